@@ -0,0 +1,21 @@
+find_path(QATZIP_INCLUDE_DIR
+  qatzip.h
+  HINTS $ENV{QATZIP_ROOT}/include)
+
+find_library(QATZIP_LIBRARIES
+  qatzip
+  HINTS $ENV{QATZIP_ROOT}/lib)
+
+find_path(QATSEQPROD_INCLUDE_DIR
+  qatseqprod.h
+  HINTS $ENV{QATSEQPROD_ROOT}/include $ENV{QATSEQPROD_ROOT}/src)
+
+find_library(QATSEQPROD_LIBRARIES
+  qatseqprod
+  HINTS $ENV{QATSEQPROD_ROOT}/lib $ENV{QATSEQPROD_ROOT}/src)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(qat DEFAULT_MSG
+  QATZIP_LIBRARIES QATZIP_INCLUDE_DIR QATSEQPROD_LIBRARIES QATSEQPROD_INCLUDE_DIR)
+
+mark_as_advanced(QATZIP_INCLUDE_DIR QATZIP_LIBRARIES QATSEQPROD_INCLUDE_DIR QATSEQPROD_LIBRARIES)
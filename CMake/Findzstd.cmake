@@ -0,0 +1,12 @@
+find_path(ZSTD_INCLUDE_DIR
+  zstd.h
+  HINTS $ENV{ZSTD_ROOT}/include)
+
+find_library(ZSTD_LIBRARIES
+  zstd
+  HINTS $ENV{ZSTD_ROOT}/lib)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(zstd DEFAULT_MSG ZSTD_LIBRARIES ZSTD_INCLUDE_DIR)
+
+mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARIES)
\ No newline at end of file
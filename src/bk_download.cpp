@@ -14,20 +14,32 @@
    limitations under the License.
 */
 #include <errno.h>
+#include <string.h>
+#include <algorithm>
 #include <list>
+#include <map>
+#include <mutex>
 #include <set>
 #include <string>
-#include <thread>
+#include <vector>
 #include <sys/file.h>
 #include "overlaybd/alog-stdstring.h"
 #include "overlaybd/alog.h"
+#include "overlaybd/iovector.h"
+#include "overlaybd/fs/cache/cache.h"
+#include "overlaybd/fs/forwardfs.h"
+#include "overlaybd/fs/gzip_file.h"
 #include "overlaybd/fs/localfs.h"
+#include "overlaybd/fs/lsmt/file.h"
+#include "overlaybd/fs/registryfs/digest.h"
+#include "overlaybd/fs/tar_file.h"
 #include "overlaybd/fs/throttled-file.h"
+#include "overlaybd/fs/zfile/zfile.h"
 #include "overlaybd/photon/thread.h"
+#include "overlaybd/photon/thread11.h"
 #include "overlaybd/photon/syncio/fd-events.h"
 #include "bk_download.h"
 #include "overlaybd/event-loop.h"
-#include <openssl/sha.h>
 #include <sys/stat.h>
 #include <unistd.h>
 using namespace FileSystem;
@@ -36,43 +48,6 @@ static constexpr size_t ALIGNMENT = 4096;
 
 namespace BKDL {
 
-std::string sha256sum(const char* fn) {
-    constexpr size_t BUFFERSIZE = 65536;
-    int fd = open(fn, O_RDONLY | O_DIRECT);
-    if (fd < 0) {
-        LOG_ERROR("failed to open `", fn);
-        return "";
-    }
-    DEFER(close(fd););
-
-    struct stat stat;
-    if (::fstat(fd, &stat) < 0) {
-        LOG_ERROR("failed to stat `", fn);
-        return "";
-    }
-    SHA256_CTX ctx = {0};
-    SHA256_Init(&ctx);
-    __attribute__((aligned(ALIGNMENT))) char buffer[65536];
-    unsigned char sha[32];
-    int recv = 0;
-    for (off_t offset = 0; offset < stat.st_size; offset += BUFFERSIZE) {
-        recv = pread(fd, &buffer, BUFFERSIZE, offset);
-        if (recv < 0) {
-            LOG_ERROR("io error: `", fn);
-            return "";
-        }
-        if (SHA256_Update(&ctx, buffer, recv) < 0) {
-            LOG_ERROR("sha256 calculate error: `", fn);
-            return "";
-        }
-    }
-    SHA256_Final(sha, &ctx);
-    char res[SHA256_DIGEST_LENGTH * 2];
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
-        sprintf(res + (i * 2), "%02x", sha[i]);
-    return "sha256:" + std::string(res, SHA256_DIGEST_LENGTH*2);
-}
-
 bool check_downloaded(const std::string &dir) {
     std::string fn = dir + "/" + COMMIT_FILE_NAME;
     auto lfs = FileSystem::new_localfs_adaptor();
@@ -87,54 +62,322 @@ bool check_downloaded(const std::string &dir) {
     return false;
 }
 
+// shared by devices on all vcpus
 static std::set<std::string> lock_files;
+static std::mutex lock_files_mtx;
+
+// the reads of the source pass through the scheduler
+class ScheduledFile : public ForwardFile {
+public:
+    ScheduledFile(IFile *file, DownloadScheduler *scheduler, int &running)
+        : ForwardFile(file), m_scheduler(scheduler), m_running(running) {
+    }
+    ssize_t pread(void *buf, size_t count, off_t offset) override {
+        m_scheduler->acquire(count, m_running);
+        return m_file->pread(buf, count, offset);
+    }
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        m_scheduler->acquire(iovector_view((struct iovec *)iov, iovcnt).sum(), m_running);
+        return m_file->preadv(iov, iovcnt, offset);
+    }
+
+private:
+    DownloadScheduler *m_scheduler;
+    int &m_running;
+};
+
+typedef std::vector<std::pair<uint64_t, uint64_t>> Ranges; // (offset, length)
+
+// the ranges of an uncompressed LSMT layer to download, widened to ALIGNMENT
+// and merged, or false for a layer of other formats, whose data the index
+// doesn't map to, e.g. zfile
+static bool lsmt_live_ranges(IFile *file, size_t size, Ranges &out) {
+    if (ZFile::is_zfile(file) == 1 || FileSystem::is_tar_file(file) == 1 ||
+        FileSystem::is_gzip_file(file) == 1)
+        return false;
+    Ranges ranges;
+    if (LSMT::live_ranges(file, ranges) < 0)
+        return false;
+    out.clear();
+    for (auto &r : ranges) {
+        uint64_t begin = r.first / ALIGNMENT * ALIGNMENT;
+        uint64_t end = std::min((r.first + r.second + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT,
+                                (uint64_t)size);
+        if (!out.empty() && begin <= out.back().first + out.back().second) {
+            out.back().second = end - out.back().first;
+            continue;
+        }
+        out.emplace_back(begin, end - begin);
+    }
+    return true;
+}
+
+// Copies a file in chunks by concurrent workers. The chunks committed are
+// recorded in a bitmap persisted to `progress`, so that a download restarted
+// skips them. The SHA-256 is computed as chunks are committed in order, those
+// committed before being read back from the local file. With `cache`, the
+// parts of the file already cached are read from it rather than from `src`.
+// Committed chunks are added to `partial` as downloaded, to be read locally.
+// With `live`, only those ranges of the file are copied, leaving holes in
+// the rest, and no SHA-256 is computed, so `src` must be verified otherwise.
+class ChunkedCopy {
+public:
+    ChunkedCopy(IFile *src, IFile *dst, IFile *progress, size_t size, size_t chunk,
+                int retry_limit, int &running, ICachedFile *cache = nullptr,
+                ISwitchFile *partial = nullptr, const Ranges *live = nullptr)
+        : m_src(src), m_dst(dst), m_progress(progress), m_cache(cache), m_partial(partial),
+          m_live(live), m_size(size), m_chunk(chunk), m_retry_limit(retry_limit),
+          m_running(running) {
+        m_nchunks = (size + chunk - 1) / chunk;
+        m_bitmap.resize((m_nchunks + 7) / 8);
+    }
+
+    // returns the digest as "sha256:<hex>", "" with `live`, or nullptr for failure
+    const char *run(int concurrency) {
+        load_progress();
+        std::vector<photon::join_handle *> workers;
+        auto owner = FileSystem::registryfs_get_io_owner();
+        for (int i = 0; i < std::max(concurrency, 1); i++) {
+            auto th = photon::thread_create11(&ChunkedCopy::worker, this, owner);
+            workers.push_back(photon::thread_enable_join(th));
+        }
+        for (auto jh : workers)
+            photon::thread_join(jh);
+        if (m_cache)
+            LOG_INFO("` bytes of ` are copied from the cache", m_cached_bytes, m_size);
+        if (m_live)
+            LOG_INFO("` bytes of ` are copied, the rest is garbage", m_live_bytes, m_size);
+        if (m_failed || m_hashed != m_nchunks) {
+            save_progress();
+            return nullptr;
+        }
+        // truncate after write, for O_DIRECT
+        m_dst->ftruncate(m_size);
+        m_digest = m_live ? "" : m_sha.final();
+        return m_digest.c_str();
+    }
+
+private:
+    struct ProgressHeader {
+        uint64_t magic;
+        uint64_t size;
+        uint64_t chunk;
+    };
+    static const uint64_t PROGRESS_MAGIC = 0x73736572676f7270; // "progress"
+    static const uint64_t SPARSE_MAGIC = 0x6c64657372617073;   // "sparsedl", with `live`
+    static const uint64_t SAVE_INTERVAL = 64;                 // in chunks
+    static const size_t CACHE_PIECE = 256 * 1024;             // the cache refill unit
+
+    IFile *m_src, *m_dst, *m_progress;
+    ICachedFile *m_cache;
+    ISwitchFile *m_partial;
+    const Ranges *m_live;
+    uint64_t m_cached_bytes = 0, m_live_bytes = 0;
+    size_t m_size, m_chunk;
+    int m_retry_limit;
+    int &m_running;
+    uint64_t m_nchunks;
+    std::vector<uint8_t> m_bitmap;
+    uint64_t m_claimed = 0, m_hashed = 0, m_unsaved = 0;
+    bool m_failed = false;
+    SHA256Stream m_sha;
+    std::string m_digest;
+    photon::condition_variable m_cv;
+
+    uint64_t magic() {
+        return m_live ? SPARSE_MAGIC : PROGRESS_MAGIC;
+    }
+
+    // calls f(offset, length) for each live range within the i-th chunk
+    template <typename F>
+    void for_each_live(uint64_t i, F f) {
+        uint64_t begin = i * m_chunk, end = std::min(begin + m_chunk, (uint64_t)m_size);
+        auto it = std::upper_bound(m_live->begin(), m_live->end(), begin,
+                                   [](uint64_t x, const std::pair<uint64_t, uint64_t> &r) {
+                                       return x < r.first + r.second;
+                                   });
+        for (; it != m_live->end() && it->first < end; ++it) {
+            auto b = std::max(it->first, begin);
+            f(b, std::min(it->first + it->second, end) - b);
+        }
+    }
+
+    bool committed(uint64_t i) {
+        return m_bitmap[i / 8] & (1 << (i % 8));
+    }
+
+    void commit(uint64_t i) {
+        m_bitmap[i / 8] |= 1 << (i % 8);
+        mark_downloaded(i);
+    }
+
+    void mark_downloaded(uint64_t i) {
+        if (!m_partial)
+            return;
+        if (!m_live) {
+            m_partial->add_downloaded(i * m_chunk, std::min(m_chunk, m_size - i * m_chunk));
+            return;
+        }
+        for_each_live(i, [&](uint64_t offset, uint64_t length) {
+            m_partial->add_downloaded(offset, length);
+        });
+    }
+
+    void load_progress() {
+        ProgressHeader hdr = {};
+        if (m_progress->pread(&hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            hdr.magic != magic() || hdr.size != m_size || hdr.chunk != m_chunk)
+            return;
+        if (m_progress->pread(m_bitmap.data(), m_bitmap.size(), sizeof(hdr)) !=
+            (ssize_t)m_bitmap.size()) {
+            memset(m_bitmap.data(), 0, m_bitmap.size());
+            return;
+        }
+        uint64_t n = 0;
+        for (uint64_t i = 0; i < m_nchunks; i++) {
+            if (committed(i)) {
+                mark_downloaded(i);
+                n++;
+            }
+        }
+        LOG_INFO("resume downloading, ` of ` chunks committed", n, m_nchunks);
+    }
+
+    // chunks are durable before being recorded as committed
+    void save_progress() {
+        m_unsaved = 0;
+        if (m_dst->fdatasync() != 0) {
+            LOG_ERRNO_RETURN(0, , "failed to sync downloading file");
+        }
+        ProgressHeader hdr = {magic(), m_size, m_chunk};
+        std::string buf((char *)&hdr, sizeof(hdr));
+        buf.append((char *)m_bitmap.data(), m_bitmap.size());
+        if (m_progress->pwrite(buf.data(), buf.size(), 0) != (ssize_t)buf.size())
+            LOG_ERRNO_RETURN(0, , "failed to save downloading progress");
+    }
 
-ssize_t filecopy(IFile *infile, IFile *outfile, size_t bs, int retry_limit, int &running) {
-    if (bs == 0)
-        LOG_ERROR_RETURN(EINVAL, -1, "bs should not be 0");
-    void *buff = nullptr;
-
-    // buffer allocate, with 4K alignment
-    ::posix_memalign(&buff, ALIGNMENT, bs);
-    if (buff == nullptr)
-        LOG_ERROR_RETURN(ENOMEM, -1, "Fail to allocate buffer with ", VALUE(bs));
-    DEFER(free(buff));
-    off_t offset = 0;
-    ssize_t count = bs;
-    while (count == (ssize_t)bs) {
-        if (running != 1) {
-            LOG_INFO("image file exit when background downloading");
-            return -1;
+    // reads a range from the source, the runs of pieces cached from the cache
+    ssize_t fetch(char *buff, size_t len, off_t offset) {
+        if (!m_cache)
+            return m_src->pread(buff, len, offset);
+        auto in_cache = [&](size_t pos, size_t n) {
+            return m_cache->query(offset + pos, n) == 0;
+        };
+        size_t done = 0;
+        while (done < len) {
+            size_t n = std::min(CACHE_PIECE - (offset + done) % CACHE_PIECE, len - done);
+            bool cached = in_cache(done, n);
+            while (done + n < len) {
+                auto m = std::min(CACHE_PIECE, len - done - n);
+                if (in_cache(done + n, m) != cached)
+                    break;
+                n += m;
+            }
+            IFile *from = cached ? (IFile *)m_cache : m_src;
+            if (from->pread(buff + done, n, offset + done) != (ssize_t)n)
+                return -1;
+            if (cached)
+                m_cached_bytes += n;
+            done += n;
         }
+        return len;
+    }
+
+    ssize_t copy_chunk(void *buff, uint64_t i) {
+        if (!m_live)
+            return copy_range(buff, i * m_chunk, std::min(m_chunk, m_size - i * m_chunk),
+                              committed(i));
+        // nothing to hash, so a chunk committed is not read back
+        if (committed(i))
+            return 0;
+        ssize_t ret = 0;
+        for_each_live(i, [&](uint64_t offset, uint64_t length) {
+            if (ret < 0)
+                return;
+            auto n = copy_range((char *)buff + offset - i * m_chunk, offset, length, false);
+            ret = n < 0 ? n : ret + n;
+        });
+        if (ret > 0)
+            m_live_bytes += ret;
+        return ret;
+    }
 
-        int retry = retry_limit;
+    ssize_t copy_range(void *buff, off_t offset, size_t len, bool local) {
+        IFile *from = local ? m_dst : m_src;
+        int retry = m_retry_limit;
     again_read:
         if (!(retry--))
-            LOG_ERROR_RETURN(EIO, -1, "Fail to read at ", VALUE(offset), VALUE(count));
-        auto rlen = infile->pread(buff, bs, offset);
-        if (rlen < 0) {
-            LOG_DEBUG("Fail to read at ", VALUE(offset), VALUE(count), " retry...");
+            LOG_ERROR_RETURN(EIO, -1, "Fail to read at ", VALUE(offset), VALUE(len));
+        auto rlen = from == m_dst ? from->pread(buff, len, offset) : fetch((char *)buff, len, offset);
+        if (rlen != (ssize_t)len) {
+            LOG_DEBUG("Fail to read at ", VALUE(offset), VALUE(len), " retry...");
             goto again_read;
         }
-        retry = retry_limit;
+        if (from == m_dst)
+            return rlen;
+        retry = m_retry_limit;
     again_write:
         if (!(retry--))
-            LOG_ERROR_RETURN(EIO, -1, "Fail to write at ", VALUE(offset), VALUE(count));
+            LOG_ERROR_RETURN(EIO, -1, "Fail to write at ", VALUE(offset), VALUE(len));
         // cause it might write into file with O_DIRECT
-        // keep write length as bs
-        auto wlen = outfile->pwrite(buff, bs, offset);
+        // keep write length aligned
+        auto wlen = m_dst->pwrite(buff, (len + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT, offset);
         // but once write lenth larger than read length treats as OK
         if (wlen < rlen) {
-            LOG_DEBUG("Fail to write at ", VALUE(offset), VALUE(count), " retry...");
+            LOG_DEBUG("Fail to write at ", VALUE(offset), VALUE(len), " retry...");
             goto again_write;
         }
-        count = rlen;
-        offset += count;
+        return rlen;
     }
-    // truncate after write, for O_DIRECT
-    outfile->ftruncate(offset);
-    return offset;
-}
+
+    int worker(FileSystem::RegistryIOOwner *owner) {
+        FileSystem::registryfs_set_io_owner(owner);
+        void *buff = nullptr;
+        // buffer allocate, with 4K alignment
+        ::posix_memalign(&buff, ALIGNMENT, m_chunk);
+        if (buff == nullptr) {
+            m_failed = true;
+            m_cv.notify_all();
+            LOG_ERROR_RETURN(ENOMEM, -1, "Fail to allocate buffer with ", VALUE(m_chunk));
+        }
+        DEFER(free(buff));
+        while (!m_failed && m_claimed < m_nchunks) {
+            if (m_running != 1) {
+                LOG_INFO("image file exit when background downloading");
+                m_failed = true;
+                break;
+            }
+            auto i = m_claimed++;
+            bool resumed = committed(i);
+            auto len = copy_chunk(buff, i);
+            if (len < 0) {
+                m_failed = true;
+                break;
+            }
+            if (m_live) {
+                // nothing to hash, in order or not
+                m_hashed++;
+            } else {
+                // hashed in order
+                while (m_hashed != i && !m_failed)
+                    m_cv.wait_no_lock();
+                if (m_failed)
+                    break;
+                // the other workers go on copying while it is hashed
+                m_sha.update(buff, len);
+                m_hashed++;
+                m_cv.notify_all();
+            }
+            if (!resumed) {
+                commit(i);
+                if (++m_unsaved >= SAVE_INTERVAL)
+                    save_progress();
+            }
+        }
+        m_cv.notify_all();
+        return 0;
+    }
+};
 
 void BkDownload::switch_to_local_file() {
     std::string path = dir + "/" + COMMIT_FILE_NAME;
@@ -154,17 +397,14 @@ bool BkDownload::download_done() {
     old_name = dir + "/" + DOWNLOAD_TMP_NAME;
     new_name = dir + "/" + COMMIT_FILE_NAME;
 
-    // verify sha256
-    auto th = photon::CURRENT;
-    std::string shares;
-    std::thread sha256_thread([&, th](){
-        shares = sha256sum(old_name.c_str());
-        photon::safe_thread_interrupt(th, EINTR, 0);
-    });
-    sha256_thread.detach();
-    photon::thread_usleep(-1UL);
-    if (shares != digest) {
-        LOG_ERROR("verify checksum ` failed (expect: `, got: `)", old_name, digest, shares);
+    // verify sha256, computed while downloading, unless verified as read
+    if (!downloaded_sparse && downloaded_digest != digest) {
+        LOG_ERROR("verify checksum ` failed (expect: `, got: `)", old_name, digest,
+                  downloaded_digest);
+        // start over next time
+        sw_file->set_partial_file(nullptr);
+        lfs->unlink(old_name.c_str());
+        lfs->unlink((dir + "/" + PROGRESS_FILE_NAME).c_str());
         return false;
     }
 
@@ -173,17 +413,18 @@ bool BkDownload::download_done() {
         LOG_ERROR("rename(`,`), `:`", old_name, new_name, errno, strerror(errno));
         return false;
     }
+    lfs->unlink((dir + "/" + PROGRESS_FILE_NAME).c_str());
     LOG_INFO("download done. rename(`,`) success", old_name, new_name);
     return true;
 }
 
-bool BkDownload::download(int &running) {
+bool BkDownload::download(int &running, DownloadScheduler *scheduler) {
     if (check_downloaded(dir)) {
         switch_to_local_file();
         return true;
     }
 
-    if (download_blob(running)) {
+    if (download_blob(running, scheduler)) {
         if (!download_done())
             return false;
         switch_to_local_file();
@@ -193,6 +434,7 @@ bool BkDownload::download(int &running) {
 }
 
 bool BkDownload::lock_file() {
+    std::lock_guard<std::mutex> lock(lock_files_mtx);
     if (lock_files.find(dir) != lock_files.end()) {
         LOG_WARN("failded to lock download path:`", dir);
         return false;
@@ -202,10 +444,11 @@ bool BkDownload::lock_file() {
 }
 
 void BkDownload::unlock_file() {
+    std::lock_guard<std::mutex> lock(lock_files_mtx);
     lock_files.erase(dir);
 }
 
-bool BkDownload::download_blob(int &running) {
+bool BkDownload::download_blob(int &running, DownloadScheduler *scheduler) {
     std::string dl_file_path = dir + "/" + DOWNLOAD_TMP_NAME;
     try_cnt--;
     FileSystem::IFile *src = src_file;
@@ -220,71 +463,165 @@ bool BkDownload::download_blob(int &running) {
         if (limit_MB_ps > 0)
             delete src;
     });
+    ScheduledFile scheduled(src, scheduler, running);
+    if (scheduler)
+        src = &scheduled;
 
+    struct stat st = {};
+    if (src_file->fstat(&st) != 0) {
+        LOG_ERRNO_RETURN(0, false, "failed to stat src file of `", dir);
+    }
     auto dst = FileSystem::open_localfile_adaptor(dl_file_path.c_str(), O_RDWR | O_CREAT, 0644);
     if (dst == nullptr) {
-        LOG_ERRNO_RETURN(0, -1, "failed to open dst file `", dl_file_path.c_str());
+        LOG_ERRNO_RETURN(0, false, "failed to open dst file `", dl_file_path.c_str());
     }
     DEFER(delete dst;);
-
-    auto res = filecopy(src, dst, 1024UL * 1024, 1, running);
-    if (res < 0)
+    std::string progress_path = dir + "/" + PROGRESS_FILE_NAME;
+    auto progress = FileSystem::open_localfile_adaptor(progress_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (progress == nullptr) {
+        LOG_ERRNO_RETURN(0, false, "failed to open progress file `", progress_path.c_str());
+    }
+    DEFER(delete progress;);
+    // failing to read locally while downloading is harmless
+    sw_file->set_partial_file(dl_file_path.c_str());
+
+    // the index is read through the cache, which has the tail of the layer
+    Ranges live;
+    downloaded_sparse = sparse && lsmt_live_ranges(cached_file ? (IFile *)cached_file : src_file,
+                                                   st.st_size, live);
+    if (sparse && !downloaded_sparse)
+        LOG_INFO("download ` in whole, not an uncompressed LSMT layer", dir);
+    ChunkedCopy copy(src, dst, progress, st.st_size, 1024UL * 1024, 1, running, cached_file,
+                     sw_file, downloaded_sparse ? &live : nullptr);
+    auto sha = copy.run(concurrency);
+    if (!sha)
         return false;
+    downloaded_digest = sha;
     return true;
 }
 
-void bk_download_proc(std::list<BKDL::BkDownload *> &dl_list, uint64_t delay_sec, int &running) {
-    LOG_INFO("BACKGROUND DOWNLOAD THREAD STARTED.");
-    uint64_t time_st = photon::now;
-    while (photon::now - time_st < delay_sec * 1000000) {
-        photon::thread_usleep(200 * 1000);
-        if (running != 1)
-            break;
-    }
+// the budget of all the schedulers, across vcpus
+static std::mutex budget_mtx;
+static uint64_t budget_next = 0; // the time the budget is available from
+
+DownloadScheduler::~DownloadScheduler() {
+    m_stopped = true;
+    m_cv.notify_all();
+    if (m_worker)
+        photon::thread_join(m_worker);
+    for (auto &item : m_queue)
+        delete item.dl;
+}
 
-    while (!dl_list.empty()) {
-        if (running != 1) {
-            LOG_WARN("image exited, background download exit...");
-            break;
+void DownloadScheduler::add(std::list<BkDownload *> &items, uint64_t delay_sec, int &running,
+                            FileSystem::RegistryIOOwner *owner) {
+    uint64_t start = photon::now + delay_sec * 1000000;
+    for (auto dl : items)
+        m_queue.push_back({dl, &running, owner, start});
+    items.clear();
+    if (m_worker == nullptr)
+        m_worker = photon::thread_enable_join(
+            photon::thread_create11(&DownloadScheduler::worker, this));
+    m_cv.notify_all();
+}
+
+void DownloadScheduler::remove(int &running) {
+    for (auto it = m_queue.begin(); it != m_queue.end();) {
+        if (it->running == &running) {
+            delete it->dl;
+            it = m_queue.erase(it);
+        } else {
+            ++it;
         }
-        photon::thread_usleep(200 * 1000);
+    }
+    while (m_active == &running)
+        m_cv.wait_no_lock(200 * 1000);
+}
 
-        BKDL::BkDownload *dl_item = dl_list.front();
-        dl_list.pop_front();
+void DownloadScheduler::on_read(uint64_t latency_us) {
+    if (photon::now - m_fg_time >= FG_IDLE_US)
+        m_fg_latency = latency_us;
+    else
+        m_fg_latency = (m_fg_latency * 7 + latency_us) / 8;
+    m_fg_time = photon::now;
+}
+
+bool DownloadScheduler::degraded() {
+    return m_pause_latency_us > 0 && m_fg_latency > m_pause_latency_us &&
+           photon::now - m_fg_time < FG_IDLE_US;
+}
+
+void DownloadScheduler::acquire(size_t bytes, int &running) {
+    while (degraded() && running == 1 && !m_stopped)
+        photon::thread_usleep(100 * 1000);
+    if (m_total_MB_ps == 0)
+        return;
+    uint64_t cost = bytes * 1000000UL / (m_total_MB_ps * 1024 * 1024);
+    uint64_t start;
+    {
+        std::lock_guard<std::mutex> lock(budget_mtx);
+        start = std::max(budget_next, photon::now);
+        budget_next = start + cost;
+    }
+    while (photon::now < start && running == 1 && !m_stopped)
+        photon::thread_usleep(std::min(start - photon::now, 200 * 1000UL));
+}
+
+// the first item due, of the layer queued by the most devices
+std::list<DownloadScheduler::Item>::iterator DownloadScheduler::pick() {
+    std::map<std::string, int> shares;
+    for (auto &item : m_queue)
+        shares[item.dl->dir]++;
+    auto best = m_queue.end();
+    for (auto it = m_queue.begin(); it != m_queue.end(); ++it) {
+        if (it->start > photon::now || *it->running != 1)
+            continue;
+        if (best == m_queue.end() || shares[it->dl->dir] > shares[best->dl->dir])
+            best = it;
+    }
+    return best;
+}
+
+void DownloadScheduler::worker() {
+    LOG_INFO("BACKGROUND DOWNLOAD THREAD STARTED.");
+    while (!m_stopped) {
+        auto it = pick();
+        if (it == m_queue.end()) {
+            m_cv.wait_no_lock(200 * 1000);
+            continue;
+        }
+        Item item = *it;
+        m_queue.erase(it);
+        BkDownload *dl_item = item.dl;
 
         LOG_INFO("start downloading for dir `", dl_item->dir);
 
         if (!dl_item->lock_file()) {
-            dl_list.push_back(dl_item);
+            // being downloaded by a device on another vcpu
+            item.start = photon::now + 1000 * 1000;
+            m_queue.push_back(item);
             continue;
         }
 
-        bool succ = dl_item->download(running);
+        m_active = item.running;
+        FileSystem::registryfs_set_io_owner(item.owner);
+        bool succ = dl_item->download(*item.running, this);
         dl_item->unlock_file();
 
-        if (running != 1) {
-            LOG_WARN("image exited, background download exit...");
+        if (*item.running != 1) {
+            LOG_WARN("image exited, background download of ` exit...", dl_item->dir);
             delete dl_item;
-            break;
-        }
-
-        if (!succ && dl_item->try_cnt > 0) {
-            dl_list.push_back(dl_item);
+        } else if (!succ && dl_item->try_cnt > 0) {
+            m_queue.push_back(item);
             LOG_WARN("download failed, push back to download queue and retry `", dl_item->dir);
-            continue;
-        }
-        LOG_DEBUG("finish downloading or no retry any more: `, retry_cnt: `", dl_item->dir,
-                 dl_item->try_cnt);
-        delete dl_item;
-    }
-
-    if (!dl_list.empty()) {
-        LOG_INFO("DOWNLOAD THREAD EXITED in advance, delete dl_list.");
-        while (!dl_list.empty()) {
-            BKDL::BkDownload *dl_item = dl_list.front();
-            dl_list.pop_front();
+        } else {
+            LOG_DEBUG("finish downloading or no retry any more: `, retry_cnt: `", dl_item->dir,
+                      dl_item->try_cnt);
             delete dl_item;
         }
+        m_active = nullptr;
+        m_cv.notify_all();
+        photon::thread_usleep(200 * 1000);
     }
     LOG_DEBUG("BACKGROUND DOWNLOAD THREAD EXIT.");
 }
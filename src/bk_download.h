@@ -17,23 +17,32 @@
 #include <list>
 #include <string>
 #include "overlaybd/fs/filesystem.h"
+#include "overlaybd/fs/registryfs/registryfs.h"
+#include "overlaybd/photon/thread.h"
 #include "switch_file.h"
 
 class ImageFile;
 
+namespace FileSystem {
+class ICachedFile;
+}
+
 namespace BKDL {
 
 static std::string DOWNLOAD_TMP_NAME = "overlaybd.download";
 static std::string COMMIT_FILE_NAME = "overlaybd.commit";
+static std::string PROGRESS_FILE_NAME = "overlaybd.download.progress";
 
 bool check_downloaded(const std::string &dir);
 
+class DownloadScheduler;
+
 class BkDownload {
 public:
     std::string dir;
     uint32_t try_cnt;
 
-    bool download(int &running);
+    bool download(int &running, DownloadScheduler *scheduler = nullptr);
     bool lock_file();
     void unlock_file();
 
@@ -43,14 +52,17 @@ public:
         delete src_file;
     }
     BkDownload(FileSystem::ISwitchFile *sw_file, FileSystem::IFile *src_file, const std::string dir,
-               int32_t limit_MB_ps, int32_t try_cnt, ImageFile *image_file, std::string digest)
+               int32_t limit_MB_ps, int32_t try_cnt, ImageFile *image_file, std::string digest,
+               int32_t concurrency = 1, FileSystem::ICachedFile *cached_file = nullptr,
+               bool sparse = false)
         : sw_file(sw_file), src_file(src_file), dir(dir), limit_MB_ps(limit_MB_ps),
-          try_cnt(try_cnt), image_file(image_file), digest(digest) {
+          try_cnt(try_cnt), image_file(image_file), digest(digest), concurrency(concurrency),
+          cached_file(cached_file), sparse(sparse) {
     }
 
 private:
     void switch_to_local_file();
-    bool download_blob(int &running);
+    bool download_blob(int &running, DownloadScheduler *scheduler);
     bool download_done();
 
     FileSystem::ISwitchFile *sw_file = nullptr;
@@ -58,8 +70,66 @@ private:
     int32_t limit_MB_ps;
     ImageFile *image_file;
     std::string digest;
+    int32_t concurrency;
+    // the cached file of the layer, owned by `sw_file`, whose cached ranges are copied locally
+    FileSystem::ICachedFile *cached_file = nullptr;
+    // only the live ranges of an uncompressed LSMT layer are downloaded, from
+    // `src_file` verified as it's read, e.g. by a merkle tree, as the digest of
+    // the layer can't be computed then; other layers are downloaded in whole
+    bool sparse = false;
+    std::string downloaded_digest;
+    bool downloaded_sparse = false;
 };
 
-void bk_download_proc(std::list<BKDL::BkDownload *> &, uint64_t, int &);
+// Downloads the layers of all the devices on a vcpu, one at a time, those
+// shared by more devices first, each finished once for all of them. Reads
+// from the source take their share of a budget of `total_MB_ps` for the
+// whole node, across vcpus, and are held back while the foreground reads
+// take more than `pause_latency_us` on average.
+class DownloadScheduler {
+public:
+    DownloadScheduler(uint64_t total_MB_ps, uint64_t pause_latency_us)
+        : m_total_MB_ps(total_MB_ps), m_pause_latency_us(pause_latency_us) {
+    }
+    ~DownloadScheduler();
+
+    // takes the items, downloaded `delay_sec` later, as long as `running` is 1
+    void add(std::list<BkDownload *> &items, uint64_t delay_sec, int &running,
+             FileSystem::RegistryIOOwner *owner);
+    // drops the items added with `running`, waiting for the one downloading
+    void remove(int &running);
+
+    // changes the limits given at construction, for the downloads going on
+    void set_limits(uint64_t total_MB_ps, uint64_t pause_latency_us) {
+        m_total_MB_ps = total_MB_ps;
+        m_pause_latency_us = pause_latency_us;
+    }
+
+    // records the latency of a foreground read
+    void on_read(uint64_t latency_us);
+    // waits until `bytes` can be read from the source, or `running` is not 1
+    void acquire(size_t bytes, int &running);
+
+private:
+    struct Item {
+        BkDownload *dl;
+        int *running;
+        FileSystem::RegistryIOOwner *owner;
+        uint64_t start; // not downloaded before this time
+    };
+    static const uint64_t FG_IDLE_US = 1000UL * 1000; // latency of older reads is ignored
+
+    uint64_t m_total_MB_ps, m_pause_latency_us;
+    std::list<Item> m_queue;
+    int *m_active = nullptr; // `running` of the item downloading
+    photon::join_handle *m_worker = nullptr;
+    bool m_stopped = false;
+    photon::condition_variable m_cv;
+    uint64_t m_fg_latency = 0, m_fg_time = 0;
+
+    void worker();
+    bool degraded();
+    std::list<Item>::iterator pick();
+};
 
 } // namespace BKDL
\ No newline at end of file
@@ -29,6 +29,9 @@ struct LayerConfig : public ConfigUtils::Config {
     APPCFG_PARA(dir, std::string, "");
     APPCFG_PARA(digest, std::string, "");
     APPCFG_PARA(size, uint64_t, 0);
+    APPCFG_PARA(merkleTree, std::string, "");
+    APPCFG_PARA(merkleRoot, std::string, "");
+    APPCFG_PARA(cachePinned, bool, false);
 };
 
 struct UpperConfig : public ConfigUtils::Config {
@@ -36,6 +39,9 @@ struct UpperConfig : public ConfigUtils::Config {
 
     APPCFG_PARA(index, std::string, "");
     APPCFG_PARA(data, std::string, "");
+    APPCFG_PARA(zeroDetect, bool, false);
+    APPCFG_PARA(dedupBlocks, uint32_t, 0);
+    APPCFG_PARA(writeCacheMB, uint32_t, 0);
 };
 
 struct DownloadConfig : public ConfigUtils::Config {
@@ -46,6 +52,56 @@ struct DownloadConfig : public ConfigUtils::Config {
     APPCFG_PARA(delayExtra, int, 30);
     APPCFG_PARA(maxMBps, int, 100);
     APPCFG_PARA(tryCnt, int, 5);
+    APPCFG_PARA(concurrency, int, 4);
+    APPCFG_PARA(sparse, bool, false);
+};
+
+struct CompactionConfig : public ConfigUtils::Config {
+    APPCFG_CLASS;
+
+    APPCFG_PARA(enable, bool, false);
+    APPCFG_PARA(interval, int, 3600);
+    APPCFG_PARA(garbageRatio, int, 50);
+    APPCFG_PARA(minGarbageMB, int, 1024);
+    APPCFG_PARA(maxMBps, int, 50);
+};
+
+struct ThrottleConfig : public ConfigUtils::Config {
+    APPCFG_CLASS;
+
+    APPCFG_PARA(IOPS, uint32_t, 0);
+    APPCFG_PARA(MBps, uint32_t, 0);
+    APPCFG_PARA(burstSec, uint32_t, 1);
+    APPCFG_PARA(maxIOPS, uint32_t, 0);
+    APPCFG_PARA(maxMBps, uint32_t, 0);
+    APPCFG_PARA(maxConcurrentOps, uint32_t, 0);
+    APPCFG_PARA(targetLatencyUs, uint32_t, 0);
+};
+
+struct MirrorConfig : public ConfigUtils::Config {
+    APPCFG_CLASS;
+
+    APPCFG_PARA(registry, std::string, "");
+    APPCFG_PARA(endpoints, std::vector<std::string>);
+};
+
+struct RegistryEmulatorConfig : public ConfigUtils::Config {
+    APPCFG_CLASS;
+
+    APPCFG_PARA(blobDir, std::string, "");
+    APPCFG_PARA(rttMedianUs, uint32_t, 0);
+    APPCFG_PARA(rttP99Us, uint32_t, 0);
+    APPCFG_PARA(connectionMBps, uint32_t, 0);
+    APPCFG_PARA(errorPPM, uint32_t, 0);
+    APPCFG_PARA(maxConnections, uint32_t, 0);
+    APPCFG_PARA(seed, uint64_t, 1);
+};
+
+struct CacheQuotaConfig : public ConfigUtils::Config {
+    APPCFG_CLASS;
+
+    APPCFG_PARA(group, std::string, "");
+    APPCFG_PARA(sizeGB, uint32_t, 0);
 };
 
 struct ImageConfig : public ConfigUtils::Config {
@@ -57,7 +113,25 @@ struct ImageConfig : public ConfigUtils::Config {
     APPCFG_PARA(resultFile, std::string, "");
     APPCFG_PARA(download, DownloadConfig);
     APPCFG_PARA(accelerationLayer, bool, false);
+    APPCFG_PARA(accelerationData, bool, false);
     APPCFG_PARA(recordTracePath, std::string, "");
+    APPCFG_PARA(prefetchHintPath, std::string, "");
+    APPCFG_PARA(readaheadMaxKB, uint32_t, 0);
+    APPCFG_PARA(heatmapPath, std::string, "");
+    APPCFG_PARA(heatmapStartupSec, uint32_t, 60);
+    APPCFG_PARA(metadataFirst, bool, false);
+    APPCFG_PARA(mergeReads, bool, false);
+    APPCFG_PARA(promotionDir, std::string, "");
+    APPCFG_PARA(promotionReads, uint32_t, 2);
+    APPCFG_PARA(promotionMaxMB, uint32_t, 1024);
+    APPCFG_PARA(ioWeight, uint32_t, 1);
+    APPCFG_PARA(numaNode, int, -1);
+    APPCFG_PARA(mergedIndex, std::string, "");
+    APPCFG_PARA(throttle, ThrottleConfig);
+    APPCFG_PARA(cacheMode, std::string, "compressed");
+    APPCFG_PARA(hybridCacheMB, uint32_t, 64);
+    APPCFG_PARA(cacheGroup, std::string, "");
+    APPCFG_PARA(cacheQuotaGB, uint32_t, 0);
 };
 
 struct GlobalConfig : public ConfigUtils::Config {
@@ -69,9 +143,72 @@ struct GlobalConfig : public ConfigUtils::Config {
     APPCFG_PARA(ioEngine, uint32_t, 0);
     APPCFG_PARA(logLevel, uint32_t, 1);
     APPCFG_PARA(logPath, std::string, "/var/log/overlaybd.log");
+    APPCFG_PARA(logAsyncRingKB, uint32_t, 0);
     APPCFG_PARA(download, DownloadConfig);
+    APPCFG_PARA(compaction, CompactionConfig);
     APPCFG_PARA(enableAudit, bool, true);
     APPCFG_PARA(auditPath, std::string, "/var/log/overlaybd-audit.log");
+    APPCFG_PARA(auditRingPath, std::string, "");
+    APPCFG_PARA(auditRingRecords, uint32_t, 1024 * 1024);
+    APPCFG_PARA(vcpuNum, uint32_t, 1);
+    APPCFG_PARA(numaAware, bool, false);
+    APPCFG_PARA(deviceVcpus, uint32_t, 1);
+    APPCFG_PARA(zfileBlockCacheKB, uint32_t, 0);
+    APPCFG_PARA(zfileReadaheadKB, uint32_t, 1024);
+    APPCFG_PARA(zfileDecompressThreads, uint32_t, 0);
+    APPCFG_PARA(zfileLazyJumpTable, bool, true);
+    APPCFG_PARA(zfileVerifyOnce, bool, true);
+    APPCFG_PARA(zfileRefillLookahead, int, 0);
+    APPCFG_PARA(registryChunkKB, uint32_t, 256);
+    APPCFG_PARA(registryOpenTailKB, uint32_t, 1024);
+    APPCFG_PARA(registryParallelism, uint32_t, 4);
+    APPCFG_PARA(registryHTTP2, bool, false);
+    APPCFG_PARA(registryNativeGet, bool, false);
+    APPCFG_PARA(registryFetchMinKB, uint32_t, 256);
+    APPCFG_PARA(registryFetchMaxKB, uint32_t, 0);
+    APPCFG_PARA(registryCoalesceGapKB, uint32_t, 64);
+    APPCFG_PARA(registryCoalesceMaxKB, uint32_t, 1024);
+    APPCFG_PARA(registryCoalesceInflight, uint32_t, 4);
+    APPCFG_PARA(registryHedgePercentile, uint32_t, 95);
+    APPCFG_PARA(registryMirrors, std::vector<MirrorConfig>);
+    APPCFG_PARA(registryEmulator, RegistryEmulatorConfig);
+    APPCFG_PARA(registryAuthCacheFile, std::string, "");
+    APPCFG_PARA(registryMaxConcurrentGets, uint32_t, 32);
+    APPCFG_PARA(registryMemCacheSizeMB, uint32_t, 0);
+    APPCFG_PARA(registryMemCachePromoteHits, uint32_t, 2);
+    APPCFG_PARA(registryCachePolicy, std::string, "lru");
+    APPCFG_PARA(registryCacheEvictUnits, bool, false);
+    APPCFG_PARA(registryCacheAsyncRefill, bool, false);
+    APPCFG_PARA(registryCacheByDigest, bool, false);
+    APPCFG_PARA(registryCacheEvictRateMB, uint32_t, 0);
+    APPCFG_PARA(registryCacheAdmitHits, uint32_t, 0);
+    APPCFG_PARA(registryCacheMmap, bool, false);
+    APPCFG_PARA(registryCacheDirectIO, bool, false);
+    APPCFG_PARA(registryCacheQuotas, std::vector<CacheQuotaConfig>);
+    APPCFG_PARA(registryCachePinned, std::vector<std::string>);
+    APPCFG_PARA(refillHugePageMB, uint32_t, 0);
+    APPCFG_PARA(registryFastCacheDir, std::string, "");
+    APPCFG_PARA(registryFastCacheSizeGB, uint32_t, 0);
+    APPCFG_PARA(registryFastCachePromoteHits, uint32_t, 2);
+    APPCFG_PARA(prefetchLeadWindowMs, uint32_t, 0);
+    APPCFG_PARA(prefetchMinRunPercent, uint32_t, 0);
+    APPCFG_PARA(downloadTotalMBps, uint32_t, 0);
+    APPCFG_PARA(downloadPauseLatencyMs, uint32_t, 100);
+    APPCFG_PARA(hashThreads, uint32_t, 2);
+    APPCFG_PARA(p2pPeers, std::vector<std::string>);
+    APPCFG_PARA(p2pPort, uint32_t, 0);
+    APPCFG_PARA(p2pMaxTries, uint32_t, 2);
+    APPCFG_PARA(p2pTimeoutMs, uint32_t, 1000);
+    APPCFG_PARA(p2pToken, std::string, "");
+    APPCFG_PARA(threadStatsIntervalSec, uint32_t, 0);
+    APPCFG_PARA(metricsPort, uint32_t, 0);
+    APPCFG_PARA(traceSlowReadMs, uint32_t, 0);
+    APPCFG_PARA(lazyIndexLoad, bool, false);
+    APPCFG_PARA(indexGroupCommitKB, uint32_t, 0);
+    APPCFG_PARA(mmapIndex, bool, false);
+    APPCFG_PARA(mergeUpperIndex, bool, false);
+    APPCFG_PARA(memoryBudgetMB, uint32_t, 0);
+    APPCFG_PARA(throttle, ThrottleConfig);
 };
 
 struct AuthConfig : public ConfigUtils::Config {
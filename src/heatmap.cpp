@@ -0,0 +1,149 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "heatmap.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "overlaybd/alog.h"
+#include "overlaybd/alog-stdstring.h"
+#include "overlaybd/fs/filesystem.h"
+#include "overlaybd/fs/localfs.h"
+#include "overlaybd/photon/thread.h"
+
+namespace Heatmap {
+
+// buckets beyond are not counted, i.e. 4TB of data of a layer
+static const uint64_t MAX_BUCKETS = 1UL << 22;
+
+// the file: the header, then for each layer its header and the counts of its
+// buckets, of the startup and of the steady state by turns
+struct FileHeader {
+    char magic[8] = "OBDHEAT";
+    uint32_t version = 1;
+    uint32_t bucket_shift = BUCKET_SHIFT;
+    uint64_t nlayers = 0;
+    uint64_t uptime_us = 0;
+    uint64_t startup_us = 0;
+};
+
+struct LayerHeader {
+    char name[256] = {};
+    uint64_t reads[PHASES] = {};
+    uint64_t bytes[PHASES] = {};
+    uint64_t nbuckets = 0;
+};
+
+ImageHeatmap::ImageHeatmap(const std::vector<std::string> &names, uint64_t startup_us)
+    : m_layers(names.size()), m_start(photon::now), m_startup_us(startup_us) {
+    for (size_t i = 0; i < names.size(); i++)
+        m_layers[i].name = names[i];
+}
+
+void ImageHeatmap::on_read(size_t layer, uint64_t offset, uint64_t length) {
+    if (layer >= m_layers.size() || length == 0)
+        return;
+    int phase = photon::now - m_start < m_startup_us ? STARTUP : STEADY;
+    auto &l = m_layers[layer];
+    l.reads[phase]++;
+    l.bytes[phase] += length;
+    uint64_t begin = offset >> BUCKET_SHIFT;
+    uint64_t end = std::min((offset + length - 1) >> BUCKET_SHIFT, MAX_BUCKETS - 1) + 1;
+    auto &buckets = l.buckets[phase];
+    if (begin >= end)
+        return;
+    if (buckets.size() < end)
+        buckets.resize(end);
+    for (auto i = begin; i < end; i++)
+        if (buckets[i] != UINT32_MAX)
+            buckets[i]++;
+}
+
+int ImageHeatmap::save(const std::string &path) const {
+    std::string buf;
+    FileHeader h;
+    h.nlayers = m_layers.size();
+    h.uptime_us = photon::now - m_start;
+    h.startup_us = m_startup_us;
+    buf.append((char *)&h, sizeof(h));
+    for (auto &l : m_layers) {
+        LayerHeader lh;
+        strncpy(lh.name, l.name.c_str(), sizeof(lh.name) - 1);
+        memcpy(lh.reads, l.reads, sizeof(lh.reads));
+        memcpy(lh.bytes, l.bytes, sizeof(lh.bytes));
+        lh.nbuckets = std::max(l.buckets[STARTUP].size(), l.buckets[STEADY].size());
+        buf.append((char *)&lh, sizeof(lh));
+        for (uint64_t i = 0; i < lh.nbuckets; i++) {
+            for (int p = 0; p < PHASES; p++) {
+                uint32_t n = i < l.buckets[p].size() ? l.buckets[p][i] : 0;
+                buf.append((char *)&n, sizeof(n));
+            }
+        }
+    }
+    auto tmp = path + ".tmp";
+    std::unique_ptr<FileSystem::IFile> file(FileSystem::open_localfile_adaptor(
+        tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644, 0));
+    if (!file || file->pwrite(buf.data(), buf.size(), 0) != (ssize_t)buf.size() ||
+        ::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        LOG_ERRNO_RETURN(0, -1, "failed to save heatmap in `", path);
+    }
+    return 0;
+}
+
+int load_heatmap(const std::string &path, std::vector<LayerHeat> *layers, uint64_t *uptime_us,
+                 uint64_t *startup_us) {
+    std::unique_ptr<FileSystem::IFile> file(
+        FileSystem::open_localfile_adaptor(path.c_str(), O_RDONLY, 0644, 0));
+    if (!file)
+        LOG_ERRNO_RETURN(0, -1, "failed to open heatmap `", path);
+    FileHeader h;
+    off_t offset = 0;
+    if (file->pread(&h, sizeof(h), offset) != sizeof(h) ||
+        memcmp(h.magic, FileHeader().magic, sizeof(h.magic)) != 0 || h.version != 1 ||
+        h.bucket_shift != BUCKET_SHIFT)
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid heatmap `", path);
+    offset += sizeof(h);
+    *uptime_us = h.uptime_us;
+    *startup_us = h.startup_us;
+    layers->clear();
+    layers->resize(h.nlayers);
+    for (auto &l : *layers) {
+        LayerHeader lh;
+        if (file->pread(&lh, sizeof(lh), offset) != sizeof(lh) || lh.nbuckets > MAX_BUCKETS)
+            LOG_ERROR_RETURN(EINVAL, -1, "truncated heatmap `", path);
+        offset += sizeof(lh);
+        lh.name[sizeof(lh.name) - 1] = 0;
+        l.name = lh.name;
+        memcpy(l.reads, lh.reads, sizeof(l.reads));
+        memcpy(l.bytes, lh.bytes, sizeof(l.bytes));
+        std::vector<uint32_t> counts(lh.nbuckets * PHASES);
+        ssize_t len = counts.size() * sizeof(uint32_t);
+        if (len && file->pread(&counts[0], len, offset) != len)
+            LOG_ERROR_RETURN(EINVAL, -1, "truncated heatmap `", path);
+        offset += len;
+        for (int p = 0; p < PHASES; p++) {
+            l.buckets[p].resize(lh.nbuckets);
+            for (uint64_t i = 0; i < lh.nbuckets; i++)
+                l.buckets[p][i] = counts[i * PHASES + p];
+        }
+    }
+    return 0;
+}
+
+} // namespace Heatmap
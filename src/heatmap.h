@@ -0,0 +1,64 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// A coarse heatmap of the reads of the layers of an image, counting the
+// reads of the data of each layer in buckets of BUCKET_SIZE, apart for the
+// startup of the image and the steady state after it, so as to see which
+// layers, and which regions of them, the reads of the image go to. It's fed
+// by the read observer of the LSMT file of the image, and saved in a file
+// that overlaybd-info prints.
+namespace Heatmap {
+
+static const uint32_t BUCKET_SHIFT = 20; // 1MB
+static const uint64_t BUCKET_SIZE = 1UL << BUCKET_SHIFT;
+
+enum Phase { STARTUP = 0, STEADY = 1, PHASES = 2 };
+
+struct LayerHeat {
+    std::string name;
+    uint64_t reads[PHASES] = {};
+    uint64_t bytes[PHASES] = {};
+    // # of reads of each bucket of the data of the layer, for each phase
+    std::vector<uint32_t> buckets[PHASES];
+};
+
+class ImageHeatmap {
+public:
+    // the layers are those of the LSMT file of the image, by tag, the
+    // reads within `startup_us` from now counted as its startup
+    ImageHeatmap(const std::vector<std::string> &names, uint64_t startup_us);
+
+    // the read observer of the LSMT file
+    void on_read(size_t layer, uint64_t offset, uint64_t length);
+
+    // save to `path`, written aside and renamed
+    int save(const std::string &path) const;
+
+private:
+    std::vector<LayerHeat> m_layers;
+    uint64_t m_start, m_startup_us;
+};
+
+// load a heatmap saved by ImageHeatmap::save(), with the time it had been
+// counted for, and the length of the startup
+int load_heatmap(const std::string &path, std::vector<LayerHeat> *layers, uint64_t *uptime_us,
+                 uint64_t *startup_us);
+
+} // namespace Heatmap
@@ -17,6 +17,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <memory>
 #include <string>
 #include <sys/types.h>
 #include <unistd.h>
@@ -26,23 +27,36 @@
 #include "overlaybd/alog-stdstring.h"
 #include "overlaybd/alog.h"
 #include "overlaybd/fs/aligned-file.h"
+#include "overlaybd/fs/cache/cache.h"
 #include "overlaybd/fs/filesystem.h"
 #include "overlaybd/fs/localfs.h"
 #include "overlaybd/fs/lsmt/file.h"
+#include "overlaybd/fs/throttled-file.h"
+#include "overlaybd/fs/writeback-file.h"
 #include "overlaybd/fs/zfile/zfile.h"
+#include "overlaybd/iovector.h"
+#include "overlaybd/metrics.h"
 #include "config.h"
 #include "image_file.h"
+#include "merkle_file.h"
+#include "promote_file.h"
 #include "sure_file.h"
 #include "switch_file.h"
 
 #define PARALLEL_LOAD_INDEX 32
+#define COMPACT_SUFFIX ".compact"
+#define HINT_IO_SIZE (1024 * 1024)
+#define HINT_CONCURRENCY 8
+#define READAHEAD_CONCURRENCY 4
+#define HEATMAP_SAVE_INTERVAL 60
+#define ACCEL_IO_SIZE (16 * 1024 * 1024)
 
 FileSystem::IFile *ImageFile::__open_ro_file(const std::string &path) {
     int flags = O_RDONLY;
 
     LOG_DEBUG("open ro file: `", path);
     int ioengine = image_service.global_conf.ioEngine();
-    if (ioengine > 2) {
+    if (ioengine > 3) {
         LOG_WARN("invalid ioengine: `, set to psync", ioengine);
         ioengine = 0;
     }
@@ -81,9 +95,38 @@ FileSystem::IFile *ImageFile::__open_ro_file(const std::string &path) {
     return file;
 }
 
-FileSystem::IFile *ImageFile::__open_ro_remote(const std::string &dir, const std::string &digest,
-                                               const uint64_t size, int layer_index) {
-    std::string url;
+// the layer read from the source fs of the registry cache, each chunk checked
+// against the merkle tree of the layer, before it is cached if `uncompressed`
+// is false, so that integrity costs no extra pass over the layer
+FileSystem::IFile *ImageFile::__open_ro_verified(const std::string &url,
+                                                 ImageConfigNS::LayerConfig &layer,
+                                                 bool uncompressed) {
+    auto cached_fs =
+        dynamic_cast<FileSystem::ICachedFileSystem *>(image_service.global_fs.remote_fs);
+    auto src_fs = cached_fs && cached_fs->get_source() ? cached_fs->get_source()
+                                                       : image_service.global_fs.remote_fs;
+    auto src = src_fs->open(url.c_str(), O_RDONLY);
+    if (!src)
+        return nullptr;
+    std::unique_ptr<FileSystem::IFile> tree(
+        FileSystem::open_localfile_adaptor(layer.merkleTree().c_str(), O_RDONLY, 0644, 0));
+    if (!tree) {
+        delete src;
+        LOG_ERRNO_RETURN(0, nullptr, "failed to open merkle tree `", layer.merkleTree());
+    }
+    auto verified = Merkle::new_merkle_file(src, tree.get(), layer.merkleRoot());
+    if (!verified)
+        LOG_ERRNO_RETURN(EIO, nullptr, "failed to load merkle tree ` of `", layer.merkleTree(),
+                         url);
+    if (uncompressed || src_fs == image_service.global_fs.remote_fs)
+        return verified;
+    return cached_fs->open_cached(url.c_str(), verified);
+}
+
+FileSystem::IFile *ImageFile::__open_ro_remote(ImageConfigNS::LayerConfig &layer,
+                                               int layer_index) {
+    std::string dir = layer.dir(), digest = layer.digest(), url;
+    uint64_t size = layer.size();
     int64_t extra_range, rand_wait;
 
     if (conf.repoBlobUrl() == "") {
@@ -96,45 +139,125 @@ FileSystem::IFile *ImageFile::__open_ro_remote(const std::string &dir, const std
         url += "/";
     url += digest;
 
-    LOG_DEBUG("open file from remotefs: `, size: `", url, size);
-    FileSystem::IFile *remote_file = image_service.global_fs.remote_fs->open(url.c_str(), O_RDONLY);
-    if (!remote_file) {
-        if (errno == EPERM)
-            set_auth_failed();
+    // the layer is cached as it is in the registry, compressed, by the remote
+    // fs, or by a cache of its own over the zfile, decompressed; "hybrid"
+    // caches it compressed, with the hot blocks decompressed in memory
+    auto mode = conf.cacheMode();
+    auto cached_fs =
+        dynamic_cast<FileSystem::ICachedFileSystem *>(image_service.global_fs.remote_fs);
+    if (mode != "compressed" && mode != "uncompressed" && mode != "hybrid")
+        LOG_WARN("invalid cacheMode: `, set to compressed", mode);
+    bool uncompressed = mode == "uncompressed" && cached_fs && cached_fs->get_source();
+    int64_t block_cache_size = mode == "hybrid" ? (int64_t)conf.hybridCacheMB() << 20 : -1;
+    // the compressed cache refills whole blocks, hinted by the zfile
+    int refill_lookahead =
+        cached_fs && !uncompressed ? image_service.global_conf.zfileRefillLookahead() : -1;
+
+    // the layer is opened once and shared by the devices of the service,
+    // which are attached with it, and the first one downloads it if enabled
+    FileSystem::IFile *remote_file = nullptr;
+    FileSystem::ISwitchFile *switch_file = nullptr;
+    auto open_layer = [&]() -> FileSystem::IFile * {
+        LOG_DEBUG("open file from remotefs: `, size: `, cache mode: `", url, size, mode);
+        // the size given by the manifest saves a HEAD of the blob
+        FileSystem::registryfs_set_blob_size(image_service.global_fs.srcfs, url.c_str(), size);
+        auto fs = uncompressed ? cached_fs->get_source() : image_service.global_fs.remote_fs;
+        if (layer.merkleTree() != "")
+            remote_file = __open_ro_verified(url, layer, uncompressed);
         else
-            set_failed("failed to open remote file " + url);
-        LOG_ERROR_RETURN(0, nullptr, "failed to open remote file `", url);
-    }
+            remote_file = fs->open(url.c_str(), O_RDONLY);
+        if (!remote_file) {
+            if (errno == EPERM)
+                set_auth_failed();
+            else
+                set_failed("failed to open remote file " + url);
+            LOG_ERROR_RETURN(0, nullptr, "failed to open remote file `", url);
+        }
+        // the trailers and the indexes of the zfile and the LSMT, at the tail of
+        // the layer, are fetched by one GET in the background, while its headers
+        // are read; those larger than the tail are read as they are reached
+        uint64_t tail = (uint64_t)image_service.global_conf.registryOpenTailKB() << 10;
+        auto cached_file = dynamic_cast<FileSystem::ICachedFile *>(remote_file);
+        struct stat st;
+        if (tail > 0 && cached_file && remote_file->fstat(&st) == 0 && st.st_size > 0) {
+            off_t offset = st.st_size > (off_t)tail ? st.st_size - tail : 0;
+            cached_file->prefetch_async(offset, st.st_size - offset,
+                                        FileSystem::ICachedFile::PrefetchDone());
+        }
 
+        std::string tar_index;
+        if (!image_service.tar_index_dir.empty())
+            tar_index = image_service.tar_index_dir + "/" + digest;
+        switch_file = FileSystem::new_switch_file(remote_file, false, nullptr,
+                                                  tar_index.empty() ? nullptr : tar_index.c_str(),
+                                                  block_cache_size, refill_lookahead);
+        if (!switch_file) {
+            set_failed("failed to open switch file `" + url);
+            delete remote_file;
+            LOG_ERROR_RETURN(0, nullptr, "failed to open switch file `", url);
+        }
+        if (!uncompressed)
+            return switch_file;
+        // named apart from the compressed cache of the layer
+        auto cached = cached_fs->open_cached((url + ".uncompressed").c_str(), switch_file);
+        if (!cached) {
+            set_failed("failed to open uncompressed cache of " + url);
+            LOG_ERROR_RETURN(0, nullptr, "failed to open uncompressed cache of `", url);
+        }
+        return cached;
+    };
+    bool opened = false;
+    FileSystem::IFile *file = image_service.open_shared_layer(digest, open_layer, opened);
+    if (!file) {
+        if (m_exception == "")
+            set_failed("failed to open shared layer " + url);
+        LOG_ERROR_RETURN(0, nullptr, "failed to open layer `", url);
+    }
 
-    FileSystem::ISwitchFile *switch_file = FileSystem::new_switch_file(remote_file);
-    if (!switch_file) {
-        set_failed("failed to open switch file `" + url);
-        delete remote_file;
-        LOG_ERROR_RETURN(0, nullptr, "failed to open switch file `", url);
+    // the cache of the layer is charged to the group of the image that opens
+    // it first, and base layers pinned by either config are evicted last
+    auto pinned = image_service.global_conf.registryCachePinned();
+    bool pin = layer.cachePinned() || std::find(pinned.begin(), pinned.end(), digest) != pinned.end();
+    auto pool = cached_fs ? cached_fs->get_pool() : nullptr;
+    if (pool && (pin || !conf.cacheGroup().empty())) {
+        pool->set_owner(uncompressed ? url + ".uncompressed" : url, conf.cacheGroup(), pin);
     }
 
-    FileSystem::IFile *file = switch_file;
     if (m_prefetcher != nullptr) {
-        file = m_prefetcher->new_prefetch_file(switch_file, layer_index);
+        file = m_prefetcher->new_prefetch_file(file, layer_index);
+    }
+    if (layer_index == m_accel_index) {
+        m_accel_file = file;
     }
 
-    FileSystem::IFile *sure_file = new_sure_file(file, this);
+    // the registry host, whose outage is shared by all the layers from it
+    auto host_pos = url.find("://");
+    host_pos = host_pos == std::string::npos ? 0 : host_pos + 3;
+    auto backend = url.substr(0, url.find('/', host_pos));
+    FileSystem::IFile *sure_file = new_sure_file(file, this, true, backend.c_str());
     if (!sure_file) {
         set_failed("failed to open sure file `" + url);
-        delete switch_file;
+        delete file;
         LOG_ERROR_RETURN(0, nullptr, "failed to open sure file `", url);
     }
 
-    if (conf.HasMember("download") && conf.download().enable() == 1) {
-        // download from registry, verify sha256 after downloaded.
-        FileSystem::IFile *srcfile = image_service.global_fs.srcfs->open(url.c_str(), O_RDONLY);
+    if (opened && conf.HasMember("download") && conf.download().enable() == 1) {
+        // download from registry, verify sha256 after downloaded, or each chunk
+        // by the merkle tree as it's read, if only the live data is downloaded
+        bool sparse = conf.download().sparse() && layer.merkleTree() != "";
+        if (conf.download().sparse() && !sparse)
+            LOG_INFO("download ` in whole, to be verified without a merkle tree", url);
+        FileSystem::IFile *srcfile =
+            sparse ? __open_ro_verified(url, layer, true)
+                   : image_service.global_fs.srcfs->open(url.c_str(), O_RDONLY);
         if (srcfile == nullptr) {
             LOG_WARN("failed to open source file, ignore download");
         } else {
             BKDL::BkDownload *obj =
                 new BKDL::BkDownload(switch_file, srcfile, dir, conf.download().maxMBps(),
-                                    conf.download().tryCnt(), this, digest);
+                                    conf.download().tryCnt(), this, digest,
+                                    conf.download().concurrency(),
+                                    dynamic_cast<FileSystem::ICachedFile *>(remote_file), sparse);
             LOG_DEBUG("add to download list for `", dir);
             dl_list.push_back(obj);
         }
@@ -153,8 +276,249 @@ void ImageFile::start_bk_dl_thread() {
     extra_range = (extra_range <= 0) ? 30 : extra_range;
     uint64_t delay_sec = (rand() % extra_range) + conf.download().delay();
 
-    dl_thread_jh = photon::thread_enable_join(
-        photon::thread_create11(&BKDL::bk_download_proc, dl_list, delay_sec, m_status));
+    image_service.download_scheduler->add(dl_list, delay_sec, m_status, &m_bg_owner);
+}
+
+// the LBA ranges in `prefetchHintPath`, a line of `<lba> <sectors>` in 512B
+// sectors each, e.g. the extents of the files the image is known to need, as
+// printed by `filefrag -e -b512` on the mounted device, are prefetched from the
+// lowers once the image is opened, as urgently as the reads of the guest
+void ImageFile::start_hint_threads(FileSystem::IFile *lower) {
+    auto path = conf.prefetchHintPath();
+    FILE *fp = fopen(path.c_str(), "r");
+    if (fp == nullptr) {
+        LOG_ERROR("failed to open prefetch hints `, `:`", path, errno, strerror(errno));
+        return;
+    }
+    DEFER(fclose(fp));
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long long lba, sectors;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%llu %llu", &lba, &sectors) != 2 || sectors == 0) {
+            LOG_WARN("invalid prefetch hint in `: `", path, line);
+            continue;
+        }
+        // in pieces, for the workers to share a long range
+        off_t offset = lba * 512, end = (lba + sectors) * 512;
+        for (; offset < end; offset += HINT_IO_SIZE)
+            m_hints.emplace_back(offset, std::min((off_t)HINT_IO_SIZE, end - offset));
+    }
+    LOG_INFO("prefetch ` ranges hinted by `", m_hints.size(), path);
+    auto n = std::min((size_t)HINT_CONCURRENCY, m_hints.size());
+    for (size_t i = 0; i < n; i++)
+        hint_jhs.push_back(photon::thread_enable_join(
+            photon::thread_create11(&ImageFile::hint_proc, this, lower)));
+}
+
+void ImageFile::hint_proc(FileSystem::IFile *lower) {
+    FileSystem::registryfs_set_io_owner(&m_fg_owner);
+    // the hinted ranges are known to be needed
+    FileSystem::cached_fs_set_admission(FileSystem::ADMIT_ALWAYS);
+    DEFER(FileSystem::cached_fs_set_admission(FileSystem::ADMIT_BY_FILTER));
+    while (!m_hints.empty() && m_status != -1) {
+        auto hint = m_hints.front();
+        m_hints.pop_front();
+        // a read without buffer is a prefetch, passed to the layers it reaches
+        struct iovec iov = {nullptr, hint.second};
+        if (lower->preadv(&iov, 1, hint.first) < 0)
+            LOG_WARN("failed to prefetch hinted range [`, +`), `:`", hint.first, hint.second,
+                     errno, strerror(errno));
+    }
+}
+
+// the streams of reads of the guest are detected by the reads of the image
+// file, and the ranges they are about to read prefetched from the lowers
+void ImageFile::start_readahead_threads(FileSystem::IFile *lower) {
+    struct stat st;
+    if (lower->fstat(&st) < 0) {
+        LOG_ERROR("failed to stat lower layers for readahead, `:`", errno, strerror(errno));
+        return;
+    }
+    uint64_t max_window = (uint64_t)conf.readaheadMaxKB() * 1024;
+    m_readahead = Readahead::new_stream_detector(st.st_size, max_window);
+    LOG_INFO("readahead of guest streams enabled, max window ` KB", conf.readaheadMaxKB());
+    for (int i = 0; i < READAHEAD_CONCURRENCY; i++)
+        hint_jhs.push_back(photon::thread_enable_join(
+            photon::thread_create11(&ImageFile::readahead_proc, this, lower)));
+}
+
+void ImageFile::readahead_proc(FileSystem::IFile *lower) {
+    FileSystem::registryfs_set_io_owner(&m_fg_owner);
+    // the ranges are about to be read by the guest
+    FileSystem::cached_fs_set_admission(FileSystem::ADMIT_ALWAYS);
+    DEFER(FileSystem::cached_fs_set_admission(FileSystem::ADMIT_BY_FILTER));
+    off_t offset;
+    size_t count;
+    while (m_readahead->pop(&offset, &count)) {
+        // a read without buffer is a prefetch, passed to the layers it reaches
+        struct iovec iov = {nullptr, count};
+        if (lower->preadv(&iov, 1, offset) < 0)
+            LOG_DEBUG("failed to read ahead [`, +`), `:`", offset, count, errno,
+                      strerror(errno));
+    }
+}
+
+// the reads of the layers, as resolved by the index of `file`, are counted
+// in the heatmap, named by digest, or by path for local layers
+void ImageFile::start_heatmap(LSMT::IFileRO *file,
+                              const std::vector<ImageConfigNS::LayerConfig> &lowers) {
+    std::vector<std::string> names;
+    for (auto layer : lowers) {
+        auto name = layer.digest();
+        if (name.empty())
+            name = layer.file().empty() ? layer.dir() : layer.file();
+        names.push_back(name);
+    }
+    if (m_rw_file)
+        names.push_back("upper");
+    m_heatmap.reset(new Heatmap::ImageHeatmap(names, conf.heatmapStartupSec() * 1000000UL));
+    file->set_read_observer({m_heatmap.get(), &Heatmap::ImageHeatmap::on_read});
+    LOG_INFO("reads of ` layers counted in heatmap `", names.size(), conf.heatmapPath());
+    hint_jhs.push_back(
+        photon::thread_enable_join(photon::thread_create11(&ImageFile::heatmap_proc, this)));
+}
+
+void ImageFile::heatmap_proc() {
+    while (m_status != -1) {
+        // sleep in small steps, so that close() doesn't wait for a whole interval
+        for (int i = 0; i < HEATMAP_SAVE_INTERVAL * 5 && m_status != -1; i++)
+            photon::thread_usleep(200 * 1000);
+        m_heatmap->save(conf.heatmapPath());
+    }
+}
+
+// the acceleration layer built by overlaybd-accel holds the data read by a
+// trace, in the order it was read, so it is fetched from the start to the end
+// in large pieces, instead of replaying the trace range by range
+void ImageFile::accel_proc(FileSystem::IFile *accel) {
+    FileSystem::registryfs_set_io_owner(&m_bg_owner);
+    FileSystem::cached_fs_set_admission(FileSystem::ADMIT_ALWAYS);
+    DEFER(FileSystem::cached_fs_set_admission(FileSystem::ADMIT_BY_FILTER));
+    struct stat st;
+    if (accel->fstat(&st) < 0) {
+        LOG_WARN("failed to stat the acceleration layer, `:`", errno, strerror(errno));
+        return;
+    }
+    auto start = photon::now;
+    for (off_t offset = 0; offset < st.st_size && m_status != -1; offset += ACCEL_IO_SIZE) {
+        // a read without buffer is a prefetch into the cache
+        struct iovec iov = {nullptr, (size_t)std::min((off_t)ACCEL_IO_SIZE, st.st_size - offset)};
+        if (accel->preadv(&iov, 1, offset) < 0) {
+            LOG_WARN("failed to fetch the acceleration layer at `, `:`", offset, errno,
+                     strerror(errno));
+            return;
+        }
+    }
+    LOG_INFO("acceleration layer of ` bytes fetched in ` ms", st.st_size,
+             (photon::now - start) / 1000);
+}
+
+void ImageFile::start_compaction_thread() {
+    compact_thread_jh = photon::thread_enable_join(
+        photon::thread_create11(&ImageFile::compaction_proc, this));
+}
+
+void ImageFile::compaction_proc() {
+    ImageConfigNS::CompactionConfig cconf;
+    cconf.CopyFrom(image_service.global_conf.compaction(), cconf.GetAllocator());
+    uint64_t interval = (cconf.interval() <= 0) ? 3600 : cconf.interval();
+    uint64_t min_garbage = (uint64_t)std::max(cconf.minGarbageMB(), 0) << 20;
+    uint64_t ratio = std::max(cconf.garbageRatio(), 0);
+    LOG_INFO("compaction thread started, interval: `s, garbageRatio: `%, minGarbageMB: `",
+             interval, ratio, cconf.minGarbageMB());
+
+    while (m_status >= 0) {
+        // sleep in small steps, so that close() doesn't wait for a whole interval
+        for (uint64_t i = 0; i < interval * 5 && m_status >= 0; i++)
+            photon::thread_usleep(200 * 1000);
+        if (m_status != 1)
+            continue;
+
+        auto st = m_rw_file->data_stat();
+        if (st.total_data_size == (uint64_t)-1 || st.valid_data_size > st.total_data_size)
+            continue;
+        uint64_t garbage = st.total_data_size - st.valid_data_size;
+        LOG_DEBUG("upper data: total `, valid `, garbage `", st.total_data_size,
+                  st.valid_data_size, garbage);
+        if (garbage < min_garbage || garbage * 100 < ratio * st.total_data_size)
+            continue;
+
+        LOG_INFO("start compacting upper layer, total `, garbage `", st.total_data_size, garbage);
+        if (compact_upper() < 0) {
+            LOG_ERROR("compaction failed, `:`", errno, strerror(errno));
+        } else {
+            st = m_rw_file->data_stat();
+            LOG_INFO("compaction done, total data size: `", st.total_data_size);
+        }
+    }
+    LOG_INFO("compaction thread exited");
+}
+
+int ImageFile::compact_upper() {
+    ImageConfigNS::UpperConfig upper;
+    upper.CopyFrom(conf.upper(), upper.GetAllocator());
+    std::string data_path = upper.data(), index_path = upper.index();
+    std::string data_tmp = data_path + COMPACT_SUFFIX, index_tmp = index_path + COMPACT_SUFFIX;
+
+    auto fdata = new_sure_file_by_path(data_tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, this);
+    if (!fdata)
+        LOG_ERRNO_RETURN(0, -1, "failed to create `", data_tmp);
+    if (m_upper_compressed) {
+        auto file = ZFile::zfile_open_append(fdata, true, nullptr, true);
+        if (!file) {
+            delete fdata;
+            ::unlink(data_tmp.c_str());
+            LOG_ERRNO_RETURN(0, -1, "failed to create compressed `", data_tmp);
+        }
+        fdata = file;
+    }
+    auto findex = new_sure_file_by_path(index_tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, this);
+    if (!findex) {
+        delete fdata;
+        ::unlink(data_tmp.c_str());
+        LOG_ERRNO_RETURN(0, -1, "failed to create `", index_tmp);
+    }
+
+    uint64_t max_MBps = std::max(image_service.global_conf.compaction().maxMBps(), 0);
+    int ret = m_rw_file->compact_online(fdata, findex, max_MBps, &m_status);
+    if (ret < 0) {
+        int eno = errno;
+        delete fdata;
+        delete findex;
+        ::unlink(data_tmp.c_str());
+        ::unlink(index_tmp.c_str());
+        LOG_ERROR_RETURN(eno, -1, "compact_online(`, `) failed", data_tmp, index_tmp);
+    }
+
+    // The new files are owned by the LSMT file from now on. Rename the data
+    // file first: open_upper() treats a lonely index.compact as a finished
+    // compaction and a pair of .compact files as an unfinished one.
+    if (::rename(data_tmp.c_str(), data_path.c_str()) < 0)
+        LOG_ERRNO_RETURN(0, -1, "rename(`, `) failed", data_tmp, data_path);
+    if (::rename(index_tmp.c_str(), index_path.c_str()) < 0)
+        LOG_ERRNO_RETURN(0, -1, "rename(`, `) failed", index_tmp, index_path);
+    return 0;
+}
+
+static void recover_compaction(ImageConfigNS::UpperConfig &upper) {
+    std::string data_tmp = upper.data() + COMPACT_SUFFIX;
+    std::string index_tmp = upper.index() + COMPACT_SUFFIX;
+    bool has_data = ::access(data_tmp.c_str(), F_OK) == 0;
+    bool has_index = ::access(index_tmp.c_str(), F_OK) == 0;
+    if (has_data) {
+        // interrupted before the new files were in place, the old ones are intact
+        LOG_WARN("discard unfinished compaction of `", upper.data());
+        ::unlink(data_tmp.c_str());
+        ::unlink(index_tmp.c_str());
+    } else if (has_index) {
+        // the compacted data file is in place, so its index must follow
+        LOG_WARN("finish interrupted compaction of `", upper.index());
+        if (::rename(index_tmp.c_str(), upper.index().c_str()) < 0)
+            LOG_ERROR("rename(`, `) failed, `:`", index_tmp, upper.index(), errno,
+                      strerror(errno));
+    }
 }
 
 struct ParallelOpenTask {
@@ -211,7 +575,7 @@ int ImageFile::open_lower_layer(FileSystem::IFile *&file, ImageConfigNS::LayerCo
             file = __open_ro_file(opened);
         } else {
             opened = layer.digest();
-            file = __open_ro_remote(layer.dir(), layer.digest(), layer.size(), index);
+            file = __open_ro_remote(layer, index);
         }
     }
     if (file != nullptr) {
@@ -221,10 +585,99 @@ int ImageFile::open_lower_layer(FileSystem::IFile *&file, ImageConfigNS::LayerCo
     return -1;
 }
 
+// the lower layers opened with the merged index shared by the devices of the
+// same layers, whose UUIDs are `key`, or nullptr, with `loading` set if it's
+// to be loaded by this device and shared then
+LSMT::IFileRO *ImageFile::open_shared_lowers(std::vector<FileSystem::IFile *> &files,
+                                             const std::vector<UUID> &uuids,
+                                             const std::string &key, bool &loading) {
+    auto index = image_service.get_lower_index(key);
+    loading = !index;
+    if (!index)
+        return nullptr;
+    auto ret = LSMT::open_files_ro_shared(&files[0], files.size(), &uuids[0], index, true);
+    if (!ret)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to open lower layers with shared index");
+    return ret;
+}
+
+// the index of the layers merged ahead of time, e.g. by `overlaybd-commit -i`,
+// which falls back to loading their indexes if it doesn't match the layers
+LSMT::IFileRO *ImageFile::open_merged_index(std::vector<FileSystem::IFile *> &files,
+                                            const std::string &path) {
+    std::unique_ptr<FileSystem::IFile> findex(
+        FileSystem::open_localfile_adaptor(path.c_str(), O_RDONLY, 0644, 0));
+    if (!findex)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to open merged index `, ignored", path);
+    auto ret = LSMT::open_files_ro_with_index(&files[0], files.size(), findex.get(), true);
+    if (!ret)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to load merged index `, ignored", path);
+    return ret;
+}
+
+// save the merged index of the lowers as `path`, for later attaches of the
+// same layers, e.g. after a restart, to open with instead of loading them
+static void save_lower_index(LSMT::IFileRO *lowers, const std::string &path) {
+    // unique among the vcpus saving the same layers
+    auto tmp = path + ".tmp" + std::to_string((uintptr_t)lowers);
+    std::unique_ptr<FileSystem::IFile> findex(
+        FileSystem::open_localfile_adaptor(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644, 0));
+    if (!findex)
+        LOG_ERRNO_RETURN(0, , "failed to create `", tmp);
+    if (LSMT::save_merged_index(lowers, findex.get()) < 0 || findex->fdatasync() < 0 ||
+        ::rename(tmp.c_str(), path.c_str()) < 0) {
+        LOG_ERROR("failed to save merged index `, `:`", path, errno, strerror(errno));
+        ::unlink(tmp.c_str());
+        return;
+    }
+    LOG_INFO("merged index of the lowers saved as `", path);
+}
+
+// the lowers with their indexes shared by other devices of the same layers,
+// merged ahead of time, saved by a previous attach, or loaded in turn
+LSMT::IFileRO *ImageFile::load_lowers(std::vector<FileSystem::IFile *> &files) {
+    LSMT::IFileRO *ret = nullptr;
+    std::vector<UUID> uuids(files.size());
+    std::string key, saved;
+    bool loading = false;
+    if (LSMT::read_uuids(&files[0], files.size(), &uuids[0]) == 0) {
+        for (auto &uuid : uuids)
+            key += UUID::String(uuid).c_str();
+        ret = open_shared_lowers(files, uuids, key, loading);
+        if (!image_service.merged_index_dir.empty()) {
+            char name[32];
+            snprintf(name, sizeof(name), "/%016lx", std::hash<std::string>()(key));
+            saved = image_service.merged_index_dir + name;
+        }
+    } else {
+        LOG_ERROR("failed to read UUIDs of the lower layers, `:`", errno, strerror(errno));
+    }
+
+    if (!ret && conf.mergedIndex() != "")
+        ret = open_merged_index(files, conf.mergedIndex());
+    if (!ret && !saved.empty() && ::access(saved.c_str(), F_OK) == 0)
+        ret = open_merged_index(files, saved);
+    if (!ret) {
+        if (image_service.global_conf.lazyIndexLoad()) {
+            ret = LSMT::open_files_ro_lazy((FileSystem::IFile **)&(files[0]), files.size(), true);
+        } else {
+            ret = LSMT::open_files_ro((FileSystem::IFile **)&(files[0]), files.size(), true);
+            if (ret && !saved.empty())
+                save_lower_index(ret, saved);
+        }
+    }
+    if (loading) {
+        // shared with the devices waiting for it, or they load it themselves
+        image_service.share_lower_index(key, ret ? LSMT::share_index(ret) : nullptr);
+    }
+    return ret;
+}
+
 LSMT::IFileRO *ImageFile::open_lowers(std::vector<ImageConfigNS::LayerConfig> &lowers,
                                       bool &has_error) {
     LSMT::IFileRO *ret = NULL;
     has_error = false;
+    auto start = photon::now;
 
     if (lowers.size() == 0)
         return NULL;
@@ -244,6 +697,7 @@ LSMT::IFileRO *ImageFile::open_lowers(std::vector<ImageConfigNS::LayerConfig> &l
     for (int i = 0; i < n; i++) {
         photon::thread_join(ths[i]);
     }
+    open_timing.lower_files = photon::now - start;
 
     for (int i = 0; i < files.size(); i++) {
         if (files[i] == NULL) {
@@ -254,15 +708,21 @@ LSMT::IFileRO *ImageFile::open_lowers(std::vector<ImageConfigNS::LayerConfig> &l
             goto ERROR_EXIT;
         }
     }
-    ret = LSMT::open_files_ro((FileSystem::IFile **)&(files[0]), lowers.size(), true);
+    start = photon::now;
+    ret = load_lowers(files);
     if (!ret) {
         LOG_ERROR("LSMT::open_files_ro(files, `, `) return NULL", lowers.size(), true);
         goto ERROR_EXIT;
     }
+    open_timing.lower_index = photon::now - start;
     LOG_INFO("LSMT::open_files_ro(files, `) success", lowers.size());
 
     if (m_prefetcher != nullptr) {
+        // replay workers inherit the owner of the calling thread
+        auto owner = FileSystem::registryfs_get_io_owner();
+        FileSystem::registryfs_set_io_owner(&m_bg_owner);
         m_prefetcher->replay();
+        FileSystem::registryfs_set_io_owner(owner);
     }
 
     return ret;
@@ -287,12 +747,24 @@ LSMT::IFileRW *ImageFile::open_upper(ImageConfigNS::UpperConfig &upper) {
     LOG_INFO("upper layer : ` , `", upper.index(), upper.data());
 
     int dafa_file_flags = O_RDWR;
+    recover_compaction(upper);
 
     data_file = new_sure_file_by_path(upper.data().c_str(), O_RDWR, this);
     if (!data_file) {
         LOG_ERROR("open(`,flags), `:`", upper.data(), errno, strerror(errno));
         goto ERROR_EXIT;
     }
+    // created compressed by `overlaybd-create -z`
+    if (ZFile::is_zfile_append(data_file) == 1) {
+        auto file = ZFile::zfile_open_append(data_file, false, nullptr, true);
+        if (!file) {
+            LOG_ERROR("failed to load compressed data of `, `:`", upper.data(), errno,
+                      strerror(errno));
+            goto ERROR_EXIT;
+        }
+        data_file = file;
+        m_upper_compressed = true;
+    }
 
     idx_file = new_sure_file_by_path(upper.index().c_str(), O_RDWR, this);
     if (!idx_file) {
@@ -306,6 +778,15 @@ LSMT::IFileRW *ImageFile::open_upper(ImageConfigNS::UpperConfig &upper) {
                   true);
         goto ERROR_EXIT;
     }
+    if (upper.zeroDetect()) {
+        ret->set_zero_detect(true);
+    }
+    if (upper.dedupBlocks() > 0) {
+        ret->set_dedup(upper.dedupBlocks());
+    }
+    if (image_service.global_conf.indexGroupCommitKB() > 0) {
+        ret->set_index_group_commit(image_service.global_conf.indexGroupCommitKB() * 1024UL);
+    }
 
     return ret;
 
@@ -316,30 +797,137 @@ ERROR_EXIT:
     return NULL;
 }
 
+void ImageFile::open_upper_proc(ImageConfigNS::UpperConfig &upper, LSMT::IFileRW **ret) {
+    auto start = photon::now;
+    *ret = open_upper(upper);
+    open_timing.upper = photon::now - start;
+}
+
+// the promotion layer in conf.promotionDir(), created anew unless it holds
+// data of the same `nlowers` lowers, as recorded by their UUIDs
+LSMT::IFileRW *ImageFile::open_promoted(LSMT::IFileRO *lower, size_t nlowers) {
+    std::string dir = conf.promotionDir();
+    std::string data_path = dir + "/promoted.data", index_path = dir + "/promoted.index",
+                lowers_path = dir + "/promoted.lowers";
+    std::string uuids;
+    for (size_t i = 0; i < nlowers; i++) {
+        UUID uuid;
+        if (lower->get_uuid(uuid, i) < 0)
+            LOG_ERRNO_RETURN(0, nullptr, "failed to get the uuid of lower `", i);
+        UUID::String str(uuid);
+        uuids.append(str.c_str()).append("\n");
+    }
+
+    std::unique_ptr<FileSystem::IFile> saved(
+        FileSystem::open_localfile_adaptor(lowers_path.c_str(), O_RDONLY, 0644, 0));
+    struct stat st;
+    if (saved && saved->fstat(&st) == 0 && st.st_size == (off_t)uuids.size()) {
+        std::string buf(uuids.size(), '\0');
+        if (saved->pread(&buf[0], buf.size(), 0) == (ssize_t)buf.size() && buf == uuids) {
+            auto fdata = FileSystem::open_localfile_adaptor(data_path.c_str(), O_RDWR, 0644, 0);
+            auto findex = FileSystem::open_localfile_adaptor(index_path.c_str(), O_RDWR, 0644, 0);
+            auto ret = (fdata && findex) ? LSMT::open_file_rw(fdata, findex, true) : nullptr;
+            if (ret)
+                return ret;
+            delete fdata;
+            delete findex;
+            LOG_WARN("failed to open the promotion layer in `, to be created anew", dir);
+        }
+    }
+    saved.reset();
+
+    // the layer is taken for one of the lowers only once it's created
+    ::unlink(lowers_path.c_str());
+    if (lower->fstat(&st) < 0)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to stat the lowers");
+    auto fdata =
+        FileSystem::open_localfile_adaptor(data_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644, 0);
+    auto findex =
+        FileSystem::open_localfile_adaptor(index_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644, 0);
+    LSMT::IFileRW *ret = nullptr;
+    if (fdata && findex) {
+        LSMT::LayerInfo args(fdata, findex);
+        args.virtual_size = st.st_size;
+        ret = LSMT::create_file_rw(args, true);
+    }
+    if (!ret) {
+        delete fdata;
+        delete findex;
+        LOG_ERRNO_RETURN(0, nullptr, "failed to create the promotion layer in `", dir);
+    }
+    std::unique_ptr<FileSystem::IFile> out(FileSystem::open_localfile_adaptor(
+        lowers_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644, 0));
+    if (!out || out->pwrite(uuids.data(), uuids.size(), 0) != (ssize_t)uuids.size()) {
+        delete ret;
+        LOG_ERRNO_RETURN(0, nullptr, "failed to write `", lowers_path);
+    }
+    LOG_INFO("promotion layer created in `", dir);
+    return ret;
+}
+
+// reads of `image` reaching the lowers are promoted to the promotion layer,
+// if it's configured; the image is read without it if it fails to be opened
+void ImageFile::promote_file(LSMT::IFileRO *image, LSMT::IFileRO *lower, size_t nlowers) {
+    if (conf.promotionDir().empty() || !lower || nlowers == 0 || replica)
+        return;
+    auto promoted = open_promoted(lower, nlowers);
+    if (!promoted) {
+        LOG_WARN("read the image without the promotion layer");
+        return;
+    }
+    m_file = Promote::new_promote_file(image, nlowers, promoted, conf.promotionReads(),
+                                       (uint64_t)conf.promotionMaxMB() << 20, true);
+}
+
+static void observe_open_phase(const char *phase, uint64_t us) {
+    auto h = Metrics::histogram("overlaybd_image_open_phase_seconds",
+                                "Time taken by each phase of opening an image.",
+                                {{"phase", phase}});
+    if (h)
+        h->observe(us);
+}
+
 int ImageFile::init_image_file() {
     LSMT::IFileRO *lower_file = nullptr;
     LSMT::IFileRW *upper_file = nullptr;
     LSMT::IFileRW *stack_ret = nullptr;
     ImageConfigNS::UpperConfig upper;
+    photon::join_handle *upper_jh = nullptr;
     bool record_no_download = false;
     bool has_error = false;
     auto lowers = conf.lowers();
+    auto start = photon::now;
+    uint64_t phase_start;
+
+    m_fg_owner.weight = m_bg_owner.weight = m_meta_owner.weight = conf.ioWeight();
+    m_bg_owner.background = true;
+    m_meta_owner.urgent = true;
+    if (!conf.cacheGroup().empty() && conf.cacheQuotaGB() > 0)
+        image_service.set_cache_quota(conf.cacheGroup(), conf.cacheQuotaGB());
 
     if (conf.accelerationLayer() && !conf.recordTracePath().empty()) {
         LOG_ERROR("Cannot record trace while acceleration layer exists");
         goto ERROR_EXIT;
 
+    } else if (conf.accelerationLayer() && conf.accelerationData() && !lowers.empty()) {
+        // it holds the data read by a trace, and is stacked on the lowers as usual
+        m_accel_index = lowers.size() - 1;
+        LOG_INFO("Acceleration layer with data found, to be fetched once opened");
+
     } else if (conf.accelerationLayer() && !lowers.empty()) {
         std::string accel_layer = lowers.back().dir();
         lowers.pop_back();
         LOG_INFO("Acceleration layer found at `, ignore the last lower", accel_layer);
 
         std::string trace_file = accel_layer + "/trace";
-        if (FileSystem::Prefetcher::detect_mode(trace_file) == FileSystem::Prefetcher::Mode::Replay) {
-            m_prefetcher = FileSystem::new_prefetcher(trace_file);
+        if (!replica &&
+            FileSystem::Prefetcher::detect_mode(trace_file) == FileSystem::Prefetcher::Mode::Replay) {
+            m_prefetcher = FileSystem::new_prefetcher(
+                trace_file, image_service.global_conf.prefetchLeadWindowMs() * 1000UL,
+                image_service.global_conf.prefetchMinRunPercent());
         }
 
-    } else if (!conf.recordTracePath().empty()) {
+    } else if (!conf.recordTracePath().empty() && !replica) {
         if (FileSystem::Prefetcher::detect_mode(conf.recordTracePath()) !=
             FileSystem::Prefetcher::Mode::Record) {
             LOG_ERROR("Prefetch: incorrect mode for trace recording");
@@ -347,10 +935,22 @@ int ImageFile::init_image_file() {
         }
         m_prefetcher = FileSystem::new_prefetcher(conf.recordTracePath());
         record_no_download = true;
+        recording = true;
     }
 
+    open_timing.prefetcher = photon::now - start;
+
     upper.CopyFrom(conf.upper(), upper.GetAllocator());
+    // the upper layer is local, and opened with its index while the indexes
+    // of the lowers are fetched
+    if (upper.index() != "" && upper.data() != "") {
+        upper_jh = photon::thread_enable_join(
+            photon::thread_create11(&ImageFile::open_upper_proc, this, upper, &upper_file));
+    }
     lower_file = open_lowers(lowers, has_error);
+    if (upper_jh) {
+        photon::thread_join(upper_jh);
+    }
 
     if (has_error) {
         // NOTE: lower_file is allowed to be NULL. In this case, there is only one layer.
@@ -362,26 +962,77 @@ int ImageFile::init_image_file() {
         LOG_INFO("RW layer path not set. return RO layers.");
         m_file = lower_file;
         read_only = true;
+        promote_file(lower_file, lower_file, lowers.size());
         goto SUCCESS_EXIT;
     }
 
-    upper_file = open_upper(upper);
     if (!upper_file) {
         LOG_ERROR("open upper layer failed.");
         goto ERROR_EXIT;
     }
+    phase_start = photon::now;
     stack_ret = LSMT::stack_files(upper_file, lower_file, true, false);
     if (!stack_ret) {
         LOG_ERROR("LSMT::stack_files(`, `)", (uint64_t)upper_file, true);
         goto ERROR_EXIT;
     }
+    open_timing.stack = photon::now - phase_start;
     m_file = stack_ret;
+    m_rw_file = stack_ret;
     read_only = false;
+    promote_file(stack_ret, lower_file, lowers.size());
+    if (upper.writeCacheMB() > 0) {
+        m_file = FileSystem::new_writeback_file(m_file, (uint64_t)upper.writeCacheMB() << 20, true);
+        write_cache = true;
+        LOG_INFO("cache writes of the image file in at most ` MB", upper.writeCacheMB());
+    }
 
 SUCCESS_EXIT:
-    if (conf.download().enable() && !record_no_download) {
+    merge_reads = conf.mergeReads();
+    if (!conf.heatmapPath().empty() && !replica) {
+        auto file = m_rw_file ? (LSMT::IFileRO *)m_rw_file : lower_file;
+        if (file)
+            start_heatmap(file, lowers);
+    }
+    if (conf.metadataFirst())
+        load_metadata_regions();
+    throttle_file();
+    // unless the reads are throttled or recorded, or the local files are
+    // read by an engine that doesn't block the vcpu
+    if (read_only && m_file == lower_file && !recording &&
+        image_service.global_conf.ioEngine() == IOEngineType::io_engine_psync)
+        m_direct = lower_file;
+    open_timing.total = photon::now - start;
+    open_timing.trace_reload = m_prefetcher ? m_prefetcher->get_reload_time() : 0;
+    LOG_INFO("image file opened in ` ms: prefetcher ` ms, lower files ` ms, lower index ` ms, "
+             "upper ` ms, stack ` ms, trace reloaded in ` ms",
+             open_timing.total / 1000, open_timing.prefetcher / 1000,
+             open_timing.lower_files / 1000, open_timing.lower_index / 1000,
+             open_timing.upper / 1000, open_timing.stack / 1000,
+             open_timing.trace_reload / 1000);
+    observe_open_phase("prefetcher", open_timing.prefetcher);
+    observe_open_phase("lower_files", open_timing.lower_files);
+    observe_open_phase("lower_index", open_timing.lower_index);
+    observe_open_phase("upper", open_timing.upper);
+    observe_open_phase("stack", open_timing.stack);
+    observe_open_phase("trace_reload", open_timing.trace_reload);
+    observe_open_phase("total", open_timing.total);
+    if (conf.download().enable() && !record_no_download && !replica) {
         start_bk_dl_thread();
     }
+    if (lower_file && !conf.prefetchHintPath().empty() && !replica) {
+        start_hint_threads(lower_file);
+    }
+    if (lower_file && conf.readaheadMaxKB() > 0 && !replica) {
+        start_readahead_threads(lower_file);
+    }
+    if (m_accel_file && !replica) {
+        hint_jhs.push_back(photon::thread_enable_join(
+            photon::thread_create11(&ImageFile::accel_proc, this, m_accel_file)));
+    }
+    if (m_rw_file && image_service.global_conf.compaction().enable()) {
+        start_compaction_thread();
+    }
     return 1;
 
 ERROR_EXIT:
@@ -390,6 +1041,80 @@ ERROR_EXIT:
     return -1;
 }
 
+// a read of a sealed image is served by one preadv() of each local file of
+// the layers it reaches, as resolved by the index, bypassing the files of the
+// layers; -1 for the caller to read it through them, e.g. if it reaches a
+// layer not downloaded yet, or if it fails to be read directly
+ssize_t ImageFile::preadv_direct(const struct iovec *iov, int iovcnt, off_t offset) {
+    static const size_t MAX_EXTENTS = 32;
+    LSMT::IFileRO::Extent extents[MAX_EXTENTS];
+    iovector_view view((iovec *)iov, iovcnt);
+    auto count = view.sum();
+    auto n = m_direct->resolve(offset, count, extents, MAX_EXTENTS);
+    if (n < 0)
+        return -1;
+    // as the psync engine of the local files does
+    photon::thread_yield();
+    if (n == 1 && extents[0].fd >= 0)
+        return ::preadv(extents[0].fd, iov, iovcnt, extents[0].moffset) == (ssize_t)count ? count
+                                                                                           : -1;
+    std::vector<iovec> tmp(iovcnt);
+    size_t pos = 0;
+    for (ssize_t i = 0; i < n; i++) {
+        auto &e = extents[i];
+        iovector_view part(&tmp[0], iovcnt);
+        view.slice(e.length, pos, &part);
+        if (e.fd < 0) {
+            for (auto &v : part)
+                memset(v.iov_base, 0, v.iov_len);
+        } else if (::preadv(e.fd, part.iov, part.iovcnt, e.moffset) != (ssize_t)e.length) {
+            return -1;
+        }
+        pos += e.length;
+    }
+    return count;
+}
+
+// guest I/O is throttled by the limits of the device, and within the node
+// by its share of the I/O of the node, which it may exceed while the node
+// has I/O to spare; m_rw_file is used as is by compaction
+void ImageFile::throttle_file() {
+    auto t = conf.throttle();
+    if (!m_file || (!t.IOPS() && !t.MBps() && !t.maxIOPS() && !t.maxMBps() &&
+                    !t.maxConcurrentOps() && !t.targetLatencyUs() &&
+                    !image_service.throttle_group))
+        return;
+    FileSystem::ThrottleLimits limits;
+    limits.RW.IOPS = t.maxIOPS();
+    limits.RW.throughput = std::min((uint64_t)t.maxMBps() << 20, (uint64_t)UINT32_MAX);
+    limits.RW.concurent_ops = t.maxConcurrentOps();
+    limits.share.IOPS = t.IOPS();
+    limits.share.throughput = (uint64_t)t.MBps() << 20;
+    limits.share.burst = t.burstSec();
+    limits.group = image_service.throttle_group;
+    limits.target_latency = t.targetLatencyUs();
+    m_unthrottled = m_file;
+    m_file = FileSystem::new_throttled_file(m_file, limits, true);
+    LOG_INFO("throttle the image file: ` IOPS, ` MB/s, bursting for ` s, at most ` IOPS, ` MB/s, ` ops, "
+             "targeting p99 latency of ` us",
+             t.IOPS(), t.MBps(), t.burstSec(), t.maxIOPS(), t.maxMBps(), t.maxConcurrentOps(),
+             t.targetLatencyUs());
+}
+
+// the regions of the metadata of the ext4 fs on the image, read here as the
+// guest would at mount, so that the reads of them go first from now on
+void ImageFile::load_metadata_regions() {
+    auto owner = FileSystem::registryfs_get_io_owner();
+    FileSystem::registryfs_set_io_owner(&m_meta_owner);
+    DEFER(FileSystem::registryfs_set_io_owner(owner));
+    if (Metadata::load_ext4_regions(m_file, &m_metadata) < 0) {
+        LOG_WARN("failed to load the metadata regions of the image, read as the others");
+        return;
+    }
+    LOG_INFO("metadata of the image: ` bytes in ` regions", m_metadata.bytes(),
+             m_metadata.size());
+}
+
 void ImageFile::set_auth_failed() {
     if (m_status == 0) // only set exit in image boot phase
     {
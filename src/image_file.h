@@ -21,6 +21,7 @@
 #include <limits.h>
 #include <list>
 #include <map>
+#include <memory>
 #include <string>
 #include <sys/types.h>
 #include <thread>
@@ -29,18 +30,27 @@
 #include "image_service.h"
 #include "bk_download.h"
 #include "config.h"
+#include "heatmap.h"
 #include "image_service.h"
+#include "metadata.h"
 #include "prefetch.h"
+#include "readahead.h"
+#include "overlaybd/trace.h"
 #include "overlaybd/alog.h"
+#include "overlaybd/memory.h"
 #include "overlaybd/fs/filesystem.h"
 #include "overlaybd/fs/forwardfs.h"
+#include "overlaybd/iovector.h"
 #include "overlaybd/fs/lsmt/file.h"
+#include "overlaybd/fs/registryfs/registryfs.h"
 #include "overlaybd/photon/thread11.h"
 
 class ImageFile : public FileSystem::ForwardFile {
 public:
-    ImageFile(ImageConfigNS::ImageConfig &_conf, ImageService &is)
-        : ForwardFile(nullptr), image_service(is) {
+    // a `replica` of an image file opened on another vcpu serves a share of
+    // its reads, neither prefetching nor downloading the layers by itself
+    ImageFile(ImageConfigNS::ImageConfig &_conf, ImageService &is, bool replica = false)
+        : ForwardFile(nullptr), replica(replica), image_service(is) {
         conf.CopyFrom(_conf, conf.GetAllocator());
         m_exception = "";
         m_status = init_image_file();
@@ -54,12 +64,24 @@ public:
     ~ImageFile() {
         delete m_file;
         delete m_prefetcher;
+        delete m_readahead;
     }
 
     int close() override {
         m_status = -1;
-        if (dl_thread_jh != nullptr)
-            photon::thread_join(dl_thread_jh);
+        if (image_service.download_scheduler)
+            image_service.download_scheduler->remove(m_status);
+        if (compact_thread_jh != nullptr)
+            photon::thread_join(compact_thread_jh);
+        if (m_readahead)
+            m_readahead->stop();
+        for (auto jh : hint_jhs)
+            photon::thread_join(jh);
+        LOG_INFO("registry GETs: foreground ` bytes in ` requests, "
+                 "background ` bytes in ` requests", m_fg_owner.bytes, m_fg_owner.requests, m_bg_owner.bytes, m_bg_owner.requests);
+        if (!m_metadata.empty())
+            LOG_INFO("registry GETs of metadata: ` bytes in ` requests", m_meta_owner.bytes,
+                     m_meta_owner.requests);
         return m_file->close();
     }
 
@@ -75,20 +97,55 @@ public:
 
     ssize_t pwritev(const struct iovec *iov, int iovcnt,
                     off_t offset) override {
+        SCOPE_TRACE("image");
         if (read_only) {
             LOG_ERROR_RETURN(EROFS, -1, "writing read only file");
         }
-        return m_file->pwritev(iov, iovcnt, offset);
+        auto ret = m_file->pwritev(iov, iovcnt, offset);
+        account_upper();
+        return ret;
     }
 
     ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
-        return m_file->preadv(iov, iovcnt, offset);
+        SCOPE_TRACE("image");
+        auto start = photon::now;
+        if (m_readahead)
+            m_readahead->on_read(offset, iovector_view((iovec *)iov, iovcnt).sum());
+        ssize_t ret = m_direct ? preadv_direct(iov, iovcnt, offset) : -1;
+        if (ret < 0) {
+            // reads of the metadata of the guest fs are not held back by
+            // the bulk of the data, in the registry or by the throttle
+            auto count = iovector_view((iovec *)iov, iovcnt).sum();
+            if (!m_metadata.empty() && m_metadata.overlaps(offset, count)) {
+                FileSystem::registryfs_set_io_owner(&m_meta_owner);
+                ret = (m_unthrottled ? m_unthrottled : m_file)->preadv(iov, iovcnt, offset);
+            } else {
+                FileSystem::registryfs_set_io_owner(&m_fg_owner);
+                ret = m_file->preadv(iov, iovcnt, offset);
+            }
+        }
+        if (image_service.download_scheduler)
+            image_service.download_scheduler->on_read(photon::now - start);
+        return ret;
     }
 
     int fdatasync() override { return m_file->fdatasync(); }
 
     int fallocate(int mode, off_t offset, off_t len) override {
-        return m_file->fallocate(mode, offset, len);
+        if (read_only) {
+            LOG_ERROR_RETURN(EROFS, -1, "discarding read only file");
+        }
+        auto ret = m_file->fallocate(mode, offset, len);
+        account_upper();
+        return ret;
+    }
+
+    // the memory of the index of the upper layer, written by the guest, is
+    // accounted to `device` from now on
+    void account_memory(const std::string &device) {
+        if (m_rw_file)
+            m_upper_account.reset(new Memory::Account("upper_index", device));
+        account_upper();
     }
 
     void set_auth_failed();
@@ -102,21 +159,99 @@ public:
     uint64_t num_lbas;
     uint32_t block_size;
     bool read_only = false;
+    // writes are cached in memory, and durable only once fdatasync()ed
+    bool write_cache = false;
+    // a trace of the reads is being recorded
+    bool recording = false;
+    // reads of adjacent LBAs pending at once are merged before being read
+    bool merge_reads = false;
+    const bool replica;
+
+    // registry GETs made for guest reads, and for background download and
+    // prefetch replay, respectively, and for guest reads of metadata, urgent
+    FileSystem::RegistryIOOwner m_fg_owner, m_bg_owner, m_meta_owner;
+
+    // time taken by the phases of opening the image, in us; the upper layer
+    // is opened, and the trace reloaded, while the lowers are being opened
+    struct OpenTiming {
+        uint64_t prefetcher = 0;   // creating the prefetcher
+        uint64_t lower_files = 0;  // opening the files of the lowers
+        uint64_t lower_index = 0;  // loading and merging the indexes of the lowers
+        uint64_t upper = 0;        // opening the upper layer, with its index
+        uint64_t stack = 0;        // stacking the upper on the lowers
+        uint64_t trace_reload = 0; // reloading the trace to replay
+        uint64_t total = 0;
+    } open_timing;
 
 private:
     FileSystem::Prefetcher* m_prefetcher = nullptr;
     ImageConfigNS::ImageConfig conf;
     std::list<BKDL::BkDownload *> dl_list;
-    photon::join_handle *dl_thread_jh = nullptr;
+    photon::join_handle *compact_thread_jh = nullptr;
+    // the ranges of the lowers hinted to be prefetched, and their workers
+    std::list<std::pair<off_t, size_t>> m_hints;
+    std::vector<photon::join_handle *> hint_jhs;
+    // the streams of guest reads detected, whose ranges ahead are prefetched
+    // from the lowers by workers joined along with those of the hints
+    Readahead::StreamDetector *m_readahead = nullptr;
+    // the reads of the layers, saved periodically by a worker joined along
+    // with those of the hints, and once it quits
+    std::unique_ptr<Heatmap::ImageHeatmap> m_heatmap;
+    // the regions of the metadata of the guest fs, read ahead of the others,
+    // from the file under the throttle, if throttled
+    Metadata::Regions m_metadata;
+    FileSystem::IFile *m_unthrottled = nullptr;
+    // the lower holding the data of the acceleration layer, fetched once
+    // the image is opened, if any
+    int m_accel_index = -1;
+    FileSystem::IFile *m_accel_file = nullptr;
+    LSMT::IFileRW *m_rw_file = nullptr;
+    // the data of the upper layer is compressed, and so is that compacted
+    bool m_upper_compressed = false;
+    // the sealed layers, read directly where they are local files
+    LSMT::IFileRO *m_direct = nullptr;
     ImageService &image_service;
+    std::unique_ptr<Memory::Account> m_upper_account;
+
+    // a mapping in the index of the upper takes a node of the set, of about
+    // UPPER_MAPPING_BYTES along with the mapping itself
+    static const int64_t UPPER_MAPPING_BYTES = 48;
+    void account_upper() {
+        if (m_upper_account)
+            m_upper_account->set(m_rw_file->index()->size() * UPPER_MAPPING_BYTES);
+    }
 
     int init_image_file();
     void set_failed(std::string reason);
+    LSMT::IFileRO *open_shared_lowers(std::vector<FileSystem::IFile *> &files,
+                                      const std::vector<UUID> &uuids, const std::string &key,
+                                      bool &loading);
+    LSMT::IFileRO *open_merged_index(std::vector<FileSystem::IFile *> &files,
+                                     const std::string &path);
+    LSMT::IFileRO *load_lowers(std::vector<FileSystem::IFile *> &files);
     LSMT::IFileRO *open_lowers(std::vector<ImageConfigNS::LayerConfig> &,
                                bool &);
     LSMT::IFileRW *open_upper(ImageConfigNS::UpperConfig &);
+    void open_upper_proc(ImageConfigNS::UpperConfig &, LSMT::IFileRW **);
+    LSMT::IFileRW *open_promoted(LSMT::IFileRO *lower, size_t nlowers);
+    void promote_file(LSMT::IFileRO *image, LSMT::IFileRO *lower, size_t nlowers);
     FileSystem::IFile *__open_ro_file(const std::string &);
-    FileSystem::IFile *__open_ro_remote(const std::string &dir,
-                                        const std::string &, const uint64_t, int);
+    FileSystem::IFile *__open_ro_remote(ImageConfigNS::LayerConfig &, int);
+    FileSystem::IFile *__open_ro_verified(const std::string &url, ImageConfigNS::LayerConfig &,
+                                          bool uncompressed);
+    void throttle_file();
+    void load_metadata_regions();
+    ssize_t preadv_direct(const struct iovec *iov, int iovcnt, off_t offset);
     void start_bk_dl_thread();
+    void start_compaction_thread();
+    void start_hint_threads(FileSystem::IFile *lower);
+    void hint_proc(FileSystem::IFile *lower);
+    void start_readahead_threads(FileSystem::IFile *lower);
+    void readahead_proc(FileSystem::IFile *lower);
+    void start_heatmap(LSMT::IFileRO *file,
+                       const std::vector<ImageConfigNS::LayerConfig> &lowers);
+    void heatmap_proc();
+    void accel_proc(FileSystem::IFile *accel);
+    void compaction_proc();
+    int compact_upper();
 };
@@ -18,17 +18,29 @@
 #include "image_file.h"
 #include "overlaybd/alog-stdstring.h"
 #include "overlaybd/alog.h"
+#include "overlaybd/alog-audit.h"
 #include "overlaybd/base64.h"
+#include "overlaybd/fs/aligned-file.h"
 #include "overlaybd/fs/cache/cache.h"
 #include "overlaybd/fs/filesystem.h"
+#include "overlaybd/fs/forwardfs.h"
 #include "overlaybd/fs/localfs.h"
+#include "overlaybd/fs/lsmt/file.h"
+#include "overlaybd/fs/p2p/p2p.h"
+#include "overlaybd/fs/remote-emulator.h"
+#include "overlaybd/fs/registryfs/digest.h"
 #include "overlaybd/fs/registryfs/registryfs.h"
 #include "overlaybd/fs/tar_file.h"
+#include "overlaybd/fs/throttled-file.h"
 #include "overlaybd/fs/zfile/zfile.h"
+#include "overlaybd/memory.h"
+#include "overlaybd/net/curl.h"
+#include "overlaybd/photon/syncio/iouring-wrapper.h"
 #include "overlaybd/photon/thread.h"
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <algorithm>
 #include <limits.h>
 #include <string>
 #include <sys/types.h>
@@ -135,26 +147,78 @@ int load_cred_from_file(const std::string path, const std::string &remote_path,
     return -1;
 }
 
+// the services of the vcpus share the group, created by the first of them,
+// which lasts as long as the process
+static FileSystem::ThrottleGroup *node_throttle_group(ImageConfigNS::ThrottleConfig conf) {
+    static FileSystem::ThrottleGroup *group = [&]() -> FileSystem::ThrottleGroup * {
+        if (!conf.IOPS() && !conf.MBps())
+            return nullptr;
+        FileSystem::ThrottleLimits::Share limits;
+        limits.IOPS = conf.IOPS();
+        limits.throughput = (uint64_t)conf.MBps() << 20;
+        limits.burst = conf.burstSec();
+        LOG_INFO("throttle the devices of the node to ` IOPS, ` MB/s, bursting for ` s",
+                 conf.IOPS(), conf.MBps(), conf.burstSec());
+        return FileSystem::new_throttle_group(limits);
+    }();
+    return group;
+}
+
+// blobs of a local directory served as if by a registry, for performance tests
+// to be reproducible without the network
+static FileSystem::IFileSystem *new_registry_emulator(ImageConfigNS::RegistryEmulatorConfig conf) {
+    FileSystem::RemoteEmulatorOptions options;
+    options.rtt_median = conf.rttMedianUs();
+    options.rtt_p99 = conf.rttP99Us();
+    options.bandwidth = (uint64_t)conf.connectionMBps() << 20;
+    options.error_ppm = conf.errorPPM();
+    options.max_connections = conf.maxConnections();
+    options.seed = conf.seed();
+    auto blobs = FileSystem::new_localfs_adaptor(conf.blobDir().c_str());
+    if (blobs == nullptr)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to open blob dir `", conf.blobDir());
+    LOG_INFO("emulate the registry with blobs of `, RTT ` us (p99 ` us), ` MB/s, ` connections",
+             conf.blobDir(), conf.rttMedianUs(), conf.rttP99Us(), conf.connectionMBps(),
+             conf.maxConnections());
+    return FileSystem::new_remote_emulator_fs(blobs, options, true);
+}
+
 int ImageService::read_global_config_and_set() {
     if (!global_conf.ParseJSON(DEFAULT_CONFIG_PATH)) {
         LOG_ERROR_RETURN(0, -1, "error parse global config json: `",
                          DEFAULT_CONFIG_PATH);
     }
     uint32_t ioengine = global_conf.ioEngine();
-    if (ioengine > 2) {
+    if (ioengine > 3) {
         LOG_ERROR_RETURN(0, -1, "unknown io_engine: `", ioengine);
     }
 
     LOG_INFO("global config: cache_dir: `, cache_size_GB: `",
              global_conf.registryCacheDir(), global_conf.registryCacheSizeGB());
 
+    throttle_group = node_throttle_group(global_conf.throttle());
+
+    // logging has been set up by the service of the main vcpu
+    if (m_cache_shard >= 0)
+        return 0;
+
     if (global_conf.enableAudit()) {
         std::string auditPath = global_conf.auditPath();
+        if (global_conf.auditRingPath() != "") {
+            if (audit_ring_open(global_conf.auditRingPath().c_str(),
+                                global_conf.auditRingRecords()) < 0)
+                LOG_WARN("failed to open audit ring `, audit in text",
+                         global_conf.auditRingPath());
+        }
         if (auditPath == "") {
             LOG_WARN("empty audit path, ignore audit");
         } else {
             LOG_INFO("set audit_path:`", global_conf.auditPath());
             default_audit_logger.log_output = new_log_output_file(global_conf.auditPath().c_str(), LOG_SIZE_MB, LOG_NUM);
+            if (default_audit_logger.log_output && global_conf.logAsyncRingKB())
+                default_audit_logger.log_output = new_async_log_output(
+                    default_audit_logger.log_output,
+                    (size_t)global_conf.logAsyncRingKB() << 10, true);
         }
     } else {
         LOG_INFO("audit disabled");
@@ -163,12 +227,84 @@ int ImageService::read_global_config_and_set() {
     set_log_output_level(global_conf.logLevel());
     LOG_INFO("set log_level:`", global_conf.logLevel());
 
+    ZFile::zfile_set_block_cache_size((size_t)global_conf.zfileBlockCacheKB() << 10);
+    LOG_INFO("set zfile block cache size: `KB", global_conf.zfileBlockCacheKB());
+    ZFile::zfile_set_readahead_size((size_t)global_conf.zfileReadaheadKB() << 10);
+    LOG_INFO("set zfile readahead size: `KB", global_conf.zfileReadaheadKB());
+    ZFile::zfile_set_decompress_threads(global_conf.zfileDecompressThreads());
+    LOG_INFO("set zfile decompress threads: `", global_conf.zfileDecompressThreads());
+    ZFile::zfile_set_lazy_jump_table(global_conf.zfileLazyJumpTable());
+    LOG_INFO("set zfile lazy jump table: `", global_conf.zfileLazyJumpTable());
+    ZFile::zfile_set_verify_once(global_conf.zfileVerifyOnce());
+    LOG_INFO("set zfile verify once: `", global_conf.zfileVerifyOnce());
+    FileSystem::digest_set_hash_threads(global_conf.hashThreads());
+    LSMT::set_mmap_index(global_conf.mmapIndex());
+    LOG_INFO("set mmap index: `", global_conf.mmapIndex());
+    LSMT::set_combo_index_merged(global_conf.mergeUpperIndex());
+    LOG_INFO("set merge upper index: `", global_conf.mergeUpperIndex());
+    Memory::set_budget((uint64_t)global_conf.memoryBudgetMB() << 20);
+    LOG_INFO("set memory budget: `MB", global_conf.memoryBudgetMB());
+
     if (global_conf.logPath() != "") {
         LOG_INFO("set log_path:`", global_conf.logPath());
         int ret = log_output_file(global_conf.logPath().c_str(), LOG_SIZE_MB, LOG_NUM);
         if (ret != 0) {
             LOG_ERROR_RETURN(0, -1, "log_output_file failed, errno:`", errno);
         }
+        // lines are written by a background thread, dropped if the ring is full
+        if (global_conf.logAsyncRingKB()) {
+            log_output = new_async_log_output(log_output,
+                                              (size_t)global_conf.logAsyncRingKB() << 10);
+            LOG_INFO("log asynchronously, with a ring of `KB per thread",
+                     global_conf.logAsyncRingKB());
+        }
+    }
+    return 0;
+}
+
+int ImageService::reload_global_config() {
+    ImageConfigNS::GlobalConfig conf;
+    if (!conf.ParseJSON(DEFAULT_CONFIG_PATH))
+        LOG_ERROR_RETURN(0, -1, "error parse global config json: `, nothing reloaded",
+                         DEFAULT_CONFIG_PATH);
+
+    if (m_cache_shard < 0) {
+        set_log_output_level(conf.logLevel());
+        LOG_INFO("reload log_level:`", conf.logLevel());
+        Memory::set_budget((uint64_t)conf.memoryBudgetMB() << 20);
+        LOG_INFO("reload memory budget: `MB", conf.memoryBudgetMB());
+        auto throttle = conf.throttle();
+        if (throttle_group) {
+            FileSystem::ThrottleLimits::Share limits;
+            limits.IOPS = throttle.IOPS();
+            limits.throughput = (uint64_t)throttle.MBps() << 20;
+            limits.burst = throttle.burstSec();
+            FileSystem::set_throttle_group_limits(throttle_group, limits);
+            LOG_INFO("reload throttle of the node: ` IOPS, ` MB/s, bursting for ` s",
+                     throttle.IOPS(), throttle.MBps(), throttle.burstSec());
+        } else if (throttle.IOPS() || throttle.MBps()) {
+            LOG_WARN("the node is not throttled since start, restart to throttle it");
+        }
+    }
+
+    auto cached_fs = dynamic_cast<FileSystem::ICachedFileSystem *>(global_fs.remote_fs);
+    auto pool = cached_fs ? cached_fs->get_pool() : nullptr;
+    if (pool) {
+        uint64_t cache_size_GB = conf.registryCacheSizeGB();
+        if (m_cache_shard >= 0)
+            cache_size_GB = std::max(cache_size_GB / global_conf.vcpuNum(), 1UL);
+        if (pool->set_capacity(cache_size_GB << 30) < 0)
+            LOG_ERROR("failed to set cache capacity to ` GB, `:`", cache_size_GB, errno,
+                      strerror(errno));
+        for (auto &quota : conf.registryCacheQuotas())
+            set_cache_quota(quota.group(), quota.sizeGB());
+    }
+
+    if (download_scheduler) {
+        download_scheduler->set_limits(conf.downloadTotalMBps(),
+                                       conf.downloadPauseLatencyMs() * 1000UL);
+        LOG_INFO("reload background download limit: ` MB/s, paused over ` ms reads",
+                 conf.downloadTotalMBps(), conf.downloadPauseLatencyMs());
     }
     return 0;
 }
@@ -213,21 +349,93 @@ int ImageService::init() {
         return -1;
     }
 
-    if (create_dir(global_conf.registryCacheDir().c_str()) == false)
+    // each vcpu submits to an io_uring of its own
+    bool iouring = global_conf.ioEngine() == IOEngineType::io_engine_iouring;
+    if (iouring && photon::iouring_wrapper_init() < 0)
+        LOG_WARN("failed to init io_uring, local I/O falls back to blocking syscalls");
+
+    // with multiple vcpus, images are served by the services of worker vcpus
+    if (m_cache_shard < 0 && global_conf.vcpuNum() > 1) {
+        LOG_INFO("images are served by ` worker vcpus", global_conf.vcpuNum());
+        return 0;
+    }
+
+    std::string cache_dir = global_conf.registryCacheDir();
+    uint64_t cache_size_GB = global_conf.registryCacheSizeGB();
+    uint64_t mem_cache_size_MB = global_conf.registryMemCacheSizeMB();
+    std::string fast_cache_dir = global_conf.registryFastCacheDir();
+    uint64_t fast_cache_size_GB = global_conf.registryFastCacheSizeGB();
+    if (create_dir(cache_dir.c_str()) == false)
         return -1;
+    if (!fast_cache_dir.empty() && create_dir(fast_cache_dir.c_str()) == false)
+        return -1;
+    if (m_cache_shard >= 0) {
+        cache_dir += "/vcpu" + std::to_string(m_cache_shard);
+        cache_size_GB = std::max(cache_size_GB / global_conf.vcpuNum(), 1UL);
+        mem_cache_size_MB /= global_conf.vcpuNum();
+        if (create_dir(cache_dir.c_str()) == false)
+            return -1;
+        if (!fast_cache_dir.empty()) {
+            fast_cache_dir += "/vcpu" + std::to_string(m_cache_shard);
+            fast_cache_size_GB = std::max(fast_cache_size_GB / global_conf.vcpuNum(), 1UL);
+            if (create_dir(fast_cache_dir.c_str()) == false)
+                return -1;
+        }
+    }
+    // tiny files, which the cache may evict like the others, to be saved again
+    tar_index_dir = cache_dir + "/tar_index";
+    if (create_dir(tar_index_dir.c_str()) == false) {
+        LOG_WARN("failed to create `, tar members are not saved", tar_index_dir);
+        tar_index_dir.clear();
+    }
+    // not sharded, as a device may be served by another vcpu after a restart
+    merged_index_dir = global_conf.registryCacheDir() + "/merged_index";
+    if (create_dir(merged_index_dir.c_str()) == false) {
+        LOG_WARN("failed to create `, merged indexes are not saved", merged_index_dir);
+        merged_index_dir.clear();
+    }
 
     if (global_fs.remote_fs == nullptr) {
-        auto cafile = "/etc/ssl/certs/ca-bundle.crt";
-        if (access(cafile, 0) != 0) {
-            cafile = "/etc/ssl/certs/ca-certificates.crt";
+        FileSystem::IFileSystem *registry_fs;
+        if (!global_conf.registryEmulator().blobDir().empty()) {
+            registry_fs = new_registry_emulator(global_conf.registryEmulator());
+        } else {
+            auto cafile = "/etc/ssl/certs/ca-bundle.crt";
             if (access(cafile, 0) != 0) {
-                LOG_ERROR_RETURN(0, -1, "no certificates found.");
+                cafile = "/etc/ssl/certs/ca-certificates.crt";
+                if (access(cafile, 0) != 0) {
+                    LOG_ERROR_RETURN(0, -1, "no certificates found.");
+                }
             }
-        }
 
-        LOG_INFO("create registryfs with cafile:`", cafile);
-        auto registry_fs = FileSystem::new_registryfs_with_credential_callback(
-            {this, &ImageService::reload_auth}, cafile, 30UL * 1000000);
+            FileSystem::registryfs_set_chunked_get((size_t)global_conf.registryChunkKB() << 10,
+                                                   global_conf.registryParallelism());
+            LOG_INFO("set registry chunk size: `KB, parallelism: `", global_conf.registryChunkKB(),
+                     global_conf.registryParallelism());
+            FileSystem::registryfs_set_coalescing((size_t)global_conf.registryCoalesceGapKB() << 10,
+                                                  (size_t)global_conf.registryCoalesceMaxKB() << 10,
+                                                  global_conf.registryCoalesceInflight());
+            FileSystem::registryfs_set_hedging(global_conf.registryHedgePercentile());
+            FileSystem::registryfs_set_max_concurrent_gets(global_conf.registryMaxConcurrentGets());
+            for (auto &mirror : global_conf.registryMirrors()) {
+                for (auto &endpoint : mirror.endpoints()) {
+                    LOG_INFO("add mirror ` of registry `", endpoint, mirror.registry());
+                    FileSystem::registryfs_add_mirror(mirror.registry().c_str(), endpoint.c_str());
+                }
+            }
+            if (global_conf.registryHTTP2() && Net::libcurl_set_http2(true) == 0)
+                LOG_INFO("multiplex registry requests over HTTP/2");
+            FileSystem::registryfs_set_native_get(global_conf.registryNativeGet());
+            FileSystem::registryfs_set_fetch_size((size_t)global_conf.registryFetchMinKB() << 10,
+                                                  (size_t)global_conf.registryFetchMaxKB() << 10);
+            auto auth_cache_file = global_conf.registryAuthCacheFile();
+            if (!auth_cache_file.empty() && m_cache_shard >= 0)
+                auth_cache_file += ".vcpu" + std::to_string(m_cache_shard);
+            LOG_INFO("create registryfs with cafile:`, auth cache file:`", cafile, auth_cache_file);
+            registry_fs = FileSystem::new_registryfs_with_credential_callback(
+                {this, &ImageService::reload_auth}, cafile, 30UL * 1000000,
+                auth_cache_file.c_str());
+        }
         if (registry_fs == nullptr) {
             LOG_ERROR_RETURN(0, -1, "create registryfs failed.");
         }
@@ -238,35 +446,253 @@ int ImageService::init() {
             LOG_ERROR_RETURN(0, -1, "create tar_fs failed.");
         }
 
-        auto registry_cache_fs = FileSystem::new_localfs_adaptor(
-            global_conf.registryCacheDir().c_str());
+        // blob ranges are asked from the peers before the registry
+        FileSystem::IFileSystem *src_fs = tar_fs;
+        if (!global_conf.p2pPeers().empty()) {
+            src_fs = FileSystem::new_p2p_fs(tar_fs, global_conf.p2pPeers(),
+                                            global_conf.p2pMaxTries(),
+                                            global_conf.p2pTimeoutMs() * 1000UL,
+                                            global_conf.p2pToken().c_str());
+            if (src_fs == nullptr) {
+                delete tar_fs;
+                LOG_ERROR_RETURN(0, -1, "create p2p_fs failed.");
+            }
+            LOG_INFO("fetch from ` peers first", global_conf.p2pPeers().size());
+        }
+
+        m_refill_alloc = m_refill_allocator.get_io_alloc();
+        if (global_conf.refillHugePageMB()) {
+            if (m_refill_huge_allocator.init((size_t)global_conf.refillHugePageMB() << 20) == 0) {
+                m_refill_alloc = m_refill_huge_allocator.get_io_alloc();
+                m_refill_huge_account.set((int64_t)global_conf.refillHugePageMB() << 20);
+                LOG_INFO("refill buffers carved from ` MB of `", global_conf.refillHugePageMB(),
+                         m_refill_huge_allocator.hugetlb() ? "hugetlbfs" : "transparent hugepages");
+            } else {
+                LOG_WARN("failed to map ` MB for refill buffers, pooled ones are used, errno `",
+                         global_conf.refillHugePageMB(), errno);
+            }
+        }
+
+        // cache files are buffered, which io_uring handles asynchronously as well;
+        // with registryCacheDirectIO, they bypass the page cache of the host, by
+        // libaio or io_uring, accessed in blocks aligned by bounce buffers of the
+        // refill allocator where the reads and writes are not aligned
+        int cache_io_engine = iouring ? FileSystem::ioengine_iouring : FileSystem::ioengine_psync;
+        bool cache_direct = global_conf.registryCacheDirectIO();
+        if (cache_direct) {
+            cache_io_engine = iouring ? FileSystem::ioengine_iouring | FileSystem::ioengine_direct
+                                      : FileSystem::ioengine_libaio;
+            LOG_INFO("cache files are accessed with O_DIRECT");
+        }
+        auto new_cache_fs = [&](const std::string &dir) -> FileSystem::IFileSystem * {
+            auto fs = FileSystem::new_localfs_adaptor(dir.c_str(), cache_io_engine);
+            if (fs && cache_direct) {
+                auto aligned = FileSystem::new_aligned_fs_adaptor(fs, 4096, true, true,
+                                                                  &m_refill_alloc);
+                if (!aligned)
+                    delete fs;
+                fs = aligned;
+            }
+            return fs;
+        };
+        auto registry_cache_fs = new_cache_fs(cache_dir);
         if (registry_cache_fs == nullptr) {
-            delete tar_fs;
+            delete src_fs;
             LOG_ERROR_RETURN(0, -1, "new_localfs_adaptor for ` failed",
-                             global_conf.registryCacheDir().c_str());
+                             cache_dir.c_str());
             return false;
         }
 
-        LOG_INFO("create cache with size: ` GB",
-                 global_conf.registryCacheSizeGB());
-        global_fs.remote_fs = FileSystem::new_full_file_cached_fs(
-            tar_fs, registry_cache_fs, 256 * 1024 /* refill unit 256KB */,
-            global_conf.registryCacheSizeGB() /*GB*/, 10000000,
-            (uint64_t)1048576 * 4096, nullptr);
+        FileSystem::IFileSystem *fast_cache_fs = nullptr;
+        if (!fast_cache_dir.empty()) {
+            fast_cache_fs = new_cache_fs(fast_cache_dir);
+            if (fast_cache_fs == nullptr) {
+                delete src_fs;
+                delete registry_cache_fs;
+                LOG_ERROR_RETURN(0, -1, "new_localfs_adaptor for ` failed",
+                                 fast_cache_dir.c_str());
+            }
+            LOG_INFO("create fast cache tier ` with size: ` GB", fast_cache_dir,
+                     fast_cache_size_GB);
+        }
 
-        if (global_fs.remote_fs == nullptr) {
-            delete tar_fs;
+        LOG_INFO("create cache ` with size: ` GB, memory tier: ` MB", cache_dir, cache_size_GB,
+                 mem_cache_size_MB);
+        auto cached_fs = FileSystem::new_full_file_cached_fs(
+            src_fs, registry_cache_fs, 256 * 1024 /* refill unit 256KB */,
+            cache_size_GB /*GB*/, 10000000,
+            (uint64_t)1048576 * 4096, &m_refill_alloc, mem_cache_size_MB << 20,
+            global_conf.registryMemCachePromoteHits(), global_conf.registryCachePolicy().c_str(),
+            global_conf.registryCacheEvictUnits(), global_conf.registryCacheAsyncRefill(),
+            global_conf.registryCacheByDigest(),
+            (uint64_t)global_conf.registryCacheEvictRateMB() << 20,
+            global_conf.registryCacheAdmitHits(), fast_cache_fs, fast_cache_size_GB,
+            global_conf.registryFastCachePromoteHits(),
+            global_conf.registryCacheMmap() && !cache_direct);
+
+        if (cached_fs == nullptr) {
+            delete src_fs;
             delete registry_cache_fs;
+            delete fast_cache_fs;
             LOG_ERROR_RETURN(0, -1,
                              "create remotefs (registryfs + cache) failed.");
         }
+        global_fs.remote_fs = cached_fs;
+        for (auto &quota : global_conf.registryCacheQuotas())
+            set_cache_quota(quota.group(), quota.sizeGB());
         global_fs.cachefs = registry_cache_fs;
+        global_fs.fast_cachefs = fast_cache_fs;
         global_fs.srcfs = registry_fs;
+
+        if (global_conf.p2pPort() > 0) {
+            // each vcpu serves its own cache shard on a port of its own
+            auto port = global_conf.p2pPort() + std::max(m_cache_shard, 0);
+            m_p2p_server = FileSystem::new_p2p_server(cached_fs->get_pool(), registry_cache_fs,
+                                                      port, global_conf.p2pToken().c_str());
+            if (m_p2p_server == nullptr)
+                LOG_WARN("failed to start P2P server on port `, not serving peers", port);
+        }
     }
+    download_scheduler = new BKDL::DownloadScheduler(global_conf.downloadTotalMBps(),
+                                                     global_conf.downloadPauseLatencyMs() * 1000UL);
+    LOG_INFO("background download limit of the node: ` MB/s, paused over ` ms reads",
+             global_conf.downloadTotalMBps(), global_conf.downloadPauseLatencyMs());
     return 0;
 }
 
-ImageFile *ImageService::create_image_file(const char *config_path) {
+struct ImageService::SharedLayer {
+    std::string digest;
+    FileSystem::IFile *file = nullptr; // nullptr while being opened, or failed
+    bool failed = false;
+    uint32_t refcnt = 0;
+    photon::condition_variable cond;
+};
+
+class ImageService::SharedLayerFile : public FileSystem::ForwardFile {
+public:
+    SharedLayerFile(ImageService *service, SharedLayer *layer)
+        : ForwardFile(layer->file), m_service(service), m_layer(layer) {
+    }
+    ~SharedLayerFile() {
+        m_service->release_shared_layer(m_layer);
+    }
+
+private:
+    ImageService *m_service;
+    SharedLayer *m_layer;
+};
+
+FileSystem::IFile *ImageService::open_shared_layer(const std::string &digest,
+                                                   const std::function<FileSystem::IFile *()> &open,
+                                                   bool &opened) {
+    opened = false;
+    auto it = m_layers.find(digest);
+    if (it != m_layers.end()) {
+        auto layer = it->second;
+        layer->refcnt++;
+        while (!layer->file && !layer->failed)
+            layer->cond.wait_no_lock();
+        if (layer->failed) {
+            release_shared_layer(layer);
+            LOG_ERROR_RETURN(EIO, nullptr, "failed to open shared layer `", digest);
+        }
+        LOG_DEBUG("layer ` shared by ` devices", digest, layer->refcnt);
+        return new SharedLayerFile(this, layer);
+    }
+
+    auto layer = new SharedLayer;
+    layer->digest = digest;
+    layer->refcnt = 1;
+    m_layers[digest] = layer;
+    layer->file = open();
+    if (!layer->file) {
+        int eno = errno;
+        // later devices may try again
+        m_layers.erase(digest);
+        layer->failed = true;
+        layer->cond.notify_all();
+        release_shared_layer(layer);
+        errno = eno;
+        return nullptr;
+    }
+    layer->cond.notify_all();
+    opened = true;
+    return new SharedLayerFile(this, layer);
+}
+
+void ImageService::set_cache_quota(const std::string &group, uint64_t sizeGB) {
+    auto cached_fs = dynamic_cast<FileSystem::ICachedFileSystem *>(global_fs.remote_fs);
+    auto pool = cached_fs ? cached_fs->get_pool() : nullptr;
+    if (!pool)
+        return;
+    uint64_t bytes = sizeGB << 30;
+    if (m_cache_shard >= 0)
+        bytes /= global_conf.vcpuNum();
+    if (pool->set_quota(group, bytes) < 0)
+        LOG_ERROR("failed to set cache quota of ` to ` GB, `:`", group, sizeGB, errno,
+                  strerror(errno));
+}
+
+void ImageService::release_shared_layer(SharedLayer *layer) {
+    if (--layer->refcnt > 0)
+        return;
+    auto it = m_layers.find(layer->digest);
+    if (it != m_layers.end() && it->second == layer)
+        m_layers.erase(it);
+    delete layer->file;
+    delete layer;
+}
+
+struct ImageService::SharedIndex {
+    std::weak_ptr<const LSMT::IMemoryIndex> index;
+    bool loading = false;
+    uint32_t waiters = 0;
+    photon::condition_variable cond;
+};
+
+// defined where SharedIndex is complete, for m_lower_indexes
+ImageService::ImageService(int cache_shard) : m_cache_shard(cache_shard) {
+}
+
+ImageService::~ImageService() {
+}
+
+std::shared_ptr<const LSMT::IMemoryIndex> ImageService::get_lower_index(const std::string &key) {
+    while (true) {
+        auto &shared = m_lower_indexes[key];
+        if (!shared)
+            shared.reset(new SharedIndex);
+        if (!shared->loading) {
+            auto index = shared->index.lock();
+            if (!index)
+                shared->loading = true;
+            return index;
+        }
+        shared->waiters++;
+        shared->cond.wait_no_lock();
+        shared->waiters--;
+    }
+}
+
+void ImageService::share_lower_index(const std::string &key,
+                                     std::shared_ptr<const LSMT::IMemoryIndex> index) {
+    auto it = m_lower_indexes.find(key);
+    if (it == m_lower_indexes.end())
+        return;
+    it->second->index = index;
+    it->second->loading = false;
+    it->second->cond.notify_all();
+    // forget the indexes released by all their devices
+    for (auto it = m_lower_indexes.begin(); it != m_lower_indexes.end();) {
+        auto &shared = it->second;
+        if (!shared->loading && !shared->waiters && shared->index.expired())
+            it = m_lower_indexes.erase(it);
+        else
+            ++it;
+    }
+}
+
+ImageFile *ImageService::create_image_file(const char *config_path, bool replica) {
     ImageConfigNS::GlobalConfig defaultDlCfg;
     if (!defaultDlCfg.ParseJSON(DEFAULT_CONFIG_PATH)) {
         LOG_WARN("default download config parse failed, ignore");
@@ -282,20 +708,22 @@ ImageFile *ImageService::create_image_file(const char *config_path) {
     }
 
     auto resFile = cfg.resultFile();
-    ImageFile *ret = new ImageFile(cfg, *this);
+    ImageFile *ret = new ImageFile(cfg, *this, replica);
     if (ret->m_status <= 0) {
         std::string data = "failed:" + ret->m_exception;
-        set_result_file(resFile, data);
+        if (!replica)
+            set_result_file(resFile, data);
         delete ret;
         return NULL;
     }
     std::string data = "success";
-    set_result_file(resFile, data);
+    if (!replica)
+        set_result_file(resFile, data);
     return ret;
 }
 
-ImageService *create_image_service() {
-    ImageService *ret = new ImageService();
+ImageService *create_image_service(int cache_shard) {
+    ImageService *ret = new ImageService(cache_shard);
     if (ret->init() < 0) {
         delete ret;
         return nullptr;
@@ -16,22 +16,40 @@
 
 #pragma once
 
+#include <functional>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include "config.h"
+#include "overlaybd/io-alloc.h"
+#include "overlaybd/memory.h"
 
 namespace FileSystem {
+class IFile;
 class IFileSystem;
+class IP2PServer;
+class ThrottleGroup;
+}
+
+namespace LSMT {
+class IMemoryIndex;
+}
+
+namespace BKDL {
+class DownloadScheduler;
 }
 
 typedef enum {
     io_engine_psync,
     io_engine_libaio,
-    io_engine_posixaio
+    io_engine_posixaio,
+    io_engine_iouring
 } IOEngineType;
 
 struct GlobalFs {
     FileSystem::IFileSystem *remote_fs = nullptr;
     FileSystem::IFileSystem *cachefs = nullptr;
+    FileSystem::IFileSystem *fast_cachefs = nullptr;
     FileSystem::IFileSystem *srcfs = nullptr;
 };
 
@@ -39,19 +57,71 @@ struct ImageFile;
 
 class ImageService {
 public:
-    ImageService() {}
+    // `cache_shard` >= 0 makes the service own a private partition of the
+    // registry cache, so that each worker vcpu can have its own service
+    ImageService(int cache_shard = -1);
+    ~ImageService();
     int init();
-    ImageFile *create_image_file(const char *config_path);
+    // apply the tunables of the global config file that can change at
+    // runtime to the service, and to the process by that of the main vcpu,
+    // keeping the others as they were at init(); nothing is changed if the
+    // file fails to be parsed
+    int reload_global_config();
+    // the result file is written unless it's a `replica`, see ImageFile
+    ImageFile *create_image_file(const char *config_path, bool replica = false);
     ImageConfigNS::GlobalConfig global_conf;
     struct GlobalFs global_fs;
+    // background downloads of the devices served by this service
+    BKDL::DownloadScheduler *download_scheduler = nullptr;
+    // the I/O shared by the devices of all vcpus, with `throttle`
+    FileSystem::ThrottleGroup *throttle_group = nullptr;
+    // where the members of tar-wrapped remote layers are saved, by digest
+    std::string tar_index_dir;
+    // where the merged indexes of lower layers are saved, by their UUIDs, for
+    // the devices attached again, e.g. after a restart, to reuse
+    std::string merged_index_dir;
+
+    // open the remote layer of `digest` with `open`, or share the one opened
+    // by another device of the service, waiting for it if being opened; the
+    // layer is closed along with the last of the files returned, and `opened`
+    // tells whether it was opened by this call
+    FileSystem::IFile *open_shared_layer(const std::string &digest,
+                                         const std::function<FileSystem::IFile *()> &open,
+                                         bool &opened);
+
+    // the merged index of lower layers shared by the devices of the service,
+    // keyed by the UUIDs of the layers; if there's none, nullptr is returned
+    // for the caller to load it, and the others of the key wait for it to
+    // share_lower_index(), which must follow, with nullptr if not loaded
+    std::shared_ptr<const LSMT::IMemoryIndex> get_lower_index(const std::string &key);
+    void share_lower_index(const std::string &key,
+                           std::shared_ptr<const LSMT::IMemoryIndex> index);
+
+    // the quota of `group` in the registry cache, split among the shards
+    void set_cache_quota(const std::string &group, uint64_t sizeGB);
 
 private:
     int read_global_config_and_set();
     std::pair<std::string, std::string> reload_auth(const char *remote_path);
     void set_result_file(std::string &filename, std::string &data);
+    int m_cache_shard;
+    // page-aligned and pooled buffers for cache refills, which registry data is
+    // received into and written to the cache files from, even with O_DIRECT
+    PooledAllocator<> m_refill_allocator;
+    // or carved from hugepages, with refillHugePageMB
+    HugePageAllocator<> m_refill_huge_allocator;
+    Memory::Account m_refill_huge_account{"refill_buffers"};
+    IOAlloc m_refill_alloc;
+    FileSystem::IP2PServer *m_p2p_server = nullptr;
+    struct SharedLayer;
+    class SharedLayerFile;
+    void release_shared_layer(SharedLayer *layer);
+    std::unordered_map<std::string, SharedLayer *> m_layers;
+    struct SharedIndex;
+    std::unordered_map<std::string, std::unique_ptr<SharedIndex>> m_lower_indexes;
 };
 
-ImageService *create_image_service();
+ImageService *create_image_service(int cache_shard = -1);
 
 int load_cred_from_file(const std::string path, const std::string &remote_path,
                         std::string &username, std::string &password);
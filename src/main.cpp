@@ -18,37 +18,127 @@
 #include "overlaybd/alog.h"
 #include "overlaybd/event-loop.h"
 #include "overlaybd/fs/filesystem.h"
+#include "overlaybd/identity-pool.h"
+#include "overlaybd/metrics.h"
 #include "overlaybd/net/curl.h"
+#include "overlaybd/net/http.h"
 #include "overlaybd/photon/syncio/aio-wrapper.h"
 #include "overlaybd/photon/syncio/fd-events.h"
+#include "overlaybd/photon/syncio/iouring-wrapper.h"
 #include "overlaybd/photon/syncio/signal.h"
+#include "overlaybd/photon/channel.h"
 #include "overlaybd/photon/thread-pool.h"
 #include "overlaybd/photon/thread.h"
+#include "overlaybd/photon/thread11.h"
+#include "overlaybd/trace.h"
 #include "libtcmu.h"
 #include "libtcmu_common.h"
 #include "scsi.h"
 #include "scsi_defs.h"
 #include "scsi_helper.h"
+#include "numa_helper.h"
+#include "metrics_server.h"
+#include <endian.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <scsi/scsi.h>
+#include <sys/eventfd.h>
 #include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 class TCMUDevLoop;
+class TCMUWorker;
+class CompletionBatcher;
 
 #define MAX_OPEN_FD 1048576
 
+// metrics of the reads or writes of a device, labeled by its uio name and
+// the config path of its image
+struct DevMetrics {
+    Metrics::Labels labels;
+    Metrics::Counter *ops, *bytes, *errors;
+    Metrics::Histogram *latency;
+
+    void init(const char *device, const char *image, const char *op) {
+        labels = {{"device", device}, {"image", image}, {"op", op}};
+        ops = Metrics::counter("overlaybd_device_ops_total", "Commands of devices", labels);
+        bytes = Metrics::counter("overlaybd_device_bytes_total", "Bytes of commands of devices",
+                                 labels);
+        errors = Metrics::counter("overlaybd_device_errors_total", "Failed commands of devices",
+                                  labels);
+        latency = Metrics::histogram("overlaybd_device_latency_seconds",
+                                     "Latency of commands of devices", labels);
+    }
+    void fini() {
+        Metrics::remove(labels);
+    }
+    void done(uint64_t start, size_t length, bool ok) {
+        ops->inc();
+        bytes->inc(length);
+        if (!ok)
+            errors->inc();
+        latency->observe(photon::now - start);
+    }
+};
+
+// a replica of the image file of a device, opened on another vcpu
+struct Replica {
+    TCMUWorker *worker;
+    ImageFile *file;
+};
+
 struct obd_dev {
     ImageFile *file;
     TCMUDevLoop *loop;
-    uint32_t aio_pending_wakeups;
+    TCMUWorker *worker; // the vcpu serving the device, nullptr for the main vcpu
+    std::vector<Replica> replicas; // sharing the reads of the device, if any
+    CompletionBatcher *batcher;
     uint32_t inflight;
+    DevMetrics reads, writes;
+};
+
+// a read handled by a replica, and completed back on the vcpu of the device
+struct RemoteRead : public photon::mpsc_node {
+    struct tcmulib_cmd *cmd;
+    ImageFile *file;
+    uint64_t offset;
+    size_t length;
+    uint64_t start;
+    ssize_t ret;
 };
 
 struct handle_args {
     struct tcmu_device *dev;
     struct tcmulib_cmd *cmd;
+    TCMUDevLoop *loop;
+};
+
+// reads of adjacent LBAs, sorted, read at once into their iovecs
+struct merged_read {
+    struct tcmu_device *dev;
+    std::vector<struct tcmulib_cmd *> cmds;
+    uint64_t offset;
 };
 
+static bool is_read_cmd(struct tcmulib_cmd *cmd) {
+    switch (cmd->cdb[0]) {
+    case READ_6:
+    case READ_10:
+    case READ_12:
+    case READ_16:
+        return true;
+    default:
+        return false;
+    }
+}
+
 class TCMULoop;
 TCMULoop *main_loop = nullptr;
 ImageService *imgservice = nullptr;
@@ -59,8 +149,9 @@ protected:
     struct tcmulib_context *ctx;
     int fd;
 
+    // by a multishot poll of the io_uring of the vcpu, if it has one
     int wait_for_readable(EventLoop *) {
-        auto ret = photon::wait_for_fd_readable(fd);
+        auto ret = photon::iouring_wait_for_fd_readable(fd);
         if (ret < 0) {
             if (errno == ETIMEDOUT) {
                 return 0;
@@ -85,16 +176,210 @@ public:
     ~TCMULoop() {
         loop->stop();
         delete loop;
+        photon::iouring_cancel_poll(fd);
     }
 
     void run() { loop->async_run(); }
 };
 
+// Completed commands are collected, and the kernel is notified by a single
+// tcmulib_processing_complete() per batch: when the batch is full, when no
+// more commands are in flight, or when the batching window expires.
+class CompletionBatcher {
+public:
+    static const uint32_t BATCH_SIZE = 32;
+    static const uint64_t WINDOW_US = 50;
+
+    explicit CompletionBatcher(struct tcmu_device *dev) : dev(dev) {
+        th = photon::thread_create11(&CompletionBatcher::run, this);
+        jh = photon::thread_enable_join(th);
+    }
+
+    ~CompletionBatcher() {
+        stopping = true;
+        cond.notify_one();
+        photon::thread_join(jh);
+    }
+
+    // `inflight` is the # of commands still being handled
+    void completed(uint32_t inflight) {
+        ++pending;
+        if (pending >= BATCH_SIZE || inflight == 0) {
+            flush();
+        } else if (!armed) {
+            armed = true;
+            cond.notify_one();
+        }
+    }
+
+    // the kernel is told by writing to the uio fd, as
+    // tcmulib_processing_complete() does, but queued to the io_uring of the
+    // vcpu if it has one, and submitted with those of the other devices;
+    // `sync` for the last one, written before the fd is closed
+    void flush(bool sync = false) {
+        static const uint32_t kick = 0;
+        if (pending == 0)
+            return;
+        pending = 0;
+        if (sync || photon::iouring_write_async(tcmu_dev_get_fd(dev), &kick, sizeof(kick)) < 0)
+            tcmulib_processing_complete(dev);
+    }
+
+protected:
+    struct tcmu_device *dev;
+    photon::thread *th;
+    photon::join_handle *jh;
+    photon::condition_variable cond;
+    uint32_t pending = 0;
+    bool armed = false;
+    bool stopping = false;
+
+    void run() {
+        while (!stopping) {
+            if (!armed) {
+                cond.wait_no_lock();
+                continue;
+            }
+            photon::thread_usleep(WINDOW_US);
+            armed = false;
+            flush();
+        }
+        flush(true);
+    }
+};
+
+// UNMAP and WRITE SAME may address much more than a regular write,
+// patterns are expanded into a buffer of this size before writing
+#define WRITE_SAME_BUF_SIZE (1024 * 1024)
+// the largest range a single UNMAP descriptor may discard, in bytes
+#define MAX_UNMAP_LEN (64UL * 1024 * 1024)
+// the reads of a device with replicas are striped over its vcpus by this size
+#define READ_STRIPE_SIZE (1024 * 1024)
+// adjacent reads pending at once are merged into reads of at most this size,
+// and of at most this # of commands
+#define MAX_MERGED_READ (1024 * 1024)
+#define MAX_MERGED_CMDS 32
+
+static inline uint16_t get_be16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return be16toh(v);
+}
+
+static inline uint32_t get_be32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+
+static inline uint64_t get_be64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return be64toh(v);
+}
+
+static bool lba_range_valid(ImageFile *file, uint64_t lba, uint64_t nlbas) {
+    return lba <= file->num_lbas && nlbas <= file->num_lbas - lba;
+}
+
+static bool is_zero_block(const char *buf, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (buf[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+static int discard_status(ImageFile *file, uint64_t lba, uint64_t nlbas) {
+    uint32_t bs = file->block_size;
+    if (file->fallocate(3, lba * bs, nlbas * bs) == 0)
+        return TCMU_STS_OK;
+    return errno == EROFS ? TCMU_STS_WR_ERR_INCOMPAT_FRMT : TCMU_STS_WR_ERR;
+}
+
+// every UNMAP block descriptor becomes a discarded (zeroed) segment in
+// the upper layer, leaving the lower layers untouched
+static int handle_unmap(struct tcmulib_cmd *cmd, ImageFile *file) {
+    uint16_t param_len = get_be16(&cmd->cdb[7]);
+    if (cmd->cdb[1] & 0x01) // ANCHOR
+        return TCMU_STS_INVALID_CDB;
+    if (param_len == 0)
+        return TCMU_STS_OK;
+    if (param_len < 8)
+        return TCMU_STS_INVALID_PARAM_LIST_LEN;
+
+    std::vector<uint8_t> param(param_len);
+    if (tcmu_memcpy_from_iovec(param.data(), param_len, cmd->iovec, cmd->iov_cnt) < param_len)
+        return TCMU_STS_INVALID_PARAM_LIST_LEN;
+    uint16_t desc_len = get_be16(&param[2]);
+    if (desc_len > param_len - 8)
+        return TCMU_STS_INVALID_PARAM_LIST_LEN;
+    if (desc_len % 16)
+        return TCMU_STS_INVALID_PARAM_LIST;
+
+    for (size_t off = 8; off < 8 + (size_t)desc_len; off += 16) {
+        uint64_t lba = get_be64(&param[off]);
+        uint32_t nlbas = get_be32(&param[off + 8]);
+        if (nlbas == 0)
+            continue;
+        if (!lba_range_valid(file, lba, nlbas))
+            return TCMU_STS_LBA_OUT_OF_RANGE;
+        auto ret = discard_status(file, lba, nlbas);
+        if (ret != TCMU_STS_OK)
+            return ret;
+    }
+    return TCMU_STS_OK;
+}
+
+// WRITE SAME with the UNMAP bit, or with an all-zero block, is a discard;
+// any other pattern is written out block by block
+static int handle_write_same(struct tcmulib_cmd *cmd, ImageFile *file) {
+    uint32_t bs = file->block_size;
+    uint64_t lba = tcmu_cdb_get_lba(cmd->cdb);
+    uint64_t nlbas = tcmu_cdb_get_xfer_length(cmd->cdb);
+    if (lba > file->num_lbas)
+        return TCMU_STS_LBA_OUT_OF_RANGE;
+    if (nlbas == 0) // to the end of the device
+        nlbas = file->num_lbas - lba;
+    if (!lba_range_valid(file, lba, nlbas))
+        return TCMU_STS_LBA_OUT_OF_RANGE;
+    if (nlbas == 0)
+        return TCMU_STS_OK;
+
+    if (cmd->cdb[1] & 0x08) // UNMAP
+        return discard_status(file, lba, nlbas);
+
+    if (tcmu_iovec_length(cmd->iovec, cmd->iov_cnt) < bs)
+        return TCMU_STS_INVALID_PARAM_LIST_LEN;
+    size_t buf_size = std::max((size_t)bs, (size_t)WRITE_SAME_BUF_SIZE / bs * bs);
+    void *buf = nullptr;
+    if (::posix_memalign(&buf, 4096, buf_size) != 0)
+        return TCMU_STS_NO_RESOURCE;
+    DEFER(free(buf));
+    tcmu_memcpy_from_iovec(buf, bs, cmd->iovec, cmd->iov_cnt);
+    if (is_zero_block((const char *)buf, bs))
+        return discard_status(file, lba, nlbas);
+
+    for (size_t i = bs; i < buf_size; i += bs)
+        memcpy((char *)buf + i, buf, bs);
+    off_t offset = lba * bs, end = (lba + nlbas) * bs;
+    while (offset < end) {
+        size_t count = std::min((off_t)buf_size, end - offset);
+        struct iovec iov = {buf, count};
+        if (file->pwritev(&iov, 1, offset) != (ssize_t)count) {
+            return errno == EROFS ? TCMU_STS_WR_ERR_INCOMPAT_FRMT : TCMU_STS_WR_ERR;
+        }
+        offset += count;
+    }
+    return TCMU_STS_OK;
+}
+
 void cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
     obd_dev *odev = (obd_dev *)tcmu_dev_get_private(dev);
     ImageFile *file = odev->file;
     size_t ret = -1;
     size_t length;
+    uint64_t start;
 
     switch (cmd->cdb[0]) {
     case INQUIRY:
@@ -138,24 +423,34 @@ void cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
     case READ_6:
     case READ_10:
     case READ_12:
-    case READ_16:
+    case READ_16: {
         length = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+        start = photon::now;
+        Trace::Request trace("read", tcmu_cdb_to_byte(dev, cmd->cdb), length);
         ret = file->preadv(cmd->iovec, cmd->iov_cnt,
                            tcmu_cdb_to_byte(dev, cmd->cdb));
+        odev->reads.done(start, length, ret == length);
         if (ret == length) {
             tcmulib_command_complete(dev, cmd, TCMU_STS_OK);
         } else {
             tcmulib_command_complete(dev, cmd, TCMU_STS_RD_ERR);
         }
         break;
+    }
 
     case WRITE_6:
     case WRITE_10:
     case WRITE_12:
     case WRITE_16:
         length = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+        start = photon::now;
         ret = file->pwritev(cmd->iovec, cmd->iov_cnt,
                             tcmu_cdb_to_byte(dev, cmd->cdb));
+        // a write with FUA is durable once completed, even if cached
+        if (ret == length && file->write_cache && cmd->cdb[0] != WRITE_6 &&
+            (cmd->cdb[1] & 0x08) && file->fdatasync() < 0)
+            ret = -1;
+        odev->writes.done(start, length, ret == length);
         if (ret == length) {
             tcmulib_command_complete(dev, cmd, TCMU_STS_OK);
         } else {
@@ -180,18 +475,13 @@ void cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
 
     case WRITE_SAME:
     case WRITE_SAME_16:
-        if (cmd->cdb[1] & 0x08) {
-            length = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
-            ret = file->fallocate(3, tcmu_cdb_to_byte(dev, cmd->cdb), length);
-            if (ret == 0) {
-                tcmulib_command_complete(dev, cmd, TCMU_STS_OK);
-            } else {
-                tcmulib_command_complete(dev, cmd, TCMU_STS_WR_ERR);
-            }
-        } else {
-            LOG_ERROR("unknown write_same command `", cmd->cdb[0]);
-            tcmulib_command_complete(dev, cmd, TCMU_STS_NOT_HANDLED);
-        }
+        ret = handle_write_same(cmd, file);
+        tcmulib_command_complete(dev, cmd, ret);
+        break;
+
+    case UNMAP:
+        ret = handle_unmap(cmd, file);
+        tcmulib_command_complete(dev, cmd, ret);
         break;
 
     case MAINTENANCE_IN:
@@ -205,41 +495,99 @@ void cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
         break;
     }
 
-    // call tcmulib_processing_complete(dev) if needed
-    ++odev->aio_pending_wakeups;
-    int wake_up = (odev->aio_pending_wakeups == 1) ? 1 : 0;
-    while (wake_up) {
-        tcmulib_processing_complete(dev);
-        photon::thread_yield();
-
-        if (odev->aio_pending_wakeups > 1) {
-            odev->aio_pending_wakeups = 1;
-            wake_up = 1;
-        } else {
-            odev->aio_pending_wakeups = 0;
-            wake_up = 0;
-        }
-    }
-
     odev->inflight--;
+    odev->batcher->completed(odev->inflight);
 }
 
-void *handle(void *args) {
-    handle_args *obj = (handle_args *)args;
-    cmd_handler(obj->dev, obj->cmd);
-    delete obj;
+// the commands are completed one by one, after read at once; each is read
+// and completed by itself if the merged read fails, so that only those
+// failing themselves fail
+void *handle_merged(void *args) {
+    auto m = (merged_read *)args;
+    DEFER(delete m);
+    photon::thread_set_group(photon::CURRENT, "tcmu handlers");
+    obd_dev *odev = (obd_dev *)tcmu_dev_get_private(m->dev);
+    std::vector<struct iovec> iov;
+    for (auto cmd : m->cmds)
+        iov.insert(iov.end(), cmd->iovec, cmd->iovec + cmd->iov_cnt);
+    size_t length = tcmu_iovec_length(iov.data(), iov.size());
+    auto start = photon::now;
+    ssize_t ret;
+    {
+        Trace::Request trace("read", m->offset, length);
+        ret = odev->file->preadv(iov.data(), iov.size(), m->offset);
+    }
+    for (auto cmd : m->cmds) {
+        if (ret != (ssize_t)length) {
+            cmd_handler(m->dev, cmd);
+            continue;
+        }
+        odev->reads.done(start, tcmu_iovec_length(cmd->iovec, cmd->iov_cnt), true);
+        tcmulib_command_complete(m->dev, cmd, TCMU_STS_OK);
+        odev->inflight--;
+        odev->batcher->completed(odev->inflight);
+    }
     return nullptr;
 }
 
+void *handle(void *args);
+
 class TCMUDevLoop {
+public:
+    // max # of idle handler threads and command slots kept by a device;
+    // both are created on demand beyond that, and idle ones are reclaimed
+    // by autoscale, so the pool follows the observed inflight depth
+    static const uint32_t POOL_CAPACITY = 256;
+    // handler threads kept alive even when idle, the most that may run at
+    // once, and the commands queued beyond that before the loop stops
+    // pulling from the ring
+    static const uint32_t MIN_HANDLERS = 8;
+    static const uint32_t MAX_HANDLERS = 1024;
+    static const uint32_t MAX_QUEUED = 1024;
+
+    void put_args(handle_args *args) {
+        args_pool.put(args);
+    }
+
 protected:
     EventLoop *loop;
     struct tcmu_device *dev;
     int fd;
-    photon::ThreadPool<32> threadpool;
+    photon::ThreadPoolBase *threadpool;
+    IdentityPool<handle_args, POOL_CAPACITY> args_pool;
+    // completions of the reads handled by the replicas, if any
+    photon::MPSCChannel *remote = nullptr;
+    photon::thread *completer = nullptr;
+    photon::join_handle *completer_jh = nullptr;
+    uint32_t nremote = 0;
+    bool stopping = false;
+    // the reads to merge, pulled from the ring by on_accept() at once
+    std::vector<struct tcmulib_cmd *> pending_reads;
+
+    bool dispatch_remote(obd_dev *odev, struct tcmulib_cmd *cmd);
+
+    void complete_remote() {
+        obd_dev *odev = (obd_dev *)tcmu_dev_get_private(dev);
+        while (!stopping || nremote > 0) {
+            // an interrupt may be missed by a thread not waiting yet
+            auto node = remote->recv(100 * 1000);
+            while (node) {
+                auto r = (RemoteRead *)node;
+                node = node->mpsc_next;
+                bool ok = r->ret == (ssize_t)r->length;
+                odev->reads.done(r->start, r->length, ok);
+                tcmulib_command_complete(dev, r->cmd, ok ? TCMU_STS_OK : TCMU_STS_RD_ERR);
+                delete r;
+                nremote--;
+                odev->inflight--;
+                odev->batcher->completed(odev->inflight);
+            }
+        }
+    }
 
+    // by a multishot poll of the io_uring of the vcpu, if it has one
     int wait_for_readable(EventLoop *) {
-        auto ret = photon::wait_for_fd_readable(fd);
+        auto ret = photon::iouring_wait_for_fd_readable(fd);
         if (ret < 0) {
             if (errno == ETIMEDOUT) {
                 return 0;
@@ -249,14 +597,69 @@ protected:
         return 1;
     }
 
+    void dispatch(struct tcmulib_cmd *cmd) {
+        auto args = args_pool.get();
+        *args = {dev, cmd, this};
+        // blocks when the queue is full, as backpressure to the ring;
+        // a command that can not be submitted is handled in place
+        if (threadpool->submit(&handle, args) < 0) {
+            LOG_WARN("failed to submit tcmu command, handle it in place");
+            handle(args);
+        }
+    }
+
+    // the reads pending, sorted by LBA, are dispatched in runs of adjacent
+    // ones, each as one read if it takes more than one command
+    void dispatch_reads() {
+        auto offset = [&](struct tcmulib_cmd *cmd) -> uint64_t {
+            return tcmu_cdb_to_byte(dev, cmd->cdb);
+        };
+        auto length = [](struct tcmulib_cmd *cmd) {
+            return tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+        };
+        std::sort(pending_reads.begin(), pending_reads.end(),
+                  [&](struct tcmulib_cmd *a, struct tcmulib_cmd *b) {
+                      return offset(a) < offset(b);
+                  });
+        for (size_t i = 0, j; i < pending_reads.size(); i = j) {
+            uint64_t begin = offset(pending_reads[i]);
+            uint64_t end = begin + length(pending_reads[i]);
+            for (j = i + 1; j < pending_reads.size() && j - i < MAX_MERGED_CMDS; j++) {
+                auto cmd = pending_reads[j];
+                if (offset(cmd) != end || end + length(cmd) - begin > MAX_MERGED_READ)
+                    break;
+                end += length(cmd);
+            }
+            if (j - i == 1) {
+                dispatch(pending_reads[i]);
+                continue;
+            }
+            auto m = new merged_read{
+                dev, {pending_reads.begin() + i, pending_reads.begin() + j}, begin};
+            if (threadpool->submit(&handle_merged, m) < 0) {
+                LOG_WARN("failed to submit merged tcmu reads, handle them in place");
+                handle_merged(m);
+            }
+        }
+        pending_reads.clear();
+    }
+
     int on_accept(EventLoop *) {
         struct tcmulib_cmd *cmd;
         obd_dev *odev = (obd_dev *)tcmu_dev_get_private(dev);
         tcmulib_processing_start(dev);
         while ((cmd = tcmulib_get_next_command(dev, 0)) != NULL) {
             odev->inflight++;
-            threadpool.thread_create(&handle, new handle_args{dev, cmd});
+            if (!odev->replicas.empty() && dispatch_remote(odev, cmd))
+                continue;
+            if (odev->file->merge_reads && is_read_cmd(cmd)) {
+                pending_reads.push_back(cmd);
+                continue;
+            }
+            dispatch(cmd);
         }
+        if (!pending_reads.empty())
+            dispatch_reads();
         return 0;
     }
 
@@ -265,16 +668,52 @@ public:
         : dev(dev), loop(new_event_loop({this, &TCMUDevLoop::wait_for_readable},
                                         {this, &TCMUDevLoop::on_accept})) {
         fd = tcmu_dev_get_fd(dev);
+        threadpool = photon::new_thread_pool(POOL_CAPACITY);
+        threadpool->set_limits(MIN_HANDLERS, MAX_HANDLERS, MAX_QUEUED);
+        threadpool->enable_autoscale();
+        args_pool.enable_autoscale();
     }
 
     ~TCMUDevLoop() {
         loop->stop();
         delete loop;
+        // waits for the reads still handled by the replicas
+        if (completer) {
+            stopping = true;
+            photon::thread_interrupt(completer);
+            photon::thread_join(completer_jh);
+            delete remote;
+        }
+        // the fd is closed by tcmulib, and may be reused by the next device
+        photon::fd_events_forget(fd);
+        photon::iouring_cancel_poll(fd);
+        photon::delete_thread_pool(threadpool);
     }
 
     void run() { loop->async_run(); }
+
+    // to hand reads to replicas, whose completions are sent back to a
+    // photon thread of the vcpu of the device
+    int enable_remote() {
+        if (remote)
+            return 0;
+        remote = photon::new_mpsc_channel();
+        if (!remote)
+            LOG_ERRNO_RETURN(0, -1, "failed to create the channel of remote completions");
+        completer = photon::thread_create11(&TCMUDevLoop::complete_remote, this);
+        completer_jh = photon::thread_enable_join(completer);
+        return 0;
+    }
 };
 
+void *handle(void *args) {
+    handle_args *obj = (handle_args *)args;
+    photon::thread_set_group(photon::CURRENT, "tcmu handlers");
+    cmd_handler(obj->dev, obj->cmd);
+    obj->loop->put_args(obj);
+    return nullptr;
+}
+
 static char *tcmu_get_path(struct tcmu_device *dev) {
     char *config = strchr(tcmu_dev_get_cfgstring(dev), '/');
     if (!config) {
@@ -286,7 +725,212 @@ static char *tcmu_get_path(struct tcmu_device *dev) {
     return config;
 }
 
-static int dev_open(struct tcmu_device *dev) {
+// accounting of photon threads on the calling vcpu, logged periodically
+static void enable_thread_stats(ImageService *imgservice) {
+    uint64_t interval = imgservice->global_conf.threadStatsIntervalSec();
+    if (interval)
+        photon::set_thread_stats(true, interval * 1000 * 1000);
+}
+
+// A worker vcpu is an OS thread running its own photon environment, with an
+// image service on a private partition of the registry cache. Devices are
+// sharded across worker vcpus, so that commands of different devices are
+// handled on different cores. The worker is driven by the main vcpu via call().
+class TCMUWorker {
+public:
+    ImageService *imgservice = nullptr;
+    uint32_t ndevs = 0; // # of devices served, maintained by the main vcpu
+    // the NUMA node the vcpu is bound to, and its index among the vcpus
+    // of the node, or -1 for pinning to core `id` regardless of nodes
+    const int node, node_index;
+
+    TCMUWorker(int id, int node = -1, int node_index = 0)
+        : node(node), node_index(node_index), id(id) {
+    }
+
+    ~TCMUWorker() {
+        stop();
+        if (evfd >= 0)
+            close(evfd);
+    }
+
+    int start() {
+        evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (evfd < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to create eventfd for vcpu `", id);
+        auto ready = m_ready.get_future();
+        th = std::thread(&TCMUWorker::run, this);
+        if (ready.get() < 0) {
+            stop();
+            LOG_ERROR_RETURN(0, -1, "failed to start vcpu `", id);
+        }
+        return 0;
+    }
+
+    void stop() {
+        if (!th.joinable())
+            return;
+        stopping = true;
+        notify();
+        th.join();
+    }
+
+    // run `func` in a photon thread of the worker vcpu,
+    // and wait for its completion in the calling photon thread
+    int call(std::function<void()> func) {
+        int done = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (done < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to create eventfd");
+        DEFER({
+            photon::fd_events_forget(done);
+            close(done);
+        });
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            tasks.push_back(new Task{std::move(func), done});
+        }
+        notify();
+        uint64_t x;
+        while (::read(done, &x, sizeof(x)) != sizeof(x))
+            photon::wait_for_fd_readable(done);
+        return 0;
+    }
+
+    // run `func` in a photon thread of the worker vcpu, without waiting for it
+    void post(std::function<void()> func) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            tasks.push_back(new Task{std::move(func), -1});
+        }
+        notify();
+    }
+
+protected:
+    struct Task {
+        std::function<void()> func;
+        int done; // eventfd to notify of completion, or -1
+    };
+
+    int id;
+    int evfd = -1;
+    std::thread th;
+    std::promise<int> m_ready;
+    std::atomic<bool> stopping{false};
+    std::mutex mtx;
+    std::vector<Task *> tasks;
+
+    void notify() {
+        uint64_t x = 1;
+        if (::write(evfd, &x, sizeof(x)) != sizeof(x))
+            LOG_ERRNO_RETURN(0, , "failed to notify vcpu `", id);
+    }
+
+    static void *exec(void *arg) {
+        auto task = (Task *)arg;
+        task->func();
+        DEFER(delete task);
+        uint64_t x = 1;
+        if (task->done >= 0 && ::write(task->done, &x, sizeof(x)) != sizeof(x))
+            LOG_ERRNO_RETURN(0, nullptr, "failed to notify task completion");
+        return nullptr;
+    }
+
+    void pin_to_core() {
+        if (node >= 0) {
+            if (numa_bind_thread(node, node_index) < 0)
+                LOG_WARN("failed to bind vcpu ` to numa node `", id, node);
+            return;
+        }
+        auto ncpu = std::thread::hardware_concurrency();
+        if (ncpu == 0)
+            return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(id % ncpu, &set);
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (ret != 0)
+            LOG_WARN("failed to pin vcpu ` to core `, ret `", id, id % ncpu, ret);
+    }
+
+    void run() {
+        pin_to_core();
+        photon::init();
+        DEFER(photon::fini());
+        photon::fd_events_init();
+        DEFER(photon::fd_events_fini());
+        photon::libaio_wrapper_init();
+        DEFER(photon::libaio_wrapper_fini());
+        Net::libcurl_init();
+        DEFER(Net::libcurl_fini());
+        DEFER(Net::http_fini());
+
+        imgservice = create_image_service(id);
+        m_ready.set_value(imgservice ? 0 : -1);
+        if (imgservice == nullptr)
+            return;
+        enable_thread_stats(imgservice);
+        DEFER(photon::set_thread_stats(false));
+        LOG_INFO("vcpu ` started", id);
+
+        std::vector<Task *> todo;
+        while (!stopping) {
+            photon::wait_for_fd_readable(evfd);
+            uint64_t x;
+            if (::read(evfd, &x, sizeof(x)) != sizeof(x))
+                continue;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                todo.swap(tasks);
+            }
+            for (auto task : todo)
+                photon::thread_create(&exec, task);
+            todo.clear();
+        }
+        LOG_INFO("vcpu ` stopped", id);
+    }
+};
+
+static std::vector<TCMUWorker *> workers;
+
+// reads are striped over the vcpu of the device and its replicas, so that
+// each of them caches only its own stripes of the image
+bool TCMUDevLoop::dispatch_remote(obd_dev *odev, struct tcmulib_cmd *cmd) {
+    if (!is_read_cmd(cmd))
+        return false;
+    uint64_t offset = tcmu_cdb_to_byte(dev, cmd->cdb);
+    auto i = offset / READ_STRIPE_SIZE % (odev->replicas.size() + 1);
+    if (i == 0)
+        return false;
+    auto &replica = odev->replicas[i - 1];
+    auto r = new RemoteRead;
+    r->cmd = cmd;
+    r->file = replica.file;
+    r->offset = offset;
+    r->length = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+    r->start = photon::now;
+    nremote++;
+    auto channel = remote;
+    replica.worker->post([r, channel]() {
+        r->ret = r->file->preadv(r->cmd->iovec, r->cmd->iov_cnt, r->offset);
+        channel->send(r);
+    });
+    return true;
+}
+
+// the NUMA node of the registry cache device, preferred by devices
+// without one configured, or -1
+static int cache_node = -1;
+
+// the NUMA node configured for the image at `config`, or else the one of
+// the cache device, -1 for any
+static int preferred_node(const char *config) {
+    ImageConfigNS::ImageConfig cfg;
+    if (config && cfg.ParseJSON(config) && cfg.numaNode() >= 0)
+        return cfg.numaNode();
+    return cache_node;
+}
+
+static int do_dev_open(struct tcmu_device *dev, ImageService *imgservice) {
     char *config = tcmu_get_path(dev);
     LOG_INFO("dev open `", config);
     if (!config) {
@@ -302,16 +946,24 @@ static int dev_open(struct tcmu_device *dev) {
     }
 
     obd_dev *odev = new obd_dev;
-    odev->aio_pending_wakeups = 0;
+    odev->worker = nullptr;
     odev->inflight = 0;
     odev->file = file;
+    odev->reads.init(tcmu_dev_get_uio_name(dev), config, "read");
+    odev->writes.init(tcmu_dev_get_uio_name(dev), config, "write");
+    file->account_memory(tcmu_dev_get_uio_name(dev));
 
     tcmu_dev_set_private(dev, odev);
     tcmu_dev_set_block_size(dev, file->block_size);
     tcmu_dev_set_num_lbas(dev, file->num_lbas);
-    tcmu_dev_set_unmap_enabled(dev, true);
-    tcmu_dev_set_write_cache_enabled(dev, false);
+    tcmu_dev_set_unmap_enabled(dev, !file->read_only);
+    if (!file->read_only) {
+        tcmu_dev_set_max_unmap_len(dev, MAX_UNMAP_LEN / file->block_size);
+        tcmu_dev_set_opt_unmap_gran(dev, 1, false);
+    }
+    tcmu_dev_set_write_cache_enabled(dev, file->write_cache);
 
+    odev->batcher = new CompletionBatcher(dev);
     odev->loop = new TCMUDevLoop(dev);
     odev->loop->run();
 
@@ -323,13 +975,117 @@ static int dev_open(struct tcmu_device *dev) {
     return 0;
 }
 
-static int close_cnt = 0;
-static void dev_close(struct tcmu_device *dev) {
+static void close_replicas(std::vector<Replica> &replicas) {
+    for (auto &r : replicas) {
+        r.worker->call([&]() {
+            r.file->close();
+            delete r.file;
+        });
+        r.worker->ndevs--;
+    }
+    replicas.clear();
+}
+
+// a read-only device is replicated on deviceVcpus - 1 other worker vcpus,
+// the least loaded ones, of the NUMA node of its own vcpu first, to share
+// its reads; it's served by its own vcpu alone if none can be opened
+static void open_replicas(struct tcmu_device *dev, TCMUWorker *home) {
+    obd_dev *odev = (obd_dev *)tcmu_dev_get_private(dev);
+    size_t n = std::min((size_t)imgservice->global_conf.deviceVcpus(), workers.size());
+    if (n <= 1 || !odev->file->read_only || odev->file->recording)
+        return;
+    std::vector<TCMUWorker *> candidates;
+    for (auto w : workers) {
+        if (w != home)
+            candidates.push_back(w);
+    }
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [home](TCMUWorker *a, TCMUWorker *b) {
+                         bool local_a = a->node == home->node, local_b = b->node == home->node;
+                         return local_a != local_b ? local_a : a->ndevs < b->ndevs;
+                     });
+    char *config = tcmu_get_path(dev);
+    std::vector<Replica> replicas;
+    for (auto w : candidates) {
+        if (replicas.size() + 1 >= n)
+            break;
+        ImageFile *file = nullptr;
+        w->call([&]() { file = w->imgservice->create_image_file(config, true); });
+        if (!file) {
+            LOG_WARN("failed to open a replica of `", config);
+            continue;
+        }
+        replicas.push_back({w, file});
+        w->ndevs++;
+    }
+    if (replicas.empty())
+        return;
+    int ret = -1;
+    home->call([&]() {
+        ret = odev->loop->enable_remote();
+        if (ret == 0)
+            odev->replicas.swap(replicas);
+    });
+    if (ret < 0) {
+        close_replicas(replicas);
+        return;
+    }
+    LOG_INFO("` is served by ` vcpus", config, odev->replicas.size() + 1);
+}
+
+static int dev_open(struct tcmu_device *dev) {
+    if (workers.empty())
+        return do_dev_open(dev, imgservice);
+
+    // shard the device to the least loaded vcpu, of its NUMA node if any
+    int node = imgservice->global_conf.numaAware() ? preferred_node(tcmu_get_path(dev)) : -1;
+    TCMUWorker *worker = nullptr;
+    for (auto w : workers) {
+        if (node >= 0 && w->node != node)
+            continue;
+        if (!worker || w->ndevs < worker->ndevs)
+            worker = w;
+    }
+    if (!worker) {
+        worker = *std::min_element(
+            workers.begin(), workers.end(),
+            [](TCMUWorker *a, TCMUWorker *b) { return a->ndevs < b->ndevs; });
+    }
+    int ret = -EPERM;
+    worker->call([&]() { ret = do_dev_open(dev, worker->imgservice); });
+    if (ret == 0) {
+        ((obd_dev *)tcmu_dev_get_private(dev))->worker = worker;
+        worker->ndevs++;
+        open_replicas(dev, worker);
+    }
+    return ret;
+}
+
+// the replicas of the device, if any, are handed over to be closed
+static void do_dev_close(struct tcmu_device *dev, std::vector<Replica> &replicas) {
     obd_dev *odev = (obd_dev *)tcmu_dev_get_private(dev);
     delete odev->loop;
+    replicas.swap(odev->replicas);
+    delete odev->batcher;
     odev->file->close();
     delete odev->file;
+    odev->reads.fini();
+    odev->writes.fini();
     delete odev;
+}
+
+static int close_cnt = 0;
+static void dev_close(struct tcmu_device *dev) {
+    obd_dev *odev = (obd_dev *)tcmu_dev_get_private(dev);
+    auto worker = odev->worker;
+    std::vector<Replica> replicas;
+    if (worker) {
+        worker->call([&]() { do_dev_close(dev, replicas); });
+        worker->ndevs--;
+        close_replicas(replicas);
+    } else {
+        do_dev_close(dev, replicas);
+    }
     close_cnt++;
     if (close_cnt == 500) {
         malloc_trim(128 * 1024);
@@ -346,6 +1102,19 @@ void sigint_handler(int signal = SIGINT) {
     }
 }
 
+// reloads the global config of the services of all vcpus, on SIGHUP
+static void reload_global_config() {
+    LOG_INFO("reloading global config");
+    if (imgservice)
+        imgservice->reload_global_config();
+    for (auto w : workers)
+        w->call([w] { w->imgservice->reload_global_config(); });
+}
+
+void sighup_handler(int signal = SIGHUP) {
+    // not to block the handling of signals
+    photon::thread_create11(&reload_global_config);
+}
 
 int main(int argc, char **argv) {
     mallopt(M_TRIM_THRESHOLD, 128 * 1024);
@@ -360,16 +1129,55 @@ int main(int argc, char **argv) {
     DEFER(photon::sync_signal_fini());
     Net::libcurl_init();
     DEFER(Net::libcurl_fini());
+    DEFER(Net::http_fini());
 
     photon::block_all_signal();
     photon::sync_signal(SIGTERM, &sigint_handler);
     photon::sync_signal(SIGINT, &sigint_handler);
+    photon::sync_signal(SIGHUP, &sighup_handler);
 
     imgservice = create_image_service();
     if (imgservice == nullptr) {
         LOG_ERROR("failed to create image service");
         return -1;
     }
+    enable_thread_stats(imgservice);
+    DEFER(photon::set_thread_stats(false));
+    Trace::set_threshold(imgservice->global_conf.traceSlowReadMs() * 1000UL);
+
+    MetricsServer *metrics_server = nullptr;
+    DEFER(delete_metrics_server(metrics_server));
+    if (imgservice->global_conf.metricsPort()) {
+        metrics_server = new_metrics_server(imgservice->global_conf.metricsPort());
+        if (metrics_server == nullptr)
+            LOG_ERROR("failed to start metrics server, going on without it");
+    }
+
+    uint32_t nvcpu = imgservice->global_conf.vcpuNum();
+    DEFER({
+        for (auto w : workers)
+            delete w;
+        workers.clear();
+    });
+    if (nvcpu > 1) {
+        // vcpus are spread over the NUMA nodes in turn, each allocating
+        // node-local memory for the devices it serves
+        int nnodes = imgservice->global_conf.numaAware() ? numa_node_count() : 0;
+        if (nnodes > 0) {
+            cache_node = numa_node_of_path(imgservice->global_conf.registryCacheDir().c_str());
+            LOG_INFO("` numa nodes, registry cache on node `", nnodes, cache_node);
+        }
+        for (uint32_t i = 0; i < nvcpu; i++) {
+            auto w = nnodes > 0 ? new TCMUWorker(i, i % nnodes, i / nnodes) : new TCMUWorker(i);
+            if (w->start() < 0) {
+                delete w;
+                LOG_ERROR("failed to start worker vcpus");
+                return -1;
+            }
+            workers.push_back(w);
+        }
+        LOG_INFO("` worker vcpus started", nvcpu);
+    }
 
     /*
      * Handings for rlimit and netlink are from tcmu-runner main.c
@@ -0,0 +1,170 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "merkle_file.h"
+#include <sys/stat.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "overlaybd/alog-stdstring.h"
+#include "overlaybd/alog.h"
+#include "overlaybd/iovector.h"
+#include "overlaybd/fs/forwardfs.h"
+#include "overlaybd/fs/registryfs/digest.h"
+
+using namespace FileSystem;
+
+namespace Merkle {
+
+struct Header {
+    static const uint64_t MAGIC = 0x314c4b524d44424fULL; // "OBDMRKL1"
+    uint64_t magic = MAGIC;
+    uint64_t size = 0; // of the layer
+    uint32_t chunk_size = 0;
+    uint32_t reserved = 0;
+};
+
+// the chunks of the tree are read from the source in batches of this size
+static const size_t BUILD_IO_SIZE = 4 * 1024 * 1024;
+
+static const size_t DIGEST_LENGTH = SHA256Stream::DIGEST_LENGTH;
+
+std::string build_tree(IFile *src, IFile *tree, uint32_t chunk_size) {
+    struct stat st;
+    if (chunk_size == 0)
+        LOG_ERROR_RETURN(EINVAL, "", "invalid chunk size 0");
+    if (src->fstat(&st) < 0)
+        LOG_ERRNO_RETURN(0, "", "failed to stat the source");
+    Header header;
+    header.size = st.st_size;
+    header.chunk_size = chunk_size;
+    SHA256Stream root;
+    root.update(&header, sizeof(header));
+    if (tree->pwrite(&header, sizeof(header), 0) != (ssize_t)sizeof(header))
+        LOG_ERRNO_RETURN(0, "", "failed to write the header of the tree");
+
+    size_t batch = std::max((size_t)chunk_size, BUILD_IO_SIZE / chunk_size * chunk_size);
+    std::unique_ptr<unsigned char[]> buf(new unsigned char[batch]);
+    std::vector<unsigned char> digests;
+    off_t tree_offset = sizeof(header);
+    for (off_t offset = 0; offset < st.st_size; offset += batch) {
+        auto len = std::min((off_t)batch, st.st_size - offset);
+        if (src->pread(buf.get(), len, offset) != len)
+            LOG_ERRNO_RETURN(0, "", "failed to read the source at `", offset);
+        digests.resize(0);
+        for (off_t i = 0; i < len; i += chunk_size) {
+            unsigned char sha[DIGEST_LENGTH];
+            SHA256Stream::digest(buf.get() + i, std::min((off_t)chunk_size, len - i), sha);
+            digests.insert(digests.end(), sha, sha + sizeof(sha));
+        }
+        root.update(digests.data(), digests.size());
+        if (tree->pwrite(digests.data(), digests.size(), tree_offset) != (ssize_t)digests.size())
+            LOG_ERRNO_RETURN(0, "", "failed to write the tree at `", tree_offset);
+        tree_offset += digests.size();
+    }
+    return root.final();
+}
+
+class MerkleFile : public ForwardFile_Ownership {
+public:
+    MerkleFile(IFile *src, bool ownership) : ForwardFile_Ownership(src, ownership) {
+    }
+
+    int load(IFile *tree, const std::string &root) {
+        struct stat st;
+        if (tree->fstat(&st) < 0 || st.st_size < (off_t)sizeof(m_header))
+            LOG_ERRNO_RETURN(0, -1, "failed to stat the tree, or it is too short");
+        std::unique_ptr<unsigned char[]> buf(new unsigned char[st.st_size]);
+        if (tree->pread(buf.get(), st.st_size, 0) != st.st_size)
+            LOG_ERRNO_RETURN(0, -1, "failed to read the tree");
+        SHA256Stream sha;
+        sha.update(buf.get(), st.st_size);
+        auto digest = sha.final();
+        if (digest != root)
+            LOG_ERROR_RETURN(EIO, -1, "the root of the tree is `, not `", digest, root);
+
+        memcpy(&m_header, buf.get(), sizeof(m_header));
+        if (m_header.magic != Header::MAGIC || m_header.chunk_size == 0)
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid header of the tree");
+        uint64_t nchunks = (m_header.size + m_header.chunk_size - 1) / m_header.chunk_size;
+        if ((uint64_t)st.st_size != sizeof(m_header) + nchunks * DIGEST_LENGTH)
+            LOG_ERROR_RETURN(EINVAL, -1, "the tree has ` bytes for ` chunks", st.st_size, nchunks);
+        struct stat src_st;
+        if (m_file->fstat(&src_st) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to stat the source");
+        if ((uint64_t)src_st.st_size != m_header.size)
+            LOG_ERROR_RETURN(EINVAL, -1, "the source has ` bytes, the tree is of `",
+                             src_st.st_size, m_header.size);
+        m_digests.assign(buf.get() + sizeof(m_header), buf.get() + st.st_size);
+        return 0;
+    }
+
+    ssize_t pread(void *buf, size_t count, off_t offset) override {
+        struct iovec iov { buf, count };
+        return preadv(&iov, 1, offset);
+    }
+
+    ssize_t preadv_mutable(struct iovec *iov, int iovcnt, off_t offset) override {
+        return preadv(iov, iovcnt, offset);
+    }
+
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        // a prefetch delivers no data to verify
+        if (iovcnt == 1 && iov->iov_base == nullptr)
+            return m_file->preadv(iov, iovcnt, offset);
+        iovector_view view((struct iovec *)iov, iovcnt);
+        size_t count = view.sum();
+        if (offset < 0 || (uint64_t)offset >= m_header.size || count == 0)
+            return m_file->preadv(iov, iovcnt, offset);
+        count = std::min(count, (size_t)(m_header.size - offset));
+
+        uint64_t chunk = m_header.chunk_size;
+        off_t begin = offset / chunk * chunk;
+        off_t end = std::min((offset + count + chunk - 1) / chunk * chunk, m_header.size);
+        std::unique_ptr<unsigned char[]> buf(new unsigned char[end - begin]);
+        auto ret = m_file->pread(buf.get(), end - begin, begin);
+        if (ret != end - begin)
+            LOG_ERRNO_RETURN(0, -1, "failed to read chunks [`, `) of the source", begin, end);
+        for (off_t i = begin; i < end; i += chunk) {
+            unsigned char sha[DIGEST_LENGTH];
+            SHA256Stream::digest(buf.get() + (i - begin), std::min((off_t)chunk, end - i), sha);
+            auto expected = m_digests.data() + i / chunk * DIGEST_LENGTH;
+            if (memcmp(sha, expected, DIGEST_LENGTH) != 0)
+                LOG_ERROR_RETURN(EIO, -1, "chunk [`, +`) doesn't match its digest in the tree", i,
+                                 chunk);
+        }
+        return view.memcpy_from(buf.get() + (offset - begin), count);
+    }
+
+    // sequential reads don't go through the verification
+    UNIMPLEMENTED(ssize_t read(void *buf, size_t count) override);
+    UNIMPLEMENTED(ssize_t readv(const struct iovec *iov, int iovcnt) override);
+    UNIMPLEMENTED(ssize_t readv_mutable(struct iovec *iov, int iovcnt) override);
+
+private:
+    Header m_header;
+    std::vector<unsigned char> m_digests;
+};
+
+IFile *new_merkle_file(IFile *src, IFile *tree, const std::string &root, bool ownership) {
+    auto file = new MerkleFile(src, ownership);
+    if (file->load(tree, root) < 0) {
+        delete file;
+        return nullptr;
+    }
+    return file;
+}
+
+} // namespace Merkle
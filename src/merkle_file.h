@@ -0,0 +1,39 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <string>
+#include "overlaybd/fs/filesystem.h"
+
+// The merkle tree of a layer, saved aside of it, is a header followed by the
+// sha256 of each chunk of the layer, and its root is the sha256 of the whole
+// tree, as "sha256:<hex>". With the root given by a trusted config, the
+// chunks read from an untrusted source are verified one by one.
+namespace Merkle {
+
+static const uint32_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+// saves the tree of `src` to `tree`, returning its root, or "" for failure
+std::string build_tree(FileSystem::IFile *src, FileSystem::IFile *tree,
+                       uint32_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+// reads of the returned file are widened to whole chunks of `src`, and fail
+// with EIO if any of them doesn't match its digest in `tree`, which is loaded
+// here and checked against `root`; the returned file owns `src` if
+// `ownership`, which is deleted on failure as well, but never `tree`
+FileSystem::IFile *new_merkle_file(FileSystem::IFile *src, FileSystem::IFile *tree,
+                                   const std::string &root, bool ownership = true);
+
+} // namespace Merkle
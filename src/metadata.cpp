@@ -0,0 +1,147 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "metadata.h"
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include "overlaybd/alog.h"
+#include "overlaybd/fs/filesystem.h"
+
+namespace Metadata {
+
+void Regions::add(uint64_t offset, uint64_t length) {
+    if (length > 0)
+        m_ranges.emplace_back(offset, offset + length);
+}
+
+void Regions::seal() {
+    std::sort(m_ranges.begin(), m_ranges.end());
+    size_t n = 0;
+    for (auto &r : m_ranges) {
+        if (n > 0 && r.first <= m_ranges[n - 1].second) {
+            m_ranges[n - 1].second = std::max(m_ranges[n - 1].second, r.second);
+            continue;
+        }
+        m_ranges[n++] = r;
+    }
+    m_ranges.resize(n);
+    m_ranges.shrink_to_fit();
+}
+
+bool Regions::overlaps(uint64_t offset, uint64_t count) const {
+    auto it = std::upper_bound(m_ranges.begin(), m_ranges.end(), offset,
+                               [](uint64_t x, const std::pair<uint64_t, uint64_t> &r) {
+                                   return x < r.second;
+                               });
+    return it != m_ranges.end() && it->first < offset + count;
+}
+
+uint64_t Regions::bytes() const {
+    uint64_t n = 0;
+    for (auto &r : m_ranges)
+        n += r.second - r.first;
+    return n;
+}
+
+// the fields of the superblock and of the group descriptors, by their offsets
+// in the little endian structures of ext4
+static const uint64_t SUPERBLOCK_OFFSET = 1024, SUPERBLOCK_SIZE = 1024;
+static const uint16_t EXT4_MAGIC = 0xEF53;
+static const uint32_t INCOMPAT_META_BG = 0x10, INCOMPAT_64BIT = 0x80;
+static const uint32_t RO_COMPAT_GDT_CSUM = 0x10, RO_COMPAT_METADATA_CSUM = 0x400;
+static const uint16_t BG_INODE_UNINIT = 0x1, BG_BLOCK_UNINIT = 0x2;
+// groups beyond are not classified, i.e. 8TB of 4KB blocks, of 4MB of
+// descriptors at most
+static const uint64_t MAX_GROUPS = 1UL << 16;
+
+template <typename T>
+static T get(const char *p, size_t offset) {
+    T v;
+    memcpy(&v, p + offset, sizeof(T));
+    return v;
+}
+
+int load_ext4_regions(FileSystem::IFile *file, Regions *out) {
+    char sb[SUPERBLOCK_SIZE];
+    if (file->pread(sb, sizeof(sb), SUPERBLOCK_OFFSET) != (ssize_t)sizeof(sb))
+        LOG_ERRNO_RETURN(0, -1, "failed to read the superblock");
+    if (get<uint16_t>(sb, 0x38) != EXT4_MAGIC)
+        LOG_ERROR_RETURN(EINVAL, -1, "not an ext4 filesystem");
+    uint32_t log_block_size = get<uint32_t>(sb, 0x18);
+    uint64_t first_block = get<uint32_t>(sb, 0x14);
+    uint64_t blocks = get<uint32_t>(sb, 0x4);
+    uint64_t blocks_per_group = get<uint32_t>(sb, 0x20);
+    uint64_t inodes_per_group = get<uint32_t>(sb, 0x28);
+    uint64_t inode_size = get<uint32_t>(sb, 0x4C) ? get<uint16_t>(sb, 0x58) : 128;
+    uint32_t incompat = get<uint32_t>(sb, 0x60), ro_compat = get<uint32_t>(sb, 0x64);
+    uint64_t desc_size = 32;
+    if (incompat & INCOMPAT_64BIT) {
+        blocks |= (uint64_t)get<uint32_t>(sb, 0x150) << 32;
+        desc_size = get<uint16_t>(sb, 0xFE);
+    }
+    if (log_block_size > 6 || blocks <= first_block || blocks_per_group == 0 ||
+        inodes_per_group == 0 || inode_size == 0 || desc_size < 32)
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid ext4 superblock");
+    uint64_t block_size = 1024UL << log_block_size;
+    // the unused inodes and the uninitialized groups are recorded only with
+    // the checksums of the descriptors
+    bool uninit = ro_compat & (RO_COMPAT_GDT_CSUM | RO_COMPAT_METADATA_CSUM);
+    uint64_t gdt = (first_block + 1) * block_size;
+    // the descriptors are scattered across the meta groups, not classified
+    if (incompat & INCOMPAT_META_BG) {
+        out->add(0, gdt);
+        out->seal();
+        return 0;
+    }
+
+    uint64_t ngroups = (blocks - first_block + blocks_per_group - 1) / blocks_per_group;
+    ngroups = std::min(ngroups, MAX_GROUPS);
+    std::vector<char> desc(ngroups * desc_size);
+    if (file->pread(desc.data(), desc.size(), gdt) != (ssize_t)desc.size())
+        LOG_ERRNO_RETURN(0, -1, "failed to read ` group descriptors", ngroups);
+    out->add(0, gdt + desc.size());
+    auto add_blocks = [&](uint64_t block, uint64_t n) {
+        if (block >= first_block && block + n <= blocks)
+            out->add(block * block_size, n * block_size);
+    };
+    for (uint64_t i = 0; i < ngroups; i++) {
+        auto d = desc.data() + i * desc_size;
+        uint64_t block_bitmap = get<uint32_t>(d, 0x0);
+        uint64_t inode_bitmap = get<uint32_t>(d, 0x4);
+        uint64_t inode_table = get<uint32_t>(d, 0x8);
+        uint64_t itable_unused = get<uint16_t>(d, 0x1C);
+        if (desc_size >= 64) {
+            block_bitmap |= (uint64_t)get<uint32_t>(d, 0x20) << 32;
+            inode_bitmap |= (uint64_t)get<uint32_t>(d, 0x24) << 32;
+            inode_table |= (uint64_t)get<uint32_t>(d, 0x28) << 32;
+            itable_unused |= (uint64_t)get<uint16_t>(d, 0x32) << 16;
+        }
+        uint16_t flags = uninit ? get<uint16_t>(d, 0x12) : 0;
+        if (!(flags & BG_BLOCK_UNINIT))
+            add_blocks(block_bitmap, 1);
+        if (flags & BG_INODE_UNINIT)
+            continue;
+        add_blocks(inode_bitmap, 1);
+        uint64_t inodes = inodes_per_group;
+        if (uninit)
+            inodes -= std::min(itable_unused, inodes_per_group);
+        add_blocks(inode_table, (inodes * inode_size + block_size - 1) / block_size);
+    }
+    out->seal();
+    return 0;
+}
+
+} // namespace Metadata
@@ -0,0 +1,59 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+namespace FileSystem {
+class IFile;
+}
+
+// The regions of a device holding the metadata of the guest filesystem,
+// e.g. its superblock, group descriptors, bitmaps and inode tables, which
+// the guest reads ahead of the data they lead to, at mount and at every
+// lookup; reads of them are served ahead of the others.
+namespace Metadata {
+
+class Regions {
+public:
+    // [offset, offset + length) in bytes, before seal()
+    void add(uint64_t offset, uint64_t length);
+    // sorts and merges the regions added
+    void seal();
+    // whether [offset, offset + count) overlaps any of the regions
+    bool overlaps(uint64_t offset, uint64_t count) const;
+
+    bool empty() const {
+        return m_ranges.empty();
+    }
+    size_t size() const {
+        return m_ranges.size();
+    }
+    uint64_t bytes() const;
+
+private:
+    std::vector<std::pair<uint64_t, uint64_t>> m_ranges; // [begin, end)
+};
+
+// the regions of the ext4 filesystem on `file`, from its superblock and group
+// descriptors, read here: the blocks up to the descriptors, and the bitmaps
+// and the inode tables of the groups, only the part in use if recorded;
+// return 0 for success, or -1 if the file is not ext4, or fails to be read
+int load_ext4_regions(FileSystem::IFile *file, Regions *out);
+
+} // namespace Metadata
@@ -0,0 +1,154 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "metrics_server.h"
+#include "overlaybd/alog.h"
+#include "overlaybd/metrics.h"
+#include "overlaybd/photon/syncio/fd-events.h"
+#include "overlaybd/photon/thread.h"
+#include "overlaybd/photon/thread11.h"
+#include "overlaybd/utility.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <unordered_set>
+
+static const size_t kMaxRequestHeader = 8 * 1024;
+static const uint64_t kConnTimeout = 10L * 1000 * 1000;
+
+// a scrape is one request per connection, answered and closed
+class MetricsServer {
+public:
+    ~MetricsServer() {
+        m_stopping = true;
+        if (m_listener) {
+            photon::thread_interrupt(m_listener, EINTR);
+            photon::thread_join(m_listener_jh);
+        }
+        for (auto th : m_conns)
+            photon::thread_interrupt(th, EINTR);
+        while (!m_conns.empty())
+            m_conns_cv.wait_no_lock();
+        if (m_fd >= 0) {
+            photon::fd_events_forget(m_fd);
+            ::close(m_fd);
+        }
+    }
+
+    int start(uint16_t port) {
+        m_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_fd < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to create metrics server socket");
+        int on = 1;
+        ::setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (::bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to bind metrics server to port `", port);
+        if (::listen(m_fd, 16) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to listen on port `", port);
+        m_listener = photon::thread_create11(&MetricsServer::accept_loop, this);
+        m_listener_jh = photon::thread_enable_join(m_listener);
+        LOG_INFO("metrics server listening on port `", port);
+        return 0;
+    }
+
+protected:
+    int m_fd = -1;
+    bool m_stopping = false;
+    photon::thread *m_listener = nullptr;
+    photon::join_handle *m_listener_jh = nullptr;
+    std::unordered_set<photon::thread *> m_conns;
+    photon::condition_variable m_conns_cv;
+
+    void accept_loop() {
+        while (!m_stopping) {
+            int fd = ::accept4(m_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EAGAIN) {
+                    photon::wait_for_fd_readable(m_fd);
+                } else if (errno != EINTR && errno != ECONNABORTED) {
+                    LOG_ERRNO_RETURN(0, , "metrics server failed to accept");
+                }
+                continue;
+            }
+            photon::thread_create11(&MetricsServer::serve_conn, this, fd);
+        }
+    }
+
+    void serve_conn(int fd) {
+        m_conns.insert(photon::CURRENT);
+        DEFER({
+            photon::fd_events_forget(fd);
+            ::close(fd);
+            m_conns.erase(photon::CURRENT);
+            m_conns_cv.notify_all();
+        });
+        std::string req;
+        char tmp[1024];
+        while (req.find("\r\n\r\n") == std::string::npos) {
+            if (req.size() > kMaxRequestHeader)
+                return;
+            auto ret = ::read(fd, tmp, sizeof(tmp));
+            if (ret < 0 && errno == EAGAIN) {
+                if (photon::wait_for_fd_readable(fd, kConnTimeout) < 0)
+                    return;
+                continue;
+            }
+            if (ret <= 0)
+                return;
+            req.append(tmp, ret);
+        }
+
+        std::string status = "200 OK", body;
+        if (req.compare(0, 4, "GET ") != 0) {
+            status = "405 Method Not Allowed";
+        } else if (req.compare(4, 9, "/metrics ") != 0 && req.compare(4, 9, "/metrics?") != 0) {
+            status = "404 Not Found";
+        } else {
+            body = Metrics::render();
+        }
+        auto resp = "HTTP/1.1 " + status +
+                    "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                    std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < resp.size()) {
+            auto ret = ::write(fd, resp.data() + sent, resp.size() - sent);
+            if (ret < 0) {
+                if (errno != EAGAIN || photon::wait_for_fd_writable(fd, kConnTimeout) < 0)
+                    return;
+                continue;
+            }
+            sent += ret;
+        }
+    }
+};
+
+MetricsServer *new_metrics_server(uint16_t port) {
+    auto server = new MetricsServer;
+    if (server->start(port) < 0) {
+        delete server;
+        return nullptr;
+    }
+    return server;
+}
+
+void delete_metrics_server(MetricsServer *server) {
+    delete server;
+}
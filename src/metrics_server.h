@@ -0,0 +1,24 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <stdint.h>
+
+class MetricsServer;
+
+// serves GET /metrics on `port` by photon threads of the calling vcpu,
+// nullptr on failure
+MetricsServer *new_metrics_server(uint16_t port);
+void delete_metrics_server(MetricsServer *server);
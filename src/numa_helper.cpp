@@ -0,0 +1,137 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "numa_helper.h"
+#include "overlaybd/alog.h"
+#include "overlaybd/alog-stdstring.h"
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <string>
+
+static const int MPOL_PREFERRED_ = 1;
+static const int MAX_NODES = 1024;
+
+static bool read_line(const std::string &path, std::string &line) {
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp)
+        return false;
+    char buf[4096];
+    bool ok = fgets(buf, sizeof(buf), fp) != nullptr;
+    fclose(fp);
+    if (ok) {
+        line = buf;
+        while (!line.empty() && (line.back() == '\n' || line.back() == ' '))
+            line.pop_back();
+    }
+    return ok;
+}
+
+// parses a list like "0-7,16-23"
+static int parse_list(const std::string &list, std::vector<int> &out) {
+    out.clear();
+    const char *p = list.c_str();
+    while (*p) {
+        char *end;
+        long a = strtol(p, &end, 10);
+        if (end == p)
+            return -1;
+        long b = a;
+        if (*end == '-') {
+            p = end + 1;
+            b = strtol(p, &end, 10);
+            if (end == p || b < a)
+                return -1;
+        }
+        for (long i = a; i <= b; i++)
+            out.push_back((int)i);
+        p = (*end == ',') ? end + 1 : end;
+        if (*end && *end != ',')
+            return -1;
+    }
+    return (int)out.size();
+}
+
+int numa_node_count() {
+    std::string line;
+    std::vector<int> nodes;
+    if (!read_line("/sys/devices/system/node/online", line) || parse_list(line, nodes) <= 0)
+        return 1;
+    return nodes.back() + 1;
+}
+
+int numa_node_cpus(int node, std::vector<int> &cpus) {
+    std::string line;
+    auto path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+    if (!read_line(path, line))
+        LOG_ERRNO_RETURN(0, -1, "failed to read `", path);
+    if (parse_list(line, cpus) < 0)
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid cpu list ` of node `", line, node);
+    return (int)cpus.size();
+}
+
+int numa_node_of_path(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to stat `", path);
+    char dev[64], real[PATH_MAX];
+    snprintf(dev, sizeof(dev), "/sys/dev/block/%u:%u", major(st.st_dev), minor(st.st_dev));
+    if (!realpath(dev, real))
+        return -1;
+    std::string dir = real;
+    // a partition has no device of its own, but its disk has
+    if (access((dir + "/partition").c_str(), F_OK) == 0)
+        dir = dir.substr(0, dir.rfind('/'));
+    std::string line;
+    // the node is of the PCI function, which is the device of an NVMe
+    // controller, or the device of the disk itself otherwise
+    for (auto f : {"/device/device/numa_node", "/device/numa_node"}) {
+        if (read_line(dir + f, line)) {
+            int node = atoi(line.c_str());
+            if (node >= 0)
+                return node;
+        }
+    }
+    return -1;
+}
+
+int numa_bind_thread(int node, int index) {
+    if (node < 0 || node >= MAX_NODES)
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid numa node `", node);
+    std::vector<int> cpus;
+    if (numa_node_cpus(node, cpus) <= 0)
+        LOG_ERROR_RETURN(ENOENT, -1, "no cpu found in numa node `", node);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    auto cpu = cpus[index % cpus.size()];
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0)
+        LOG_ERROR_RETURN(ret, -1, "failed to pin thread to cpu ` of node `", cpu, node);
+
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED_, mask, MAX_NODES) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to prefer memory of numa node `", node);
+    LOG_INFO("thread bound to cpu ` of numa node `", cpu, node);
+    return 0;
+}
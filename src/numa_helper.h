@@ -0,0 +1,35 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <vector>
+
+// NUMA topology is read from sysfs, and memory policy is set by syscalls,
+// so that libnuma is not required.
+
+// # of NUMA nodes online, 1 if unknown
+int numa_node_count();
+
+// cpus of `node`, returns the count, or -1 on failure
+int numa_node_cpus(int node, std::vector<int> &cpus);
+
+// node of the device holding `path` (e.g. the NVMe of a cache dir),
+// -1 if unknown, as for virtual or stacked devices
+int numa_node_of_path(const char *path);
+
+// pins the calling OS thread to the `index`-th (modulo) cpu of `node`, and
+// makes memory allocated by it prefer `node`, including stacks, heap and
+// the page cache filled by its reads
+int numa_bind_thread(int node, int index);
@@ -0,0 +1,168 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "alog-audit.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+namespace photon {
+extern __thread uint64_t now;
+}
+
+AuditRingHeader *audit_ring = nullptr;
+static size_t audit_ring_size = 0;
+static AuditRecord *audit_records = nullptr;
+
+// ops are string literals, so they are looked up by address first,
+// and by name only at the first record of each call site
+static struct {
+    std::atomic<const char *> ptr;
+    uint16_t idx;
+} op_ptrs[AuditRingHeader::MAX_OPS];
+static std::atomic<uint32_t> nop_ptrs{0};
+static std::mutex ops_mutex;
+
+static uint16_t get_op(const char *op) {
+    auto n = nop_ptrs.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < n; i++)
+        if (op_ptrs[i].ptr.load(std::memory_order_relaxed) == op)
+            return op_ptrs[i].idx;
+
+    std::lock_guard<std::mutex> lock(ops_mutex);
+    n = nop_ptrs.load(std::memory_order_relaxed);
+    uint16_t idx = UINT16_MAX;
+    for (uint32_t i = 0; i < audit_ring->nops; i++) {
+        if (strncmp(audit_ring->ops[i], op, sizeof(audit_ring->ops[i]) - 1) == 0) {
+            idx = i;
+            break;
+        }
+    }
+    if (idx == UINT16_MAX) {
+        if (audit_ring->nops == AuditRingHeader::MAX_OPS)
+            return UINT16_MAX;
+        idx = audit_ring->nops;
+        strncpy(audit_ring->ops[idx], op, sizeof(audit_ring->ops[idx]) - 1);
+        audit_ring->nops++;
+    }
+    if (n < AuditRingHeader::MAX_OPS) {
+        op_ptrs[n].idx = idx;
+        op_ptrs[n].ptr.store(op, std::memory_order_relaxed);
+        nop_ptrs.store(n + 1, std::memory_order_release);
+    }
+    return idx;
+}
+
+int audit_ring_open(const char *path, uint64_t capacity) {
+    if (audit_ring)
+        LOG_ERROR_RETURN(EALREADY, -1, "audit ring already opened");
+    if (capacity == 0)
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid audit ring capacity 0");
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to open audit ring `", path);
+    DEFER(close(fd));
+    size_t size = AUDIT_RING_HEADER_SIZE + capacity * sizeof(AuditRecord);
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to stat audit ring `", path);
+    bool reuse = (size_t)st.st_size == size;
+    if (!reuse && ftruncate(fd, size) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to resize audit ring ` to `", path, size);
+    auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+        LOG_ERRNO_RETURN(0, -1, "failed to map audit ring `", path);
+
+    auto header = (AuditRingHeader *)ptr;
+    if (!reuse || memcmp(header->magic, "OBDAUDIT", 8) != 0 ||
+        header->version != AuditRingHeader::VERSION ||
+        header->record_size != sizeof(AuditRecord) || header->capacity != capacity) {
+        memset(ptr, 0, size);
+        memcpy(header->magic, "OBDAUDIT", 8);
+        header->version = AuditRingHeader::VERSION;
+        header->record_size = sizeof(AuditRecord);
+        header->capacity = capacity;
+    }
+    audit_ring_size = size;
+    audit_records = (AuditRecord *)((char *)ptr + AUDIT_RING_HEADER_SIZE);
+    nop_ptrs = 0;
+    audit_ring = header;
+    LOG_INFO("audit records in binary to `, capacity `", path, capacity);
+    return 0;
+}
+
+void audit_ring_close() {
+    if (!audit_ring)
+        return;
+    auto header = audit_ring;
+    audit_ring = nullptr;
+    munmap(header, audit_ring_size);
+}
+
+AuditRingReader::~AuditRingReader() {
+    if (header)
+        munmap((void *)header, m_size);
+}
+
+int AuditRingReader::open(const char *path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to open audit ring `", path);
+    DEFER(close(fd));
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < AUDIT_RING_HEADER_SIZE)
+        LOG_ERROR_RETURN(EINVAL, -1, "` is not an audit ring", path);
+    auto ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+        LOG_ERRNO_RETURN(0, -1, "failed to map audit ring `", path);
+    auto h = (const AuditRingHeader *)ptr;
+    if (memcmp(h->magic, "OBDAUDIT", 8) != 0 || h->version != AuditRingHeader::VERSION ||
+        h->record_size != sizeof(AuditRecord) ||
+        AUDIT_RING_HEADER_SIZE + h->capacity * sizeof(AuditRecord) > (size_t)st.st_size) {
+        munmap(ptr, st.st_size);
+        LOG_ERROR_RETURN(EINVAL, -1, "` is not an audit ring of this version", path);
+    }
+    header = h;
+    records = (const AuditRecord *)((const char *)ptr + AUDIT_RING_HEADER_SIZE);
+    m_size = st.st_size;
+    return 0;
+}
+
+void audit_ring_record(const char *op, std::string_view path, uint64_t offset, uint64_t size,
+                       uint64_t latency) {
+    auto header = audit_ring;
+    if (!header)
+        return;
+    auto idx = __atomic_fetch_add(&header->next, 1, __ATOMIC_RELAXED);
+    auto &r = audit_records[idx % header->capacity];
+    // invalidated while being written, in case a reader sees it
+    __atomic_store_n(&r.seq, 0, __ATOMIC_RELEASE);
+    r.ts = photon::now;
+    r.offset = offset;
+    r.size = (int32_t)size;
+    r.latency = (uint32_t)std::min(latency, (uint64_t)UINT32_MAX);
+    r.path_hash = std::hash<std::string_view>()(path);
+    r.op = get_op(op);
+    auto n = std::min(path.size(), sizeof(r.path));
+    memcpy(r.path, path.data() + path.size() - n, n);
+    memset(r.path + n, 0, sizeof(r.path) - n);
+    __atomic_store_n(&r.seq, idx + 1, __ATOMIC_RELEASE);
+}
@@ -14,11 +14,97 @@
    limitations under the License.
 */
 #pragma once
+#include <algorithm>
 #include <utility>
 
 #include "alog.h"
+#include "string_view.h"
 #include "utility.h"
 
+// Audit records may be written in binary, instead of text lines, into a
+// ring of fixed-size records in a memory-mapped file, which is decoded
+// offline by overlaybd-audit. A record costs no formatting and no I/O.
+struct AuditRecord {
+    uint64_t seq;       // 1 + the index of the record, written last
+    uint64_t ts;        // wall clock at the end of the op, in us
+    uint64_t offset;
+    uint64_t path_hash; // of the full path name
+    int32_t size;       // may be negative, for an error
+    uint32_t latency;   // in us, saturated
+    uint16_t op;        // index into AuditRingHeader::ops
+    char path[22];      // the tail of the path name, NUL-padded
+};
+static_assert(sizeof(AuditRecord) == 64, "...");
+
+struct AuditRingHeader {
+    static const uint32_t VERSION = 1;
+    static const uint32_t MAX_OPS = 64;
+    char magic[8]; // "OBDAUDIT"
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity; // # of records in the ring
+    uint64_t next;     // the index of the next record
+    uint32_t nops;
+    char ops[MAX_OPS][60]; // names of ops, NUL-terminated
+};
+static const size_t AUDIT_RING_HEADER_SIZE = 4096;
+static_assert(sizeof(AuditRingHeader) <= AUDIT_RING_HEADER_SIZE, "...");
+
+// maps a ring of `capacity` records in file `path`, which is reused if it
+// is a ring of the same capacity; audit records are binary since then
+int audit_ring_open(const char *path, uint64_t capacity);
+// audit records are text again
+void audit_ring_close();
+extern AuditRingHeader *audit_ring;
+inline bool audit_ring_enabled() {
+    return audit_ring != nullptr;
+}
+void audit_ring_record(const char *op, std::string_view path, uint64_t offset, uint64_t size,
+                       uint64_t latency);
+
+// a ring mapped read-only, to be decoded offline, e.g. by overlaybd-audit
+class AuditRingReader {
+public:
+    const AuditRingHeader *header = nullptr;
+    const AuditRecord *records = nullptr;
+
+    ~AuditRingReader();
+    // fails unless `path` is a ring of this version
+    int open(const char *path);
+    // the name of op `idx` of a record, or "?"
+    const char *op_name(uint16_t idx) const {
+        return idx < header->nops ? header->ops[idx] : "?";
+    }
+    // calls `func` with each of the last `last` records, oldest first,
+    // skipping those being written, or overwritten since
+    template <typename F>
+    void for_each(uint64_t last, F func) const {
+        uint64_t next = __atomic_load_n(&header->next, __ATOMIC_ACQUIRE);
+        uint64_t n = std::min(std::min(next, header->capacity), last);
+        for (uint64_t i = next - n; i < next; i++) {
+            AuditRecord r = records[i % header->capacity];
+            if (r.seq == i + 1)
+                func(r);
+        }
+    }
+
+private:
+    size_t m_size = 0;
+};
+
+template <size_t N, typename P, typename O, typename S>
+inline bool audit_binary(uint64_t latency, const char (&op)[N], NamedValue<P> path,
+                         NamedValue<O> offset, NamedValue<S> size) {
+    audit_ring_record(op, path.value, offset.value, size.value, latency);
+    return true;
+}
+
+// ops of other forms are audited in text
+template <typename... Ts>
+inline bool audit_binary(uint64_t, Ts &&...) {
+    return false;
+}
+
 #define AU_FILEOP(pathname, offset, size)                                                          \
     make_named_value("pathname", pathname), make_named_value("offset", offset),                    \
         make_named_value("size", size)
@@ -28,15 +114,19 @@
 #ifndef DISABLE_AUDIT
 #define SCOPE_AUDIT(...)                                                                           \
     auto _CONCAT(__audit_start_time__, __LINE__) = photon::now;                                    \
-    DEFER(default_audit_logger << LOG_AUDIT(                                                       \
-              __VA_ARGS__, make_named_value("latency", photon::now - _CONCAT(__audit_start_time__, \
-                                                                             __LINE__))));
+    DEFER({                                                                                        \
+        auto latency = photon::now - _CONCAT(__audit_start_time__, __LINE__);                      \
+        if (!audit_ring_enabled() || !audit_binary(latency, __VA_ARGS__)) {                        \
+            default_audit_logger << LOG_AUDIT(__VA_ARGS__, make_named_value("latency", latency));  \
+        }                                                                                          \
+    });
 
 #define SCOPE_AUDIT_THRESHOLD(threshold, ...)                                                      \
     auto _CONCAT(__audit_start_time__, __LINE__) = photon::now;                                    \
     DEFER({                                                                                        \
         auto latency = photon::now - _CONCAT(__audit_start_time__, __LINE__);                      \
-        if (latency >= (threshold)) {                                                              \
+        if (latency >= (threshold) &&                                                              \
+            (!audit_ring_enabled() || !audit_binary(latency, __VA_ARGS__))) {                      \
             default_audit_logger << LOG_AUDIT(__VA_ARGS__, make_named_value("latency", latency));  \
         }                                                                                          \
     });
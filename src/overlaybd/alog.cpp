@@ -24,6 +24,8 @@
 #include <algorithm>
 #include <thread>
 #include <chrono>
+#include <memory>
+#include <vector>
 using namespace std;
 
 class BaseLogOutput : public ILogOutput {
@@ -394,6 +396,179 @@ int log_output_file_close() {
     return 0;
 }
 
+// A ring of log lines, written by a single OS thread and read by the
+// flusher, each line prefixed by its length and level
+class LogRing {
+public:
+    explicit LogRing(size_t size) : m_buf(new char[size]), m_mask(size - 1) {
+    }
+
+    bool push(int level, const char *begin, const char *end) {
+        Header h{(uint32_t)(end - begin), level};
+        auto t = m_tail.load(memory_order_relaxed);
+        if (t + sizeof(h) + h.length - m_head.load(memory_order_acquire) > m_mask + 1)
+            return false;
+        copy_in(t, &h, sizeof(h));
+        copy_in(t + sizeof(h), begin, h.length);
+        m_tail.store(t + sizeof(h) + h.length, memory_order_release);
+        return true;
+    }
+
+    bool pop(vector<char> &line, int &level) {
+        auto h = m_head.load(memory_order_relaxed);
+        if (h == m_tail.load(memory_order_acquire))
+            return false;
+        Header hdr;
+        copy_out(h, &hdr, sizeof(hdr));
+        line.resize(hdr.length);
+        copy_out(h + sizeof(hdr), line.data(), hdr.length);
+        level = hdr.level;
+        m_head.store(h + sizeof(hdr) + hdr.length, memory_order_release);
+        return true;
+    }
+
+    bool empty() {
+        return m_head.load(memory_order_acquire) == m_tail.load(memory_order_acquire);
+    }
+
+protected:
+    struct Header {
+        uint32_t length;
+        int32_t level;
+    };
+    unique_ptr<char[]> m_buf;
+    size_t m_mask;
+    atomic<uint64_t> m_head{0}, m_tail{0};
+
+    void copy_in(uint64_t pos, const void *src, size_t n) {
+        auto off = pos & m_mask;
+        auto n1 = min(n, m_mask + 1 - off);
+        memcpy(&m_buf[off], src, n1);
+        memcpy(&m_buf[0], (const char *)src + n1, n - n1);
+    }
+    void copy_out(uint64_t pos, void *dst, size_t n) {
+        auto off = pos & m_mask;
+        auto n1 = min(n, m_mask + 1 - off);
+        memcpy(dst, &m_buf[off], n1);
+        memcpy((char *)dst + n1, &m_buf[0], n - n1);
+    }
+};
+
+class AsyncLogOutput : public BaseLogOutput {
+public:
+    atomic<uint64_t> dropped{0};
+
+    AsyncLogOutput(ILogOutput *output, size_t ring_size, bool ownership)
+        : m_output(output), m_ownership(ownership), m_id(next_id++) {
+        m_ring_size = LOG_BUFFER_SIZE * 2;
+        while (m_ring_size < ring_size)
+            m_ring_size *= 2;
+        m_flusher = thread(&AsyncLogOutput::flush, this);
+    }
+
+    ~AsyncLogOutput() {
+        m_stopping = true;
+        m_flusher.join();
+        if (m_ownership)
+            delete m_output;
+    }
+
+    void write(int level, const char *begin, const char *end) override {
+        if (!get_ring()->push(level, begin, end))
+            dropped++;
+    }
+    int get_log_file_fd() override {
+        return m_output->get_log_file_fd();
+    }
+    uint64_t set_throttle(uint64_t t = -1) override {
+        return m_output->set_throttle(t);
+    }
+    uint64_t get_throttle() override {
+        return m_output->get_throttle();
+    }
+
+protected:
+    ILogOutput *m_output;
+    bool m_ownership;
+    uint64_t m_id;
+    size_t m_ring_size;
+    atomic<bool> m_stopping{false};
+    thread m_flusher;
+    mutex m_rings_lock;
+    vector<shared_ptr<LogRing>> m_rings;
+    static atomic<uint64_t> next_id;
+
+    // the ring of the calling OS thread, which is kept by the flusher
+    // until drained, after the thread exits
+    LogRing *get_ring() {
+        static thread_local vector<pair<uint64_t, shared_ptr<LogRing>>> rings;
+        for (auto &x : rings)
+            if (x.first == m_id)
+                return x.second.get();
+        auto ring = make_shared<LogRing>(m_ring_size);
+        {
+            lock_guard<mutex> lock(m_rings_lock);
+            m_rings.push_back(ring);
+        }
+        rings.emplace_back(m_id, ring);
+        return ring.get();
+    }
+
+    void flush() {
+        vector<char> line;
+        vector<shared_ptr<LogRing>> rings;
+        uint64_t reported = 0;
+        while (true) {
+            bool stopping = m_stopping;
+            {
+                lock_guard<mutex> lock(m_rings_lock);
+                rings = m_rings;
+            }
+            bool idle = true;
+            int level;
+            for (auto &r : rings) {
+                while (r->pop(line, level)) {
+                    m_output->write(level, line.data(), line.data() + line.size());
+                    idle = false;
+                }
+            }
+            rings.clear();
+            uint64_t n = dropped;
+            if (n > reported) {
+                char msg[64];
+                int len = snprintf(msg, sizeof(msg), "%lu log lines dropped\n",
+                                   (unsigned long)(n - reported));
+                m_output->write(ALOG_WARN, msg, msg + len);
+                reported = n;
+            }
+            {
+                // rings of exited threads
+                lock_guard<mutex> lock(m_rings_lock);
+                m_rings.erase(remove_if(m_rings.begin(), m_rings.end(),
+                                        [](const shared_ptr<LogRing> &r) {
+                                            return r.use_count() == 1 && r->empty();
+                                        }),
+                              m_rings.end());
+            }
+            if (stopping)
+                break;
+            if (idle)
+                this_thread::sleep_for(chrono::milliseconds(10));
+        }
+    }
+};
+
+atomic<uint64_t> AsyncLogOutput::next_id{0};
+
+ILogOutput *new_async_log_output(ILogOutput *output, size_t ring_size, bool ownership) {
+    return new AsyncLogOutput(output, ring_size, ownership);
+}
+
+uint64_t log_output_dropped(ILogOutput *output) {
+    auto async = dynamic_cast<AsyncLogOutput *>(output);
+    return async ? async->dropped.load() : 0;
+}
+
 namespace photon {
 struct thread;
 #ifndef LOGCURRENT
@@ -401,7 +576,7 @@ static
 #else
 extern
 #endif
-    thread *CURRENT;
+    __thread thread *CURRENT;
 } // namespace photon
 
 static inline ALogInteger DEC_W2P0(uint64_t x) {
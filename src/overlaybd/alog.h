@@ -49,6 +49,14 @@ int log_output_file(const char *fn, uint64_t rotate_limit = UINT64_MAX, int max_
                     uint64_t throttle = -1UL);
 int log_output_file_close();
 
+// wraps `output`, so that a log line is copied into a ring buffer of the
+// calling OS thread, and written to `output` by a background thread;
+// a line that does not fit in the ring is dropped, and counted
+ILogOutput *new_async_log_output(ILogOutput *output, size_t ring_size = 1024 * 1024,
+                                 bool ownership = false);
+// # of lines dropped by an async log output, 0 for others
+uint64_t log_output_dropped(ILogOutput *output);
+
 #ifndef LOG_BUFFER_SIZE
 // size of a temp buffer on stack to format a log, deallocated after output
 #define LOG_BUFFER_SIZE 4096
@@ -53,11 +53,42 @@ namespace FileSystem
             m_alignment = alignment;
             m_align_memory = align_memory;
         }
-        void* mem_alloc(uint64_t size)
+        // a buffer of the allocator, released when out of scope
+        struct scoped_buffer
         {
-            void* ptr = nullptr;
-            m_allocator.allocate(IOAlloc::RangeSize{(int)size, (int)size}, &ptr);
-            return ptr;
+            IOAlloc& alloc;
+            void* ptr;
+            scoped_buffer(IOAlloc& alloc, uint64_t size) : alloc(alloc)
+            {
+                ptr = size ? alloc.alloc(size) : nullptr;
+            }
+            ~scoped_buffer()
+            {
+                if (ptr) alloc.dealloc(ptr);
+            }
+        };
+        // copy between `ptr` and the `n` bytes at `offset` of `buf`
+        static void memcpy_iov(const iovector_view& buf, uint64_t offset, void* ptr,
+                               uint64_t n, bool to_iov)
+        {
+            for (auto p : buf) {
+                if (n == 0) break;
+                if (offset >= p.iov_len) {
+                    offset -= p.iov_len;
+                    continue;
+                }
+                auto len = std::min(p.iov_len - offset, n);
+                auto base = (char*)p.iov_base + offset;
+                if (to_iov) memcpy(base, ptr, len);
+                else memcpy(ptr, base, len);
+                (char*&)ptr += len;
+                n -= len;
+                offset = 0;
+            }
+        }
+        virtual Object *get_underlay_object(int i = 0) override
+        {
+            return m_file->get_underlay_object(i);
         }
         virtual ssize_t pread(void *buf, size_t count, off_t offset) override
         {
@@ -65,20 +96,8 @@ namespace FileSystem
             range_split_power2 rs(offset, count, m_alignment);
             if (rs.is_aligned() && (!m_align_memory || rs.is_aligned_ptr(buf)))
                 return m_file->pread(buf, count, offset);
-
-            auto ptr = mem_alloc(rs.aligned_length());
-            if (!ptr)
-                LOG_ERROR_RETURN(0, -1, "Failed to allocate memory");
-            DEFER(free(ptr));
-            ssize_t ret = m_file->pread(ptr, rs.aligned_length(), rs.aligned_begin_offset());
-            if (ret < (ssize_t)(rs.begin_remainder)) {
-                LOG_ERRNO_RETURN(0, -1, "failed to aligned [`]->pread(buf=`, count=`, offset=`), ret: ` ( < ` )",
-                                 m_file, ptr, rs.aligned_length(), rs.aligned_begin_offset(), ret, rs.begin_remainder + count);
-            }
-            auto actual_read = ret - rs.begin_remainder;
-            if (actual_read > count) actual_read = count;
-            memcpy(buf, (char*)ptr + rs.begin_remainder, actual_read);
-            return actual_read;
+            iovec iov{buf, count};
+            return preadv_mutable(&iov, 1, offset);
         }
         virtual ssize_t pwrite(const void *buf, size_t count, off_t offset) override
         {
@@ -86,50 +105,8 @@ namespace FileSystem
             range_split_power2 rs(offset, count, m_alignment);
             if (rs.is_aligned() && (!m_align_memory || rs.is_aligned_ptr(buf)))
                 return m_file->pwrite(buf, count, offset);
-
-            struct stat stat;
-            m_file->fstat(&stat);
-            ssize_t filesize = stat.st_size;
-            auto suppose_filesize = (offset + (ssize_t)count) > filesize ? offset + count: filesize;
-            auto ptr = mem_alloc(rs.aligned_length());
-            if (!ptr)
-                LOG_ERROR_RETURN(0, -1, "Failed to allocate memory");
-            DEFER(free(ptr));
-
-            if (rs.begin_remainder > 0)
-            {
-                ssize_t off = rs.aligned_begin_offset();
-                ssize_t ret = m_file->pread(ptr, m_alignment, off);
-                if ((ret < 0) || ((off + ret < filesize) && (ret < (ssize_t)m_alignment)))
-                    LOG_ERRNO_RETURN(0, -1, "failed to aligned [`]->pread(ptr=`, count=`, offset=`) and patch the first alignment block", m_file, ptr, m_alignment, off);
-                if (ret < (ssize_t)m_alignment) {
-                    memset((char*)ptr + ret, 0, m_alignment - ret);
-                }
-            }
-
-            if (!rs.small_note && rs.end_remainder > 0)
-            {
-                ssize_t off = rs.aligned_end_offset() - m_alignment; // this should never be negative
-                if (filesize - off > (ssize_t)(rs.end_remainder)) {
-                    // that means there is still parts of data after the rear end of pwrite block
-                    auto ptr_ = (char*)ptr + off - rs.aligned_begin_offset();
-                    ssize_t ret = m_file->pread(ptr_, m_alignment, off);
-                    if ((ret < 0) ||
-                        ((ret + off < filesize) && (ret < (ssize_t)m_alignment))) // cannot fetch all data of file, and cannot fillup aligned block
-                        LOG_ERRNO_RETURN(0, -1, "failed to aligned [`]->pread(ptr=`, count=`, offset=`) and patch the last alignment block", m_file, ptr_, m_alignment, off);
-                }
-            }
-
-            memcpy((char*)ptr + rs.begin_remainder, buf, count);
-            auto actual_write = m_file->pwrite(ptr, rs.aligned_length(), rs.aligned_begin_offset());
-            auto current_tail = rs.aligned_begin_offset() + actual_write;
-            if ((ssize_t)current_tail < offset)
-                return -1; // failed to write
-            auto count_write = current_tail - offset >= count ? count : current_tail - offset;
-            if (suppose_filesize < current_tail) { // that means have written more than needs
-                m_file->ftruncate(suppose_filesize);
-            }
-            return count_write;
+            iovec iov{(void*)buf, count};
+            return pwritev_mutable(&iov, 1, offset);
         }
         virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
             IOVector iovec(iov, iovcnt);
@@ -142,6 +119,53 @@ namespace FileSystem
             }
             return true;
         }
+        // the aligned range of a request, as the blocks at its unaligned edges,
+        // bounced in `edges`, and the middle in place in the buffer of the
+        // request, in `iov` for one I/O of the underlying file
+        struct EdgeSplit
+        {
+            uint64_t head = 0, tail = 0; // the length of the edge blocks, 0 or the alignment
+            uint64_t head_count = 0;     // # of bytes of the request in the head block
+            scoped_buffer edges;         // the head block, followed by the tail block
+            struct iovec io[MAX_TMP_IOVEC_SIZE];
+            struct iovec *iov = nullptr;
+            int iovcnt = 0;
+            EdgeSplit(IOAlloc& alloc) : edges(alloc, 0) {}
+        };
+        // return false if the middle is not aligned in memory as required, or
+        // is in too many iovecs, to be bounced altogether
+        bool split_edges(const range_split_power2& rs, uint64_t count,
+                         const iovector_view& buf, EdgeSplit& es)
+        {
+            auto length = rs.aligned_length();
+            es.head = rs.begin_remainder ? m_alignment : 0;
+            es.tail = (rs.end_remainder && length > es.head) ? m_alignment : 0;
+            es.head_count = es.head ? std::min(count, es.head - rs.begin_remainder) : 0;
+            auto mid = length - es.head - es.tail;
+            iovector_view view(es.io + 1, MAX_TMP_IOVEC_SIZE - 2);
+            if (mid == 0) {
+                view.iovcnt = 0;
+            } else if (buf.slice(mid, es.head_count, &view) != (ssize_t)mid ||
+                       (m_align_memory && !iov_align_check(view))) {
+                return false;
+            }
+            if (es.head + es.tail == 0)
+                return false;
+            es.edges.ptr = m_allocator.alloc(es.head + es.tail);
+            if (!es.edges.ptr)
+                return false;
+            es.iov = es.head ? es.io : es.io + 1;
+            es.iovcnt = view.iovcnt;
+            if (es.head) {
+                es.io[0] = {es.edges.ptr, es.head};
+                es.iovcnt++;
+            }
+            if (es.tail) {
+                es.io[1 + view.iovcnt] = {(char*)es.edges.ptr + es.head, es.tail};
+                es.iovcnt++;
+            }
+            return true;
+        }
         virtual ssize_t preadv_mutable(struct iovec *iov, int iovcnt, off_t offset) override {
             iovector_view buf(iov, iovcnt);
             auto count = buf.sum();
@@ -150,30 +174,74 @@ namespace FileSystem
             if (rs.is_aligned() && (!m_align_memory || iov_align_check(buf)))
                 return m_file->preadv_mutable(iov, iovcnt, offset);
 
-            IOVector rbuf(m_allocator);
-            auto ret = rbuf.push_back(rs.aligned_length());
-            if (ret < rs.aligned_length())
-                LOG_ERROR_RETURN(0, -1, "Failed to allocate");
-            ret = m_file->preadv(rbuf.iovec(), rbuf.iovcnt(), rs.aligned_begin_offset());
-            if (ret < rs.begin_remainder) {
-                LOG_ERRNO_RETURN(0, -1, "failed to aligned [`]->pread(iov=`, iovcnt=`, offset=`), ret: ` ( < ` )",
-                                 m_file, rbuf.iovec(), rbuf.iovcnt(), rs.aligned_begin_offset(), ret, rs.begin_remainder + count);
+            // only the edges are bounced, if the middle can be read in place
+            EdgeSplit es(m_allocator);
+            scoped_buffer rbuf(m_allocator, 0);
+            void *head = nullptr, *tail = nullptr;
+            ssize_t ret;
+            if (split_edges(rs, count, buf, es)) {
+                head = es.edges.ptr;
+                tail = (char*)es.edges.ptr + es.head;
+                ret = m_file->preadv_mutable(es.iov, es.iovcnt, rs.aligned_begin_offset());
+            } else {
+                rbuf.ptr = m_allocator.alloc(rs.aligned_length());
+                if (!rbuf.ptr)
+                    LOG_ERROR_RETURN(0, -1, "Failed to allocate memory");
+                head = rbuf.ptr;
+                es.head_count = count; // all in the bounce buffer
+                es.tail = 0;
+                ret = m_file->pread(rbuf.ptr, rs.aligned_length(), rs.aligned_begin_offset());
+            }
+            if (ret < (ssize_t)rs.begin_remainder) {
+                LOG_ERRNO_RETURN(0, -1, "failed to aligned [`]->preadv(count=`, offset=`), ret: ` ( < ` )",
+                                 m_file, rs.aligned_length(), rs.aligned_begin_offset(), ret, rs.begin_remainder + count);
             }
-            auto actual_read = ret - rs.begin_remainder;
+            uint64_t actual_read = ret - rs.begin_remainder;
             if (actual_read > count) actual_read = count;
-            if (rs.end_remainder)
-                rbuf.extract_back(m_alignment - rs.end_remainder);
-            rbuf.extract_front(rs.begin_remainder);
-            rbuf.memcpy_to(&buf, actual_read);
+            memcpy_iov(buf, 0, (char*)head + rs.begin_remainder,
+                       std::min(es.head_count, actual_read), true);
+            auto tail_begin = count - rs.end_remainder;
+            if (es.tail && actual_read > tail_begin)
+                memcpy_iov(buf, tail_begin, tail, actual_read - tail_begin, true);
             return actual_read;
         }
         virtual ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override {
             IOVector iovec(iov, iovcnt);
             return this->pwritev_mutable(iovec.iovec(), iovec.iovcnt(), offset);
         }
+        // read the blocks at the edges to be patched, in one read if adjacent;
+        // `tail` is read only if the file has data after the request in it
+        int read_edges(const range_split_power2& rs, char* head, char* tail, ssize_t filesize)
+        {
+            ssize_t off = rs.aligned_begin_offset();
+            ssize_t tail_off = rs.aligned_end_offset() - m_alignment;
+            bool read_tail = tail && filesize - tail_off > (ssize_t)rs.end_remainder;
+            ssize_t len = m_alignment;
+            if (head && read_tail && tail == head + m_alignment && tail_off == off + m_alignment)
+                len *= 2;
+            if (head || len > m_alignment) {
+                ssize_t ret = m_file->pread(head, len, off);
+                if ((ret < 0) || ((off + ret < filesize) && (ret < len)))
+                    LOG_ERRNO_RETURN(0, -1, "failed to aligned [`]->pread(ptr=`, count=`, offset=`) and patch the first alignment block", m_file, head, len, off);
+                if (ret < len)
+                    memset(head + ret, 0, len - ret);
+                if (len > m_alignment)
+                    return 0;
+            }
+            if (tail) {
+                ssize_t ret = 0;
+                if (read_tail) {
+                    ret = m_file->pread(tail, m_alignment, tail_off);
+                    if ((ret < 0) ||
+                        ((ret + tail_off < filesize) && (ret < (ssize_t)m_alignment))) // cannot fetch all data of file, and cannot fillup aligned block
+                        LOG_ERRNO_RETURN(0, -1, "failed to aligned [`]->pread(ptr=`, count=`, offset=`) and patch the last alignment block", m_file, tail, m_alignment, tail_off);
+                }
+                if (ret < (ssize_t)m_alignment)
+                    memset(tail + ret, 0, m_alignment - ret);
+            }
+            return 0;
+        }
         virtual ssize_t pwritev_mutable(struct iovec *iov, int iovcnt, off_t offset) override {
-            struct iovec tmpiovec[MAX_TMP_IOVEC_SIZE];
-            iovector_view view(tmpiovec, MAX_TMP_IOVEC_SIZE);
             iovector_view buf(iov, iovcnt);
             auto count = buf.sum();
             if (count == 0) return 0;
@@ -185,65 +253,46 @@ namespace FileSystem
             m_file->fstat(&stat);
             ssize_t filesize = stat.st_size;
             auto suppose_filesize = (offset + (ssize_t)count) > filesize ? offset + count: filesize;
-            IOVector wbuf(m_allocator);
-            auto ret = wbuf.push_back(rs.aligned_length());
-            if (ret < rs.aligned_length())
-                LOG_ERROR_RETURN(0, -1, "Failed to allocate memory");
 
-            if (rs.begin_remainder > 0)
-            {
-                view.iovcnt = MAX_TMP_IOVEC_SIZE;
-                ssize_t ret = wbuf.slice(m_alignment, 0, &view);
-                assert(ret == m_alignment);
-                ssize_t off = rs.aligned_begin_offset();
-                ret = m_file->preadv(view.iov, view.iovcnt, off);
-                if ((ret < 0) || ((off + ret < filesize) && (ret < (ssize_t)m_alignment)))
-                    LOG_ERRNO_RETURN(0, -1, "failed to aligned [`]->preadv(iov=`, iovcnt=`, offset=`) and patch the first alignment block",
-                                     m_file, view.iov, view.iovcnt, off);
-                if (ret < (ssize_t)m_alignment) {
-                    view.extract_front(ret);
-                    for (auto &p : view) {
-                        memset(p.iov_base, 0, p.iov_len);
-                    }
-                }
-            }
-            if (!rs.small_note && rs.end_remainder > 0)
-            {
-                ssize_t off = rs.aligned_end_offset() - m_alignment; // this should never be negative
-                if (filesize - off > (ssize_t)(rs.end_remainder)) {
-                    // that means there is still parts of data after the rear end of pwrite block
-                    view.iovcnt = MAX_TMP_IOVEC_SIZE;
-                    ssize_t ret = wbuf.slice(m_alignment, wbuf.sum() - m_alignment, &view);
-                    assert(ret == m_alignment);
-                    ret = m_file->preadv(view.iov, view.iovcnt, off);
-                    if (ret < 0)
-                        LOG_ERRNO_RETURN(0, -1, "failed to aligned [`]->preadv(ptr=`, count=`, offset=`)",
-                                         m_file, view.iov, view.iovcnt, off);
-                    if ((ret + off < filesize) && (ret < (ssize_t)m_alignment)) // cannot fetch all data of file, and cannot fillup aligned block
-                        LOG_ERRNO_RETURN(0, -1, "aligned [`]->preadv(ptr=`, count=`, offset=`) partial read",
-                                         m_file, view.iov, view.iovcnt, off);
-                }
+            // only the edges are bounced, if the middle can be written in place,
+            // with the edges patched, in one write
+            EdgeSplit es(m_allocator);
+            scoped_buffer wbuf(m_allocator, 0);
+            ssize_t actual_write;
+            if (split_edges(rs, count, buf, es)) {
+                auto head = (char*)es.edges.ptr;
+                auto tail = head + es.head;
+                if (read_edges(rs, es.head ? head : nullptr, es.tail ? tail : nullptr, filesize) < 0)
+                    return -1;
+                memcpy_iov(buf, 0, head + rs.begin_remainder, es.head_count, false);
+                if (es.tail)
+                    memcpy_iov(buf, count - rs.end_remainder, tail, rs.end_remainder, false);
+                actual_write = m_file->pwritev_mutable(es.iov, es.iovcnt, rs.aligned_begin_offset());
+            } else {
+                wbuf.ptr = m_allocator.alloc(rs.aligned_length());
+                if (!wbuf.ptr)
+                    LOG_ERROR_RETURN(0, -1, "Failed to allocate memory");
+                auto head = (char*)wbuf.ptr;
+                auto tail = head + rs.aligned_length() - m_alignment;
+                bool has_tail = rs.end_remainder &&
+                                rs.aligned_length() > (rs.begin_remainder ? m_alignment : 0);
+                if (read_edges(rs, rs.begin_remainder ? head : nullptr,
+                               has_tail ? tail : nullptr, filesize) < 0)
+                    return -1;
+                memcpy_iov(buf, 0, head + rs.begin_remainder, count, false);
+                actual_write = m_file->pwrite(wbuf.ptr, rs.aligned_length(), rs.aligned_begin_offset());
             }
-            view.iovcnt = MAX_TMP_IOVEC_SIZE;
-            ret = wbuf.slice(count, rs.begin_remainder, &view);
-            assert(ret == count);
-            ret = view.memcpy_from(&buf, count);
-            assert(ret == count);
-            auto actual_write = m_file->pwritev_mutable(wbuf.iovec(), wbuf.iovcnt(), rs.aligned_begin_offset());
             auto current_tail = rs.aligned_begin_offset() + actual_write;
             if ((ssize_t)current_tail < offset)
                 LOG_ERRNO_RETURN(0, -1, "failed to pwritev");
             if (suppose_filesize < current_tail) { // that means have written more than needs
                 m_file->ftruncate(suppose_filesize);
                 current_tail = suppose_filesize;
-            } else { // means pwrite will not extend file
-
             }
             auto count_write = current_tail - offset;
             if (count_write > count)
                 count_write = count;
             return count_write;
-
         }
     };
 
@@ -44,14 +44,14 @@ ICacheStore::try_preadv_result ICacheStore::try_preadv_mutable(struct iovec *iov
 }
 ssize_t ICacheStore::preadv(const struct iovec *iov, int iovcnt, off_t offset) {
     SmartCloneIOV<32> ciov(iov, iovcnt);
-    return preadv_mutable(ciov.iov, iovcnt, offset);
+    return preadv_mutable(ciov.ptr, iovcnt, offset);
 }
 ssize_t ICacheStore::preadv_mutable(struct iovec *iov, int iovcnt, off_t offset) {
     return preadv(iov, iovcnt, offset);
 }
 ssize_t ICacheStore::pwritev(const struct iovec *iov, int iovcnt, off_t offset) {
     SmartCloneIOV<32> ciov(iov, iovcnt);
-    return pwritev_mutable(ciov.iov, iovcnt, offset);
+    return pwritev_mutable(ciov.ptr, iovcnt, offset);
 }
 ssize_t ICacheStore::pwritev_mutable(struct iovec *iov, int iovcnt, off_t offset) {
     return pwritev(iov, iovcnt, offset);
@@ -60,21 +60,67 @@ ssize_t ICacheStore::pwritev_mutable(struct iovec *iov, int iovcnt, off_t offset
 ICachedFileSystem *new_full_file_cached_fs(IFileSystem *srcFs, IFileSystem *mediaFs,
                                            uint64_t refillUnit, uint64_t capacityInGB,
                                            uint64_t periodInUs, uint64_t diskAvailInBytes,
-                                           IOAlloc *allocator) {
+                                           IOAlloc *allocator, uint64_t memCapacityInBytes,
+                                           uint32_t memPromoteHits, const char *evictionPolicy,
+                                           bool evictUnits, bool asyncRefill,
+                                           bool cacheByDigest, uint64_t evictRateInBytes,
+                                           uint32_t admitHits, IFileSystem *fastMediaFs,
+                                           uint64_t fastCapacityInGB, uint32_t fastPromoteHits,
+                                           bool mmapHits) {
     if (refillUnit % 4096 != 0) {
         LOG_ERROR_RETURN(EINVAL, nullptr, "refill Unit need to be aligned to 4KB")
     }
     if (!allocator) {
         allocator = new IOAlloc;
     }
-    Cache::FileCachePool *pool = nullptr;
-    pool =
-        new ::Cache::FileCachePool(mediaFs, capacityInGB, periodInUs, diskAvailInBytes, refillUnit);
-    pool->Init();
-    return new_cached_fs(srcFs, pool, 4096, refillUnit, allocator);
+    ICachePool *pool = nullptr;
+    auto diskPool = new ::Cache::FileCachePool(mediaFs, capacityInGB, periodInUs,
+                                               diskAvailInBytes, refillUnit, evictionPolicy,
+                                               evictUnits, evictRateInBytes, mmapHits);
+    diskPool->Init();
+    pool = diskPool;
+    if (fastMediaFs) {
+        auto fastPool = new ::Cache::FileCachePool(fastMediaFs, fastCapacityInGB, periodInUs,
+                                                   diskAvailInBytes, refillUnit, evictionPolicy,
+                                                   evictUnits, evictRateInBytes, mmapHits);
+        fastPool->Init();
+        pool = new_tiered_cache_pool(fastPool, diskPool, refillUnit, fastPromoteHits);
+        if (!pool) {
+            delete fastPool;
+            delete diskPool;
+            LOG_ERRNO_RETURN(0, nullptr, "failed to create tiered cache pool");
+        }
+    }
+    pool->set_key_by_digest(cacheByDigest);
+    if (memCapacityInBytes > 0) {
+        auto memPool = new_mem_cache_pool(pool, memCapacityInBytes, refillUnit, memPromoteHits);
+        if (!memPool) {
+            delete pool;
+            LOG_ERRNO_RETURN(0, nullptr, "failed to create memory cache pool");
+        }
+        memPool->set_key_by_digest(cacheByDigest);
+        return new_cached_fs(srcFs, memPool, 4096, refillUnit, allocator, asyncRefill,
+                             admitHits);
+    }
+    return new_cached_fs(srcFs, pool, 4096, refillUnit, allocator, asyncRefill, admitHits);
+}
+
+std::string ICachePool::cache_key(std::string_view filename) const {
+    const std::string_view kPrefix = "sha256:";
+    const size_t kHexLen = 64;
+    if (!m_key_by_digest)
+        return std::string(filename.data(), filename.size());
+    auto pos = filename.rfind('/');
+    auto base = pos == std::string_view::npos ? filename : filename.substr(pos + 1);
+    if (base.size() != kPrefix.size() + kHexLen || base.substr(0, kPrefix.size()) != kPrefix ||
+        base.find_first_not_of("0123456789abcdef", kPrefix.size()) != std::string_view::npos)
+        return std::string(filename.data(), filename.size());
+    return "/blobs/" + std::string(base.data(), base.size());
 }
 
-ICacheStore *ICachePool::open(std::string_view filename, int flags, mode_t mode) {
+ICacheStore *ICachePool::open(std::string_view pathname, int flags, mode_t mode) {
+    auto key = cache_key(pathname);
+    std::string_view filename = key;
     ICacheStore *cache_store = nullptr;
     auto it = m_stores.find(filename);
     if (it != m_stores.end())
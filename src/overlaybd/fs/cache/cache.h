@@ -17,11 +17,14 @@
 #include <inttypes.h>
 #include <sys/uio.h>
 #include <stdlib.h>
+#include "../../callback.h"
 #include "../filesystem.h"
 #include "pool_store.h"
 
 struct IOAlloc;
 namespace FileSystem {
+class ICachedFile;
+
 class ICachedFileSystem : public IFileSystem {
 public:
     // get the source file system
@@ -31,6 +34,11 @@ public:
     UNIMPLEMENTED(int set_source(IFileSystem *src));
 
     UNIMPLEMENTED_POINTER(ICachePool *get_pool());
+
+    // open the cache of `pathname` over `src`, instead of the file of the
+    // source fs, e.g. for the data decoded from a file of it; the returned
+    // file owns `src`, which is deleted on failure as well
+    UNIMPLEMENTED_POINTER(ICachedFile *open_cached(const char *pathname, IFile *src));
 };
 
 class ICachedFile : public IFile {
@@ -66,6 +74,11 @@ public:
         return preadv(&iov, 1, offset);
     }
 
+    // prefetching a range in background, `done` is fired with the bytes
+    // prefetched, or -1 for failure; concurrent prefetches are allowed
+    using PrefetchDone = Callback<ssize_t>;
+    UNIMPLEMENTED(int prefetch_async(off_t offset, size_t count, PrefetchDone done));
+
     // query cached extents is implemented as fiemap()
     UNIMPLEMENTED(int query(off_t offset, size_t count))
 
@@ -99,14 +112,63 @@ public:
     virtual int unpin_buffer(off_t offset, const iovector *iov) = 0;
 };
 
+// how the misses read by a photon thread are admitted into the cache
+enum CacheAdmission {
+    ADMIT_BY_FILTER = 0, // by the admission filter of the cached fs, if any
+    ADMIT_ALWAYS,        // e.g. replaying a trace known to be hot
+    ADMIT_NEVER,         // e.g. one-shot scans, served from the source only
+};
+
 extern "C" {
+// with `asyncRefill`, a read missing the cache returns once the source read
+// completes, and the cache is written in background; with `admitHits` > 0,
+// a refill unit is written into the cache only once it has been missed
+// `admitHits` times recently, as estimated by a count-min sketch
 ICachedFileSystem *new_cached_fs(IFileSystem *src, ICachePool *pool, uint64_t pageSize,
-                                 uint64_t refillUnit, IOAlloc *allocator);
-
+                                 uint64_t refillUnit, IOAlloc *allocator,
+                                 bool asyncRefill = false, uint32_t admitHits = 0);
+
+// set the CacheAdmission of the current photon thread, ADMIT_BY_FILTER by
+// default, which must be restored before the thread exits
+void cached_fs_set_admission(int admission);
+
+// with `memCapacityInBytes` > 0, a DRAM tier is stacked above the disk cache,
+// see new_mem_cache_pool(); `evictionPolicy` of cached files is "lru" or "2q",
+// and with `evictUnits`, cold refill units of open files are evicted first;
+// `asyncRefill` is passed to new_cached_fs(); with `cacheByDigest`, files
+// named after a layer digest share one cache file, see ICachePool::cache_key();
+// eviction frees at most `evictRateInBytes` per second, 0 for no limit;
+// `admitHits` is passed to new_cached_fs(); with `fastMediaFs`, a cache of
+// `fastCapacityInGB` on a faster device is tiered above the one on `media_fs`,
+// see new_tiered_cache_pool(); with `mmapHits`, hits are copied from a
+// mapping of the cache files, saving a syscall for each
 ICachedFileSystem *new_full_file_cached_fs(IFileSystem *srcFs, IFileSystem *media_fs,
                                            uint64_t refillUnit, uint64_t capacityInGB,
                                            uint64_t periodInUs, uint64_t diskAvailInBytes,
-                                           IOAlloc *allocator);
+                                           IOAlloc *allocator, uint64_t memCapacityInBytes = 0,
+                                           uint32_t memPromoteHits = 2,
+                                           const char *evictionPolicy = "lru",
+                                           bool evictUnits = false,
+                                           bool asyncRefill = false,
+                                           bool cacheByDigest = false,
+                                           uint64_t evictRateInBytes = 0,
+                                           uint32_t admitHits = 0,
+                                           IFileSystem *fastMediaFs = nullptr,
+                                           uint64_t fastCapacityInGB = 0,
+                                           uint32_t fastPromoteHits = 2,
+                                           bool mmapHits = false);
+
+// a DRAM tier of `capacity` bytes above the `lower` pool, which it owns;
+// blocks of `blockSize` hit in the lower pool `promoteHits` times are copied
+// into memory, and served from there afterwards
+ICachePool *new_mem_cache_pool(ICachePool *lower, uint64_t capacity, uint64_t blockSize,
+                               uint32_t promoteHits);
+
+// a cache over two devices, owning both pools; every refill goes to the
+// `slow` pool, and blocks of `blockSize` hit there `promoteHits` times are
+// copied to the `fast` one, each pool evicting within its own capacity
+ICachePool *new_tiered_cache_pool(ICachePool *fast, ICachePool *slow, uint64_t blockSize,
+                                  uint32_t promoteHits);
 
 ICachedFile *new_mem_cached_file(IFile *src, uint64_t mem_size, uint64_t refillUnit,
                                  IOAlloc *allocator);
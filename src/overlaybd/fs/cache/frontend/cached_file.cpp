@@ -16,25 +16,59 @@
 #include "cached_file.h"
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
 #include "../../../alog-audit.h"
 #include "../../../alog-stdstring.h"
 #include "../../../alog.h"
 #include "../../../iovector.h"
+#include "../../../metrics.h"
+#include "../../../trace.h"
+#include "../../../photon/thread11.h"
 #include "../../../utility.h"
 #include "../pool_store.h"
+#include "../policy/sketch.h"
 #include "../../range-split.h"
 
 namespace Cache {
 
-const off_t kMaxPrefetchSize = 16 * 1024 * 1024;
+const off_t kMaxPrefetchSize = 4 * 1024 * 1024;
+
+namespace {
+struct CacheMetrics {
+    Metrics::Counter *hits =
+        Metrics::counter("overlaybd_cache_hits_total", "Reads served by the cache entirely");
+    Metrics::Counter *misses = Metrics::counter("overlaybd_cache_misses_total",
+                                                "Reads going to the source, in part or whole");
+    Metrics::Counter *refill_bytes = Metrics::counter(
+        "overlaybd_cache_refill_bytes_total", "Bytes read from the source to fill the cache");
+};
+
+CacheMetrics &metrics() {
+    static CacheMetrics m;
+    return m;
+}
+} // namespace
 
 CachedFile::CachedFile(FileSystem::IFile *src_file, FileSystem::ICacheStore *cache_store,
                        off_t size, size_t pageSize, size_t refillUnit, IOAlloc *allocator,
-                       IFileSystem *fs)
+                       IFileSystem *fs, bool asyncRefill, CountMinSketch *admission,
+                       uint32_t admitHits)
     : src_file_(src_file), cache_store_(cache_store), size_(size), pageSize_(pageSize),
-      refillUnit_(refillUnit), allocator_(allocator), fs_(fs), readOffset_(0), writeOffset_(0){};
+      refillUnit_(refillUnit), allocator_(allocator), fs_(fs), readOffset_(0), writeOffset_(0),
+      asyncRefill_(asyncRefill), admission_(admission), admitHits_(admitHits) {
+    if (admission_) {
+        // FNV-1a, to tell the refill units of different files apart
+        pathHash_ = 14695981039346656037ULL;
+        for (auto c : get_pathname())
+            pathHash_ = (pathHash_ ^ (uint8_t)c) * 1099511628211ULL;
+    }
+}
 
 CachedFile::~CachedFile() {
+    while (pendingTasks_ > 0)
+        tasksDone_.wait_no_lock();
     cache_store_->release();
     delete src_file_;
 }
@@ -51,46 +85,160 @@ ssize_t CachedFile::pread(void *buf, size_t count, off_t offset) {
 }
 
 ssize_t CachedFile::preadv(const struct iovec *iov, int iovcnt, off_t offset) {
+    SCOPE_TRACE("cache");
     if (1 == iovcnt && !iov->iov_base) {
         return prefetch(iov->iov_len, offset);
     }
-    return preadvInternal(iov, iovcnt, offset);
+    // the iovecs are held in an IOVector on the stack, so a longer array
+    // is read in pieces of as many as it holds
+    ssize_t done = 0;
+    while (iovcnt > IOVector::capacity) {
+        iovector_view piece(const_cast<struct iovec *>(iov), IOVector::capacity);
+        auto size = static_cast<ssize_t>(piece.sum());
+        auto ret = preadvInternal(iov, IOVector::capacity, offset + done);
+        if (ret < 0)
+            return ret;
+        done += ret;
+        if (ret < size)
+            return done;
+        iov += IOVector::capacity;
+        iovcnt -= IOVector::capacity;
+    }
+    auto ret = preadvInternal(iov, iovcnt, offset + done);
+    if (ret < 0)
+        return ret;
+    return done + ret;
 }
 
-ssize_t CachedFile::prefetch(size_t count, off_t offset) {
-    static char buf[kMaxPrefetchSize * 2] = {0};
-    void *alignBuf = align_ptr(buf, pageSize_);
-    struct iovec iov {
-        alignBuf, count
-    };
+static std::mutex admissions_mtx;
+static std::unordered_map<photon::thread *, int> admissions;
+
+bool CachedFile::admit(off_t refillOffset) {
+    int admission = ADMIT_BY_FILTER;
+    {
+        // shared by the threads of all vcpus
+        std::lock_guard<std::mutex> lock(admissions_mtx);
+        auto it = admissions.find(photon::CURRENT);
+        if (it != admissions.end())
+            admission = it->second;
+    }
+    if (admission == ADMIT_NEVER)
+        return false;
+    if (admission == ADMIT_ALWAYS || !admission_)
+        return true;
+    auto key = pathHash_ * 31 + refillOffset / refillUnit_;
+    return admission_->increment(key) >= admitHits_;
+}
+
+// the size of source reads that keeps the link busy, in refill units, or 0
+// if the source doesn't tell, see IOCTL_FETCH_SIZE
+size_t CachedFile::fetchSize() {
+    size_t size = 0;
+    if (src_file_->ioctl(IOCTL_FETCH_SIZE, &size) < 0)
+        return 0;
+    return alingn_up(size, refillUnit_);
+}
 
-    auto end = offset + count;
+// refill the missing parts of the range into the cache, in pieces of at most
+// the fetch size of the source, or kMaxPrefetchSize, without reading the
+// cached parts or copying data out
+ssize_t CachedFile::prefetch(size_t count, off_t offset) {
+    off_t end = offset + count;
     if (offset % pageSize_ != 0) {
         offset = offset & ~(pageSize_ - 1);
     }
     if (end % pageSize_ != 0) {
         end = (end + pageSize_ - 1) & ~(pageSize_ - 1);
     }
+    end = std::min(end, size_);
+    if (offset >= end) {
+        return 0;
+    }
+    if (!src_file_) {
+        return -1;
+    }
 
-    off_t remain = end - offset;
-    ssize_t read = 0;
-    while (remain > 0) {
-        off_t min = std::min(kMaxPrefetchSize, remain);
-        remain -= min;
-        iov.iov_len = min;
-        auto ret = preadvInternal(&iov, 1, offset);
-        if (ret < 0) {
-            LOG_ERRNO_RETURN(0, -1, "preadv failed, ret : `, len : `, offset : `, size_ : `", ret,
-                             min, offset, size_);
+    auto pieceSize = fetchSize();
+    if (pieceSize == 0)
+        pieceSize = kMaxPrefetchSize;
+    off_t pos = offset;
+    while (pos < end) {
+        auto q = cache_store_->queryRefillRange(pos, end - pos);
+        if (q.second == 0) {
+            break;
+        }
+        uint64_t refillOff = q.first;
+        uint64_t refillSize = std::min(q.second, pieceSize);
+        if (refillOff + refillSize > static_cast<uint64_t>(size_)) {
+            refillSize = size_ - refillOff;
         }
-        read += ret;
-        //  read end of file.
-        if (ret < min) {
-            return read;
+        // being refilled by others, query again once they are done
+        if (rangeLock_.try_lock_wait(refillOff, refillSize) < 0) {
+            continue;
         }
-        offset += ret;
+
+        auto refill = new Refill(refillOff, refillSize, allocator_);
+        refills_.push_back(refill);
+        DEFER(putRefill(refill));
+        auto &buffer = refill->buffer;
+        auto alloc = buffer.push_back(refillSize);
+        if (alloc < refillSize) {
+            endRefill(refill, false);
+            LOG_ERROR_RETURN(ENOMEM, -1, "memory allocate failed, refillSize:`, alloc:`",
+                             refillSize, alloc);
+        }
+        ssize_t read;
+        {
+            SCOPE_AUDIT("download", AU_FILEOP(get_pathname(), refillOff, read));
+            read = src_file_->preadv(buffer.iovec(), buffer.iovcnt(), refillOff);
+        }
+        if (read != static_cast<ssize_t>(refillSize)) {
+            endRefill(refill, false);
+            LOG_ERRNO_RETURN(0, -1,
+                             "src file read failed, read : `, expectRead : `, size_ : `, offset : `",
+                             read, refillSize, size_, refillOff);
+        }
+        metrics().refill_bytes->inc(read);
+        refill->ready = true;
+        refill->cv.notify_all();
+
+        if (asyncRefill_) {
+            refill->refs++;
+            pendingTasks_++;
+            photon::thread_create11(&CachedFile::writeRefill, this, refill);
+        } else {
+            auto write = cache_store_->pwritev(buffer.iovec(), buffer.iovcnt(), refillOff);
+            endRefill(refill, true);
+            if (write != static_cast<ssize_t>(refillSize)) {
+                if (ENOSPC != errno)
+                    LOG_ERROR("cache file write failed : `, error : `, size_ : `, offset : `",
+                              write, ERRNO(errno), size_, refillOff);
+                return -1;
+            }
+        }
+        pos = refillOff + refillSize;
+    }
+    return end - offset;
+}
+
+int CachedFile::prefetch_async(off_t offset, size_t count, PrefetchDone done) {
+    if (offset < 0) {
+        LOG_ERROR_RETURN(EINVAL, -1, "offset is invalid, offset : `", offset)
     }
-    return read;
+    pendingTasks_++;
+    photon::thread_create11(&CachedFile::prefetchTask, this, offset, count, done);
+    return 0;
+}
+
+void CachedFile::prefetchTask(off_t offset, size_t count, PrefetchDone done) {
+    auto ret = prefetch(count, offset);
+    done.fire(ret);
+    taskDone();
+}
+
+void CachedFile::taskDone() {
+    if (--pendingTasks_ == 0)
+        tasksDone_.notify_all();
 }
 
 ssize_t CachedFile::preadvInternal(const struct iovec *iov, int iovcnt, off_t offset) {
@@ -125,6 +273,8 @@ ssize_t CachedFile::preadvInternal(const struct iovec *iov, int iovcnt, off_t of
         iovSize = size_ - offset;
     }
 
+    // a read waiting for the refill of others counts as a miss only
+    bool missed = false;
 again:
     auto tr = cache_store_->try_preadv(input.iovec(), input.iovcnt(), offset);
     if (tr.refill_offset < 0) {
@@ -137,15 +287,45 @@ again:
 
         return -1;
     } else if (tr.refill_size == 0 && tr.size >= 0) {
+        if (!missed)
+            metrics().hits->inc();
         return tr.size;
     }
+    if (!missed) {
+        missed = true;
+        metrics().misses->inc();
+    }
 
     if (!src_file_) {
         return -1;
     }
 
+    // served from a refill in flight, rather than waiting for its range lock
+    if (auto inflight = findRefill(offset, iovSize)) {
+        auto ret = readRefill(inflight, &input, offset, iovSize);
+        if (ret >= 0)
+            return ret;
+        goto again;
+    }
+
+    // ranges not admitted are read from the source, without touching the cache
+    if (!admit(tr.refill_offset)) {
+        ssize_t ret;
+        SCOPE_AUDIT("download", AU_FILEOP(get_pathname(), offset, ret));
+        ret = src_file_->preadv(input.iovec(), input.iovcnt(), offset);
+        return ret;
+    }
+
     uint64_t refillOff = tr.refill_offset;
     uint64_t refillSize = tr.refill_size;
+    // a refill shorter than the fetch size of the source takes the missing
+    // units following it as well, saving round trips of reads to come
+    auto fetch = fetchSize();
+    if (refillSize < fetch && refillOff + refillSize < static_cast<uint64_t>(size_)) {
+        auto q = cache_store_->queryRefillRange(refillOff + refillSize, fetch - refillSize);
+        if (q.second > 0 && static_cast<uint64_t>(q.first) == refillOff + refillSize)
+            refillSize += q.second;
+    }
     if (refillOff + refillSize > static_cast<uint64_t>(size_)) {
         refillSize = size_ - refillOff;
     }
@@ -155,11 +335,14 @@ again:
         goto again;
     }
 
-    IOVector buffer(*allocator_);
+    auto refill = new Refill(refillOff, refillSize, allocator_);
+    refills_.push_back(refill);
+    DEFER(putRefill(refill));
+    auto &buffer = refill->buffer;
     {
-        DEFER(rangeLock_.unlock(refillOff, refillSize));
         auto alloc = buffer.push_back(refillSize);
         if (alloc < refillSize) {
+            endRefill(refill, false);
             LOG_ERROR("memory allocate failed, refillSize:`, alloc:`", refillSize, alloc);
             ssize_t ret;
             SCOPE_AUDIT("download", AU_FILEOP(get_pathname(), offset, ret));
@@ -174,24 +357,37 @@ again:
         }
 
         if (read != static_cast<ssize_t>(refillSize)) {
+            endRefill(refill, false);
             LOG_ERRNO_RETURN(
                 0, -1,
                 "src file read failed, read : `, expectRead : `, size_ : `, offset : `, sum : `",
                 read, refillSize, size_, refillOff, buffer.sum());
         }
-
-        auto write = cache_store_->pwritev(buffer.iovec(), buffer.iovcnt(), refillOff);
-
-        if (write != static_cast<ssize_t>(refillSize)) {
-            if (ENOSPC != errno)
-                LOG_ERROR("cache file write failed : `, error : `, size_ : `, offset : `, sum : `",
-                          write, ERRNO(errno), size_, refillOff, buffer.sum());
-            ssize_t ret;
-            {
-                SCOPE_AUDIT("download", AU_FILEOP(get_pathname(), offset, ret));
-                ret = src_file_->preadv(input.iovec(), input.iovcnt(), offset);
+        metrics().refill_bytes->inc(read);
+        refill->ready = true;
+        refill->cv.notify_all();
+
+        if (asyncRefill_) {
+            // the caller gets its data now, and the cache is written behind
+            refill->refs++;
+            pendingTasks_++;
+            photon::thread_create11(&CachedFile::writeRefill, this, refill);
+        } else {
+            auto write = cache_store_->pwritev(buffer.iovec(), buffer.iovcnt(), refillOff);
+            endRefill(refill, true);
+
+            if (write != static_cast<ssize_t>(refillSize)) {
+                if (ENOSPC != errno)
+                    LOG_ERROR(
+                        "cache file write failed : `, error : `, size_ : `, offset : `, sum : `",
+                        write, ERRNO(errno), size_, refillOff, buffer.sum());
+                ssize_t ret;
+                {
+                    SCOPE_AUDIT("download", AU_FILEOP(get_pathname(), offset, ret));
+                    ret = src_file_->preadv(input.iovec(), input.iovcnt(), offset);
+                }
+                return ret;
             }
-            return ret;
         }
     }
 
@@ -206,9 +402,9 @@ again:
         offset += copy;
         result += copy;
     } else if (tr.refill_offset + tr.refill_size >= offset + iovSize) {
-        iovector_view tailIov;
-        tailIov.iovcnt = 0;
-        input.slice(iovSize - (tr.refill_offset - offset), tr.refill_offset - offset, &tailIov);
+        IOVectorEntity<IOVector::capacity, 0> tail;
+        input.slice(iovSize - (tr.refill_offset - offset), tr.refill_offset - offset, &tail);
+        auto tailIov = tail.view();
         auto copy = refillBuf.memcpy_to(&tailIov);
         input.extract_back(copy);
         result += copy;
@@ -274,6 +470,52 @@ ssize_t CachedFile::pwritev(const struct iovec *iov, int iovcnt, off_t offset) {
     return write;
 }
 
+CachedFile::Refill *CachedFile::findRefill(off_t offset, size_t count) {
+    for (auto refill : refills_) {
+        if (refill->offset <= offset && offset + count <= refill->offset + refill->size)
+            return refill;
+    }
+    return nullptr;
+}
+
+ssize_t CachedFile::readRefill(Refill *refill, IOVector *input, off_t offset, size_t count) {
+    refill->refs++;
+    DEFER(putRefill(refill));
+    while (!refill->ready && !refill->failed)
+        refill->cv.wait_no_lock();
+    if (refill->failed)
+        return -1;
+    IOVector refillBuf(refill->buffer.iovec(), refill->buffer.iovcnt());
+    refillBuf.extract_front(offset - refill->offset);
+    auto inView = input->view();
+    return refillBuf.memcpy_to(&inView, count);
+}
+
+void CachedFile::writeRefill(Refill *refill) {
+    auto write = cache_store_->pwritev(refill->buffer.iovec(), refill->buffer.iovcnt(),
+                                       refill->offset);
+    if (write != static_cast<ssize_t>(refill->size) && ENOSPC != errno)
+        LOG_ERROR("cache file write failed : `, error : `, size_ : `, offset : `, size : `",
+                  write, ERRNO(errno), size_, refill->offset, refill->size);
+    endRefill(refill, true);
+    putRefill(refill);
+    taskDone();
+}
+
+void CachedFile::endRefill(Refill *refill, bool ok) {
+    refills_.erase(std::find(refills_.begin(), refills_.end(), refill));
+    if (!ok) {
+        refill->failed = true;
+        refill->cv.notify_all();
+    }
+    rangeLock_.unlock(refill->offset, refill->size);
+}
+
+void CachedFile::putRefill(Refill *refill) {
+    if (--refill->refs == 0)
+        delete refill;
+}
+
 int CachedFile::fiemap(struct fiemap *map) {
     errno = ENOSYS;
     return -1;
@@ -342,7 +584,8 @@ std::string_view CachedFile::get_pathname() {
 }
 
 ICachedFile *new_cached_file(IFile *src, ICacheStore *store, uint64_t pageSize, uint64_t refillUnit,
-                             IOAlloc *allocator, IFileSystem *fs) {
+                             IOAlloc *allocator, IFileSystem *fs, bool asyncRefill,
+                             CountMinSketch *admission, uint32_t admitHits) {
     // new_cached_file requires src is able to fstat
     // once stat is failed, it will return nullptr
     struct stat st = {};
@@ -352,7 +595,18 @@ ICachedFile *new_cached_file(IFile *src, ICacheStore *store, uint64_t pageSize,
             LOG_ERRNO_RETURN(0, nullptr, "src_file fstat failed : `", ok);
         }
     }
-    return new CachedFile(src, store, st.st_size, pageSize, refillUnit, allocator, fs);
+    return new CachedFile(src, store, st.st_size, pageSize, refillUnit, allocator, fs,
+                          asyncRefill, admission, admitHits);
 }
 
 } //  namespace Cache
+
+namespace FileSystem {
+void cached_fs_set_admission(int admission) {
+    std::lock_guard<std::mutex> lock(Cache::admissions_mtx);
+    if (admission == ADMIT_BY_FILTER)
+        Cache::admissions.erase(photon::CURRENT);
+    else
+        Cache::admissions[photon::CURRENT] = admission;
+}
+} // namespace FileSystem
@@ -21,6 +21,8 @@
 #include <vector>
 #include "../../filesystem.h"
 #include "../cache.h"
+#include "../../../iovector.h"
+#include "../../../photon/thread.h"
 #include "../../../range-lock.h"
 #include "../../../string_view.h"
 
@@ -28,6 +30,7 @@ struct IOAlloc;
 
 namespace FileSystem {
 class ICacheStore;
+class CountMinSketch;
 }
 
 namespace Cache {
@@ -45,7 +48,9 @@ using namespace FileSystem;
 class CachedFile : public ICachedFile {
 public:
     CachedFile(IFile *src_file, ICacheStore *cache_store, off_t size, uint64_t pageSize,
-               uint64_t refillUnit, IOAlloc *allocator, IFileSystem *fs);
+               uint64_t refillUnit, IOAlloc *allocator, IFileSystem *fs,
+               bool asyncRefill = false, CountMinSketch *admission = nullptr,
+               uint32_t admitHits = 0);
     ~CachedFile();
 
     IFileSystem *filesystem();
@@ -75,6 +80,8 @@ public:
 
     int query(off_t offset, size_t count) override;
 
+    int prefetch_async(off_t offset, size_t count, PrefetchDone done) override;
+
     //  offset and len must be aligned 4k, otherwise it's useless.
     //  !!! need ensure no other read operation, otherwise read may read hole data(zero).
     int fallocate(int mode, off_t offset, off_t len) override;
@@ -102,9 +109,35 @@ public:
     std::string_view get_pathname();
 
 private:
+    //  a refill between its source read and the end of its cache write,
+    //  readers of a range inside it copy from `buffer`.
+    struct Refill {
+        off_t offset;
+        size_t size;
+        IOVector buffer;
+        bool ready = false;
+        bool failed = false;
+        int refs = 1;
+        photon::condition_variable cv;
+
+        Refill(off_t offset, size_t size, IOAlloc *allocator)
+            : offset(offset), size(size), buffer(*allocator) {
+        }
+    };
+
     ssize_t prefetch(size_t count, off_t offset);
+    void prefetchTask(off_t offset, size_t count, PrefetchDone done);
+    void taskDone();
 
     ssize_t preadvInternal(const struct iovec *iov, int iovcnt, off_t offset);
+    bool admit(off_t refillOffset);
+    size_t fetchSize();
+
+    Refill *findRefill(off_t offset, size_t count);
+    ssize_t readRefill(Refill *refill, IOVector *input, off_t offset, size_t count);
+    void writeRefill(Refill *refill);
+    void endRefill(Refill *refill, bool ok);
+    void putRefill(Refill *refill);
 
     IFile *src_file_;          //  owned by current class
     ICacheStore *cache_store_; //  owned by current class
@@ -119,9 +152,23 @@ private:
 
     off_t readOffset_;
     off_t writeOffset_;
+
+    //  return data once the source read completes and write the cache behind
+    bool asyncRefill_;
+    std::vector<Refill *> refills_;
+
+    //  shared by the files of a cached fs, nullptr to admit every refill
+    CountMinSketch *admission_;
+    uint32_t admitHits_;
+    uint64_t pathHash_ = 0;
+
+    //  background cache writes and prefetches, waited for by the destructor
+    int pendingTasks_ = 0;
+    photon::condition_variable tasksDone_;
 };
 
 ICachedFile *new_cached_file(IFile *src, ICacheStore *store, uint64_t pageSize, uint64_t refillUnit,
-                             IOAlloc *allocator, IFileSystem *fs);
+                             IOAlloc *allocator, IFileSystem *fs, bool asyncRefill = false,
+                             CountMinSketch *admission = nullptr, uint32_t admitHits = 0);
 
 } //  namespace Cache
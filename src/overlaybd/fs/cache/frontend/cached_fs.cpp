@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include "../cache.h"
 #include "cached_file.h"
+#include "../policy/sketch.h"
 #include "../../../alog.h"
 #include "../../../io-alloc.h"
 
@@ -30,9 +31,12 @@ using namespace FileSystem;
 class CachedFs : public ICachedFileSystem {
 public:
     CachedFs(IFileSystem *srcFs, ICachePool *fileCachePool, size_t pageSize, size_t refillUnit,
-             IOAlloc *allocator)
+             IOAlloc *allocator, bool asyncRefill, uint32_t admitHits)
         : srcFs_(srcFs), fileCachePool_(fileCachePool), pageSize_(pageSize),
-          refillUnit_(refillUnit), allocator_(allocator) {
+          refillUnit_(refillUnit), allocator_(allocator), asyncRefill_(asyncRefill),
+          admitHits_(admitHits) {
+        if (admitHits_ > 0)
+            admission_.reset(new CountMinSketch(kAdmissionWidth));
     }
 
     ~CachedFs() {
@@ -53,7 +57,8 @@ public:
             LOG_ERRNO_RETURN(0, nullptr, "fileCachePool_ open file failed, name : `", pathname)
         }
 
-        auto ret = new_cached_file(srcFile, cache_store, pageSize_, refillUnit_, allocator_, this);
+        auto ret = new_cached_file(srcFile, cache_store, pageSize_, refillUnit_, allocator_, this,
+                                   asyncRefill_, admission_.get(), admitHits_);
         if (ret == nullptr) { // if create file is failed
             // srcFile and cache_store must be release, or will leak
             delete srcFile;
@@ -66,6 +71,22 @@ public:
         return open(pathname, flags, 0); // mode and flags are meaningless in RoCacheFS::open(2)(3)
     }
 
+    ICachedFile *open_cached(const char *pathname, IFile *src) override {
+        auto cache_store = fileCachePool_->open(pathname, O_RDWR | O_CREAT, 0644);
+        if (nullptr == cache_store) {
+            delete src;
+            LOG_ERRNO_RETURN(0, nullptr, "fileCachePool_ open file failed, name : `", pathname)
+        }
+
+        auto ret = new_cached_file(src, cache_store, pageSize_, refillUnit_, allocator_, this,
+                                   asyncRefill_, admission_.get(), admitHits_);
+        if (ret == nullptr) {
+            delete src;
+            cache_store->release();
+        }
+        return ret;
+    }
+
     UNIMPLEMENTED_POINTER(IFile *creat(const char *pathname, mode_t mode));
     UNIMPLEMENTED(int mkdir(const char *pathname, mode_t mode));
     UNIMPLEMENTED(int rmdir(const char *pathname));
@@ -125,16 +146,24 @@ private:
     size_t refillUnit_;
 
     IOAlloc *allocator_;
+    bool asyncRefill_;
+
+    // 4 rows of 256K counters, 512KB in all
+    static const size_t kAdmissionWidth = 256 * 1024;
+    uint32_t admitHits_;
+    std::unique_ptr<CountMinSketch> admission_;
 };
 
 } //  namespace Cache
 
 namespace FileSystem {
 ICachedFileSystem *new_cached_fs(IFileSystem *src, ICachePool *pool, uint64_t pageSize,
-                                 uint64_t refillUnit, IOAlloc *allocator) {
+                                 uint64_t refillUnit, IOAlloc *allocator, bool asyncRefill,
+                                 uint32_t admitHits) {
     if (!allocator) {
         allocator = new IOAlloc;
     }
-    return new ::Cache::CachedFs(src, pool, pageSize, refillUnit, allocator);
+    return new ::Cache::CachedFs(src, pool, pageSize, refillUnit, allocator, asyncRefill,
+                                 admitHits);
 }
 } // namespace FileSystem
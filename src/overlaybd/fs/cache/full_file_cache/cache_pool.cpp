@@ -18,11 +18,16 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <string.h>
 #include <algorithm>
+#include <set>
 #include <sys/statvfs.h>
 #include "../../../alog-stdstring.h"
 #include "../../../alog.h"
 #include "../../../enumerable.h"
+#include "../../../estring.h"
+#include "../../../metrics.h"
+#include "../../../photon/thread11.h"
 #include "../../../utility.h"
 #include "../../path.h"
 #include "cache_store.h"
@@ -34,35 +39,110 @@ using namespace FileSystem;
 const uint64_t kGB = 1024 * 1024 * 1024;
 const uint64_t kMaxFreeSpace = 50 * kGB;
 const int64_t kEvictionMark = 5ll * kGB;
+const char kManifestName[] = "/.manifest";
+const char kManifestTmpName[] = "/.manifest.tmp";
+const char kManifestMagic[] = "overlaybd-cache-manifest 1";
 
 FileCachePool::FileCachePool(IFileSystem *mediaFs, uint64_t capacityInGB, uint64_t periodInUs,
-                             uint64_t diskAvailInBytes, uint64_t refillUnit)
+                             uint64_t diskAvailInBytes, uint64_t refillUnit, const char *policy,
+                             bool evictUnits, uint64_t evictRateInBytes, bool mmapHits)
     : mediaFs_(mediaFs), capacityInGB_(capacityInGB), periodInUs_(periodInUs),
-      diskAvailInBytes_(diskAvailInBytes), refillUnit_(refillUnit), totalUsed_(0), timer_(nullptr),
+      diskAvailInBytes_(diskAvailInBytes), refillUnit_(refillUnit), evictUnits_(evictUnits),
+      totalUsed_(0), evictRateInBytes_(evictRateInBytes), mmapHits_(mmapHits), timer_(nullptr),
       running_(false), exit_(false), isFull_(false) {
-    int64_t capacityInBytes = capacityInGB_ * kGB;
+    if (policy && strcmp(policy, "2q") == 0) {
+        lru_.reset(new TwoQPolicy<FileNameMap::iterator>(kCorrelatedPeriodInUs));
+    } else {
+        if (policy && strcmp(policy, "lru") != 0)
+            LOG_WARN("unknown cache eviction policy `, use lru", policy);
+        lru_.reset(new LRUPolicy<FileNameMap::iterator>());
+    }
+    setMarks(capacityInGB_ * kGB);
+}
+
+void FileCachePool::setMarks(int64_t capacityInBytes) {
     waterMark_ = calcWaterMark(capacityInBytes, kMaxFreeSpace);
+    lowMark_ = calcWaterMark(waterMark_, kEvictionMark);
     // keep this relation : waterMark < riskMark < capacity
     riskMark_ = std::max(capacityInBytes - kEvictionMark,
                          (static_cast<int64_t>(waterMark_) + capacityInBytes) >> 1);
 }
 
+int FileCachePool::set_capacity(uint64_t capacity) {
+    if (capacity < kGB)
+        LOG_ERROR_RETURN(EINVAL, -1, "cache capacity ` is less than 1GB", capacity);
+    capacityInGB_ = capacity / kGB;
+    setMarks(capacityInGB_ * kGB);
+    LOG_INFO("cache capacity set to `GB, totalUsed: `", capacityInGB_, totalUsed_);
+    // evicting down to the new marks, or letting writes in if no longer full
+    forceRecycle();
+    return 0;
+}
+
+int FileCachePool::set_owner(std::string_view filename, std::string_view group, bool pinned) {
+    auto key = cache_key(filename);
+    auto it = owners_.find(key);
+    if (it == owners_.end())
+        it = owners_.emplace(key, Owner()).first;
+    if (it->second.group.empty())
+        it->second.group.assign(group.data(), group.size());
+    it->second.pinned |= pinned;
+    return 0;
+}
+
+int FileCachePool::set_quota(std::string_view group, uint64_t bytes) {
+    if (group.empty())
+        LOG_ERROR_RETURN(EINVAL, -1, "quota of no group");
+    std::string name(group.data(), group.size());
+    if (bytes == 0)
+        quotas_.erase(name);
+    else
+        quotas_[name] = bytes;
+    LOG_INFO("cache quota of group ` set to ` bytes", name, bytes);
+    return 0;
+}
+
 FileCachePool::~FileCachePool() {
     exit_ = true;
+    if (traverseTh_) {
+        photon::thread_join(traverseTh_);
+    }
     if (timer_) {
-        while (running_) {
-            photon::thread_usleep(1);
-        }
         delete timer_;
+        evictCv_.notify_all();
+        paceCv_.notify_all();
+        photon::thread_join(evictTh_);
+        saveManifest(indexExact_);
     }
     delete mediaFs_;
 }
 
 void FileCachePool::Init() {
-    traverseDir("/");
+    bool clean = false;
+    if (loadManifest(&clean) < 0) {
+        traverseDir("/");
+    } else if (!clean) {
+        LOG_INFO("cache manifest is stale, traverse the media in background");
+        indexExact_ = false;
+        auto th = photon::thread_create11(&FileCachePool::lazyTraverse, this);
+        traverseTh_ = photon::thread_enable_join(th);
+    }
+    lastCheckpoint_ = photon::now;
+    auto th = photon::thread_create11(&FileCachePool::evictionWorker, this);
+    evictTh_ = photon::thread_enable_join(th);
     timer_ = new photon::Timer(periodInUs_, {this, FileCachePool::timerHandler});
 }
 
+// the fd of `file` if it's a local file, to be mapped, or -1
+static int mappable_fd(IFile *file) {
+    auto fd = (int)(uint64_t)file->get_underlay_object();
+    struct stat st, fd_st;
+    if (fd <= 0 || file->fstat(&st) != 0 || ::fstat(fd, &fd_st) != 0 ||
+        st.st_dev != fd_st.st_dev || st.st_ino != fd_st.st_ino)
+        return -1;
+    return fd;
+}
+
 ICacheStore *FileCachePool::do_open(std::string_view pathname, int flags, mode_t mode) {
     auto localFile = openMedia(pathname, flags, mode);
     if (!localFile) {
@@ -71,15 +151,18 @@ ICacheStore *FileCachePool::do_open(std::string_view pathname, int flags, mode_t
 
     auto find = fileIndex_.find(pathname);
     if (find == fileIndex_.end()) {
-        auto lruIter = lru_.push_front(fileIndex_.end());
+        auto lruIter = lru_->insert(fileIndex_.end());
         std::unique_ptr<LruEntry> entry(new LruEntry{lruIter, 1, 0});
         find = fileIndex_.emplace(pathname, std::move(entry)).first;
-        lru_.front() = find;
+        lru_->get(lruIter) = find;
     } else {
-        lru_.access(find->second->lruIter);
+        lru_->access(find->second->lruIter);
         find->second->openCount++;
     }
 
+    int fd = mmapHits_ ? mappable_fd(localFile) : -1;
+    if (fd >= 0)
+        return new MmapCacheStore(this, localFile, fd, refillUnit_, find);
     return new FileCacheStore(this, localFile, refillUnit_, find);
 }
 
@@ -122,15 +205,33 @@ bool FileCachePool::isFull() {
 }
 
 void FileCachePool::removeOpenFile(FileNameMap::iterator iter) {
-    iter->second->openCount--;
+    auto lruEntry = iter->second.get();
+    if (--lruEntry->openCount == 0) {
+        lruEntry->pages.bits = {};
+        lruEntry->pagesLoaded = false;
+        lruEntry->unitAccess = {};
+    }
 }
 
 void FileCachePool::forceRecycle() {
-    timerHandler(this);
+    recycle_ = true;
+    evictCv_.notify_all();
 }
 
 void FileCachePool::updateLru(FileNameMap::iterator iter) {
-    lru_.access(iter->second->lruIter);
+    lru_->access(iter->second->lruIter);
+}
+
+void FileCachePool::touchUnits(FileNameMap::iterator iter, off_t offset, size_t count) {
+    if (!evictUnits_ || count == 0)
+        return;
+    auto &unitAccess = iter->second->unitAccess;
+    auto last = (offset + count - 1) / refillUnit_;
+    if (unitAccess.size() <= last)
+        unitAccess.resize(last + 1);
+    uint32_t now = photon::now / 1000000 + 1; // 0 for never
+    for (auto i = offset / refillUnit_; i <= last; i++)
+        unitAccess[i] = now;
 }
 
 //  currently, we exist duplicate pwrite
@@ -155,16 +256,29 @@ uint64_t FileCachePool::updateSpace(FileNameMap::iterator iter, uint64_t size) {
 }
 
 uint64_t FileCachePool::timerHandler(void *data) {
-    auto cur = static_cast<FileCachePool *>(data);
-    if (cur->running_) {
-        return 0;
-    }
-    cur->running_ = true;
-    DEFER(cur->running_ = false;);
-    cur->eviction();
+    static_cast<FileCachePool *>(data)->forceRecycle();
     return 0;
 }
 
+// Eviction runs in a photon thread of its own, woken up by the timer and by
+// forceRecycle(), so that neither the timer nor a write waits for it.
+void FileCachePool::evictionWorker() {
+    while (!exit_) {
+        if (!recycle_)
+            evictCv_.wait_no_lock();
+        recycle_ = false;
+        if (exit_)
+            break;
+        running_ = true;
+        eviction();
+        running_ = false;
+        if (indexExact_ && !exit_ && photon::now - lastCheckpoint_ >= kManifestPeriodInUs) {
+            saveManifest(false);
+            lastCheckpoint_ = photon::now;
+        }
+    }
+}
+
 void FileCachePool::eviction() {
     uint64_t evictByDisk = 0;
     uint64_t evictByCache = 0;
@@ -186,8 +300,9 @@ void FileCachePool::eviction() {
         }
     }
 
+    // evict down to lowMark_ once above waterMark_, not to be woken up again soon
     if (totalUsed_ >= static_cast<int64_t>(waterMark_)) {
-        evictByCache = totalUsed_ - waterMark_;
+        evictByCache = totalUsed_ - lowMark_;
     }
 
     auto actualEvict = static_cast<int64_t>(std::max(evictByCache, evictByDisk));
@@ -195,43 +310,202 @@ void FileCachePool::eviction() {
         return;
     }
 
-    isFull_ = true;
-
-    while (actualEvict > 0 && !lru_.empty() && !exit_) {
-        auto fileIter = lru_.back();
-        const auto &fileName = fileIter->first;
-        auto lruEntry = fileIter->second.get();
-        auto fileSize = lruEntry->size;
-        if (lruEntry->openCount == 0) {
-            lru_.mark_key_cleared(fileIter->second->lruIter);
-        } else {
-            lru_.access(fileIter->second->lruIter);
-        }
-        // as soon as possible truncate and unlink
-        if (0 == fileSize) {
-            if (0 == fileIter->second->openCount) {
-                afterFtrucate(fileIter);
+    // writes are refused only until below riskMark_, or the disk has room again
+    isFull_ = evictByDisk > 0 || totalUsed_ >= riskMark_;
+
+    while (actualEvict > 0 && !lru_->empty() && !exit_) {
+        auto candidates = evictCandidates(actualEvict);
+        if (candidates.empty())
+            break;
+        auto before = actualEvict;
+        auto files = fileIndex_.size();
+        for (auto &name : candidates) {
+            if (actualEvict <= 0 || exit_)
+                break;
+            auto freed = evictFile(name, actualEvict);
+            actualEvict -= freed;
+            if (freed > 0) {
+                static auto evictions = Metrics::counter(
+                    "overlaybd_cache_evictions_total", "Files truncated or punched by eviction");
+                static auto evicted = Metrics::counter("overlaybd_cache_evicted_bytes_total",
+                                                       "Bytes freed by eviction");
+                evictions->inc();
+                evicted->inc(freed);
             }
-            photon::thread_usleep(kDeleteDelayInUs);
-            continue;
+            if (evictByDisk == 0 && totalUsed_ < riskMark_)
+                isFull_ = false;
+            // pace the deletions, not to hog the disk serving reads
+            uint64_t delay = kDeleteDelayInUs;
+            if (evictRateInBytes_ > 0)
+                delay = std::max(delay, freed * 1000 * 1000 / evictRateInBytes_);
+            if (!exit_)
+                paceCv_.wait_no_lock(delay);
         }
+        // nothing could be evicted, e.g. failed to truncate, try again later
+        if (actualEvict == before && fileIndex_.size() == files)
+            break;
+    }
+}
 
-        {
-            photon::scoped_rwlock rl(lruEntry->rw_lock_, photon::WLOCK);
-            err = mediaFs_->truncate(fileName.data(), 0);
+// The names of the files to evict for `size` bytes, in the order of eviction,
+// computed ahead as entries may change while evicting one after another.
+// The files of groups over their quotas go first, until the groups are
+// within them, then the others in the order of the policy, and the pinned
+// ones last.
+std::vector<std::string> FileCachePool::evictCandidates(uint64_t size) {
+    // the bytes of each group over its quota
+    std::unordered_map<std::string, int64_t> excess;
+    for (auto &q : quotas_)
+        excess[q.first] = -static_cast<int64_t>(q.second);
+    if (!excess.empty()) {
+        for (auto &it : fileIndex_) {
+            auto owner = owners_.find(it.first);
+            if (owner == owners_.end())
+                continue;
+            auto e = excess.find(owner->second.group);
+            if (e != excess.end())
+                e->second += it.second->size;
         }
+    }
 
-        if (err && errno != ENOENT) {
-            LOG_ERROR("truncate(0) failed, name : `, ret : `, error code : `", fileName, err,
-                      ERRNO());
-            continue;
+    std::vector<FileNameMap::iterator> borrowed, others, pinned;
+    auto visit = [&](FileNameMap::iterator &it) {
+        auto owner = owners_.find(it->first);
+        if (owner == owners_.end()) {
+            others.push_back(it);
+        } else if (owner->second.pinned) {
+            pinned.push_back(it);
         } else {
-            fileSize = lruEntry->size;
+            auto e = excess.find(owner->second.group);
+            if (e != excess.end() && e->second > 0) {
+                e->second -= it->second->size;
+                borrowed.push_back(it);
+            } else {
+                others.push_back(it);
+            }
+        }
+    };
+    lru_->for_each(visit);
+
+    std::vector<std::string> names;
+    uint64_t sum = 0;
+    for (auto list : {&borrowed, &others, &pinned}) {
+        for (auto it : *list) {
+            if (sum >= size)
+                return names;
+            names.emplace_back(it->first.data(), it->first.size());
+            // empty files are to be unlinked as well
+            sum += std::max(it->second->size, (uint64_t)1);
+        }
+    }
+    return names;
+}
+
+// Evict the file by name, punching its cold units if open with evictUnits,
+// or truncating it, and unlinking it if closed. Returns the bytes freed.
+uint64_t FileCachePool::evictFile(const std::string &name, uint64_t size) {
+    auto fileIter = fileIndex_.find(name);
+    if (fileIter == fileIndex_.end())
+        return 0;
+    auto lruEntry = fileIter->second.get();
+    auto fileSize = lruEntry->size;
+    if (evictUnits_ && lruEntry->openCount > 0 && fileSize > 0) {
+        auto freed = evictColdUnits(fileIter, size);
+        if (freed > 0) {
+            lru_->access(lruEntry->lruIter);
+            return freed;
+        }
+    }
+    if (lruEntry->openCount == 0) {
+        lru_->mark_key_cleared(lruEntry->lruIter);
+    } else {
+        lru_->access(lruEntry->lruIter);
+    }
+    // as soon as possible truncate and unlink
+    if (0 == fileSize) {
+        if (0 == lruEntry->openCount) {
             afterFtrucate(fileIter);
-            actualEvict -= fileSize;
         }
-        photon::thread_usleep(kDeleteDelayInUs);
+        return 0;
+    }
+
+    int err;
+    {
+        photon::scoped_rwlock rl(lruEntry->rw_lock_, photon::WLOCK);
+        err = mediaFs_->truncate(name.c_str(), 0);
+        if (!err) {
+            lruEntry->pages.bits.clear();
+            lruEntry->unitAccess.clear();
+        }
+    }
+
+    if (err && errno != ENOENT) {
+        LOG_ERROR("truncate(0) failed, name : `, ret : `, error code : `", name, err, ERRNO());
+        return 0;
+    }
+    fileSize = lruEntry->size;
+    afterFtrucate(fileIter);
+    return fileSize;
+}
+
+// Punch out up to half of the populated refill units of an open file, until
+// `size` bytes are freed, least recently read first; units not read since the
+// file was opened go first. Returns the bytes actually freed.
+uint64_t FileCachePool::evictColdUnits(FileNameMap::iterator iter, uint64_t size) {
+    auto lruEntry = iter->second.get();
+    auto it = m_stores.find(iter->first);
+    if (it == m_stores.end())
+        return 0;
+    auto store = it->second;
+
+    const uint64_t pagesPerUnit = refillUnit_ / 4096;
+    auto &unitAccess = lruEntry->unitAccess;
+    std::vector<std::pair<uint32_t, uint64_t>> units; // (access time, unit)
+    uint64_t nunits = (lruEntry->pages.bits.size() * 64 + pagesPerUnit - 1) / pagesPerUnit;
+    for (uint64_t i = 0; i < nunits; i++) {
+        if (lruEntry->pages.any(i * pagesPerUnit, (i + 1) * pagesPerUnit))
+            units.emplace_back(i < unitAccess.size() ? unitAccess[i] : 0, i);
+    }
+    if (units.size() < 2)
+        return 0;
+    std::sort(units.begin(), units.end());
+
+    uint64_t punched = 0;
+    {
+        photon::scoped_rwlock rl(lruEntry->rw_lock_, photon::WLOCK);
+        for (size_t k = 0; k < units.size() / 2 && punched < size; k++) {
+            auto i = units[k].second;
+            if (store->evict(i * refillUnit_, refillUnit_) != 0) {
+                LOG_ERROR("punch failed, name : `, offset : `, error code : `", iter->first,
+                          i * refillUnit_, ERRNO());
+                break;
+            }
+            punched += refillUnit_;
+            if (i < unitAccess.size())
+                unitAccess[i] = 0;
+        }
+    }
+
+    struct stat st = {};
+    if (punched == 0 || mediaFs_->stat(iter->first.data(), &st) != 0)
+        return 0;
+    uint64_t fileSize = st.st_blocks * kDiskBlockSize;
+    uint64_t freed = fileSize < lruEntry->size ? lruEntry->size - fileSize : 0;
+    totalUsed_ = std::max(totalUsed_ - static_cast<int64_t>(freed), (int64_t)0);
+    lruEntry->size = fileSize;
+    return freed;
+}
+
+bool FileCachePool::PageMap::any(uint64_t begin, uint64_t end) const {
+    for (auto i = begin; i < end;) {
+        if (i / 64 >= bits.size())
+            return false;
+        auto word = bits[i / 64] >> (i % 64);
+        if (word)
+            return i + __builtin_ctzl(word) < end;
+        i = (i / 64 + 1) * 64;
     }
+    return false;
 }
 
 uint64_t FileCachePool::calcWaterMark(uint64_t capacity, uint64_t maxFreeSpace) {
@@ -252,7 +526,7 @@ bool FileCachePool::afterFtrucate(FileNameMap::iterator iter) {
             LOG_ERROR("unlink failed, name : `, ret : `, error code : `", iter->first, err,
                       ERRNO());
         } else {
-            lru_.remove(iter->second->lruIter);
+            lru_->remove(iter->second->lruIter);
             fileIndex_.erase(iter);
         }
     }
@@ -261,11 +535,155 @@ bool FileCachePool::afterFtrucate(FileNameMap::iterator iter) {
 
 int FileCachePool::traverseDir(const std::string &root) {
     for (auto file : enumerable(Walker(mediaFs_, root))) {
+        if (file == kManifestName || file == kManifestTmpName)
+            continue;
         insertFile(file);
     }
     return 0;
 }
 
+int FileCachePool::loadManifest(bool *clean) {
+    auto file = mediaFs_->open(kManifestName, O_RDONLY);
+    if (!file) {
+        if (errno != ENOENT)
+            LOG_ERRNO_RETURN(0, -1, "failed to open cache manifest");
+        return -1;
+    }
+    DEFER(delete file);
+    struct stat st = {};
+    if (file->fstat(&st) != 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to stat cache manifest");
+    estring buf;
+    buf.resize(st.st_size);
+    if (file->pread(&buf[0], buf.size(), 0) != static_cast<ssize_t>(buf.size()))
+        LOG_ERRNO_RETURN(0, -1, "failed to read cache manifest");
+    // loaded only once, any later crash leaves an older checkpoint or nothing
+    mediaFs_->unlink(kManifestName);
+
+    // "<magic> <clean> <count>\n" followed by "<size> <name>\n" of each file,
+    // the least recently used first
+    auto lines = buf.split_lines();
+    auto it = lines.begin();
+    if (it == lines.end() || !(*it).starts_with(kManifestMagic))
+        LOG_ERROR_RETURN(0, -1, "invalid cache manifest");
+    int flag = 0;
+    uint64_t count = 0;
+    if (sscanf(std::string(*it).c_str() + sizeof(kManifestMagic) - 1, "%d %lu", &flag,
+               &count) != 2)
+        LOG_ERROR_RETURN(0, -1, "invalid cache manifest header");
+    std::vector<std::pair<uint64_t, std::string_view>> entries;
+    for (++it; it != lines.end() && entries.size() < count; ++it) {
+        auto line = *it;
+        auto pos = line.find(' ');
+        if (pos == estring_view::npos || pos + 1 >= line.size())
+            break;
+        entries.emplace_back(std::stoull(std::string(line.substr(0, pos))),
+                             line.substr(pos + 1));
+    }
+    if (entries.size() != count)
+        LOG_ERROR_RETURN(0, -1, "truncated cache manifest, ` of ` entries", entries.size(),
+                         count);
+
+    for (auto &e : entries) {
+        if (fileIndex_.find(e.second) != fileIndex_.end())
+            continue;
+        auto lruIter = lru_->insert(fileIndex_.end());
+        auto entry = std::unique_ptr<LruEntry>(new LruEntry{lruIter, 0, e.first});
+        auto iter = fileIndex_.emplace(e.second, std::move(entry)).first;
+        lru_->get(lruIter) = iter;
+        totalUsed_ += e.first;
+    }
+    *clean = flag == 1;
+    LOG_INFO("loaded ` cached files from manifest, clean : `", count, *clean);
+    return 0;
+}
+
+int FileCachePool::saveManifest(bool clean) {
+    // files in the order of eviction, those being evicted (cleared) first
+    std::vector<FileNameMap::iterator> files;
+    std::set<LruEntry *> visited;
+    auto visit = [&](FileNameMap::iterator &it) {
+        files.push_back(it);
+        visited.insert(it->second.get());
+    };
+    lru_->for_each(visit);
+    std::vector<FileNameMap::iterator> cleared;
+    for (auto it = fileIndex_.begin(); it != fileIndex_.end(); ++it) {
+        if (visited.find(it->second.get()) == visited.end())
+            cleared.push_back(it);
+    }
+    files.insert(files.begin(), cleared.begin(), cleared.end());
+
+    std::string buf = std::string(kManifestMagic) + " " + std::to_string(clean ? 1 : 0) + " " +
+                      std::to_string(files.size()) + "\n";
+    for (auto it : files) {
+        buf += std::to_string(it->second->size);
+        buf += ' ';
+        buf.append(it->first.data(), it->first.size());
+        buf += '\n';
+    }
+
+    // written aside and renamed, so that a crash leaves the last manifest intact
+    auto file = mediaFs_->open(kManifestTmpName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (!file)
+        LOG_ERRNO_RETURN(0, -1, "failed to create cache manifest");
+    auto ret = file->pwrite(buf.data(), buf.size(), 0);
+    if (ret == static_cast<ssize_t>(buf.size()))
+        ret = file->ftruncate(buf.size());
+    delete file;
+    if (ret < 0 || mediaFs_->rename(kManifestTmpName, kManifestName) != 0) {
+        mediaFs_->unlink(kManifestTmpName);
+        LOG_ERRNO_RETURN(0, -1, "failed to save cache manifest");
+    }
+    return 0;
+}
+
+// Reconciles the index loaded from a stale manifest with the media: files
+// missing from the manifest are added, the sizes of the closed ones are
+// refreshed, and entries of files no longer existing are dropped.
+void FileCachePool::lazyTraverse() {
+    std::set<std::string> seen;
+    uint64_t n = 0;
+    for (auto file : enumerable(Walker(mediaFs_, "/"))) {
+        if (exit_)
+            return;
+        if (file == kManifestName || file == kManifestTmpName)
+            continue;
+        seen.emplace(file.data(), file.size());
+        if (++n % 64 == 0)
+            photon::thread_yield();
+        auto iter = fileIndex_.find(file);
+        if (iter == fileIndex_.end()) {
+            insertFile(file);
+            continue;
+        }
+        if (iter->second->openCount > 0)
+            continue;
+        struct stat st = {};
+        std::string name(file.data(), file.size());
+        if (mediaFs_->stat(name.c_str(), &st) != 0)
+            continue;
+        // it may have been evicted while stating
+        iter = fileIndex_.find(name);
+        if (iter == fileIndex_.end() || iter->second->openCount > 0)
+            continue;
+        auto fileSize = st.st_blocks * kDiskBlockSize;
+        totalUsed_ += static_cast<int64_t>(fileSize) - static_cast<int64_t>(iter->second->size);
+        iter->second->size = fileSize;
+    }
+    for (auto it = fileIndex_.begin(); it != fileIndex_.end();) {
+        auto iter = it++;
+        if (iter->second->openCount == 0 && !seen.count(std::string(iter->first.data(), iter->first.size()))) {
+            totalUsed_ = std::max(totalUsed_ - static_cast<int64_t>(iter->second->size),
+                                  (int64_t)0);
+            lru_->remove(iter->second->lruIter);
+            fileIndex_.erase(iter);
+        }
+    }
+    indexExact_ = true;
+    LOG_INFO("cache media traversed, ` files cached", fileIndex_.size());
+}
+
 int FileCachePool::insertFile(std::string_view file) {
     struct stat st = {};
     auto ret = mediaFs_->stat(file.data(), &st);
@@ -274,12 +692,52 @@ int FileCachePool::insertFile(std::string_view file) {
     }
     auto fileSize = st.st_blocks * kDiskBlockSize;
 
-    auto lruIter = lru_.push_front(fileIndex_.end());
+    auto lruIter = lru_->insert(fileIndex_.end());
     auto entry = std::unique_ptr<LruEntry>(new LruEntry{lruIter, 0, fileSize});
     auto iter = fileIndex_.emplace(file, std::move(entry)).first;
-    lru_.front() = iter;
+    lru_->get(lruIter) = iter;
     totalUsed_ += fileSize;
     return 0;
 }
 
+void FileCachePool::PageMap::set(uint64_t begin, uint64_t end) {
+    if (begin >= end)
+        return;
+    if (bits.size() < (end + 63) / 64)
+        bits.resize((end + 63) / 64);
+    for (auto i = begin; i < end; i++)
+        bits[i / 64] |= 1UL << (i % 64);
+}
+
+void FileCachePool::PageMap::clear(uint64_t begin, uint64_t end) {
+    end = std::min(end, bits.size() * 64);
+    for (auto i = begin; i < end; i++)
+        bits[i / 64] &= ~(1UL << (i % 64));
+}
+
+uint64_t FileCachePool::PageMap::find_hole(uint64_t begin, uint64_t end) const {
+    for (auto i = begin; i < end;) {
+        if (i / 64 >= bits.size())
+            return i;
+        auto word = ~bits[i / 64] >> (i % 64);
+        if (word)
+            return std::min(i + __builtin_ctzl(word), end);
+        i = (i / 64 + 1) * 64;
+    }
+    return end;
+}
+
+uint64_t FileCachePool::PageMap::rfind_hole(uint64_t begin, uint64_t end) const {
+    for (auto i = end; i > begin;) {
+        auto last = i - 1;
+        if (last / 64 >= bits.size())
+            return i;
+        auto word = ~bits[last / 64] << (63 - last % 64);
+        if (word)
+            return std::max(i - __builtin_clzl(word), begin);
+        i = last / 64 * 64;
+    }
+    return begin;
+}
+
 } //  namespace Cache
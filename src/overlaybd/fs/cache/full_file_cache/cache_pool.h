@@ -24,7 +24,7 @@
 #include "../../../photon/thread.h"
 #include "../../../photon/timer.h"
 #include "../../../string-keyed.h"
-#include "../policy/lru.h"
+#include "../policy/policy.h"
 #include "../pool_store.h"
 
 namespace FileSystem {
@@ -37,14 +37,25 @@ using namespace FileSystem;
 
 class FileCachePool : public ICachePool {
 public:
+    // `policy` is the eviction policy of files, "lru" or "2q"; with `evictUnits`,
+    // the coldest refill units of open files are punched out before whole files;
+    // eviction frees at most `evictRateInBytes` per second, 0 for no limit;
+    // with `mmapHits`, hits are copied from a mapping of the cache files, see
+    // MmapCacheStore, where the media is local files
     FileCachePool(IFileSystem *mediaFs, uint64_t capacityInGB, uint64_t periodInUs,
-                  uint64_t diskAvailInBytes, uint64_t refillUnit);
+                  uint64_t diskAvailInBytes, uint64_t refillUnit, const char *policy = "lru",
+                  bool evictUnits = false, uint64_t evictRateInBytes = 0,
+                  bool mmapHits = false);
     ~FileCachePool();
 
     static const uint64_t kDiskBlockSize = 512; // stat(2)
     static const uint64_t kDeleteDelayInUs = 1000;
     static const uint32_t kWaterMarkRatio = 90;
+    static const uint64_t kCorrelatedPeriodInUs = 60UL * 1000 * 1000; // of 2q
+    static const uint64_t kManifestPeriodInUs = 10UL * 60 * 1000 * 1000;
 
+    // loads the index of cached files from the manifest if there is one, and
+    // traverses the media otherwise, in background if the manifest is stale
     void Init();
 
     //  pathname must begin with '/'
@@ -54,6 +65,27 @@ public:
 
     int evict(std::string_view filename) override;
     int evict(size_t size = 0) override;
+    int set_capacity(uint64_t capacity) override;
+    int set_owner(std::string_view filename, std::string_view group, bool pinned) override;
+    int set_quota(std::string_view group, uint64_t bytes) override;
+
+    // a bitmap of the 4KB pages populated in a cache file
+    struct PageMap {
+        std::vector<uint64_t> bits;
+
+        // mark pages [begin, end) as populated or not
+        void set(uint64_t begin, uint64_t end);
+        void clear(uint64_t begin, uint64_t end);
+        // the first unpopulated page in [begin, end), or end if none
+        uint64_t find_hole(uint64_t begin, uint64_t end) const;
+        // the page after the last unpopulated one in [begin, end), or begin if none
+        uint64_t rfind_hole(uint64_t begin, uint64_t end) const;
+        // whether any page in [begin, end) is populated
+        bool any(uint64_t begin, uint64_t end) const;
+        bool test(uint64_t page) const {
+            return page / 64 < bits.size() && (bits[page / 64] >> (page % 64) & 1);
+        }
+    };
 
     struct LruEntry {
         LruEntry(uint32_t lruIt, int openCnt, uint64_t fileSize)
@@ -64,6 +96,11 @@ public:
         int openCount;
         uint64_t size;
         photon::rwlock rw_lock_;
+        // kept while the file is open, loaded from fiemap by the first opener
+        PageMap pages;
+        bool pagesLoaded = false;
+        // last access time in seconds of each refill unit while open, with evictUnits
+        std::vector<uint32_t> unitAccess;
     };
 
     // Normally, fileIndex(std::map) always keep growing, so its iterators always
@@ -74,27 +111,43 @@ public:
 
     bool isFull();
     void removeOpenFile(FileNameMap::iterator iter);
+    // wakes up the eviction worker, without waiting for it
     void forceRecycle();
     void updateLru(FileNameMap::iterator iter);
     uint64_t updateSpace(FileNameMap::iterator iter, uint64_t size);
+    void touchUnits(FileNameMap::iterator iter, off_t offset, size_t count);
 
 protected:
     IFile *openMedia(std::string_view name, int flags, int mode);
 
     static uint64_t timerHandler(void *data);
+    void evictionWorker();
     virtual void eviction();
+    std::vector<std::string> evictCandidates(uint64_t size);
+    uint64_t evictFile(const std::string &name, uint64_t size);
+    uint64_t evictColdUnits(FileNameMap::iterator iter, uint64_t size);
     uint64_t calcWaterMark(uint64_t capacity, uint64_t maxFreeSpace);
+    void setMarks(int64_t capacityInBytes);
 
     IFileSystem *mediaFs_; //  owned by current class
     uint64_t capacityInGB_;
     uint64_t periodInUs_;
     uint64_t diskAvailInBytes_;
     size_t refillUnit_;
+    bool evictUnits_;
     int64_t totalUsed_;
     int64_t riskMark_;
     uint64_t waterMark_;
+    // once above waterMark_, eviction goes on until below lowMark_
+    uint64_t lowMark_;
+    uint64_t evictRateInBytes_;
+    bool mmapHits_;
 
     photon::Timer *timer_;
+    photon::join_handle *evictTh_ = nullptr;
+    photon::condition_variable evictCv_;
+    photon::condition_variable paceCv_; // notified only on exit
+    bool recycle_ = false;
     bool running_;
     bool exit_;
 
@@ -105,8 +158,26 @@ protected:
     int traverseDir(const std::string &root);
     virtual int insertFile(std::string_view file);
 
-    typedef LRU<FileNameMap::iterator, uint32_t> LRUContainer;
-    LRUContainer lru_;
+    // the manifest lists the size and name of every cached file, it is saved
+    // as `clean` at shutdown, and as stale by the periodical checkpoints
+    int loadManifest(bool *clean);
+    int saveManifest(bool clean);
+    void lazyTraverse();
+
+    photon::join_handle *traverseTh_ = nullptr;
+    bool indexExact_ = true; // false until the lazy traversal completes
+    uint64_t lastCheckpoint_ = 0;
+
+    struct Owner {
+        std::string group;
+        bool pinned = false;
+    };
+    // by the names of cache files, kept after they are evicted
+    unordered_map_string_key<Owner> owners_;
+    std::unordered_map<std::string, uint64_t> quotas_;
+
+    typedef ICachePolicy<FileNameMap::iterator> PolicyContainer;
+    std::unique_ptr<PolicyContainer> lru_;
     // filename -> lruEntry
     FileNameMap fileIndex_;
 };
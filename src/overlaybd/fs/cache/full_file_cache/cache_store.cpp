@@ -16,8 +16,10 @@
 
 #include "cache_store.h"
 #include "sys/statvfs.h"
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <memory>
 #include "../../../alog-audit.h"
 #include "../../../alog.h"
 #include "../../../iovector.h"
@@ -35,6 +37,8 @@ FileCacheStore::FileCacheStore(FileSystem::ICachePool *cachePool, IFile *localFi
                                size_t refillUnit, FileIterator iterator)
     : cachePool_(static_cast<FileCachePool *>(cachePool)), localFile_(localFile),
       refillUnit_(refillUnit), iterator_(iterator) {
+    if (!lruEntry()->pagesLoaded)
+        loadPages();
 }
 
 FileCacheStore::~FileCacheStore() {
@@ -45,8 +49,7 @@ FileCacheStore::~FileCacheStore() {
 ssize_t FileCacheStore::preadv(const struct iovec *iov, int iovcnt, off_t offset) {
     ssize_t ret;
     cachePool_->updateLru(iterator_);
-    auto lruEntry = static_cast<FileCachePool::LruEntry *>(iterator_->second.get());
-    photon::scoped_rwlock rl(lruEntry->rw_lock_, photon::RLOCK);
+    photon::scoped_rwlock rl(lruEntry()->rw_lock_, photon::RLOCK);
     SCOPE_AUDIT_THRESHOLD(10UL * 1000, "file:read", AU_FILEOP("", offset, ret));
     ret = localFile_->preadv(iov, iovcnt, offset);
     return ret;
@@ -58,6 +61,9 @@ ssize_t FileCacheStore::do_pwritev(const struct iovec *iov, int iovcnt, off_t of
     ScopedRangeLock lock(rangeLock_, offset, view.sum());
     SCOPE_AUDIT_THRESHOLD(10UL * 1000, "file:write", AU_FILEOP("", offset, ret));
     ret = localFile_->pwritev(iov, iovcnt, offset);
+    if (ret > 0)
+        lruEntry()->pages.set(offset / kBlockSize,
+                              alingn_up(offset + ret, kBlockSize) / kBlockSize);
     return ret;
 }
 
@@ -86,64 +92,55 @@ ssize_t FileCacheStore::pwritev(const struct iovec *iov, int iovcnt, off_t offse
 
 std::pair<off_t, size_t> FileCacheStore::queryRefillRange(off_t offset, size_t size) {
     ScopedRangeLock lock(rangeLock_, offset, size);
-    off_t alignLeft = alingn_down(offset, kBlockSize);
-    off_t alignRight = alingn_up(offset + size, kBlockSize);
-    ReadRequest request{alignLeft, static_cast<size_t>(alignRight - alignLeft)};
-    struct fiemap_t<kFieExtentSize> fie(request.offset, request.size);
-    fie.fm_mapped_extents = 0;
-
-    if (request.size > 0) { //  fiemap cannot handle size zero.
-        auto ok = localFile_->fiemap(&fie);
-        if (ok != 0) {
-            LOG_ERRNO_RETURN(0, std::make_pair(-1, 0),
-                             "media fiemap failed : `, offset : `, size : `", ok, request.offset,
-                             request.size);
-        }
-        if (fie.fm_mapped_extents >= kFieExtentSize) { // TODO: qisheng.ds
-                                                       // it's supposed to be solved by
-                                                       // get fie extents twice,
-                                                       // but just do not concern much
-                                                       // about it rightnow.
-            LOG_ERROR_RETURN(EINVAL, std::make_pair(-1, 0), "read size is too big : `",
-                             request.size);
-        }
-    }
+    cachePool_->touchUnits(iterator_, offset, size);
+    auto &pages = lruEntry()->pages;
+    uint64_t begin = offset / kBlockSize;
+    uint64_t end = alingn_up(offset + size, kBlockSize) / kBlockSize;
+    uint64_t holeStart = pages.find_hole(begin, end);
+    if (holeStart >= end)
+        return std::make_pair(0, 0);
+    uint64_t holeEnd = pages.rfind_hole(holeStart, end);
 
-    uint64_t holeStart = request.offset;
-    uint64_t holeEnd = request.offset + request.size;
-
-    for (auto i = fie.fm_mapped_extents - 1; i < fie.fm_mapped_extents; i--) {
-        auto &extent = fie.fm_extents[i];
-        if ((extent.fe_flags == FIEMAP_EXTENT_UNKNOWN) ||
-            (extent.fe_flags == FIEMAP_EXTENT_UNWRITTEN))
-            continue;
-        if (extent.fe_logical < holeEnd) {
-            if (extent.fe_logical_end() >= holeEnd) {
-                holeEnd = extent.fe_logical;
-            } else
-                break;
-        }
-    }
+    // CacheMiss
+    auto left = alingn_down(holeStart * kBlockSize, refillUnit_);
+    auto right = alingn_up(holeEnd * kBlockSize, refillUnit_);
+    return std::make_pair(left, right - left);
+}
 
-    for (uint32_t i = 0; i < fie.fm_mapped_extents; i++) {
-        auto &extent = fie.fm_extents[i];
-        if ((extent.fe_flags == FIEMAP_EXTENT_UNKNOWN) ||
-            (extent.fe_flags == FIEMAP_EXTENT_UNWRITTEN))
-            continue;
-        if (extent.fe_logical_end() > holeStart) {
-            if (extent.fe_logical <= holeStart) {
-                holeStart = extent.fe_logical_end();
-            } else
-                break;
+// rebuild the page map from the extents of the local file, in batches of
+// kFieExtentSize, so that it works for files of any fragmentation
+int FileCacheStore::loadPages() {
+    auto entry = lruEntry();
+    struct stat st = {};
+    if (localFile_->fstat(&st) != 0)
+        LOG_ERRNO_RETURN(0, -1, "fstat failed");
+    entry->pages.bits.clear();
+    std::unique_ptr<fiemap_t<kFieExtentSize>> fie;
+    uint64_t start = 0;
+    while (start < (uint64_t)st.st_size) {
+        fie.reset(new fiemap_t<kFieExtentSize>(start, st.st_size - start));
+        fie->fm_mapped_extents = 0;
+        auto ok = localFile_->fiemap(fie.get());
+        if (ok != 0) {
+            entry->pages.bits.clear();
+            LOG_ERRNO_RETURN(0, -1, "media fiemap failed : `, offset : `, size : `", ok, start,
+                             st.st_size - start);
+        }
+        auto n = fie->fm_mapped_extents;
+        for (uint32_t i = 0; i < n; i++) {
+            auto &extent = fie->fm_extents[i];
+            if ((extent.fe_flags == FIEMAP_EXTENT_UNKNOWN) ||
+                (extent.fe_flags == FIEMAP_EXTENT_UNWRITTEN))
+                continue;
+            entry->pages.set(extent.fe_logical / kBlockSize,
+                             alingn_up(extent.fe_logical_end(), kBlockSize) / kBlockSize);
         }
+        if (n < kFieExtentSize || (fie->fm_extents[n - 1].fe_flags & FIEMAP_EXTENT_LAST))
+            break;
+        start = fie->fm_extents[n - 1].fe_logical_end();
     }
-
-    if (holeStart >= holeEnd)
-        return std::make_pair(0, 0);
-    // CacheMiss
-    auto left = alingn_down(holeStart, refillUnit_);
-    auto right = alingn_up(holeEnd, refillUnit_);
-    return std::make_pair(left, right - left);
+    entry->pagesLoaded = true;
+    return 0;
 }
 
 int FileCacheStore::stat(CacheStat *stat) {
@@ -152,7 +149,9 @@ int FileCacheStore::stat(CacheStat *stat) {
 }
 
 int FileCacheStore::evict(off_t offset, size_t count) {
+    auto &pages = lruEntry()->pages;
     if (static_cast<size_t>(-1) == count) {
+        pages.clear(alingn_up(offset, kBlockSize) / kBlockSize, UINT64_MAX);
         return localFile_->ftruncate(offset);
     } else {
 #ifndef FALLOC_FL_KEEP_SIZE
@@ -162,6 +161,7 @@ int FileCacheStore::evict(off_t offset, size_t count) {
 #define FALLOC_FL_PUNCH_HOLE 0x02 /* de-allocates range */
 #endif
         int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        pages.clear(alingn_up(offset, kBlockSize) / kBlockSize, (offset + count) / kBlockSize);
         return localFile_->fallocate(mode, offset, count);
     }
 }
@@ -174,4 +174,47 @@ bool FileCacheStore::cacheIsFull() {
     return cachePool_->isFull();
 }
 
+MmapCacheStore::MmapCacheStore(FileSystem::ICachePool *cachePool, IFile *localFile, int fd,
+                               size_t refillUnit, FileIterator iterator)
+    : FileCacheStore(cachePool, localFile, refillUnit, iterator), fd_(fd) {
+}
+
+MmapCacheStore::~MmapCacheStore() {
+    for (auto p : windows_) {
+        if (p)
+            munmap(p, kMapWindow);
+    }
+}
+
+char *MmapCacheStore::window(uint64_t i) {
+    if (i >= windows_.size())
+        windows_.resize(i + 1, nullptr);
+    if (!windows_[i]) {
+        auto p = mmap(nullptr, kMapWindow, PROT_READ, MAP_SHARED, fd_, i * kMapWindow);
+        if (p == MAP_FAILED)
+            LOG_ERRNO_RETURN(0, nullptr, "failed to map window ` of the cache file", i);
+        windows_[i] = (char *)p;
+    }
+    return windows_[i];
+}
+
+ssize_t MmapCacheStore::preadv(const struct iovec *iov, int iovcnt, off_t offset) {
+    iovector_view view((iovec *)iov, iovcnt);
+    size_t count = view.sum();
+    uint64_t w = offset / kMapWindow;
+    if (count == 0 || (offset + count - 1) / kMapWindow != w)
+        return FileCacheStore::preadv(iov, iovcnt, offset);
+    {
+        cachePool_->updateLru(iterator_);
+        // eviction clears the pages before punching them, under the write lock
+        photon::scoped_rwlock rl(lruEntry()->rw_lock_, photon::RLOCK);
+        uint64_t end = alingn_up(offset + count, kBlockSize) / kBlockSize;
+        char *base;
+        if (lruEntry()->pages.find_hole(offset / kBlockSize, end) >= end &&
+            (base = window(w)) != nullptr)
+            return view.memcpy_from(base + offset % kMapWindow, count);
+    }
+    return FileCacheStore::preadv(iov, iovcnt, offset);
+}
+
 } //  namespace Cache
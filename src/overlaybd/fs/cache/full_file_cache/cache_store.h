@@ -17,6 +17,7 @@
 
 #include <stddef.h>
 #include <string>
+#include <vector>
 #include "../../../range-lock.h"
 #include "cache_pool.h"
 
@@ -50,19 +51,11 @@ public:
 protected:
     bool cacheIsFull();
 
-    struct ReadRequest {
-        off_t offset;
-        size_t size;
-    };
+    FileCachePool::LruEntry *lruEntry() {
+        return iterator_->second.get();
+    }
 
-    //  merge from first extent to last extent(or encounter hole),
-    //  because fiemap could return multiple continuous extents even though no any hole.
-    std::pair<off_t, size_t> getFirstMergedExtents(struct fiemap *fie);
-
-    std::pair<off_t, size_t> getLastMergedExtents(struct fiemap *fie);
-
-    std::pair<off_t, off_t> getHoleFromCacheHitResult(off_t offset, size_t alignSize,
-                                                      struct FileSystem::fiemap *fie);
+    int loadPages();
 
     FileCachePool *cachePool_; //  owned by extern class
     IFile *localFile_;         //  owned by current class
@@ -73,4 +66,27 @@ protected:
     ssize_t do_pwritev(const struct iovec *iov, int iovcnt, off_t offset);
 };
 
+// A FileCacheStore serving hits by copying from a shared mapping of the cache
+// file, which costs no syscall once the pages are in memory. The file is
+// mapped in windows of kMapWindow bytes on demand, kept till the store is
+// closed; only populated pages are read from the mapping, so it's never read
+// beyond the end of the file, and reads reaching a hole or spanning windows,
+// as well as misses, are served by the file as usual.
+class MmapCacheStore : public FileCacheStore {
+public:
+    static const uint64_t kMapWindow = 64 * 1024 * 1024;
+
+    MmapCacheStore(FileSystem::ICachePool *cachePool, IFile *localFile, int fd,
+                   size_t refillUnit, FileIterator iterator);
+    ~MmapCacheStore();
+
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override;
+
+protected:
+    int fd_; //  of localFile_
+    std::vector<char *> windows_;
+
+    char *window(uint64_t i);
+};
+
 } //  namespace Cache
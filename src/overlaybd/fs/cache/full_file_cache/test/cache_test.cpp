@@ -29,12 +29,19 @@
 #include "../../../../alog.h"
 #include "../../../localfs.h"
 #include "../../../aligned-file.h"
+#include "../../../forwardfs.h"
 #include "../../../../photon/thread.h"
+#include "../../../../photon/thread11.h"
 #include "../../../../photon/syncio/fd-events.h"
 #include "../../../../photon/syncio/aio-wrapper.h"
 #include "../../../../io-alloc.h"
 
 #include "../../cache.h"
+#include "../../policy/clock.h"
+#include "../../policy/policy.h"
+#include "../../policy/sketch.h"
+#include "../cache_pool.h"
+#include "../cache_store.h"
 #include "random_generator.h"
 
 namespace Cache {
@@ -374,6 +381,717 @@ TEST(RoCachedFs, CacheWithOutSrcFile) {
   EXPECT_EQ(-1, writeFile->pread(res.data(), len, len * 2));
 }
 
+TEST(RoCachedFs, FragmentedCacheFile) {
+  std::string root("/tmp/obdcache/cache_test_fragmented/");
+  SetupTestDir(root);
+  SetupTestDir(root + "testDir");
+
+  // every other page of the cache file is populated, far more extents
+  // than a single fiemap call returns
+  const int kPageSize = 4 * 1024;
+  const int kPageCount = 8192;
+  std::vector<char> page(kPageSize, 'a');
+  {
+    int fd = ::open((root + "testDir/file_1").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_LE(0, fd);
+    for (int i = 0; i < kPageCount; i += 2)
+      EXPECT_EQ(kPageSize, ::pwrite(fd, page.data(), kPageSize, (off_t)i * kPageSize));
+    ::ftruncate(fd, (off_t)kPageCount * kPageSize);
+    ::close(fd);
+  }
+
+  auto mediaFs = new_localfs_adaptor(root.c_str(), ioengine_psync);
+  auto cacheAllocator = new AlignedAlloc(4 * 1024);
+  DEFER(delete cacheAllocator);
+  auto roCachedFs = new_full_file_cached_fs(nullptr, mediaFs, kPageSize,
+      512, 1000 * 1000 * 1, 128ul * 1024 * 1024, cacheAllocator);
+  DEFER(delete roCachedFs);
+  auto cachedFile = static_cast<ICachedFile*>(roCachedFs->open("/testDir/file_1", 0, 0644));
+  DEFER(delete cachedFile);
+  cachedFile->ftruncate((off_t)kPageCount * kPageSize);
+
+  for (int i = kPageCount - 6; i < kPageCount; i++)
+    EXPECT_EQ(i % 2 ? kPageSize : 0, cachedFile->query((off_t)i * kPageSize, kPageSize));
+  EXPECT_EQ(kPageSize * 3, cachedFile->query((off_t)(kPageCount - 4) * kPageSize, kPageSize * 4));
+
+  EXPECT_EQ(kPageSize,
+            cachedFile->pwrite(page.data(), kPageSize, (off_t)(kPageCount - 1) * kPageSize));
+  EXPECT_EQ(0, cachedFile->query((off_t)(kPageCount - 2) * kPageSize, kPageSize * 2));
+
+  EXPECT_EQ(0, cachedFile->fallocate(0, (off_t)(kPageCount - 2) * kPageSize, kPageSize));
+  EXPECT_EQ(kPageSize, cachedFile->query((off_t)(kPageCount - 2) * kPageSize, kPageSize * 2));
+}
+
+TEST(RoCachedFs, MemCacheTier) {
+  std::string root("/tmp/obdcache/cache_test_mem/");
+  SetupTestDir(root);
+  std::string srcRoot("/tmp/obdcache/src_test_mem/");
+  SetupTestDir(srcRoot);
+
+  const size_t kRefillUnit = 64 * 1024;
+  const size_t kFileSize = kRefillUnit * 8 + 1000;
+  std::vector<char> data(kFileSize);
+  UniformCharRandomGen gen(0, 255);
+  for (auto &c : data)
+    c = gen.next();
+  auto srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+  {
+    auto srcFile = srcFs->open("/file_1", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    EXPECT_EQ((ssize_t)kFileSize, srcFile->pwrite(data.data(), kFileSize, 0));
+    delete srcFile;
+  }
+
+  auto mediaFs = new_localfs_adaptor(root.c_str(), ioengine_psync);
+  auto cacheAllocator = new AlignedAlloc(4 * 1024);
+  DEFER(delete cacheAllocator);
+  // room for 4 blocks in memory, promoted on the 2nd hit on disk
+  auto roCachedFs = new_full_file_cached_fs(srcFs, mediaFs, kRefillUnit, 512, 1000 * 1000 * 1,
+      128ul * 1024 * 1024, cacheAllocator, kRefillUnit * 4, 2);
+  ASSERT_NE(nullptr, roCachedFs);
+  DEFER(delete roCachedFs);
+  auto cachedFile = roCachedFs->open("/file_1", 0, 0644);
+  DEFER(delete cachedFile);
+
+  std::vector<char> buf(kFileSize);
+  // refill, then hit twice on disk
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ((ssize_t)kFileSize, cachedFile->pread(buf.data(), kFileSize, 0));
+    EXPECT_EQ(0, memcmp(data.data(), buf.data(), kFileSize));
+  }
+
+  // wipe the disk cache behind its back, the last promoted blocks are served from memory
+  ::truncate((root + "file_1").c_str(), 0);
+  auto offset = kRefillUnit * 5;
+  auto len = kFileSize - offset;
+  buf.assign(kFileSize, 0);
+  EXPECT_EQ((ssize_t)len, cachedFile->pread(buf.data(), len, offset));
+  EXPECT_EQ(0, memcmp(data.data() + offset, buf.data(), len));
+  delete srcFs;
+}
+
+TEST(RoCachedFs, TieredCache) {
+  std::string root("/tmp/obdcache/cache_test_tiered/");
+  SetupTestDir(root);
+  std::string fastRoot("/tmp/obdcache/cache_test_tiered_fast/");
+  SetupTestDir(fastRoot);
+  std::string srcRoot("/tmp/obdcache/src_test_tiered/");
+  SetupTestDir(srcRoot);
+
+  const size_t kRefillUnit = 64 * 1024;
+  const size_t kFileSize = kRefillUnit * 8 + 1000;
+  std::vector<char> data(kFileSize);
+  UniformCharRandomGen gen(0, 255);
+  for (auto &c : data)
+    c = gen.next();
+  auto srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+  {
+    auto srcFile = srcFs->open("/file_1", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    EXPECT_EQ((ssize_t)kFileSize, srcFile->pwrite(data.data(), kFileSize, 0));
+    delete srcFile;
+  }
+
+  auto mediaFs = new_localfs_adaptor(root.c_str(), ioengine_psync);
+  auto fastMediaFs = new_localfs_adaptor(fastRoot.c_str(), ioengine_psync);
+  auto cacheAllocator = new AlignedAlloc(4 * 1024);
+  DEFER(delete cacheAllocator);
+  // promoted to the fast device on the 2nd hit on the slow one
+  auto roCachedFs = new_full_file_cached_fs(srcFs, mediaFs, kRefillUnit, 512, 1000 * 1000 * 1,
+      128ul * 1024 * 1024, cacheAllocator, 0, 2, "lru", false, false, false, 0, 0,
+      fastMediaFs, 1, 2);
+  ASSERT_NE(nullptr, roCachedFs);
+  DEFER(delete roCachedFs);
+  auto cachedFile = roCachedFs->open("/file_1", 0, 0644);
+  DEFER(delete cachedFile);
+
+  std::vector<char> buf(kFileSize);
+  // refill, then hit once on the slow device, the fast one is still empty
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ((ssize_t)kFileSize, cachedFile->pread(buf.data(), kFileSize, 0));
+    EXPECT_EQ(0, memcmp(data.data(), buf.data(), kFileSize));
+  }
+  struct stat st = {};
+  EXPECT_EQ(0, ::stat((fastRoot + "file_1").c_str(), &st));
+  EXPECT_EQ(0, st.st_size);
+  EXPECT_EQ((ssize_t)kFileSize, cachedFile->pread(buf.data(), kFileSize, 0));
+  EXPECT_EQ(0, ::stat((fastRoot + "file_1").c_str(), &st));
+  EXPECT_EQ((off_t)kFileSize, st.st_size);
+
+  // wipe the slow cache behind its back, all blocks are served by the fast one
+  ::truncate((root + "file_1").c_str(), 0);
+  buf.assign(kFileSize, 0);
+  EXPECT_EQ((ssize_t)kFileSize, cachedFile->pread(buf.data(), kFileSize, 0));
+  EXPECT_EQ(0, memcmp(data.data(), buf.data(), kFileSize));
+  delete srcFs;
+}
+
+static void readAndCompare(IFile *file, const char *expect, size_t count, off_t offset) {
+  std::vector<char> buf(count);
+  EXPECT_EQ((ssize_t)count, file->pread(buf.data(), count, offset));
+  EXPECT_EQ(0, memcmp(expect + offset, buf.data(), count));
+}
+
+TEST(RoCachedFs, AsyncRefill) {
+  std::string root("/tmp/obdcache/cache_test_async/");
+  SetupTestDir(root);
+  std::string srcRoot("/tmp/obdcache/src_test_async/");
+  SetupTestDir(srcRoot);
+
+  const size_t kRefillUnit = 64 * 1024;
+  const size_t kFileSize = kRefillUnit * 8 + 1000;
+  std::vector<char> data(kFileSize);
+  UniformCharRandomGen gen(0, 255);
+  for (auto &c : data)
+    c = gen.next();
+  auto srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+  {
+    auto srcFile = srcFs->open("/file_1", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    EXPECT_EQ((ssize_t)kFileSize, srcFile->pwrite(data.data(), kFileSize, 0));
+    delete srcFile;
+  }
+
+  auto mediaFs = new_localfs_adaptor(root.c_str(), ioengine_psync);
+  auto cacheAllocator = new AlignedAlloc(4 * 1024);
+  DEFER(delete cacheAllocator);
+  auto roCachedFs = new_full_file_cached_fs(srcFs, mediaFs, kRefillUnit, 512, 1000 * 1000 * 1,
+      128ul * 1024 * 1024, cacheAllocator, 0, 2, "lru", false, true);
+  ASSERT_NE(nullptr, roCachedFs);
+  DEFER(delete roCachedFs);
+
+  {
+    auto cachedFile = roCachedFs->open("/file_1", 0, 0644);
+    // readers of a same refill unit, the later ones copy from the first one's buffer
+    std::vector<photon::join_handle *> jhs;
+    for (int i = 0; i < 4; i++) {
+      auto th = photon::thread_create11(&readAndCompare, cachedFile, data.data(), 4096,
+                                        i * 4096 + 100);
+      jhs.push_back(photon::thread_enable_join(th));
+    }
+    for (auto jh : jhs)
+      photon::thread_join(jh);
+    readAndCompare(cachedFile, data.data(), kFileSize, 0);
+    // waits for the cache writes in background
+    delete cachedFile;
+  }
+
+  struct stat st;
+  EXPECT_EQ(0, ::stat((root + "file_1").c_str(), &st));
+  EXPECT_EQ((off_t)kFileSize, st.st_size);
+  std::vector<char> cached(kFileSize);
+  auto fd = ::open((root + "file_1").c_str(), O_RDONLY);
+  EXPECT_EQ((ssize_t)kFileSize, ::pread(fd, cached.data(), kFileSize, 0));
+  ::close(fd);
+  EXPECT_EQ(0, memcmp(data.data(), cached.data(), kFileSize));
+  delete srcFs;
+}
+
+struct PrefetchWaiter {
+  int pending = 0;
+  ssize_t bytes = 0;
+  photon::condition_variable cv;
+
+  int on_done(ssize_t ret) {
+    if (ret > 0)
+      bytes += ret;
+    if (--pending == 0)
+      cv.notify_all();
+    return 0;
+  }
+};
+
+TEST(RoCachedFs, PrefetchAsync) {
+  std::string root("/tmp/obdcache/cache_test_prefetch/");
+  SetupTestDir(root);
+  std::string srcRoot("/tmp/obdcache/src_test_prefetch/");
+  SetupTestDir(srcRoot);
+
+  const size_t kRefillUnit = 64 * 1024;
+  const size_t kFileSize = 16ul * 1024 * 1024 + 1000;
+  std::vector<char> data(kFileSize);
+  UniformCharRandomGen gen(0, 255);
+  for (auto &c : data)
+    c = gen.next();
+  auto srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+  for (auto name : {"/file_1", "/file_2"}) {
+    auto srcFile = srcFs->open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    EXPECT_EQ((ssize_t)kFileSize, srcFile->pwrite(data.data(), kFileSize, 0));
+    delete srcFile;
+  }
+
+  auto mediaFs = new_localfs_adaptor(root.c_str(), ioengine_psync);
+  auto cacheAllocator = new AlignedAlloc(4 * 1024);
+  DEFER(delete cacheAllocator);
+  auto roCachedFs = new_full_file_cached_fs(srcFs, mediaFs, kRefillUnit, 512, 1000 * 1000 * 1,
+      128ul * 1024 * 1024, cacheAllocator);
+  ASSERT_NE(nullptr, roCachedFs);
+  DEFER(delete roCachedFs);
+
+  // overlapped prefetches of two files at the same time
+  PrefetchWaiter waiter;
+  std::vector<ICachedFile *> files;
+  for (auto name : {"/file_1", "/file_2"}) {
+    auto file = static_cast<ICachedFile *>(roCachedFs->open(name, 0, 0644));
+    files.push_back(file);
+    for (int i = 0; i <= 4; i++) {
+      waiter.pending++;
+      EXPECT_EQ(0, file->prefetch_async(i * kFileSize / 8, kFileSize / 2,
+                                        {&waiter, &PrefetchWaiter::on_done}));
+    }
+  }
+  while (waiter.pending > 0)
+    waiter.cv.wait_no_lock();
+  EXPECT_LE((ssize_t)(kFileSize * 2), waiter.bytes);
+
+  for (auto file : files) {
+    EXPECT_EQ(0, file->query(0, kFileSize - 1000));
+    readAndCompare(file, data.data(), kFileSize, 0);
+    delete file;
+  }
+  delete srcFs;
+}
+
+TEST(RoCachedFs, CacheByDigest) {
+  std::string root("/tmp/obdcache/cache_test_digest/");
+  SetupTestDir(root);
+  std::string srcRoot("/tmp/obdcache/src_test_digest/");
+  SetupTestDir(srcRoot);
+
+  const size_t kRefillUnit = 64 * 1024;
+  const size_t kFileSize = kRefillUnit * 4;
+  const std::string digest = "sha256:" + std::string(64, 'a');
+  const std::string repo = "/repo/blobs/" + digest, mirror = "/mirror/blobs/" + digest;
+  std::vector<char> data(kFileSize), zeros(kFileSize, 0);
+  UniformCharRandomGen gen(0, 255);
+  for (auto &c : data)
+    c = gen.next();
+  auto srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+  SetupTestDir(srcRoot + "repo/blobs");
+  SetupTestDir(srcRoot + "mirror/blobs");
+  // the mirror differs from the repo, to tell which one a read comes from
+  for (auto &src : {std::make_pair(repo, &data), std::make_pair(mirror, &zeros)}) {
+    auto srcFile = srcFs->open(src.first.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    EXPECT_EQ((ssize_t)kFileSize, srcFile->pwrite(src.second->data(), kFileSize, 0));
+    delete srcFile;
+  }
+
+  auto mediaFs = new_localfs_adaptor(root.c_str(), ioengine_psync);
+  auto cacheAllocator = new AlignedAlloc(4 * 1024);
+  DEFER(delete cacheAllocator);
+  auto roCachedFs = new_full_file_cached_fs(srcFs, mediaFs, kRefillUnit, 512, 1000 * 1000 * 1,
+      128ul * 1024 * 1024, cacheAllocator, 0, 2, "lru", false, false, true);
+  ASSERT_NE(nullptr, roCachedFs);
+  DEFER(delete roCachedFs);
+  EXPECT_EQ("/blobs/" + digest, roCachedFs->get_pool()->cache_key(mirror));
+  EXPECT_EQ("/repo/file_1", roCachedFs->get_pool()->cache_key("/repo/file_1"));
+
+  auto file = roCachedFs->open(repo.c_str(), 0, 0644);
+  readAndCompare(file, data.data(), kFileSize, 0);
+  delete file;
+  struct stat st;
+  EXPECT_EQ(0, ::stat((root + "blobs/" + digest).c_str(), &st));
+
+  file = roCachedFs->open(mirror.c_str(), 0, 0644);
+  readAndCompare(file, data.data(), kFileSize, 0);
+  delete file;
+  delete srcFs;
+}
+
+TEST(RoCachedFs, OpenCached) {
+  std::string root("/tmp/obdcache/cache_test_open_cached/");
+  SetupTestDir(root);
+  std::string srcRoot("/tmp/obdcache/src_test_open_cached/");
+  SetupTestDir(srcRoot);
+
+  const size_t kRefillUnit = 64 * 1024;
+  const size_t kFileSize = kRefillUnit * 4;
+  std::vector<char> data(kFileSize), zeros(kFileSize, 0);
+  UniformCharRandomGen gen(0, 255);
+  for (auto &c : data)
+    c = gen.next();
+  auto srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+  DEFER(delete srcFs);
+  for (auto &src : {std::make_pair("/data", &data), std::make_pair("/zeros", &zeros)}) {
+    auto srcFile = srcFs->open(src.first, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    EXPECT_EQ((ssize_t)kFileSize, srcFile->pwrite(src.second->data(), kFileSize, 0));
+    delete srcFile;
+  }
+
+  auto mediaFs = new_localfs_adaptor(root.c_str(), ioengine_psync);
+  auto cacheAllocator = new AlignedAlloc(4 * 1024);
+  DEFER(delete cacheAllocator);
+  auto roCachedFs = new_full_file_cached_fs(srcFs, mediaFs, kRefillUnit, 512, 1000 * 1000 * 1,
+      128ul * 1024 * 1024, cacheAllocator);
+  ASSERT_NE(nullptr, roCachedFs);
+  DEFER(delete roCachedFs);
+
+  // cached under a name of its own, over a file not of the source fs
+  auto file = roCachedFs->open_cached("/decoded", srcFs->open("/data", O_RDONLY));
+  ASSERT_NE(nullptr, file);
+  readAndCompare(file, data.data(), kFileSize, 0);
+  EXPECT_EQ(0, file->query(0, kFileSize));
+  delete file;
+  struct stat st;
+  EXPECT_EQ(0, ::stat((root + "decoded").c_str(), &st));
+
+  // served from the cache, rather than from the new source
+  file = roCachedFs->open_cached("/decoded", srcFs->open("/zeros", O_RDONLY));
+  ASSERT_NE(nullptr, file);
+  readAndCompare(file, data.data(), kFileSize, 0);
+  delete file;
+}
+
+class ManifestCachePool : public FileCachePool {
+public:
+  using FileCachePool::FileCachePool;
+  size_t files() { return fileIndex_.size(); }
+  int64_t used() { return totalUsed_; }
+  bool exact() { return indexExact_; }
+  int checkpoint() { return saveManifest(false); }
+  std::vector<std::string> candidates(uint64_t size) { return evictCandidates(size); }
+};
+
+static void writeMediaFile(const std::string &path, size_t size) {
+  std::vector<char> data(size, 'x');
+  auto fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  EXPECT_EQ((ssize_t)size, ::pwrite(fd, data.data(), size, 0));
+  ::close(fd);
+}
+
+static ManifestCachePool *newManifestPool(const std::string &root) {
+  auto pool = new ManifestCachePool(new_localfs_adaptor(root.c_str(), ioengine_psync), 512,
+                                    1000 * 1000 * 1, 0, 64 * 1024);
+  pool->Init();
+  return pool;
+}
+
+TEST(CachePool, Manifest) {
+  std::string root("/tmp/obdcache/cache_test_manifest/");
+  SetupTestDir(root);
+  SetupTestDir(root + "sub");
+  writeMediaFile(root + "a", 8192);
+  writeMediaFile(root + "sub/b", 16384);
+  std::string manifest = root + ".manifest";
+  struct stat st;
+
+  // no manifest, traversed at once, and saved at shutdown
+  auto pool = newManifestPool(root);
+  EXPECT_EQ(2u, pool->files());
+  EXPECT_TRUE(pool->exact());
+  auto used = pool->used();
+  EXPECT_LE(8192 + 16384, used);
+  delete pool;
+  EXPECT_EQ(0, ::stat(manifest.c_str(), &st));
+
+  // a clean manifest is trusted, and consumed
+  writeMediaFile(root + "c", 4096);
+  pool = newManifestPool(root);
+  EXPECT_EQ(2u, pool->files());
+  EXPECT_EQ(used, pool->used());
+  EXPECT_TRUE(pool->exact());
+  EXPECT_NE(0, ::stat(manifest.c_str(), &st));
+
+  // a checkpoint left by a crash is stale, reconciled in background
+  EXPECT_EQ(0, pool->checkpoint());
+  ::rename(manifest.c_str(), (root + "saved").c_str());
+  delete pool;
+  ::rename((root + "saved").c_str(), manifest.c_str());
+  ::unlink((root + "a").c_str());
+  pool = newManifestPool(root);
+  EXPECT_EQ(2u, pool->files());
+  for (int i = 0; i < 100 && !pool->exact(); i++)
+    photon::thread_usleep(10 * 1000);
+  EXPECT_TRUE(pool->exact());
+  EXPECT_EQ(2u, pool->files());
+  EXPECT_LE(16384 + 4096, pool->used());
+  EXPECT_GT(used, pool->used());
+  delete pool;
+}
+
+TEST(CachePool, Quota) {
+  std::string root("/tmp/obdcache/cache_test_quota/");
+  SetupTestDir(root);
+  for (auto name : {"x1", "x2", "y1", "base"})
+    writeMediaFile(root + name, 8192);
+  auto pool = newManifestPool(root);
+  DEFER(delete pool);
+  EXPECT_EQ(0, pool->set_owner("/x1", "x", false));
+  EXPECT_EQ(0, pool->set_owner("/x2", "x", false));
+  EXPECT_EQ(0, pool->set_owner("/y1", "y", false));
+  EXPECT_EQ(0, pool->set_owner("/base", "y", true));
+  // the first group is kept, and pinning adds up
+  EXPECT_EQ(0, pool->set_owner("/base", "x", false));
+
+  // without quotas, in the order of the policy, except the pinned one last
+  auto order = pool->candidates(-1);
+  ASSERT_EQ(4u, order.size());
+  EXPECT_EQ("/base", order.back());
+
+  // x borrows a file over its quota, which goes first
+  EXPECT_EQ(0, pool->set_quota("x", 8192));
+  auto names = pool->candidates(-1);
+  ASSERT_EQ(4u, names.size());
+  EXPECT_TRUE(names[0] == "/x1" || names[0] == "/x2");
+  EXPECT_EQ("/base", names.back());
+  EXPECT_EQ(1u, pool->candidates(1).size());
+
+  // within its quota, x borrows nothing
+  EXPECT_EQ(0, pool->set_quota("x", 16384));
+  EXPECT_EQ(order, pool->candidates(-1));
+  EXPECT_EQ(-1, pool->set_quota("", 8192));
+}
+
+TEST(RoCachedFs, Admission) {
+  std::string root("/tmp/obdcache/cache_test_admission/");
+  SetupTestDir(root);
+  std::string srcRoot("/tmp/obdcache/src_test_admission/");
+  SetupTestDir(srcRoot);
+
+  const size_t kRefillUnit = 64 * 1024;
+  const size_t kFileSize = kRefillUnit * 4;
+  std::vector<char> data(kFileSize);
+  UniformCharRandomGen gen(0, 255);
+  for (auto &c : data)
+    c = gen.next();
+  auto srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+  {
+    auto srcFile = srcFs->open("/file_1", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    EXPECT_EQ((ssize_t)kFileSize, srcFile->pwrite(data.data(), kFileSize, 0));
+    delete srcFile;
+  }
+
+  auto mediaFs = new_localfs_adaptor(root.c_str(), ioengine_psync);
+  auto cacheAllocator = new AlignedAlloc(4 * 1024);
+  DEFER(delete cacheAllocator);
+  auto roCachedFs = new_full_file_cached_fs(srcFs, mediaFs, kRefillUnit, 512, 1000 * 1000 * 1,
+      128ul * 1024 * 1024, cacheAllocator, 0, 2, "lru", false, false, false, 0, 2);
+  ASSERT_NE(nullptr, roCachedFs);
+  DEFER(delete roCachedFs);
+  auto file = static_cast<ICachedFile *>(roCachedFs->open("/file_1", 0, 0644));
+  DEFER(delete file);
+
+  // admitted on the 2nd miss only
+  readAndCompare(file, data.data(), 4096, 0);
+  EXPECT_NE(0, file->query(0, 4096));
+  readAndCompare(file, data.data(), 4096, 0);
+  EXPECT_EQ(0, file->query(0, 4096));
+
+  // never for a one-shot reader, and at once for a known hot one
+  cached_fs_set_admission(ADMIT_NEVER);
+  for (int i = 0; i < 3; i++)
+    readAndCompare(file, data.data(), 4096, kRefillUnit);
+  EXPECT_NE(0, file->query(kRefillUnit, 4096));
+  cached_fs_set_admission(ADMIT_ALWAYS);
+  readAndCompare(file, data.data(), 4096, kRefillUnit * 2);
+  EXPECT_EQ(0, file->query(kRefillUnit * 2, 4096));
+  cached_fs_set_admission(ADMIT_BY_FILTER);
+  delete srcFs;
+}
+
+// a source telling a fetch size, and counting the reads of it
+class FetchSizeFile : public ForwardFile_Ownership {
+public:
+  FetchSizeFile(IFile *file, size_t fetchSize, int *reads)
+      : ForwardFile_Ownership(file, true), fetchSize_(fetchSize), reads_(reads) {}
+  ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+    (*reads_)++;
+    return m_file->preadv(iov, iovcnt, offset);
+  }
+  int vioctl(int request, va_list args) override {
+    if (request != IOCTL_FETCH_SIZE) {
+      errno = ENOSYS;
+      return -1;
+    }
+    *va_arg(args, size_t *) = fetchSize_;
+    return 0;
+  }
+
+private:
+  size_t fetchSize_;
+  int *reads_;
+};
+
+class FetchSizeFs : public ForwardFS_Ownership {
+public:
+  FetchSizeFs(IFileSystem *fs, size_t fetchSize)
+      : ForwardFS_Ownership(fs, true), fetchSize_(fetchSize) {}
+  IFile *open(const char *pathname, int flags) override {
+    auto file = m_fs->open(pathname, flags);
+    return file ? new FetchSizeFile(file, fetchSize_, &reads) : nullptr;
+  }
+  IFile *open(const char *pathname, int flags, mode_t mode) override {
+    return open(pathname, flags);
+  }
+  int reads = 0;
+
+private:
+  size_t fetchSize_;
+};
+
+TEST(RoCachedFs, FetchSize) {
+  std::string root("/tmp/obdcache/cache_test_fetch/");
+  SetupTestDir(root);
+  std::string srcRoot("/tmp/obdcache/src_test_fetch/");
+  SetupTestDir(srcRoot);
+
+  const size_t kRefillUnit = 64 * 1024;
+  const size_t kFileSize = kRefillUnit * 16;
+  std::vector<char> data(kFileSize);
+  UniformCharRandomGen gen(0, 255);
+  for (auto &c : data)
+    c = gen.next();
+  auto localFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+  for (auto name : {"/file_1", "/file_2"}) {
+    auto srcFile = localFs->open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    EXPECT_EQ((ssize_t)kFileSize, srcFile->pwrite(data.data(), kFileSize, 0));
+    delete srcFile;
+  }
+  // 3 units and a bit, rounded up to 4 units
+  auto srcFs = new FetchSizeFs(localFs, kRefillUnit * 3 + 100);
+  DEFER(delete srcFs);
+
+  auto mediaFs = new_localfs_adaptor(root.c_str(), ioengine_psync);
+  auto cacheAllocator = new AlignedAlloc(4 * 1024);
+  DEFER(delete cacheAllocator);
+  auto roCachedFs = new_full_file_cached_fs(srcFs, mediaFs, kRefillUnit, 512, 1000 * 1000 * 1,
+      128ul * 1024 * 1024, cacheAllocator);
+  ASSERT_NE(nullptr, roCachedFs);
+  DEFER(delete roCachedFs);
+  auto file = static_cast<ICachedFile *>(roCachedFs->open("/file_1", 0, 0644));
+  DEFER(delete file);
+
+  // a miss of one unit refills the fetch size
+  readAndCompare(file, data.data(), 4096, 100);
+  EXPECT_EQ(1, srcFs->reads);
+  EXPECT_EQ(0, file->query(0, kRefillUnit * 4));
+  EXPECT_NE(0, file->query(kRefillUnit * 4, 4096));
+  readAndCompare(file, data.data(), kRefillUnit, kRefillUnit * 3);
+  EXPECT_EQ(1, srcFs->reads);
+
+  // but not over the units cached already
+  readAndCompare(file, data.data(), 4096, kRefillUnit * 6);
+  EXPECT_EQ(2, srcFs->reads);
+  readAndCompare(file, data.data(), 4096, kRefillUnit * 5);
+  EXPECT_EQ(3, srcFs->reads);
+  EXPECT_EQ(0, file->query(kRefillUnit * 5, kRefillUnit * 5));
+  EXPECT_NE(0, file->query(kRefillUnit * 4, 4096));
+
+  // and prefetches go in pieces of the fetch size
+  auto file2 = static_cast<ICachedFile *>(roCachedFs->open("/file_2", 0, 0644));
+  DEFER(delete file2);
+  EXPECT_EQ((ssize_t)kFileSize, file2->prefetch(0, kFileSize));
+  EXPECT_EQ(3 + 4, srcFs->reads);
+  readAndCompare(file2, data.data(), kFileSize, 0);
+  EXPECT_EQ(3 + 4, srcFs->reads);
+}
+
+TEST(CachePool, MmapHits) {
+  std::string root("/tmp/obdcache/cache_test_mmap/");
+  SetupTestDir(root);
+  const size_t kRefillUnit = 64 * 1024;
+  auto pool = new FileCachePool(new_localfs_adaptor(root.c_str(), ioengine_psync), 512,
+                                1000 * 1000 * 1, 0, kRefillUnit, "lru", false, 0, true);
+  pool->Init();
+  DEFER(delete pool);
+  auto store = pool->open("/file_1", O_RDWR | O_CREAT, 0644);
+  ASSERT_NE(nullptr, store);
+  DEFER(store->release());
+  EXPECT_NE(nullptr, dynamic_cast<MmapCacheStore *>(store));
+
+  std::vector<char> data(kRefillUnit * 2), buf(kRefillUnit * 2);
+  UniformCharRandomGen gen(0, 255);
+  for (auto &c : data)
+    c = gen.next();
+  struct iovec iov{data.data(), kRefillUnit};
+  EXPECT_EQ((ssize_t)kRefillUnit, store->pwritev(&iov, 1, kRefillUnit));
+
+  // hits are copied from the mapping, into any iovecs
+  struct iovec riov[2] = {{buf.data(), 100}, {buf.data() + 100, 8000}};
+  EXPECT_EQ(8100, store->preadv(riov, 2, kRefillUnit + 1000));
+  EXPECT_EQ(0, memcmp(data.data() + 1000, buf.data(), 8100));
+
+  // while a read reaching a hole, or punched out, goes to the file
+  struct iovec hole{buf.data(), 8192};
+  EXPECT_EQ(8192, store->preadv(&hole, 1, kRefillUnit - 4096));
+  EXPECT_EQ(0, memcmp(data.data(), buf.data() + 4096, 4096));
+  EXPECT_EQ(0, store->evict(kRefillUnit, 4096));
+  EXPECT_EQ(8192, store->preadv(&hole, 1, kRefillUnit));
+  EXPECT_EQ(std::vector<char>(4096, 0), std::vector<char>(buf.begin(), buf.begin() + 4096));
+  EXPECT_EQ(0, memcmp(data.data() + 4096, buf.data() + 4096, 4096));
+}
+
+TEST(CachePolicy, TwoQ) {
+  TwoQPolicy<int> policy(10 * 1000);
+  uint32_t keys[8];
+  for (int i = 0; i < 4; i++)
+    keys[i] = policy.insert(i);
+  photon::thread_usleep(20 * 1000);
+  // 0 and 1 are used again after the period, and promoted
+  policy.access(keys[1]);
+  policy.access(keys[0]);
+  // a scan of 4 more, each read many times at once
+  for (int i = 4; i < 8; i++) {
+    keys[i] = policy.insert(i);
+    for (int j = 0; j < 10; j++)
+      policy.access(keys[i]);
+  }
+  // the ones read once go first, in FIFO order, until within their share
+  for (int i : {2, 3, 4, 5, 6}) {
+    EXPECT_EQ(i, policy.victim());
+    policy.remove(keys[i]);
+  }
+  EXPECT_EQ(1, policy.victim());
+  policy.remove(keys[7]);
+  policy.access(keys[1]);
+  EXPECT_EQ(0, policy.victim());
+  policy.mark_key_cleared(keys[0]);
+  EXPECT_EQ(1, policy.victim());
+  policy.remove(keys[1]);
+  EXPECT_TRUE(policy.empty());
+}
+
+TEST(CachePolicy, Clock) {
+  ClockRing clock;
+  for (uint32_t i = 0; i < 6; i++)
+    clock.insert(i * 1000);
+  EXPECT_EQ(6UL, clock.size());
+  // the referenced ones are passed over once, in the order of insertion
+  uint32_t hits[] = {0, 2000, 3000};
+  clock.touch(hits, hits + 3);
+  EXPECT_EQ(1000U, clock.victim());
+  clock.remove(1000);
+  EXPECT_EQ(4000U, clock.victim());
+  clock.remove(4000);
+  clock.touch(5000);
+  EXPECT_EQ(0U, clock.victim());
+  clock.remove(0);
+  // inserted behind the hand, so visited last
+  clock.insert(1000);
+  EXPECT_EQ(2000U, clock.victim());
+  clock.remove(2000);
+  EXPECT_EQ(3000U, clock.victim());
+  clock.remove(3000);
+  EXPECT_EQ(5000U, clock.victim());
+  clock.remove(5000);
+  EXPECT_EQ(1000U, clock.victim());
+  clock.remove(1000);
+  EXPECT_FALSE(clock.contains(1000));
+  EXPECT_TRUE(clock.empty());
+}
+
+TEST(CachePolicy, CountMinSketch) {
+  CountMinSketch sketch(1024);
+  for (uint64_t k = 0; k < 100; k++)
+    EXPECT_EQ(1, sketch.increment(k));
+  for (int i = 0; i < 20; i++)
+    sketch.increment(7);
+  EXPECT_EQ(15, sketch.estimate(7));
+  EXPECT_EQ(1, sketch.estimate(8));
+  // aged by halving after 10 * width samples
+  for (uint64_t k = 1000; k < 1000 + 10 * 1024; k++)
+    sketch.increment(k);
+  EXPECT_GE(15 / 2, sketch.estimate(7));
+  EXPECT_LE(3, sketch.estimate(7));
+}
+
 }  //  namespace Cache
 
 int main(int argc, char** argv) {
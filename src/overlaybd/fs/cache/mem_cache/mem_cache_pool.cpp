@@ -0,0 +1,299 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "mem_cache_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include "../../../alog.h"
+#include "../../../iovector.h"
+#include "../../../utility.h"
+#include "../cache.h"
+
+namespace Cache {
+
+const uint64_t kMemBlockAlignment = 4096;
+const size_t kMaxHitCounts = 64 * 1024; // per store
+const size_t kTouchBatch = 64;
+
+MemCachePool::MemCachePool(ICachePool *lower, uint64_t capacity, uint64_t blockSize,
+                           uint32_t promoteHits)
+    : lower_(lower), blockSize_(blockSize), maxBlocks_(capacity / blockSize),
+      promoteHits_(std::max(promoteHits, 1U)) {
+    maxBlocks_ = std::min(maxBlocks_, (uint64_t)ClockRing::LIMIT - 1);
+}
+
+MemCachePool::~MemCachePool() {
+    for (auto data : freeData_)
+        free(data);
+    delete lower_;
+}
+
+ICacheStore *MemCachePool::do_open(std::string_view pathname, int flags, mode_t mode) {
+    auto lower = lower_->open(pathname, flags, mode);
+    if (!lower)
+        return nullptr;
+    return new MemCacheStore(this, lower);
+}
+
+int MemCachePool::stat(CacheStat *stat, std::string_view pathname) {
+    return lower_->stat(stat, pathname);
+}
+
+int MemCachePool::evict(std::string_view filename) {
+    return lower_->evict(filename);
+}
+
+int MemCachePool::evict(size_t size) {
+    return lower_->evict(size);
+}
+
+MemCachePool::Block *MemCachePool::allocBlock(MemCacheStore *store, uint64_t index) {
+    if (maxBlocks_ == 0)
+        return nullptr;
+    if (Memory::shedding()) {
+        shed();
+        return nullptr;
+    }
+    while (nBlocks_ >= maxBlocks_ && !clock_.empty())
+        evictOne();
+    if (nBlocks_ >= maxBlocks_) // all are being filled
+        return nullptr;
+
+    char *data = nullptr;
+    if (!freeData_.empty()) {
+        data = freeData_.back();
+        freeData_.pop_back();
+    } else if (posix_memalign((void **)&data, kMemBlockAlignment, blockSize_) != 0) {
+        LOG_ERROR_RETURN(ENOMEM, nullptr, "failed to allocate memory cache block, size : `",
+                         blockSize_);
+    } else {
+        account_.add(blockSize_);
+    }
+    nBlocks_++;
+    uint32_t slot;
+    if (!freeSlots_.empty()) {
+        slot = freeSlots_.back();
+        freeSlots_.pop_back();
+    } else {
+        slot = slots_.size();
+        slots_.push_back(nullptr);
+    }
+    return slots_[slot] = new Block{store, index, 0, slot, data};
+}
+
+void MemCachePool::insertBlock(Block *block) {
+    clock_.insert(block->slot);
+}
+
+void MemCachePool::evictOne() {
+    auto victim = slots_[clock_.victim()];
+    victim->store->dropBlock(victim->index);
+    freeBlock(victim);
+}
+
+// frees the buffers of freed blocks, and that of the next victim
+void MemCachePool::shed() {
+    if (!clock_.empty())
+        evictOne();
+    for (auto data : freeData_)
+        free(data);
+    account_.sub(freeData_.size() * blockSize_);
+    freeData_.clear();
+}
+
+void MemCachePool::freeBlock(Block *block) {
+    if (clock_.contains(block->slot))
+        clock_.remove(block->slot);
+    slots_[block->slot] = nullptr;
+    freeSlots_.push_back(block->slot);
+    freeData_.push_back(block->data);
+    nBlocks_--;
+    delete block;
+}
+
+MemCacheStore::MemCacheStore(MemCachePool *pool, ICacheStore *lower)
+    : memPool_(pool), lower_(lower) {
+}
+
+MemCacheStore::~MemCacheStore() {
+    for (auto &it : blocks_)
+        memPool_->freeBlock(it.second);
+    lower_->release();
+}
+
+bool MemCacheStore::inMem(off_t offset, size_t count) {
+    auto bs = memPool_->blockSize();
+    uint64_t end = offset + count;
+    if (count == 0)
+        return false;
+    for (uint64_t i = offset / bs; i <= (end - 1) / bs; i++) {
+        auto it = blocks_.find(i);
+        if (it == blocks_.end() || i * bs + it->second->length < std::min(end, (i + 1) * bs))
+            return false;
+    }
+    return true;
+}
+
+void MemCacheStore::readMem(const struct iovec *iov, int iovcnt, off_t offset) {
+    auto bs = memPool_->blockSize();
+    // the blocks are touched once each, in batches
+    uint32_t touched[kTouchBatch];
+    size_t nTouched = 0;
+    MemCachePool::Block *block = nullptr;
+    for (int i = 0; i < iovcnt; i++) {
+        auto buf = (char *)iov[i].iov_base;
+        auto len = iov[i].iov_len;
+        while (len > 0) {
+            auto skip = offset % bs;
+            if (!block || skip == 0) {
+                block = blocks_[offset / bs];
+                if (nTouched == kTouchBatch) {
+                    memPool_->accessBlocks(touched, nTouched);
+                    nTouched = 0;
+                }
+                touched[nTouched++] = block->slot;
+            }
+            auto n = std::min(len, bs - skip);
+            memcpy(buf, block->data + skip, n);
+            buf += n;
+            len -= n;
+            offset += n;
+        }
+    }
+    memPool_->accessBlocks(touched, nTouched);
+}
+
+ICacheStore::try_preadv_result MemCacheStore::try_preadv(const struct iovec *iov, int iovcnt,
+                                                        off_t offset) {
+    try_preadv_result rst;
+    rst.iov_sum = iovector_view((iovec *)iov, iovcnt).sum();
+    if (inMem(offset, rst.iov_sum)) {
+        readMem(iov, iovcnt, offset);
+        rst.refill_size = 0;
+        rst.size = rst.iov_sum;
+        return rst;
+    }
+    rst = lower_->try_preadv(iov, iovcnt, offset);
+    if (rst.refill_size == 0 && rst.size == (ssize_t)rst.iov_sum)
+        countHits(offset, rst.iov_sum);
+    return rst;
+}
+
+ssize_t MemCacheStore::preadv(const struct iovec *iov, int iovcnt, off_t offset) {
+    auto count = iovector_view((iovec *)iov, iovcnt).sum();
+    if (inMem(offset, count)) {
+        readMem(iov, iovcnt, offset);
+        return count;
+    }
+    return lower_->preadv(iov, iovcnt, offset);
+}
+
+ssize_t MemCacheStore::pwritev(const struct iovec *iov, int iovcnt, off_t offset) {
+    auto count = iovector_view((iovec *)iov, iovcnt).sum();
+    invalidate(offset, count);
+    return lower_->pwritev(iov, iovcnt, offset);
+}
+
+int MemCacheStore::evict(off_t offset, size_t count) {
+    invalidate(offset, count);
+    return lower_->evict(offset, count);
+}
+
+std::pair<off_t, size_t> MemCacheStore::queryRefillRange(off_t offset, size_t size) {
+    if (inMem(offset, size))
+        return std::make_pair(0, 0);
+    return lower_->queryRefillRange(offset, size);
+}
+
+// blocks hit in the lower pool `promoteHits` times are promoted into memory
+void MemCacheStore::countHits(off_t offset, size_t count) {
+    auto bs = memPool_->blockSize();
+    if (count == 0)
+        return;
+    // start over once too many blocks are counted
+    if (hits_.size() > kMaxHitCounts)
+        hits_.clear();
+    for (uint64_t i = offset / bs; i <= (offset + count - 1) / bs; i++) {
+        if (blocks_.find(i) != blocks_.end())
+            continue;
+        if (++hits_[i] >= memPool_->promoteHits()) {
+            hits_.erase(i);
+            promote(i);
+        }
+    }
+}
+
+int MemCacheStore::promote(uint64_t index) {
+    auto bs = memPool_->blockSize();
+    uint64_t offset = index * bs;
+    struct stat st = {};
+    if (lower_->fstat(&st) != 0 || (uint64_t)st.st_size <= offset)
+        return -1;
+    auto length = std::min(bs, st.st_size - offset);
+    // only blocks entirely cached in the lower pool
+    if (lower_->queryRefillRange(offset, length).second != 0)
+        return -1;
+    auto block = memPool_->allocBlock(this, index);
+    if (!block)
+        return -1;
+    auto ret = lower_->pread(block->data, length, offset);
+    if (ret != (ssize_t)length || blocks_.find(index) != blocks_.end()) {
+        memPool_->freeBlock(block);
+        return -1;
+    }
+    block->length = length;
+    blocks_[index] = block;
+    memPool_->insertBlock(block);
+    return 0;
+}
+
+void MemCacheStore::invalidate(off_t offset, size_t count) {
+    auto bs = memPool_->blockSize();
+    auto drop = [&](std::unordered_map<uint64_t, MemCachePool::Block *>::iterator it) {
+        memPool_->freeBlock(it->second);
+        return blocks_.erase(it);
+    };
+    if (static_cast<size_t>(-1) == count) { // truncated
+        for (auto it = blocks_.begin(); it != blocks_.end();) {
+            if ((it->first + 1) * bs > (uint64_t)offset)
+                it = drop(it);
+            else
+                ++it;
+        }
+        return;
+    }
+    if (count == 0 || blocks_.empty())
+        return;
+    for (uint64_t i = offset / bs; i <= (offset + count - 1) / bs; i++) {
+        auto it = blocks_.find(i);
+        if (it != blocks_.end())
+            drop(it);
+    }
+}
+
+} //  namespace Cache
+
+namespace FileSystem {
+ICachePool *new_mem_cache_pool(ICachePool *lower, uint64_t capacity, uint64_t blockSize,
+                               uint32_t promoteHits) {
+    if (!lower || blockSize == 0 || blockSize % 4096 != 0)
+        LOG_ERROR_RETURN(EINVAL, nullptr, "invalid lower pool or block size : `", blockSize);
+    return new ::Cache::MemCachePool(lower, capacity, blockSize, promoteHits);
+}
+} // namespace FileSystem
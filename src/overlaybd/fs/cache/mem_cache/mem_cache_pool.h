@@ -0,0 +1,138 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include "../../../memory.h"
+#include "../policy/clock.h"
+#include "../pool_store.h"
+
+namespace Cache {
+
+using namespace FileSystem;
+
+class MemCacheStore;
+
+// A DRAM tier stacked above another cache pool. Blocks that have been read
+// from the lower pool `promoteHits` times are copied into memory, within a
+// budget of `capacity` bytes evicted by CLOCK, and then served by memcpy alone.
+// Misses and writes go to the lower pool. Over the shedding mark of the node,
+// no block is promoted, and each promotion frees the next victim.
+class MemCachePool : public ICachePool {
+public:
+    MemCachePool(ICachePool *lower, uint64_t capacity, uint64_t blockSize, uint32_t promoteHits);
+    ~MemCachePool();
+
+    ICacheStore *do_open(std::string_view pathname, int flags, mode_t mode) override;
+
+    int stat(CacheStat *stat, std::string_view pathname = std::string_view(nullptr, 0)) override;
+
+    int evict(std::string_view filename) override;
+    int evict(size_t size = 0) override;
+    int set_capacity(uint64_t capacity) override {
+        return lower_->set_capacity(capacity);
+    }
+    int set_owner(std::string_view filename, std::string_view group, bool pinned) override {
+        return lower_->set_owner(cache_key(filename), group, pinned);
+    }
+    int set_quota(std::string_view group, uint64_t bytes) override {
+        return lower_->set_quota(group, bytes);
+    }
+
+    struct Block {
+        MemCacheStore *store;
+        uint64_t index;  // offset / blockSize
+        uint64_t length; // of valid data
+        uint32_t slot; // in the clock ring
+        char *data;
+    };
+
+    uint64_t blockSize() const {
+        return blockSize_;
+    }
+    uint32_t promoteHits() const {
+        return promoteHits_;
+    }
+
+    // get a block to fill, evicting by the clock if needed; it becomes
+    // evictable once inserted
+    Block *allocBlock(MemCacheStore *store, uint64_t index);
+    void insertBlock(Block *block);
+    // the blocks hit by one read, touched at once
+    void accessBlocks(const uint32_t *slots, size_t n) {
+        clock_.touch(slots, slots + n);
+    }
+    void freeBlock(Block *block);
+
+protected:
+    ICachePool *lower_; //  owned by current class
+    uint64_t blockSize_;
+    uint64_t maxBlocks_;
+    uint32_t promoteHits_;
+    uint64_t nBlocks_ = 0;
+    ClockRing clock_;
+    std::vector<Block *> slots_; // blocks by slot
+    std::vector<uint32_t> freeSlots_;
+    std::vector<char *> freeData_; // buffers of freed blocks, for reuse
+    Memory::Account account_{"dram_cache"};
+
+    void shed();
+    void evictOne();
+};
+
+class MemCacheStore : public ICacheStore {
+public:
+    MemCacheStore(MemCachePool *pool, ICacheStore *lower);
+    ~MemCacheStore();
+
+    try_preadv_result try_preadv(const struct iovec *iov, int iovcnt, off_t offset) override;
+
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override;
+
+    ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override;
+
+    int stat(CacheStat *stat) override {
+        return lower_->stat(stat);
+    }
+    int evict(off_t offset, size_t count = -1) override;
+
+    std::pair<off_t, size_t> queryRefillRange(off_t offset, size_t size) override;
+
+    int fstat(struct stat *buf) override {
+        return lower_->fstat(buf);
+    }
+
+    // called by the pool when evicting a block of the store
+    void dropBlock(uint64_t index) {
+        blocks_.erase(index);
+    }
+
+protected:
+    MemCachePool *memPool_; //  owned by extern class
+    ICacheStore *lower_;    //  released by current class
+    std::unordered_map<uint64_t, MemCachePool::Block *> blocks_;
+    std::unordered_map<uint64_t, uint32_t> hits_; // hits of blocks in the lower pool
+
+    bool inMem(off_t offset, size_t count);
+    void readMem(const struct iovec *iov, int iovcnt, off_t offset);
+    void countHits(off_t offset, size_t count);
+    int promote(uint64_t index);
+    void invalidate(off_t offset, size_t count);
+};
+
+} //  namespace Cache
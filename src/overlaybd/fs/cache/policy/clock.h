@@ -0,0 +1,127 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+#include <assert.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <vector>
+
+namespace FileSystem {
+// An intrusive CLOCK ring for eviction at fine granularity, e.g. of cache
+// blocks, where millions of entries are tracked. Entries are the keys of
+// the caller, dense indexes into its own arrays, linked by 32-bit indexes in
+// a contiguous array, with a reference bit each: 8 bytes and 1 bit an entry,
+// about 80MB for 10M of them. A hit only sets the bit, without moving links
+// or allocating, and the hand gives the referenced entries a second chance
+// as it passes them, which approximates LRU.
+class ClockRing {
+public:
+    using key_type = uint32_t;
+    const static key_type kNil = UINT32_MAX;
+    // maximum # of entries, keys are below it
+    const static size_t LIMIT = kNil;
+
+    // make room for keys below `n` up front
+    void reserve(size_t n) {
+        assert(n <= LIMIT);
+        if (n > m_links.size())
+            grow(n);
+    }
+    // insert `i`, unreferenced, as the last entry the hand comes to
+    void insert(key_type i) {
+        if (i >= m_links.size())
+            grow(i + 1);
+        assert(!contains(i));
+        if (m_hand == kNil) {
+            m_links[i] = {i, i};
+            m_hand = i;
+        } else {
+            auto prev = m_links[m_hand].prev;
+            m_links[i] = {prev, m_hand};
+            m_links[prev].next = m_links[m_hand].prev = i;
+        }
+        clear_ref(i);
+        m_size++;
+    }
+    void remove(key_type i) {
+        assert(contains(i));
+        auto &l = m_links[i];
+        if (m_size == 1) {
+            m_hand = kNil;
+        } else {
+            if (i == m_hand)
+                m_hand = l.next;
+            m_links[l.prev].next = l.next;
+            m_links[l.next].prev = l.prev;
+        }
+        l.prev = l.next = kNil;
+        m_size--;
+    }
+    bool contains(key_type i) const {
+        return i < m_links.size() && m_links[i].next != kNil;
+    }
+    void touch(key_type i) {
+        assert(contains(i));
+        m_refs[i / 64] |= 1ULL << (i % 64);
+    }
+    // touch the keys hit by one I/O at once
+    template <typename Iter>
+    void touch(Iter first, Iter last) {
+        for (; first != last; ++first)
+            touch(*first);
+    }
+    // the next entry to evict, if not empty(): the hand clears the reference
+    // bits of the entries it passes, so it stops within one round
+    key_type victim() {
+        assert(m_size > 0);
+        while (test_and_clear_ref(m_hand))
+            m_hand = m_links[m_hand].next;
+        return m_hand;
+    }
+    size_t size() const {
+        return m_size;
+    }
+    bool empty() const {
+        return m_size == 0;
+    }
+
+protected:
+    struct Link {
+        key_type prev, next;
+    };
+    std::vector<Link> m_links;     // {kNil, kNil} for keys not in the ring
+    std::vector<uint64_t> m_refs;  // the reference bits
+    key_type m_hand = kNil;
+    size_t m_size = 0;
+
+    void grow(size_t n) {
+        m_links.resize(n, Link{kNil, kNil});
+        m_refs.resize((n + 63) / 64, 0);
+    }
+    void clear_ref(key_type i) {
+        m_refs[i / 64] &= ~(1ULL << (i % 64));
+    }
+    bool test_and_clear_ref(key_type i) {
+        auto &w = m_refs[i / 64];
+        auto bit = 1ULL << (i % 64);
+        if (!(w & bit))
+            return false;
+        w &= ~bit;
+        return true;
+    }
+};
+} // namespace FileSystem
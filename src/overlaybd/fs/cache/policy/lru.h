@@ -85,6 +85,10 @@ public:
         assert(m_size > 0);
         remove(PTR(PTR(m_head)->prev)->prev);
     }
+    value_type &get(key_type i) {
+        assert(i < m_array.size());
+        return PTR(i)->val;
+    }
     value_type &front() {
         assert(m_size > 0);
         return PTR(m_head)->val;
@@ -96,6 +100,15 @@ public:
     size_t size() {
         return m_size;
     }
+    // visit the values from the least recently used one, except cleared ones
+    template <typename F>
+    void for_each(F &&f) {
+        if (empty())
+            return;
+        auto dummy = PTR(m_head)->prev;
+        for (auto i = PTR(dummy)->prev; i != dummy; i = PTR(i)->prev)
+            f(PTR(i)->val);
+    }
     bool empty() {
         return m_head == PTR(m_head)->prev;
     }
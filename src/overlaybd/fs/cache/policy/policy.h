@@ -0,0 +1,177 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+#include <inttypes.h>
+#include <algorithm>
+#include <vector>
+#include "../../../callback.h"
+#include "../../../photon/thread.h"
+#include "lru.h"
+
+namespace FileSystem {
+// An eviction policy orders cached entries for eviction. Entries are
+// referred to by the keys returned by insert(), which remain valid until
+// remove()d.
+template <typename ValueType>
+class ICachePolicy {
+public:
+    using value_type = ValueType;
+    using key_type = uint32_t;
+
+    virtual ~ICachePolicy() {
+    }
+    virtual key_type insert(value_type v) = 0;
+    virtual value_type &get(key_type i) = 0;
+    virtual void access(key_type i) = 0;
+    // take `i` out of the candidates for eviction, until it is access()ed again
+    virtual void mark_key_cleared(key_type i) = 0;
+    virtual void remove(key_type i) = 0;
+    // the next entry to evict, if not empty()
+    virtual value_type &victim() = 0;
+    virtual bool empty() = 0;
+    // visit the entries in the order of eviction, except cleared ones
+    using Visitor = Delegate<void, value_type &>;
+    virtual void for_each(Visitor visit) = 0;
+};
+
+// least recently used first
+template <typename ValueType>
+class LRUPolicy : public ICachePolicy<ValueType> {
+public:
+    using typename ICachePolicy<ValueType>::key_type;
+
+    key_type insert(ValueType v) override {
+        return m_lru.push_front(v);
+    }
+    ValueType &get(key_type i) override {
+        return m_lru.get(i);
+    }
+    void access(key_type i) override {
+        m_lru.access(i);
+    }
+    void mark_key_cleared(key_type i) override {
+        m_lru.mark_key_cleared(i);
+    }
+    void remove(key_type i) override {
+        m_lru.remove(i);
+    }
+    ValueType &victim() override {
+        return m_lru.back();
+    }
+    bool empty() override {
+        return m_lru.empty();
+    }
+    void for_each(typename ICachePolicy<ValueType>::Visitor visit) override {
+        m_lru.for_each([&](ValueType &v) { visit(v); });
+    }
+
+protected:
+    LRU<ValueType, key_type> m_lru;
+};
+
+// 2Q: entries start in a FIFO probation queue, and are promoted to an LRU
+// main queue only when accessed again more than `period` us after insertion,
+// so that a burst of accesses, e.g. a one-pass scan, counts as one. The
+// probation queue is evicted first while it holds more than `in_percent`% of
+// the entries, so that scanned entries go before the ones in repeated use.
+template <typename ValueType>
+class TwoQPolicy : public ICachePolicy<ValueType> {
+public:
+    using typename ICachePolicy<ValueType>::key_type;
+
+    TwoQPolicy(uint64_t period, uint32_t in_percent = 25)
+        : m_period(period), m_in_percent(in_percent) {
+    }
+
+    key_type insert(ValueType v) override {
+        key_type i;
+        if (m_free.empty()) {
+            i = m_slots.size();
+            m_slots.emplace_back();
+        } else {
+            i = m_free.back();
+            m_free.pop_back();
+        }
+        auto &s = m_slots[i];
+        s.val = v;
+        s.main = false;
+        s.cleared = false;
+        s.inserted = photon::now;
+        s.key = m_in.push_front(i);
+        return i;
+    }
+    ValueType &get(key_type i) override {
+        return m_slots[i].val;
+    }
+    void access(key_type i) override {
+        auto &s = m_slots[i];
+        if (s.main) {
+            m_main.access(s.key);
+        } else if (photon::now - s.inserted > m_period) {
+            m_in.remove(s.key);
+            s.key = m_main.push_front(i);
+            s.main = true;
+        } else if (s.cleared) {
+            m_in.access(s.key);
+        }
+        s.cleared = false;
+    }
+    void mark_key_cleared(key_type i) override {
+        auto &s = m_slots[i];
+        queue(s).mark_key_cleared(s.key);
+        s.cleared = true;
+    }
+    void remove(key_type i) override {
+        auto &s = m_slots[i];
+        queue(s).remove(s.key);
+        s.val = ValueType();
+        m_free.push_back(i);
+    }
+    ValueType &victim() override {
+        auto limit = std::max((m_in.size() + m_main.size()) * m_in_percent / 100, (size_t)1);
+        if (!m_in.empty() && (m_in.size() > limit || m_main.empty()))
+            return m_slots[m_in.back()].val;
+        return m_slots[m_main.back()].val;
+    }
+    bool empty() override {
+        return m_in.empty() && m_main.empty();
+    }
+    // probation first, though victim() may interleave the two queues
+    void for_each(typename ICachePolicy<ValueType>::Visitor visit) override {
+        m_in.for_each([&](key_type i) { visit(m_slots[i].val); });
+        m_main.for_each([&](key_type i) { visit(m_slots[i].val); });
+    }
+
+protected:
+    struct Slot {
+        ValueType val;
+        key_type key; // in the queue below
+        bool main;
+        bool cleared;
+        uint64_t inserted;
+    };
+    std::vector<Slot> m_slots;
+    std::vector<key_type> m_free;
+    LRU<key_type, key_type> m_in, m_main;
+    uint64_t m_period;
+    uint32_t m_in_percent;
+
+    LRU<key_type, key_type> &queue(const Slot &s) {
+        return s.main ? m_main : m_in;
+    }
+};
+} // namespace FileSystem
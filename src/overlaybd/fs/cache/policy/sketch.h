@@ -0,0 +1,94 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+#include <inttypes.h>
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+
+namespace FileSystem {
+// A count-min sketch of 4-bit counters, estimating how many times a key has
+// been seen, in the manner of TinyLFU: counters saturate at 15, and are all
+// halved after `10 * width` samples, so that old popularity fades out.
+// `width` is rounded up to a power of 2.
+class CountMinSketch {
+public:
+    static const int kDepth = 4;
+    static const uint8_t kMaxCount = 15;
+
+    explicit CountMinSketch(size_t width) {
+        m_width = 64;
+        while (m_width < width)
+            m_width <<= 1;
+        m_table.resize(m_width * kDepth / 2);
+        m_reset_at = m_width * 10;
+    }
+
+    // count `key` once, returning its estimated count including this time
+    uint8_t increment(uint64_t key) {
+        uint8_t est = kMaxCount;
+        for (int i = 0; i < kDepth; i++)
+            est = std::min(est, counter(i, key));
+        if (est < kMaxCount) {
+            // conservative update, only the minimal counters are increased
+            for (int i = 0; i < kDepth; i++) {
+                if (counter(i, key) == est)
+                    set_counter(i, key, est + 1);
+            }
+            est++;
+        }
+        if (++m_samples >= m_reset_at)
+            reset();
+        return est;
+    }
+
+    uint8_t estimate(uint64_t key) const {
+        uint8_t est = kMaxCount;
+        for (int i = 0; i < kDepth; i++)
+            est = std::min(est, counter(i, key));
+        return est;
+    }
+
+protected:
+    std::vector<uint8_t> m_table; // 2 counters a byte, kDepth rows of m_width
+    size_t m_width;
+    size_t m_samples = 0;
+    size_t m_reset_at;
+
+    size_t index(int row, uint64_t key) const {
+        static const uint64_t kSeeds[kDepth] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+                                                0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL};
+        auto h = (key + row) * kSeeds[row];
+        h ^= h >> 29;
+        return row * m_width + (h & (m_width - 1));
+    }
+    uint8_t counter(int row, uint64_t key) const {
+        auto i = index(row, key);
+        return (m_table[i / 2] >> (i % 2 * 4)) & 0xF;
+    }
+    void set_counter(int row, uint64_t key, uint8_t val) {
+        auto i = index(row, key);
+        auto &b = m_table[i / 2];
+        b = (b & ~(0xF << (i % 2 * 4))) | (val << (i % 2 * 4));
+    }
+    void reset() {
+        for (auto &b : m_table)
+            b = (b >> 1) & 0x77;
+        m_samples /= 2;
+    }
+};
+} // namespace FileSystem
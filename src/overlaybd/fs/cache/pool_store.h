@@ -15,10 +15,12 @@
 */
 #pragma once
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <string>
 #include "../../string_view.h"
 #include "../../string-keyed.h"
 #include "../../object.h"
@@ -48,14 +50,48 @@ public:
     // available space meet other requirements as well
     virtual int evict(size_t size = 0) = 0;
 
+    // change the capacity of the (lowest) tier of the pool to `capacity`
+    // bytes at runtime, evicting in background if it's over
+    // return 0 for success, -1 with ENOTSUP if not supported
+    virtual int set_capacity(uint64_t capacity) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // charge the cache of `filename` to `group`, e.g. a tenant or an image,
+    // whose bytes over its quota are the first to evict, so that a group may
+    // borrow space only until the pool is full; a file keeps the first group
+    // it's charged to, and with `pinned`, e.g. a base layer, it's evicted
+    // only after all the others; return -1 with ENOTSUP if not supported
+    virtual int set_owner(std::string_view filename, std::string_view group, bool pinned) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // the quota of `group` in bytes, 0 for none
+    virtual int set_quota(std::string_view group, uint64_t bytes) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
     int store_release(ICacheStore *store);
 
     virtual ICacheStore *do_open(std::string_view filename, int flags, mode_t mode) = 0;
 
     ICacheStore *find_store_map(std::string_view pathname);
 
+    // the name that `filename` is cached by, which is itself unless keyed by
+    // digest, where a file named after a layer digest ("sha256:<hex>") is
+    // cached as "/blobs/sha256:<hex>", shared by all repos and mirrors
+    std::string cache_key(std::string_view filename) const;
+
+    void set_key_by_digest(bool enable) {
+        m_key_by_digest = enable;
+    }
+
 protected:
     unordered_map_string_key<ICacheStore *> m_stores;
+    bool m_key_by_digest = false;
 };
 
 class ICacheStore : public Object {
@@ -0,0 +1,222 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "tiered_cache_pool.h"
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include "../../../alog.h"
+#include "../../../iovector.h"
+#include "../../../utility.h"
+#include "../cache.h"
+
+namespace Cache {
+
+const uint64_t kTieredBlockAlignment = 4096;
+const size_t kMaxHitCounts = 64 * 1024; // per store
+
+TieredCachePool::TieredCachePool(ICachePool *fast, ICachePool *slow, uint64_t blockSize,
+                                 uint32_t promoteHits)
+    : fast_(fast), slow_(slow), blockSize_(blockSize), promoteHits_(std::max(promoteHits, 1U)) {
+}
+
+TieredCachePool::~TieredCachePool() {
+    delete fast_;
+    delete slow_;
+}
+
+ICacheStore *TieredCachePool::do_open(std::string_view pathname, int flags, mode_t mode) {
+    auto slow = slow_->open(pathname, flags, mode);
+    if (!slow)
+        return nullptr;
+    auto fast = fast_->open(pathname, flags, mode);
+    if (!fast) {
+        slow->release();
+        return nullptr;
+    }
+    return new TieredCacheStore(this, fast, slow);
+}
+
+int TieredCachePool::stat(CacheStat *stat, std::string_view pathname) {
+    return slow_->stat(stat, pathname);
+}
+
+int TieredCachePool::evict(std::string_view filename) {
+    auto ret = fast_->evict(filename);
+    return slow_->evict(filename) | ret;
+}
+
+int TieredCachePool::evict(size_t size) {
+    auto ret = fast_->evict(size);
+    return slow_->evict(size) | ret;
+}
+
+TieredCacheStore::TieredCacheStore(TieredCachePool *pool, ICacheStore *fast, ICacheStore *slow)
+    : tieredPool_(pool), fast_(fast), slow_(slow) {
+}
+
+TieredCacheStore::~TieredCacheStore() {
+    fast_->release();
+    slow_->release();
+}
+
+bool TieredCacheStore::covered(off_t offset, size_t count) {
+    auto bs = tieredPool_->blockSize();
+    uint64_t end = offset + count;
+    for (uint64_t pos = offset; pos < end;) {
+        auto n = std::min(end, (pos / bs + 1) * bs) - pos;
+        if (!cached(fast_, pos, n) && !cached(slow_, pos, n))
+            return false;
+        pos += n;
+    }
+    return true;
+}
+
+ssize_t TieredCacheStore::readBlocks(const struct iovec *iov, int iovcnt, off_t offset,
+                                     size_t count) {
+    auto bs = tieredPool_->blockSize();
+    std::vector<struct iovec> piece;
+    int idx = 0;
+    size_t skip = 0; // bytes consumed in iov[idx]
+    ssize_t done = 0;
+    while ((size_t)done < count) {
+        uint64_t pos = offset + done;
+        auto n = std::min(count - done, (pos / bs + 1) * bs - pos);
+        piece.clear();
+        for (size_t left = n; left > 0 && idx < iovcnt;) {
+            auto len = std::min(left, iov[idx].iov_len - skip);
+            piece.push_back({(char *)iov[idx].iov_base + skip, len});
+            left -= len;
+            skip += len;
+            if (skip == iov[idx].iov_len) {
+                idx++;
+                skip = 0;
+            }
+        }
+        bool inFast = cached(fast_, pos, n);
+        auto store = inFast ? fast_ : slow_;
+        auto ret = store->preadv(piece.data(), piece.size(), pos);
+        if (ret < 0)
+            return ret;
+        if (!inFast)
+            countHits(pos / bs);
+        done += ret;
+        if ((size_t)ret < n)
+            break;
+    }
+    return done;
+}
+
+ICacheStore::try_preadv_result TieredCacheStore::try_preadv(const struct iovec *iov, int iovcnt,
+                                                           off_t offset) {
+    try_preadv_result rst;
+    rst.iov_sum = iovector_view((iovec *)iov, iovcnt).sum();
+    if (cached(fast_, offset, rst.iov_sum)) {
+        rst.refill_size = 0;
+        rst.size = fast_->preadv(iov, iovcnt, offset);
+        return rst;
+    }
+    auto q = queryRefillRange(offset, rst.iov_sum);
+    if (q.second != 0) {
+        rst.refill_size = q.second;
+        rst.refill_offset = q.first;
+        return rst;
+    }
+    rst.refill_size = 0;
+    rst.size = readBlocks(iov, iovcnt, offset, rst.iov_sum);
+    return rst;
+}
+
+ssize_t TieredCacheStore::preadv(const struct iovec *iov, int iovcnt, off_t offset) {
+    auto count = iovector_view((iovec *)iov, iovcnt).sum();
+    if (cached(fast_, offset, count))
+        return fast_->preadv(iov, iovcnt, offset);
+    return readBlocks(iov, iovcnt, offset, count);
+}
+
+// refills always land in the slow pool, the fast one only receives promoted
+// blocks; cached contents never change, so a copy in the fast pool stays valid
+ssize_t TieredCacheStore::pwritev(const struct iovec *iov, int iovcnt, off_t offset) {
+    return slow_->pwritev(iov, iovcnt, offset);
+}
+
+int TieredCacheStore::evict(off_t offset, size_t count) {
+    if (static_cast<size_t>(-1) == count)
+        hits_.clear();
+    auto ret = fast_->evict(offset, count);
+    return slow_->evict(offset, count) | ret;
+}
+
+std::pair<off_t, size_t> TieredCacheStore::queryRefillRange(off_t offset, size_t size) {
+    auto q = slow_->queryRefillRange(offset, size);
+    if (q.second == 0 || covered(offset, size))
+        return std::make_pair(0, 0);
+    return q;
+}
+
+int TieredCacheStore::fstat(struct stat *buf) {
+    struct stat st = {};
+    if (slow_->fstat(buf) != 0)
+        return -1;
+    if (fast_->fstat(&st) == 0)
+        buf->st_size = std::max(buf->st_size, st.st_size);
+    return 0;
+}
+
+// blocks hit in the slow pool `promoteHits` times are copied to the fast one
+void TieredCacheStore::countHits(uint64_t index) {
+    // start over once too many blocks are counted
+    if (hits_.size() > kMaxHitCounts)
+        hits_.clear();
+    if (++hits_[index] >= tieredPool_->promoteHits()) {
+        hits_.erase(index);
+        promote(index);
+    }
+}
+
+int TieredCacheStore::promote(uint64_t index) {
+    auto bs = tieredPool_->blockSize();
+    uint64_t offset = index * bs;
+    struct stat st = {};
+    if (slow_->fstat(&st) != 0 || (uint64_t)st.st_size <= offset)
+        return -1;
+    auto length = std::min(bs, st.st_size - offset);
+    // only blocks entirely cached in the slow pool
+    if (!cached(slow_, offset, length) || cached(fast_, offset, length))
+        return -1;
+    char *data = nullptr;
+    if (posix_memalign((void **)&data, kTieredBlockAlignment, bs) != 0)
+        LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate promoting buffer, size : `", bs);
+    DEFER(free(data));
+    auto ret = slow_->pread(data, length, offset);
+    if (ret != (ssize_t)length)
+        return -1;
+    // failing to promote, e.g. the fast device is full, is harmless
+    ret = fast_->pwrite(data, length, offset);
+    return ret == (ssize_t)length ? 0 : -1;
+}
+
+} //  namespace Cache
+
+namespace FileSystem {
+ICachePool *new_tiered_cache_pool(ICachePool *fast, ICachePool *slow, uint64_t blockSize,
+                                  uint32_t promoteHits) {
+    if (!fast || !slow || blockSize == 0 || blockSize % 4096 != 0)
+        LOG_ERROR_RETURN(EINVAL, nullptr, "invalid pools or block size : `", blockSize);
+    return new ::Cache::TieredCachePool(fast, slow, blockSize, promoteHits);
+}
+} // namespace FileSystem
@@ -0,0 +1,106 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include "../pool_store.h"
+
+namespace Cache {
+
+using namespace FileSystem;
+
+// A cache over two local devices. Every refill lands in the `slow` pool, the
+// larger one, and blocks that have been read from it `promoteHits` times are
+// copied into the `fast` pool, and served from there afterwards. Each pool
+// keeps its own capacity and eviction, so cold blocks are demoted simply by
+// being evicted from the fast device, while the slow one still holds them.
+class TieredCachePool : public ICachePool {
+public:
+    TieredCachePool(ICachePool *fast, ICachePool *slow, uint64_t blockSize, uint32_t promoteHits);
+    ~TieredCachePool();
+
+    ICacheStore *do_open(std::string_view pathname, int flags, mode_t mode) override;
+
+    int stat(CacheStat *stat, std::string_view pathname = std::string_view(nullptr, 0)) override;
+
+    int evict(std::string_view filename) override;
+    int evict(size_t size = 0) override;
+    int set_capacity(uint64_t capacity) override {
+        return slow_->set_capacity(capacity);
+    }
+    int set_owner(std::string_view filename, std::string_view group, bool pinned) override {
+        auto key = cache_key(filename);
+        fast_->set_owner(key, group, pinned);
+        return slow_->set_owner(key, group, pinned);
+    }
+    int set_quota(std::string_view group, uint64_t bytes) override {
+        return slow_->set_quota(group, bytes);
+    }
+
+    uint64_t blockSize() const {
+        return blockSize_;
+    }
+    uint32_t promoteHits() const {
+        return promoteHits_;
+    }
+
+protected:
+    ICachePool *fast_; //  owned by current class
+    ICachePool *slow_; //  owned by current class
+    uint64_t blockSize_;
+    uint32_t promoteHits_;
+};
+
+class TieredCacheStore : public ICacheStore {
+public:
+    TieredCacheStore(TieredCachePool *pool, ICacheStore *fast, ICacheStore *slow);
+    ~TieredCacheStore();
+
+    try_preadv_result try_preadv(const struct iovec *iov, int iovcnt, off_t offset) override;
+
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override;
+
+    ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override;
+
+    int stat(CacheStat *stat) override {
+        return slow_->stat(stat);
+    }
+    int evict(off_t offset, size_t count = -1) override;
+
+    std::pair<off_t, size_t> queryRefillRange(off_t offset, size_t size) override;
+
+    int fstat(struct stat *buf) override;
+
+protected:
+    TieredCachePool *tieredPool_; //  owned by extern class
+    ICacheStore *fast_;           //  released by current class
+    ICacheStore *slow_;           //  released by current class
+    std::unordered_map<uint64_t, uint32_t> hits_; // hits of blocks in the slow pool
+
+    static bool cached(ICacheStore *store, off_t offset, size_t count) {
+        return count == 0 || store->queryRefillRange(offset, count).second == 0;
+    }
+    // whether every block of the range is in either of the pools
+    bool covered(off_t offset, size_t count);
+    // read block by block, each from the pool holding it
+    ssize_t readBlocks(const struct iovec *iov, int iovcnt, off_t offset, size_t count);
+    void countHits(uint64_t index);
+    int promote(uint64_t index);
+};
+
+} //  namespace Cache
@@ -17,6 +17,7 @@
 #include <errno.h>
 #include <stdarg.h>
 #include "../stream.h"
+#include "../callback.h"
 
 #define UNIMPLEMENTED(func)  \
     virtual func             \
@@ -45,6 +46,11 @@ namespace FileSystem
 {
     const static size_t ALIGNMENT_4K = 4096;
 
+    // ioctl() of a file of a remote source, getting as a `size_t*` the size
+    // of reads that keeps its link busy, about a bandwidth-delay product;
+    // ENOSYS for files not knowing any
+    const static int IOCTL_FETCH_SIZE = 0x4653;
+
     struct fiemap;
     class IFileSystem;
     class IFile : public IStream {
@@ -90,6 +96,21 @@ namespace FileSystem
 
         UNIMPLEMENTED_POINTER(Object* get_underlay_object(int i = 0));
 
+        // fired once with what preadv() or pwritev() returns, and the errno
+        // it sets, for the asynchronous editions below
+        typedef Callback<ssize_t, int> AsyncDone;
+
+        // start preadv() or pwritev() without waiting for it, firing `done`
+        // once it's done; `iov` and its buffers must remain valid till then;
+        // return 0 if started, or -1 without firing `done`. By default, the
+        // I/O is run by a pooled photon thread of current vcpu, firing `done`
+        // there; leaf files that submit it natively, e.g. with libaio, fire
+        // it from the thread reaping the completions, so `done` must not block.
+        virtual int async_preadv(const struct iovec *iov, int iovcnt, off_t offset,
+                                 AsyncDone done);
+        virtual int async_pwritev(const struct iovec *iov, int iovcnt, off_t offset,
+                                  AsyncDone done);
+
         // De-allocate a range of space in the file.
         // Supported on at least the following filesystems:
         // *  XFS (since Linux 2.6.38)
@@ -0,0 +1,397 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "gzip_file.h"
+#include "../alog.h"
+#include "../fs/filesystem.h"
+#include "../fs/forwardfs.h"
+#include "../fs/localfs.h"
+#include "../photon/thread.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+namespace FileSystem {
+
+static const size_t GZ_WINDOW = 32 * 1024;
+static const size_t GZ_CHUNK = 64 * 1024;
+
+// a point to start inflating at, as the zran example of zlib does: `out` of
+// the data is decompressed from `in` of the file, with `bits` of the byte
+// before it left; -1 for the start of a gzip member, which needs no window
+struct GzPoint {
+    uint64_t out, in;
+    uint64_t window; // offset of the window in the windows saved
+    uint32_t wsize;
+    int32_t bits;
+};
+
+struct GzIndexHeader {
+    char magic[8] = "OBDGZI";
+    uint64_t gz_size = 0, raw_size = 0, span = 0, npoints = 0;
+};
+
+int is_gzip_file(IFile *file) {
+    unsigned char magic[2];
+    auto ret = file->pread(magic, sizeof(magic), 0);
+    if (ret < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to read gzip magic");
+    return ret == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+class GzipFile : public ForwardFile_Ownership {
+public:
+    GzipFile(IFile *file, bool ownership) : ForwardFile_Ownership(file, ownership) {
+        memset(&m_strm, 0, sizeof(m_strm));
+    }
+    void set_ownership(bool ownership) {
+        m_ownership = ownership;
+    }
+    ~GzipFile() {
+        if (m_strm_inited)
+            inflateEnd(&m_strm);
+        delete m_windows_file;
+    }
+
+    int load_index(const char *index_path) {
+        std::unique_ptr<IFile> findex(open_localfile_adaptor(index_path, O_RDONLY, 0644, 0));
+        if (!findex)
+            return -1;
+        GzIndexHeader h;
+        if (findex->pread(&h, sizeof(h), 0) != sizeof(h) ||
+            memcmp(h.magic, GzIndexHeader().magic, sizeof(h.magic)) != 0 || h.npoints == 0)
+            LOG_ERROR_RETURN(0, -1, "invalid gzip index `", index_path);
+        if (h.gz_size != m_gz_size)
+            LOG_ERROR_RETURN(0, -1, "gzip index ` is of ` bytes, not `", index_path, h.gz_size,
+                             m_gz_size);
+        m_points.resize(h.npoints);
+        ssize_t len = h.npoints * sizeof(GzPoint);
+        if (findex->pread(&m_points[0], len, sizeof(h)) != len)
+            LOG_ERRNO_RETURN(0, -1, "failed to read gzip index `", index_path);
+        m_raw_size = h.raw_size;
+        m_span = h.span;
+        m_windows_offset = sizeof(h) + len;
+        m_windows_file = findex.release();
+        LOG_DEBUG("gzip index loaded from `: ` points", index_path, h.npoints);
+        return 0;
+    }
+
+    // written aside and renamed, so that it's never seen partially written
+    void save_index(const char *index_path) {
+        GzIndexHeader h;
+        h.gz_size = m_gz_size;
+        h.raw_size = m_raw_size;
+        h.span = m_span;
+        h.npoints = m_points.size();
+        ssize_t len = h.npoints * sizeof(GzPoint);
+        auto tmp = std::string(index_path) + ".tmp";
+        std::unique_ptr<IFile> findex(
+            open_localfile_adaptor(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644, 0));
+        if (!findex || findex->pwrite(&h, sizeof(h), 0) != sizeof(h) ||
+            findex->pwrite(&m_points[0], len, sizeof(h)) != len ||
+            findex->pwrite(m_windows.data(), m_windows.size(), sizeof(h) + len) !=
+                (ssize_t)m_windows.size() ||
+            ::rename(tmp.c_str(), index_path) != 0) {
+            LOG_WARN("failed to save gzip index in `: `(`)", index_path, errno, strerror(errno));
+            ::unlink(tmp.c_str());
+        }
+    }
+
+    void add_point(uint64_t out, uint64_t in, int bits) {
+        GzPoint p{out, in, m_windows.size(), 0, bits};
+        if (bits >= 0) {
+            uInt wsize = GZ_WINDOW;
+            m_windows.resize(p.window + wsize);
+            inflateGetDictionary(&m_strm, &m_windows[p.window], &wsize);
+            m_windows.resize(p.window + wsize);
+            p.wsize = wsize;
+        }
+        m_points.push_back(p);
+    }
+
+    // decompress the whole file once, taking a point at the end of the first
+    // deflate block past each `span` of data, and at the start of each member
+    int build_index() {
+        if (inflateInit2(&m_strm, 15 + 16) != Z_OK)
+            LOG_ERROR_RETURN(ENOMEM, -1, "inflateInit2 failed");
+        m_strm_inited = true;
+        std::unique_ptr<unsigned char[]> inbuf(new unsigned char[GZ_CHUNK]);
+        std::unique_ptr<unsigned char[]> outbuf(new unsigned char[GZ_WINDOW]);
+        uint64_t in = 0, out = 0;
+        add_point(0, 0, -1);
+        while (true) {
+            if (m_strm.avail_in == 0) {
+                auto n = m_file->pread(inbuf.get(), std::min(GZ_CHUNK, m_gz_size - in), in);
+                if (n <= 0)
+                    LOG_ERROR_RETURN(EIO, -1, "gzip data truncated at `", in);
+                m_strm.next_in = inbuf.get();
+                m_strm.avail_in = n;
+            }
+            auto avail_in = m_strm.avail_in;
+            m_strm.next_out = outbuf.get();
+            m_strm.avail_out = GZ_WINDOW;
+            int ret = inflate(&m_strm, Z_BLOCK);
+            in += avail_in - m_strm.avail_in;
+            out += GZ_WINDOW - m_strm.avail_out;
+            if (ret == Z_STREAM_END) {
+                // another member may follow, as concatenated gzip files
+                unsigned char magic[2];
+                if (in + 2 > m_gz_size || m_file->pread(magic, 2, in) != 2 ||
+                    magic[0] != 0x1f || magic[1] != 0x8b)
+                    break;
+                inflateReset(&m_strm);
+                add_point(out, in, -1);
+                continue;
+            }
+            if (ret != Z_OK && ret != Z_BUF_ERROR)
+                LOG_ERROR_RETURN(EIO, -1, "corrupted gzip data at `: `", in,
+                                 m_strm.msg ? m_strm.msg : "");
+            if ((m_strm.data_type & 128) && !(m_strm.data_type & 64) &&
+                out - m_points.back().out >= m_span)
+                add_point(out, in, m_strm.data_type & 7);
+        }
+        m_raw_size = out;
+        LOG_INFO("gzip index built: ` points for ` bytes of ` bytes", m_points.size(), out,
+                 m_gz_size);
+        return 0;
+    }
+
+    int init(const char *index_path, uint64_t span) {
+        struct stat st;
+        if (m_file->fstat(&st) != 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to stat gzip file");
+        m_gz_size = st.st_size;
+        m_span = span;
+        if (index_path && load_index(index_path) == 0)
+            return 0;
+        if (build_index() != 0)
+            return -1;
+        if (index_path)
+            save_index(index_path);
+        return 0;
+    }
+
+    int read_window(const GzPoint &p, unsigned char *buf) {
+        if (m_windows_file == nullptr) {
+            memcpy(buf, &m_windows[p.window], p.wsize);
+            return 0;
+        }
+        if (m_windows_file->pread(buf, p.wsize, m_windows_offset + p.window) != p.wsize)
+            LOG_ERRNO_RETURN(0, -1, "failed to read window of gzip point at `", p.out);
+        return 0;
+    }
+
+    // position the stream at point `p`
+    int restart(const GzPoint &p) {
+        m_pos = UINT64_MAX;
+        if (!m_strm_inited) {
+            if (inflateInit2(&m_strm, -15) != Z_OK)
+                LOG_ERROR_RETURN(ENOMEM, -1, "inflateInit2 failed");
+            m_strm_inited = true;
+        }
+        inflateReset2(&m_strm, p.bits < 0 ? 15 + 16 : -15);
+        m_strm.avail_in = 0;
+        m_in = p.in;
+        if (p.bits > 0) {
+            unsigned char c;
+            if (m_file->pread(&c, 1, p.in - 1) != 1)
+                LOG_ERRNO_RETURN(0, -1, "failed to read gzip data at `", p.in - 1);
+            inflatePrime(&m_strm, p.bits, c >> (8 - p.bits));
+        }
+        if (p.bits >= 0 && p.wsize) {
+            unsigned char window[GZ_WINDOW];
+            if (read_window(p, window) != 0)
+                return -1;
+            inflateSetDictionary(&m_strm, window, p.wsize);
+        }
+        m_pos = p.out;
+        return 0;
+    }
+
+    // the point to start at for reading `offset`
+    const GzPoint &point_of(uint64_t offset) {
+        auto it = std::upper_bound(m_points.begin(), m_points.end(), offset,
+                                   [](uint64_t x, const GzPoint &p) { return x < p.out; });
+        return *(it - 1);
+    }
+
+    // the member starting at `out`, which the stream has reached the end of
+    const GzPoint *next_member(uint64_t out) {
+        auto it = std::lower_bound(m_points.begin(), m_points.end(), out,
+                                   [](const GzPoint &p, uint64_t x) { return p.out < x; });
+        for (; it != m_points.end() && it->out == out; ++it)
+            if (it->bits < 0)
+                return &*it;
+        return nullptr;
+    }
+
+    // decompress `count` bytes at the position of the stream into `buf`,
+    // or discard them with `buf` nullptr
+    ssize_t inflate_to(unsigned char *buf, size_t count) {
+        unsigned char discard[GZ_WINDOW];
+        size_t done = 0;
+        while (done < count) {
+            if (m_strm.avail_in == 0) {
+                auto n = m_file->pread(m_inbuf.get(), std::min(GZ_CHUNK, m_gz_size - m_in), m_in);
+                if (n <= 0) {
+                    m_pos = UINT64_MAX;
+                    LOG_ERROR_RETURN(EIO, -1, "gzip data truncated at `", m_in);
+                }
+                m_in += n;
+                m_strm.next_in = m_inbuf.get();
+                m_strm.avail_in = n;
+            }
+            size_t n = count - done;
+            if (buf) {
+                m_strm.next_out = buf + done;
+            } else {
+                m_strm.next_out = discard;
+                n = std::min(n, sizeof(discard));
+            }
+            m_strm.avail_out = n;
+            int ret = inflate(&m_strm, Z_NO_FLUSH);
+            n -= m_strm.avail_out;
+            done += n;
+            m_pos += n;
+            if (ret == Z_STREAM_END) {
+                auto p = next_member(m_pos);
+                if (p == nullptr)
+                    break;
+                if (restart(*p) != 0)
+                    return -1;
+                continue;
+            }
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                m_pos = UINT64_MAX;
+                LOG_ERROR_RETURN(EIO, -1, "corrupted gzip data before `: `", m_in,
+                                 m_strm.msg ? m_strm.msg : "");
+            }
+        }
+        return done;
+    }
+
+    virtual ssize_t pread(void *buf, size_t count, off_t offset) override {
+        if (offset < 0)
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid offset `", offset);
+        if ((uint64_t)offset >= m_raw_size)
+            return 0;
+        count = std::min(count, (size_t)(m_raw_size - offset));
+        photon::scoped_lock lock(m_mutex);
+        // go on with the stream if it's past the nearest point before
+        // `offset`, e.g. for sequential reads; otherwise start over there
+        uint64_t off = offset;
+        auto &p = point_of(off);
+        if (m_pos > off || m_pos < p.out) {
+            if (restart(p) != 0)
+                return -1;
+        }
+        ssize_t skip = off - m_pos;
+        if (skip > 0 && inflate_to(nullptr, skip) != skip)
+            LOG_ERROR_RETURN(EIO, -1, "gzip data ended before `", off);
+        return inflate_to((unsigned char *)buf, count);
+    }
+
+    virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        // a read without buffer is a prefetch of the data, ignored
+        if (iovcnt == 1 && iov->iov_base == nullptr)
+            return iov->iov_len;
+        ssize_t done = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            auto ret = pread(iov[i].iov_base, iov[i].iov_len, offset + done);
+            if (ret < 0)
+                return ret;
+            done += ret;
+            if ((size_t)ret < iov[i].iov_len)
+                break;
+        }
+        return done;
+    }
+
+    virtual ssize_t read(void *buf, size_t count) override {
+        auto ret = pread(buf, count, m_offset);
+        if (ret > 0)
+            m_offset += ret;
+        return ret;
+    }
+
+    virtual ssize_t readv(const struct iovec *iov, int iovcnt) override {
+        auto ret = preadv(iov, iovcnt, m_offset);
+        if (ret > 0)
+            m_offset += ret;
+        return ret;
+    }
+
+    virtual off_t lseek(off_t offset, int whence) override {
+        switch (whence) {
+        case SEEK_SET:
+            break;
+        case SEEK_CUR:
+            offset += m_offset;
+            break;
+        case SEEK_END:
+            offset += m_raw_size;
+            break;
+        default:
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid whence `", whence);
+        }
+        if (offset < 0)
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid offset `", offset);
+        return m_offset = offset;
+    }
+
+    virtual int fstat(struct stat *buf) override {
+        int ret = m_file->fstat(buf);
+        if (ret == 0)
+            buf->st_size = m_raw_size;
+        return ret;
+    }
+
+    UNIMPLEMENTED(ssize_t write(const void *buf, size_t count) override);
+    UNIMPLEMENTED(ssize_t writev(const struct iovec *iov, int iovcnt) override);
+    UNIMPLEMENTED(ssize_t pwrite(const void *buf, size_t count, off_t offset) override);
+    UNIMPLEMENTED(ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override);
+
+private:
+    uint64_t m_gz_size = 0, m_raw_size = 0, m_span = 0;
+    std::vector<GzPoint> m_points;
+    std::vector<unsigned char> m_windows; // windows of the points, if built
+    IFile *m_windows_file = nullptr;      // or the index loaded, to read them
+    uint64_t m_windows_offset = 0;
+
+    // the stream, at `m_pos` of the data, consumed `m_in` of the file
+    photon::mutex m_mutex;
+    z_stream m_strm;
+    bool m_strm_inited = false;
+    uint64_t m_pos = UINT64_MAX, m_in = 0;
+    std::unique_ptr<unsigned char[]> m_inbuf{new unsigned char[GZ_CHUNK]};
+    off_t m_offset = 0;
+};
+
+IFile *new_gzip_file(IFile *file, const char *index_path, bool ownership, uint64_t span) {
+    auto ret = new GzipFile(file, ownership);
+    if (ret->init(index_path, span) != 0) {
+        ret->set_ownership(false);
+        delete ret;
+        return nullptr;
+    }
+    return ret;
+}
+
+} // namespace FileSystem
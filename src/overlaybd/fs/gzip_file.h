@@ -0,0 +1,36 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+#include <inttypes.h>
+
+namespace FileSystem {
+
+    class IFile;
+
+    // return 1 if `file` starts with the gzip magic, 0 if not, or -1
+    extern "C" int is_gzip_file(FileSystem::IFile *file);
+
+    // return a read-only file of the data decompressed from the gzip file
+    // `file`, e.g. a tar.gz layer, read at random by inflating from the
+    // nearest of the checkpoints taken every `span` bytes of it, each with
+    // the 32KB window it needs. The checkpoints are taken by decompressing
+    // `file` once, and saved in the local file `index_path`, if not nullptr,
+    // from which they are loaded by later opens, and their windows read as
+    // needed. Concatenated gzip members are supported.
+    extern "C" IFile *new_gzip_file(FileSystem::IFile *file, const char *index_path,
+                                    bool ownership = false, uint64_t span = 1024 * 1024);
+}
@@ -14,6 +14,7 @@
    limitations under the License.
 */
 #include "localfs.h"
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <limits.h>
@@ -26,6 +27,8 @@
 #include <sys/statvfs.h>
 #include <sys/ioctl.h>
 #include <dirent.h>
+#include <algorithm>
+#include <memory>
 #ifdef __linux__
 #include <linux/fs.h>
 #include <sys/vfs.h>
@@ -37,11 +40,15 @@
 #ifndef FALLOC_FL_PUNCH_HOLE
 #define FALLOC_FL_PUNCH_HOLE 0x02 /* de-allocates range */
 #endif
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 #endif //__linux__
 #include "virtual-file.h"
 #include "fiemap.h"
 #include "subfs.h"
 #include "../photon/syncio/aio-wrapper.h"
+#include "../photon/syncio/iouring-wrapper.h"
 #include "../alog.h"
 #include "../photon/thread.h"
 using namespace photon;
@@ -72,6 +79,7 @@ class BaseFileAdaptor : public VirtualFile, public IFileXAttr {
 public:
     int fd;
     IFileSystem *fs;
+    bool uring_registered = false; // registered to the io_uring of a vcpu
     BaseFileAdaptor(int _fd, IFileSystem *_fs) : fd(_fd), fs(_fs) {
     }
     virtual ~BaseFileAdaptor() {
@@ -80,6 +88,12 @@ public:
     virtual int close() override final {
         if (fd < 0)
             return 0;
+#ifdef __linux__
+        if (uring_registered) {
+            photon::iouring_unregister_file(fd);
+            uring_registered = false;
+        }
+#endif
         int ret = UISysCall(::close(fd));
         if (ret == 0)
             fd = -1;
@@ -88,6 +102,10 @@ public:
     virtual IFileSystem *filesystem() override final {
         return fs;
     }
+    // the fd of the file
+    virtual Object *get_underlay_object(int i = 0) override {
+        return (Object *)(uint64_t)fd;
+    }
     virtual int fchmod(mode_t mode) override final {
         return UISysCall(::fchmod(fd, mode));
     }
@@ -217,8 +235,37 @@ public:
     virtual int fdatasync() override {
         return AIOEngine::fdatasync(fd);
     }
+    virtual int async_preadv(const struct iovec *iov, int iovcnt, off_t offset,
+                             AsyncDone done) override {
+        return BaseFileAdaptor::async_preadv(iov, iovcnt, offset, done);
+    }
+    virtual int async_pwritev(const struct iovec *iov, int iovcnt, off_t offset,
+                              AsyncDone done) override {
+        return BaseFileAdaptor::async_pwritev(iov, iovcnt, offset, done);
+    }
 };
 
+// submitted to libaio natively, without a thread for each I/O
+template <>
+int AioFileAdaptor<libaio>::async_preadv(const struct iovec *iov, int iovcnt, off_t offset,
+                                         AsyncDone done) {
+    return libaio::async_preadv(fd, iov, iovcnt, offset, done);
+}
+template <>
+int AioFileAdaptor<libaio>::async_pwritev(const struct iovec *iov, int iovcnt, off_t offset,
+                                          AsyncDone done) {
+    return libaio::async_pwritev(fd, iov, iovcnt, offset, done);
+}
+
+#ifdef __linux__
+// registered to the ring of the vcpu opening it, if possible
+static IFile *new_uring_file(int fd, IFileSystem *fs) {
+    auto file = new AioFileAdaptor<iouring>(fd, fs);
+    file->uring_registered = photon::iouring_register_file(fd) >= 0;
+    return file;
+}
+#endif
+
 class LocalDIR : public DIR {
 public:
     ::DIR *dirp;
@@ -265,11 +312,14 @@ class LocalFileSystemAdaptor : public IFileSystem, public IFileSystemXAttr {
 public:
     int io_engine_type = 0;
     int io_flags = 0;
-    LocalFileSystemAdaptor(int ioengine_type) : io_engine_type(ioengine_type) {
+    LocalFileSystemAdaptor(int ioengine_type) : io_engine_type(ioengine_type & ~ioengine_direct) {
 #ifdef __linux__
-        if (ioengine_type == ioengine_libaio) {
+        if (io_engine_type == ioengine_libaio) {
             LOG_INFO("using libaio, set io_flags O_DIRECT");
             this->io_flags = O_DIRECT;
+        } else if (ioengine_type & ioengine_direct) {
+            LOG_INFO("set io_flags O_DIRECT for io engine `", io_engine_type);
+            this->io_flags = O_DIRECT;
         }
 #endif
     }
@@ -285,6 +335,9 @@ public:
         case ioengine_libaio:
             return new AioFileAdaptor<libaio>(fd, this);
             break;
+        case ioengine_iouring:
+            return new_uring_file(fd, this);
+            break;
 #endif
         default:
             return new LocalFileAdaptor(fd, this);
@@ -435,11 +488,94 @@ IFile *new_localfile_adaptor(int fd, int io_engine_type) {
 
     if (io_engine_type == ioengine_posixaio)
         return new AioFileAdaptor<posixaio>(fd, nullptr);
+
+    if (io_engine_type == ioengine_iouring)
+        return new_uring_file(fd, nullptr);
 #endif
 
     return new LocalFileAdaptor(fd, nullptr);
 }
 
+// copy [offset, offset + count) of `src` to the same range of `dst`
+static int copy_range(int src, int dst, off_t offset, off_t count) {
+#ifdef __linux__
+    while (count > 0) {
+        loff_t in = offset, out = offset;
+        auto n = ::copy_file_range(src, &in, dst, &out, count, 0);
+        if (n <= 0)
+            break;
+        offset += n;
+        count -= n;
+    }
+    if (count == 0)
+        return 0;
+    // not across file systems, or not by this kernel
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+        LOG_ERRNO_RETURN(0, -1, "failed to copy ` bytes at `", count, offset);
+#endif
+    // aligned for files opened with O_DIRECT
+    const size_t BUF_SIZE = 1024 * 1024;
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, 4096, BUF_SIZE) != 0)
+        LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate buffer to copy");
+    std::unique_ptr<char, decltype(&free)> buf((char *)ptr, &free);
+    while (count > 0) {
+        auto n = ::pread(src, buf.get(), std::min((off_t)BUF_SIZE, count), offset);
+        if (n == 0)
+            LOG_ERROR_RETURN(EIO, -1, "unexpected EOF reading ` bytes at `", count, offset);
+        if (n < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to read ` bytes at `", count, offset);
+        if (::pwrite(dst, buf.get(), n, offset) != n)
+            LOG_ERRNO_RETURN(0, -1, "failed to write ` bytes at `", n, offset);
+        offset += n;
+        count -= n;
+    }
+    return 0;
+}
+
+int clone_localfile(IFile *src, IFile *dst, bool *reflinked) {
+    auto sfd = src ? (int)(uint64_t)src->get_underlay_object() : 0;
+    auto dfd = dst ? (int)(uint64_t)dst->get_underlay_object() : 0;
+    if (sfd <= 0 || dfd <= 0)
+        LOG_ERROR_RETURN(EINVAL, -1, "not local files to clone: ` -> `", sfd, dfd);
+    if (reflinked)
+        *reflinked = false;
+    struct stat st;
+    if (::fstat(sfd, &st) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to stat fd `", sfd);
+#ifdef __linux__
+    if (::ioctl(dfd, FICLONE, sfd) == 0) {
+        if (reflinked)
+            *reflinked = true;
+        return 0;
+    }
+    LOG_INFO("fd ` can't be reflinked, errno `, its data is copied", sfd, errno);
+#endif
+    if (::ftruncate(dfd, 0) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to truncate fd `", dfd);
+    off_t data = 0;
+    while (data < st.st_size) {
+        off_t hole = st.st_size;
+#ifdef SEEK_DATA
+        auto next = ::lseek(sfd, data, SEEK_DATA);
+        if (next < 0 && errno == ENXIO) // holes to the end
+            break;
+        if (next >= 0) {
+            data = next;
+            hole = ::lseek(sfd, data, SEEK_HOLE);
+            if (hole < 0)
+                hole = st.st_size;
+        }
+#endif
+        if (copy_range(sfd, dfd, data, hole - data) < 0)
+            return -1;
+        data = hole;
+    }
+    if (::ftruncate(dfd, st.st_size) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to truncate fd ` to `", dfd, st.st_size);
+    return 0;
+}
+
 IFile *open_localfile_adaptor(const char *filename, int flags, mode_t mode, int io_engine_type) {
     int fd = UISysCall(::open(filename, flags, mode));
     if (fd < 0)
@@ -29,6 +29,12 @@ namespace FileSystem
 
     const int ioengine_posixaio = 2;        // posixaio depends on photon::fd-events ( fd_events_init() )
 
+    const int ioengine_iouring = 3;         // io_uring depends on photon::iouring_wrapper_init(),
+                                            // and photon::fd-events ( fd_events_init() )
+
+    const int ioengine_direct = 0x100;      // OR'ed to an engine of new_localfs_adaptor(),
+                                            // to open files with O_DIRECT, as libaio always does
+
 
     extern "C" IFileSystem* new_localfs_adaptor(const char* root_path = nullptr,
                                                 int io_engine_type = 0);
@@ -38,6 +44,14 @@ namespace FileSystem
     extern "C" IFile* open_localfile_adaptor(const char* filename, int flags,
                                              mode_t mode = 0644, int io_engine_type = 0);
 
+    // make `dst`, a local file opened for writing, a copy of the local file
+    // `src`, by sharing its extents (FICLONE) if the file system supports it;
+    // otherwise the extents of data of `src` are copied, by the kernel if it
+    // can, leaving its holes as holes; `reflinked` is set to whether the
+    // extents were shared; `src` must not be written while it's copied
+    // return 0 for success, -1 otherwise
+    extern "C" int clone_localfile(IFile* src, IFile* dst, bool* reflinked = nullptr);
+
     inline __attribute__((always_inline))
     IFile* new_libaio_file_adaptor(int fd)
     {
@@ -49,4 +63,10 @@ namespace FileSystem
     {
         return new_localfile_adaptor(fd, ioengine_posixaio);
     }
+
+    inline __attribute__((always_inline))
+    IFile* new_iouring_file_adaptor(int fd)
+    {
+        return new_localfile_adaptor(fd, ioengine_iouring);
+    }
 }
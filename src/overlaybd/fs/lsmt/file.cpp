@@ -26,12 +26,20 @@ limitations under the License.
 #include <vector>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include "index.h"
 #include "../../alog.h"
 #include "../../utility.h"
+#include "../../iovector.h"
 #include "../../photon/thread.h"
+#include "../../photon/thread11.h"
+#include "../../trace.h"
+#include "../fiemap.h"
+#include "../localfs.h"
+#include "../zfile/zfile.h"
 
 #define PARALLEL_LOAD_INDEX 32
+#define PARALLEL_READ 8
 
 using namespace std;
 using namespace FileSystem;
@@ -70,6 +78,7 @@ struct HeaderTrailer {
     static const uint32_t FLAG_SHIFT_HEADER = 0; // 1:header         0:trailer
     static const uint32_t FLAG_SHIFT_TYPE = 1;   // 1:data file,     0:index file
     static const uint32_t FLAG_SHIFT_SEALED = 2; // 1:YES,           0:NO
+    static const uint32_t FLAG_SHIFT_INDEX_ENCODED = 3; // 1:encoded index, 0:array of mappings
 
     uint32_t get_flag_bit(uint32_t shift) const {
         return flags & (1 << shift);
@@ -110,6 +119,12 @@ struct HeaderTrailer {
     void set_sealed() {
         set_flag_bit(FLAG_SHIFT_SEALED);
     }
+    bool is_index_encoded() const {
+        return get_flag_bit(FLAG_SHIFT_INDEX_ENCODED);
+    }
+    void set_index_encoded() {
+        set_flag_bit(FLAG_SHIFT_INDEX_ENCODED);
+    }
     void clr_sealed() {
         clr_flag_bit(FLAG_SHIFT_SEALED);
     }
@@ -143,23 +158,105 @@ struct HeaderTrailer {
     uint8_t to;               // DEPRECATED
 
     static const uint8_t LSMT_V1 = 1;     // v1 (UUID check)
+    static const uint8_t LSMT_V2 = 2;     // v2 (wider length and tag of index)
     static const uint8_t LSMT_SUB_V1 = 1; // .1 deprecated level range.
 
     uint8_t version = LSMT_V1;
     uint8_t sub_version = LSMT_SUB_V1;
 
+    bool is_index_v2() const {
+        return version >= LSMT_V2;
+    }
+
     char user_tag[TAG_SIZE]{}; // 256B commit message.
 
 } __attribute__((packed));
 
 class LSMTReadOnlyFile;
 static LSMTReadOnlyFile *open_file_ro(IFile *file, bool ownership, bool reserve_tag);
+static HeaderTrailer *verify_trailer(IFile *file, char *buf);
 
 static const uint32_t ALIGNMENT = 512; // same as trim block size.
 static const uint32_t ALIGNMENT4K = 4096;
 
 static const int ABORT_FLAG_DETECTED = -2;
 
+// data segments of a single pread() / preadv(), fetched concurrently
+// by at most PARALLEL_READ photon threads
+struct parallel_read_task {
+    struct Job {
+        IFile *file;
+        size_t iov_begin;
+        int iovcnt;
+        size_t count;
+        off_t offset;
+    };
+
+    vector<iovec> iovs;
+    vector<Job> jobs;
+    size_t i = 0;
+    uint64_t io_size = 0;
+    uint32_t io_cnt = 0;
+    int eno = 0;
+
+    // move the first `count` bytes of `view` to a job reading from `offset` of `file`
+    void add_job(IFile *file, iovector_view &view, size_t count, off_t offset) {
+        auto begin = iovs.size();
+        for (auto left = count; left > 0;) {
+            auto &f = view.front();
+            auto n = min(f.iov_len, left);
+            iovs.push_back(iovec{f.iov_base, n});
+            view.extract_front(n);
+            left -= n;
+        }
+        if (!jobs.empty()) {
+            // merge with the previous one if it's contiguous in the same file
+            auto &j = jobs.back();
+            if (j.file == file && j.offset + (off_t)j.count == offset) {
+                j.iovcnt += iovs.size() - begin;
+                j.count += count;
+                return;
+            }
+        }
+        jobs.push_back(Job{file, begin, (int)(iovs.size() - begin), count, offset});
+    }
+
+    Job *get_job() {
+        if (i < jobs.size() && eno == 0)
+            return &jobs[i++];
+        return nullptr;
+    }
+};
+
+static void *do_parallel_read(void *param) {
+    auto tm = (parallel_read_task *)param;
+    while (auto job = tm->get_job()) {
+        LOG_DEBUG("offset: `, length: `", job->offset, job->count);
+        auto iov = &tm->iovs[job->iov_begin];
+        ssize_t ret = (job->iovcnt == 1)
+                          ? job->file->pread(iov->iov_base, iov->iov_len, job->offset)
+                          : job->file->preadv(iov, job->iovcnt, job->offset);
+        if (ret < (ssize_t)job->count) {
+            tm->eno = (ret < 0 && errno) ? errno : EIO;
+            LOG_ERRNO_RETURN(0, nullptr, "failed to read from ` ( pread return: ` < size: `)",
+                             job->file, ret, job->count);
+        }
+        tm->io_size += ret;
+        tm->io_cnt++;
+    }
+    return nullptr;
+}
+
+static void zero_fill(iovector_view &view, size_t count) {
+    while (count > 0) {
+        auto &f = view.front();
+        auto n = min(f.iov_len, count);
+        memset(f.iov_base, 0, n);
+        view.extract_front(n);
+        count -= n;
+    }
+}
+
 class LSMTReadOnlyFile : public IFileRW {
 public:
     size_t MAX_IO_SIZE = 4 * 1024 * 1024;
@@ -171,6 +268,7 @@ public:
     uint64_t m_data_offset = HeaderTrailer::SPACE / ALIGNMENT;
     uint32_t lsmt_io_cnt = 0;
     uint64_t lsmt_io_size = 0;
+    ReadObserver m_read_observer;
 
     virtual ~LSMTReadOnlyFile() {
         LOG_INFO("pread times: `, size: `M", lsmt_io_cnt, lsmt_io_size >> 20);
@@ -196,6 +294,10 @@ public:
         return this->MAX_IO_SIZE;
     }
 
+    virtual void set_read_observer(ReadObserver observer) override {
+        m_read_observer = observer;
+    }
+
     virtual IMemoryIndex0 *index() const override {
         return (IMemoryIndex0 *)m_index;
     }
@@ -234,46 +336,163 @@ public:
         LOG_ERROR_RETURN(EFAULT, -1, "arguments must be aligned!");
 
     virtual ssize_t pread(void *buf, size_t count, off_t offset) override {
+        iovec v{buf, count};
+        return preadv(&v, 1, offset);
+    }
+
+    // zeroed and unmapped segments are filled in place, and mapped segments
+    // are read straight into the caller's iovecs, without bounce buffers
+    virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        SCOPE_TRACE("lsmt");
+        // a read without buffer is a prefetch, passed to the layers it reaches
+        if (iovcnt == 1 && iov->iov_base == nullptr)
+            return prefetch(iov->iov_len, offset);
+        SmartCloneIOV<32> ciov(iov, iovcnt);
+        iovector_view view(ciov.ptr, iovcnt);
+        auto count = view.sum();
         CHECK_ALIGNMENT(count, offset);
         auto nbytes = count;
-        while (count > MAX_IO_SIZE) {
-            auto ret = pread(buf, MAX_IO_SIZE, offset);
-            if (ret < (ssize_t)MAX_IO_SIZE)
+        while (count > 0) {
+            auto step = min(count, MAX_IO_SIZE);
+            if (do_preadv(view, step, offset) < 0)
                 return -1;
-            (char *&)buf += MAX_IO_SIZE;
-            count -= MAX_IO_SIZE;
-            offset += MAX_IO_SIZE;
+            count -= step;
+            offset += step;
+        }
+        return nbytes;
+    }
+
+    ssize_t prefetch(size_t count, off_t offset) {
+        CHECK_ALIGNMENT(count, offset);
+        auto nbytes = count;
+        while (count > 0) {
+            auto step = min(count, MAX_IO_SIZE);
+            Segment s{(uint64_t)offset / ALIGNMENT, (uint32_t)(step / ALIGNMENT)};
+            auto ret = foreach_segments(
+                m_index, s, [&](const Segment &) { return 0; },
+                [&](const SegmentMapping &m) {
+                    if (m.tag >= m_files.size())
+                        LOG_ERROR_RETURN(EIO, -1, "no layer ` to prefetch ` from", m.tag, m);
+                    iovec v{nullptr, m.length * ALIGNMENT};
+                    if (m_files[m.tag]->preadv(&v, 1, m.moffset * ALIGNMENT) < 0)
+                        LOG_ERRNO_RETURN(0, -1, "failed to prefetch ` from layer `", m, m.tag);
+                    return 0;
+                });
+            if (ret < 0)
+                return -1;
+            count -= step;
+            offset += step;
         }
-        count /= ALIGNMENT;
-        offset /= ALIGNMENT;
-        Segment s{(uint64_t)offset, (uint32_t)count};
+        return nbytes;
+    }
+
+    int do_preadv(iovector_view &view, size_t count, off_t offset) {
+        Segment s{(uint64_t)offset / ALIGNMENT, (uint32_t)(count / ALIGNMENT)};
+        parallel_read_task tm;
         auto ret = foreach_segments(
             m_index, s,
             [&](const Segment &m) __attribute__((always_inline)) {
-                auto step = m.length * ALIGNMENT;
-                memset(buf, 0, step);
-                (char *&)buf += step;
+                zero_fill(view, m.length * ALIGNMENT);
                 return 0;
             },
             [&](const SegmentMapping &m) __attribute__((always_inline)) {
-                if (m.tag >= m_files.size()) {
-                    LOG_DEBUG(" ` >= `", m.tag, m_files.size());
-                }
-                assert(m.tag < m_files.size());
-                ssize_t size = m.length * ALIGNMENT;
-                LOG_DEBUG("offset: `, length: `", m.moffset, size);
-                ssize_t ret = m_files[m.tag]->pread(buf, size, m.moffset * ALIGNMENT);
-                if (ret < size) {
-                    LOG_ERRNO_RETURN(0, (int)ret,
-                                     "failed to read from `-th file ( ` pread return: ` < size: `)",
-                                     m.tag, m_files[m.tag], ret, size);
-                }
-                lsmt_io_size += ret;
-                lsmt_io_cnt++;
-                (char *&)buf += size;
+                // e.g. a range of a layer whose index failed to be loaded lazily
+                if (m.tag >= m_files.size())
+                    LOG_ERROR_RETURN(EIO, -1, "no layer ` to read ` from", m.tag, m);
+                if (m_read_observer)
+                    m_read_observer(m.tag, m.moffset * ALIGNMENT, m.length * ALIGNMENT);
+                tm.add_job(m_files[m.tag], view, m.length * ALIGNMENT, m.moffset * ALIGNMENT);
                 return 0;
             });
-        return (ret >= 0) ? nbytes : ret;
+        if (ret < 0)
+            return ret;
+
+        // the calling thread works as one of the readers
+        auto n = min((size_t)PARALLEL_READ, tm.jobs.size());
+        photon::join_handle *ths[PARALLEL_READ];
+        size_t nths = 0;
+        for (; nths + 1 < n; ++nths) {
+            auto th = photon::thread_create(&do_parallel_read, &tm);
+            if (!th)
+                break;
+            ths[nths] = photon::thread_enable_join(th);
+        }
+        do_parallel_read(&tm);
+        for (size_t i = 0; i < nths; ++i) {
+            photon::thread_join(ths[i]);
+        }
+        lsmt_io_size += tm.io_size;
+        lsmt_io_cnt += tm.io_cnt;
+        if (tm.eno != 0) {
+            LOG_ERROR_RETURN(tm.eno, -1, "failed to read from underlying files");
+        }
+        return 0;
+    }
+
+    // the fds of the layers found to be local files, -1 for those opened
+    // with O_DIRECT, or 0 if not known yet, e.g. not downloaded
+    vector<int> m_fds;
+
+    int layer_fd(size_t tag) {
+        if (m_fds.size() < m_files.size())
+            m_fds.resize(m_files.size(), 0);
+        if (m_fds[tag] != 0)
+            return m_fds[tag];
+        auto fd = m_files[tag] ? (int)(uint64_t)m_files[tag]->get_underlay_object() : 0;
+        if (fd <= 0)
+            return -1;
+        auto flags = fcntl(fd, F_GETFL);
+        if (flags < 0)
+            return -1;
+        return m_fds[tag] = (flags & O_DIRECT) ? -1 : fd;
+    }
+
+    virtual ssize_t resolve(off_t offset, size_t count, Extent *out, size_t n) override {
+        if (!is_aligned(count | offset))
+            return -1;
+        size_t k = 0;
+        auto add = [&](int fd, uint64_t moffset, uint64_t length) {
+            if (k > 0 && out[k - 1].fd == fd &&
+                (fd < 0 || out[k - 1].moffset + out[k - 1].length == moffset)) {
+                out[k - 1].length += length;
+                return 0;
+            }
+            if (k == n)
+                return -1;
+            out[k++] = {fd, moffset, length};
+            return 0;
+        };
+        bool failed = false;
+        // observed only once resolved, as the caller reads it otherwise
+        vector<SegmentMapping> observed;
+        while (count > 0 && !failed) {
+            auto step = min(count, MAX_IO_SIZE);
+            Segment s{(uint64_t)offset / ALIGNMENT, (uint32_t)(step / ALIGNMENT)};
+            auto ret = foreach_segments(
+                m_index, s,
+                [&](const Segment &m) {
+                    if (add(-1, 0, m.length * ALIGNMENT) < 0)
+                        failed = true;
+                    return failed ? -1 : 0;
+                },
+                [&](const SegmentMapping &m) {
+                    int fd = m.tag < m_files.size() ? layer_fd(m.tag) : -1;
+                    if (fd < 0 || add(fd, m.moffset * ALIGNMENT, m.length * ALIGNMENT) < 0)
+                        failed = true;
+                    else if (m_read_observer)
+                        observed.push_back(m);
+                    return failed ? -1 : 0;
+                });
+            if (ret < 0)
+                failed = true;
+            count -= step;
+            offset += step;
+        }
+        if (failed)
+            return -1;
+        for (auto &m : observed)
+            m_read_observer(m.tag, m.moffset * ALIGNMENT, m.length * ALIGNMENT);
+        return k;
     }
 
     virtual IFile *front_file() {
@@ -301,8 +520,179 @@ public:
             LOG_ERROR_RETURN(ENOSYS, nullptr, "no underlying files found!");
         return file->filesystem();
     }
+
+    // the first block in [begin, end) that holds data, or that is in a hole,
+    // where zeroed segments are holes too; `end` if there is none
+    uint64_t find_block(uint64_t begin, uint64_t end, bool data) {
+        while (begin < end) {
+            Segment s{begin, (uint32_t)min(end - begin, (uint64_t)Segment::MAX_LENGTH)};
+            uint64_t found = end;
+            foreach_segments(
+                m_index, s,
+                [&](const Segment &m) {
+                    if (data)
+                        return 0;
+                    found = m.offset;
+                    return -1;
+                },
+                [&](const SegmentMapping &m) {
+                    if (!data)
+                        return 0;
+                    found = m.offset;
+                    return -1;
+                });
+            if (found < end)
+                return found;
+            begin = s.end();
+        }
+        return end;
+    }
+
+    // SEEK_DATA and SEEK_HOLE are answered by the index, so that holes can
+    // be skipped without reading them; the end of file is a hole
+    virtual off_t lseek(off_t offset, int whence) override {
+        if (whence != SEEK_DATA && whence != SEEK_HOLE)
+            return IFileRW::lseek(offset, whence);
+        if (offset < 0 || (uint64_t)offset >= m_vsize)
+            LOG_ERROR_RETURN(ENXIO, -1, "offset ` is out of the file of ` bytes", offset, m_vsize);
+        auto end = (m_vsize + ALIGNMENT - 1) / ALIGNMENT;
+        auto block = find_block(offset / ALIGNMENT, end, whence == SEEK_DATA);
+        if (block == end && whence == SEEK_DATA)
+            LOG_ERROR_RETURN(ENXIO, -1, "no data from offset ` on", offset);
+        auto pos = min(max((uint64_t)offset, block * ALIGNMENT), m_vsize);
+        return IFileRW::lseek(pos, SEEK_SET);
+    }
+
+    // the extents of data in the range, one per mapped segment, with its
+    // offset in the layer it is mapped to as `fe_physical`
+    virtual int fiemap(struct fiemap *map) override {
+        map->fm_mapped_extents = 0;
+        if (map->fm_start >= m_vsize)
+            return 0;
+        auto begin = map->fm_start / ALIGNMENT;
+        auto len = min(map->fm_length, m_vsize - map->fm_start);
+        auto end = (map->fm_start + len + ALIGNMENT - 1) / ALIGNMENT;
+        bool full = false;
+        SegmentMapping last(0, 0, 0);
+        while (begin < end && !full) {
+            Segment s{begin, (uint32_t)min(end - begin, (uint64_t)Segment::MAX_LENGTH)};
+            foreach_segments(
+                m_index, s, [&](const Segment &m) { return 0; },
+                [&](const SegmentMapping &m) {
+                    // a segment split by the windows of lookup is one extent
+                    auto n = map->fm_mapped_extents;
+                    if (n > 0 && last.end() == m.offset &&
+                        last.moffset + last.length == m.moffset && last.tag == m.tag) {
+                        if (map->fm_extent_count > 0)
+                            map->fm_extents[n - 1].fe_length += m.length * ALIGNMENT;
+                        last = m;
+                        return 0;
+                    }
+                    // with no room for extents, they are counted only
+                    if (map->fm_extent_count > 0) {
+                        if (n == map->fm_extent_count) {
+                            full = true;
+                            return -1;
+                        }
+                        auto &e = map->fm_extents[n];
+                        memset(&e, 0, sizeof(e));
+                        e.fe_logical = m.offset * ALIGNMENT;
+                        e.fe_physical = m.moffset * ALIGNMENT;
+                        e.fe_length = m.length * ALIGNMENT;
+                    }
+                    map->fm_mapped_extents++;
+                    last = m;
+                    return 0;
+                });
+            begin = s.end();
+        }
+        auto n = map->fm_mapped_extents;
+        if (!full && n > 0 && map->fm_extent_count > 0 && end * ALIGNMENT >= m_vsize)
+            map->fm_extents[n - 1].fe_flags |= FIEMAP_EXTENT_LAST;
+        return 0;
+    }
+
+    // the bytes of data stored in the i-th layer, which is sealed
+    virtual int layer_data_size(size_t i, uint64_t &size) const {
+        ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+        auto pht = verify_trailer(m_files[i], buf);
+        if (!pht)
+            LOG_ERROR_RETURN(0, -1, "failed to read the trailer of layer `", i);
+        size = pht->index_offset - HeaderTrailer::SPACE;
+        return 0;
+    }
+
+    // the mappings are looked up in windows from the beginning to the end,
+    // and the ones split by the windows are joined again
+    virtual ssize_t space_stat(SpaceStat *stats, size_t n) const override {
+        n = min(n, m_files.size());
+        for (size_t i = 0; i < n; i++) {
+            stats[i] = SpaceStat();
+            if (layer_data_size(i, stats[i].data_size) < 0)
+                return -1;
+        }
+        // the end of the last data segment in each layer
+        vector<uint64_t> mend(n, UINT64_MAX);
+        // a segment of `length` blocks, more than that of a mapping if joined
+        auto add = [&](const SegmentMapping &m, uint64_t length) {
+            if (m.tag >= n || length == 0)
+                return;
+            auto &st = stats[m.tag];
+            if (m.zeroed) {
+                st.zeroed_segments++;
+                st.zeroed_size += length * ALIGNMENT;
+                return;
+            }
+            st.segments++;
+            st.live_size += length * ALIGNMENT;
+            int k = 0;
+            while (k + 1 < SpaceStat::HISTOGRAM_SIZE && (length >> (k + 1)) > 0)
+                k++;
+            st.histogram[k]++;
+            if (m.moffset != mend[m.tag])
+                st.fragments++;
+            mend[m.tag] = m.moffset + length;
+        };
+
+        const size_t NMAPPING = 16;
+        SegmentMapping pm[NMAPPING];
+        SegmentMapping last(0, 0, 0);
+        uint64_t length = 0;
+        auto end = (m_vsize + ALIGNMENT - 1) / ALIGNMENT;
+        for (uint64_t begin = 0; begin < end;) {
+            Segment s{begin, (uint32_t)min(end - begin, (uint64_t)Segment::MAX_LENGTH)};
+            begin = s.end();
+            while (s.length > 0) {
+                auto k = m_index->lookup(s, pm, NMAPPING);
+                for (size_t j = 0; j < k; j++) {
+                    auto &m = pm[j];
+                    if (last.offset + length == m.offset && last.tag == m.tag &&
+                        last.zeroed == m.zeroed &&
+                        (m.zeroed || last.moffset + length == m.moffset)) {
+                        length += m.length;
+                        continue;
+                    }
+                    add(last, length);
+                    last = m;
+                    length = m.length;
+                }
+                if (k < NMAPPING)
+                    break;
+                s.forward_offset_to(pm[k - 1].end());
+            }
+        }
+        add(last, length);
+        for (size_t i = 0; i < n; i++) {
+            auto &st = stats[i];
+            st.garbage_size = st.data_size > st.live_size ? st.data_size - st.live_size : 0;
+        }
+        return m_files.size();
+    }
+
     UNIMPLEMENTED(int close_seal(IFileRO **reopen_as = nullptr) override);
     UNIMPLEMENTED(int commit(const CommitArgs &args) const override);
+    UNIMPLEMENTED(int compact_online(IFile *fdata, IFile *findex, uint64_t max_MBps,
+                                     const int *running) override);
 
     virtual DataStat data_stat() const override {
         uint64_t size = 0;
@@ -318,7 +708,8 @@ public:
 };
 
 static int write_header_trailer(IFile *file, bool is_header, bool is_sealed, bool is_data_file,
-                                uint64_t index_offset, uint64_t index_size, const LayerInfo &args) {
+                                uint64_t index_offset, uint64_t index_size, const LayerInfo &args,
+                                bool index_v2 = false, bool index_encoded = false) {
     ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
     memset(buf, 0, HeaderTrailer::SPACE);
     auto pht = new (buf) HeaderTrailer;
@@ -336,6 +727,10 @@ static int write_header_trailer(IFile *file, bool is_header, bool is_sealed, boo
     else
         pht->set_index_file();
 
+    if (index_v2)
+        pht->version = HeaderTrailer::LSMT_V2;
+    if (index_encoded)
+        pht->set_index_encoded();
     pht->index_offset = index_offset;
     pht->index_size = index_size;
     pht->virtual_size = args.virtual_size;
@@ -362,7 +757,8 @@ struct CompactOptions {
     size_t index_size;
     size_t virtual_size;
     const CommitArgs *commit_args = nullptr;
-    uint64_t io_usleep_time = 0;
+    uint64_t io_usleep_time = 0;   // sleep after copying every 32KB, for throttling
+    const int *running = nullptr; // abort copying once *running != 1
     char *TRIM_BLOCK = nullptr;
     size_t trim_blk_size = 0;
 };
@@ -387,19 +783,48 @@ static int push_segment(char *buf, char *data, int &data_length, int &prev_end,
     return 0;
 }
 
-static int is_zero_block(char *buf, size_t n) {
-    return 1;
-    // TODO: fixme: result data error
-    if (n & (sizeof(uint64_t) - 1)) {
-        LOG_ERROR("buf size invalid.");
-        return -1;
+static bool is_zero_block(const char *buf, size_t n) {
+    assert((n & (sizeof(uint64_t) - 1)) == 0);
+    for (size_t j = 0; j < n; j += sizeof(uint64_t)) {
+        if (*(const uint64_t *)(buf + j) != 0)
+            return false;
     }
-    for (uint64_t j = 0; j < n; j += sizeof(uint64_t)) {
-        if ((uint64_t)(*(buf + j)) == (uint64_t)0)
+    return true;
+}
+
+// a hash of a 4K block, to find the candidates of duplicates of it, which
+// are compared byte by byte before being shared
+static uint64_t hash_block(const char *buf) {
+    uint64_t h = 0;
+    for (size_t j = 0; j < ALIGNMENT4K; j += sizeof(uint64_t))
+        h = (h ^ *(const uint64_t *)(buf + j)) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 32);
+}
+
+// split `step` bytes of segment `s` read into `buf` into the segments of
+// zeroed blocks and the ones of data, which is gathered into `data`
+static void split_zero_blocks(char *buf, ssize_t step, SegmentMapping &s, char *data,
+                              int &data_length, vector<SegmentMapping> &index) {
+    auto zero_detected = -1;
+    auto prev_end = 0;
+    for (auto i = 0; i < step; i += (ssize_t)ALIGNMENT) {
+        if (is_zero_block(buf + i, ALIGNMENT)) {
+            if (zero_detected == 0 && s.length) {
+                push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
+            }
+            s.length++;
+            zero_detected = 1;
             continue;
-        return 1;
+        }
+        if (zero_detected == 1) {
+            push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
+        }
+        zero_detected = 0;
+        s.length++;
+    }
+    if (s.length) {
+        push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
     }
-    return 0;
 }
 
 static ssize_t pcopy(const CompactOptions &opt, const SegmentMapping &m, uint64_t moffset,
@@ -415,30 +840,13 @@ static ssize_t pcopy(const CompactOptions &opt, const SegmentMapping &m, uint64_
     while (count > 0) {
         ssize_t step = min((size_t)count, BUFFER_SIZE /* BUFFER_SIZE 32K */);
         LOG_DEBUG("read from src_file, offset: `, step: `", offset, step);
+        if (opt.running && *opt.running != 1)
+            LOG_ERROR_RETURN(ECANCELED, ABORT_FLAG_DETECTED, "copying aborted");
         ssize_t ret = opt.src_files[m.tag]->pread(buf, step, offset);
         if (ret < (ssize_t)step)
             LOG_ERRNO_RETURN(0, -1, "failed to read from file");
-        auto zero_detected = -1;
         auto data_length = 0;
-        auto prev_end = 0;
-        for (auto i = 0; i < step; i += (ssize_t)ALIGNMENT) {
-            if (is_zero_block(buf + i, ALIGNMENT) == 0) {
-                if (zero_detected == 0 && s.length) {
-                    push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
-                }
-                s.length++;
-                zero_detected = 1;
-                continue;
-            }
-            if (zero_detected == 1) {
-                push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
-            }
-            zero_detected = 0;
-            s.length++;
-        }
-        if (s.length) {
-            push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
-        }
+        split_zero_blocks(buf, step, s, data, data_length, index);
         /* write non-zeroed data */
         LOG_DEBUG("write valid data(size: `)", data_length);
         if (data_length) {
@@ -449,10 +857,123 @@ static ssize_t pcopy(const CompactOptions &opt, const SegmentMapping &m, uint64_
         bytes += data_length;
         offset += step;
         count -= step;
+        if (opt.io_usleep_time)
+            photon::thread_usleep(opt.io_usleep_time);
     }
     return bytes / ALIGNMENT;
 }
 
+// Segments are copied in blocks by photon threads, each of which reads a
+// block and splits the zeroed blocks off, and then appends the data and the
+// mappings to the output in turn, i.e. in the order of the index, so that
+// the reads of the others are in flight while one is writing.
+struct ParallelCopy {
+    const static size_t BLOCK_SIZE = 1024 * 1024;
+
+    const CompactOptions &opt;
+    const SegmentMapping *mappings;
+    size_t n;
+    uint64_t &moffset;
+    vector<SegmentMapping> &index;
+    atomic_uint64_t &copied;
+
+    // the position of the next block, in segment and in blocks of ALIGNMENT
+    size_t next_mapping = 0;
+    uint32_t next_skip = 0;
+    uint64_t issued = 0, written = 0;
+    int ret = 0;
+    photon::condition_variable cv;
+
+    ParallelCopy(const CompactOptions &opt, const SegmentMapping *mappings, size_t n,
+                 uint64_t &moffset, vector<SegmentMapping> &index, atomic_uint64_t &copied)
+        : opt(opt), mappings(mappings), n(n), moffset(moffset), index(index), copied(copied) {
+    }
+
+    bool next_block(SegmentMapping &b, uint64_t &ticket) {
+        if (ret != 0 || next_mapping == n)
+            return false;
+        auto &m = mappings[next_mapping];
+        b = m;
+        if (m.zeroed) {
+            next_skip = m.length;
+        } else {
+            b.offset += next_skip;
+            b.moffset += next_skip;
+            b.length = min(m.length - next_skip, (uint32_t)(BLOCK_SIZE / ALIGNMENT));
+            next_skip += b.length;
+        }
+        if (next_skip == m.length) {
+            copied.fetch_add(1);
+            next_mapping++;
+            next_skip = 0;
+        }
+        ticket = issued++;
+        return true;
+    }
+
+    int read_block(const SegmentMapping &b, char *buf, char *data, int &data_length,
+                   vector<SegmentMapping> &segments) {
+        if (opt.running && *opt.running != 1)
+            LOG_ERROR_RETURN(ECANCELED, ABORT_FLAG_DETECTED, "copying aborted");
+        ssize_t count = b.length * ALIGNMENT;
+        if (opt.src_files[b.tag]->pread(buf, count, b.moffset * ALIGNMENT) < count)
+            LOG_ERRNO_RETURN(0, -1, "failed to read from file");
+        // the segments are relative to the data of the block
+        SegmentMapping s{b.offset, 0, 0, b.tag};
+        split_zero_blocks(buf, count, s, data, data_length, segments);
+        return 0;
+    }
+
+    void worker() {
+        ALIGNED_MEM4K(buf, BLOCK_SIZE);
+        ALIGNED_MEM4K(data, BLOCK_SIZE);
+        vector<SegmentMapping> segments;
+        SegmentMapping b;
+        uint64_t ticket;
+        while (next_block(b, ticket)) {
+            segments.clear();
+            int data_length = 0, r = 0;
+            if (!b.zeroed)
+                r = read_block(b, buf, data, data_length, segments);
+            while (written != ticket)
+                cv.wait_no_lock();
+            DEFER({
+                written++;
+                cv.notify_all();
+            });
+            if (ret == 0)
+                ret = r;
+            if (ret != 0)
+                continue;
+            if (b.zeroed) {
+                b.moffset = moffset;
+                index.push_back(b);
+                continue;
+            }
+            for (auto &s : segments) {
+                s.moffset += moffset;
+                index.push_back(s);
+            }
+            if (data_length && opt.commit_args->as->write(data, data_length) < data_length) {
+                LOG_ERROR("failed to write to file, `: `", errno, strerror(errno));
+                ret = -1;
+                continue;
+            }
+            moffset += data_length / ALIGNMENT;
+        }
+    }
+
+    int run(int concurrency) {
+        vector<photon::join_handle *> threads;
+        for (int i = 0; i < concurrency; i++)
+            threads.push_back(
+                photon::thread_enable_join(photon::thread_create11(&ParallelCopy::worker, this)));
+        for (auto th : threads)
+            photon::thread_join(th);
+        return ret;
+    }
+};
+
 static int load_layer_info(IFile **src_files, size_t n, LayerInfo &layer, bool oper_seal = false) {
     ALIGNED_MEM(buf_top, HeaderTrailer::SPACE, ALIGNMENT4K);
     auto ret = src_files[0]->pread(buf_top, HeaderTrailer::SPACE, 0);
@@ -491,6 +1012,68 @@ static int load_layer_info(IFile **src_files, size_t n, LayerInfo &layer, bool o
     return 0;
 }
 
+static bool index_v2 = false;
+void set_index_v2(bool enable) {
+    index_v2 = enable;
+}
+
+static bool index_encoded = false;
+void set_index_encoding(bool enable) {
+    index_encoded = enable;
+}
+
+// write the first `index_size` of `index`, padded with invalid mappings to
+// 4KB, updating `index_size` to include the padding
+static int write_raw_index(IFile *dest_file, vector<SegmentMapping> &index, size_t &index_size,
+                           bool v2) {
+    LOG_DEBUG("write index to dest_file `, size: `*`", dest_file, index_size,
+              sizeof(SegmentMapping));
+    ALIGNED_MEM4K(raw, 4096);
+    int N = ALIGNMENT4K / sizeof(SegmentMapping);
+    ssize_t p = 0;
+    size_t padding = N - index_size % N;
+    if ((ssize_t)padding < N) {
+        index.resize(index_size + padding);
+        for (size_t i = index_size; i < index_size + padding; i++)
+            index[i] = SegmentMapping::invalid_mapping();
+        LOG_DEBUG("index_count: `, (include padding: `), `", index.size(), padding,
+                  sizeof(SegmentMapping));
+        assert(index.size() % N == 0);
+        index_size += padding;
+    } else {
+        index.resize(index_size);
+    }
+    if (!v2 && mappings_to_v1(index.data(), index.size()) < 0)
+        return -1;
+    size_t writen = 0;
+    while (p < (ssize_t)index.size()) {
+        memcpy(raw, &index[p], ALIGNMENT4K);
+        auto ret = dest_file->write(raw, ALIGNMENT4K);
+        if (ret < (ssize_t)ALIGNMENT4K)
+            LOG_ERRNO_RETURN(0, -1, "failed to write index");
+        writen += ret;
+        p += N;
+    }
+    assert(writen == index_size * sizeof(SegmentMapping));
+    return 0;
+}
+
+// write the `n` mappings encoded by encode_index(), padded with 0 to 4KB
+static int write_encoded_index(IFile *dest_file, const SegmentMapping *index, size_t n) {
+    vector<char> encoded;
+    encode_index(index, n, encoded);
+    LOG_INFO("index of ` mappings encoded in ` bytes", n, encoded.size());
+    ALIGNED_MEM4K(raw, ALIGNMENT4K);
+    for (size_t p = 0; p < encoded.size(); p += ALIGNMENT4K) {
+        auto len = min((size_t)ALIGNMENT4K, encoded.size() - p);
+        memcpy(raw, &encoded[p], len);
+        memset(raw + len, 0, ALIGNMENT4K - len);
+        if (dest_file->write(raw, ALIGNMENT4K) < (ssize_t)ALIGNMENT4K)
+            LOG_ERRNO_RETURN(0, -1, "failed to write index");
+    }
+    return 0;
+}
+
 static int compact(const CompactOptions &opt, atomic_uint64_t &compacted_idx_size) {
     auto src_files = opt.src_files;
     auto commit_args = opt.commit_args;
@@ -504,7 +1087,7 @@ static int compact(const CompactOptions &opt, atomic_uint64_t &compacted_idx_siz
         layer.parent_uuid.parse(commit_args->parent_uuid);
     }
     layer.len = commit_args->get_tag_len();
-    ssize_t ret = write_header_trailer(dest_file, true, true, true, 0, 0, layer);
+    ssize_t ret = write_header_trailer(dest_file, true, true, true, 0, 0, layer, index_v2);
     if (ret < 0) {
         LOG_ERRNO_RETURN(0, -1, "failed to write header.");
     }
@@ -512,56 +1095,64 @@ static int compact(const CompactOptions &opt, atomic_uint64_t &compacted_idx_siz
     uint64_t moffset = HeaderTrailer::SPACE;
     vector<SegmentMapping> compact_index;
     moffset /= ALIGNMENT;
-    for (auto &m : marray) {
-        compacted_idx_size.fetch_add(1);
-        if (m.zeroed) {
-            m.moffset = moffset;
-            compact_index.push_back(m);
-            // there is no need do pcopy if current block is zero-marked.
-            continue;
-        }
-        auto ret = pcopy(opt, m, moffset, compact_index);
+    if (commit_args->concurrency > 1) {
+        ParallelCopy pc(opt, opt.raw_index, opt.index_size, moffset, compact_index,
+                        compacted_idx_size);
+        auto ret = pc.run(commit_args->concurrency);
         if (ret < 0)
-            return (int)ret;
-        moffset += ret;
-    }
-    uint64_t index_offset = moffset * ALIGNMENT;
-    auto index_size = compress_raw_index(&compact_index[0], compact_index.size());
-    LOG_DEBUG("write index to dest_file `, size: `*`", dest_file, index_size,
-              sizeof(SegmentMapping));
-
-    ALIGNED_MEM4K(raw, 4096);
-    int N = ALIGNMENT4K / sizeof(SegmentMapping);
-    ssize_t p = 0;
-    size_t padding = N - index_size % N;
-    if ((ssize_t)padding < N) {
-        compact_index.resize(index_size + padding);
-        for (size_t i = index_size; i < index_size + padding; i++)
-            compact_index[i] = SegmentMapping::invalid_mapping();
-        LOG_DEBUG("index_count: `, (include padding: `), `", compact_index.size(), padding,
-                  sizeof(SegmentMapping));
-        assert(compact_index.size() % N == 0);
-        index_size += padding;
+            return ret;
     } else {
-        compact_index.resize(index_size);
+        for (auto &m : marray) {
+            compacted_idx_size.fetch_add(1);
+            if (m.zeroed) {
+                m.moffset = moffset;
+                compact_index.push_back(m);
+                // there is no need do pcopy if current block is zero-marked.
+                continue;
+            }
+            auto ret = pcopy(opt, m, moffset, compact_index);
+            if (ret < 0)
+                return (int)ret;
+            moffset += ret;
+        }
     }
-    size_t writen = 0;
-    while (p < (ssize_t)compact_index.size()) {
-        memcpy(raw, &compact_index[p], ALIGNMENT4K);
-        ret = dest_file->write(raw, ALIGNMENT4K);
-        assert(ret == ALIGNMENT4K);
-        writen += ret;
-        p += N;
+    uint64_t index_offset = moffset * ALIGNMENT;
+    // an encoded index can't be read by older versions either
+    bool v2 = index_v2 || index_encoded;
+    auto index_size =
+        compress_raw_index(&compact_index[0], compact_index.size(),
+                           v2 ? Segment::MAX_LENGTH : Segment::MAX_LENGTH_V1);
+    if (index_encoded) {
+        if (write_encoded_index(dest_file, compact_index.data(), index_size) < 0)
+            return -1;
+    } else if (write_raw_index(dest_file, compact_index, index_size, v2) < 0) {
+        return -1;
     }
-    assert(writen == index_size * sizeof(SegmentMapping));
     auto trailer_offset = dest_file->lseek(0, 2);
     LOG_DEBUG("trailer offset: `", trailer_offset);
-    ret = write_header_trailer(dest_file, false, true, true, index_offset, index_size, layer);
+    ret = write_header_trailer(dest_file, false, true, true, index_offset, index_size, layer, v2,
+                               index_encoded);
     if (ret < 0)
         LOG_ERROR_RETURN(0, -1, "failed to write trailer");
     return 0;
 }
 
+// append `count` bytes at `offset` of `src` to `dest`
+static int copy_range(IFile *src, IFile *dest, off_t offset, size_t count) {
+    const size_t BUFFER_SIZE = 32 * 1024;
+    ALIGNED_MEM4K(buf, BUFFER_SIZE);
+    while (count > 0) {
+        auto step = min(count, BUFFER_SIZE);
+        if (src->pread(buf, step, offset) < (ssize_t)step)
+            LOG_ERRNO_RETURN(0, -1, "failed to read from `, offset: `", src, offset);
+        if (dest->write(buf, step) < (ssize_t)step)
+            LOG_ERRNO_RETURN(0, -1, "failed to write to `", dest);
+        offset += step;
+        count -= step;
+    }
+    return 0;
+}
+
 class LSMTFile : public LSMTReadOnlyFile {
 public:
     typedef photon::mutex Mutex;
@@ -570,18 +1161,50 @@ public:
     atomic_uint64_t m_compacted_idx_size; // count of compacted raw-index
 
     bool m_init_concurrency = false;
+    // the end of the data file reserved by writes, and that of the writes
+    // published, i.e. whose mappings have been inserted into the index
     uint64_t m_data_offset = HeaderTrailer::SPACE / ALIGNMENT;
-
-    uint8_t m_rw_tag = 0;
+    uint64_t m_published_offset = HeaderTrailer::SPACE / ALIGNMENT;
+    // writes reserve their space in the data file in turn, copy their data
+    // concurrently, and then publish their mappings in the order of the
+    // reservations, which is that of their offsets in the data file
+    uint64_t m_writes_reserved = 0, m_writes_published = 0;
+    photon::condition_variable m_publish_cv;
+
+    uint16_t m_rw_tag = 0;
+    bool m_zero_detect = false;
+
+    // the data of recently written 4K blocks by their hashes, one in each
+    // slot, which is empty with a moffset of 0; no slots if dedup is disabled
+    struct DedupEntry {
+        uint64_t hash, moffset;
+    };
+    vector<DedupEntry> m_dedup_table;
 
     Mutex m_rw_mtx;
     IFile *m_findex = nullptr;
+    // shared by the users of the current data and index files,
+    // and exclusive when compact_online() switches them
+    photon::rwlock m_files_lock;
+    bool m_compacting = false;
 
     vector<SegmentMapping> m_stacked_mappings;
     // used as a buffer for batch write (aka "group commit")
     uint32_t nmapping = 0;
     // # of elements in the mapping buffer
 
+    // the mapping of the last write, which may be extended by the next one,
+    // and whether it's the last one in the mapping buffer
+    SegmentMapping m_last_write = SegmentMapping::invalid_mapping();
+    bool m_last_stacked = false;
+
+    // syncs issued and done, the latter covering the writes before the
+    // former was issued, so that concurrent callers of fsync() share one
+    uint64_t m_sync_issued = 0, m_sync_done = 0;
+    int m_sync_ret = 0;
+    bool m_syncing = false;
+    photon::condition_variable m_sync_cv;
+
     LSMTFile() {
         m_compacted_idx_size.store(0);
     }
@@ -599,6 +1222,15 @@ public:
     }
 
     virtual int vioctl(int request, va_list args) override {
+        if (request == Zero_Detect) {
+            m_zero_detect = va_arg(args, int);
+            return 0;
+        }
+        if (request == Dedup) {
+            Lock lock(m_rw_mtx);
+            m_dedup_table.assign(va_arg(args, size_t), DedupEntry{0, 0});
+            return 0;
+        }
         if (request != Index_Group_Commit)
             LOG_ERROR_RETURN(EINVAL, -1, "invaid request code");
 
@@ -644,12 +1276,15 @@ public:
 
     int do_group_commit_mappings() {
         if (nmapping > 0) {
-            while (nmapping < m_stacked_mappings.size()) {
+            // padded to the alignment only, as they are flushed by every fsync()
+            while (nmapping % (ALIGNMENT / sizeof(SegmentMapping)) != 0 &&
+                   nmapping < m_stacked_mappings.size()) {
                 m_stacked_mappings[nmapping++] = SegmentMapping::invalid_mapping();
             }
             auto index_size = nmapping * sizeof(m_stacked_mappings[0]);
             ALIGNED_MEM4K(raw, index_size);
             memcpy(raw, &m_stacked_mappings[0], index_size);
+            mappings_to_v1((SegmentMapping *)raw, nmapping);
             auto ret = append(m_findex, raw, index_size);
             if (ret == 0)
                 return -1;
@@ -662,10 +1297,25 @@ public:
         return LSMTReadOnlyFile::pread(buf, count, offset);
     }
 
+    virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        photon::scoped_rwlock lock(m_files_lock, photon::RLOCK);
+        return LSMTReadOnlyFile::preadv(iov, iovcnt, offset);
+    }
+
+    // the files of the writable layer may be replaced by compaction
+    virtual ssize_t resolve(off_t, size_t, Extent *, size_t) override {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // the index of a writable layer is in the v1 format, which its mappings
+    // are short enough for, so that it's opened by older versions as well
     virtual void append_index(const SegmentMapping &m) {
         if (m_findex) {
             if (m_stacked_mappings.empty()) {
-                append(m_findex, &m, sizeof(m));
+                auto v1 = m;
+                mappings_to_v1(&v1, 1);
+                append(m_findex, &v1, sizeof(v1));
             } else {
                 m_stacked_mappings[nmapping++] = m;
                 if (nmapping == m_stacked_mappings.size() /* || TODO: timeout  */) {
@@ -675,8 +1325,16 @@ public:
         }
     }
 
+    // written as a whole by one append and one mapping, instead of one for each
+    // of `iov` by VirtualFile::pwritev(), if not to be split or zero-detected
     virtual ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override {
-        return VirtualFile::pwritev(iov, iovcnt, offset);
+        iovector_view view((struct iovec *)iov, iovcnt);
+        auto count = view.sum();
+        if (m_zero_detect || !m_dedup_table.empty() || count > MAX_IO_SIZE || count == 0)
+            return VirtualFile::pwritev(iov, iovcnt, offset);
+        LOG_DEBUG("{offset:`,length:`,iovcnt:`}", offset, count, iovcnt);
+        CHECK_ALIGNMENT(count, offset);
+        return do_pwritev(iov, iovcnt, count, offset) < 0 ? -1 : count;
     }
 
     virtual ssize_t pwrite(const void *buf, size_t count, off_t offset) override {
@@ -691,30 +1349,213 @@ public:
             count -= MAX_IO_SIZE;
             offset += MAX_IO_SIZE;
         }
-        // wait unlock
-        off_t moffset = -1;
+        if (!m_dedup_table.empty())
+            return pwrite_dedup(buf, count, offset) < 0 ? -1 : bytes;
+        if (m_zero_detect)
+            return pwrite_zero_detect(buf, count, offset) < 0 ? -1 : bytes;
+        return do_pwrite(buf, count, offset) < 0 ? -1 : bytes;
+    }
+
+    int do_pwrite(const void *buf, size_t count, off_t offset, const uint64_t *hashes = nullptr) {
+        iovec v{(void *)buf, count};
+        return do_pwritev(&v, 1, count, offset, hashes);
+    }
+
+    // the 4K blocks written are remembered for dedup by their `hashes`, if any
+    int do_pwritev(const struct iovec *iov, int iovcnt, size_t count, off_t offset,
+                   const uint64_t *hashes = nullptr) {
+        // the data file is not switched by compact_online() till the write is published
+        photon::scoped_rwlock files_lock(m_files_lock, photon::RLOCK);
+        uint64_t moffset, ticket;
         {
             Lock lock(m_rw_mtx);
-            moffset = append(m_files[m_rw_tag], buf, count);
-            if (moffset == 0)
-                return -1;
-            m_vsize = max(m_vsize, count + offset);
-            if (m_vsize < count + offset) {
-                LOG_INFO("resize m_visze: `->`", m_vsize, count + offset);
+            moffset = m_data_offset;
+            m_data_offset += count / ALIGNMENT;
+            ticket = m_writes_reserved++;
+        }
+        auto ret = m_files[m_rw_tag]->pwritev(iov, iovcnt, moffset * ALIGNMENT);
+
+        Lock lock(m_rw_mtx);
+        while (m_writes_published != ticket)
+            m_publish_cv.wait(lock);
+        DEFER({
+            m_writes_published++;
+            m_published_offset = moffset + count / ALIGNMENT;
+            m_publish_cv.notify_all();
+        });
+        if (ret < (ssize_t)count) {
+            LOG_ERRNO_RETURN(0, -1, "pwritev failed, ret:`, moffset:`, count:`", ret,
+                             moffset * ALIGNMENT, count);
+        }
+        m_vsize = max(m_vsize, count + offset);
+        SegmentMapping m{
+            (uint64_t)offset / (uint64_t)ALIGNMENT,
+            (uint32_t)count / (uint32_t)ALIGNMENT,
+            moffset,
+        };
+        m.tag = m_rw_tag;
+        assert(m.length > (uint32_t)0);
+        insert_write(m);
+        if (hashes && !m_dedup_table.empty()) {
+            for (size_t i = 0; i < count / ALIGNMENT4K; i++) {
+                auto &e = m_dedup_table[hashes[i] % m_dedup_table.size()];
+                e = {hashes[i], moffset + i * ALIGNMENT4K / ALIGNMENT};
             }
-            SegmentMapping m{
-                (uint64_t)offset / (uint64_t)ALIGNMENT,
-                (uint32_t)count / (uint32_t)ALIGNMENT,
-                (uint64_t)moffset / (uint64_t)ALIGNMENT,
-            };
-            m.tag = m_rw_tag;
-            assert(m.length > (uint32_t)0);
-            m_data_offset = m.mend();
+        }
+        return 0;
+    }
+
+    // a write right after the last one, both in the logical and the data
+    // file, e.g. of a guest writing sequentially, extends its mapping instead
+    // of adding one, which replaces it in the mapping buffer if still there
+    void insert_write(const SegmentMapping &m) {
+        auto &l = m_last_write;
+        if (l.length > 0 && l.end() == m.offset && l.mend() == m.moffset && l.tag == m.tag &&
+            (uint32_t)(l.length + m.length) <= Segment::MAX_LENGTH_V1) {
+            l.length += m.length;
+            static_cast<IMemoryIndex0 *>(m_index)->insert(l);
+            if (m_last_stacked && nmapping > 0) {
+                m_stacked_mappings[nmapping - 1] = l;
+                return;
+            }
+        } else {
+            l = m;
             static_cast<IMemoryIndex0 *>(m_index)->insert(m);
-            append_index(m);
         }
+        append_index(l);
+        m_last_stacked = nmapping > 0;
+    }
+
+    // split the buffer into runs of zero and non-zero blocks, where
+    // the zero runs are only recorded in index as discarded mappings
+    int pwrite_zero_detect(const void *buf, size_t count, off_t offset) {
+        auto ptr = (const char *)buf;
+        const size_t max_run = Segment::MAX_LENGTH_V1 * ALIGNMENT;
+        size_t i = 0;
+        while (i < count) {
+            bool zero = is_zero_block(ptr + i, ALIGNMENT);
+            size_t j = i + ALIGNMENT;
+            while (j < count && j - i < max_run && is_zero_block(ptr + j, ALIGNMENT) == zero)
+                j += ALIGNMENT;
+            if (!zero) {
+                if (do_pwrite(ptr + i, j - i, offset + i) < 0)
+                    return -1;
+            } else {
+                SegmentMapping m{
+                    (uint64_t)(offset + i) / (uint64_t)ALIGNMENT,
+                    (uint32_t)(j - i) / (uint32_t)ALIGNMENT,
+                    0,
+                };
+                m.discard();
+                discard(m);
+                m_vsize = max(m_vsize, offset + j);
+            }
+            i = j;
+        }
+        return 0;
+    }
 
-        return bytes;
+    // the 4K blocks that equal the ones at their offsets are skipped, and the
+    // ones that equal remembered blocks are mapped to their data, while the
+    // runs of the others are written, and remembered, as usual
+    int pwrite_dedup(const void *buf, size_t count, off_t offset) {
+        if (((offset | count) & (ALIGNMENT4K - 1)) != 0)
+            return m_zero_detect ? pwrite_zero_detect(buf, count, offset)
+                                 : do_pwrite(buf, count, offset);
+        enum Kind : uint8_t { SAME, ZERO, DATA };
+        auto ptr = (const char *)buf;
+        auto n = count / ALIGNMENT4K;
+        vector<Kind> kinds(n);
+        vector<uint64_t> hashes(n);
+        const size_t CHUNK = 64 * 1024;
+        ALIGNED_MEM4K(cur, CHUNK);
+        for (size_t i = 0; i < count; i += CHUNK) {
+            auto len = min(CHUNK, count - i);
+            if (pread(cur, len, offset + i) < (ssize_t)len)
+                LOG_ERRNO_RETURN(0, -1, "failed to read the blocks to be overwritten");
+            for (size_t j = i; j < i + len; j += ALIGNMENT4K) {
+                auto &k = kinds[j / ALIGNMENT4K];
+                if (memcmp(cur + j - i, ptr + j, ALIGNMENT4K) == 0) {
+                    k = SAME;
+                } else if (m_zero_detect && is_zero_block(ptr + j, ALIGNMENT4K)) {
+                    k = ZERO;
+                } else {
+                    k = DATA;
+                    hashes[j / ALIGNMENT4K] = hash_block(ptr + j);
+                }
+            }
+        }
+        const size_t max_run = Segment::MAX_LENGTH_V1 * ALIGNMENT / ALIGNMENT4K;
+        size_t i = 0;
+        while (i < n) {
+            auto k = kinds[i];
+            int shared = 0;
+            if (k == DATA && (shared = share_block(ptr + i * ALIGNMENT4K, hashes[i],
+                                                   offset + i * ALIGNMENT4K)) != 0) {
+                if (shared < 0)
+                    return -1;
+                i++;
+                continue;
+            }
+            if (k == SAME) {
+                i++;
+                continue;
+            }
+            size_t j = i + 1;
+            for (; j < n && j - i < max_run && kinds[j] == k; j++) {
+                if (k == DATA && (shared = share_block(ptr + j * ALIGNMENT4K, hashes[j],
+                                                       offset + j * ALIGNMENT4K)) != 0)
+                    break;
+            }
+            if (shared < 0)
+                return -1;
+            auto run = (j - i) * ALIGNMENT4K, pos = i * ALIGNMENT4K;
+            if (k == DATA) {
+                if (do_pwrite(ptr + pos, run, offset + pos, &hashes[i]) < 0)
+                    return -1;
+            } else {
+                SegmentMapping m{
+                    (uint64_t)(offset + pos) / (uint64_t)ALIGNMENT,
+                    (uint32_t)run / (uint32_t)ALIGNMENT,
+                    0,
+                };
+                m.discard();
+                discard(m);
+            }
+            i = shared ? j + 1 : j;
+        }
+        Lock lock(m_rw_mtx);
+        m_vsize = max(m_vsize, offset + count);
+        return 0;
+    }
+
+    // maps the 4K `block` at `offset` to a remembered one of the same data
+    // and returns 1, or returns 0 if there is none
+    int share_block(const char *block, uint64_t hash, off_t offset) {
+        photon::scoped_rwlock files_lock(m_files_lock, photon::RLOCK);
+        if (m_dedup_table.empty())
+            return 0;
+        auto e = m_dedup_table[hash % m_dedup_table.size()];
+        if (e.moffset == 0 || e.hash != hash)
+            return 0;
+        ALIGNED_MEM4K(data, ALIGNMENT4K);
+        if (m_files[m_rw_tag]->pread(data, ALIGNMENT4K, e.moffset * ALIGNMENT) <
+            (ssize_t)ALIGNMENT4K)
+            LOG_ERRNO_RETURN(0, -1, "failed to read the block at `", e.moffset * ALIGNMENT);
+        if (memcmp(data, block, ALIGNMENT4K) != 0)
+            return 0;
+        Lock lock(m_rw_mtx);
+        // mappings made during compaction would be relocated by their offsets
+        if (m_compacting)
+            return 0;
+        SegmentMapping m{
+            (uint64_t)offset / (uint64_t)ALIGNMENT,
+            (uint32_t)(ALIGNMENT4K / ALIGNMENT),
+            e.moffset,
+        };
+        m.tag = m_rw_tag;
+        insert_write(m);
+        return 1;
     }
 
 #ifndef FALLOC_FL_KEEP_SIZE
@@ -724,7 +1565,7 @@ public:
 #define FALLOC_FL_PUNCH_HOLE 0x02 /* de-allocates range */
 #endif
     virtual int fallocate(int mode, off_t offset, off_t len) override {
-        auto max_length_bytes = Segment::MAX_LENGTH * ALIGNMENT;
+        auto max_length_bytes = Segment::MAX_LENGTH_V1 * ALIGNMENT;
 
         while (len > max_length_bytes) {
             auto ret = this->fallocate(mode, offset, max_length_bytes);
@@ -747,13 +1588,138 @@ public:
     }
 
     virtual int discard(SegmentMapping &m) {
-        off_t pos = m_files[m_rw_tag]->lseek(0, SEEK_END);
-        m.moffset = (uint64_t)(pos / ALIGNMENT);
+        Lock lock(m_rw_mtx);
+        m.moffset = m_published_offset;
         m.tag = m_rw_tag;
         LOG_DEBUG(m);
         static_cast<IMemoryIndex0 *>(m_index)->insert(m);
-        Lock lock(m_rw_mtx);
         append_index(m);
+        m_last_write = SegmentMapping::invalid_mapping();
+        return 0;
+    }
+
+    virtual int compact_online(IFile *fdata, IFile *findex, uint64_t max_MBps,
+                               const int *running) override {
+        if (!fdata || !findex)
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid file ptr, fdata: `, findex: `", fdata, findex);
+        if (m_compacting)
+            LOG_ERROR_RETURN(EBUSY, -1, "online compaction is already running");
+        m_compacting = true;
+        DEFER(m_compacting = false);
+        auto index0 = (IMemoryIndex0 *)m_index;
+        auto src = m_files[m_rw_tag];
+
+        // data file is append-only, so the live segments in the snapshot
+        // remain valid to read while new writes are going on, and the ones
+        // in progress are beyond the end of the published
+        unique_ptr<SegmentMapping[]> snapshot;
+        size_t nsnapshot;
+        off_t snapshot_end;
+        {
+            Lock lock(m_rw_mtx);
+            snapshot.reset(index0->dump());
+            nsnapshot = index0->size();
+            snapshot_end = m_published_offset * ALIGNMENT;
+        }
+        LOG_INFO("online compaction started, segments: `, data size: `", nsnapshot, snapshot_end);
+        if (copy_range(src, fdata, 0, HeaderTrailer::SPACE) < 0 ||
+            copy_range(m_findex, findex, 0, HeaderTrailer::SPACE) < 0)
+            LOG_ERROR_RETURN(0, -1, "failed to copy headers");
+
+        CommitArgs args(fdata);
+        CompactOptions opts;
+        opts.src_files = &m_files[0];
+        opts.n = m_files.size();
+        opts.commit_args = &args;
+        opts.io_usleep_time = max_MBps ? (32UL * 1024 * 1000000) / (max_MBps << 20) : 0;
+        opts.running = running;
+        vector<SegmentMapping> compacted;
+        uint64_t moffset = HeaderTrailer::SPACE / ALIGNMENT;
+        for (auto &m : ptr_array(snapshot.get(), nsnapshot)) {
+            if (m.zeroed)
+                continue;
+            auto ret = pcopy(opts, m, moffset, compacted);
+            if (ret < 0)
+                LOG_ERROR_RETURN(0, -1, "failed to copy live segment `", m);
+            moffset += ret;
+        }
+        snapshot.reset();
+        unique_ptr<IMemoryIndex> cindex;
+        if (!compacted.empty()) {
+            auto p = new SegmentMapping[compacted.size()];
+            std::copy(compacted.begin(), compacted.end(), p);
+            cindex.reset(create_memory_index(p, compacted.size(), 0, UINT64_MAX, true));
+            if (!cindex)
+                LOG_ERROR_RETURN(0, -1, "failed to create index of compacted segments");
+        }
+
+        // block reads and writes, after the ones in progress, to catch up with
+        // the writes during copying
+        photon::scoped_rwlock files_lock(m_files_lock, photon::WLOCK);
+        Lock lock(m_rw_mtx);
+        off_t src_end = max(src->lseek(0, SEEK_END), snapshot_end);
+        off_t tail = fdata->lseek(0, SEEK_END);
+        if (copy_range(src, fdata, snapshot_end, src_end - snapshot_end) < 0)
+            LOG_ERROR_RETURN(0, -1, "failed to copy data written during compaction");
+        unique_ptr<SegmentMapping[]> current(index0->dump());
+        vector<SegmentMapping> mappings;
+        for (auto m : ptr_array(current.get(), index0->size())) {
+            if (m.zeroed) {
+                m.moffset = HeaderTrailer::SPACE / ALIGNMENT; // must be within the new data file
+                mappings.push_back(m);
+            } else if (m.moffset * ALIGNMENT >= (uint64_t)snapshot_end) {
+                m.moffset = m.moffset - snapshot_end / ALIGNMENT + tail / ALIGNMENT;
+                mappings.push_back(m);
+            } else if (relocate(cindex.get(), m, mappings) < 0) {
+                return -1;
+            }
+        }
+        if (!mappings.empty()) {
+            vector<SegmentMapping> v1(mappings);
+            mappings_to_v1(v1.data(), v1.size());
+            auto bytes = v1.size() * sizeof(SegmentMapping);
+            if (findex->write(v1.data(), bytes) < (ssize_t)bytes)
+                LOG_ERRNO_RETURN(0, -1, "failed to write index");
+        }
+        if (fdata->fdatasync() < 0 || findex->fdatasync() < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to sync compacted files");
+
+        for (auto &m : mappings)
+            index0->insert(m);
+        nmapping = 0; // grouped mappings of the old index file are all in `mappings`
+        m_last_write = SegmentMapping::invalid_mapping();
+        // the remembered blocks are in the old data file
+        std::fill(m_dedup_table.begin(), m_dedup_table.end(), DedupEntry{0, 0});
+        auto old_data = m_files[m_rw_tag];
+        auto old_index = m_findex;
+        m_files[m_rw_tag] = fdata;
+        m_findex = findex;
+        m_data_offset = m_published_offset = fdata->lseek(0, SEEK_END) / ALIGNMENT;
+        LOG_INFO("online compaction done, data size: ` -> `", src_end, m_data_offset * ALIGNMENT);
+        if (m_file_ownership) {
+            delete old_data;
+            delete old_index;
+        }
+        return 0;
+    }
+
+    // translate `m`, which was written before the snapshot of compaction,
+    // into the segments copied to the compacted data file
+    int relocate(IMemoryIndex *cindex, const SegmentMapping &m, vector<SegmentMapping> &out) {
+        Segment s{m.offset, m.length};
+        SegmentMapping pm[16];
+        while (s.length > 0) {
+            auto n = cindex ? cindex->lookup(s, pm, 16) : 0;
+            if (n == 0 || pm[0].offset != s.offset)
+                LOG_ERROR_RETURN(EIO, -1, "segment ` is missing in compacted data", m);
+            for (size_t i = 0; i < n; i++) {
+                if (i > 0 && pm[i].offset != pm[i - 1].end())
+                    LOG_ERROR_RETURN(EIO, -1, "segment ` is missing in compacted data", m);
+                pm[i].tag = m.tag;
+                out.push_back(pm[i]);
+            }
+            s.forward_offset_to(pm[n - 1].end());
+        }
         return 0;
     }
 
@@ -778,10 +1744,12 @@ public:
     virtual int close_seal(IFileRO **reopen_as = nullptr) override {
         auto m_index0 = (IMemoryIndex0 *)m_index;
         unique_ptr<SegmentMapping[]> mapping(m_index0->dump(ALIGNMENT));
+        unique_ptr<SegmentMapping[]> v1(m_index0->dump(ALIGNMENT));
+        mappings_to_v1(v1.get(), m_index0->size());
         uint64_t index_offset = m_files[m_rw_tag]->lseek(0, SEEK_END);
         ssize_t index_bytes = m_index0->size() * sizeof(SegmentMapping);
         index_bytes = (index_bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
-        auto ret = m_files[m_rw_tag]->write(mapping.get(), index_bytes);
+        auto ret = m_files[m_rw_tag]->write(v1.get(), index_bytes);
         if (ret < index_bytes)
             LOG_ERRNO_RETURN(0, -1, "failed to write index.");
 
@@ -811,7 +1779,9 @@ public:
         return close();
     }
 
-    virtual int fsync() override {
+    // the data file is synced before the index file, so that the index
+    // never maps data that is lost
+    int do_fsync() {
         {
             Lock lock(m_rw_mtx);
             auto commit_ret = do_group_commit_mappings();
@@ -819,11 +1789,32 @@ public:
                 return commit_ret;
             }
         }
-        m_files[m_rw_tag]->fsync();
-        if (m_findex)
-            m_findex->fsync();
+        photon::scoped_rwlock lock(m_files_lock, photon::RLOCK);
+        if (m_files[m_rw_tag]->fdatasync() < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to sync data file");
+        if (m_findex && m_findex->fdatasync() < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to sync index file");
         return 0;
     }
+
+    // a caller waits for the sync in progress, if any, which may not cover
+    // its writes, and then shares the next one with the others waiting
+    virtual int fsync() override {
+        auto target = m_sync_issued + 1;
+        while (m_sync_done < target) {
+            if (m_syncing) {
+                m_sync_cv.wait_no_lock();
+                continue;
+            }
+            m_syncing = true;
+            auto issued = ++m_sync_issued;
+            m_sync_ret = do_fsync();
+            m_sync_done = issued;
+            m_syncing = false;
+            m_sync_cv.notify_all();
+        }
+        return m_sync_ret;
+    }
     virtual int fdatasync() override {
         return fsync();
     }
@@ -837,6 +1828,16 @@ public:
         return 0;
     }
 
+    virtual int layer_data_size(size_t i, uint64_t &size) const override {
+        if (i != m_rw_tag)
+            return LSMTReadOnlyFile::layer_data_size(i, size);
+        struct stat buf;
+        if (m_files[m_rw_tag]->fstat(&buf) != 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to fstat()");
+        size = buf.st_size - HeaderTrailer::SPACE;
+        return 0;
+    }
+
     virtual DataStat data_stat() const override {
         struct stat buf;
         auto ret = m_files[m_rw_tag]->fstat(&buf);
@@ -866,37 +1867,74 @@ HeaderTrailer *verify_ht(IFile *file, char *buf) {
     return pht;
 }
 
-static SegmentMapping *do_load_index(IFile *file, HeaderTrailer *pheader_trailer, bool trailer) {
-    ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+// verify the header and the trailer of a sealed layer, returning the trailer
+// read into `buf` of HeaderTrailer::SPACE bytes
+static HeaderTrailer *verify_trailer(IFile *file, char *buf) {
     auto pht = verify_ht(file, buf);
     if (pht == nullptr)
         return nullptr;
+    if (!pht->is_data_file())
+        LOG_ERROR_RETURN(0, nullptr, "uncognized file type");
     struct stat stat;
     auto ret = file->fstat(&stat);
     if (ret < 0)
         LOG_ERRNO_RETURN(0, nullptr, "failed to stat file.");
 
+    auto trailer_offset = stat.st_size - HeaderTrailer::SPACE;
+    ret = file->pread(buf, HeaderTrailer::SPACE, trailer_offset);
+    if (ret < (ssize_t)HeaderTrailer::SPACE)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to read file trailer.");
+
+    if (!pht->verify_magic() || !pht->is_trailer() || !pht->is_data_file() || !pht->is_sealed())
+        LOG_ERROR_RETURN(0, nullptr,
+                         "trailer magic, trailer type, "
+                         "file type or sealedness doesn't match");
+    LOG_DEBUG("index_size: `, trailer offset: `", pht->index_size + 0, trailer_offset);
+    if (pht->index_offset > (uint64_t)trailer_offset ||
+        (!pht->is_index_encoded() &&
+         pht->index_size * sizeof(SegmentMapping) > trailer_offset - pht->index_offset))
+        LOG_ERROR_RETURN(0, nullptr, "invalid index bytes or size");
+    return pht;
+}
+
+// the encoded index is all the way to the trailer
+static SegmentMapping *load_encoded_index(IFile *file, HeaderTrailer *pht,
+                                          HeaderTrailer *pheader_trailer) {
+    struct stat stat;
+    if (file->fstat(&stat) < 0)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to stat file.");
+    size_t index_bytes = stat.st_size - HeaderTrailer::SPACE - pht->index_offset;
+    unique_ptr<char[]> buf(new char[index_bytes]);
+    if (file->pread(buf.get(), index_bytes, pht->index_offset) < (ssize_t)index_bytes)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to read index.");
+    unique_ptr<SegmentMapping[]> p(new SegmentMapping[pht->index_size]);
+    if (decode_index(buf.get(), index_bytes, p.get(), pht->index_size) < 0)
+        return nullptr;
+    if (pheader_trailer)
+        *pheader_trailer = *pht;
+    return p.release();
+}
+
+static SegmentMapping *do_load_index(IFile *file, HeaderTrailer *pheader_trailer, bool trailer) {
+    ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+    HeaderTrailer *pht;
     uint64_t index_bytes;
+    ssize_t ret;
     if (trailer) {
-        if (!pht->is_data_file())
-            LOG_ERROR_RETURN(0, nullptr, "uncognized file type");
-
-        auto trailer_offset = stat.st_size - HeaderTrailer::SPACE;
-        ret = file->pread(buf, HeaderTrailer::SPACE, trailer_offset);
-        if (ret < (ssize_t)HeaderTrailer::SPACE)
-            LOG_ERRNO_RETURN(0, nullptr, "failed to read file trailer.");
-
-        if (!pht->verify_magic() || !pht->is_trailer() || !pht->is_data_file() || !pht->is_sealed())
-            LOG_ERROR_RETURN(0, nullptr,
-                             "trailer magic, trailer type, "
-                             "file type or sealedness doesn't match");
-        LOG_DEBUG("index_size: `, trailer offset: `", pht->index_size + 0, trailer_offset);
+        pht = verify_trailer(file, buf);
+        if (pht == nullptr)
+            return nullptr;
+        if (pht->is_index_encoded())
+            return load_encoded_index(file, pht, pheader_trailer);
         index_bytes = pht->index_size * sizeof(SegmentMapping);
-
-        if (index_bytes > trailer_offset - pht->index_offset)
-            LOG_ERROR_RETURN(0, nullptr, "invalid index bytes or size");
-
     } else {
+        pht = verify_ht(file, buf);
+        if (pht == nullptr)
+            return nullptr;
+        struct stat stat;
+        ret = file->fstat(&stat);
+        if (ret < 0)
+            LOG_ERRNO_RETURN(0, nullptr, "failed to stat file.");
         if (!pht->is_index_file() || pht->is_sealed())
             LOG_ERROR_RETURN(0, nullptr, "file type or sealedness wrong");
         if (pht->index_offset != HeaderTrailer::SPACE)
@@ -912,6 +1950,8 @@ static SegmentMapping *do_load_index(IFile *file, HeaderTrailer *pheader_trailer
         free(ibuf);
         LOG_ERROR_RETURN(0, nullptr, "failed to read index.");
     }
+    if (!pht->is_index_v2())
+        mappings_from_v1(ibuf, pht->index_size);
 
     size_t index_size = 0;
     for (size_t i = 0; i < pht->index_size; ++i)
@@ -931,22 +1971,97 @@ static SegmentMapping *do_load_index(IFile *file, HeaderTrailer *pheader_trailer
     return p;
 }
 
-static LSMTReadOnlyFile *open_file_ro(IFile *file, bool ownership, bool reserve_tag) {
-    if (!file) {
-        LOG_ERROR("invalid file ptr. file: `", file);
+static bool mmap_index = false;
+void set_mmap_index(bool enable) {
+    mmap_index = enable;
+}
+
+// map the `n` mappings at `offset` of `file`, if it is a local file, and
+// validate them once: the ones of v1 are converted, the padding at the end
+// is dropped, the tags are reset to 0 if `ntags` is 0 or must be less than
+// it otherwise, and the order and the mapped offsets are verified by
+// create_mapped_index(); the mapping is private, so that the changes are not
+// written back to the file; return nullptr if not mapped, for the caller to
+// read the mappings instead
+static IMemoryIndex *map_index(IFile *file, uint64_t offset, size_t n, uint64_t moffset_begin,
+                               uint64_t moffset_end, size_t ntags, bool v2) {
+    auto fd = (int)(uint64_t)file->get_underlay_object();
+    if (fd <= 0 || n == 0)
         return nullptr;
+    static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    auto begin = offset / page_size * page_size;
+    auto length = offset - begin + n * sizeof(SegmentMapping);
+    auto addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, begin);
+    if (addr == MAP_FAILED) {
+        LOG_WARN("failed to mmap index of fd `, `: `, read it instead", fd, errno,
+                 strerror(errno));
+        return nullptr;
+    }
+    auto p = (SegmentMapping *)((char *)addr + (offset - begin));
+    if (!v2)
+        mappings_from_v1(p, n);
+    while (n > 0 && p[n - 1].offset == SegmentMapping::INVALID_OFFSET)
+        n--;
+    size_t i = 0;
+    for (; i < n; i++) {
+        if (p[i].offset == SegmentMapping::INVALID_OFFSET)
+            break;
+        if (ntags == 0) {
+            if (p[i].tag != 0)
+                p[i].tag = 0;
+        } else if (p[i].tag >= ntags) {
+            break;
+        }
+    }
+    auto pi = (i == n) ? create_mapped_index(p, n, moffset_begin, moffset_end, addr, length)
+                       : nullptr;
+    if (!pi) {
+        munmap(addr, length);
+        LOG_WARN("invalid mapping in the mapped index of fd `, read it instead", fd);
     }
+    return pi;
+}
 
-    HeaderTrailer ht;
-    auto p = do_load_index(file, &ht, true);
+// load the index of a sealed layer, mapped from the file if enabled
+static IMemoryIndex *load_index(IFile *file, HeaderTrailer *pht) {
+    if (mmap_index) {
+        ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+        auto p = verify_trailer(file, buf);
+        if (!p)
+            LOG_ERROR_RETURN(EIO, nullptr, "failed to load index from file.");
+        // an encoded index is decoded instead
+        IMemoryIndex *pi = nullptr;
+        if (!p->is_index_encoded())
+            pi = map_index(file, p->index_offset, p->index_size, HeaderTrailer::SPACE / ALIGNMENT,
+                           p->index_offset / ALIGNMENT, 0, p->is_index_v2());
+        if (pi) {
+            *pht = *p;
+            pht->index_size = pi->size();
+            return pi;
+        }
+    }
+    auto p = do_load_index(file, pht, true);
     if (!p)
         LOG_ERROR_RETURN(EIO, nullptr, "failed to load index from file.");
-    auto pi = create_memory_index(p, ht.index_size, HeaderTrailer::SPACE / ALIGNMENT,
-                                  ht.index_offset / ALIGNMENT);
+    auto pi = create_memory_index(p, pht->index_size, HeaderTrailer::SPACE / ALIGNMENT,
+                                  pht->index_offset / ALIGNMENT);
     if (!pi) {
         delete[] p;
         LOG_ERROR_RETURN(0, nullptr, "failed to create memory index!");
     }
+    return pi;
+}
+
+static LSMTReadOnlyFile *open_file_ro(IFile *file, bool ownership, bool reserve_tag) {
+    if (!file) {
+        LOG_ERROR("invalid file ptr. file: `", file);
+        return nullptr;
+    }
+
+    HeaderTrailer ht;
+    auto pi = load_index(file, &ht);
+    if (!pi)
+        return nullptr;
     auto rst = new LSMTReadOnlyFile;
     rst->m_index = pi;
     rst->m_files = {file};
@@ -963,6 +2078,37 @@ IFileRO *open_file_ro(IFile *file, bool ownership) {
     return open_file_ro(file, ownership, true);
 }
 
+int live_ranges(IFile *file, vector<pair<uint64_t, uint64_t>> &out) {
+    struct stat st;
+    if (file->fstat(&st) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to stat the layer");
+    unique_ptr<LSMTReadOnlyFile> ro(open_file_ro(file, false, true));
+    if (!ro)
+        LOG_ERROR_RETURN(0, -1, "failed to open the layer");
+    uint64_t data_size;
+    if (ro->layer_data_size(0, data_size) < 0)
+        return -1;
+    // as [begin, end)
+    vector<pair<uint64_t, uint64_t>> ranges;
+    ranges.emplace_back(0, HeaderTrailer::SPACE);
+    auto m = ro->m_index->buffer();
+    for (size_t i = 0; i < ro->m_index->size(); i++) {
+        if (!m[i].zeroed)
+            ranges.emplace_back(m[i].moffset * ALIGNMENT, m[i].mend() * ALIGNMENT);
+    }
+    ranges.emplace_back(HeaderTrailer::SPACE + data_size, st.st_size);
+    sort(ranges.begin(), ranges.end());
+    out.clear();
+    for (auto &r : ranges) {
+        if (!out.empty() && r.first <= out.back().first + out.back().second) {
+            out.back().second = max(out.back().second, r.second - out.back().first);
+            continue;
+        }
+        out.emplace_back(r.first, r.second - r.first);
+    }
+    return 0;
+}
+
 IFileRW *open_file_rw(IFile *fdata, IFile *findex, bool ownership) {
     ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
     auto pht = verify_ht(fdata, buf);
@@ -993,6 +2139,7 @@ IFileRW *open_file_rw(IFile *fdata, IFile *findex, bool ownership) {
     rst->m_index = pi;
     rst->m_findex = findex;
     rst->m_files.push_back(fdata);
+    rst->m_data_offset = rst->m_published_offset = (stat.st_size + ALIGNMENT - 1) / ALIGNMENT;
     rst->m_vsize = pht->virtual_size;
     rst->m_file_ownership = ownership;
     UUID raw;
@@ -1003,6 +2150,36 @@ IFileRW *open_file_rw(IFile *fdata, IFile *findex, bool ownership) {
     return rst;
 }
 
+int clone_file_rw(IFile *src_data, IFile *src_index, IFile *dst_data, IFile *dst_index) {
+    ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+    // the header of compressed data is read through its units
+    unique_ptr<IFile> plain;
+    if (ZFile::is_zfile_append(src_data) == 1) {
+        plain.reset(ZFile::zfile_open_append(src_data, false));
+        if (!plain)
+            return -1;
+    }
+    auto pht = verify_ht(plain ? plain.get() : src_data, buf);
+    if (!pht)
+        return -1;
+    if (!pht->is_data_file() || pht->is_sealed())
+        LOG_ERROR_RETURN(EINVAL, -1, "not the data file of a writable layer");
+    pht = verify_ht(src_index, buf);
+    if (!pht)
+        return -1;
+    if (!pht->is_index_file())
+        LOG_ERROR_RETURN(EINVAL, -1, "not the index file of a writable layer");
+    // the index first, so that the data cloned covers all that it maps
+    bool index_reflinked, data_reflinked;
+    if (clone_localfile(src_index, dst_index, &index_reflinked) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to clone the index file");
+    if (clone_localfile(src_data, dst_data, &data_reflinked) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to clone the data file");
+    LOG_INFO("writable layer cloned, index `, data `", index_reflinked ? "reflinked" : "copied",
+             data_reflinked ? "reflinked" : "copied");
+    return 0;
+}
+
 IFileRW *create_file_rw(const LayerInfo &args, bool ownership) {
     auto fdata = args.fdata;
     auto findex = args.findex;
@@ -1083,23 +2260,196 @@ void *do_parallel_load_index(void *param) {
             // error occured from another threads.
             return nullptr;
         }
-        auto p = do_load_index(job->get_file(), &job->ht, true);
-        if (!p) {
-            job->set_error(EIO);
-            LOG_ERROR_RETURN(0, nullptr, "failed to load index from `-th file", job->i);
-        }
-        auto pi = create_memory_index(p, job->ht.index_size, HeaderTrailer::SPACE / ALIGNMENT,
-                                      job->ht.index_offset / ALIGNMENT);
+        auto pi = load_index(job->get_file(), &job->ht);
         if (!pi) {
-            delete[] p;
             job->set_error(EIO);
-            LOG_ERROR_RETURN(0, nullptr, "failed to create memory index!");
+            LOG_ERROR_RETURN(0, nullptr, "failed to load index from `-th file", job->i);
         }
         job->set_index(pi);
     }
     return NULL;
 }
 
+// the index of the layers opened by open_files_ro_lazy(), `files[0]` being
+// the top layer, whose indexes are loaded by background threads from the top
+// down, or a layer that a lookup is waiting for first; a lookup waits only
+// for the layers it reaches, from the top down till its range is covered,
+// and once all are loaded, they are merged and lookups are served by it
+class LazyIndex : public IMemoryIndex {
+public:
+    // the tag of ranges in layers whose indexes failed to be loaded
+    static const uint16_t FAILED_TAG = UINT16_MAX;
+
+    LazyIndex(const vector<IFile *> &files) : m_files(files) {
+        m_layers.resize(files.size());
+        m_state.resize(files.size(), NONE);
+        m_start = photon::now;
+        auto n = min(PARALLEL_LOAD_INDEX, (int)files.size());
+        for (int i = 0; i < n; i++) {
+            auto th = photon::thread_create11(&LazyIndex::load_layers, this);
+            m_loaders.push_back(photon::thread_enable_join(th));
+        }
+    }
+
+    ~LazyIndex() {
+        m_stopping = true;
+        for (auto th : m_loaders)
+            photon::thread_join(th);
+    }
+
+    virtual size_t lookup(Segment s, SegmentMapping *pm, size_t n) const override {
+        if (m_merged)
+            return m_merged->lookup(s, pm, n);
+        if (s.length == 0)
+            return 0;
+        vector<SegmentMapping> found;
+        vector<Segment> holes{s}, rest;
+        for (size_t i = 0; i < m_layers.size() && !holes.empty(); i++) {
+            bool ok = wait_for_layer(i);
+            // the layers are merged, and released, while waiting
+            if (m_merged)
+                return m_merged->lookup(s, pm, n);
+            if (!ok) {
+                for (auto &h : holes)
+                    found.push_back(SegmentMapping(h.offset, h.length, 0, FAILED_TAG));
+                break;
+            }
+            rest.clear();
+            for (auto &h : holes)
+                lookup_layer(i, h, found, rest);
+            holes.swap(rest);
+        }
+        sort(found.begin(), found.end(),
+             [](const SegmentMapping &a, const SegmentMapping &b) { return a.offset < b.offset; });
+        auto m = min(n, found.size());
+        copy(found.begin(), found.begin() + m, pm);
+        return m;
+    }
+
+    // the merged index is needed by the following, which wait for it
+
+    virtual size_t size() const override {
+        wait_for_merged();
+        return m_merged ? m_merged->size() : 0;
+    }
+    virtual const SegmentMapping *buffer() const override {
+        wait_for_merged();
+        return m_merged ? m_merged->buffer() : nullptr;
+    }
+    virtual SegmentMapping front() const override {
+        wait_for_merged();
+        return m_merged ? m_merged->front() : SegmentMapping::invalid_mapping();
+    }
+    virtual SegmentMapping back() const override {
+        wait_for_merged();
+        return m_merged ? m_merged->back() : SegmentMapping::invalid_mapping();
+    }
+    virtual int increase_tag(int delta) override {
+        wait_for_merged();
+        if (!m_merged)
+            LOG_ERROR_RETURN(EIO, -1, "indexes of the layers are not loaded");
+        return m_merged->increase_tag(delta);
+    }
+    // not to wait, as it's asked by fstat()
+    virtual uint64_t block_count() const override {
+        return m_merged ? m_merged->block_count() : 0;
+    }
+
+protected:
+    enum State : uint8_t { NONE, LOADING, LOADED, FAILED };
+    vector<IFile *> m_files;
+    vector<unique_ptr<IMemoryIndex>> m_layers;
+    mutable vector<State> m_state;
+    // layers waited for by lookups, to be loaded before the others
+    mutable vector<size_t> m_wanted;
+    size_t m_next = 0, m_done = 0;
+    bool m_failed = false, m_stopping = false;
+    unique_ptr<IMemoryIndex> m_merged;
+    mutable photon::condition_variable m_cv;
+    vector<photon::join_handle *> m_loaders;
+    uint64_t m_start;
+
+    // looks up the range `h` in layer `i`, for the mappings and the holes
+    void lookup_layer(size_t i, Segment h, vector<SegmentMapping> &found,
+                      vector<Segment> &holes) const {
+        const size_t NMAPPING = 16;
+        SegmentMapping pm[NMAPPING];
+        auto offset = h.offset, end = h.end();
+        while (offset < end) {
+            auto n = m_layers[i]->lookup(Segment{offset, (uint32_t)(end - offset)}, pm, NMAPPING);
+            for (size_t k = 0; k < n; k++) {
+                if (pm[k].offset > offset)
+                    holes.push_back(Segment{offset, (uint32_t)(pm[k].offset - offset)});
+                pm[k].tag = i;
+                found.push_back(pm[k]);
+                offset = pm[k].end();
+            }
+            if (n < NMAPPING)
+                break;
+        }
+        if (offset < end)
+            holes.push_back(Segment{offset, (uint32_t)(end - offset)});
+    }
+
+    bool wait_for_layer(size_t i) const {
+        if (m_state[i] == NONE)
+            m_wanted.push_back(i);
+        while (m_state[i] == NONE || m_state[i] == LOADING)
+            m_cv.wait_no_lock();
+        return m_state[i] == LOADED;
+    }
+
+    void wait_for_merged() const {
+        while (!m_merged && m_done < m_layers.size())
+            m_cv.wait_no_lock();
+    }
+
+    int next_layer() {
+        while (!m_wanted.empty()) {
+            auto i = m_wanted.back();
+            m_wanted.pop_back();
+            if (m_state[i] == NONE)
+                return i;
+        }
+        while (m_next < m_state.size() && m_state[m_next] != NONE)
+            m_next++;
+        return m_next < m_state.size() ? (int)m_next : -1;
+    }
+
+    void load_layers() {
+        int i;
+        while (!m_stopping && (i = next_layer()) >= 0) {
+            m_state[i] = LOADING;
+            HeaderTrailer ht;
+            auto pi = load_index(m_files[i], &ht);
+            if (pi) {
+                m_layers[i].reset(pi);
+                m_state[i] = LOADED;
+            } else {
+                LOG_ERROR("failed to load index of layer ` (the top being 0) lazily", i);
+                m_state[i] = FAILED;
+                m_failed = true;
+            }
+            if (++m_done == m_layers.size() && !m_failed)
+                merge();
+            m_cv.notify_all();
+        }
+    }
+
+    void merge() {
+        vector<const IMemoryIndex *> pindexes;
+        for (auto &x : m_layers)
+            pindexes.push_back(x.get());
+        auto merged = merge_memory_indexes(pindexes.data(), pindexes.size());
+        if (!merged)
+            LOG_ERROR_RETURN(0, , "failed to merge indexes loaded lazily");
+        m_merged.reset(merged);
+        m_layers.clear();
+        LOG_INFO("indexes of ` layers loaded lazily and merged in ` ms", m_state.size(),
+                 (photon::now - m_start) / 1000);
+    }
+};
+
 static IMemoryIndex *load_merge_index(vector<IFile *> &files, vector<UUID> &uuid,
                                       HeaderTrailer &ht) {
     photon::join_handle *ths[PARALLEL_LOAD_INDEX];
@@ -1159,6 +2509,266 @@ IFileRO *open_files_ro(IFile **files, size_t n, bool ownership) {
     return rst;
 }
 
+IFileRO *open_files_ro_lazy(IFile **files, size_t n, bool ownership) {
+    if (n > MAX_STACK_LAYERS) {
+        LOG_ERROR_RETURN(0, 0, "open too many files lazily (` > `)", n, MAX_STACK_LAYERS);
+    }
+    if (!files || n == 0)
+        return nullptr;
+
+    // the virtual size is that of the top layer, as open_files_ro() has
+    ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+    auto pht = verify_ht(files[n - 1], buf);
+    if (pht == nullptr)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to read header of the top layer");
+
+    auto rst = new LSMTReadOnlyFile;
+    rst->m_files.assign(files, files + n);
+    std::reverse(rst->m_files.begin(), rst->m_files.end());
+    // UUIDs are not known before the indexes are loaded
+    rst->m_uuid.resize(n);
+    for (auto &x : rst->m_uuid)
+        x.clear();
+    rst->m_vsize = pht->virtual_size;
+    rst->m_file_ownership = ownership;
+    rst->m_index = new LazyIndex(rst->m_files);
+    LOG_INFO("open ` layers, loading their indexes lazily", n);
+    return rst;
+}
+
+struct parallel_read_uuid {
+    IFile **files;
+    UUID *uuid;
+    size_t n, i = 0;
+    int eno = 0;
+};
+
+static void *do_parallel_read_uuid(void *param) {
+    auto t = (parallel_read_uuid *)param;
+    ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+    while (t->i < t->n && t->eno == 0) {
+        auto i = t->i++;
+        auto pht = verify_ht(t->files[i], buf);
+        if (!pht || t->uuid[i].parse(pht->uuid) != 0) {
+            t->eno = EIO;
+            LOG_ERROR_RETURN(0, nullptr, "failed to read UUID of `-th file", i);
+        }
+    }
+    return nullptr;
+}
+
+int read_uuids(IFile **files, size_t n, UUID *uuids) {
+    if (!files || n == 0 || n > MAX_STACK_LAYERS)
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid # of files `", n);
+    parallel_read_uuid tm{files, uuids, n};
+    auto nthreads = min(PARALLEL_LOAD_INDEX, (int)n);
+    vector<photon::join_handle *> ths(nthreads);
+    for (auto &th : ths)
+        th = photon::thread_enable_join(photon::thread_create(&do_parallel_read_uuid, &tm));
+    for (auto th : ths)
+        photon::thread_join(th);
+    if (tm.eno != 0)
+        LOG_ERROR_RETURN(tm.eno, -1, "failed to read UUIDs of the layers");
+    return 0;
+}
+
+// a merged index shared by the files of the same layers, see share_index()
+class SharedIndex : public IMemoryIndex {
+public:
+    shared_ptr<const IMemoryIndex> m_index;
+    SharedIndex(shared_ptr<const IMemoryIndex> index) : m_index(move(index)) {
+    }
+    virtual size_t size() const override {
+        return m_index->size();
+    }
+    virtual const SegmentMapping *buffer() const override {
+        return m_index->buffer();
+    }
+    virtual size_t lookup(Segment s, SegmentMapping *pm, size_t n) const override {
+        return m_index->lookup(s, pm, n);
+    }
+    virtual SegmentMapping front() const override {
+        return m_index->front();
+    }
+    virtual SegmentMapping back() const override {
+        return m_index->back();
+    }
+    virtual int increase_tag(int) override {
+        LOG_ERROR_RETURN(EPERM, -1, "a shared index can't be changed");
+    }
+    virtual uint64_t block_count() const override {
+        return m_index->block_count();
+    }
+};
+
+shared_ptr<const IMemoryIndex> share_index(IFileRO *file) {
+    auto p = dynamic_cast<LSMTReadOnlyFile *>(file);
+    if (!p || !p->m_index || dynamic_cast<LSMTFile *>(file))
+        LOG_ERROR_RETURN(EINVAL, nullptr, "only the index of sealed layers can be shared");
+    if (auto shared = dynamic_cast<SharedIndex *>(p->m_index))
+        return shared->m_index;
+    if (dynamic_cast<LazyIndex *>(p->m_index)) {
+        errno = ENOTSUP; // loaded by each file on its own
+        return nullptr;
+    }
+    shared_ptr<const IMemoryIndex> index(p->m_index);
+    p->m_index = new SharedIndex(index);
+    return index;
+}
+
+IFileRO *open_files_ro_shared(IFile **files, size_t n, const UUID *uuids,
+                              shared_ptr<const IMemoryIndex> index, bool ownership) {
+    if (n > MAX_STACK_LAYERS) {
+        LOG_ERROR_RETURN(0, 0, "open too many files (` > `)", n, MAX_STACK_LAYERS);
+    }
+    if (!files || n == 0 || !uuids || !index)
+        return nullptr;
+
+    // the virtual size is that of the top layer, as open_files_ro() has
+    ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+    auto pht = verify_ht(files[n - 1], buf);
+    if (pht == nullptr)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to read header of the top layer");
+
+    auto rst = new LSMTReadOnlyFile;
+    rst->m_files.assign(files, files + n);
+    std::reverse(rst->m_files.begin(), rst->m_files.end());
+    rst->m_uuid.assign(uuids, uuids + n);
+    std::reverse(rst->m_uuid.begin(), rst->m_uuid.end());
+    rst->m_vsize = pht->virtual_size;
+    rst->m_file_ownership = ownership;
+    rst->m_index = new SharedIndex(move(index));
+    LOG_INFO("open ` layers with shared index of ` mappings", n, rst->m_index->size());
+    return rst;
+}
+
+// the header of a merged index saved by save_merged_index(), followed by the
+// UUIDs of the layers, the top first, whose subscripts are the tags of the
+// mappings, and then the mappings, of v2 if MAGIC0_V2(), or v1 otherwise
+struct MergedIndexHeader {
+    static const uint32_t SPACE = 4096;
+    static uint64_t MAGIC0() {
+        static char magic0[] = "LSMTmi\1";
+        return *(uint64_t *)magic0;
+    }
+    static uint64_t MAGIC0_V2() {
+        static char magic0[] = "LSMTmi\2";
+        return *(uint64_t *)magic0;
+    }
+    uint64_t magic0 = MAGIC0();
+    uint32_t size = sizeof(MergedIndexHeader);
+    uint32_t nlayers;
+    uint64_t uuid_offset;  // in bytes
+    uint64_t index_offset; // in bytes
+    uint64_t index_size;   // # of SegmentMappings
+    uint64_t virtual_size; // in bytes
+} __attribute__((packed));
+
+int save_merged_index(IFileRO *file, IFile *out) {
+    auto p = (LSMTReadOnlyFile *)file;
+    if (!p || !out || !p->m_index)
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid argument(s)");
+    for (auto &x : p->m_uuid)
+        if (x.is_null())
+            LOG_ERROR_RETURN(EINVAL, -1, "UUIDs of the layers are unknown");
+
+    MergedIndexHeader h;
+    h.magic0 = MergedIndexHeader::MAGIC0_V2();
+    h.nlayers = p->m_files.size();
+    h.uuid_offset = MergedIndexHeader::SPACE;
+    h.index_offset = alingn_up(h.uuid_offset + h.nlayers * sizeof(UUID), ALIGNMENT);
+    h.index_size = p->m_index->size();
+    h.virtual_size = p->m_vsize;
+    auto size = h.index_offset + h.index_size * sizeof(SegmentMapping);
+    unique_ptr<char[]> buf(new char[size]{});
+    memcpy(buf.get(), &h, sizeof(h));
+    memcpy(buf.get() + h.uuid_offset, p->m_uuid.data(), h.nlayers * sizeof(UUID));
+    memcpy(buf.get() + h.index_offset, p->m_index->buffer(),
+           h.index_size * sizeof(SegmentMapping));
+    if (out->pwrite(buf.get(), size, 0) != (ssize_t)size)
+        LOG_ERRNO_RETURN(0, -1, "failed to write merged index");
+    LOG_INFO("merged index of ` layers saved, ` mappings", p->m_files.size(),
+             p->m_index->size());
+    return 0;
+}
+
+IFileRO *open_files_ro_with_index(IFile **files, size_t n, IFile *merged_index, bool ownership) {
+    if (n > MAX_STACK_LAYERS) {
+        LOG_ERROR_RETURN(0, 0, "open too many files (` > `)", n, MAX_STACK_LAYERS);
+    }
+    if (!files || n == 0 || !merged_index)
+        return nullptr;
+
+    struct stat st;
+    if (merged_index->fstat(&st) < 0)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to stat merged index");
+    size_t size = st.st_size;
+    if (size < MergedIndexHeader::SPACE)
+        LOG_ERROR_RETURN(EINVAL, nullptr, "merged index too small (` bytes)", size);
+    // with mmap_index, the header is read first, and then the UUIDs only if
+    // the mappings are mapped from the file
+    unique_ptr<char[]> buf(new char[size]);
+    size_t nread = mmap_index ? MergedIndexHeader::SPACE : size;
+    if (merged_index->pread(buf.get(), nread, 0) != (ssize_t)nread)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to read merged index");
+    auto h = (MergedIndexHeader *)buf.get();
+    bool v2 = h->magic0 == MergedIndexHeader::MAGIC0_V2();
+    if ((!v2 && h->magic0 != MergedIndexHeader::MAGIC0()) || h->nlayers != n ||
+        h->uuid_offset < MergedIndexHeader::SPACE ||
+        h->uuid_offset + n * sizeof(UUID) > h->index_offset ||
+        h->index_offset + h->index_size * sizeof(SegmentMapping) != size)
+        LOG_ERROR_RETURN(EINVAL, nullptr, "invalid merged index of ` layers", n);
+    unique_ptr<IMemoryIndex> pmi;
+    if (mmap_index) {
+        pmi.reset(map_index(merged_index, h->index_offset, h->index_size, 0, UINT64_MAX, n, v2));
+        auto rest = (pmi ? h->index_offset : size) - nread;
+        if (merged_index->pread(buf.get() + nread, rest, nread) != (ssize_t)rest)
+            LOG_ERRNO_RETURN(0, nullptr, "failed to read merged index");
+    }
+
+    // verified with the UUIDs in the headers of the layers, the top first
+    vector<IFile *> m_files(files, files + n);
+    std::reverse(m_files.begin(), m_files.end());
+    vector<UUID> m_uuid(n);
+    if (read_uuids(m_files.data(), n, m_uuid.data()) < 0)
+        return nullptr;
+    auto puuid = (UUID *)(buf.get() + h->uuid_offset);
+    for (size_t i = 0; i < n; i++) {
+        if (m_uuid[i] != puuid[i])
+            LOG_ERROR_RETURN(EINVAL, nullptr, "layer ` (the top being 0) mismatches merged index",
+                             i);
+    }
+
+    size_t nmappings = h->index_size;
+    if (!pmi) {
+        auto pmappings = new SegmentMapping[nmappings];
+        memcpy(pmappings, buf.get() + h->index_offset, nmappings * sizeof(SegmentMapping));
+        if (!v2)
+            mappings_from_v1(pmappings, nmappings);
+        for (size_t i = 0; i < nmappings; i++) {
+            if (pmappings[i].tag >= n) {
+                delete[] pmappings;
+                LOG_ERROR_RETURN(EINVAL, nullptr, "invalid tag ` in merged index",
+                                 (int)pmappings[i].tag);
+            }
+        }
+        pmi.reset(create_memory_index(pmappings, nmappings, 0, UINT64_MAX));
+        if (!pmi) {
+            delete[] pmappings;
+            LOG_ERROR_RETURN(EINVAL, nullptr, "invalid mappings in merged index");
+        }
+    }
+
+    auto rst = new LSMTReadOnlyFile;
+    rst->m_index = pmi.release();
+    rst->m_files = move(m_files);
+    rst->m_uuid = move(m_uuid);
+    rst->m_vsize = h->virtual_size;
+    rst->m_file_ownership = ownership;
+    LOG_INFO("open ` layers with merged index of ` mappings", n, nmappings);
+    return rst;
+}
+
 int merge_files_ro(vector<IFile *> files, const CommitArgs &args) {
     HeaderTrailer ht;
     vector<UUID> files_uuid(files.size());
@@ -1199,6 +2809,13 @@ static bool verify_order(const vector<IFile *> &layers, const vector<UUID> &uuid
         LayerInfo args;
         if (load_layer_info((IFile **)&layers[i], 1, args))
             return false;
+        if (layer_uuid.is_null()) {
+            // not known for the layers opened lazily till their indexes are loaded
+            ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+            auto pht = verify_ht(layers[i], buf);
+            if (pht == nullptr || layer_uuid.parse(pht->uuid) != 0)
+                LOG_ERROR_RETURN(0, false, "failed to get UUID of layer `", i);
+        }
         if (parent_uuid.is_null() == false) {
             if (layer_uuid != parent_uuid) {
                 LOG_ERROR_RETURN(0, false,
@@ -1231,6 +2848,8 @@ IFileRW *stack_files(IFileRW *upper_layer, IFileRO *lower_layers, bool ownership
     LSMTFile *rst = new LSMTFile;
     rst->m_index = idx;
     rst->m_findex = u->m_findex;
+    rst->m_data_offset = u->m_data_offset;
+    rst->m_published_offset = u->m_published_offset;
     rst->m_vsize = u->m_vsize;
     rst->m_file_ownership = ownership;
     rst->m_files.reserve(1 + l->m_files.size());
@@ -25,14 +25,17 @@ IMemoryIndex -> IMemoryIndex0 -> IComboIndex -> Index0 ( set<SegmentMap> ) -> Co
 #pragma once
 #include <inttypes.h>
 #include <cstddef>
+#include <memory>
+#include <vector>
 #include "../filesystem.h"
 #include "../virtual-file.h"
 #include "index.h"
+#include "../../callback.h"
 #include "../../uuid.h"
 
 namespace LSMT {
 
-static const int MAX_STACK_LAYERS = 255;
+static const int MAX_STACK_LAYERS = 4095;
 
 typedef ::FileSystem::IFile IFile;
 class IFileRO : public ::FileSystem::VirtualReadOnlyFile {
@@ -45,6 +48,47 @@ public:
 
     // return uuid of  m_files[layer_idx];
     virtual int get_uuid(UUID &out, size_t layer_idx = 0) const = 0;
+
+    // the space of a layer as seen through the index of the file, where the
+    // data of the layer that is not mapped is garbage, having been overwritten
+    // or discarded, or hidden by upper layers; data mapped more than once, by
+    // deduplication, is counted as many times as live
+    struct SpaceStat {
+        uint64_t data_size = 0;    // bytes of data stored in the layer
+        uint64_t live_size = 0;    // bytes of data mapped
+        uint64_t garbage_size = 0; // data_size - live_size, or 0
+        uint64_t segments = 0;     // # of data segments mapped
+        uint64_t fragments = 0;    // # of runs of them contiguous in the layer too
+        uint64_t zeroed_segments = 0; // # of zeroed segments, discarded or written zeros
+        uint64_t zeroed_size = 0;     // bytes of them
+        // # of data segments of [2^i, 2^(i+1)) 512B blocks, the last of 8MB or longer
+        static const int HISTOGRAM_SIZE = 15;
+        uint64_t histogram[HISTOGRAM_SIZE] = {};
+    };
+    // fill `stats[i]` for each layer i as in get_uuid(), for i < n, with one
+    // pass over the index, returning the # of layers, or -1 for failure
+    virtual ssize_t space_stat(SpaceStat *stats, size_t n) const = 0;
+
+    // a range of the file, stored at `moffset` of a local file `fd`, or
+    // zeroes with `fd` of -1, in bytes
+    struct Extent {
+        int fd;
+        uint64_t moffset;
+        uint64_t length;
+    };
+    // resolve [offset, offset + count) to at most `n` extents, in order, to
+    // be read from the local files directly, bypassing the files of the
+    // layers; adjacent extents of the same file are merged; returns the #
+    // of extents, or -1 if any of the range is in a layer that is not a
+    // local file opened without O_DIRECT, or it takes more than `n` extents
+    virtual ssize_t resolve(off_t offset, size_t count, Extent *out, size_t n) = 0;
+
+    // called with the layer, i as in get_uuid(), and the offset and length in
+    // bytes of its data, for each range a read by preadv(), or a successful
+    // resolve(), is mapped to, e.g. to count the reads of each layer; reads
+    // without buffer, which are prefetches, are not observed
+    typedef Delegate<void, size_t, uint64_t, uint64_t> ReadObserver;
+    virtual void set_read_observer(ReadObserver observer) = 0;
 };
 
 struct CommitArgs {
@@ -52,6 +96,9 @@ struct CommitArgs {
     char *user_tag = nullptr; // commit_msg, at most 256B
     size_t tag_len = 0;       // commit_msg length
     UUID::String parent_uuid; // set parent uuid when commit
+    // # of blocks copied concurrently by photon threads, 1 (the default)
+    // copies them one by one in the calling thread
+    int concurrency = 1;
     size_t get_tag_len() const {
         if (tag_len == 0 && user_tag != nullptr) {
             return strlen(user_tag);
@@ -70,6 +117,31 @@ public:
         return this->ioctl(Index_Group_Commit, buffer_size);
     }
 
+    // when enabled, all-zero blocks written to the file are recorded as
+    // zeroed mappings instead of being appended to the data file
+    const int Zero_Detect = 11;
+    int set_zero_detect(bool enable) {
+        return this->ioctl(Zero_Detect, (int)enable);
+    }
+
+    // when enabled with the # of recently written 4K blocks to remember, a
+    // block written that equals the one at its offset is skipped, and one that
+    // equals a remembered block is mapped to its data instead of being
+    // appended again; the blocks to be overwritten are read to compare with
+    const int Dedup = 12;
+    int set_dedup(size_t nblocks) {
+        return this->ioctl(Dedup, nblocks);
+    }
+
+    // copy the live data of the writable layer into the empty `fdata` and
+    // `findex` while the file keeps serving I/O, and then switch over to them;
+    // copying is throttled to `max_MBps` (0 for unlimited), and canceled once
+    // `*running` is no longer 1; on success, the replaced files are deleted
+    // if owned, and the new ones are taken over with the same ownership
+    // return 0 for success, -1 otherwise (with nothing changed)
+    virtual int compact_online(IFile *fdata, IFile *findex, uint64_t max_MBps = 0,
+                               const int *running = nullptr) = 0;
+
     // commit the written content as a new file, without garbages
     // return 0 for success, -1 otherwise
     virtual int commit(const CommitArgs &args) const = 0;
@@ -108,20 +180,92 @@ extern "C" IFileRW *create_file_rw(const LayerInfo &args, bool ownership = false
 // open a writable LSMT file constitued by a data file and a index file,
 // optionally obtaining the ownerships of the underlying files,
 // thus they will be destructed automatically.
+// The data file is written at the offsets reserved by concurrent writes,
+// so it must not be opened with O_APPEND.
 extern "C" IFileRW *open_file_rw(IFile *fdata, IFile *findex, bool ownership = false);
 
+// make `dst_data` and `dst_index`, empty local files opened for writing, a
+// clone of the writable LSMT file of the local files `src_data` and
+// `src_index`, to be opened by open_file_rw() independently of it; their
+// extents are shared by reflinks where the file system supports them, in
+// time regardless of the data, and copied otherwise, except the holes; the
+// source must not be written meanwhile, e.g. being fdatasync()ed and paused
+// return 0 for success, -1 otherwise
+extern "C" int clone_file_rw(IFile *src_data, IFile *src_index, IFile *dst_data,
+                             IFile *dst_index);
+
 // open a read-only LSMT file, which was created by
 // `close_seal()`ing or `commit()`ing a R/W LSMT file.
 // optionally obtaining the `ownership` of the underlying file,
 // thus it will be destructed automatically.
 extern "C" IFileRO *open_file_ro(IFile *file, bool ownership = false);
 
+// the ranges of `file`, a sealed layer, that are read once it's opened by
+// open_file_ro(): its header, the data mapped by its index, and the index
+// and the trailer after the data, as (offset, length) in bytes, sorted and
+// merged; the rest of the data, overwritten or discarded before the layer
+// was sealed, is garbage; return 0 for success, -1 otherwise
+int live_ranges(IFile *file, std::vector<std::pair<uint64_t, uint64_t>> &out);
+
 // open a read-only (sealed) LSMT file constituted by multiple layers,
 // with `files[0]` being the lowest layer, and vice versa
 // optionally obtaining the ownerships of the underlying files,
 // thus they will be destructed automatically.
 extern "C" IFileRO *open_files_ro(IFile **files, size_t n, bool ownership = false);
 
+// like open_files_ro(), but returning without loading the indexes of the
+// layers, which are loaded in the background from the top layer down; a
+// read waits only for the indexes of the layers it reaches, from the top
+// down till its range is covered, which are loaded first; once all are
+// loaded, they are merged, and reads are as fast as with open_files_ro();
+// a read reaching a layer whose index failed to be loaded fails with EIO
+extern "C" IFileRO *open_files_ro_lazy(IFile **files, size_t n, bool ownership = false);
+
+// map the indexes of sealed layers in local files, and the merged index of
+// open_files_ro_with_index(), from the files instead of reading them into
+// memory, validating the mappings once when they are mapped; an index that
+// can't be mapped, e.g. in a compressed or remote layer, is read as before;
+// false by default, and the files must not be changed while they're opened
+extern "C" void set_mmap_index(bool enable);
+
+// save the indexes of the layers committed afterwards in the v2 format,
+// whose segments are up to 512MB long, instead of 8MB, merging the writes of
+// large files into far fewer mappings; layers of v2 can't be opened by older
+// versions, so false by default
+extern "C" void set_index_v2(bool enable);
+
+// save the indexes of the layers committed afterwards encoded, by
+// encode_index(), in 1/4 of the size or less, to be downloaded faster when
+// the layers are remote; implies the v2 format, so false by default as well
+extern "C" void set_index_encoding(bool enable);
+
+// save the merged index of the layers of `file`, opened by open_files_ro(),
+// along with their UUIDs, as `out`, to be opened with open_files_ro_with_index()
+extern "C" int save_merged_index(IFileRO *file, IFile *out);
+
+// like open_files_ro(), but loading the merged index of the layers in one
+// read of `merged_index`, saved by save_merged_index(), instead of loading
+// and merging their indexes; the UUIDs of the layers must match the saved
+// ones; `merged_index` is not used after the function returns
+extern "C" IFileRO *open_files_ro_with_index(IFile **files, size_t n, IFile *merged_index,
+                                             bool ownership = false);
+
+// read the UUIDs of `files[0..n)` from their headers into `uuids`, in parallel
+// return 0 for success, -1 otherwise
+extern "C" int read_uuids(IFile **files, size_t n, UUID *uuids);
+
+// take over the merged index of the layers of `file`, opened by open_files_ro()
+// or open_files_ro_with_index(), so that other files of the same layers can be
+// opened with it by open_files_ro_shared(), saving the memory and the time of
+// loading their own; it's released along with the last of the files, and
+// nullptr is returned if it can't be shared, e.g. being loaded lazily
+std::shared_ptr<const IMemoryIndex> share_index(IFileRO *file);
+
+// like open_files_ro(), but looking up `index`, shared by share_index() from a
+// file of the layers with the same `uuids`, as read by read_uuids()
+IFileRO *open_files_ro_shared(IFile **files, size_t n, const UUID *uuids,
+                              std::shared_ptr<const IMemoryIndex> index, bool ownership = false);
+
 // merge multiple RO files (layers) into a single RO file (layer)
 // returning 0 for success, -1 otherwise
 // extern "C" int merge_files_ro(IFile** src_files, size_t n, IFile* dest_file);
@@ -19,7 +19,14 @@
 #include <set>
 #include <algorithm>
 #include <memory>
+#include <new>
+#include <cstddef>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <thread>
 #include "../../alog.h"
+#include "../../memory.h"
 #include "../filesystem.h"
 #include "../../utility.h"
 using namespace std;
@@ -61,6 +68,13 @@ public:
     const SegmentMapping *pbegin = nullptr;
     const SegmentMapping *pend = nullptr;
     uint64_t alloc_blk = 0;
+    Memory::Account m_account{"lsmt_index"};
+
+    // the mappings held by the index, not those referred to only
+    void account() {
+        m_account.set(mapping.capacity() * sizeof(SegmentMapping) +
+                      (ownership ? size() * sizeof(SegmentMapping) : 0));
+    }
 
     inline void get_alloc_blks() {
         for (auto m : mapping) {
@@ -80,6 +94,7 @@ public:
         }
         pbegin = pmappings;
         pend = pbegin + n;
+        account();
     }
     Index(vector<SegmentMapping> &&m) : mapping(std::move(m)) {
         if (mapping.size()) {
@@ -88,6 +103,7 @@ public:
             get_alloc_blks();
         } else
             pbegin = pend = nullptr;
+        account();
     }
 
     virtual uint64_t block_count() const override {
@@ -100,6 +116,7 @@ public:
         pbegin = &mapping[0];
         pend = pbegin + mapping.size();
         get_alloc_blks();
+        account();
     }
     // number of segments in the index
     virtual size_t size() const override {
@@ -228,10 +245,164 @@ public:
     }
 };
 
+// a static B+ tree of the mappings' end offsets, stored as plain uint64_t
+// keys in cache-line sized nodes, beside the mapping array as its payload;
+// level 0 holds the end of every mapping, and each upper level holds the
+// last (largest) key of every node in the level below
+class BTreeIndex : public Index {
+public:
+    static const size_t NODE_KEYS = 64 / sizeof(uint64_t);
+    uint64_t *m_keys = nullptr;
+    vector<size_t> m_levels; // offset (in keys) of each level in m_keys, bottom first
+
+    BTreeIndex(const SegmentMapping *pmappings = nullptr, size_t n = 0, bool ownership = true)
+        : Index(pmappings, n, ownership) {
+        build_tree();
+    }
+    BTreeIndex(vector<SegmentMapping> &&m) : Index(std::move(m)) {
+        build_tree();
+    }
+    ~BTreeIndex() {
+        free(m_keys);
+    }
+
+    static size_t round_up(size_t n) {
+        return (n + NODE_KEYS - 1) / NODE_KEYS * NODE_KEYS;
+    }
+
+    void build_tree() {
+        auto n = size();
+        if (n == 0)
+            return;
+        size_t total = 0;
+        for (auto k = n;; k = round_up(k) / NODE_KEYS) {
+            m_levels.push_back(total);
+            total += round_up(k);
+            if (k <= NODE_KEYS)
+                break;
+        }
+        if (::posix_memalign((void **)&m_keys, 64, total * sizeof(uint64_t)) != 0) {
+            m_keys = nullptr;
+            m_levels.clear();
+            LOG_ERROR("failed to allocate search tree, fall back to binary search");
+            return;
+        }
+        m_account.add(total * sizeof(uint64_t));
+        std::fill(m_keys, m_keys + total, UINT64_MAX);
+        for (size_t i = 0; i < n; i++)
+            m_keys[i] = pbegin[i].end();
+        for (size_t l = 1; l < m_levels.size(); l++) {
+            auto lower = m_keys + m_levels[l - 1];
+            auto upper = m_keys + m_levels[l];
+            for (size_t i = 0; i < m_levels[l] - m_levels[l - 1]; i += NODE_KEYS)
+                upper[i / NODE_KEYS] = lower[i + NODE_KEYS - 1];
+        }
+        LOG_DEBUG("create btree index, depth: `, elements: `, keys: `", m_levels.size(), n, total);
+    }
+
+    // # of keys in the node that are <= x, written as a plain
+    // loop with no branch so that compiler can vectorize it
+    static inline size_t node_rank(const uint64_t *node, uint64_t x) {
+        size_t r = 0;
+        for (size_t i = 0; i < NODE_KEYS; i++)
+            r += (node[i] <= x);
+        return r;
+    }
+
+    // the first mapping whose end() > offset, i.e. std::lower_bound() with Segment
+    const SegmentMapping *search(uint64_t offset) const {
+        if (!m_keys)
+            return Index::lower_bound(offset);
+        size_t pos = 0;
+        for (auto l = m_levels.size(); l > 0; l--) {
+            auto node = m_keys + m_levels[l - 1] + pos * NODE_KEYS;
+            auto r = node_rank(node, offset);
+            if (r == NODE_KEYS)
+                return pend; // only possible at the root
+            pos = pos * NODE_KEYS + r;
+        }
+        return pbegin + min(pos, size());
+    }
+
+    virtual size_t lookup(Segment s, /* OUT */ SegmentMapping *pm, size_t n) const override {
+        if (s.length == 0)
+            return 0;
+        auto lb = search(s.offset);
+        auto m = copy_n(lb, pend, s.end(), pm, n);
+        trim_edge_mappings(pm, m, s);
+        return m;
+    }
+};
+
+// a free list of fixed-size objects carved out of large slabs, one per
+// vcpu (OS thread); objects freed by another vcpu join that vcpu's list,
+// and slabs are kept for reuse until the process exits
+template <size_t SIZE>
+struct slab_free_list {
+    static const size_t SLAB_OBJECTS = 4096;
+    union Node {
+        Node *next;
+        alignas(std::max_align_t) char data[SIZE];
+    };
+    static thread_local Node *free_list;
+
+    static void *get() {
+        if (!free_list) {
+            auto slab = (Node *)malloc(SLAB_OBJECTS * sizeof(Node));
+            if (!slab)
+                throw std::bad_alloc();
+            for (size_t i = 0; i < SLAB_OBJECTS - 1; i++)
+                slab[i].next = &slab[i + 1];
+            slab[SLAB_OBJECTS - 1].next = nullptr;
+            free_list = slab;
+        }
+        auto p = free_list;
+        free_list = p->next;
+        return p;
+    }
+    static void put(void *p) {
+        auto n = (Node *)p;
+        n->next = free_list;
+        free_list = n;
+    }
+};
+template <size_t SIZE>
+thread_local typename slab_free_list<SIZE>::Node *slab_free_list<SIZE>::free_list = nullptr;
+
+// std::set<> allocates a tree node for every mapping, so Index0 takes its
+// nodes from the slabs instead of calling malloc() on every small write
+template <typename T>
+struct slab_allocator {
+    typedef T value_type;
+    slab_allocator() = default;
+    template <typename U>
+    slab_allocator(const slab_allocator<U> &) {
+    }
+    T *allocate(size_t n) {
+        if (n != 1)
+            return std::allocator<T>().allocate(n);
+        return (T *)slab_free_list<sizeof(T)>::get();
+    }
+    void deallocate(T *p, size_t n) {
+        if (n != 1)
+            return std::allocator<T>().deallocate(p, n);
+        slab_free_list<sizeof(T)>::put(p);
+    }
+    template <typename U>
+    bool operator==(const slab_allocator<U> &) const {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const slab_allocator<U> &) const {
+        return false;
+    }
+};
+
 class Index0 : public IComboIndex {
 public:
-    set<SegmentMapping> mapping;
-    typedef set<SegmentMapping>::iterator iterator;
+    typedef set<SegmentMapping, less<SegmentMapping>, slab_allocator<SegmentMapping>> mapping_set;
+    mapping_set mapping;
+    typedef mapping_set::iterator iterator;
 
     struct block_usage {
         uint64_t m_alloc = 0;
@@ -387,26 +558,165 @@ public:
     }
 };
 
-static void merge_indexes(uint8_t level, vector<SegmentMapping> &mapping, const Index **pindexes,
+static void merge_indexes(uint16_t level, vector<SegmentMapping> &mapping, const Index **pindexes,
                           std::size_t n, uint64_t begin, uint64_t end, bool change_tag = true,
                           size_t max_level = 0);
 
+// A sorted array of mappings, cut into chunks of up to 2 * CHUNK, and the
+// end of the last mapping of each chunk, so that a lookup is a binary search
+// in contiguous memory, and an insert moves no more than a chunk.
+class ChunkedIndex {
+public:
+    static const size_t CHUNK = 256;
+
+    ChunkedIndex(const SegmentMapping *pmappings, size_t n) {
+        for (size_t i = 0; i < n; i += CHUNK)
+            m_chunks.emplace_back(pmappings + i, pmappings + min(n, i + CHUNK));
+        for (auto &c : m_chunks)
+            m_ends.push_back(c.back().end());
+        m_size = n;
+    }
+    size_t size() const {
+        return m_size;
+    }
+    size_t lookup(Segment s, SegmentMapping *pm, size_t n) const {
+        auto c = chunk_of(s.offset);
+        size_t m = 0;
+        for (; c < m_chunks.size() && m < n; c++) {
+            auto &chunk = m_chunks[c];
+            auto begin = (m == 0) ? lower_bound(chunk.begin(), chunk.end(), s) : chunk.begin();
+            auto k = copy_n(begin, chunk.end(), s.end(), pm + m, n - m);
+            m += k;
+            if (begin + k != chunk.end())
+                break;
+        }
+        trim_edge_mappings(pm, m, s);
+        return m;
+    }
+    void insert(SegmentMapping m) {
+        if (m.length == 0)
+            return;
+        auto c = chunk_of(m.offset);
+        if (c == m_chunks.size()) {
+            if (c == 0 || m_chunks.back().size() >= 2 * CHUNK) {
+                m_chunks.emplace_back();
+                m_ends.push_back(0);
+            } else {
+                c--;
+            }
+            m_chunks[c].push_back(m);
+            m_ends[c] = m.end();
+            m_size++;
+            return;
+        }
+
+        // trim or remove what m covers, from chunk c on, then put m in place
+        auto &chunk = m_chunks[c];
+        auto it = lower_bound(chunk.begin(), chunk.end(), (Segment &)m);
+        auto pos = it - chunk.begin();
+        SegmentMapping tail;
+        tail.length = 0;
+        if (it != chunk.end() && it->offset < m.offset) {
+            if (it->end() > m.end()) {
+                tail = *it;
+                tail.forward_offset_to(m.end());
+            }
+            it->backward_end_to(m.offset);
+            pos++;
+        }
+        for (auto k = c; k < m_chunks.size(); k++) {
+            auto &ck = m_chunks[k];
+            auto b = (k == c) ? ck.begin() + pos : ck.begin();
+            auto e = b;
+            while (e != ck.end() && e->end() <= m.end())
+                e++;
+            bool done = e != ck.end();
+            if (done && e->offset < m.end())
+                e->forward_offset_to(m.end());
+            m_size -= e - b;
+            ck.erase(b, e);
+            if (done)
+                break;
+        }
+        auto at = chunk.insert(chunk.begin() + pos, m);
+        m_size++;
+        if (tail.length) {
+            chunk.insert(at + 1, tail);
+            m_size++;
+        }
+        m_ends[c] = chunk.back().end();
+
+        // drop the chunks emptied, and split c if it has grown too large
+        for (auto k = c + 1; k < m_chunks.size() && m_chunks[k].empty();)
+            m_chunks.erase(m_chunks.begin() + k), m_ends.erase(m_ends.begin() + k);
+        if (chunk.size() > 2 * CHUNK) {
+            vector<SegmentMapping> half(chunk.begin() + CHUNK, chunk.end());
+            chunk.resize(CHUNK);
+            m_ends[c] = chunk.back().end();
+            m_chunks.insert(m_chunks.begin() + c + 1, move(half));
+            m_ends.insert(m_ends.begin() + c + 1, m_chunks[c + 1].back().end());
+        }
+    }
+
+private:
+    vector<vector<SegmentMapping>> m_chunks;
+    vector<uint64_t> m_ends;
+    size_t m_size = 0;
+
+    // the first chunk ending after offset
+    size_t chunk_of(uint64_t offset) const {
+        return upper_bound(m_ends.begin(), m_ends.end(), offset) - m_ends.begin();
+    }
+};
+
+static bool combo_index_merged = false;
+void set_combo_index_merged(bool enable) {
+    combo_index_merged = enable;
+}
+
 class ComboIndex : public Index0 {
 public:
     Index0 *m_index0{nullptr};
-    Index *m_backing_index{nullptr};
+    // any IMemoryIndex to look up, e.g. the lazy index of the lower layers,
+    // but an Index to be rebuilt
+    IMemoryIndex *m_backing_index{nullptr};
     bool m_ownership;
+    // the front and the backing mappings merged, and updated by every
+    // insert, to be looked up instead of both, if enabled
+    unique_ptr<ChunkedIndex> m_merged;
 
-    ComboIndex(Index0 *index0, const Index *index, uint8_t ro_layers_count, bool ownership) {
+    ComboIndex(Index0 *index0, const IMemoryIndex *index, uint16_t ro_layers_count,
+               bool ownership) {
         m_index0 = index0;
-        m_backing_index = const_cast<Index *>(index);
+        m_backing_index = const_cast<IMemoryIndex *>(index);
         mapping = index0->mapping;
+        alloc_blk = index0->alloc_blk;
         m_ownership = ownership;
 
         for (auto &x : mapping)
             ((SegmentMapping &)x).tag = ro_layers_count;
         // for (auto &x : *m_backing_index)
         //     ((SegmentMapping &)x).tag++;
+        merge_front();
+    }
+
+    // a backing index without a buffer, e.g. the lazy index before all the
+    // layers are loaded, is not merged
+    void merge_front() {
+        m_merged.reset();
+        if (!combo_index_merged || !m_backing_index || !m_backing_index->buffer())
+            return;
+        auto merged = new ChunkedIndex(m_backing_index->buffer(), m_backing_index->size());
+        for (auto &m : mapping)
+            merged->insert(m);
+        m_merged.reset(merged);
+        LOG_INFO("front index merged with the backing one, ` mappings", merged->size());
+    }
+
+    virtual void insert(SegmentMapping m) override {
+        Index0::insert(m);
+        if (m_merged)
+            m_merged->insert(m);
     }
     ~ComboIndex() {
         if (m_ownership) {
@@ -424,6 +734,8 @@ public:
             return 0;
         if (!m_backing_index)
             return Index0::lookup(s, pm, n);
+        if (m_merged)
+            return m_merged->lookup(s, pm, n);
 
         auto pm_ = pm;
         auto it = mapping.lower_bound({s.offset, s.length, 0});
@@ -463,7 +775,8 @@ public:
             delete m_backing_index;
             m_backing_index = nullptr;
         }
-        m_backing_index = (Index *)bi;
+        m_backing_index = const_cast<IMemoryIndex *>(bi);
+        merge_front();
         return 0;
     }
 
@@ -493,7 +806,7 @@ public:
 
     virtual Index *rebuild_backing_index(Index *highlevel_idx, size_t max_level) {
         vector<SegmentMapping> mappings;
-        const Index *indexes[2] = {highlevel_idx, const_cast<Index *>(m_backing_index)};
+        const Index *indexes[2] = {highlevel_idx, (const Index *)m_backing_index};
         merge_indexes(0, mappings, indexes, 2, 0, UINT64_MAX, false, max_level);
         return new Index(std::move(mappings));
     }
@@ -543,7 +856,27 @@ IMemoryIndex *create_memory_index(const SegmentMapping *pmappings, size_t n, uin
                                   uint64_t moffset_end, bool ownership) {
     auto ok1 = verify_mapping_order(pmappings, n);
     auto ok2 = verify_mapping_moffset(pmappings, n, moffset_begin, moffset_end);
-    return (ok1 && ok2) ? new Index(pmappings, n, ownership) : nullptr;
+    return (ok1 && ok2) ? new BTreeIndex(pmappings, n, ownership) : nullptr;
+}
+
+// a BTreeIndex over an array in a region mapped by mmap()
+class MappedIndex : public BTreeIndex {
+public:
+    void *m_addr;
+    size_t m_length;
+    MappedIndex(const SegmentMapping *pmappings, size_t n, void *addr, size_t length)
+        : BTreeIndex(pmappings, n, false), m_addr(addr), m_length(length) {
+    }
+    ~MappedIndex() {
+        munmap(m_addr, m_length);
+    }
+};
+
+IMemoryIndex *create_mapped_index(const SegmentMapping *pmappings, size_t n, uint64_t moffset_begin,
+                                  uint64_t moffset_end, void *addr, size_t length) {
+    auto ok1 = verify_mapping_order(pmappings, n);
+    auto ok2 = verify_mapping_moffset(pmappings, n, moffset_begin, moffset_end);
+    return (ok1 && ok2) ? new MappedIndex(pmappings, n, addr, length) : nullptr;
 }
 
 IMemoryIndex *create_level_index(const SegmentMapping *pmappings, size_t n, uint64_t moffset_begin,
@@ -553,7 +886,7 @@ IMemoryIndex *create_level_index(const SegmentMapping *pmappings, size_t n, uint
     return (ok1 && ok2) ? new LevelIndex(pmappings, n, copy_mode) : nullptr;
 }
 
-static void merge_indexes(uint8_t level, vector<SegmentMapping> &mapping, const Index **pindexes,
+static void merge_indexes(uint16_t level, vector<SegmentMapping> &mapping, const Index **pindexes,
                           size_t n, uint64_t begin, uint64_t end, bool change_tag,
                           size_t max_level) {
 
@@ -605,16 +938,15 @@ static void merge_indexes(uint8_t level, vector<SegmentMapping> &mapping, const
     }
 }
 
-IComboIndex *create_combo_index(IMemoryIndex0 *index0, const IMemoryIndex *index, uint8_t ro_index_count, bool ownership) {
+IComboIndex *create_combo_index(IMemoryIndex0 *index0, const IMemoryIndex *index, uint16_t ro_index_count, bool ownership) {
     if (!index0 || !index)
         LOG_ERROR_RETURN(EINVAL, nullptr, "invalid argument(s)");
 
     auto i0 = (Index0 *)index0;
-    auto i1 = (Index *)index;
-    return new ComboIndex(i0, i1, ro_index_count, ownership);
+    return new ComboIndex(i0, index, ro_index_count, ownership);
 }
 
-size_t compress_raw_index(SegmentMapping *mapping, size_t n) {
+size_t compress_raw_index(SegmentMapping *mapping, size_t n, uint32_t max_length) {
     size_t i, j;
     if (n < 2)
         return n;
@@ -623,7 +955,7 @@ size_t compress_raw_index(SegmentMapping *mapping, size_t n) {
     for (j = 1, i = 0; j < n; ++j)
         if (mapping[i].end() == mapping[j].offset && mapping[i].mend() == mapping[j].moffset &&
             (!(mapping[i].zeroed ^ mapping[j].zeroed)) && mapping[i].tag == mapping[j].tag &&
-            (uint64_t)(mapping[i].length + mapping[j].length) < SegmentMapping::MAX_LENGTH) {
+            (uint64_t)(mapping[i].length + mapping[j].length) < max_length) {
             mapping[i].length += mapping[j].length;
         } else {
             mapping[++i] = mapping[j];
@@ -654,9 +986,192 @@ size_t compress_raw_index_predict(const SegmentMapping *mapping, size_t n) {
     return i;
 }
 
+void mappings_from_v1(SegmentMapping *pmappings, size_t n) {
+    for (auto &m : ptr_array(pmappings, n)) {
+        SegmentMappingV1 v1;
+        memcpy(&v1, &m, sizeof(v1));
+        if (v1.offset == SegmentMappingV1::INVALID_OFFSET) {
+            m = SegmentMapping::invalid_mapping();
+            continue;
+        }
+        m.offset = v1.offset;
+        m.length = v1.length;
+        m.moffset = v1.moffset;
+        m.zeroed = v1.zeroed;
+        m.tag = v1.tag;
+    }
+}
+
+int mappings_to_v1(SegmentMapping *pmappings, size_t n) {
+    for (auto &m : ptr_array(pmappings, n)) {
+        SegmentMappingV1 v1;
+        if (m.offset == SegmentMapping::INVALID_OFFSET) {
+            v1.offset = SegmentMappingV1::INVALID_OFFSET;
+            v1.length = 0;
+            v1.moffset = 0;
+            v1.zeroed = 0;
+            v1.tag = 0;
+        } else {
+            if (m.length > Segment::MAX_LENGTH_V1)
+                LOG_ERROR_RETURN(EOVERFLOW, -1, "mapping [`, +`) is too long for v1 format",
+                                 m.offset + 0, m.length + 0);
+            v1.offset = m.offset;
+            v1.length = m.length;
+            v1.moffset = m.moffset;
+            v1.zeroed = m.zeroed;
+            v1.tag = 0;
+        }
+        // converted in place, the two are of the same size
+        memcpy((void *)&m, &v1, sizeof(m));
+    }
+    return 0;
+}
+
+static inline void put_varint(vector<char> &out, uint64_t x) {
+    while (x >= 0x80) {
+        out.push_back((char)(x | 0x80));
+        x >>= 7;
+    }
+    out.push_back((char)x);
+}
+
+// returns false if the varint is truncated, or longer than 64 bits
+static inline bool get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &x) {
+    if (p < end && *p < 0x80) { // the gaps and deltas are mostly 0
+        x = *p++;
+        return true;
+    }
+    x = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint64_t b = *p++;
+        x |= (b & 0x7f) << shift;
+        if (b < 0x80)
+            return true;
+    }
+    return false;
+}
+
+void encode_index(const SegmentMapping *pmappings, size_t n, vector<char> &out) {
+    for (size_t i = 0; i < n; i += ENCODED_BLOCK) {
+        uint32_t count = min((size_t)ENCODED_BLOCK, n - i);
+        auto header = out.size();
+        out.resize(header + 2 * sizeof(uint32_t));
+        uint64_t end = 0, mend = 0;
+        for (auto &m : ptr_array(pmappings + i, count)) {
+            int64_t delta = m.moffset - mend;
+            put_varint(out, m.offset - end);
+            put_varint(out, ((uint64_t)m.length << 1) | m.zeroed);
+            put_varint(out, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+            end = m.end();
+            mend = m.mend();
+        }
+        uint32_t bytes = out.size() - header - 2 * sizeof(uint32_t);
+        memcpy(&out[header], &count, sizeof(count));
+        memcpy(&out[header + sizeof(count)], &bytes, sizeof(bytes));
+    }
+}
+
+int decode_index(const char *buf, size_t size, SegmentMapping *pmappings, size_t n) {
+    auto p = (const uint8_t *)buf, end = p + size;
+    size_t i = 0;
+    while (i < n) {
+        uint32_t count, bytes;
+        if (end - p < (ssize_t)(2 * sizeof(uint32_t)))
+            LOG_ERROR_RETURN(EINVAL, -1, "encoded index truncated at mapping `", i);
+        memcpy(&count, p, sizeof(count));
+        memcpy(&bytes, p + sizeof(count), sizeof(bytes));
+        p += 2 * sizeof(uint32_t);
+        if (count == 0 || count > ENCODED_BLOCK || count > n - i || bytes > (size_t)(end - p))
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid block of encoded index at mapping `", i);
+        auto block_end = p + bytes;
+        uint64_t lend = 0, mend = 0;
+        for (auto &m : ptr_array(pmappings + i, count)) {
+            uint64_t gap, length, delta;
+            if (!get_varint(p, block_end, gap) || !get_varint(p, block_end, length) ||
+                !get_varint(p, block_end, delta))
+                LOG_ERROR_RETURN(EINVAL, -1, "invalid varint in encoded index");
+            uint64_t offset = lend + gap;
+            uint64_t moffset = mend + ((delta >> 1) ^ -(delta & 1));
+            if (offset > Segment::MAX_OFFSET || (length >> 1) > Segment::MAX_LENGTH ||
+                moffset > SegmentMapping::MAX_MOFFSET)
+                LOG_ERROR_RETURN(EINVAL, -1, "invalid mapping in encoded index");
+            m = SegmentMapping(offset, length >> 1, moffset);
+            m.zeroed = length & 1;
+            lend = m.end();
+            mend = m.mend();
+        }
+        if (p != block_end)
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid size of block of encoded index");
+        i += count;
+    }
+    return 0;
+}
+
+// merges of at least this many mappings in all run on OS threads, each
+// over a range of the logical space, up to MERGE_MAX_THREADS of them
+static const size_t PARALLEL_MERGE_MIN = 1 << 18;
+static const size_t MERGE_MAX_THREADS = 16;
+
+// Move `offset` forward to where no merged mapping spans it, i.e. where the
+// topmost mapping over the sector before it, if any, ends; false if it takes
+// more than a few steps.
+static bool clean_cut(const Index **pi, size_t n, uint64_t &offset) {
+    for (int step = 0; step < 16; step++) {
+        const SegmentMapping *top = nullptr;
+        for (size_t k = 0; k < n && !top; k++) {
+            auto it = pi[k]->lower_bound(offset - 1);
+            if (it != pi[k]->end() && it->offset < offset)
+                top = it;
+        }
+        if (!top || top->end() == offset)
+            return true;
+        offset = top->end();
+    }
+    return false;
+}
+
+// The ranges are cut at offsets picked evenly from the largest index, so they
+// carry similar numbers of mappings, and moved to where no mapping of the
+// result crosses them, so the result is the same as that of one merge.
+static void merge_indexes_parallel(vector<SegmentMapping> &mapping, const Index **pi, size_t n,
+                                   size_t total, size_t nthreads) {
+    auto largest = *max_element(pi, pi + n, [](const Index *a, const Index *b) {
+        return a->size() < b->size();
+    });
+    vector<uint64_t> cuts{0};
+    for (size_t i = 1; i < nthreads; i++) {
+        auto offset = largest->pbegin[i * largest->size() / nthreads].offset;
+        if (offset > cuts.back() && clean_cut(pi, n, offset))
+            cuts.push_back(offset);
+    }
+    cuts.push_back(UINT64_MAX);
+
+    auto nranges = cuts.size() - 1;
+    vector<vector<SegmentMapping>> parts(nranges);
+    vector<std::thread> threads;
+    for (size_t i = 0; i < nranges; i++) {
+        threads.emplace_back([&, i]() {
+            parts[i].reserve(total / nranges);
+            merge_indexes(0, parts[i], pi, n, cuts[i], cuts[i + 1]);
+        });
+    }
+    for (auto &th : threads)
+        th.join();
+
+    size_t count = 0;
+    for (auto &part : parts)
+        count += part.size();
+    mapping.reserve(count);
+    for (auto &part : parts) {
+        mapping.insert(mapping.end(), part.begin(), part.end());
+        vector<SegmentMapping>().swap(part);
+    }
+    LOG_INFO("merged ` indexes of ` mappings in ` ranges", n, total, nranges);
+}
+
 IMemoryIndex *merge_memory_indexes(const IMemoryIndex **pindexes, size_t n) {
-    if (n > 255) {
-        LOG_ERROR("too many indexes to merge, 255 at most!");
+    if (n > UINT16_MAX) {
+        LOG_ERROR("too many indexes to merge, ` at most!", UINT16_MAX);
         return nullptr;
     }
     if (n == 0 || pindexes == nullptr)
@@ -664,8 +1179,16 @@ IMemoryIndex *merge_memory_indexes(const IMemoryIndex **pindexes, size_t n) {
 
     vector<SegmentMapping> mapping;
     auto pi = (const Index **)pindexes;
-    mapping.reserve(pi[0]->size());
-    merge_indexes(0, mapping, pi, n, 0, UINT64_MAX);
-    return new Index(std::move(mapping));
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += pi[i]->size();
+    size_t nthreads = min((size_t)std::thread::hardware_concurrency(), MERGE_MAX_THREADS);
+    if (total >= PARALLEL_MERGE_MIN && nthreads > 1) {
+        merge_indexes_parallel(mapping, pi, n, total, nthreads);
+    } else {
+        mapping.reserve(pi[0]->size());
+        merge_indexes(0, mapping, pi, n, 0, UINT64_MAX);
+    }
+    return new BTreeIndex(std::move(mapping));
 }
 } // namespace LSMT
@@ -26,13 +26,15 @@ IMemoryIndex -> IMemoryIndex0 -> IComboIndex -> Index0 ( set<SegmentMap> ) -> Co
 #include <inttypes.h>
 #include <cstddef>
 #include <assert.h>
+#include <vector>
 
 namespace LSMT {
-struct Segment {          // 48 + 18 == 64
-    uint64_t offset : 50; // offset (0.5 PB if in sector)
-    uint32_t length : 14; // length (8MB if in sector)
-    const static uint64_t MAX_OFFSET = (1UL << 50) - 1;
-    const static uint32_t MAX_LENGTH = (1 << 14) - 1;
+struct Segment {          // 44 + 20 == 64
+    uint64_t offset : 44; // offset (8 PB if in sector)
+    uint32_t length : 20; // length (512MB if in sector)
+    const static uint64_t MAX_OFFSET = (1UL << 44) - 1;
+    const static uint32_t MAX_LENGTH = (1 << 20) - 1;
+    const static uint32_t MAX_LENGTH_V1 = (1 << 14) - 1; // of the v1 index format
     const static uint64_t INVALID_OFFSET = MAX_OFFSET;
     uint64_t end() const {
         return offset + length;
@@ -50,15 +52,15 @@ struct Segment {          // 48 + 18 == 64
     }
 } __attribute__((packed));
 
-struct SegmentMapping : public Segment { // 64 + 55 + 9 == 128
-    uint64_t moffset : 55;               // mapped offset (2^64 B if in sector)
+struct SegmentMapping : public Segment { // 64 + 47 + 1 + 16 == 128
+    uint64_t moffset : 47;               // mapped offset (64 PB if in sector)
     uint32_t zeroed : 1;                 // indicating a zero-filled segment
-    uint8_t tag;
-    const static uint64_t MAX_MOFFSET = (1UL << 55) - 1;
+    uint16_t tag;
+    const static uint64_t MAX_MOFFSET = (1UL << 47) - 1;
 
     SegmentMapping() {
     }
-    SegmentMapping(uint64_t loffset, uint32_t length, uint64_t moffset, uint8_t tag = 0)
+    SegmentMapping(uint64_t loffset, uint32_t length, uint64_t moffset, uint16_t tag = 0)
         : Segment{loffset, length}, moffset(moffset), zeroed(0), tag(tag) {
         assert(length <= Segment::MAX_LENGTH);
     }
@@ -83,6 +85,22 @@ struct SegmentMapping : public Segment { // 64 + 55 + 9 == 128
     }
 } __attribute__((packed));
 
+// SegmentMapping is the layout of the v2 index format, while the v1 format,
+// of the layers saved by older versions, has a shorter length, supporting
+// segments of 8MB at most, and an 8-bit tag. Indexes of v1 are converted to
+// SegmentMapping when loaded, so that all the indexes are looked up alike.
+struct SegmentMappingV1 {  // 50 + 14 + 55 + 1 + 8 == 128
+    uint64_t offset : 50;
+    uint32_t length : 14;
+    uint64_t moffset : 55;
+    uint32_t zeroed : 1;
+    uint8_t tag;
+    const static uint64_t INVALID_OFFSET = (1UL << 50) - 1;
+} __attribute__((packed));
+
+static_assert(sizeof(SegmentMapping) == 16 && sizeof(SegmentMappingV1) == 16,
+              "the formats of index must be of the same size");
+
 // a read-only memory index for log-structured data
 class IMemoryIndex {
 public:
@@ -160,6 +178,13 @@ extern "C" IMemoryIndex *create_memory_index(const SegmentMapping *pmappings, st
                                              uint64_t moffset_begin, uint64_t moffset_end,
                                              bool ownership = true);
 
+// like create_memory_index(), but the array is within the region [addr,
+// addr + length) mapped by mmap(), which is unmapped when the index is
+// destructed; the region is left mapped if the index fails to be created
+extern "C" IMemoryIndex *create_mapped_index(const SegmentMapping *pmappings, std::size_t n,
+                                             uint64_t moffset_begin, uint64_t moffset_end,
+                                             void *addr, std::size_t length);
+
 // merge multiple indexes into a single one index
 // the `tag` field of each element in the result is subscript of `pindexes`:
 // after creation, the sources can be safely destoryed
@@ -169,13 +194,42 @@ extern "C" IMemoryIndex *merge_memory_indexes(const IMemoryIndex **pindexes, std
 // were one single index; inserting into a combo effectively inserting into the index0 part;
 // the mapped offset must be within [moffset_begin, moffset_end)
 extern "C" IComboIndex *create_combo_index(IMemoryIndex0 *index0, const IMemoryIndex *index,
-                                           uint8_t ro_index_count, bool ownership);
+                                           uint16_t ro_index_count, bool ownership);
+
+// merge the index0 of the combos created afterwards with their backing index
+// into one chunked sorted array, updated by every insert, so that a lookup
+// searches one index instead of both, at the cost of a copy of the backing
+// index; false by default
+extern "C" void set_combo_index_merged(bool enable);
 
 // compress raw index array by mergeing adjacent continuous mappings
-// returning compressed size of the array
-extern "C" std::size_t compress_raw_index(SegmentMapping *mapping, std::size_t n);
+// shorter than `max_length` in all, returning compressed size of the array
+extern "C" std::size_t compress_raw_index(SegmentMapping *mapping, std::size_t n,
+                                          uint32_t max_length = Segment::MAX_LENGTH);
 extern "C" std::size_t compress_raw_index_predict(const SegmentMapping *mapping, std::size_t n);
 
+// convert the `n` mappings in place from the v1 format, or to it, where they
+// must be short enough, and their tags are dropped, as in the index of a
+// layer; the invalid mappings are kept invalid
+extern "C" void mappings_from_v1(SegmentMapping *pmappings, std::size_t n);
+extern "C" int mappings_to_v1(SegmentMapping *pmappings, std::size_t n);
+
+// The index of a layer may be saved encoded, in blocks of ENCODED_BLOCK
+// mappings at most, each of which begins with the # of the mappings and the
+// size of the rest, as uint32_t, followed by 3 varints for each mapping: the
+// gap from the end of the previous one, the length shifted left by 1 with
+// `zeroed` in the lowest bit, and the zigzag delta of the mapped offset from
+// the mapped end of the previous one, which are mostly 3 or 4 bytes in all,
+// instead of 16. Blocks are decoded on their own, and tags are not kept.
+static const uint32_t ENCODED_BLOCK = 4096;
+
+// append the encoding of the `n` mappings in order to `out`
+void encode_index(const SegmentMapping *pmappings, std::size_t n, std::vector<char> &out);
+
+// decode the `n` mappings encoded in the `size` bytes of `buf`, which may be
+// followed by padding, into `pmappings`; return -1 with EINVAL if invalid
+int decode_index(const char *buf, std::size_t size, SegmentMapping *pmappings, std::size_t n);
+
 // lookup `idx` with `s`, and visit each segments via callbacks
 template <typename CB1, typename CB2>
 inline int foreach_segments(IMemoryIndex *idx, Segment s, CB1 cb_zero, CB2 cb_data) {
@@ -137,7 +137,7 @@ public:
         return file;
     }
     IFileRW *open_file_rw() {
-        auto fdata = lfs->open(data_name.back().c_str(), O_RDWR | O_APPEND, S_IRWXU);
+        auto fdata = lfs->open(data_name.back().c_str(), O_RDWR, S_IRWXU);
         auto findex = lfs->open(idx_name.back().c_str(), O_RDWR | O_APPEND, S_IRWXU);
         EXPECT_EQ(LSMT::open_file_rw(nullptr, findex), nullptr);
         EXPECT_EQ(LSMT::open_file_rw(nullptr, nullptr), nullptr);
@@ -210,6 +210,7 @@ public:
                 for (int i = 0; i < slice_count - 1; i++) {
                     seg_offset.push_back(rand() % length);
                 }
+                sort(seg_offset.begin(), seg_offset.end());
                 seg_offset.push_back(length);
                 for (auto i = 0; i < slice_count; i++) {
                     iov[i].iov_base = &buf[seg_offset[i]];
@@ -26,6 +26,8 @@ IMemoryIndex -> IMemoryIndex0 -> IComboIndex -> Index0 ( set<SegmentMap> ) -> Co
 #include <sys/time.h>
 #include "../../../photon/syncio/fd-events.h"
 #include "../../../photon/syncio/aio-wrapper.h"
+#include "../../fiemap.h"
+#include "../../forwardfs.h"
 
 #define USE_PTH true // use pthread
 
@@ -73,6 +75,12 @@ TEST(Index, lookup) {
     lookup_test<LevelIndex>(mapping, { 16, 10 }, { {16, 4, 56} });
     lookup_test<LevelIndex>(mapping, LEN(mapping), { 26, 10 }, nullptr, 0);
     lookup_test<LevelIndex>(mapping, { 6, 100 }, { {6, 4, 6}, {10, 10, 50}, {100, 6, 20} });
+
+    lookup_test<BTreeIndex>(mapping, { 5, 10 }, { {5, 5, 5}, {10, 5, 50} });
+    lookup_test<BTreeIndex>(mapping, { 16, 10 }, { {16, 4, 56} });
+    lookup_test<BTreeIndex>(mapping, LEN(mapping), { 26, 10 }, nullptr, 0);
+    lookup_test<BTreeIndex>(mapping, { 6, 100 }, { {6, 4, 6}, {10, 10, 50}, {100, 6, 20} });
+    lookup_test<BTreeIndex>(mapping, LEN(mapping), { 110, 10 }, nullptr, 0);
 }
 
 const static SegmentMapping mapping0[] = { {0, 20, 0},    {10, 15, 50},    {30, 100, 20}, {5, 10, 3},
@@ -189,6 +197,36 @@ TEST(Layered, Indexes) {
     printf("\n");
 }
 
+TEST(Layered, MergedComboIndex) {
+    vector<SegmentMapping> lower;
+    for (uint64_t offset = 0; lower.size() < 100000; offset += rand() % 3 * 64) {
+        lower.emplace_back(offset, rand() % 64 + 1, rand() % 10000000, rand() % 4);
+        offset = lower.back().end();
+    }
+    unique_ptr<IMemoryIndex> mi(create_memory_index(lower.data(), lower.size(), 0, UINT64_MAX, false));
+    unique_ptr<IMemoryIndex0> idx1(create_memory_index0()), idx2(create_memory_index0());
+    unique_ptr<IComboIndex> ci(create_combo_index(idx1.get(), mi.get(), 4, false));
+    set_combo_index_merged(true);
+    unique_ptr<IComboIndex> merged(create_combo_index(idx2.get(), mi.get(), 4, false));
+    set_combo_index_merged(false);
+    for (int i = 0; i < 100000; i++) {
+        SegmentMapping m{RAND_RANGE, (uint64_t)(rand() % 10000000 + 1), 4};
+        if (rand() % 8 == 0)
+            m.discard();
+        ci->insert(m);
+        merged->insert(m);
+    }
+    EXPECT_EQ(ci->size(), merged->size());
+    // looked up in one tree, the same as in both
+    SegmentMapping pm1[16], pm2[16];
+    for (int i = 0; i < 100000; i++) {
+        Segment s{RAND_RANGE};
+        auto n = ci->lookup(s, pm1, 16);
+        ASSERT_EQ(n, merged->lookup(s, pm2, 16));
+        EXPECT_EQ(0, memcmp(pm1, pm2, n * sizeof(SegmentMapping)));
+    }
+}
+
 IMemoryIndex0* idx0 = create_memory_index0();
 
 TEST(Perf, Index0_randwrite1M) {
@@ -226,6 +264,55 @@ TEST(Perf, Index1_randread1M) {
     delete[] p;
 }
 
+TEST(Index, btree_lookup) {
+    unique_ptr<IMemoryIndex0> i0(create_memory_index0());
+    for (int i = 0; i < 100 * 1000; ++i)
+        i0->insert({ RAND_RANGE, (uint64_t)i });
+    auto p = i0->dump();
+    Index idx(p, i0->size(), false);
+    BTreeIndex bidx(p, i0->size(), false);
+    SegmentMapping pm1[16], pm2[16];
+    for (int i = 0; i < 100 * 1000; ++i) {
+        auto s = Segment{ RAND_RANGE };
+        auto n1 = idx.lookup(s, pm1, LEN(pm1));
+        auto n2 = bidx.lookup(s, pm2, LEN(pm2));
+        ASSERT_EQ(n1, n2);
+        ASSERT_EQ(0, memcmp(pm1, pm2, n1 * sizeof(pm1[0])));
+    }
+    delete[] p;
+}
+
+TEST(Perf, Index_lookup_compare) {
+    auto p = idx0->dump();
+    auto n = idx0->size();
+    const int NLOOKUP = 1000 * 1000;
+    vector<Segment> segs(NLOOKUP);
+    for (auto &s : segs)
+        s = Segment{ RAND_RANGE };
+    auto bench = [&](const char *name, IMemoryIndex *idx) {
+        SegmentMapping pm[16];
+        size_t found = 0;
+        struct timeval t0, t1;
+        gettimeofday(&t0, nullptr);
+        for (auto &s : segs)
+            found += idx->lookup(s, pm, LEN(pm));
+        gettimeofday(&t1, nullptr);
+        auto us = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_usec - t0.tv_usec);
+        cout << name << ": " << NLOOKUP << " lookups in " << us << "us, " << found
+            << " mappings found" << endl;
+        return found;
+    };
+    Index idx(p, n, false);
+    LevelIndex lidx(p, n, false);
+    BTreeIndex bidx(p, n, false);
+    auto f1 = bench("Index", &idx);
+    auto f2 = bench("LevelIndex", &lidx);
+    auto f3 = bench("BTreeIndex", &bidx);
+    EXPECT_EQ(f1, f2);
+    EXPECT_EQ(f1, f3);
+    delete[] p;
+}
+
 void test_combo(const IMemoryIndex* indexes[], size_t ni, const SegmentMapping stdrst[],
     size_t nrst) {
     auto i0 = create_memory_index0(indexes[0]->buffer(), indexes[0]->size(), 0, 1000000);
@@ -318,6 +405,35 @@ TEST(Index, merge) {
          {2000, 30, 2393 + 1, 2} });
 }
 
+TEST(Index, merge_parallel) {
+    // layers of random mappings, more than PARALLEL_MERGE_MIN in all
+    const size_t nlayers = 8, nmappings = 64 * 1024;
+    vector<vector<SegmentMapping>> layers(nlayers);
+    vector<unique_ptr<IMemoryIndex>> indexes;
+    vector<const IMemoryIndex *> pi;
+    for (size_t k = 0; k < nlayers; k++) {
+        uint64_t offset = 0;
+        for (size_t i = 0; i < nmappings; i++) {
+            offset += rand() % 64;
+            uint32_t length = rand() % 128 + 1;
+            layers[k].emplace_back(offset, length, rand() % (1 << 30));
+            offset += length;
+        }
+        indexes.emplace_back(create_memory_index(layers[k].data(), nmappings, 0, UINT64_MAX, false));
+        pi.push_back(indexes.back().get());
+    }
+
+    vector<SegmentMapping> serial;
+    merge_indexes(0, serial, (const Index **)pi.data(), nlayers, 0, UINT64_MAX);
+    for (size_t nthreads : {2, 5, 16}) {
+        vector<SegmentMapping> parallel;
+        merge_indexes_parallel(parallel, (const Index **)pi.data(), nlayers,
+                               nlayers * nmappings, nthreads);
+        ASSERT_EQ(parallel.size(), serial.size());
+        EXPECT_EQ(memcmp(parallel.data(), serial.data(), serial.size() * sizeof(SegmentMapping)), 0);
+    }
+}
+
 void test_compress(SegmentMapping* src, size_t n1, const SegmentMapping* stdrst, size_t n2) {
     auto n1cp = compress_raw_index_predict(src, n1);
     EXPECT_EQ(n1cp, n2);
@@ -346,6 +462,34 @@ TEST(Index, compress) {
     test_compress({ {5, 5, 0}, {10, 10, 5, 3}, {20, 10, 15, 3}, {30, 10, 20} },
         { {5, 5, 0}, {10, 20, 5, 3}, {30, 10, 20} });
 }
+
+TEST(Index, encode) {
+    vector<SegmentMapping> mappings;
+    uint64_t offset = 0, moffset = 8;
+    for (int i = 0; i < 10000; i++) {
+        offset += rand() % 3 * 100;
+        SegmentMapping m(offset, rand() % Segment::MAX_LENGTH + 1, moffset);
+        if (rand() % 5 == 0)
+            m.discard();
+        else if (rand() % 5 == 0)
+            m.moffset = moffset = rand() % 100000; // backward
+        mappings.push_back(m);
+        offset = m.end();
+        moffset = m.mend();
+    }
+    vector<char> encoded;
+    encode_index(mappings.data(), mappings.size(), encoded);
+    EXPECT_LT(encoded.size(), mappings.size() * sizeof(SegmentMapping) / 2);
+    // decoded as is, with padding after the blocks
+    encoded.resize(encoded.size() + 100);
+    vector<SegmentMapping> decoded(mappings.size());
+    EXPECT_EQ(0, decode_index(encoded.data(), encoded.size(), decoded.data(), decoded.size()));
+    EXPECT_EQ(0, memcmp(mappings.data(), decoded.data(), mappings.size() * sizeof(mappings[0])));
+    // truncated, or with a block of a wrong size
+    EXPECT_EQ(-1, decode_index(encoded.data(), encoded.size() / 2, decoded.data(), decoded.size()));
+    encoded[4]++;
+    EXPECT_EQ(-1, decode_index(encoded.data(), encoded.size(), decoded.data(), decoded.size()));
+}
 // #endif
 
 struct ThreadArgs {
@@ -386,6 +530,288 @@ TEST_F(FileTest, create_open) {
     delete file2;
 }
 
+TEST_F(FileTest, zero_detect) {
+    auto file = create_file_rw();
+    file->set_zero_detect(true);
+    ALIGNED_MEM4K(buf, 64 * 1024);
+    ALIGNED_MEM4K(rbuf, 64 * 1024);
+    memset(buf, 0, 64 * 1024);
+    memset(buf + 16 * 1024, 0xcc, 16 * 1024);
+    memset(buf + 48 * 1024, 0xcc, 512);
+    EXPECT_EQ(64 * 1024, file->pwrite(buf, 64 * 1024, 0));
+    EXPECT_EQ(16 * 1024 + 512, (ssize_t)file->data_stat().total_data_size);
+
+    memset(rbuf, 0xff, 64 * 1024);
+    EXPECT_EQ(64 * 1024, file->pread(rbuf, 64 * 1024, 0));
+    EXPECT_EQ(0, memcmp(buf, rbuf, 64 * 1024));
+
+    // overwrite with zeros must hide the data written before
+    memset(buf, 0, 64 * 1024);
+    EXPECT_EQ(64 * 1024, file->pwrite(buf, 64 * 1024, 0));
+    EXPECT_EQ(64 * 1024, file->pread(rbuf, 64 * 1024, 0));
+    EXPECT_EQ(0, memcmp(buf, rbuf, 64 * 1024));
+    delete file;
+}
+
+TEST_F(FileTest, space_stat) {
+    auto file = create_file_rw();
+    ALIGNED_MEM4K(buf, 64 * 1024);
+    memset(buf, 0xcc, 64 * 1024);
+    EXPECT_EQ(64 * 1024, file->pwrite(buf, 64 * 1024, 0));
+    EXPECT_EQ(64 * 1024, file->pwrite(buf, 64 * 1024, 1024 * 1024));
+    // a segment longer than the window of lookup is one segment
+    for (int i = 0; i < 160; i++)
+        EXPECT_EQ(64 * 1024, file->pwrite(buf, 64 * 1024, 4 * 1024 * 1024 + i * 64 * 1024));
+    // overwritten in the middle and discarded at the end
+    EXPECT_EQ(16 * 1024, file->pwrite(buf, 16 * 1024, 16 * 1024));
+    EXPECT_EQ(0, file->fallocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                 1024 * 1024 + 56 * 1024, 8 * 1024));
+
+    IFileRO::SpaceStat st;
+    EXPECT_EQ(1, file->space_stat(&st, 1));
+    EXPECT_EQ((162 * 64 + 16) * 1024UL, st.data_size);
+    EXPECT_EQ((162 * 64 - 8) * 1024UL, st.live_size);
+    EXPECT_EQ(24 * 1024UL, st.garbage_size);
+    EXPECT_EQ(5UL, st.segments);
+    EXPECT_EQ(4UL, st.fragments);
+    EXPECT_EQ(1UL, st.zeroed_segments);
+    EXPECT_EQ(8 * 1024UL, st.zeroed_size);
+    EXPECT_EQ(2UL, st.histogram[5]);  // 16K and 16K
+    EXPECT_EQ(2UL, st.histogram[6]);  // 32K and 56K
+    EXPECT_EQ(1UL, st.histogram[14]); // 10M
+    delete file;
+}
+
+TEST_F(FileTest, live_ranges) {
+    auto file = create_file_rw();
+    ALIGNED_MEM4K(buf, 64 * 1024);
+    memset(buf, 0xcc, 64 * 1024);
+    EXPECT_EQ(64 * 1024, file->pwrite(buf, 64 * 1024, 0));
+    // overwritten in the middle and discarded at the end
+    EXPECT_EQ(16 * 1024, file->pwrite(buf, 16 * 1024, 16 * 1024));
+    EXPECT_EQ(0, file->fallocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 56 * 1024,
+                                 8 * 1024));
+    // sealed in place, with the garbage, unlike commit()
+    EXPECT_EQ(0, file->close_seal());
+    delete file;
+    auto fdata = lfs->open(data_name.back().c_str(), O_RDONLY);
+    ASSERT_NE(nullptr, fdata);
+    DEFER(delete fdata);
+    struct stat st;
+    EXPECT_EQ(0, fdata->fstat(&st));
+
+    // the header, the data left live, and the index and the trailer
+    vector<pair<uint64_t, uint64_t>> ranges;
+    EXPECT_EQ(0, live_ranges(fdata, ranges));
+    ASSERT_EQ(3UL, ranges.size());
+    EXPECT_EQ(make_pair(0UL, 20 * 1024UL), ranges[0]);
+    EXPECT_EQ(make_pair(36 * 1024UL, 24 * 1024UL), ranges[1]);
+    EXPECT_EQ(68 * 1024UL, ranges[2].first);
+    EXPECT_EQ((uint64_t)st.st_size, ranges[2].first + ranges[2].second);
+}
+
+TEST_F(FileTest, preadv) {
+    auto file = create_file_rw();
+    ALIGNED_MEM4K(buf, 64 * 1024);
+    ALIGNED_MEM4K(rbuf, 64 * 1024);
+    for (int i = 0; i < 64 * 1024; i++)
+        buf[i] = rand();
+    // leave holes and discarded ranges between the written segments
+    EXPECT_EQ(8 * 1024, file->pwrite(buf + 4096, 8 * 1024, 4096));
+    EXPECT_EQ(16 * 1024, file->pwrite(buf + 32 * 1024, 16 * 1024, 32 * 1024));
+    EXPECT_EQ(0, file->fallocate(3, 36 * 1024, 4096));
+    memset(buf, 0, 4096);
+    memset(buf + 12 * 1024, 0, 20 * 1024);
+    memset(buf + 36 * 1024, 0, 4096);
+    memset(buf + 48 * 1024, 0, 16 * 1024);
+
+    // iovecs that do not line up with either the segments or the alignment
+    size_t lens[] = {100, 4000, 12, 9000, 20000, 1, 32423};
+    iovec iov[7];
+    size_t off = 0;
+    for (int i = 0; i < 7; i++) {
+        iov[i] = {rbuf + off, lens[i]};
+        off += lens[i];
+    }
+    EXPECT_EQ(64 * 1024u, off);
+    memset(rbuf, 0xff, 64 * 1024);
+    EXPECT_EQ(64 * 1024, file->preadv(iov, 7, 0));
+    EXPECT_EQ(0, memcmp(buf, rbuf, 64 * 1024));
+    delete file;
+}
+
+TEST_F(FileTest, dedup) {
+    auto file = create_file_rw();
+    file->set_dedup(1024);
+    ALIGNED_MEM4K(buf, 32 * 1024);
+    ALIGNED_MEM4K(rbuf, 32 * 1024);
+    for (int i = 0; i < 16 * 1024; i++)
+        buf[i] = rand();
+    auto data_size = [&]() {
+        struct stat st;
+        lfs->stat(data_name.back().c_str(), &st);
+        return st.st_size;
+    };
+    auto base = data_size();
+    EXPECT_EQ(16 * 1024, file->pwrite(buf, 16 * 1024, 0));
+    EXPECT_EQ(base + 16 * 1024, data_size());
+    // the same data is skipped at its offset, and mapped to the blocks written elsewhere
+    EXPECT_EQ(16 * 1024, file->pwrite(buf, 16 * 1024, 0));
+    EXPECT_EQ(16 * 1024, file->pwrite(buf, 16 * 1024, 1 << 20));
+    EXPECT_EQ(base + 16 * 1024, data_size());
+    // and only the new blocks among the duplicates are appended
+    memcpy(buf + 16 * 1024, buf, 16 * 1024);
+    for (int i = 20 * 1024; i < 24 * 1024; i++)
+        buf[i] = rand();
+    EXPECT_EQ(32 * 1024, file->pwrite(buf, 32 * 1024, 2 << 20));
+    EXPECT_EQ(base + 20 * 1024, data_size());
+
+    for (int k = 0; k < 2; k++) {
+        EXPECT_EQ(16 * 1024, file->pread(rbuf, 16 * 1024, 0));
+        EXPECT_EQ(0, memcmp(buf, rbuf, 16 * 1024));
+        EXPECT_EQ(16 * 1024, file->pread(rbuf, 16 * 1024, 1 << 20));
+        EXPECT_EQ(0, memcmp(buf, rbuf, 16 * 1024));
+        EXPECT_EQ(32 * 1024, file->pread(rbuf, 32 * 1024, 2 << 20));
+        EXPECT_EQ(0, memcmp(buf, rbuf, 32 * 1024));
+        delete file;
+        file = open_file_rw();
+    }
+    delete file;
+}
+
+TEST_F(FileTest, seek_hole_data) {
+    auto file = create_file_rw();
+    ALIGNED_MEM4K(buf, 64 * 1024);
+    memset(buf, 0xcc, 64 * 1024);
+    const off_t M8 = 8 << 20;
+    EXPECT_EQ(8 * 1024, file->pwrite(buf, 8 * 1024, 4096));
+    EXPECT_EQ(16 * 1024, file->pwrite(buf, 16 * 1024, 32 * 1024));
+    EXPECT_EQ(0, file->fallocate(3, 36 * 1024, 4096));
+    // across the windows of index lookup
+    EXPECT_EQ(64 * 1024, file->pwrite(buf, 64 * 1024, M8 - 32 * 1024));
+
+    EXPECT_EQ(4096, file->lseek(0, SEEK_DATA));
+    EXPECT_EQ(5000, file->lseek(5000, SEEK_DATA));
+    EXPECT_EQ(12 * 1024, file->lseek(5000, SEEK_HOLE));
+    EXPECT_EQ(32 * 1024, file->lseek(12 * 1024, SEEK_DATA));
+    // zeroed segments are holes too
+    EXPECT_EQ(36 * 1024, file->lseek(32 * 1024, SEEK_HOLE));
+    EXPECT_EQ(40 * 1024, file->lseek(36 * 1024, SEEK_DATA));
+    EXPECT_EQ(48 * 1024, file->lseek(40 * 1024, SEEK_HOLE));
+    EXPECT_EQ(M8 - 32 * 1024, file->lseek(48 * 1024, SEEK_DATA));
+    EXPECT_EQ(M8 + 32 * 1024, file->lseek(M8 - 32 * 1024, SEEK_HOLE));
+    EXPECT_EQ(M8 + 32 * 1024, file->lseek(M8 + 32 * 1024, SEEK_HOLE));
+    EXPECT_EQ(-1, file->lseek(M8 + 32 * 1024, SEEK_DATA));
+    EXPECT_EQ(ENXIO, errno);
+    EXPECT_EQ(-1, file->lseek(vsize, SEEK_HOLE));
+    EXPECT_EQ(ENXIO, errno);
+
+    fiemap_t<8> fie(0, FIEMAP_MAX_OFFSET);
+    EXPECT_EQ(0, file->fiemap(&fie));
+    EXPECT_EQ(4u, fie.fm_mapped_extents);
+    uint64_t extents[][2] = {
+        {4096, 8 * 1024}, {32 * 1024, 4096}, {40 * 1024, 8 * 1024}, {M8 - 32 * 1024, 64 * 1024}};
+    for (int i = 0; i < 4; i++) {
+        EXPECT_EQ(extents[i][0], fie.fm_extents[i].fe_logical);
+        EXPECT_EQ(extents[i][1], fie.fm_extents[i].fe_length);
+        EXPECT_EQ(i == 3 ? FIEMAP_EXTENT_LAST : 0u, fie.fm_extents[i].fe_flags);
+    }
+    fiemap_t<2> fie2(0, FIEMAP_MAX_OFFSET);
+    EXPECT_EQ(0, file->fiemap(&fie2));
+    EXPECT_EQ(2u, fie2.fm_mapped_extents);
+    EXPECT_EQ(0u, fie2.fm_extents[1].fe_flags);
+    fiemap_t<2> fie3(36 * 1024, FIEMAP_MAX_OFFSET);
+    EXPECT_EQ(0, file->fiemap(&fie3));
+    EXPECT_EQ(2u, fie3.fm_mapped_extents);
+    EXPECT_EQ(40u * 1024, fie3.fm_extents[0].fe_logical);
+    EXPECT_EQ((uint32_t)FIEMAP_EXTENT_LAST, fie3.fm_extents[1].fe_flags);
+    // with no room for extents, they are counted
+    fiemap counting(0, FIEMAP_MAX_OFFSET, 0);
+    EXPECT_EQ(0, file->fiemap(&counting));
+    EXPECT_EQ(4u, counting.fm_mapped_extents);
+    delete file;
+}
+
+TEST_F(FileTest, pwritev_coalesce) {
+    auto file = create_file_rw();
+    file->set_index_group_commit(4096);
+    ALIGNED_MEM4K(buf, 64 * 1024);
+    ALIGNED_MEM4K(rbuf, 64 * 1024);
+    for (int i = 0; i < 64 * 1024; i++)
+        buf[i] = rand();
+    // one append and one mapping for the iovecs
+    iovec iov[4];
+    for (int i = 0; i < 4; i++)
+        iov[i] = {buf + i * 4096, 4096};
+    EXPECT_EQ(16 * 1024, file->pwritev(iov, 4, 0));
+    EXPECT_EQ(1u, file->index()->size());
+    // sequential writes extend the mapping
+    for (int i = 4; i < 7; i++)
+        EXPECT_EQ(4096, file->pwrite(buf + i * 4096, 4096, i * 4096));
+    EXPECT_EQ(1u, file->index()->size());
+    // but not across a discard
+    EXPECT_EQ(0, file->fallocate(3, 28 * 1024, 4096));
+    memset(buf + 28 * 1024, 0, 4096);
+    EXPECT_EQ(4096, file->pwrite(buf + 32 * 1024, 4096, 32 * 1024));
+    EXPECT_EQ(3u, file->index()->size());
+    // nor a write elsewhere
+    EXPECT_EQ(4096, file->pwrite(buf, 4096, 0));
+    EXPECT_EQ(4u, file->index()->size());
+
+    EXPECT_EQ(36 * 1024, file->pread(rbuf, 36 * 1024, 0));
+    EXPECT_EQ(0, memcmp(buf, rbuf, 36 * 1024));
+    delete file;
+    file = open_file_rw();
+    EXPECT_EQ(4u, file->index()->size());
+    memset(rbuf, 0xff, 36 * 1024);
+    EXPECT_EQ(36 * 1024, file->pread(rbuf, 36 * 1024, 0));
+    EXPECT_EQ(0, memcmp(buf, rbuf, 36 * 1024));
+    delete file;
+}
+
+TEST_F(FileTest, clone_file_rw) {
+    auto file = create_file_rw();
+    ALIGNED_MEM4K(buf, 64 * 1024);
+    ALIGNED_MEM4K(rbuf, 64 * 1024);
+    memset(buf, 0xcc, 64 * 1024);
+    EXPECT_EQ(64 * 1024, file->pwrite(buf, 64 * 1024, 0));
+    EXPECT_EQ(16 * 1024, file->pwrite(buf, 16 * 1024, 8 << 20));
+    EXPECT_EQ(0, file->fdatasync());
+    auto src_data = lfs->open(data_name.back().c_str(), O_RDONLY);
+    auto src_index = lfs->open(idx_name.back().c_str(), O_RDONLY);
+    DEFER(delete src_data);
+    DEFER(delete src_index);
+
+    name_next_layer();
+    auto fdata = lfs->open(data_name.back().c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    auto findex = lfs->open(idx_name.back().c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    // a sealed or a mismatched file is not cloned
+    EXPECT_EQ(-1, LSMT::clone_file_rw(src_index, src_data, fdata, findex));
+    EXPECT_EQ(0, LSMT::clone_file_rw(src_data, src_index, fdata, findex));
+    struct stat st1, st2;
+    EXPECT_EQ(0, src_data->fstat(&st1));
+    EXPECT_EQ(0, fdata->fstat(&st2));
+    EXPECT_EQ(st1.st_size, st2.st_size);
+    delete fdata;
+    delete findex;
+
+    auto clone = open_file_rw();
+    EXPECT_EQ(file->index()->size(), clone->index()->size());
+    EXPECT_EQ(64 * 1024, clone->pread(rbuf, 64 * 1024, 0));
+    EXPECT_EQ(0, memcmp(buf, rbuf, 64 * 1024));
+    EXPECT_EQ(16 * 1024, clone->pread(rbuf, 16 * 1024, 8 << 20));
+    EXPECT_EQ(0, memcmp(buf, rbuf, 16 * 1024));
+    // written independently of each other
+    memset(buf, 0xdd, 4096);
+    EXPECT_EQ(4096, clone->pwrite(buf, 4096, 0));
+    EXPECT_EQ(4096, file->pread(rbuf, 4096, 0));
+    EXPECT_EQ((char)0xcc, rbuf[0]);
+    EXPECT_EQ(4096, clone->pread(rbuf, 4096, 0));
+    EXPECT_EQ((char)0xdd, rbuf[0]);
+    delete clone;
+    delete file;
+}
+
 class FileTest1 : public FileTest {
 public:
     virtual void SetUp() override {
@@ -454,6 +880,231 @@ TEST_F(FileTest2, commit_close_seal) {
     cout << "end" << endl;
 }
 
+TEST_F(FileTest2, commit_parallel) {
+    reset_verify_file();
+    auto file = create_file();
+    // the same layer as committed one block after another
+    auto fserial = lfs->open(layer_name.back().c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    EXPECT_EQ(0, file->commit(fserial));
+    auto fparallel = lfs->open("parallel.lsmt", O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    CommitArgs args(fparallel);
+    args.concurrency = 8;
+    EXPECT_EQ(0, file->commit(args));
+    struct stat st1, st2;
+    fserial->fstat(&st1);
+    fparallel->fstat(&st2);
+    EXPECT_EQ(st1.st_size, st2.st_size);
+    delete fserial;
+    delete fparallel;
+    verify_file("parallel.lsmt");
+
+    // compressed on commit, into the same zfile as compressed afterwards
+    CompressOptions opt;
+    opt.verify = 1;
+    CompressArgs zargs(opt);
+    auto fz = lfs->open("parallel.lsmtz", O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    auto writer = ZFile::zfile_writer(fz, &zargs);
+    ASSERT_NE(nullptr, writer);
+    CommitArgs zcommit(writer);
+    zcommit.concurrency = 8;
+    EXPECT_EQ(0, file->commit(zcommit));
+    EXPECT_EQ(0, writer->close());
+    delete writer;
+    auto fsrc = lfs->open(layer_name.back().c_str(), O_RDONLY);
+    auto fz2 = lfs->open("serial.lsmtz", O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    EXPECT_EQ(0, zfile_compress(fsrc, fz2, &zargs));
+    fz->fstat(&st1);
+    fz2->fstat(&st2);
+    EXPECT_EQ(st1.st_size, st2.st_size);
+    delete fsrc;
+    delete fz2;
+    auto zfile = ZFile::zfile_open_ro(fz, true, true);
+    ASSERT_NE(nullptr, zfile);
+    auto lsmt = ::open_file_ro(zfile, true);
+    verify_file(lsmt);
+    delete lsmt;
+    delete file;
+    lfs->unlink("parallel.lsmt");
+    lfs->unlink("parallel.lsmtz");
+    lfs->unlink("serial.lsmtz");
+}
+
+TEST_F(FileTest2, commit_index_v2) {
+    // 32MB written sequentially, which is mapped by segments of 8MB at most
+    // in the writable layer
+    auto file = create_file_rw();
+    ALIGNED_MEM4K(buf, 1024 * 1024);
+    for (int i = 0; i < 32; i++) {
+        memset(buf, i + 1, 1024 * 1024);
+        EXPECT_EQ(1024 * 1024, file->pwrite(buf, 1024 * 1024, i * 1024 * 1024));
+    }
+    auto reopen = open_file_rw();
+    ASSERT_NE(nullptr, reopen);
+    EXPECT_EQ(file->index()->size(), reopen->index()->size());
+    delete reopen;
+
+    auto fv1 = lfs->open("v1.lsmt", O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    EXPECT_EQ(0, file->commit(fv1));
+    set_index_v2(true);
+    DEFER(set_index_v2(false));
+    auto fv2 = lfs->open("v2.lsmt", O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    EXPECT_EQ(0, file->commit(fv2));
+    delete file;
+    auto v1 = ::open_file_ro(fv1, true);
+    auto v2 = ::open_file_ro(fv2, true);
+    ASSERT_NE(nullptr, v1);
+    ASSERT_NE(nullptr, v2);
+    EXPECT_GE(v1->index()->size(), 4UL);
+    EXPECT_EQ(1UL, v2->index()->size());
+    for (int i = 0; i < 32; i++) {
+        for (auto f : {v1, v2}) {
+            EXPECT_EQ(1024 * 1024, f->pread(buf, 1024 * 1024, i * 1024 * 1024));
+            EXPECT_EQ(i + 1, buf[0]);
+            EXPECT_EQ(i + 1, buf[1024 * 1024 - 1]);
+        }
+    }
+    delete v1;
+    delete v2;
+    lfs->unlink("v1.lsmt");
+    lfs->unlink("v2.lsmt");
+}
+
+TEST_F(FileTest2, commit_index_encoded) {
+    reset_verify_file();
+    auto file = create_file();
+    auto fraw = lfs->open(layer_name.back().c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    EXPECT_EQ(0, file->commit(fraw));
+    set_index_encoding(true);
+    DEFER(set_index_encoding(false));
+    auto fencoded = lfs->open("encoded.lsmt", O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    EXPECT_EQ(0, file->commit(fencoded));
+    delete file;
+    struct stat st1, st2;
+    fraw->fstat(&st1);
+    fencoded->fstat(&st2);
+    auto raw = ::open_file_ro(fraw, true);
+    auto encoded = ::open_file_ro(fencoded, true);
+    ASSERT_NE(nullptr, raw);
+    ASSERT_NE(nullptr, encoded);
+    auto n = raw->index()->size();
+    // the data are the same, while the index is smaller
+    EXPECT_LT(st2.st_size, st1.st_size - (ssize_t)(n * sizeof(SegmentMapping) / 2));
+    ASSERT_EQ(n, encoded->index()->size());
+    EXPECT_EQ(0, memcmp(raw->index()->buffer(), encoded->index()->buffer(),
+                        n * sizeof(SegmentMapping)));
+    delete raw;
+    verify_file(encoded);
+    delete encoded;
+    lfs->unlink("encoded.lsmt");
+}
+
+TEST_F(FileTest2, compact_online) {
+    reset_verify_file();
+    auto file = create_file();
+    file->set_index_group_commit(4096);
+    auto before = file->data_stat();
+
+    name_next_layer();
+    auto fdata = lfs->open(data_name.back().c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    auto findex = lfs->open(idx_name.back().c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    // keep writing while compacting, which yields to it when throttled
+    void (FileTest2::*fn)(LSMT::IFileRW *, size_t) = &FileTest2::randwrite;
+    auto th = photon::thread_enable_join(
+        photon::thread_create11(fn, (FileTest2 *)this, file, (size_t)256));
+    int running = 1;
+    EXPECT_EQ(0, file->compact_online(fdata, findex, 1024, &running));
+    photon::thread_join(th);
+    auto after = file->data_stat();
+    LOG_INFO("data size: ` -> `, valid: ` -> `", before.total_data_size, after.total_data_size,
+             before.valid_data_size, after.valid_data_size);
+    EXPECT_LT(after.total_data_size, before.total_data_size);
+    verify_file(file);
+    delete file;
+
+    auto reopen = open_file_rw();
+    verify_file(reopen);
+    delete reopen;
+}
+
+static void sync_writer(IFileRW *file, int i) {
+    ALIGNED_MEM4K(buf, 4096);
+    memset(buf, i, 4096);
+    for (int k = 0; k < 16; k++) {
+        EXPECT_EQ(4096, file->pwrite(buf, 4096, (k * 8 + i) * 4096));
+        EXPECT_EQ(0, file->fdatasync());
+    }
+}
+
+TEST_F(FileTest2, group_fsync) {
+    auto file = create_file_rw();
+    file->set_index_group_commit(64 * 1024);
+    // writers syncing concurrently share the syncs
+    std::vector<photon::join_handle *> threads;
+    for (int i = 0; i < 8; i++)
+        threads.push_back(photon::thread_enable_join(photon::thread_create11(&sync_writer, file, i)));
+    for (auto th : threads)
+        photon::thread_join(th);
+    // all the index records have been appended, before the file is closed
+    auto reopen = open_file_rw();
+    EXPECT_EQ(file->index()->size(), reopen->index()->size());
+    ALIGNED_MEM4K(rbuf, 4096);
+    for (int k = 0; k < 16 * 8; k++) {
+        EXPECT_EQ(4096, reopen->pread(rbuf, 4096, k * 4096));
+        EXPECT_EQ(k % 8, rbuf[0]);
+        EXPECT_EQ(k % 8, rbuf[4095]);
+    }
+    delete reopen;
+    delete file;
+}
+
+// whose writes complete out of the order of being issued
+class SlowWriteFile : public FileSystem::ForwardFile_Ownership {
+public:
+    SlowWriteFile(IFile *file) : ForwardFile_Ownership(file, true) {
+    }
+    virtual ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override {
+        photon::thread_usleep(rand() % 1000);
+        return m_file->pwritev(iov, iovcnt, offset);
+    }
+};
+
+static void concurrent_writer(IFileRW *file, int i) {
+    ALIGNED_MEM4K(buf, 8192);
+    for (int k = 0; k < 16; k++) {
+        memset(buf, i, 8192);
+        buf[0] = k;
+        EXPECT_EQ(8192, file->pwrite(buf, 8192, (k * 8 + i) * 8192));
+    }
+}
+
+TEST_F(FileTest2, concurrent_writes) {
+    name_next_layer();
+    auto fdata = lfs->open(data_name.back().c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    auto findex = lfs->open(idx_name.back().c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    LayerInfo args(new SlowWriteFile(fdata), findex);
+    args.virtual_size = vsize;
+    auto file = ::create_file_rw(args, true);
+    std::vector<photon::join_handle *> threads;
+    for (int i = 0; i < 8; i++)
+        threads.push_back(
+            photon::thread_enable_join(photon::thread_create11(&concurrent_writer, file, i)));
+    for (auto th : threads)
+        photon::thread_join(th);
+    // the data file is filled without any gap
+    EXPECT_EQ((off_t)(HeaderTrailer::SPACE + 16 * 8 * 8192), fdata->lseek(0, SEEK_END));
+    delete file;
+
+    file = open_file_rw();
+    ALIGNED_MEM4K(rbuf, 8192);
+    for (int k = 0; k < 16 * 8; k++) {
+        EXPECT_EQ(8192, file->pread(rbuf, 8192, k * 8192));
+        EXPECT_EQ(k / 8, rbuf[0]);
+        EXPECT_EQ(k % 8, rbuf[1]);
+        EXPECT_EQ(k % 8, rbuf[8191]);
+    }
+    delete file;
+}
+
 TEST_F(FileTest3, stack_files) {
     CleanUp();
     cout << "generating " << FLAGS_layers << " RO layers by randwrite()" << endl;
@@ -469,6 +1120,16 @@ TEST_F(FileTest3, stack_files) {
     cout << "verifying stacked RO layers file" << endl;
     auto lower = open_files_ro(files, FLAGS_layers);
     verify_file(lower);
+    // the top layer hides nothing of its own
+    vector<IFileRO::SpaceStat> st(FLAGS_layers);
+    EXPECT_EQ(FLAGS_layers, lower->space_stat(st.data(), st.size()));
+    uint64_t live = 0;
+    for (auto &x : st) {
+        EXPECT_EQ(x.data_size, x.live_size + x.garbage_size);
+        live += x.live_size;
+    }
+    EXPECT_EQ(0UL, st[0].garbage_size);
+    EXPECT_EQ(lower->index()->block_count() * ALIGNMENT, live);
     ((LSMTReadOnlyFile*)lower)->m_index =
         create_level_index(lower->index()->buffer(), lower->index()->size(), 0, UINT64_MAX, false);
     EXPECT_EQ(((LSMTReadOnlyFile*)lower)->close_seal(), -1);
@@ -484,6 +1145,212 @@ TEST_F(FileTest3, stack_files) {
     delete file;
 }
 
+TEST_F(FileTest3, stack_files_lazy) {
+    CleanUp();
+    cout << "generating " << FLAGS_layers << " RO layers by randwrite()" << endl;
+    for (int i = 0; i < FLAGS_layers; ++i) {
+        files[i] = create_commit_layer(0, ut_io_engine);
+    }
+    cout << "verifying stacked RO layers file, with indexes being loaded" << endl;
+    auto lower = open_files_ro_lazy(files, FLAGS_layers);
+    verify_file(lower);
+    EXPECT_GT(lower->index()->size(), 0UL);
+    verify_file(lower);
+    cout << "generating a RW layer by randwrite()" << endl;
+    auto upper = create_file_rw();
+    auto file = stack_files(upper, lower, 0, true);
+    randwrite(file, FLAGS_nwrites);
+    verify_file(file);
+    delete file;
+}
+
+TEST_F(FileTest3, stack_files_with_merged_index) {
+    CleanUp();
+    cout << "generating " << FLAGS_layers << " RO layers by randwrite()" << endl;
+    for (int i = 0; i < FLAGS_layers; ++i) {
+        files[i] = create_commit_layer(0, ut_io_engine);
+    }
+    cout << "saving merged index of RO layers" << endl;
+    auto merged = open_files_ro(files, FLAGS_layers);
+    auto findex = lfs->open("merged.index", O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    EXPECT_EQ(save_merged_index(merged, findex), 0);
+    EXPECT_EQ(open_files_ro_with_index(files, FLAGS_layers - 1, findex), nullptr);
+    vector<IFile*> reversed(files, files + FLAGS_layers);
+    reverse(reversed.begin(), reversed.end());
+    EXPECT_EQ(open_files_ro_with_index(reversed.data(), FLAGS_layers, findex), nullptr);
+    cout << "verifying stacked RO layers file with merged index" << endl;
+    auto lower = open_files_ro_with_index(files, FLAGS_layers, findex);
+    delete findex;
+    ASSERT_NE(lower, nullptr);
+    EXPECT_EQ(lower->index()->size(), merged->index()->size());
+    delete merged;
+    verify_file(lower);
+    cout << "generating a RW layer by randwrite()" << endl;
+    auto upper = create_file_rw();
+    auto file = stack_files(upper, lower, 0, true);
+    randwrite(file, FLAGS_nwrites);
+    verify_file(file);
+    delete file;
+}
+
+TEST_F(FileTest3, stack_files_shared_index) {
+    CleanUp();
+    cout << "generating " << FLAGS_layers << " RO layers by randwrite()" << endl;
+    for (int i = 0; i < FLAGS_layers; ++i) {
+        files[i] = create_commit_layer(0, ut_io_engine);
+    }
+    vector<UUID> uuids(FLAGS_layers);
+    EXPECT_EQ(read_uuids(files, FLAGS_layers, uuids.data()), 0);
+    auto loaded = open_files_ro(files, FLAGS_layers);
+    for (int i = 0; i < FLAGS_layers; ++i) {
+        UUID uuid;
+        loaded->get_uuid(uuid, FLAGS_layers - 1 - i);
+        EXPECT_EQ(uuid, uuids[i]);
+    }
+    auto lazy = open_files_ro_lazy(files, FLAGS_layers);
+    EXPECT_EQ(share_index(lazy), nullptr);
+    delete lazy;
+    auto index = share_index(loaded);
+    ASSERT_NE(index, nullptr);
+    EXPECT_EQ(share_index(loaded), index);
+    cout << "verifying stacked RO layers files sharing an index" << endl;
+    auto lower = open_files_ro_shared(files, FLAGS_layers, uuids.data(), index);
+    ASSERT_NE(lower, nullptr);
+    EXPECT_EQ(lower->index()->buffer(), index->buffer());
+    EXPECT_EQ(lower->index()->increase_tag(), -1);
+    index.reset();
+    delete loaded;
+    verify_file(lower);
+    cout << "generating a RW layer by randwrite()" << endl;
+    auto upper = create_file_rw();
+    auto file = stack_files(upper, lower, 0, true);
+    randwrite(file, FLAGS_nwrites);
+    verify_file(file);
+    delete file;
+}
+
+TEST_F(FileTest3, stack_files_mmap_index) {
+    CleanUp();
+    cout << "generating " << FLAGS_layers << " RO layers by randwrite()" << endl;
+    for (int i = 0; i < FLAGS_layers; ++i) {
+        files[i] = create_commit_layer(0, ut_io_engine);
+    }
+    auto loaded = open_files_ro(files, FLAGS_layers);
+    auto findex = lfs->open("merged.index", O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    EXPECT_EQ(save_merged_index(loaded, findex), 0);
+    set_mmap_index(true);
+    DEFER(set_mmap_index(false));
+    cout << "verifying RO layers with mapped indexes" << endl;
+    auto layer = (LSMTReadOnlyFile *)::open_file_ro(files[0], false);
+    ASSERT_NE(layer, nullptr);
+    EXPECT_NE(dynamic_cast<MappedIndex *>(layer->m_index), nullptr);
+    delete layer;
+    auto lower = open_files_ro(files, FLAGS_layers);
+    ASSERT_NE(lower, nullptr);
+    EXPECT_EQ(lower->index()->size(), loaded->index()->size());
+    verify_file(lower);
+    delete lower;
+    lower = open_files_ro_with_index(files, FLAGS_layers, findex);
+    delete findex;
+    ASSERT_NE(lower, nullptr);
+    EXPECT_NE(dynamic_cast<MappedIndex *>(lower->index()), nullptr);
+    EXPECT_EQ(memcmp(lower->index()->buffer(), loaded->index()->buffer(),
+                     loaded->index()->size() * sizeof(SegmentMapping)), 0);
+    delete loaded;
+    verify_file(lower);
+    delete lower;
+}
+
+TEST_F(FileTest3, stack_files_resolve) {
+    CleanUp();
+    cout << "generating " << FLAGS_layers << " RO layers by randwrite()" << endl;
+    for (int i = 0; i < FLAGS_layers; ++i) {
+        files[i] = create_commit_layer(0, ut_io_engine);
+    }
+    auto lower = open_files_ro(files, FLAGS_layers);
+    ASSERT_NE(lower, nullptr);
+    DEFER(delete lower);
+    cout << "reading RO layers straight from the resolved extents" << endl;
+    const size_t max_length = 1024 * 1024;
+    std::unique_ptr<char[]> buf(new char[max_length]), data(new char[max_length]);
+    IFileRO::Extent extents[1024];
+    for (int i = 0; i < 1000; i++) {
+        off_t offset = rand() % (vsize - max_length) / ALIGNMENT * ALIGNMENT;
+        size_t length = (rand() % (max_length / ALIGNMENT) + 1) * ALIGNMENT;
+        auto n = lower->resolve(offset, length, extents, 1024);
+        ASSERT_GT(n, 0);
+        size_t pos = 0;
+        for (ssize_t j = 0; j < n; j++) {
+            auto &e = extents[j];
+            if (e.fd < 0)
+                memset(buf.get() + pos, 0, e.length);
+            else
+                ASSERT_EQ((ssize_t)e.length, ::pread(e.fd, buf.get() + pos, e.length, e.moffset));
+            pos += e.length;
+        }
+        ASSERT_EQ(length, pos);
+        ASSERT_EQ((ssize_t)length, lower->pread(data.get(), length, offset));
+        EXPECT_EQ(0, memcmp(buf.get(), data.get(), length));
+    }
+    // too many extents to resolve, or unaligned
+    EXPECT_EQ(-1, lower->resolve(0, max_length, extents, 1));
+    EXPECT_EQ(-1, lower->resolve(1, ALIGNMENT, extents, 1024));
+}
+
+// counts the bytes prefetched from it, by reads without buffer
+class PrefetchedFile : public FileSystem::ForwardFile {
+public:
+    size_t prefetched = 0;
+    PrefetchedFile(IFile *file) : ForwardFile(file) {
+    }
+    virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        if (iovcnt == 1 && iov->iov_base == nullptr) {
+            prefetched += iov->iov_len;
+            return iov->iov_len;
+        }
+        return m_file->preadv(iov, iovcnt, offset);
+    }
+};
+
+TEST_F(FileTest3, stack_files_prefetch) {
+    CleanUp();
+    cout << "generating " << FLAGS_layers << " RO layers by randwrite()" << endl;
+    std::vector<std::unique_ptr<PrefetchedFile>> layers;
+    IFile *prefetched[255];
+    for (int i = 0; i < FLAGS_layers; ++i) {
+        files[i] = create_commit_layer(0, ut_io_engine);
+        layers.emplace_back(new PrefetchedFile(files[i]));
+        prefetched[i] = layers.back().get();
+    }
+    auto lower = open_files_ro(prefetched, FLAGS_layers);
+    ASSERT_NE(lower, nullptr);
+    DEFER(delete lower);
+    cout << "prefetching RO layers, only the ranges mapped to them" << endl;
+    auto total = [&]() {
+        size_t n = 0;
+        for (auto &x : layers)
+            n += x->prefetched;
+        return n;
+    };
+    const size_t max_length = 8 * 1024 * 1024;
+    for (int i = 0; i < 100; i++) {
+        off_t offset = rand() % (vsize - max_length) / ALIGNMENT * ALIGNMENT;
+        size_t length = (rand() % (max_length / ALIGNMENT) + 1) * ALIGNMENT;
+        size_t mapped = 0;
+        foreach_segments(
+            lower->index(), Segment{(uint64_t)offset / ALIGNMENT, (uint32_t)(length / ALIGNMENT)},
+            [&](const Segment &) { return 0; },
+            [&](const SegmentMapping &m) {
+                mapped += m.length * ALIGNMENT;
+                return 0;
+            });
+        auto before = total();
+        iovec v{nullptr, length};
+        ASSERT_EQ((ssize_t)length, lower->preadv(&v, 1, offset));
+        EXPECT_EQ(mapped, total() - before);
+    }
+}
+
 TEST_F(FileTest3, stack_files_with_zfile) {
     CleanUp();
     cout << "generating " << FLAGS_layers << " RO layers by randwrite()" << endl;
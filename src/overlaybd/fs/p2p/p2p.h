@@ -0,0 +1,46 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "../../object.h"
+
+namespace FileSystem {
+class IFileSystem;
+class ICachePool;
+
+// Reads of the files opened by a P2P fs are first requested from the peers,
+// which serve the ranges they hold in their caches, and are forwarded to the
+// source file if no peer has it. `peers` are "[http://]host:port" of the P2P
+// servers, of which up to `max_tries` are asked for a range, in an order by
+// rendezvous hashing of the file and the offset, so that the nodes tend to
+// ask the same peers for the same range. The P2P fs owns `src`.
+IFileSystem *new_p2p_fs(IFileSystem *src, const std::vector<std::string> &peers, int max_tries,
+                        uint64_t timeout, const char *token = nullptr);
+
+// A P2P server serves ranges of the files cached in `pool` over HTTP, each
+// request being "GET /<escaped pathname>" with a "Range: bytes=x-y" header;
+// ranges not cached are answered with 404, and never fetched from the source.
+// With `token`, requests must carry "Authorization: Bearer <token>".
+// The server stops on deletion.
+class IP2PServer : public Object {};
+
+extern "C" IP2PServer *new_p2p_server(ICachePool *pool, IFileSystem *media_fs, uint16_t port,
+                                      const char *token = nullptr);
+
+} // namespace FileSystem
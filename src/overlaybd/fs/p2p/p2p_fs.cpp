@@ -0,0 +1,184 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "p2p.h"
+
+#include <fcntl.h>
+#include <algorithm>
+#include <functional>
+
+#include "../../alog-stdstring.h"
+#include "../../alog.h"
+#include "../../identity-pool.h"
+#include "../../iovector.h"
+#include "../../net/curl.h"
+#include "../../photon/thread.h"
+#include "../../utility.h"
+#include "../forwardfs.h"
+
+namespace FileSystem {
+
+// a peer failed to connect is not asked for a while
+static const uint64_t kPeerCooldown = 10L * 1000 * 1000;
+// ranges in a group of this size are asked from the same peers
+static const uint64_t kRangeGroupSize = 4UL * 1024 * 1024;
+// larger reads are not asked from peers, which refuse them anyway
+static const size_t kMaxPeerRead = 4UL * 1024 * 1024;
+
+static std::string url_escape(const char *s) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string ret;
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+            ret += c;
+        } else {
+            ret += '%';
+            ret += hex[c >> 4];
+            ret += hex[c & 15];
+        }
+    }
+    return ret;
+}
+
+class P2PFs : public ForwardFS_Ownership {
+public:
+    struct Peer {
+        std::string base; // "http://host:port"
+        uint64_t down_until = 0;
+    };
+
+    P2PFs(IFileSystem *src, const std::vector<std::string> &peers, int max_tries,
+          uint64_t timeout, const char *token)
+        : ForwardFS_Ownership(src, true), m_max_tries(max_tries), m_timeout(timeout) {
+        for (auto &p : peers) {
+            Peer peer;
+            peer.base = (p.find("://") == std::string::npos) ? "http://" + p : p;
+            while (!peer.base.empty() && peer.base.back() == '/')
+                peer.base.pop_back();
+            m_peers.push_back(peer);
+        }
+        if (token && *token)
+            m_auth = std::string("Bearer ") + token;
+    }
+
+    virtual IFile *open(const char *pathname, int flags, mode_t mode) override;
+    virtual IFile *open(const char *pathname, int flags) override;
+
+    // GET [offset, offset + count) of `path` from the peers into the iov,
+    // returning count, or -1 if no peer asked has it
+    ssize_t fetch(const std::string &path, const struct iovec *iov, int iovcnt, off_t offset,
+                  size_t count) {
+        if (count == 0 || count > kMaxPeerRead)
+            return -1;
+        auto group = std::to_string(offset / kRangeGroupSize);
+        std::vector<std::pair<size_t, Peer *>> ranks;
+        for (auto &peer : m_peers)
+            ranks.emplace_back(std::hash<std::string>()(peer.base + path + group), &peer);
+        std::sort(ranks.begin(), ranks.end(),
+                  [](const std::pair<size_t, Peer *> &a, const std::pair<size_t, Peer *> &b) {
+                      return a.first > b.first;
+                  });
+        int tries = 0;
+        for (auto &r : ranks) {
+            auto peer = r.second;
+            if (tries >= m_max_tries)
+                break;
+            if (peer->down_until > photon::now)
+                continue;
+            tries++;
+            Net::IOVWriter writer(iov, iovcnt);
+            writer.shrink_to(count);
+            auto curl = m_curl_pool.get();
+            DEFER(m_curl_pool.put(curl));
+            curl->reset_error();
+            curl->reset().clear_header().set_range(offset, offset + count - 1);
+            if (!m_auth.empty())
+                curl->append_header("Authorization", m_auth);
+            auto url = peer->base + "/" + url_escape(path.c_str());
+            auto code = curl->GET(url.c_str(), &writer, m_timeout);
+            if (code == 206 && writer.sum() == 0 && writer.drop == 0) {
+                LOG_DEBUG("fetched from peer ", VALUE(peer->base), VALUE(path), VALUE(offset),
+                          VALUE(count));
+                return count;
+            }
+            if (code == 0) {
+                LOG_WARN("peer ` unreachable, skip it for a while", peer->base);
+                peer->down_until = photon::now + kPeerCooldown;
+            }
+        }
+        return -1;
+    }
+
+protected:
+    std::vector<Peer> m_peers;
+    int m_max_tries;
+    uint64_t m_timeout;
+    std::string m_auth;
+    IdentityPool<Net::cURL, 4> m_curl_pool;
+};
+
+class P2PFile : public ForwardFile_Ownership {
+public:
+    P2PFile(IFile *file, P2PFs *fs, const char *path)
+        : ForwardFile_Ownership(file, true), m_fs(fs), m_path(path) {
+    }
+
+    virtual IFileSystem *filesystem() override {
+        return m_fs;
+    }
+
+    virtual ssize_t pread(void *buf, size_t count, off_t offset) override {
+        struct iovec v {
+            buf, count
+        };
+        return preadv(&v, 1, offset);
+    }
+
+    virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        auto count = iovector_view((struct iovec *)iov, iovcnt).sum();
+        if (m_fs->fetch(m_path, iov, iovcnt, offset, count) == (ssize_t)count)
+            return count;
+        return m_file->preadv(iov, iovcnt, offset);
+    }
+
+protected:
+    P2PFs *m_fs;
+    std::string m_path;
+};
+
+IFile *P2PFs::open(const char *pathname, int flags, mode_t mode) {
+    auto file = m_fs->open(pathname, flags, mode);
+    if (!file)
+        return nullptr;
+    return new P2PFile(file, this, pathname);
+}
+
+IFile *P2PFs::open(const char *pathname, int flags) {
+    auto file = m_fs->open(pathname, flags);
+    if (!file)
+        return nullptr;
+    return new P2PFile(file, this, pathname);
+}
+
+IFileSystem *new_p2p_fs(IFileSystem *src, const std::vector<std::string> &peers, int max_tries,
+                        uint64_t timeout, const char *token) {
+    if (!src || peers.empty() || max_tries <= 0)
+        LOG_ERROR_RETURN(EINVAL, nullptr, "invalid P2P fs parameters ", VALUE(peers.size()),
+                         VALUE(max_tries));
+    return new P2PFs(src, peers, max_tries, timeout, token);
+}
+
+} // namespace FileSystem
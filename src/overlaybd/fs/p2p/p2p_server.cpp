@@ -0,0 +1,280 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "p2p.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_set>
+
+#include "../../alog-stdstring.h"
+#include "../../alog.h"
+#include "../../estring.h"
+#include "../../photon/syncio/fd-events.h"
+#include "../../photon/thread.h"
+#include "../../photon/thread11.h"
+#include "../../utility.h"
+#include "../cache/pool_store.h"
+#include "../filesystem.h"
+
+namespace FileSystem {
+
+static const size_t kMaxRequestHeader = 8 * 1024;
+static const size_t kMaxServeSize = 4UL * 1024 * 1024;
+static const uint64_t kConnIdleTimeout = 30L * 1000 * 1000;
+static const uint64_t kAlignment = 4096; // cache files may be opened with O_DIRECT
+
+static int unhex(char c) {
+    if ('0' <= c && c <= '9')
+        return c - '0';
+    if ('a' <= c && c <= 'f')
+        return c - 'a' + 10;
+    if ('A' <= c && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static bool url_unescape(estring_view s, std::string &out) {
+    out.clear();
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] != '%') {
+            out += s[i];
+            continue;
+        }
+        int h, l;
+        if (i + 2 >= s.size() || (h = unhex(s[i + 1])) < 0 || (l = unhex(s[i + 2])) < 0)
+            return false;
+        out += (char)(h << 4 | l);
+        i += 2;
+    }
+    return true;
+}
+
+static ssize_t recv_some(int fd, void *buf, size_t count, uint64_t timeout) {
+    while (true) {
+        auto ret = ::read(fd, buf, count);
+        if (ret >= 0 || errno != EAGAIN)
+            return ret;
+        if (photon::wait_for_fd_readable(fd, timeout) < 0)
+            return -1;
+    }
+}
+
+static ssize_t send_all(int fd, const void *buf, size_t count, uint64_t timeout) {
+    size_t sent = 0;
+    while (sent < count) {
+        auto ret = ::write(fd, (const char *)buf + sent, count - sent);
+        if (ret < 0) {
+            if (errno != EAGAIN)
+                return -1;
+            if (photon::wait_for_fd_writable(fd, timeout) < 0)
+                return -1;
+            continue;
+        }
+        sent += ret;
+    }
+    return sent;
+}
+
+class P2PServer : public IP2PServer {
+public:
+    P2PServer(ICachePool *pool, IFileSystem *media_fs, const char *token)
+        : m_pool(pool), m_media_fs(media_fs) {
+        if (token && *token)
+            m_auth = std::string("Bearer ") + token;
+    }
+
+    ~P2PServer() {
+        m_stopping = true;
+        if (m_listener) {
+            photon::thread_interrupt(m_listener, EINTR);
+            photon::thread_join(m_listener_jh);
+        }
+        for (auto th : m_conns)
+            photon::thread_interrupt(th, EINTR);
+        while (!m_conns.empty())
+            m_conns_cv.wait_no_lock();
+        if (m_fd >= 0) {
+            photon::fd_events_forget(m_fd);
+            ::close(m_fd);
+        }
+    }
+
+    int start(uint16_t port) {
+        m_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_fd < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to create P2P server socket");
+        int on = 1;
+        ::setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (::bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to bind P2P server to port `", port);
+        if (::listen(m_fd, 128) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to listen on port `", port);
+        m_listener = photon::thread_create11(&P2PServer::accept_loop, this);
+        m_listener_jh = photon::thread_enable_join(m_listener);
+        LOG_INFO("P2P server listening on port `", port);
+        return 0;
+    }
+
+protected:
+    ICachePool *m_pool;
+    IFileSystem *m_media_fs;
+    std::string m_auth;
+    int m_fd = -1;
+    bool m_stopping = false;
+    photon::thread *m_listener = nullptr;
+    photon::join_handle *m_listener_jh = nullptr;
+    std::unordered_set<photon::thread *> m_conns;
+    photon::condition_variable m_conns_cv;
+
+    void accept_loop() {
+        while (!m_stopping) {
+            int fd = ::accept4(m_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EAGAIN) {
+                    photon::wait_for_fd_readable(m_fd);
+                } else if (errno != EINTR && errno != ECONNABORTED) {
+                    LOG_ERRNO_RETURN(0, , "P2P server failed to accept");
+                }
+                continue;
+            }
+            photon::thread_create11(&P2PServer::serve_conn, this, fd);
+        }
+    }
+
+    void serve_conn(int fd) {
+        m_conns.insert(photon::CURRENT);
+        DEFER({
+            photon::fd_events_forget(fd);
+            ::close(fd);
+            m_conns.erase(photon::CURRENT);
+            m_conns_cv.notify_all();
+        });
+        std::string buf;
+        char tmp[4096];
+        while (!m_stopping) {
+            size_t end;
+            while ((end = buf.find("\r\n\r\n")) == std::string::npos) {
+                if (buf.size() > kMaxRequestHeader)
+                    return;
+                auto ret = recv_some(fd, tmp, sizeof(tmp), kConnIdleTimeout);
+                if (ret <= 0)
+                    return;
+                buf.append(tmp, ret);
+            }
+            auto header = buf.substr(0, end + 4);
+            buf.erase(0, end + 4);
+            if (handle(fd, header) < 0)
+                return;
+        }
+    }
+
+    int reply(int fd, const char *status, const void *body = nullptr, size_t len = 0,
+              const std::string &extra = "") {
+        auto head = std::string("HTTP/1.1 ") + status + "\r\nContent-Length: " +
+                    std::to_string(len) + "\r\n" + extra + "\r\n";
+        if (send_all(fd, head.data(), head.size(), kConnIdleTimeout) < 0)
+            return -1;
+        if (len && send_all(fd, body, len, kConnIdleTimeout) < 0)
+            return -1;
+        return 0;
+    }
+
+    // returns < 0 if the connection is to be closed
+    int handle(int fd, const std::string &header) {
+        estring_view req(header);
+        auto line_end = req.find("\r\n");
+        auto line = req.substr(0, line_end);
+        if (!line.starts_with("GET /")) {
+            reply(fd, "405 Method Not Allowed");
+            return -1;
+        }
+        auto target = line.substr(4, line.find_first_of(' ', 4) - 4);
+        std::string path, range, auth;
+        estring headers(req.substr(line_end + 2));
+        for (auto l : headers.split("\r\n")) {
+            auto pos = l.find_first_of(':');
+            if (pos == estring_view::npos)
+                continue;
+            estring key = l.substr(0, pos).trim();
+            for (auto &c : key)
+                c = tolower(c);
+            if (key == "range")
+                range = l.substr(pos + 1).trim();
+            else if (key == "authorization")
+                auth = l.substr(pos + 1).trim();
+        }
+        if (!m_auth.empty() && auth != m_auth)
+            return reply(fd, "401 Unauthorized");
+        // pathnames are those of the cache pool, which must not escape its root
+        if (!url_unescape(target.substr(1), path) || path.empty() ||
+            ("/" + path + "/").find("/../") != std::string::npos)
+            return reply(fd, "400 Bad Request");
+
+        uint64_t begin, last;
+        if (sscanf(range.c_str(), "bytes=%lu-%lu", &begin, &last) != 2 || last < begin ||
+            last - begin + 1 > kMaxServeSize)
+            return reply(fd, "416 Range Not Satisfiable");
+        size_t count = last - begin + 1;
+
+        // never create cache files for the ranges not held
+        if (m_media_fs->access(m_pool->cache_key(path).c_str(), F_OK) < 0)
+            return reply(fd, "404 Not Found");
+        auto store = m_pool->open(path, O_RDWR, 0644);
+        if (!store)
+            return reply(fd, "404 Not Found");
+        DEFER(store->release());
+
+        auto off = alingn_down(begin, kAlignment);
+        auto len = alingn_up(last + 1, kAlignment) - off;
+        void *ptr = nullptr;
+        if (::posix_memalign(&ptr, kAlignment, len) != 0)
+            return reply(fd, "503 Service Unavailable");
+        DEFER(::free(ptr));
+        struct iovec iov {ptr, len};
+        auto tr = store->try_preadv(&iov, 1, off);
+        if (tr.refill_size != 0 || tr.size < (ssize_t)(begin - off + count))
+            return reply(fd, "404 Not Found");
+        auto range_header = "Content-Range: bytes " + std::to_string(begin) + "-" +
+                            std::to_string(last) + "/*\r\n";
+        LOG_DEBUG("serve peer ", VALUE(path), VALUE(begin), VALUE(count));
+        return reply(fd, "206 Partial Content", (char *)ptr + (begin - off), count, range_header);
+    }
+};
+
+IP2PServer *new_p2p_server(ICachePool *pool, IFileSystem *media_fs, uint16_t port,
+                           const char *token) {
+    if (!pool || !media_fs)
+        LOG_ERROR_RETURN(EINVAL, nullptr, "invalid P2P server parameters");
+    auto server = new P2PServer(pool, media_fs, token);
+    if (server->start(port) < 0) {
+        delete server;
+        return nullptr;
+    }
+    return server;
+}
+
+} // namespace FileSystem
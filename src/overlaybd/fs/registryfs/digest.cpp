@@ -0,0 +1,151 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "digest.h"
+#include <cpuid.h>
+#include <openssl/sha.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../../alog.h"
+#include "../../photon/thread.h"
+#include "../../photon/syncio/fd-events.h"
+
+namespace FileSystem {
+
+// smaller updates cost less than the switch to a hash thread
+static const size_t MIN_POOLED_UPDATE = 16 * 1024;
+
+// OS threads hashing the updates of photon threads, which sleep until done
+class HashPool {
+public:
+    // errno of the wakeup sent to the updater, as in aio-wrapper.cpp
+    const static int EOK = ENXIO;
+
+    explicit HashPool(int nthreads) {
+        for (int i = 0; i < nthreads; i++)
+            m_threads.emplace_back(&HashPool::worker, this);
+    }
+
+    ~HashPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        for (auto &th : m_threads)
+            th.join();
+    }
+
+    void update(SHA256_CTX *ctx, const void *buf, size_t len) {
+        Job job{ctx, buf, len, photon::CURRENT};
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_queue.push_back(&job);
+        }
+        m_cv.notify_one();
+        // woken up once by the hash thread, after the job is done
+        do {
+            photon::thread_usleep(-1);
+        } while (errno != EOK);
+    }
+
+private:
+    struct Job {
+        SHA256_CTX *ctx;
+        const void *buf;
+        size_t len;
+        photon::thread *th;
+    };
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    std::deque<Job *> m_queue;
+    std::vector<std::thread> m_threads;
+    bool m_stop = false;
+
+    void worker() {
+        while (true) {
+            Job *job;
+            {
+                std::unique_lock<std::mutex> lock(m_mtx);
+                m_cv.wait(lock, [&] { return m_stop || !m_queue.empty(); });
+                if (m_stop)
+                    return;
+                job = m_queue.front();
+                m_queue.pop_front();
+            }
+            SHA256_Update(job->ctx, job->buf, job->len);
+            photon::safe_thread_interrupt(job->th, EOK, 0);
+        }
+    }
+};
+
+static std::unique_ptr<HashPool> hash_pool;
+
+static bool has_sha_ni() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return false;
+    return ebx & (1U << 29);
+}
+
+void digest_set_hash_threads(int nthreads) {
+    hash_pool.reset(nthreads > 0 ? new HashPool(nthreads) : nullptr);
+    LOG_INFO("sha256 hashed by ` threads, SHA-NI: `", nthreads, has_sha_ni());
+}
+
+SHA256Stream::SHA256Stream() : m_ctx(new SHA256_CTX) {
+    SHA256_Init(m_ctx.get());
+}
+
+SHA256Stream::~SHA256Stream() {
+}
+
+void SHA256Stream::update(const void *buf, size_t len) {
+    if (hash_pool && photon::CURRENT && len >= MIN_POOLED_UPDATE)
+        hash_pool->update(m_ctx.get(), buf, len);
+    else
+        SHA256_Update(m_ctx.get(), buf, len);
+}
+
+void SHA256Stream::final(unsigned char *sha) {
+    SHA256_Final(sha, m_ctx.get());
+}
+
+std::string SHA256Stream::final() {
+    unsigned char sha[DIGEST_LENGTH];
+    final(sha);
+    return to_string(sha);
+}
+
+void SHA256Stream::digest(const void *buf, size_t len, unsigned char *sha) {
+    SHA256Stream stream;
+    stream.update(buf, len);
+    stream.final(sha);
+}
+
+std::string SHA256Stream::to_string(const unsigned char *sha) {
+    static const char hex[] = "0123456789abcdef";
+    std::string res = "sha256:";
+    for (size_t i = 0; i < DIGEST_LENGTH; i++) {
+        res += hex[sha[i] >> 4];
+        res += hex[sha[i] & 0xf];
+    }
+    return res;
+}
+
+} // namespace FileSystem
@@ -0,0 +1,55 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <stddef.h>
+#include <memory>
+#include <string>
+
+struct SHA256state_st;
+
+namespace FileSystem {
+
+// The sha256 of a stream of data, e.g. a blob being downloaded or uploaded,
+// hashed by OpenSSL, which uses SHA-NI where the CPU has it. The updates
+// of photon threads are hashed on the hash threads, if started, so that
+// the vcpu goes on serving I/O meanwhile, and the streams of concurrent
+// downloads and uploads are hashed in parallel.
+class SHA256Stream {
+public:
+    static const size_t DIGEST_LENGTH = 32;
+
+    SHA256Stream();
+    ~SHA256Stream();
+
+    void update(const void *buf, size_t len);
+    // the digest as "sha256:<hex>", as blobs are named in a registry
+    std::string final();
+    void final(unsigned char *sha);
+
+    // hashes `buf` at once
+    static void digest(const void *buf, size_t len, unsigned char *sha);
+    static std::string to_string(const unsigned char *sha);
+
+private:
+    std::unique_ptr<SHA256state_st> m_ctx;
+};
+
+// start `nthreads` OS threads shared by all the streams, for updates of at
+// least 16KB; 0 (the default) stops them, hashing updates in place. Must be
+// set before any stream is updated.
+extern "C" void digest_set_hash_threads(int nthreads);
+
+} // namespace FileSystem
@@ -14,11 +14,16 @@
    limitations under the License.
 */
 #include "registryfs.h"
+#include "digest.h"
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <unordered_map>
@@ -31,10 +36,14 @@
 #include "../../expirecontainer.h"
 #include "../../identity-pool.h"
 #include "../../iovector.h"
+#include "../../metrics.h"
 #include "../../net/curl.h"
+#include "../../net/http.h"
 #include "../../object.h"
 #include "../../photon/thread.h"
+#include "../../photon/thread11.h"
 #include "../../timeout.h"
+#include "../../trace.h"
 #include "../../utility.h"
 #include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
@@ -50,20 +59,168 @@ static const uint64_t kMinimalTokenLife = 30L * 1000 * 1000; // token lives atle
 static const uint64_t kMinimalAUrlLife = 300L * 1000 * 1000; // actual_url lives atleast 300s
 static const uint64_t kMinimalMetaLife = 300L * 1000 * 1000; // actual_url lives atleast 300s
 
+// resolved tokens, actual urls and blob sizes are kept as records with expiry
+// times, which are refreshed in background before they expire if they are in
+// use, and saved to the cache file if there is one
+static const time_t kDefaultTokenLife = 60;        // for tokens without "expires_in"
+static const time_t kAUrlRecordLife = 300;
+static const time_t kSizeRecordLife = 7 * 24 * 3600; // blobs are immutable
+static const uint64_t kRecordRefreshInterval = 5L * 1000 * 1000;
+
+// reads larger than this are split into sub-range GETs, see registryfs_set_chunked_get()
+static size_t get_chunk_size = 0;
+static int get_parallelism = 1;
+
+void registryfs_set_chunked_get(size_t chunk_size, int parallelism) {
+    get_chunk_size = chunk_size;
+    get_parallelism = parallelism;
+}
+
+// blobs created are uploaded in PATCHes of this size, see registryfs_set_upload_chunk_size()
+static const size_t kDefaultUploadChunkSize = 16UL * 1024 * 1024;
+static size_t upload_chunk_size = kDefaultUploadChunkSize;
+
+void registryfs_set_upload_chunk_size(size_t chunk_size) {
+    upload_chunk_size = chunk_size ? chunk_size : kDefaultUploadChunkSize;
+}
+
+// pending reads of a file are merged into one GET, see registryfs_set_coalescing()
+static size_t coalesce_max_gap = 0;
+static size_t coalesce_max_size = 0;
+static int coalesce_max_inflight = 1;
+
+void registryfs_set_coalescing(size_t max_gap, size_t max_size, int max_inflight) {
+    coalesce_max_gap = max_gap;
+    coalesce_max_size = max_size;
+    coalesce_max_inflight = max_inflight;
+}
+
+// a GET without its first byte after this percentile of the recent first-byte
+// latencies is duplicated, see registryfs_set_hedging()
+static int hedge_percentile = 0;
+static const size_t kLatencySamples = 256;
+static const size_t kMinimalLatencySamples = 32;
+static const uint64_t kMinimalHedgeDelay = 10 * 1000; // hedge no sooner than 10ms
+
+void registryfs_set_hedging(int percentile) {
+    hedge_percentile = percentile;
+}
+
+// GETs beyond this many wait for a slot, see registryfs_set_max_concurrent_gets()
+static int max_concurrent_gets = 0;
+
+void registryfs_set_max_concurrent_gets(int max_concurrent) {
+    max_concurrent_gets = max_concurrent;
+}
+
+// misses and prefetches are fetched in reads of about a bandwidth-delay
+// product of the link, within these bounds, see registryfs_set_fetch_size()
+static size_t fetch_size_min = 0;
+static size_t fetch_size_max = 0;
+// a throughput sample of a GET is taken over at least this long a transfer
+static const uint64_t kMinimalTransferTime = 1000;
+
+void registryfs_set_fetch_size(size_t min_size, size_t max_size) {
+    fetch_size_min = std::min(min_size, max_size);
+    fetch_size_max = max_size;
+}
+
+// blob GETs go through the native client, see registryfs_set_native_get()
+static bool native_get = false;
+
+void registryfs_set_native_get(bool on) {
+    native_get = on;
+}
+
+void registryfs_set_io_owner(RegistryIOOwner *owner) {
+    photon::thread_set_local(owner);
+}
+
+RegistryIOOwner *registryfs_get_io_owner() {
+    return (RegistryIOOwner *)photon::thread_get_local();
+}
+
+// failed GETs are retried after a jittered exponential backoff
+static const uint64_t kRetryBackoffBase = 20 * 1000;
+static const uint64_t kRetryBackoffMax = 1000 * 1000;
+
+static uint64_t retry_backoff(int n) {
+    uint64_t cap = std::min(kRetryBackoffBase << n, kRetryBackoffMax);
+    return cap / 2 + rand() % (cap / 2 + 1);
+}
+
+namespace {
+struct RegistryMetrics {
+    Metrics::Counter *gets_ok = Metrics::counter("overlaybd_registry_gets_total",
+                                                 "HTTP GETs of blobs", {{"result", "ok"}});
+    Metrics::Counter *gets_failed = Metrics::counter("overlaybd_registry_gets_total",
+                                                     "HTTP GETs of blobs", {{"result", "error"}});
+    Metrics::Histogram *latency = Metrics::histogram("overlaybd_registry_get_latency_seconds",
+                                                     "Latency of HTTP GETs of blobs");
+    Metrics::Counter *retries =
+        Metrics::counter("overlaybd_registry_retries_total", "HTTP GETs of blobs retried");
+    Metrics::Counter *bytes =
+        Metrics::counter("overlaybd_registry_bytes_total", "Bytes of blobs fetched");
+};
+
+RegistryMetrics &metrics() {
+    static RegistryMetrics m;
+    return m;
+}
+} // namespace
+
+// mirror endpoints of registry hosts, see registryfs_add_mirror()
+static std::mutex mirrors_mutex;
+static std::unordered_map<std::string, std::vector<std::string>> registry_mirrors;
+
+void registryfs_add_mirror(const char *registry, const char *endpoint) {
+    std::string ep = endpoint;
+    if (ep.find("://") == std::string::npos)
+        ep = "https://" + ep;
+    while (!ep.empty() && ep.back() == '/')
+        ep.pop_back();
+    std::lock_guard<std::mutex> lock(mirrors_mutex);
+    auto &eps = registry_mirrors[registry];
+    if (std::find(eps.begin(), eps.end(), ep) == eps.end())
+        eps.push_back(ep);
+}
+
+// an endpoint failed in a row is avoided for a cooldown doubling from 1s up to 60s
+static const uint64_t kEndpointCooldown = 1000 * 1000;
+static const uint64_t kMaxEndpointCooldown = 60L * 1000 * 1000;
+
+// "scheme://host[:port]" of an url
+static estring_view url_base(estring_view url) {
+    auto p = url.find("://");
+    p = (p == estring_view::npos) ? 0 : p + 3;
+    return url.substr(0, url.find_first_of('/', p));
+}
+
+// parameters of an auth challenge, split by the commas outside the quotes,
+// as there are in scopes of multiple actions, e.g. "repository:foo:pull,push"
 static std::unordered_map<estring_view, estring_view> str_to_kvmap(const estring &src) {
     std::unordered_map<estring_view, estring_view> ret;
-    for (const auto &token : src.split(',')) {
+    estring_view rest = src;
+    while (!rest.empty()) {
+        size_t end = 0;
+        for (bool quoted = false; end < rest.size() && (quoted || rest[end] != ','); end++) {
+            if (rest[end] == '"')
+                quoted = !quoted;
+        }
+        auto token = rest.substr(0, end);
+        rest = rest.substr(std::min(end + 1, rest.size()));
         auto pos = token.find_first_of('=');
-        auto key = token.substr(0, pos);
+        auto key = token.substr(0, pos).trim();
         auto val = token.substr(pos + 1).trim('\"');
         ret.emplace(key, val);
     }
     return ret;
 }
 
+class RegistryUploadFileImpl;
+
 class RegistryFS : public IFileSystem {
 public:
-    UNIMPLEMENTED_POINTER(IFile *creat(const char *, mode_t) override);
     UNIMPLEMENTED(int mkdir(const char *, mode_t) override);
     UNIMPLEMENTED(int rmdir(const char *) override);
     UNIMPLEMENTED(int link(const char *, const char *) override);
@@ -88,30 +245,332 @@ public:
         return open(pathname, flags); // ignore mode
     }
 
-    RegistryFS(PasswordCB callback, const char *caFile, uint64_t timeout)
+    // `pathname` is the url of the blob uploads of a repository
+    virtual IFile *creat(const char *pathname, mode_t) override;
+
+    // the size of the blob `pathname`, known otherwise, for it to be opened
+    // without a HEAD, see registryfs_set_blob_size()
+    void set_size(const char *pathname, uint64_t size) {
+        put_record(m_sizes, pathname, pathname, std::to_string(size), kSizeRecordLife);
+    }
+
+    RegistryFS(PasswordCB callback, const char *caFile, uint64_t timeout, const char *cacheFile)
         : m_callback(callback), m_caFile(caFile), m_timeout(timeout), m_meta_cache(kMinimalMetaLife),
-          m_scope_token(kMinimalTokenLife), m_url_actual(kMinimalAUrlLife) {
+          m_scope_token(kMinimalTokenLife), m_url_actual(kMinimalAUrlLife), m_cache_file(cacheFile) {
+        {
+            std::lock_guard<std::mutex> lock(mirrors_mutex);
+            m_mirrors = registry_mirrors;
+        }
+        if (!m_cache_file.empty())
+            load_records();
+        m_refresher = photon::thread_create11(&RegistryFS::refresh_loop, this);
+        m_refresher_jh = photon::thread_enable_join(m_refresher);
     }
 
     ~RegistryFS() {
+        m_stopping = true;
+        photon::thread_interrupt(m_refresher, EINTR);
+        photon::thread_join(m_refresher_jh);
+        if (m_dirty)
+            save_records();
+    }
+
+    struct Record {
+        estring url;   // what a token is authenticated for
+        estring value;
+        time_t refresh;
+        time_t expire;
+        bool used;     // since the last refresh
+    };
+    using Records = std::unordered_map<estring, Record>;
+
+    void put_record(Records &records, const estring &key, const estring &url,
+                    const estring &value, time_t life) {
+        auto now = time(nullptr);
+        records[key] = Record{url, value, now + life * 3 / 4, now + life, false};
+        m_dirty = true;
+    }
+
+    // a record still valid, marked as used
+    Record *get_record(Records &records, const estring &key) {
+        auto it = records.find(key);
+        if (it == records.end() || it->second.expire <= time(nullptr))
+            return nullptr;
+        it->second.used = true;
+        return &it->second;
+    }
+
+    void drop_record(Records &records, const estring &key) {
+        if (records.erase(key))
+            m_dirty = true;
+    }
+
+    // replace the value of an entry in `cache`, if present and not under construction
+    template <typename Cache>
+    static void update_cached(Cache &cache, const estring &key, const estring &value) {
+        auto it = cache.find(key);
+        if (it != cache.end() && !Cache::get_block_flag(it->second))
+            *Cache::get_ptr(it->second) = value;
     }
 
-    long GET(const char *url, Net::HeaderMap *headers, off_t offset, size_t count,
-             Net::IOVWriter *writer, uint64_t timeout) {
+    void refresh_loop() {
+        while (!m_stopping) {
+            photon::thread_usleep(kRecordRefreshInterval);
+            if (m_stopping)
+                break;
+            refresh_records();
+            if (m_dirty && !m_cache_file.empty())
+                save_records();
+        }
+    }
+
+    // keys of the records due to refresh, dropping the expired ones unused;
+    // a record failed to refresh is retried if it is used again
+    std::vector<estring> due_records(Records &records, time_t now) {
+        std::vector<estring> keys;
+        for (auto it = records.begin(); it != records.end();) {
+            if (it->second.used && it->second.refresh <= now) {
+                it->second.used = false;
+                keys.push_back(it->first);
+            } else if (!it->second.used && it->second.expire <= now) {
+                it = records.erase(it);
+                m_dirty = true;
+                continue;
+            }
+            ++it;
+        }
+        return keys;
+    }
+
+    void refresh_records() {
+        auto now = time(nullptr);
+        for (auto &key : due_records(m_tokens, now)) {
+            auto it = m_tokens.find(key);
+            if (it == m_tokens.end())
+                continue;
+            auto url = it->second.url;
+            auto cred = m_callback(url.c_str());
+            estring token;
+            time_t life;
+            if (authenticate(key.c_str(), cred.first, cred.second, &token, m_timeout, &life)) {
+                LOG_DEBUG("refreshed token ", VALUE(key));
+                put_record(m_tokens, key, url, token, life);
+                update_cached(m_scope_token, key, token);
+            }
+        }
+        for (auto &key : due_records(m_urls, now)) {
+            estring aurl;
+            long code;
+            if (getActualUrl(key.c_str(), &aurl, m_timeout, code)) {
+                LOG_DEBUG("refreshed actual url ", VALUE(key));
+                put_record(m_urls, key, key, aurl, kAUrlRecordLife);
+                update_cached(m_url_actual, key, aurl);
+            }
+        }
+        for (auto &key : due_records(m_sizes, now)) {
+            auto it = m_sizes.find(key);
+            if (it != m_sizes.end())
+                put_record(m_sizes, key, key, it->second.value, kSizeRecordLife);
+        }
+    }
+
+    void load_records() {
+        auto fd = ::open(m_cache_file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            if (errno != ENOENT)
+                LOG_ERRNO_RETURN(0, , "failed to open registry cache file `", m_cache_file);
+            return;
+        }
+        DEFER(::close(fd));
+        std::string content;
+        char buf[4096];
+        ssize_t n;
+        while ((n = ::read(fd, buf, sizeof(buf))) > 0)
+            content.append(buf, n);
+        rapidjson::Document d;
+        if (d.Parse(content.c_str()).HasParseError() || !d.IsObject())
+            LOG_ERROR_RETURN(0, , "failed to parse registry cache file `", m_cache_file);
+        auto now = time(nullptr);
+        auto load = [&](const char *name, Records &records) {
+            if (!d.HasMember(name) || !d[name].IsArray())
+                return;
+            for (auto &r : d[name].GetArray()) {
+                if (!r.IsObject() || !r.HasMember("key") || !r.HasMember("url") ||
+                    !r.HasMember("value") || !r.HasMember("refresh") || !r.HasMember("expire"))
+                    continue;
+                Record rec{r["url"].GetString(), r["value"].GetString(),
+                           (time_t)r["refresh"].GetInt64(), (time_t)r["expire"].GetInt64(), true};
+                if (rec.expire > now)
+                    records[r["key"].GetString()] = rec;
+            }
+        };
+        load("tokens", m_tokens);
+        load("urls", m_urls);
+        load("sizes", m_sizes);
+        LOG_INFO("loaded ` tokens, ` actual urls and ` blob sizes from `", m_tokens.size(),
+                 m_urls.size(), m_sizes.size(), m_cache_file);
+    }
+
+    // the file holds tokens, so it is only readable by the owner
+    void save_records() {
+        rapidjson::StringBuffer sb;
+        rapidjson::Writer<rapidjson::StringBuffer> w(sb);
+        auto save = [&](const char *name, Records &records) {
+            w.Key(name);
+            w.StartArray();
+            for (auto &x : records) {
+                w.StartObject();
+                w.Key("key");
+                w.String(x.first.c_str());
+                w.Key("url");
+                w.String(x.second.url.c_str());
+                w.Key("value");
+                w.String(x.second.value.c_str());
+                w.Key("refresh");
+                w.Int64(x.second.refresh);
+                w.Key("expire");
+                w.Int64(x.second.expire);
+                w.EndObject();
+            }
+            w.EndArray();
+        };
+        w.StartObject();
+        save("tokens", m_tokens);
+        save("urls", m_urls);
+        save("sizes", m_sizes);
+        w.EndObject();
+        m_dirty = false;
+
+        auto tmp = m_cache_file + ".tmp";
+        auto fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+            LOG_ERRNO_RETURN(0, , "failed to create registry cache file `", tmp);
+        auto ret = ::write(fd, sb.GetString(), sb.GetSize());
+        ::close(fd);
+        if (ret != (ssize_t)sb.GetSize() || ::rename(tmp.c_str(), m_cache_file.c_str()) < 0) {
+            ::unlink(tmp.c_str());
+            LOG_ERRNO_RETURN(0, , "failed to save registry cache file `", m_cache_file);
+        }
+    }
+
+    // a registry host or one of its mirrors, with its health measured by GETs
+    struct Endpoint {
+        estring base;            // "scheme://host[:port]" replacing that of urls
+        uint64_t latency = 0;    // moving average of GET latency, in us
+        uint32_t errors = 0;     // moving average of GET failure rate, in 1/1024
+        int failures = 0;        // consecutive failures
+        int inflight = 0;        // GETs running
+        uint64_t down_until = 0; // avoided until then after a failure
+
+        Endpoint(const std::string &base) : base(base) {
+        }
+        bool down() const {
+            return down_until > photon::now;
+        }
+        // lower is healthier; an endpoint not used yet scores the best
+        uint64_t score() const {
+            return (latency + 1000) * (1024 + 8 * errors) / 1024 * (1 + inflight);
+        }
+        void report(bool ok, uint64_t us) {
+            if (ok) {
+                latency = latency ? latency - latency / 8 + us / 8 : us;
+                errors -= errors / 8;
+                failures = 0;
+                down_until = 0;
+            } else {
+                errors += (1024 - errors) / 8;
+                auto cooldown = kEndpointCooldown << std::min(failures++, 6);
+                down_until = photon::now + std::min(cooldown, kMaxEndpointCooldown);
+            }
+        }
+        estring rebase(estring_view url) const {
+            return base + estring(url.substr(url_base(url).size()));
+        }
+    };
+
+    // the healthiest endpoint to request `url` from, among its registry and
+    // the mirrors of it, preferring those that are not cooling down
+    Endpoint *pick_endpoint(const char *url) {
+        estring base(url_base(url));
+        auto it = m_endpoints.find(base);
+        if (it == m_endpoints.end()) {
+            auto &eps = m_endpoints[base];
+            auto p = base.find("://");
+            auto mit = m_mirrors.find(p == estring::npos ? base : base.substr(p + 3));
+            if (mit != m_mirrors.end()) {
+                for (auto &m : mit->second)
+                    eps.emplace_back(m);
+            }
+            eps.emplace_back(base);
+            it = m_endpoints.find(base);
+        }
+        Endpoint *best = nullptr;
+        for (auto &ep : it->second) {
+            if (!best || (best->down() && !ep.down()) ||
+                (best->down() == ep.down() && ep.score() < best->score()))
+                best = &ep;
+        }
+        return best;
+    }
+
+    // GET `url` from the healthiest endpoint, a failure of which makes
+    // the succeeding retries go to the others
+    template <typename W>
+    long GET(const char *url, Net::HeaderMap *headers, off_t offset, size_t count, W *writer,
+             uint64_t timeout) {
+        auto ep = pick_endpoint(url);
+        auto ep_url = ep->rebase(url);
+        auto start = photon::now;
+        int eno = 0;
+        ep->inflight++;
+        long ret = get_from(ep_url.c_str(), headers, offset, count, writer, timeout, eno);
+        ep->inflight--;
+        if (ret != 0 || eno != EINTR) {
+            bool ok = ret == 200 || ret == 206;
+            ep->report(ok, photon::now - start);
+            (ok ? metrics().gets_ok : metrics().gets_failed)->inc();
+            metrics().latency->observe(photon::now - start);
+            if (ok && offset >= 0)
+                metrics().bytes->inc(count);
+            if (!ok && m_endpoints[estring(url_base(url))].size() > 1)
+                LOG_WARN("endpoint failed, fail over to others on retry ", VALUE(ep->base),
+                         VALUE(ret));
+        }
+        return ret;
+    }
+
+    template <typename W>
+    long get_from(const char *url, Net::HeaderMap *headers, off_t offset, size_t count,
+                  W *writer, uint64_t timeout, int &eno) {
         Timeout tmo(timeout);
         long ret = 0;
+        estring key(url);
         estring *actual_url = m_url_actual.acquire(url, [&]() -> estring * {
+            if (auto rec = get_record(m_urls, key))
+                return new estring(rec->value);
             estring *t = new estring();
             if (!getActualUrl(url, t, tmo.timeout(), ret)) {
                 delete t;
                 return nullptr;
             }
+            put_record(m_urls, key, key, *t, kAUrlRecordLife);
             return t;
         });
         if (actual_url == nullptr)
             return ret;
+        get_record(m_urls, key);
 
-        {
+        if (native_get) {
+            auto target = [&]() { return body_target(writer); };
+            errno = 0;
+            ret = Net::http_get(actual_url->c_str(), offset, count, headers, target,
+                                tmo.timeout_us(), m_caFile.c_str());
+            eno = errno;
+            // redirected further, left to cURL
+            if (300 <= ret && ret < 400 && headers)
+                headers->clear();
+        }
+        if (!native_get || (300 <= ret && ret < 400)) {
             auto curl = get_cURL();
             DEFER({ release_cURL(curl); });
             curl->set_redirect(10);
@@ -124,23 +583,132 @@ public:
                 curl->set_header_container(headers);
             }
             // going to challenge
+            errno = 0;
             if (writer) {
                 ret = curl->GET(actual_url->c_str(), writer, tmo.timeout_us());
             } else {
                 Net::DummyReaderWriter dummy;
                 ret = curl->GET(actual_url->c_str(), &dummy, tmo.timeout_us());
             }
+            eno = errno;
         }
         if (ret == 200 || ret == 206) {
             m_url_actual.release(url);
             return ret;
+        } else if (ret == 0 && eno == EINTR) {
+            // aborted as the loser of a hedged GET, the url is still good
+            m_url_actual.release(url);
+            return ret;
         } else {
             m_url_actual.release(url, true);
+            drop_record(m_urls, key);
             LOG_ERROR_RETURN(0, ret, "Failed to fetch data, even authenticate passed ", VALUE(ret),
                              VALUE(url));
         }
     }
 
+    // the writer a native GET reads the body into
+    static Net::IOVWriter *body_target(Net::IOVWriter *writer) {
+        return writer;
+    }
+    template <typename W>
+    static Net::IOVWriter *body_target(W *writer) {
+        return writer->claim();
+    }
+
+    // the round-trip time and throughput of a host, as moving averages of
+    // the first-byte latencies and transfer rates of its GETs
+    struct Link {
+        uint64_t rtt = 0;       // in us
+        uint64_t bandwidth = 0; // in bytes per second
+    };
+
+    void report_link(const char *url, uint64_t first_byte, uint64_t transfer, size_t bytes) {
+        auto &link = m_links[estring(url_base(url))];
+        // a transfer too short to time gives a lower bound of the bandwidth
+        uint64_t bw = bytes * 1000000 / std::max(transfer, kMinimalTransferTime);
+        link.rtt = link.rtt ? link.rtt - link.rtt / 8 + first_byte / 8 : first_byte;
+        link.bandwidth = link.bandwidth ? link.bandwidth - link.bandwidth / 8 + bw / 8 : bw;
+    }
+
+    // the bandwidth-delay product of the host of `url`, within the bounds
+    size_t fetch_size(const char *url) {
+        auto it = m_links.find(estring(url_base(url)));
+        if (it == m_links.end())
+            return fetch_size_min;
+        size_t bdp = it->second.bandwidth * it->second.rtt / 1000000;
+        return std::min(std::max(bdp, fetch_size_min), fetch_size_max);
+    }
+
+    void record_latency(uint64_t us) {
+        m_latency[m_nlatency++ % kLatencySamples] = std::min(us, (uint64_t)UINT32_MAX);
+    }
+
+    // how long to wait for the first byte of a GET before hedging it, or 0 if
+    // hedging is off or there are too few latency samples yet
+    uint64_t hedge_delay() {
+        if (hedge_percentile <= 0 || m_nlatency < kMinimalLatencySamples)
+            return 0;
+        size_t n = std::min(m_nlatency, kLatencySamples);
+        std::vector<uint32_t> v(m_latency, m_latency + n);
+        auto p = v.begin() + (n - 1) * std::min(hedge_percentile, 100) / 100;
+        std::nth_element(v.begin(), p, v.end());
+        return std::max((uint64_t)*p, kMinimalHedgeDelay);
+    }
+
+    RegistryIOOwner *io_owner() {
+        auto owner = registryfs_get_io_owner();
+        return owner ? owner : &m_default_owner;
+    }
+
+    // Wait for one of the `max_concurrent_gets` slots to GET `count` bytes.
+    // Waiters are served urgent first, then foreground, and then by their
+    // virtual start time, which advances by count / weight with each GET of an
+    // owner, so that owners share the slots by their weights (start-time fair
+    // queueing).
+    int acquire_get_slot(RegistryIOOwner *owner, size_t count, Timeout &timeout) {
+        SlotWaiter w{owner, std::max(m_vclock, owner->vtime), false};
+        owner->vtime = w.start + count / std::max(owner->weight, 1U) + 1;
+        if (max_concurrent_gets <= 0 ||
+            (m_running_gets < max_concurrent_gets && m_slot_waiters.empty())) {
+            m_running_gets++;
+            m_vclock = w.start;
+            return 0;
+        }
+        m_slot_waiters.push_back(&w);
+        while (!w.granted) {
+            if (m_slot_cv.wait_no_lock(timeout.timeout()) < 0 && !w.granted &&
+                errno == ETIMEDOUT) {
+                m_slot_waiters.erase(
+                    std::find(m_slot_waiters.begin(), m_slot_waiters.end(), &w));
+                LOG_ERROR_RETURN(ETIMEDOUT, -1, "timed out waiting for a GET slot ",
+                                 VALUE(m_running_gets), VALUE(m_slot_waiters.size()));
+            }
+        }
+        return 0;
+    }
+
+    void release_get_slot() {
+        m_running_gets--;
+        if (m_slot_waiters.empty())
+            return;
+        auto rank = [](const RegistryIOOwner *owner) {
+            return owner->urgent ? 0 : owner->background ? 2 : 1;
+        };
+        auto it = std::min_element(m_slot_waiters.begin(), m_slot_waiters.end(),
+                                   [&](const SlotWaiter *a, const SlotWaiter *b) {
+                                       if (rank(a->owner) != rank(b->owner))
+                                           return rank(a->owner) < rank(b->owner);
+                                       return a->start < b->start;
+                                   });
+        auto w = *it;
+        m_slot_waiters.erase(it);
+        w->granted = true;
+        m_vclock = std::max(m_vclock, w->start);
+        m_running_gets++;
+        m_slot_cv.notify_all();
+    }
+
     int stat(const char *path, struct stat *buf) override {
         auto ctor = [&]() -> ImageLayerMeta * {
             auto meta = new ImageLayerMeta;
@@ -176,19 +744,26 @@ public:
         if (getScopeAuth(url, &authurl, &scope, tmo.timeout()) < 0)
             return false;
 
+        // tokens are cached by auth url, as mirrors may have realms of their own
         if (!scope.empty()) {
-            token = m_scope_token.acquire(scope, [&]() -> estring * {
+            token = m_scope_token.acquire(authurl, [&]() -> estring * {
+                if (auto rec = get_record(m_tokens, authurl))
+                    return new estring(rec->value);
                 estring *token = new estring();
                 auto ret = m_callback(url);
-                if (!authenticate(authurl.c_str(), ret.first, ret.second, token, tmo.timeout())) {
+                time_t life;
+                if (!authenticate(authurl.c_str(), ret.first, ret.second, token, tmo.timeout(),
+                                  &life)) {
                     code = 401;
                     delete token;
                     return nullptr;
                 }
+                put_record(m_tokens, authurl, url, *token, life);
                 return token;
             });
             if (token == nullptr)
                 LOG_ERROR_RETURN(0, false, "Failed to get token");
+            get_record(m_tokens, authurl);
         }
         curl->set_redirect(0).set_nobody().set_header_container(&headers);
         if (token)
@@ -204,17 +779,32 @@ public:
             auto url = curl->getinfo<char *>(CURLINFO_REDIRECT_URL);
             *actual = url;
             if (!scope.empty())
-                m_scope_token.release(scope);
+                m_scope_token.release(authurl);
             return true;
         } else {
             // unexpected situation
-            if (!scope.empty())
-                m_scope_token.release(scope, true);
+            if (!scope.empty()) {
+                m_scope_token.release(authurl, true);
+                drop_record(m_tokens, authurl);
+            }
             LOG_ERROR_RETURN(0, false, "Failed to get actual url ", VALUE(url), VALUE(ret));
         }
     }
 
+    // a token for the scope challenged in `headers`, of a request to upload
+    // to `url`; such tokens are not cached, as they are for push
+    bool getUploadToken(const char *url, const Net::HeaderMap &headers, estring *token,
+                        uint64_t timeout) {
+        estring authurl, scope;
+        if (!getAuthUrl(&headers, &authurl, &scope))
+            return false;
+        auto cred = m_callback(url);
+        time_t life;
+        return authenticate(authurl.c_str(), cred.first, cred.second, token, timeout, &life);
+    }
+
 protected:
+    friend class RegistryUploadFileImpl;
     using CURLPool = IdentityPool<Net::cURL, 4>;
     CURLPool m_curl_pool;
     PasswordCB m_callback;
@@ -223,6 +813,30 @@ protected:
     ObjectCache<estring, ImageLayerMeta *> m_meta_cache;
     ObjectCache<estring, estring *> m_scope_token;
     ObjectCache<estring, estring *> m_url_actual;
+    std::unordered_map<std::string, std::vector<std::string>> m_mirrors;
+    std::unordered_map<estring, std::vector<Endpoint>> m_endpoints; // by registry url base
+    std::unordered_map<estring, Link> m_links;                      // by registry url base
+    estring m_cache_file;
+    Records m_tokens; // by auth url
+    Records m_urls;   // actual urls by url
+    Records m_sizes;  // blob sizes by path
+    bool m_dirty = false;
+    bool m_stopping = false;
+    photon::thread *m_refresher = nullptr;
+    photon::join_handle *m_refresher_jh = nullptr;
+    uint32_t m_latency[kLatencySamples]; // first-byte latencies of recent GETs in us
+    size_t m_nlatency = 0;
+
+    struct SlotWaiter {
+        RegistryIOOwner *owner;
+        uint64_t start; // virtual start time
+        bool granted;
+    };
+    RegistryIOOwner m_default_owner; // of GETs made without an owner
+    int m_running_gets = 0;
+    uint64_t m_vclock = 0; // virtual start time of the latest GET served
+    std::vector<SlotWaiter *> m_slot_waiters;
+    photon::condition_variable m_slot_cv;
 
     Net::cURL *get_cURL() {
         auto curl = m_curl_pool.get();
@@ -256,7 +870,7 @@ protected:
         return 0;
     }
 
-    int parseToken(const estring &jsonStr, estring *token) {
+    int parseToken(const estring &jsonStr, estring *token, time_t *life) {
         rapidjson::Document d;
         if (d.Parse(jsonStr.c_str()).HasParseError())
             LOG_ERROR_RETURN(0, -1, "JSON parse failed");
@@ -266,11 +880,15 @@ protected:
             *token = d["access_token"].GetString();
         else
             LOG_ERROR_RETURN(0, -1, "JSON has no 'token' or 'access_token' member");
+        *life = kDefaultTokenLife;
+        if (d.HasMember("expires_in") && d["expires_in"].IsInt64() && d["expires_in"].GetInt64() > 0)
+            *life = d["expires_in"].GetInt64();
         LOG_DEBUG("Get token", VALUE(*token));
         return 0;
     }
 
-    bool authenticate(const char *auth_url, std::string &username, std::string &password, estring *token, uint64_t timeout) {
+    bool authenticate(const char *auth_url, std::string &username, std::string &password,
+                      estring *token, uint64_t timeout, time_t *life) {
         Timeout tmo(timeout);
         Net::cURL *req = get_cURL();
         DEFER({ release_cURL(req); });
@@ -282,7 +900,7 @@ protected:
 
         LOG_DEBUG(VALUE(writer.string));
 
-        if (ret == 200 && parseToken(writer.string, token) == 0) {
+        if (ret == 200 && parseToken(writer.string, token, life) == 0) {
             return true;
         } else {
             LOG_ERROR_RETURN(0, false, "AUTH failed, response code=` ", ret, VALUE(auth_url));
@@ -321,6 +939,19 @@ public:
     uint64_t m_timeout;
     size_t m_filesize;
 
+    struct PendingRead {
+        const struct iovec *iov;
+        int iovcnt;
+        off_t offset;
+        size_t count;
+        ssize_t ret = 0;
+        int eno = 0;
+        bool done = false;
+    };
+    std::vector<PendingRead *> m_pending;
+    int m_inflight = 0;
+    photon::condition_variable m_pending_cv;
+
     RegistryFileImpl(const char *filename, const char *url, RegistryFS *fs, uint64_t timeout)
         : m_filename(filename), m_url(url), m_fs(fs), m_timeout(timeout) {
         m_filesize = 0;
@@ -331,6 +962,7 @@ public:
     }
 
     ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) {
+        SCOPE_TRACE("registry");
         if (m_filesize == 0) {
             struct stat stat;
             auto stret = fstat(&stat);
@@ -339,19 +971,204 @@ public:
             m_filesize = stat.st_size;
         }
         auto filesize = m_filesize;
-        int retry = 3;
         Timeout timeout(m_timeout);
+        auto count = iovector_view((struct iovec *)iov, iovcnt).sum();
+        if ((size_t)offset + count > filesize)
+            count = filesize - offset;
+        if (get_parallelism > 1 && get_chunk_size > 0 && count > get_chunk_size)
+            return preadv_chunked(iov, iovcnt, offset, count, timeout);
+        if (count > 0 && count <= coalesce_max_size)
+            return preadv_coalesced(iov, iovcnt, offset, count, timeout);
+        return fetch(iov, iovcnt, 0, offset, count, timeout);
+    }
+
+    // A read is queued as pending, and served right away by its own thread as
+    // long as there are less than `coalesce_max_inflight` fetches running.
+    // Otherwise it waits for one of them to finish, whose thread then serves
+    // all the reads pending by then, merging the neighboring ones into a
+    // single GET and copying the response out to each of them.
+    ssize_t preadv_coalesced(const struct iovec *iov, int iovcnt, off_t offset, size_t count,
+                             Timeout &timeout) {
+        PendingRead req{iov, iovcnt, offset, count};
+        m_pending.push_back(&req);
+        while (!req.done) {
+            if (m_inflight >= coalesce_max_inflight) {
+                m_pending_cv.wait_no_lock(timeout.timeout());
+                if (!req.done && timeout.expire() < photon::now) {
+                    auto it = std::find(m_pending.begin(), m_pending.end(), &req);
+                    if (it != m_pending.end()) {
+                        m_pending.erase(it);
+                        LOG_ERROR_RETURN(ETIMEDOUT, -1, "timed out waiting to fetch ",
+                                         VALUE(m_url), VALUE(offset));
+                    }
+                }
+                continue;
+            }
+            auto batch = std::move(m_pending);
+            m_pending.clear();
+            m_inflight++;
+            serve_pending(batch, timeout);
+            m_inflight--;
+            m_pending_cv.notify_all();
+        }
+        if (req.ret < 0)
+            errno = req.eno;
+        return req.ret;
+    }
+
+    void serve_pending(std::vector<PendingRead *> &batch, Timeout &timeout) {
+        std::sort(batch.begin(), batch.end(),
+                  [](PendingRead *a, PendingRead *b) { return a->offset < b->offset; });
+        for (size_t begin = 0, end; begin < batch.size(); begin = end) {
+            off_t range_begin = batch[begin]->offset;
+            off_t range_end = range_begin + batch[begin]->count;
+            for (end = begin + 1; end < batch.size(); end++) {
+                auto r = batch[end];
+                off_t new_end = std::max(range_end, (off_t)(r->offset + r->count));
+                if (r->offset > range_end + (off_t)coalesce_max_gap ||
+                    new_end - range_begin > (off_t)coalesce_max_size)
+                    break;
+                range_end = new_end;
+            }
+            if (end - begin == 1) {
+                auto r = batch[begin];
+                r->ret = fetch(r->iov, r->iovcnt, 0, r->offset, r->count, timeout);
+                r->eno = errno;
+                r->done = true;
+                continue;
+            }
+            size_t len = range_end - range_begin;
+            std::unique_ptr<char[]> buf;
+            std::vector<struct iovec> iovs;
+            bool scatter = scatter_iovs(batch, begin, end, buf, iovs);
+            if (!scatter) {
+                buf.reset(new char[len]);
+                iovs.assign(1, {buf.get(), len});
+            }
+            auto ret = fetch(iovs.data(), iovs.size(), 0, range_begin, len, timeout);
+            auto eno = errno;
+            LOG_DEBUG("coalesced ` reads into one", end - begin, VALUE(range_begin), VALUE(len),
+                      VALUE(scatter));
+            for (size_t i = begin; i < end; i++) {
+                auto r = batch[i];
+                if (ret == (ssize_t)len) {
+                    if (!scatter) {
+                        Net::IOVWriter writer(r->iov, r->iovcnt);
+                        writer.write(buf.get() + (r->offset - range_begin), r->count);
+                    }
+                    r->ret = r->count;
+                } else {
+                    r->ret = -1;
+                    r->eno = ret < 0 ? eno : EIO;
+                }
+                r->done = true;
+            }
+        }
+    }
+
+    // Build the iovecs to receive the GET of the sorted reads batch[begin, end)
+    // right into their own buffers, with the gaps between them going to a
+    // scratch `gap_buf`, so that the response needs no more copy, if the
+    // reads do not overlap and there are not too many iovecs for IOVWriter.
+    static bool scatter_iovs(std::vector<PendingRead *> &batch, size_t begin, size_t end,
+                             std::unique_ptr<char[]> &gap_buf, std::vector<struct iovec> &iovs) {
+        const size_t kMaxScatterIovs = 24;
+        size_t max_gap = 0, n = 0;
+        for (size_t i = begin; i < end; i++) {
+            auto r = batch[i];
+            if (i > begin) {
+                auto prev_end = batch[i - 1]->offset + (off_t)batch[i - 1]->count;
+                if (r->offset < prev_end)
+                    return false;
+                if (r->offset > prev_end) {
+                    max_gap = std::max(max_gap, (size_t)(r->offset - prev_end));
+                    n++;
+                }
+            }
+            n += r->iovcnt;
+        }
+        if (n > kMaxScatterIovs)
+            return false;
+        if (max_gap > 0)
+            gap_buf.reset(new char[max_gap]);
+        for (size_t i = begin; i < end; i++) {
+            auto r = batch[i];
+            if (i > begin) {
+                auto prev_end = batch[i - 1]->offset + (off_t)batch[i - 1]->count;
+                if (r->offset > prev_end)
+                    iovs.push_back({gap_buf.get(), (size_t)(r->offset - prev_end)});
+            }
+            size_t left = r->count;
+            for (int j = 0; j < r->iovcnt && left > 0; j++) {
+                auto len = std::min(left, r->iov[j].iov_len);
+                iovs.push_back({r->iov[j].iov_base, len});
+                left -= len;
+            }
+        }
+        return true;
+    }
+
+    struct ChunkedGet {
+        const struct iovec *iov;
+        int iovcnt;
+        off_t offset;
+        size_t count;
+        Timeout *timeout;
+        RegistryIOOwner *owner;
+        size_t next = 0;
+        int eno = 0;
+    };
+
+    // Each chunk of [offset, offset + count) is fetched by a GET of its own,
+    // up to `get_parallelism` of them at a time, each on a pooled connection
+    // and written to its place in the iov.
+    ssize_t preadv_chunked(const struct iovec *iov, int iovcnt, off_t offset, size_t count,
+                           Timeout &timeout) {
+        ChunkedGet ctx{iov, iovcnt, offset, count, &timeout, registryfs_get_io_owner()};
+        size_t nchunks = (count + get_chunk_size - 1) / get_chunk_size;
+        size_t nthreads = std::min(nchunks, (size_t)get_parallelism) - 1;
+        std::vector<photon::join_handle *> jhs;
+        for (size_t i = 0; i < nthreads; i++) {
+            auto th = photon::thread_create11(&RegistryFileImpl::fetch_chunks, this, &ctx);
+            jhs.push_back(photon::thread_enable_join(th));
+        }
+        fetch_chunks(&ctx);
+        for (auto jh : jhs)
+            photon::thread_join(jh);
+        if (ctx.eno != 0)
+            LOG_ERROR_RETURN(ctx.eno, -1, "failed to fetch chunks ", VALUE(m_url), VALUE(offset),
+                             VALUE(count));
+        return count;
+    }
+
+    void fetch_chunks(ChunkedGet *ctx) {
+        registryfs_set_io_owner(ctx->owner);
+        while (ctx->next * get_chunk_size < ctx->count && ctx->eno == 0) {
+            size_t skip = ctx->next++ * get_chunk_size;
+            size_t len = std::min(get_chunk_size, ctx->count - skip);
+            auto ret = fetch(ctx->iov, ctx->iovcnt, skip, ctx->offset + skip, len, *ctx->timeout);
+            if (ret != (ssize_t)len && ctx->eno == 0)
+                ctx->eno = (ret < 0 && errno) ? errno : EIO;
+        }
+    }
+
+    // GET [offset, offset + count) into the iov, after its first `skip` bytes
+    ssize_t fetch(const struct iovec *iov, int iovcnt, size_t skip, off_t offset, size_t count,
+                  Timeout &timeout) {
+        int retry = 3;
+        auto owner = m_fs->io_owner();
+        if (m_fs->acquire_get_slot(owner, count, timeout) < 0)
+            return -1;
+        DEFER(m_fs->release_get_slot());
 
     again:
         Net::IOVWriter container(iov, iovcnt);
-        auto count = container.sum();
-        if ((ssize_t)count + offset > filesize)
-            count = filesize - offset;
+        container.extract_front(skip);
+        container.shrink_to(count);
         LOG_DEBUG("pulling blob from docker registry: ", VALUE(m_url), VALUE(offset), VALUE(count));
 
         Net::HeaderMap headers;
-        long code =
-            m_fs->GET(m_url.c_str(), &headers, offset, count, &container, timeout.timeout());
+        long code = hedged_get(&headers, offset, count, &container, timeout);
 
         if (code != 200 && code != 206) {
             ERRNO eno;
@@ -366,8 +1183,9 @@ public:
                 }
                 LOG_WARN("failed to perform HTTP GET, going to retry ", VALUE(code), VALUE(offset),
                          VALUE(count), VALUE(ret_len), eno);
+                metrics().retries->inc();
 
-                photon::thread_usleep(1000);
+                photon::thread_usleep(std::min(retry_backoff(2 - retry), timeout.timeout()));
                 goto again;
             } else {
                 LOG_ERROR_RETURN(ENOENT, -1, "failed to perform HTTP GET ", VALUE(m_url),
@@ -379,9 +1197,114 @@ public:
             LOG_DEBUG(VALUE(line.first), VALUE(line.second));
         }
         headers.try_get("content-length", ret);
+        owner->bytes += ret;
+        owner->requests++;
         return ret;
     }
 
+    struct HedgedGet {
+        Net::IOVWriter *writer;
+        off_t offset;
+        size_t count;
+        Timeout *timeout;
+        int winner = -1;
+        int nstarted = 0;
+        int ndone = 0;
+        photon::condition_variable cv;
+        struct Attempt {
+            photon::thread *th = nullptr;
+            photon::join_handle *jh = nullptr;
+            uint64_t start = 0;
+            uint64_t first_byte = 0;
+            long code = 0;
+            bool done = false;
+            Net::HeaderMap headers;
+        } attempts[2];
+    };
+
+    // writer of an attempt, which takes over the caller's buffer on its first
+    // byte, so that the other attempt writes nothing and gets aborted by cURL
+    struct HedgedWriter {
+        RegistryFileImpl *file;
+        HedgedGet *ctx;
+        int idx;
+        // the caller's buffer, or nullptr if the other attempt has taken it
+        Net::IOVWriter *claim() {
+            if (ctx->winner < 0) {
+                ctx->winner = idx;
+                ctx->attempts[idx].first_byte = photon::now;
+                file->m_fs->record_latency(photon::now - ctx->attempts[idx].start);
+                ctx->cv.notify_all();
+            }
+            return ctx->winner == idx ? ctx->writer : nullptr;
+        }
+        size_t write(const void *buf, size_t n) {
+            auto writer = claim();
+            return writer ? writer->write(buf, n) : 0;
+        }
+    };
+
+    // GET into the writer; if no byte arrives before the hedge delay, the same
+    // range is requested again on another connection or mirror, and the response
+    // with the first byte is taken, while the other one is aborted.
+    long hedged_get(Net::HeaderMap *headers, off_t offset, size_t count, Net::IOVWriter *writer,
+                    Timeout &timeout) {
+        HedgedGet ctx{writer, offset, count, &timeout};
+        auto delay = m_fs->hedge_delay();
+        if (delay == 0) {
+            get_attempt(&ctx, 0);
+        } else {
+            start_attempt(&ctx, 0);
+            ctx.cv.wait_no_lock(std::min(delay, timeout.timeout()));
+            if (ctx.winner < 0 && ctx.ndone == 0 && timeout.expire() > photon::now) {
+                LOG_DEBUG("hedging slow GET ", VALUE(m_url), VALUE(offset), VALUE(delay));
+                start_attempt(&ctx, 1);
+            }
+            // wait for the winner, or for all the attempts if no one wins
+            while (ctx.winner >= 0 ? !ctx.attempts[ctx.winner].done : ctx.ndone < ctx.nstarted)
+                ctx.cv.wait_no_lock();
+            for (int i = 0; i < ctx.nstarted; i++) {
+                if (!ctx.attempts[i].done)
+                    photon::thread_interrupt(ctx.attempts[i].th, EINTR);
+            }
+            for (int i = 0; i < ctx.nstarted; i++)
+                photon::thread_join(ctx.attempts[i].jh);
+        }
+        auto &a = ctx.attempts[ctx.winner >= 0 ? ctx.winner : 0];
+        *headers = std::move(a.headers);
+        return a.code;
+    }
+
+    void start_attempt(HedgedGet *ctx, int idx) {
+        auto &a = ctx->attempts[idx];
+        a.th = photon::thread_create11(&RegistryFileImpl::get_attempt, this, ctx, idx);
+        a.jh = photon::thread_enable_join(a.th);
+        ctx->nstarted++;
+    }
+
+    void get_attempt(HedgedGet *ctx, int idx) {
+        auto &a = ctx->attempts[idx];
+        HedgedWriter writer{this, ctx, idx};
+        a.start = photon::now;
+        a.code = m_fs->GET(m_url.c_str(), &a.headers, ctx->offset, ctx->count, &writer,
+                           ctx->timeout->timeout());
+        if ((a.code == 200 || a.code == 206) && a.first_byte)
+            m_fs->report_link(m_url.c_str(), a.first_byte - a.start, photon::now - a.first_byte,
+                              ctx->count);
+        a.done = true;
+        ctx->ndone++;
+        ctx->cv.notify_all();
+    }
+
+    virtual int vioctl(int request, va_list args) override {
+        if (request != IOCTL_FETCH_SIZE || fetch_size_max == 0) {
+            errno = ENOSYS;
+            return -1;
+        }
+        *va_arg(args, size_t *) = m_fs->fetch_size(m_url.c_str());
+        return 0;
+    }
+
     /**
      * read meta data for the docker image layer. E.g. the content length in
      * bytes
@@ -391,7 +1314,8 @@ public:
         Timeout tmo(timeout);
         int retry = 3;
     again:
-        auto code = m_fs->GET(m_url.c_str(), &headers, -1, -1, nullptr, tmo.timeout());
+        auto code = m_fs->GET(m_url.c_str(), &headers, -1, -1, (Net::IOVWriter *)nullptr,
+                              tmo.timeout());
         if (code != 200 && code != 206) {
             if (tmo.expire() < photon::now)
                 LOG_ERROR_RETURN(ETIMEDOUT, -1, "get meta timedout");
@@ -447,7 +1371,8 @@ public:
     virtual int getUrl(char *buf, size_t size, uint64_t timeout) override {
         estring aurl;
         long code;
-        auto ret = m_fs->getActualUrl(m_url.c_str(), &aurl, timeout, code);
+        auto url = m_fs->pick_endpoint(m_url.c_str())->rebase(m_url);
+        auto ret = m_fs->getActualUrl(url.c_str(), &aurl, timeout, code);
         if (ret) {
             strncpy(buf, aurl.c_str(), size);
             return 0;
@@ -464,20 +1389,218 @@ inline IFile *RegistryFS::open(const char *pathname, int) {
         path = std::string("/") + pathname;
 
     auto file = new RegistryFileImpl(path.c_str(), url.c_str(), (RegistryFS *)this, m_timeout);
+    if (auto rec = get_record(m_sizes, url)) {
+        file->m_filesize = std::stoull(rec->value);
+        return file;
+    }
     struct stat buf;
     int ret = file->fstat(&buf);
     if (ret < 0) {
         delete file;
         LOG_ERROR_RETURN(0, nullptr, "failed to open and stat registry file `, ret `", pathname, ret);
     }
+    put_record(m_sizes, url, url, std::to_string(buf.st_size), kSizeRecordLife);
     return file;
 }
 
+// A blob uploaded by the OCI distribution protocol: a POST to the uploads url
+// of the repository starts a session, the data is sent in PATCHes of chunks in
+// order, each to the location returned by the previous request, and a PUT with
+// the digest, calculated incrementally as the data is written, completes it.
+class RegistryUploadFileImpl : public RegistryUploadFile {
+public:
+    RegistryFS *m_fs;
+    estring m_url;      // of the uploads of the repository
+    estring m_location; // of the session, which the registry may change with each PATCH
+    estring m_token;
+    uint64_t m_timeout;
+    size_t m_chunk_size;
+    std::string m_chunk; // written, but not uploaded yet
+    uint64_t m_uploaded = 0;
+    SHA256Stream m_sha;
+    std::string m_digest;
+    bool m_failed = false, m_closed = false;
+
+    RegistryUploadFileImpl(RegistryFS *fs, const char *url, uint64_t timeout)
+        : m_fs(fs), m_url(url), m_timeout(timeout), m_chunk_size(upload_chunk_size) {
+        m_chunk.reserve(m_chunk_size);
+    }
+
+    // a session not completed is cancelled, instead of leaving a partial blob
+    ~RegistryUploadFileImpl() {
+        if (!m_closed && !m_location.empty()) {
+            Net::HeaderMap headers;
+            request(&headers, [&](Net::cURL *curl, uint64_t timeout) {
+                Net::DummyReaderWriter dummy;
+                return curl->DELETE(m_location.c_str(), &dummy, timeout);
+            });
+        }
+    }
+
+    virtual IFileSystem *filesystem() override {
+        return m_fs;
+    }
+
+    // makes a request by `op`, authenticated again if rejected, as the token
+    // may expire during a long upload, or there is none yet
+    template <typename Op>
+    long request(Net::HeaderMap *headers, Op op) {
+        Timeout tmo(m_timeout);
+        for (int i = 0;; i++) {
+            headers->clear();
+            long ret;
+            {
+                auto curl = m_fs->get_cURL();
+                DEFER({ m_fs->release_cURL(curl); });
+                curl->set_header_container(headers);
+                if (!m_token.empty())
+                    curl->append_header(kAuthHeaderKey, kBearerAuthPrefix + m_token);
+                ret = op(curl, tmo.timeout_us());
+            }
+            if ((ret != 401 && ret != 403) || i > 0 ||
+                !m_fs->getUploadToken(m_url.c_str(), *headers, &m_token, tmo.timeout()))
+                return ret;
+        }
+    }
+
+    int update_location(const Net::HeaderMap &headers) {
+        auto it = headers.find("location");
+        if (it == headers.end())
+            LOG_ERROR_RETURN(EIO, -1, "no location of upload session in response ", VALUE(m_url));
+        estring location = it->second;
+        m_location = location.starts_with("/") ? estring(url_base(m_url)) + location : location;
+        return 0;
+    }
+
+    int start() {
+        Net::HeaderMap headers;
+        auto ret = request(&headers, [&](Net::cURL *curl, uint64_t timeout) {
+            Net::DummyReaderWriter dummy;
+            return curl->POST(m_url.c_str(), "", &dummy, timeout);
+        });
+        if (ret != 202)
+            LOG_ERROR_RETURN(EIO, -1, "failed to start upload ", VALUE(m_url), VALUE(ret));
+        return update_location(headers);
+    }
+
+    int upload_chunk() {
+        if (m_chunk.empty())
+            return 0;
+        Net::HeaderMap headers;
+        auto range = std::to_string(m_uploaded) + "-" +
+                     std::to_string(m_uploaded + m_chunk.size() - 1);
+        auto ret = request(&headers, [&](Net::cURL *curl, uint64_t timeout) {
+            Net::BufReader reader(m_chunk.data(), m_chunk.size());
+            Net::DummyReaderWriter dummy;
+            // without waiting for "100 Continue" before each chunk
+            curl->append_header("Content-Type", "application/octet-stream")
+                .append_header("Content-Range", range)
+                .append_header("Expect", "");
+            return curl->PATCH(m_location.c_str(), &reader, m_chunk.size(), &dummy, timeout);
+        });
+        if (ret != 202) {
+            m_failed = true;
+            LOG_ERROR_RETURN(EIO, -1, "failed to upload chunk ", VALUE(m_url), VALUE(range),
+                             VALUE(ret));
+        }
+        m_uploaded += m_chunk.size();
+        m_chunk.clear();
+        return update_location(headers);
+    }
+
+    virtual ssize_t write(const void *buf, size_t count) override {
+        if (m_closed || m_failed)
+            LOG_ERROR_RETURN(EBADF, -1, "write after close or failure ", VALUE(m_url));
+        m_sha.update(buf, count);
+        auto p = (const char *)buf;
+        for (size_t left = count; left > 0;) {
+            auto step = std::min(left, m_chunk_size - m_chunk.size());
+            m_chunk.append(p, step);
+            p += step;
+            left -= step;
+            if (m_chunk.size() == m_chunk_size && upload_chunk() < 0)
+                return -1;
+        }
+        return count;
+    }
+
+    uint64_t written() const {
+        return m_uploaded + m_chunk.size();
+    }
+
+    virtual ssize_t pwrite(const void *buf, size_t count, off_t offset) override {
+        if ((uint64_t)offset != written())
+            LOG_ERROR_RETURN(ESPIPE, -1, "only written sequentially");
+        return write(buf, count);
+    }
+
+    virtual off_t lseek(off_t offset, int whence) override {
+        if (offset != 0 || whence == SEEK_SET)
+            LOG_ERROR_RETURN(ESPIPE, -1, "only written sequentially");
+        return written();
+    }
+
+    virtual int fstat(struct stat *buf) override {
+        memset(buf, 0, sizeof(*buf));
+        buf->st_mode = S_IFREG | S_IWRITE;
+        buf->st_size = written();
+        return 0;
+    }
+
+    virtual int close() override {
+        if (m_closed)
+            return 0;
+        if (m_failed || upload_chunk() < 0)
+            return -1;
+        auto digest = m_sha.final();
+        auto url = m_location + (m_location.find('?') == estring::npos ? "?" : "&") +
+                   "digest=" + digest;
+        Net::HeaderMap headers;
+        auto ret = request(&headers, [&](Net::cURL *curl, uint64_t timeout) {
+            Net::BufReader reader(nullptr, 0);
+            Net::DummyReaderWriter dummy;
+            curl->setopt(CURLOPT_INFILESIZE_LARGE, 0L);
+            return curl->PUT(url.c_str(), &reader, &dummy, timeout);
+        });
+        if (ret != 201) {
+            m_failed = true;
+            LOG_ERROR_RETURN(EIO, -1, "failed to complete upload ", VALUE(m_url), VALUE(ret));
+        }
+        m_closed = true;
+        m_digest = digest;
+        LOG_INFO("uploaded blob ` of ` bytes to `", m_digest, m_uploaded, m_url);
+        return 0;
+    }
+
+    virtual std::string digest() override {
+        return m_digest;
+    }
+
+    UNIMPLEMENTED(ssize_t pread(void *buf, size_t count, off_t offset) override);
+    UNIMPLEMENTED(ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override);
+};
+
+inline IFile *RegistryFS::creat(const char *pathname, mode_t) {
+    auto file = new RegistryUploadFileImpl((RegistryFS *)this, pathname, m_timeout);
+    if (file->start() < 0) {
+        delete file;
+        LOG_ERROR_RETURN(0, nullptr, "failed to create registry upload `", pathname);
+    }
+    return file;
+}
+
+void registryfs_set_blob_size(IFileSystem *fs, const char *pathname, uint64_t size) {
+    auto rfs = dynamic_cast<RegistryFS *>(fs);
+    if (rfs && size > 0)
+        rfs->set_size(pathname, size);
+}
+
 IFileSystem *new_registryfs_with_credential_callback(PasswordCB callback,
-                                                   const char *caFile, uint64_t timeout) {
+                                                   const char *caFile, uint64_t timeout,
+                                                   const char *cacheFile) {
     if (!callback)
         LOG_ERROR_RETURN(EINVAL, nullptr, "password callback not set");
-    return new RegistryFS(callback, caFile ? caFile : "", timeout);
+    return new RegistryFS(callback, caFile ? caFile : "", timeout, cacheFile ? cacheFile : "");
 }
 
 } // namespace FileSystem
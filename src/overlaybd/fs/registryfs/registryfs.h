@@ -44,12 +44,87 @@ public:
     }
 };
 
+// IFile created by registryfs, with the url of the blob uploads of a
+// repository, e.g. "https://host/v2/<repo>/blobs/uploads/", is a
+// RegistryUploadFile. What is written to it, sequentially, is uploaded as a
+// blob in chunks as it goes, and close() completes the upload.
+class RegistryUploadFile : public VirtualReadOnlyFile {
+public:
+    // "sha256:<hex>" of the blob, available after closed successfully
+    virtual std::string digest() = 0;
+};
+
 using PasswordCB = Delegate<std::pair<std::string, std::string>, const char *>;
 
+// the party, e.g. a device, on whose behalf registry GETs are made
+struct RegistryIOOwner {
+    uint32_t weight = 1;     // share of the GETs, relative to the other owners
+    bool background = false; // served only when no foreground GET is waiting
+    bool urgent = false;     // served before the others, e.g. reads of guest fs metadata
+    uint64_t bytes = 0;      // fetched on behalf of the owner
+    uint64_t requests = 0;
+    uint64_t vtime = 0;      // virtual finish time of its last GET, kept by registryfs
+};
+
 extern "C" {
+// `cacheFile`, if given, persists the resolved tokens, actual urls and blob sizes
+// with their expiry times, so that they are reused after a restart
 IFileSystem *new_registryfs_with_credential_callback(PasswordCB callback,
                                                    const char *caFile = nullptr,
-                                                   uint64_t timeout = -1);
+                                                   uint64_t timeout = -1,
+                                                   const char *cacheFile = nullptr);
+
+// split reads of registry files larger than `chunk_size` into sub-range GETs,
+// `parallelism` of them running concurrently in photon threads; parallelism
+// of 1 (the default) or chunk_size of 0 reads with a single GET.
+void registryfs_set_chunked_get(size_t chunk_size, int parallelism);
+
+// upload blobs created by registryfs in PATCHes of `chunk_size` bytes,
+// 16MB by default; 0 restores the default.
+void registryfs_set_upload_chunk_size(size_t chunk_size);
+
+// merge concurrent reads of a registry file, that are at most `max_gap` bytes
+// apart and `max_size` bytes in total, into one GET, once `max_inflight` GETs
+// of the file are running; max_size of 0 (the default) disables coalescing.
+void registryfs_set_coalescing(size_t max_gap, size_t max_size, int max_inflight);
+
+// duplicate a GET on another connection, if its first byte has not arrived
+// after the `percentile`-th of the recent first-byte latencies, and take the
+// faster response; percentile of 0 (the default) disables hedging.
+void registryfs_set_hedging(int percentile);
+
+// add `endpoint` ("[scheme://]host[:port]") as a mirror of the `registry` host,
+// to which GETs of the registry fail over; each GET goes to the healthiest one
+// of the registry and its mirrors, by latency and failure rate. It applies to
+// registryfs created afterwards.
+void registryfs_add_mirror(const char *registry, const char *endpoint);
+
+// let `fs` open the blob `pathname` as one of `size` bytes, e.g. as given by
+// the manifest of the image, instead of asking the registry with a HEAD
+void registryfs_set_blob_size(IFileSystem *fs, const char *pathname, uint64_t size);
+
+// account and schedule the GETs made by the calling photon thread afterwards
+// to `owner`; nullptr (the default) for none, which is foreground of weight 1.
+void registryfs_set_io_owner(RegistryIOOwner *owner);
+RegistryIOOwner *registryfs_get_io_owner();
+
+// run at most `max_concurrent` GETs of a registryfs at a time; the others wait
+// in a weighted fair queue across their owners, urgent ones first, and then
+// foreground ones.
+// 0 (the default) means no limit.
+void registryfs_set_max_concurrent_gets(int max_concurrent);
+
+// GET ranges of blobs by the photon-native HTTP/1.1 client, reading them
+// into the destination buffers directly over connections kept alive by host,
+// instead of through cURL, which still makes the other requests, and the
+// GETs redirected further; false by default.
+void registryfs_set_native_get(bool on);
+
+// fetch misses and prefetches in reads of about the bandwidth-delay product
+// of the link to each host, as measured from the GETs made to it, bounded
+// in [min_size, max_size]; the files answer IOCTL_FETCH_SIZE with it, by
+// which the cache sizes its refills. max_size of 0 (the default) disables it.
+void registryfs_set_fetch_size(size_t min_size, size_t max_size);
 
 }
 
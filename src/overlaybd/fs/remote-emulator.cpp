@@ -0,0 +1,170 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "remote-emulator.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <random>
+#include <string>
+#include "filesystem.h"
+#include "forwardfs.h"
+#include "../alog.h"
+#include "../iovector.h"
+#include "../utility.h"
+#include "../photon/thread.h"
+using namespace std;
+
+namespace FileSystem
+{
+    // the z-score of the 99th percentile of the standard normal distribution
+    static const double Z99 = 2.3263;
+
+    class RemoteEmulatorFS : public ForwardFS_Ownership
+    {
+    public:
+        RemoteEmulatorFS(IFileSystem* blobs, const RemoteEmulatorOptions& options, bool ownership)
+            : ForwardFS_Ownership(blobs, ownership), m_options(options),
+              m_connections(options.max_connections), m_random(options.seed)
+        {
+            if (options.rtt_p99 > options.rtt_median && options.rtt_median > 0)
+                m_sigma = log((double)options.rtt_p99 / options.rtt_median) / Z99;
+        }
+
+        virtual IFile* open(const char *pathname, int flags) override;
+        virtual IFile* open(const char *pathname, int flags, mode_t mode) override
+        {
+            return open(pathname, flags);
+        }
+        virtual int stat(const char *path, struct stat *buf) override
+        {
+            return request(0) < 0 ? -1 : m_fs->stat(blob_path(path).c_str(), buf);
+        }
+        virtual int lstat(const char *path, struct stat *buf) override
+        {
+            return stat(path, buf);
+        }
+
+        // a request of `bytes` of response, taking a connection till done;
+        // returns 0, or -1 for an injected error
+        int request(size_t bytes)
+        {
+            auto rtt = next_rtt();
+            bool fail = next_error();
+            if (m_options.max_connections)
+                m_connections.wait(1);
+            DEFER(if (m_options.max_connections) m_connections.signal(1));
+            uint64_t time = rtt;
+            if (m_options.bandwidth && !fail)
+                time += bytes * 1000000 / m_options.bandwidth;
+            if (time)
+                photon::thread_usleep(time);
+            if (fail)
+                LOG_ERROR_RETURN(EIO, -1, "injected error of the remote");
+            return 0;
+        }
+
+    protected:
+        RemoteEmulatorOptions m_options;
+        photon::semaphore m_connections;
+        // mt19937_64 and the transforms below are fully specified, so the
+        // draws are the same by any standard library
+        mt19937_64 m_random;
+        double m_sigma = 0;
+
+        static string blob_path(const char *pathname)
+        {
+            auto name = strrchr(pathname, '/');
+            return string("/") + (name ? name + 1 : pathname);
+        }
+
+        // uniform in (0, 1]
+        double next_uniform()
+        {
+            return ((m_random() >> 11) + 1) * (1.0 / (1ULL << 53));
+        }
+        uint64_t next_rtt()
+        {
+            if (m_sigma == 0)
+                return m_options.rtt_median;
+            // Box-Muller
+            double z = sqrt(-2 * log(next_uniform())) * cos(2 * M_PI * next_uniform());
+            return (uint64_t)(m_options.rtt_median * exp(m_sigma * z));
+        }
+        bool next_error()
+        {
+            if (m_options.error_ppm == 0)
+                return false;
+            return m_random() % 1000000 < m_options.error_ppm;
+        }
+    };
+
+    class RemoteEmulatorFile : public ForwardFile_Ownership
+    {
+    public:
+        RemoteEmulatorFile(IFile* file, RemoteEmulatorFS* fs)
+            : ForwardFile_Ownership(file, true), m_fs(fs) { }
+
+        virtual IFileSystem* filesystem() override
+        {
+            return m_fs;
+        }
+        virtual ssize_t pread(void *buf, size_t count, off_t offset) override
+        {
+            struct iovec iov{buf, count};
+            return preadv(&iov, 1, offset);
+        }
+        virtual ssize_t preadv_mutable(struct iovec *iov, int iovcnt, off_t offset) override
+        {
+            return preadv(iov, iovcnt, offset);
+        }
+        virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override
+        {
+            iovector_view view((struct iovec*)iov, iovcnt);
+            if (m_fs->request(view.sum()) < 0)
+                return -1;
+            return m_file->preadv(iov, iovcnt, offset);
+        }
+        // the remote is read only
+        UNIMPLEMENTED(ssize_t pwrite(const void *buf, size_t count, off_t offset) override);
+        UNIMPLEMENTED(ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override);
+        UNIMPLEMENTED(ssize_t pwritev_mutable(struct iovec *iov, int iovcnt, off_t offset) override);
+
+    protected:
+        RemoteEmulatorFS* m_fs;
+    };
+
+    IFile* RemoteEmulatorFS::open(const char *pathname, int flags)
+    {
+        auto path = blob_path(pathname);
+        if (path == "/")
+            LOG_ERROR_RETURN(EINVAL, nullptr, "invalid remote path `", pathname);
+        if (request(0) < 0)
+            return nullptr;
+        auto file = m_fs->open(path.c_str(), O_RDONLY);
+        if (!file)
+            LOG_ERRNO_RETURN(0, nullptr, "failed to open ` of the remote", path.c_str());
+        return new RemoteEmulatorFile(file, this);
+    }
+
+    IFileSystem* new_remote_emulator_fs(IFileSystem* blobs, const RemoteEmulatorOptions& options,
+                                        bool ownership)
+    {
+        if (!blobs)
+            LOG_ERROR_RETURN(EINVAL, nullptr, "no files to serve");
+        return new RemoteEmulatorFS(blobs, options, ownership);
+    }
+}
@@ -0,0 +1,54 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <inttypes.h>
+
+namespace FileSystem
+{
+    class IFileSystem;
+
+    struct RemoteEmulatorOptions
+    {
+        // the round-trip time (in us) of each request, log-normally
+        // distributed with this median and 99th percentile; a p99 not
+        // above the median for a constant RTT
+        uint64_t rtt_median = 0;
+        uint64_t rtt_p99 = 0;
+
+        // bytes per second of each connection, 0 for unlimited
+        uint64_t bandwidth = 0;
+
+        // requests failing with EIO, in parts per million
+        uint32_t error_ppm = 0;
+
+        // connections to the remote, the requests beyond which wait for
+        // one to be free; 0 for no limit
+        uint32_t max_connections = 0;
+
+        // of the pseudo-random RTTs and errors; the same seed draws the
+        // same sequence of them for the same sequence of requests
+        uint64_t seed = 1;
+    };
+
+    // An emulator of a remote storage, e.g. a registry, serving the files
+    // `/<name>` of `blobs`, by the last component of the path opened, e.g.
+    // the digest of a blob url. Opening a file is a request, as a HEAD, and
+    // so is each read of it, as a GET, which takes a connection for an RTT
+    // plus the time to transfer the data at the bandwidth of the connection.
+    extern "C" IFileSystem* new_remote_emulator_fs(IFileSystem* blobs,
+                                                   const RemoteEmulatorOptions& options,
+                                                   bool ownership = false);
+}
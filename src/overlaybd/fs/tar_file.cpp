@@ -18,14 +18,19 @@
 #include "../alog.h"
 #include "../fs/filesystem.h"
 #include "../fs/forwardfs.h"
+#include "../fs/localfs.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <memory>
 #include <pwd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <string>
 #include <sys/param.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 namespace FileSystem {
 
@@ -122,6 +127,26 @@ int th_signed_crc_calc(struct tar_header &th_buf) {
     return sum;
 }
 
+// check the magic, version and checksum of a header
+static bool check_header(struct tar_header &th_buf) {
+    if (strncmp(th_buf.magic, TMAGIC, TMAGLEN - 1) != 0) {
+        LOG_DEBUG("unknown magic value in tar header");
+        return false;
+    }
+    // or the GNU one, with magic and version of "ustar  \0"
+    if (strncmp(th_buf.version, TVERSION, TVERSLEN) != 0 &&
+        memcmp(th_buf.magic, TMAGIC "  ", TMAGLEN + TVERSLEN) != 0) {
+        LOG_DEBUG("unknown version value in tar header");
+        return false;
+    }
+    int crc = oct_to_int(th_buf.chksum);
+    if (!(crc == th_crc_calc(th_buf) || crc == th_signed_crc_calc(th_buf))) {
+        LOG_DEBUG("tar header checksum error");
+        return false;
+    }
+    return true;
+}
+
 class TarFile : public ForwardFile_Ownership {
 public:
     TarFile(IFile *file) : ForwardFile_Ownership(file, true) {
@@ -129,11 +154,24 @@ public:
         m_file->lseek(base_offset, SEEK_SET);
     }
 
+    // with the member located, the header is not read again
+    TarFile(IFile *file, const TarMember &member)
+        : ForwardFile_Ownership(file, true), m_member(member), m_has_member(true) {
+        base_offset = member.offset;
+        m_file->lseek(base_offset, SEEK_SET);
+    }
+
     ~TarFile() {
         close();
     }
 
     virtual int fstat(struct stat *buf) override {
+        if (m_has_member) {
+            int ret = m_file->fstat(buf);
+            if (ret == 0)
+                buf->st_size = m_member.size;
+            return ret;
+        }
         struct tar_header th_buf;
         memset(&(th_buf), 0, sizeof(struct tar_header));
         m_file->pread(&th_buf, TAR_HEADER_SIZE, 0);
@@ -163,6 +201,10 @@ public:
             break;
 
         case SEEK_END:
+            if (m_has_member) {
+                ret = m_file->lseek(base_offset + m_member.size + offset, SEEK_SET);
+                break;
+            }
             struct tar_header th_buf;
             memset(&(th_buf), 0, sizeof(struct tar_header));
             m_file->pread(&th_buf, TAR_HEADER_SIZE, 0);
@@ -198,6 +240,8 @@ public:
     }
 
     virtual int close() override {
+        if (m_has_member)
+            return m_file->close();
         struct stat s;
         m_file->fstat(&s);
         struct tar_header th_buf;
@@ -210,6 +254,9 @@ public:
         return m_file->close();
     }
 
+    TarMember m_member;
+    bool m_has_member = false;
+
 private:
     off_t base_offset;
     int write_header_trailer() {
@@ -322,28 +369,133 @@ int is_tar_file(IFile *file) {
         LOG_DEBUG("error read tar file header");
         return 0;
     }
-    if (strncmp(th_buf.magic, TMAGIC, TMAGLEN - 1) != 0) {
-        LOG_DEBUG("unknown magic value in tar header");
-        return 0;
+    return check_header(th_buf) ? 1 : 0;
+}
+
+// the size of a PAX extended header, if it has one
+static void parse_pax_size(const char *p, size_t n, uint64_t &size) {
+    // records of "<length> <key>=<value>\n"
+    auto end = p + n;
+    while (p < end) {
+        char *q;
+        auto len = strtoul(p, &q, 10);
+        if (len == 0 || *q != ' ' || len > (size_t)(end - p))
+            return;
+        auto rec_end = p + len;
+        q++;
+        if (rec_end - q > 5 && memcmp(q, "size=", 5) == 0)
+            size = strtoull(q + 5, nullptr, 10);
+        p = rec_end;
     }
-    if (strncmp(th_buf.version, TVERSION, TVERSLEN) != 0) {
-        LOG_DEBUG("unknown version value in tar header");
+}
+
+int tar_find_member(IFile *file, TarMember *member) {
+    // the headers usually fit in the first read
+    const size_t PROBE_SIZE = 4096, MAX_HEADERS = 8, MAX_PAX_SIZE = 64 * 1024;
+    char probe[PROBE_SIZE];
+    auto n = file->pread(probe, PROBE_SIZE, 0);
+    if (n < TAR_HEADER_SIZE) {
+        LOG_DEBUG("error read tar file header");
         return 0;
     }
-    int crc = oct_to_int(th_buf.chksum);
-    if (!(crc == th_crc_calc(th_buf) || crc == th_signed_crc_calc(th_buf))) {
-        LOG_DEBUG("tar header checksum error");
-        return 0;
+    auto read_at = [&](void *buf, size_t count, uint64_t offset) -> bool {
+        if (offset + count <= (uint64_t)n) {
+            memcpy(buf, probe + offset, count);
+            return true;
+        }
+        return file->pread(buf, count, offset) == (ssize_t)count;
+    };
+    uint64_t offset = 0, pax_size = -1;
+    for (size_t i = 0; i < MAX_HEADERS; i++) {
+        struct tar_header th_buf;
+        if (!read_at(&th_buf, TAR_HEADER_SIZE, offset) || !check_header(th_buf))
+            return 0;
+        uint64_t size = oct_to_size(th_buf.size);
+        auto next = offset + TAR_HEADER_SIZE + (size + TAR_HEADER_SIZE - 1) / TAR_HEADER_SIZE * TAR_HEADER_SIZE;
+        switch (th_buf.typeflag) {
+        case 'x': // PAX extended header of the next member
+            if (size <= MAX_PAX_SIZE) {
+                std::unique_ptr<char[]> pax(new char[size]);
+                if (!read_at(pax.get(), size, offset + TAR_HEADER_SIZE))
+                    LOG_ERROR_RETURN(EIO, 0, "failed to read PAX header at `", offset);
+                parse_pax_size(pax.get(), size, pax_size);
+            }
+            offset = next;
+            continue;
+        case 'g': // PAX global header
+        case 'L': // GNU long name
+        case 'K': // GNU long link name
+            offset = next;
+            continue;
+        default:
+            member->offset = offset + TAR_HEADER_SIZE;
+            member->size = (pax_size != (uint64_t)-1) ? pax_size : size;
+            return 1;
+        }
     }
-    return 1;
+    LOG_ERROR_RETURN(0, 0, "no member found in the first ` headers", MAX_HEADERS);
 }
 
 IFile *new_tar_file_adaptor(IFile *file) {
-    if (is_tar_file(file) == 1) {
-        return new TarFile(file);
+    TarMember member;
+    if (tar_find_member(file, &member) == 1) {
+        return new TarFile(file, member);
     }
     LOG_DEBUG("not tar file, open as normal file");
     return file;
 }
 
+// the member saved, where offset 0 means not a tar file
+struct TarIndex {
+    char magic[8] = "OBDTARI";
+    TarMember member;
+};
+
+IFile *new_tar_file_adaptor_indexed(IFile *file, const char *index_path) {
+    TarIndex index;
+    std::unique_ptr<IFile> findex(open_localfile_adaptor(index_path, O_RDONLY, 0644, 0));
+    if (findex && findex->pread(&index, sizeof(index), 0) == sizeof(index) &&
+        memcmp(index.magic, TarIndex().magic, sizeof(index.magic)) == 0) {
+        LOG_DEBUG("tar member found in `: offset `, size `", index_path,
+                  index.member.offset, index.member.size);
+        if (index.member.offset == 0)
+            return file;
+        return new TarFile(file, index.member);
+    }
+
+    auto ret = file;
+    index = TarIndex();
+    if (tar_find_member(file, &index.member) == 1) {
+        ret = new TarFile(file, index.member);
+    } else {
+        index.member = TarMember();
+        LOG_DEBUG("not tar file, open as normal file");
+    }
+    // written aside and renamed, so that it's never seen partially written
+    auto tmp = std::string(index_path) + ".tmp";
+    findex.reset(open_localfile_adaptor(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644, 0));
+    if (!findex || findex->pwrite(&index, sizeof(index), 0) != sizeof(index) ||
+        ::rename(tmp.c_str(), index_path) != 0) {
+        LOG_WARN("failed to save tar member in `: `(`)", index_path, errno, strerror(errno));
+        ::unlink(tmp.c_str());
+    }
+    return ret;
+}
+
+int get_tar_member(IFile *file, TarMember *member) {
+    auto tar = dynamic_cast<TarFile *>(file);
+    if (!tar)
+        LOG_ERROR_RETURN(EINVAL, -1, "not a tar file adaptor");
+    if (tar->m_has_member) {
+        *member = tar->m_member;
+    } else {
+        member->offset = TAR_HEADER_SIZE;
+        struct stat st;
+        if (tar->fstat(&st) != 0)
+            return -1;
+        member->size = st.st_size;
+    }
+    return 0;
+}
+
 } // namespace FileSystem
@@ -15,7 +15,7 @@
 */
 
 #pragma once
-
+#include <inttypes.h>
 
 namespace FileSystem {
 
@@ -30,4 +30,24 @@ namespace FileSystem {
 
     extern "C" int is_tar_file(FileSystem::IFile *file);
     extern "C" IFile* new_tar_file_adaptor(FileSystem::IFile *file);
+
+    // the member of a tar file holding the blob, following any PAX or GNU
+    // extended headers: the offset of its payload, and its size
+    struct TarMember {
+        uint64_t offset = 0, size = 0;
+    };
+
+    // locate the member in `file`, returning 1 if found, 0 if not a tar file
+    extern "C" int tar_find_member(FileSystem::IFile *file, TarMember *member);
+
+    // like new_tar_file_adaptor(), but reading no header if the member, or
+    // that the file is not a tar file, has been saved in the local file
+    // `index_path`, e.g. by digest; otherwise the member is located and saved
+    extern "C" IFile* new_tar_file_adaptor_indexed(FileSystem::IFile *file,
+                                                   const char *index_path);
+
+    // get the member of a tar file adaptor, so that reading at `offset` of it
+    // can be done at `member->offset + offset` of the underlying file directly;
+    // return -1 if `file` is not a tar file adaptor
+    extern "C" int get_tar_member(FileSystem::IFile *file, TarMember *member);
 }
@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <ctime>
 #include <random>
+#include <chrono>
 
 #define protected public
 #define private public
@@ -32,6 +33,7 @@
 #include "../virtual-file.cpp"
 #include "../path.cpp"
 #include "../aligned-file.cpp"
+#include "../writeback-file.cpp"
 #include "../../enumerable.h"
 #include "../path.h"
 #include "../localfs.h"
@@ -39,6 +41,8 @@
 #include "../range-split-vi.h"
 #include "../filesystem.h"
 #include "../aligned-file.h"
+#include "../writeback-file.h"
+#include "../remote-emulator.h"
 #include "../../utility.h"
 #include "../../alog.h"
 #include "../../photon/thread11.h"
@@ -543,6 +547,56 @@ TEST(AlignedFileAdaptor, basic) {
     pread_pwrite_test(aligned_file_2.get(), normal_file);
 }
 
+// the middle of unaligned requests, aligned in memory along with the file,
+// is read and written in place, in iovecs of various lengths
+TEST(AlignedFileAdaptor, unaligned_iovecs) {
+    constexpr int file_size = 65536, max_length = 16384;
+    IFileSystem *fs = new_localfs_adaptor("/tmp/");
+    DEFER(delete fs);
+    std::unique_ptr<IFile> normal_file(fs->open("test_aligned_iov_normal", O_RDWR | O_CREAT | O_TRUNC, 0666));
+    IFile *underlay_file = fs->open("test_aligned_iov_aligned", O_RDWR | O_CREAT | O_TRUNC, 0666);
+    auto init = random_block(file_size);
+    normal_file->pwrite(init.get(), file_size, 0);
+    underlay_file->pwrite(init.get(), file_size, 0);
+    std::unique_ptr<IFile> aligned_file(new_aligned_file_adaptor(underlay_file, 4096, true, true));
+    void *base, *rbase;
+    ASSERT_EQ(0, posix_memalign(&base, 4096, max_length + 8192));
+    ASSERT_EQ(0, posix_memalign(&rbase, 4096, max_length + 8192));
+    DEFER({ free(base); free(rbase); });
+    char data[max_length];
+    for (int i = 0; i < 200; i++) {
+        off_t off = rand() % (file_size - max_length);
+        size_t len = rand() % max_length + 1;
+        // aligned in memory as in the file, or not at all
+        auto shift = (i % 4 == 3) ? 1 : off % 4096;
+        auto buf = (char*)base + shift, rbuf = (char*)rbase + shift;
+        fill_random_buff(buf, len);
+        iovec iov[3], riov[3];
+        // split at block boundaries, except for the unaligned ones
+        size_t l0 = std::min(len, (size_t)(4096 - off % 4096));
+        size_t l1 = (i % 4 == 2) ? (len - l0) / 3 : (len - l0) / 2 / 4096 * 4096;
+        iov[0] = {buf, l0}; iov[1] = {buf + l0, l1}; iov[2] = {buf + l0 + l1, len - l0 - l1};
+        riov[0] = {rbuf, l0}; riov[1] = {rbuf + l0, l1}; riov[2] = {rbuf + l0 + l1, len - l0 - l1};
+        EXPECT_EQ((ssize_t)len, aligned_file->pwritev(iov, 3, off));
+        normal_file->pwrite(buf, len, off);
+        EXPECT_EQ((ssize_t)len, aligned_file->preadv(riov, 3, off));
+        EXPECT_EQ(0, memcmp(buf, rbuf, len));
+        // a read covering the neighbours of the write, which are kept
+        off_t roff = std::max(off - 5000, (off_t)0);
+        size_t rlen = std::min((size_t)max_length, (size_t)(file_size - roff));
+        EXPECT_EQ((ssize_t)rlen, aligned_file->pread(rbuf, rlen, roff));
+        EXPECT_EQ((ssize_t)rlen, normal_file->pread(data, rlen, roff));
+        EXPECT_EQ(0, memcmp(data, rbuf, rlen));
+    }
+    // writing the head of a block keeps the rest of it
+    EXPECT_EQ(3, aligned_file->pwrite("abc", 3, 8192));
+    normal_file->pwrite("abc", 3, 8192);
+    char a[4096], b[4096];
+    EXPECT_EQ(4096, aligned_file->pread(a, 4096, 8192));
+    EXPECT_EQ(4096, normal_file->pread(b, 4096, 8192));
+    EXPECT_EQ(0, memcmp(a, b, 4096));
+}
+
 TEST(AlignedFileAdaptor, err_situation) {
     log_output = log_output_null;
     DEFER({
@@ -604,6 +658,140 @@ TEST(AlignedFile, pwrite_at_tail) {
     delete afs;
 }
 
+// writes are merged in memory, and reach the file only when written back,
+// by a sync or once too many are buffered, while reads see them all along
+TEST(WritebackFile, basic) {
+    constexpr int file_size = 1 << 20, max_length = 16384;
+    IFileSystem *fs = new_localfs_adaptor("/tmp/");
+    DEFER(delete fs);
+    std::unique_ptr<IFile> normal_file(fs->open("test_writeback_normal", O_RDWR | O_CREAT | O_TRUNC, 0666));
+    IFile *underlay_file = fs->open("test_writeback_underlay", O_RDWR | O_CREAT | O_TRUNC, 0666);
+    auto init = random_block(file_size);
+    normal_file->pwrite(init.get(), file_size, 0);
+    underlay_file->pwrite(init.get(), file_size, 0);
+    std::unique_ptr<IFile> wb_file(new_writeback_file(underlay_file, 256 * 1024, true));
+    char buf[max_length], rbuf[max_length * 2], data[max_length * 2];
+    for (int i = 0; i < 1000; i++) {
+        off_t off = rand() % (file_size - max_length);
+        size_t len = rand() % max_length + 1;
+        fill_random_buff(buf, len);
+        if (i % 10 == 9) {
+            // a discard drops the buffered data in the range
+            EXPECT_EQ(0, wb_file->fallocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len));
+            normal_file->fallocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+        } else {
+            iovec iov[2] = {{buf, len / 2}, {buf + len / 2, len - len / 2}};
+            EXPECT_EQ((ssize_t)len, wb_file->pwritev(iov, 2, off));
+            normal_file->pwrite(buf, len, off);
+        }
+        if (i % 100 == 99)
+            EXPECT_EQ(0, wb_file->fdatasync());
+        off_t roff = std::max(off - max_length / 2, (off_t)0);
+        size_t rlen = std::min((size_t)max_length * 2, (size_t)(file_size - roff));
+        iovec riov[3] = {{rbuf, 1}, {rbuf + 1, rlen / 2}, {rbuf + 1 + rlen / 2, rlen - 1 - rlen / 2}};
+        EXPECT_EQ((ssize_t)rlen, wb_file->preadv(riov, 3, roff));
+        EXPECT_EQ((ssize_t)rlen, normal_file->pread(data, rlen, roff));
+        EXPECT_EQ(0, memcmp(data, rbuf, rlen));
+    }
+
+    // adjacent writes are buffered till synced
+    EXPECT_EQ(0, wb_file->fdatasync());
+    memset(buf, 'x', 8192);
+    EXPECT_EQ(4096, wb_file->pwrite(buf, 4096, 8192));
+    EXPECT_EQ(4096, wb_file->pwrite(buf, 4096, 4096));
+    EXPECT_EQ(4096, underlay_file->pread(rbuf, 4096, 4096));
+    EXPECT_NE(0, memcmp(buf, rbuf, 4096));
+    EXPECT_EQ(8192, wb_file->pread(rbuf, 8192, 4096));
+    EXPECT_EQ(0, memcmp(buf, rbuf, 8192));
+    EXPECT_EQ(0, wb_file->fdatasync());
+    EXPECT_EQ(8192, underlay_file->pread(rbuf, 8192, 4096));
+    EXPECT_EQ(0, memcmp(buf, rbuf, 8192));
+    normal_file->pwrite(buf, 8192, 4096);
+
+    // until too many are buffered
+    auto big = random_block(512 * 1024);
+    EXPECT_EQ(512 * 1024, wb_file->pwrite(big.get(), 512 * 1024, 0));
+    EXPECT_EQ(8192, underlay_file->pread(rbuf, 8192, 4096));
+    EXPECT_EQ(0, memcmp(big.get() + 4096, rbuf, 8192));
+    normal_file->pwrite(big.get(), 512 * 1024, 0);
+
+    // and all are written back by close()
+    EXPECT_EQ(4096, wb_file->pwrite(buf, 4096, 0));
+    normal_file->pwrite(buf, 4096, 0);
+    EXPECT_EQ(0, wb_file->close());
+    wb_file.reset();
+    auto a = random_block(file_size), b = random_block(file_size);
+    IFile *check = fs->open("test_writeback_underlay", O_RDONLY);
+    DEFER(delete check);
+    EXPECT_EQ(file_size, check->pread(a.get(), file_size, 0));
+    EXPECT_EQ(file_size, normal_file->pread(b.get(), file_size, 0));
+    EXPECT_EQ(0, memcmp(a.get(), b.get(), file_size));
+}
+
+TEST(LocalFileSystem, direct) {
+    std::unique_ptr<IFileSystem> fs(new_aligned_fs_adaptor(
+        new_localfs_adaptor("/tmp/", ioengine_psync | ioengine_direct), 4096, true, true));
+    std::unique_ptr<IFile> file(fs->open("test_local_fs_direct", O_RDWR | O_CREAT | O_TRUNC, 0644));
+    ASSERT_NE(nullptr, file);
+    auto fd = (int)(uint64_t)file->get_underlay_object();
+    EXPECT_NE(0, fcntl(fd, F_GETFL) & O_DIRECT);
+
+    // unaligned I/O goes through aligned buffers
+    constexpr int N = 10000;
+    auto data = random_block(N);
+    char buf[N];
+    EXPECT_EQ(N, file->pwrite(data.get(), N, 100));
+    EXPECT_EQ(N, file->pread(buf, N, 100));
+    EXPECT_EQ(0, memcmp(data.get(), buf, N));
+}
+
+struct AsyncWaiter {
+    photon::semaphore sem{0};
+    ssize_t ret = 0;
+    int err = 0;
+    int on_done(ssize_t ret, int err) {
+        if (ret < 0) {
+            this->ret = ret;
+            this->err = err;
+        }
+        sem.signal(1);
+        return 0;
+    }
+};
+
+TEST(AsyncIO, thread_pool) {
+    constexpr int N = 16, BLOCK = 4096;
+    IFileSystem *fs = new_localfs_adaptor("/tmp/");
+    DEFER(delete fs);
+    std::unique_ptr<IFile> file(fs->open("test_async_io", O_RDWR | O_CREAT | O_TRUNC, 0666));
+    auto data = random_block(N * BLOCK);
+    std::unique_ptr<char[]> buf(new char[N * BLOCK]);
+    iovec iov[N];
+
+    // the writes and the reads are in flight at the same time
+    AsyncWaiter waiter;
+    for (int i = 0; i < N; i++) {
+        iov[i] = {data.get() + i * BLOCK, BLOCK};
+        EXPECT_EQ(0, file->async_pwritev(&iov[i], 1, i * BLOCK, {&waiter, &AsyncWaiter::on_done}));
+    }
+    EXPECT_EQ(0, waiter.sem.wait(N));
+    EXPECT_EQ(0, waiter.ret);
+    for (int i = 0; i < N; i++) {
+        iov[i] = {buf.get() + i * BLOCK, BLOCK};
+        EXPECT_EQ(0, file->async_preadv(&iov[i], 1, i * BLOCK, {&waiter, &AsyncWaiter::on_done}));
+    }
+    EXPECT_EQ(0, waiter.sem.wait(N));
+    EXPECT_EQ(0, waiter.ret);
+    EXPECT_EQ(0, memcmp(data.get(), buf.get(), N * BLOCK));
+
+    // a failure is delivered with its errno
+    std::unique_ptr<IFile> wronly(fs->open("test_async_io", O_WRONLY));
+    EXPECT_EQ(0, wronly->async_preadv(iov, 1, 0, {&waiter, &AsyncWaiter::on_done}));
+    EXPECT_EQ(0, waiter.sem.wait(1));
+    EXPECT_EQ(-1, waiter.ret);
+    EXPECT_EQ(EBADF, waiter.err);
+}
+
 inline static void SetupTestDir(const std::string& dir) {
   std::string cmd = std::string("rm -r ") + dir;
   system(cmd.c_str());
@@ -645,6 +833,106 @@ TEST(Walker, basic) {
   EXPECT_EQ(2, count);
 }
 
+static uint64_t elapsed_us(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+static IFileSystem* new_test_remote(const RemoteEmulatorOptions& options) {
+    std::string root("/tmp/obdtest_remote");
+    SetupTestDir(root);
+    std::string data(64 * 1024, 'r');
+    auto blobs = new_localfs_adaptor(root.c_str());
+    std::unique_ptr<IFile> blob(blobs->open("/sha256:abc", O_WRONLY | O_CREAT, 0644));
+    blob->pwrite(data.data(), data.size(), 0);
+    return new_remote_emulator_fs(blobs, options, true);
+}
+
+TEST(RemoteEmulator, basic) {
+    RemoteEmulatorOptions options;
+    options.rtt_median = 2000;
+    options.bandwidth = 64 * 1024 * 1000;   // 1ms for the blob
+    std::unique_ptr<IFileSystem> fs(new_test_remote(options));
+    const char* url = "https://registry.test/v2/library/ubuntu/blobs/sha256:abc";
+
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<IFile> file(fs->open(url, O_RDONLY));
+    ASSERT_NE(nullptr, file);
+    EXPECT_GE(elapsed_us(start), 2000UL);
+    struct stat st;
+    EXPECT_EQ(0, fs->stat(url, &st));
+    EXPECT_EQ(64 * 1024, st.st_size);
+
+    char buf[64 * 1024];
+    start = std::chrono::steady_clock::now();
+    EXPECT_EQ((ssize_t)sizeof(buf), file->pread(buf, sizeof(buf), 0));
+    EXPECT_GE(elapsed_us(start), 3000UL);
+    EXPECT_EQ(std::string(sizeof(buf), 'r'), std::string(buf, sizeof(buf)));
+
+    EXPECT_EQ(nullptr, fs->open("https://registry.test/v2/library/ubuntu/blobs/sha256:none", O_RDONLY));
+    EXPECT_EQ(-1, file->pwrite(buf, sizeof(buf), 0));
+}
+
+static void read_remote(IFile* file) {
+    char buf[4096];
+    EXPECT_EQ(4096, file->pread(buf, sizeof(buf), 0));
+}
+
+TEST(RemoteEmulator, connections) {
+    RemoteEmulatorOptions options;
+    options.rtt_median = 5000;
+    options.max_connections = 1;
+    std::unique_ptr<IFileSystem> fs(new_test_remote(options));
+    std::unique_ptr<IFile> file(fs->open("/sha256:abc", O_RDONLY));
+    ASSERT_NE(nullptr, file);
+
+    const int N = 4;
+    auto start = std::chrono::steady_clock::now();
+    photon::join_handle* jhs[N];
+    for (int i = 0; i < N; i++)
+        jhs[i] = photon::thread_enable_join(photon::thread_create11(&read_remote, file.get()));
+    for (auto jh : jhs)
+        photon::thread_join(jh);
+    // the requests take the only connection one after another
+    EXPECT_GE(elapsed_us(start), N * 5000UL);
+}
+
+TEST(RemoteEmulator, errors) {
+    RemoteEmulatorOptions options;
+    options.rtt_median = 10;
+    options.rtt_p99 = 100;
+    options.error_ppm = 500000;
+    options.seed = 7;
+    auto replay = [&] {
+        std::unique_ptr<IFileSystem> fs(new_test_remote(options));
+        std::string ret;
+        std::unique_ptr<IFile> file;
+        while (!file) {
+            file.reset(fs->open("/sha256:abc", O_RDONLY));
+            ret += file ? 'o' : 'x';
+        }
+        char buf[512];
+        for (int i = 0; i < 64; i++) {
+            auto n = file->pread(buf, sizeof(buf), 0);
+            EXPECT_TRUE(n == sizeof(buf) || (n == -1 && errno == EIO));
+            ret += n < 0 ? 'x' : 'o';
+        }
+        return ret;
+    };
+    auto seq = replay();
+    EXPECT_NE(std::string::npos, seq.find('x'));
+    EXPECT_NE(std::string::npos, seq.find('o'));
+    // the same seed fails the same requests
+    EXPECT_EQ(seq, replay());
+    options.seed = 8;
+    EXPECT_NE(seq, replay());
+
+    options.error_ppm = 1000000;
+    std::unique_ptr<IFileSystem> fs(new_test_remote(options));
+    EXPECT_EQ(nullptr, fs->open("/sha256:abc", O_RDONLY));
+    EXPECT_EQ(EIO, errno);
+}
+
 int main(int argc, char **argv)
 {
     ::testing::InitGoogleTest(&argc, argv);
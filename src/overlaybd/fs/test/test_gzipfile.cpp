@@ -0,0 +1,117 @@
+
+
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   limitations under the License.
+*/
+#include <fcntl.h>
+#include <unistd.h>
+#include <random>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include <gtest/gtest.h>
+
+#include "../gzip_file.h"
+#include "../filesystem.h"
+#include "../localfs.h"
+#include "../../alog.h"
+#include "../../photon/thread.h"
+
+using namespace FileSystem;
+
+// compress `data` as gzip members of `member` bytes each, concatenated
+static std::string gzip(const std::vector<char> &data, size_t member) {
+    std::string ret;
+    for (size_t i = 0; i < data.size(); i += member) {
+        z_stream strm = {};
+        deflateInit2(&strm, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        size_t n = std::min(member, data.size() - i);
+        std::vector<char> out(deflateBound(&strm, n));
+        strm.next_in = (Bytef *)&data[i];
+        strm.avail_in = n;
+        strm.next_out = (Bytef *)&out[0];
+        strm.avail_out = out.size();
+        EXPECT_EQ(Z_STREAM_END, deflate(&strm, Z_FINISH));
+        ret.append(&out[0], strm.total_out);
+        deflateEnd(&strm);
+    }
+    return ret;
+}
+
+static void verify(IFile *file, const std::vector<char> &data) {
+    struct stat st;
+    ASSERT_EQ(0, file->fstat(&st));
+    ASSERT_EQ((off_t)data.size(), st.st_size);
+    std::mt19937 rng(7);
+    std::vector<char> buf(256 * 1024);
+    for (int i = 0; i < 200; i++) {
+        size_t count = rng() % buf.size() + 1;
+        off_t offset = rng() % data.size();
+        size_t expect = std::min(count, data.size() - offset);
+        ASSERT_EQ((ssize_t)expect, file->pread(&buf[0], count, offset)) << offset << " " << count;
+        ASSERT_EQ(0, memcmp(&buf[0], &data[offset], expect)) << offset;
+    }
+    // sequential reads, across the members
+    off_t offset = 0;
+    while (offset < (off_t)data.size()) {
+        auto ret = file->pread(&buf[0], 100000, offset);
+        ASSERT_GT(ret, 0);
+        ASSERT_EQ(0, memcmp(&buf[0], &data[offset], ret));
+        offset += ret;
+    }
+    EXPECT_EQ(0, file->pread(&buf[0], 1, offset));
+}
+
+TEST(GzipFile, random_read) {
+    photon::init();
+    std::vector<char> data(6 * 1024 * 1024 + 12345);
+    std::mt19937 rng(1);
+    for (auto &c : data)
+        c = "overlaybd"[rng() % 9] ^ (rng() % 16 == 0 ? rng() : 0);
+    auto gz = gzip(data, 2500 * 1000);
+    const char *path = "/tmp/gzipfile_test.gz", *index = "/tmp/gzipfile_test.gzi";
+    ::unlink(index);
+    auto f = open_localfile_adaptor(path, O_RDWR | O_CREAT | O_TRUNC, 0644, 0);
+    ASSERT_NE(nullptr, f);
+    ASSERT_EQ((ssize_t)gz.size(), f->pwrite(gz.data(), gz.size(), 0));
+    EXPECT_EQ(1, is_gzip_file(f));
+
+    // built and saved
+    auto gf = new_gzip_file(f, index, false, 256 * 1024);
+    ASSERT_NE(nullptr, gf);
+    EXPECT_EQ(0, is_gzip_file(gf));
+    verify(gf, data);
+    delete gf;
+    ASSERT_EQ(0, ::access(index, F_OK));
+
+    // loaded from the index
+    gf = new_gzip_file(f, index, false);
+    ASSERT_NE(nullptr, gf);
+    verify(gf, data);
+    delete gf;
+
+    // an index of another file is not used
+    ASSERT_EQ(0, f->ftruncate(gz.size() - 100));
+    EXPECT_EQ(nullptr, new_gzip_file(f, index, false));
+
+    delete f;
+    ::unlink(path);
+    ::unlink(index);
+    photon::fini();
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    log_output_level = ALOG_INFO;
+    return RUN_ALL_TESTS();
+}
@@ -272,6 +272,137 @@ TEST(ThrottledFile, limit_cover) {
     EXPECT_GE(photon::now - start, 4UL*1000*1000);
 }
 
+TEST(ThrottledFile, share_burst) {
+    using namespace testing;
+    photon::init();
+    ThrottleLimits limit;
+    limit.share.IOPS = 10;
+    limit.share.burst = 2;
+    Mock::MockNullFile *mock = new Mock::MockNullFile();
+    EXPECT_CALL(*mock, write(_, _)).WillRepeatedly(ReturnArg<1>());
+    IFile * tf = new_throttled_file(mock, limit, true);
+    DEFER({ delete tf; });
+    char buf[4096];
+    photon::thread_yield();
+    auto start = photon::now;
+    for (int i = 0; i < 20; i++) { // the burst saved
+        EXPECT_EQ(4096, tf->write(buf, 4096));
+    }
+    EXPECT_LT(photon::now - start, 500UL*1000);
+    for (int i = 0; i < 10; i++) {
+        EXPECT_EQ(4096, tf->write(buf, 4096));
+    }
+    EXPECT_GE(photon::now - start, 900UL*1000);
+}
+
+TEST(ThrottledFile, group_borrowing) {
+    using namespace testing;
+    photon::init();
+    ThrottleLimits::Share node;
+    node.IOPS = 20;
+    auto group = new_throttle_group(node);
+    DEFER({ delete_throttle_group(group); });
+    ThrottleLimits la, lb;
+    la.share.IOPS = 10;
+    la.group = group;
+    lb.group = group; // nothing guaranteed
+    Mock::MockNullFile *ma = new Mock::MockNullFile();
+    Mock::MockNullFile *mb = new Mock::MockNullFile();
+    EXPECT_CALL(*ma, write(_, _)).WillRepeatedly(ReturnArg<1>());
+    EXPECT_CALL(*mb, write(_, _)).WillRepeatedly(ReturnArg<1>());
+    IFile * fa = new_throttled_file(ma, la, true);
+    IFile * fb = new_throttled_file(mb, lb, true);
+    DEFER({ delete fa; delete fb; });
+    char buf[4096];
+    photon::thread_yield();
+    auto start = photon::now;
+    for (int i = 0; i < 20; i++) { // borrowing the idle group
+        EXPECT_EQ(4096, fb->write(buf, 4096));
+    }
+    EXPECT_LT(photon::now - start, 500UL*1000);
+    for (int i = 0; i < 10; i++) { // the share is guaranteed
+        EXPECT_EQ(4096, fa->write(buf, 4096));
+    }
+    EXPECT_LT(photon::now - start, 500UL*1000);
+    start = photon::now;
+    EXPECT_EQ(4096, fb->write(buf, 4096)); // waiting for the group to be repaid
+    EXPECT_GE(photon::now - start, 500UL*1000);
+}
+
+TEST(ThrottledFile, group_set_limits) {
+    using namespace testing;
+    photon::init();
+    ThrottleLimits::Share node;
+    node.IOPS = 10;
+    auto group = new_throttle_group(node);
+    DEFER({ delete_throttle_group(group); });
+    ThrottleLimits limits;
+    limits.group = group;
+    Mock::MockNullFile *mf = new Mock::MockNullFile();
+    EXPECT_CALL(*mf, write(_, _)).WillRepeatedly(ReturnArg<1>());
+    IFile * f = new_throttled_file(mf, limits, true);
+    DEFER(delete f);
+    char buf[4096];
+    photon::thread_yield();
+    auto start = photon::now;
+    for (int i = 0; i < 10; i++) { // the burst of the group
+        EXPECT_EQ(4096, f->write(buf, 4096));
+    }
+    EXPECT_LT(photon::now - start, 500UL*1000);
+    node.IOPS = 0; // lifted for the file already in the group
+    set_throttle_group_limits(group, node);
+    start = photon::now;
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(4096, f->write(buf, 4096));
+    }
+    EXPECT_LT(photon::now - start, 500UL*1000);
+    node.IOPS = 2;
+    set_throttle_group_limits(group, node);
+    start = photon::now;
+    for (int i = 0; i < 3; i++) {
+        EXPECT_EQ(4096, f->write(buf, 4096));
+    }
+    EXPECT_GE(photon::now - start, 500UL*1000);
+}
+
+static int hot_inflight = 0;
+ssize_t hot_write(const void *buf, size_t count) { // slower with more ops in flight
+    auto n = ++hot_inflight;
+    photon::thread_usleep(n * 1000UL);
+    --hot_inflight;
+    return count;
+}
+
+void hot_writer(IFile *tf, int n) {
+    for (int i = 0; i < n; i++)
+        tf->write(nullptr, 4096);
+}
+
+TEST(ThrottledFile, target_latency) {
+    using namespace testing;
+    photon::init();
+    ThrottleLimits limit;
+    limit.RW.concurent_ops = 64;
+    limit.target_latency = 8 * 1000;
+    Mock::MockNullFile *mock = new Mock::MockNullFile();
+    EXPECT_CALL(*mock, write(_, _)).WillRepeatedly(Invoke(hot_write));
+    IFile * tf = new_throttled_file(mock, limit, true);
+    DEFER({ delete tf; });
+    auto &window = ((ThrottledFile*)tf)->m_latency;
+    EXPECT_EQ(64U, window.window);
+    vector<photon::join_handle*> jhs;
+    for (int i = 0; i < 64; i++) {
+        jhs.emplace_back(photon::thread_enable_join(photon::thread_create11(hot_writer, tf, 50)));
+    }
+    for (auto p : jhs) {
+        photon::thread_join(p);
+    }
+    // backed off till the latency is within the target
+    EXPECT_GE(window.window, 1U);
+    EXPECT_LE(window.window, 16U);
+    EXPECT_EQ(0U, window.inflight);
+}
+
 TEST(ThrottledFile, timestamp) {
     StatisticsQueue q(4096, 128);
     auto stamp = q._get_stamp(photon::now / 1024);
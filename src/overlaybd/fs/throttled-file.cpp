@@ -16,6 +16,8 @@
 
 #include "throttled-file.h"
 #include <inttypes.h>
+#include <mutex>
+#include <algorithm>
 #include "../ring.h"
 #include "filesystem.h"
 #include "forwardfs.h"
@@ -230,6 +232,161 @@ namespace FileSystem
         }
     };
 
+    // a bucket of tokens, in millionths, refilled at `rate` per second, up to
+    // `capacity`; a request larger than the capacity is granted once the
+    // bucket is full, overdrawing it
+    struct TokenBucket
+    {
+        uint64_t rate; // 0 for no limit
+        int64_t capacity, tokens;
+        uint64_t last;
+        TokenBucket(uint64_t rate_, uint32_t burst) : rate(rate_)
+        {
+            capacity = tokens = rate * 1000000 * (burst ? burst : 1);
+            last = photon::now;
+        }
+        void reset(uint64_t rate_, uint32_t burst)
+        {
+            rate = rate_;
+            capacity = rate * 1000000 * (burst ? burst : 1);
+            tokens = min(tokens, capacity);
+        }
+        void refill(uint64_t now)
+        {
+            if (now <= last)
+                return;
+            uint64_t lack = capacity - tokens, d = now - last;
+            tokens = (!rate || d > lack / rate) ? capacity : tokens + (int64_t)(d * rate);
+            last = now;
+        }
+        bool available(int64_t n) const
+        {
+            return !rate || tokens >= min(n, capacity);
+        }
+        void take(int64_t n)
+        {
+            // the debt of a group, charged by the files within their
+            // shares, is bounded so that borrowing resumes in time
+            tokens = max(tokens - n, -capacity);
+        }
+        uint64_t wait(int64_t n) const // in us
+        {
+            auto need = min(n, capacity) - tokens;
+            return (need <= 0 || !rate) ? 0 : (need + rate - 1) / rate;
+        }
+    };
+
+    class ThrottleGroup
+    {
+    public:
+        std::mutex mutex; // the files may be in different vcpus
+        TokenBucket iops, throughput;
+        ThrottleGroup(const ThrottleLimits::Share& limits) :
+            iops(limits.IOPS, limits.burst),
+            throughput(limits.throughput, limits.burst)
+        {
+        }
+    };
+
+    // the share of a file in its group, if any
+    struct ThrottleShare
+    {
+        TokenBucket iops, throughput;
+        ThrottleGroup* group;
+        ThrottleShare(const ThrottleLimits& limits) :
+            iops(limits.share.IOPS, limits.share.burst),
+            throughput(limits.share.throughput, limits.share.burst),
+            group(limits.group)
+        {
+        }
+        void acquire(uint64_t count)
+        {
+            int64_t n1 = 1000000, n2 = count * 1000000;
+            while (true)
+            {
+                auto now = photon::now;
+                iops.refill(now);
+                throughput.refill(now);
+                uint64_t wait;
+                if (!group)
+                {
+                    if (iops.available(n1) && throughput.available(n2))
+                    {
+                        iops.take(n1);
+                        throughput.take(n2);
+                        return;
+                    }
+                    wait = max(iops.wait(n1), throughput.wait(n2));
+                }
+                else
+                {
+                    // spend the tokens of the file first, charging the group
+                    // as well, then borrow those of the group left unused
+                    bool own1 = iops.rate && iops.available(n1);
+                    bool own2 = throughput.rate && throughput.available(n2);
+                    std::lock_guard<std::mutex> lock(group->mutex);
+                    group->iops.refill(now);
+                    group->throughput.refill(now);
+                    if ((own1 || group->iops.available(n1)) &&
+                        (own2 || group->throughput.available(n2)))
+                    {
+                        if (own1) iops.take(n1);
+                        if (own2) throughput.take(n2);
+                        group->iops.take(n1);
+                        group->throughput.take(n2);
+                        return;
+                    }
+                    auto wait1 = group->iops.wait(n1), wait2 = group->throughput.wait(n2);
+                    if (iops.rate) wait1 = min(wait1, iops.wait(n1));
+                    if (throughput.rate) wait2 = min(wait2, throughput.wait(n2));
+                    wait = max(wait1, wait2);
+                }
+                photon::thread_usleep(wait);
+            }
+        }
+    };
+
+    // a window of concurrent ops, adapted by AIMD to the latency of them
+    class LatencyWindow
+    {
+    public:
+        static const uint32_t SAMPLES = 100, DEFAULT_MAX_WINDOW = 256;
+        uint64_t target;
+        uint32_t window, max_window, inflight = 0, nsamples = 0;
+        uint64_t samples[SAMPLES];
+        photon::condition_variable cond;
+        LatencyWindow(uint64_t target_, uint32_t max_window_) : target(target_)
+        {
+            max_window = max_window_ ? max_window_ : DEFAULT_MAX_WINDOW;
+            window = max_window;
+        }
+        void acquire()
+        {
+            while (inflight >= window)
+                cond.wait_no_lock();
+            inflight++;
+        }
+        void release(uint64_t latency)
+        {
+            inflight--;
+            samples[nsamples++] = latency;
+            if (nsamples == SAMPLES)
+            {
+                auto p99 = samples + SAMPLES * 99 / 100 - 1;
+                nth_element(samples, p99, samples + SAMPLES);
+                if (*p99 > target) {
+                    window = max(window / 2, 1U);
+                } else if (window < max_window) {
+                    window++;
+                    cond.notify_all();
+                }
+                nsamples = 0;
+            }
+            if (inflight < window)
+                cond.notify_one();
+        }
+    };
+
     template<typename Func, typename Adv>
     static inline __attribute__((always_inline))
     ssize_t split_io(ALogStringL name, size_t count, size_t block_size,
@@ -262,7 +419,7 @@ namespace FileSystem
         return cnt;
     }
 
-    class ThrottledFile : public ForwardFile
+    class ThrottledFile : public ForwardFile_Ownership
     {
     public:
         struct Throttle
@@ -270,6 +427,8 @@ namespace FileSystem
             photon::semaphore num_io;
             StatisticsQueue iops;
             StatisticsQueue throughput;
+            ThrottleShare* share = nullptr;
+            LatencyWindow* latency = nullptr;
             Throttle(const ThrottleLimits::UpperLimits& limits, uint32_t window) :
                 num_io(limits.concurent_ops ? limits.concurent_ops : UINT32_MAX), // 0 for no limit, uint32_max to avoid overflow
                 iops(limits.IOPS, window * 1024U),
@@ -280,11 +439,12 @@ namespace FileSystem
 
         struct scoped_throttle
         {
-            uint64_t count;
+            Throttle& t;
+            uint64_t count, start;
             scoped_semaphore sem1, sem2;
             scoped_queue q11, q12, q21, q22;
             scoped_throttle(Throttle& t1, Throttle& t2, uint64_t cnt) :
-                count(cnt),
+                t(t1), count(cnt),
                 sem1(t1.num_io, 1),
                 sem2(t2.num_io, 1),
                 q11(t1.iops, 1),
@@ -292,6 +452,17 @@ namespace FileSystem
                 q21(t1.throughput, count),
                 q22(t2.throughput, count)
             {
+                if (t1.share)
+                    t1.share->acquire(count);
+                if (t1.latency)
+                    t1.latency->acquire();
+                start = photon::now;
+            }
+            ~scoped_throttle()
+            {
+                // before sleeping for the limits
+                if (t.latency)
+                    t.latency->release(photon::now - start);
             }
             scoped_throttle(Throttle& t1, Throttle& t2, const iovec* iov, int iovcnt) :
                 scoped_throttle(t1, t2, iovector_view((iovec*)iov, iovcnt).sum())
@@ -301,12 +472,20 @@ namespace FileSystem
 
         ThrottleLimits m_limits;
         Throttle t_all, t_read, t_write;
-        ThrottledFile(IFile* file, const ThrottleLimits& limits) :
-            ForwardFile(file), m_limits(limits),
+        ThrottleShare m_share;
+        LatencyWindow m_latency;
+        ThrottledFile(IFile* file, const ThrottleLimits& limits, bool ownership) :
+            ForwardFile_Ownership(file, ownership), m_limits(limits),
             t_all(limits.RW, limits.time_window),
             t_read(limits.R, limits.time_window),
-            t_write(limits.W, limits.time_window)
+            t_write(limits.W, limits.time_window),
+            m_share(limits),
+            m_latency(limits.target_latency, limits.RW.concurent_ops)
         {
+            if (limits.share.IOPS || limits.share.throughput || limits.group)
+                t_all.share = &m_share;
+            if (limits.target_latency)
+                t_all.latency = &m_latency;
         }
 
         virtual ssize_t pread(void *buf, size_t count, off_t offset) override
@@ -368,7 +547,7 @@ namespace FileSystem
         {
             SmartCloneIOV<32> ciov(iov, iovcnt);
             split_iovector_view v(ciov.ptr, iovcnt, m_limits.W.block_size);
-            scoped_throttle t(t_all, t_read, v.count);
+            scoped_throttle t(t_all, t_write, v.count);
             return split_io(__func__, v.count, m_limits.W.block_size,
                 [&](size_t len) { return m_file->pwritev(v.iov, v.iovcnt, offset);},
                 [&](size_t len) { offset += len; v.next(); });
@@ -376,7 +555,7 @@ namespace FileSystem
         virtual ssize_t pwritev_mutable(struct iovec *iov, int iovcnt, off_t offset) override
         {
             split_iovector_view v((iovec*)iov, iovcnt, m_limits.W.block_size);
-            scoped_throttle t(t_all, t_read, v.count);
+            scoped_throttle t(t_all, t_write, v.count);
             return split_io(__func__, v.count, m_limits.W.block_size,
                 [&](size_t len) { return m_file->pwritev(v.iov, v.iovcnt, offset);},
                 [&](size_t len) { offset += len; v.next(); });
@@ -393,7 +572,7 @@ namespace FileSystem
             SmartCloneIOV<32> ciov(iov, iovcnt);
             split_iovector_view v(ciov.ptr, iovcnt, m_limits.W.block_size);
 
-            scoped_throttle t(t_all, t_read, v.count);
+            scoped_throttle t(t_all, t_write, v.count);
             return split_io(__func__, v.count, m_limits.W.block_size,
                 [&](size_t len) { return m_file->writev(v.iov, v.iovcnt);},
                 [&](size_t len) { v.next(); });
@@ -401,15 +580,32 @@ namespace FileSystem
         virtual ssize_t writev_mutable(struct iovec *iov, int iovcnt) override
         {
             split_iovector_view v((iovec*)iov, iovcnt, m_limits.W.block_size);
-            scoped_throttle t(t_all, t_read, v.count);
+            scoped_throttle t(t_all, t_write, v.count);
             return split_io(__func__, v.count, m_limits.W.block_size,
                 [&](size_t len) { return m_file->writev(v.iov, v.iovcnt);},
                 [&](size_t len) { v.next(); });
         }
     };
 
-    IFile* new_throttled_file(IFile* file, const ThrottleLimits& limits)
+    IFile* new_throttled_file(IFile* file, const ThrottleLimits& limits, bool ownership)
+    {
+        return new ThrottledFile(file, limits, ownership);
+    }
+
+    ThrottleGroup* new_throttle_group(const ThrottleLimits::Share& limits)
+    {
+        return new ThrottleGroup(limits);
+    }
+
+    void delete_throttle_group(ThrottleGroup* group)
+    {
+        delete group;
+    }
+
+    void set_throttle_group_limits(ThrottleGroup* group, const ThrottleLimits::Share& limits)
     {
-        return new ThrottledFile(file, limits);
+        std::lock_guard<std::mutex> lock(group->mutex);
+        group->iops.reset(limits.IOPS, limits.burst);
+        group->throughput.reset(limits.throughput, limits.burst);
     }
 }
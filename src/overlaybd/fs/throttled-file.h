@@ -18,6 +18,8 @@
 
 namespace FileSystem
 {
+    class ThrottleGroup;
+
     struct ThrottleLimits
     {
         uint32_t struct_size = sizeof(ThrottleLimits);
@@ -32,8 +34,39 @@ namespace FileSystem
 
         // limits for read, write, and either read or write
         UpperLimits R, W, RW;
+
+        // the rates guaranteed to either read or write, metered by token
+        // buckets that save up to `burst` seconds (minimally 1) of the rates
+        // left unused, to be spent above them later; once the tokens of the
+        // file run out, it borrows the tokens of `group` left unused by the
+        // other files in the group, if any; 0 for no limit without a group,
+        // or nothing guaranteed in a group; the upper limits above still apply
+        struct Share
+        {
+            uint64_t IOPS = 0, throughput = 0;
+            uint32_t burst = 0;
+        };
+        Share share;
+        ThrottleGroup* group = nullptr;
+
+        // the p99 latency (in us) targeted for either read or write, e.g. of
+        // a backend shared with others, by adapting the # of concurrent ops:
+        // for every 100 ops completed, it grows by 1 if the p99 latency of
+        // them is within the target, or halves otherwise, between 1 and
+        // RW.concurent_ops (256 if 0); 0 for a fixed # of concurrent ops
+        uint32_t target_latency = 0;
     };
 
     class IFile;
-    extern "C" IFile* new_throttled_file(IFile* file, const ThrottleLimits& limits);
+    extern "C" IFile* new_throttled_file(IFile* file, const ThrottleLimits& limits,
+                                         bool ownership = false);
+
+    // a group of throttled files sharing the rates of `limits`, e.g. the
+    // files of a node, which may be used by files in different vcpus;
+    // `limits.group` is ignored, and 0 rates for no limit
+    extern "C" ThrottleGroup* new_throttle_group(const ThrottleLimits::Share& limits);
+    extern "C" void delete_throttle_group(ThrottleGroup* group);
+    // change the rates of `group` at runtime, for the files already in it
+    extern "C" void set_throttle_group_limits(ThrottleGroup* group,
+                                              const ThrottleLimits::Share& limits);
 }
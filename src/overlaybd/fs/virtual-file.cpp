@@ -26,9 +26,13 @@
 #include "../utility.h"
 #include "../iovector.h"
 #include "../alog.h"
+#include "../photon/thread-pool.h"
 
 namespace FileSystem
 {
+    // the # of idle threads kept by each vcpu for asynchronous I/O
+    const static uint32_t ASYNC_POOL_CAPACITY = 64;
+
     ssize_t VirtualFile::read(void *buf, size_t count)
     {
         auto ret = pread(buf, count, m_offset);
@@ -133,6 +137,53 @@ namespace FileSystem
         }
     }
 
+    // the pool of the photon threads running asynchronous I/O of current
+    // vcpu, living as long as the vcpu, as its threads do
+    static photon::ThreadPoolBase* async_pool()
+    {
+        static thread_local photon::ThreadPoolBase* pool = nullptr;
+        if (!pool) pool = photon::new_thread_pool(ASYNC_POOL_CAPACITY);
+        return pool;
+    }
+
+    struct AsyncIO
+    {
+        IFile* file;
+        bool write;
+        const struct iovec* iov;
+        int iovcnt;
+        off_t offset;
+        IFile::AsyncDone done;
+    };
+
+    static void* async_io(void* arg)
+    {
+        std::unique_ptr<AsyncIO> io((AsyncIO*)arg);
+        auto ret = io->write ? io->file->pwritev(io->iov, io->iovcnt, io->offset) :
+                               io->file->preadv(io->iov, io->iovcnt, io->offset);
+        io->done(ret, ret < 0 ? errno : 0);
+        return nullptr;
+    }
+
+    static int async_submit(AsyncIO* io)
+    {
+        if (async_pool()->submit(&async_io, io) < 0)
+        {
+            delete io;
+            LOG_ERRNO_RETURN(0, -1, "failed to submit an asynchronous I/O");
+        }
+        return 0;
+    }
+
+    int IFile::async_preadv(const struct iovec *iov, int iovcnt, off_t offset, AsyncDone done)
+    {
+        return async_submit(new AsyncIO{this, false, iov, iovcnt, offset, done});
+    }
+    int IFile::async_pwritev(const struct iovec *iov, int iovcnt, off_t offset, AsyncDone done)
+    {
+        return async_submit(new AsyncIO{this, true, iov, iovcnt, offset, done});
+    }
+
 #ifdef __linux__
     #ifndef FALLOC_FL_KEEP_SIZE
     #define FALLOC_FL_KEEP_SIZE     0x01 /* default is extend size */
@@ -0,0 +1,301 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "writeback-file.h"
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "filesystem.h"
+#include "forwardfs.h"
+#include "../iovector.h"
+#include "../alog.h"
+#include "../memory.h"
+#include "../photon/thread.h"
+
+namespace FileSystem
+{
+    // the buffered data keyed by offset, in extents neither overlapping
+    // nor adjacent, as adjacent ones are merged
+    typedef std::map<off_t, std::string> Extents;
+    typedef std::pair<off_t, off_t> Range;
+
+    // extents are written back in pieces of at most this size
+    static const size_t WRITEBACK_IO_SIZE = 1024 * 1024;
+
+    // merge `count` bytes of `view` at `offset` into `m`, over the data
+    // already there, returning the # of bytes `m` grows by
+    static int64_t merge_extent(Extents& m, off_t offset, iovector_view view, size_t count)
+    {
+        off_t end = offset + count;
+        int64_t delta = 0;
+        auto it = m.upper_bound(offset);
+        if (it != m.begin())
+        {
+            auto prev = std::prev(it);
+            if (prev->first + (off_t)prev->second.size() >= offset)
+                it = prev;
+        }
+        off_t start = offset;
+        std::string buf;
+        if (it != m.end() && it->first <= offset)
+        {
+            start = it->first;
+            buf = std::move(it->second);
+            delta -= buf.size();
+            it = m.erase(it);
+        }
+        if ((off_t)buf.size() < end - start)
+            buf.resize(end - start);
+        view.memcpy_to(&buf[offset - start], count);
+        for (; it != m.end() && it->first <= end; it = m.erase(it))
+        {
+            delta -= it->second.size();
+            if (it->first + (off_t)it->second.size() > end)
+                buf.append(it->second, end - it->first, std::string::npos);
+        }
+        delta += buf.size();
+        m.emplace(start, std::move(buf));
+        return delta;
+    }
+
+    // copy the data of `m` in [begin, end) to `view` of the range from
+    // `offset`, adding the parts not in `m` to `gaps`
+    static void copy_extents(const Extents& m, const iovector_view& view, off_t offset,
+                             off_t begin, off_t end, iovec* tmp, std::vector<Range>& gaps)
+    {
+        auto it = m.upper_bound(begin);
+        if (it != m.begin())
+            --it;
+        off_t pos = begin;
+        for (; it != m.end() && it->first < end; ++it)
+        {
+            off_t e_begin = std::max(it->first, pos);
+            off_t e_end = std::min(it->first + (off_t)it->second.size(), end);
+            if (e_begin >= e_end)
+                continue;
+            if (e_begin > pos)
+                gaps.emplace_back(pos, e_begin);
+            iovector_view part(tmp, view.iovcnt);
+            view.slice(e_end - e_begin, e_begin - offset, &part);
+            part.memcpy_from(it->second.data() + (e_begin - it->first), e_end - e_begin);
+            pos = e_end;
+        }
+        if (pos < end)
+            gaps.emplace_back(pos, end);
+    }
+
+    class WritebackFile : public ForwardFile_Ownership
+    {
+    public:
+        Extents m_dirty;    // written since the last write-back started
+        Extents m_flushing; // being written back, under m_mutex
+        uint64_t m_dirty_bytes = 0;
+        uint64_t m_flushing_bytes = 0;
+        uint64_t m_max_dirty;
+        photon::mutex m_mutex; // serializing write-backs and discards
+        Memory::Account m_account{"write_cache"};
+
+        void account()
+        {
+            m_account.set(m_dirty_bytes + m_flushing_bytes);
+        }
+
+        WritebackFile(IFile* file, uint64_t max_dirty, bool ownership) :
+            ForwardFile_Ownership(file, ownership), m_max_dirty(max_dirty)
+        {
+        }
+
+        virtual ~WritebackFile() override
+        {
+            write_back(0);
+        }
+
+        // write back the extents once more than `threshold` bytes are
+        // dirty, waiting for the write-back in progress, if any, first;
+        // writes keep being buffered meanwhile, and reads see both
+        int write_back(uint64_t threshold)
+        {
+            photon::scoped_lock lock(m_mutex);
+            if (m_dirty.empty() || m_dirty_bytes <= threshold)
+                return 0;
+            m_flushing.swap(m_dirty);
+            m_flushing_bytes = m_dirty_bytes;
+            m_dirty_bytes = 0;
+            for (auto& e : m_flushing)
+            {
+                for (size_t i = 0; i < e.second.size(); i += WRITEBACK_IO_SIZE)
+                {
+                    auto n = std::min(WRITEBACK_IO_SIZE, e.second.size() - i);
+                    if (m_file->pwrite(&e.second[i], n, e.first + i) != (ssize_t)n)
+                    {
+                        // keep all of them buffered, under the newer writes
+                        ERRNO err;
+                        for (auto& x : m_dirty)
+                        {
+                            iovec iov{&x.second[0], x.second.size()};
+                            merge_extent(m_flushing, x.first, iovector_view(&iov, 1), iov.iov_len);
+                        }
+                        m_dirty.swap(m_flushing);
+                        m_flushing.clear();
+                        m_flushing_bytes = 0;
+                        for (auto& x : m_dirty)
+                            m_dirty_bytes += x.second.size();
+                        account();
+                        LOG_ERROR_RETURN(err.no, -1, "failed to write back ` bytes at `", n,
+                                         e.first + i);
+                    }
+                }
+            }
+            m_flushing.clear();
+            m_flushing_bytes = 0;
+            account();
+            return 0;
+        }
+
+        virtual int close() override
+        {
+            if (write_back(0) < 0)
+                return -1;
+            return ForwardFile_Ownership::close();
+        }
+        virtual int fsync() override
+        {
+            if (write_back(0) < 0)
+                return -1;
+            return m_file->fsync();
+        }
+        virtual int fdatasync() override
+        {
+            if (write_back(0) < 0)
+                return -1;
+            return m_file->fdatasync();
+        }
+
+        virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override
+        {
+            if (m_dirty.empty() && m_flushing.empty())
+                return m_file->preadv(iov, iovcnt, offset);
+            iovector_view view((iovec*)iov, iovcnt);
+            off_t count = view.sum();
+            // the buffered data are copied before any read of the file, so
+            // that a write-back completing meanwhile is not missed
+            std::vector<iovec> tmp(iovcnt);
+            std::vector<Range> gaps, holes;
+            copy_extents(m_dirty, view, offset, offset, offset + count, &tmp[0], gaps);
+            for (auto& g : gaps)
+                copy_extents(m_flushing, view, offset, g.first, g.second, &tmp[0], holes);
+            for (auto& h : holes)
+            {
+                iovector_view part(&tmp[0], iovcnt);
+                view.slice(h.second - h.first, h.first - offset, &part);
+                auto ret = m_file->preadv(part.iov, part.iovcnt, h.first);
+                if (ret < 0)
+                    return ret;
+                if (ret != h.second - h.first)
+                    LOG_ERROR_RETURN(EIO, -1, "short read of ` bytes at `", h.second - h.first,
+                                     h.first);
+            }
+            return count;
+        }
+        virtual ssize_t preadv_mutable(struct iovec *iov, int iovcnt, off_t offset) override
+        {
+            return preadv(iov, iovcnt, offset);
+        }
+        virtual ssize_t pread(void *buf, size_t count, off_t offset) override
+        {
+            iovec iov{buf, count};
+            return preadv(&iov, 1, offset);
+        }
+
+        virtual ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override
+        {
+            iovector_view view((iovec*)iov, iovcnt);
+            auto count = view.sum();
+            if (count == 0)
+                return 0;
+            m_dirty_bytes += merge_extent(m_dirty, offset, view, count);
+            account();
+            // written back earlier over the shedding mark of the node
+            auto max_dirty = m_max_dirty;
+            if (m_dirty_bytes > max_dirty / 4 && Memory::shedding())
+                max_dirty /= 4;
+            if (m_dirty_bytes > max_dirty && write_back(max_dirty) < 0)
+                return -1;
+            return count;
+        }
+        virtual ssize_t pwritev_mutable(struct iovec *iov, int iovcnt, off_t offset) override
+        {
+            return pwritev(iov, iovcnt, offset);
+        }
+        virtual ssize_t pwrite(const void *buf, size_t count, off_t offset) override
+        {
+            iovec iov{(void*)buf, count};
+            return pwritev(&iov, 1, offset);
+        }
+
+        // drop the buffered data in [begin, end)
+        void trim(off_t begin, off_t end)
+        {
+            auto it = m_dirty.upper_bound(begin);
+            if (it != m_dirty.begin())
+                --it;
+            while (it != m_dirty.end() && it->first < end)
+            {
+                off_t e_begin = it->first, e_end = e_begin + it->second.size();
+                if (e_end <= begin)
+                {
+                    ++it;
+                    continue;
+                }
+                std::string data = std::move(it->second);
+                m_dirty_bytes -= data.size();
+                it = m_dirty.erase(it);
+                if (e_begin < begin)
+                {
+                    m_dirty.emplace(e_begin, data.substr(0, begin - e_begin));
+                    m_dirty_bytes += begin - e_begin;
+                }
+                if (e_end > end)
+                {
+                    m_dirty.emplace(end, data.substr(end - e_begin));
+                    m_dirty_bytes += e_end - end;
+                    break;
+                }
+            }
+        }
+
+        // the buffered data in a range punched or zeroed are dropped, as
+        // they are older than the discard, and no write-back may run
+        // meanwhile to write them over it
+        virtual int fallocate(int mode, off_t offset, off_t len) override
+        {
+            photon::scoped_lock lock(m_mutex);
+            if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+            {
+                trim(offset, offset + len);
+                account();
+            }
+            return m_file->fallocate(mode, offset, len);
+        }
+    };
+
+    IFile* new_writeback_file(IFile* file, uint64_t max_dirty, bool ownership)
+    {
+        return new WritebackFile(file, max_dirty, ownership);
+    }
+}
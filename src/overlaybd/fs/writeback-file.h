@@ -0,0 +1,31 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <inttypes.h>
+
+namespace FileSystem
+{
+    class IFile;
+
+    // create a write-back cache of `file`, which absorbs writes in memory,
+    // merged into extents of contiguous ranges, and serves reads from them;
+    // the extents are written back to `file` by fsync() or fdatasync(),
+    // which then syncs `file`, by close(), or once more than `max_dirty`
+    // bytes are buffered, without syncing, in which case the writer waits;
+    // a write completed is NOT durable until the next sync completes
+    extern "C" IFile* new_writeback_file(IFile* file, uint64_t max_dirty,
+                                         bool ownership = false);
+}
@@ -0,0 +1,421 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "zfile.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "crc32/crc32c.h"
+#include "../virtual-file.h"
+#include "../../alog.h"
+#include "../../iovector.h"
+#include "../../memory.h"
+#include "../../utility.h"
+
+using namespace FileSystem;
+
+namespace ZFile
+{
+    // The file begins with a header of ALIGNMENT bytes, followed by units,
+    // each of a UnitHeader and the data stored, padded to ALIGNMENT, so that
+    // the file may be opened with O_DIRECT.
+    static const uint32_t ALIGNMENT = 512;
+    static const uint32_t MAX_UNIT = 64 * 1024;
+    // room for the worst case of the compressors
+    static const uint32_t MAX_STORED = MAX_UNIT + MAX_UNIT / 128 + 1024;
+
+    struct AppendHeader
+    {
+        static uint64_t MAGIC()
+        {
+            static char magic[] = "ZAPPEND";
+            return *(uint64_t *)magic;
+        }
+        uint64_t magic = MAGIC();
+        uint32_t version = 1;
+        uint32_t unit_size = MAX_UNIT;
+        uint8_t type = CompressOptions::LZ4;
+    } __attribute__((packed));
+
+    struct UnitHeader
+    {
+        static const uint32_t MAGIC = 0x4e55415a; // "ZAUN"
+        uint32_t magic = MAGIC;
+        uint32_t header_crc;  // of the fields below
+        uint64_t offset;      // of the plain data, in bytes
+        uint32_t length;      // of the plain data
+        uint32_t stored;      // bytes stored, compressed, or plain if equal to `length`
+        uint32_t data_crc;    // of the bytes stored
+        uint32_t reserved = 0;
+
+        uint32_t crc() const
+        {
+            return crc32::crc32c(&offset, sizeof(*this) - offsetof(UnitHeader, offset));
+        }
+        bool valid() const
+        {
+            return magic == MAGIC && header_crc == crc() && length > 0 && length <= MAX_UNIT &&
+                   stored <= MAX_STORED;
+        }
+        uint32_t padded() const
+        {
+            return (sizeof(*this) + stored + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        }
+    } __attribute__((packed));
+
+    static_assert(sizeof(UnitHeader) == 32, "UnitHeader must be of 32 bytes");
+
+    struct AlignedBuffer
+    {
+        unsigned char *ptr = nullptr;
+        explicit AlignedBuffer(size_t size)
+        {
+            if (posix_memalign((void **)&ptr, 4096, size) != 0)
+                ptr = nullptr;
+        }
+        ~AlignedBuffer()
+        {
+            free(ptr);
+        }
+    };
+
+    class AppendFile : public VirtualFile
+    {
+    public:
+        struct Unit
+        {
+            uint64_t offset;  // of the plain data
+            uint64_t moffset; // of the UnitHeader in the file
+            uint32_t length;
+            uint32_t padded;
+            uint64_t end() const
+            {
+                return offset + length;
+            }
+        };
+
+        IFile *m_file;
+        bool m_ownership;
+        AppendHeader m_header;
+        std::unique_ptr<ICompressor> m_compressor;
+        std::vector<Unit> m_units; // sorted by offset, not overlapping
+        uint64_t m_size = 0;       // of the plain data
+        uint64_t m_tail = ALIGNMENT;
+        // the plain data of the unit read last, for the small reads of it
+        // that follow
+        AlignedBuffer m_cache{MAX_UNIT};
+        uint64_t m_cache_moffset = 0;
+        Memory::Account m_account{"zfile_append_units"};
+
+        AppendFile(IFile *file, bool ownership) : m_file(file), m_ownership(ownership)
+        {
+        }
+        ~AppendFile()
+        {
+            close();
+        }
+
+        int init(bool create, const CompressOptions *opt)
+        {
+            if (!m_cache.ptr)
+                LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate the buffer of units");
+            AlignedBuffer buf(ALIGNMENT);
+            if (!buf.ptr)
+                LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate the header");
+            memset(buf.ptr, 0, ALIGNMENT);
+            if (create)
+            {
+                if (opt)
+                    m_header.type = opt->type;
+                memcpy(buf.ptr, &m_header, sizeof(m_header));
+                if (m_file->ftruncate(0) < 0 || m_file->pwrite(buf.ptr, ALIGNMENT, 0) != ALIGNMENT)
+                    LOG_ERRNO_RETURN(0, -1, "failed to write the header");
+            }
+            else
+            {
+                if (m_file->pread(buf.ptr, ALIGNMENT, 0) != ALIGNMENT)
+                    LOG_ERRNO_RETURN(0, -1, "failed to read the header");
+                memcpy(&m_header, buf.ptr, sizeof(m_header));
+                if (m_header.magic != AppendHeader::MAGIC() || m_header.unit_size != MAX_UNIT)
+                    LOG_ERROR_RETURN(EINVAL, -1, "not a file of compressed units");
+            }
+            CompressArgs args(CompressOptions(m_header.type, MAX_UNIT));
+            m_compressor.reset(create_compressor(&args));
+            if (!m_compressor)
+                LOG_ERROR_RETURN(0, -1, "failed to create compressor of type `",
+                                 (int)m_header.type);
+            return create ? 0 : load();
+        }
+
+        // the units are found by their headers; a unit torn by a crash is
+        // skipped over, so are the units written before a newer one of the
+        // same data
+        int load()
+        {
+            struct stat st;
+            if (m_file->fstat(&st) < 0)
+                LOG_ERRNO_RETURN(0, -1, "failed to stat file");
+            AlignedBuffer buf(ALIGNMENT);
+            if (!buf.ptr)
+                LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate the buffer of headers");
+            auto h = (UnitHeader *)buf.ptr;
+            uint64_t pos = ALIGNMENT, torn = 0;
+            while (pos + ALIGNMENT <= (uint64_t)st.st_size)
+            {
+                if (m_file->pread(buf.ptr, ALIGNMENT, pos) != ALIGNMENT)
+                    LOG_ERRNO_RETURN(0, -1, "failed to read the unit at `", pos);
+                if (!h->valid())
+                {
+                    torn++;
+                    pos += ALIGNMENT;
+                    continue;
+                }
+                insert({h->offset, pos, h->length, h->padded()});
+                pos += h->padded();
+            }
+            m_tail = std::max(pos, (uint64_t)ALIGNMENT);
+            if (torn)
+                LOG_WARN("` blocks of torn units skipped", torn);
+            LOG_INFO("` units of ` bytes loaded", m_units.size(), m_size);
+            return 0;
+        }
+
+        // the units overlapping [offset, end)
+        std::vector<Unit>::iterator first_unit(uint64_t offset)
+        {
+            auto it = std::upper_bound(m_units.begin(), m_units.end(), offset,
+                                       [](uint64_t x, const Unit &u) { return x < u.offset; });
+            if (it != m_units.begin() && std::prev(it)->end() > offset)
+                --it;
+            return it;
+        }
+
+        void insert(const Unit &unit)
+        {
+            auto it = first_unit(unit.offset);
+            auto last = it;
+            while (last != m_units.end() && last->offset < unit.end())
+                ++last;
+            it = m_units.erase(it, last);
+            m_units.insert(it, unit);
+            m_size = std::max(m_size, unit.end());
+            m_account.set(m_units.capacity() * sizeof(Unit) + MAX_UNIT);
+        }
+
+        // compress `length` bytes of `data` as a unit appended to the file
+        int append_unit(const unsigned char *data, uint32_t length, uint64_t offset, Unit &unit)
+        {
+            AlignedBuffer buf(sizeof(UnitHeader) + MAX_STORED + ALIGNMENT);
+            if (!buf.ptr)
+                LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate the buffer of a unit");
+            auto h = new (buf.ptr) UnitHeader;
+            auto stored = buf.ptr + sizeof(UnitHeader);
+            auto ret = m_compressor->compress(data, length, stored, MAX_STORED);
+            if (ret > 0 && (uint32_t)ret < length)
+            {
+                h->stored = ret;
+            }
+            else
+            {
+                memcpy(stored, data, length);
+                h->stored = length;
+            }
+            h->offset = offset;
+            h->length = length;
+            h->data_crc = crc32::crc32c(stored, h->stored);
+            h->header_crc = h->crc();
+            auto padded = h->padded();
+            memset(stored + h->stored, 0, padded - sizeof(UnitHeader) - h->stored);
+            unit = {offset, m_tail, length, padded};
+            m_tail += padded;
+            if (m_file->pwrite(buf.ptr, padded, unit.moffset) != (ssize_t)padded)
+                LOG_ERRNO_RETURN(0, -1, "failed to write the unit of ` at `", offset,
+                                 unit.moffset);
+            return 0;
+        }
+
+        // the plain data of `unit`, valid till the next yield
+        const unsigned char *read_unit(const Unit &unit)
+        {
+            if (m_cache_moffset == unit.moffset)
+                return m_cache.ptr;
+            AlignedBuffer buf(unit.padded);
+            if (!buf.ptr)
+                LOG_ERROR_RETURN(ENOMEM, nullptr, "failed to allocate the buffer of a unit");
+            if (m_file->pread(buf.ptr, unit.padded, unit.moffset) != unit.padded)
+                LOG_ERRNO_RETURN(0, nullptr, "failed to read the unit at `", unit.moffset);
+            auto h = (UnitHeader *)buf.ptr;
+            auto stored = buf.ptr + sizeof(UnitHeader);
+            if (!h->valid() || h->offset != unit.offset || h->length != unit.length ||
+                crc32::crc32c(stored, h->stored) != h->data_crc)
+                LOG_ERROR_RETURN(EIO, nullptr, "the unit at ` is corrupted", unit.moffset);
+            if (h->stored == h->length)
+            {
+                memcpy(m_cache.ptr, stored, h->length);
+            }
+            else if (m_compressor->decompress(stored, h->stored, m_cache.ptr, MAX_UNIT) !=
+                     (int)h->length)
+            {
+                m_cache_moffset = 0;
+                LOG_ERROR_RETURN(EIO, nullptr, "failed to decompress the unit at `", unit.moffset);
+            }
+            m_cache_moffset = unit.moffset;
+            return m_cache.ptr;
+        }
+
+        // the data of [offset, offset + count), zeros where never written
+        int read_plain(unsigned char *buf, size_t count, uint64_t offset)
+        {
+            auto end = offset + count;
+            auto it = first_unit(offset);
+            std::vector<Unit> units;
+            for (; it != m_units.end() && it->offset < end; ++it)
+                units.push_back(*it);
+            auto pos = offset;
+            for (auto &u : units)
+            {
+                if (u.offset > pos)
+                    memset(buf + (pos - offset), 0, u.offset - pos);
+                pos = std::max(pos, u.offset);
+                auto n = std::min(end, u.end()) - pos;
+                auto data = read_unit(u);
+                if (!data)
+                    return -1;
+                memcpy(buf + (pos - offset), data + (pos - u.offset), n);
+                pos += n;
+            }
+            if (pos < end)
+                memset(buf + (pos - offset), 0, end - pos);
+            return 0;
+        }
+
+        virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override
+        {
+            iovector_view view((struct iovec *)iov, iovcnt);
+            auto count = view.sum();
+            if ((uint64_t)offset >= m_size)
+                return 0;
+            count = std::min(count, m_size - offset);
+            std::unique_ptr<unsigned char[]> buf(new unsigned char[count]);
+            if (read_plain(buf.get(), count, offset) < 0)
+                return -1;
+            view.memcpy_from(buf.get(), count);
+            return count;
+        }
+
+        // a write over units written before rewrites them as a whole,
+        // merged with it, so that units are superseded but never split
+        virtual ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override
+        {
+            iovector_view view((struct iovec *)iov, iovcnt);
+            auto count = view.sum();
+            if (count == 0)
+                return 0;
+            uint64_t begin = offset, end = offset + count;
+            auto it = first_unit(begin);
+            if (it != m_units.end() && it->offset < end)
+            {
+                begin = std::min(begin, it->offset);
+                auto last = it;
+                while (last != m_units.end() && last->offset < end)
+                    end = std::max(end, (last++)->end());
+            }
+            std::unique_ptr<unsigned char[]> buf(new unsigned char[end - begin]);
+            if ((begin < (uint64_t)offset || end > offset + count) &&
+                read_plain(buf.get(), end - begin, begin) < 0)
+                return -1;
+            view.memcpy_to(buf.get() + (offset - begin), count);
+
+            std::vector<Unit> units;
+            for (auto pos = begin; pos < end; pos += MAX_UNIT)
+            {
+                Unit unit;
+                auto length = (uint32_t)std::min((uint64_t)MAX_UNIT, end - pos);
+                if (append_unit(buf.get() + (pos - begin), length, pos, unit) < 0)
+                    return -1;
+                units.push_back(unit);
+            }
+            // published once all are written, as a write of LSMT is
+            for (auto &u : units)
+                insert(u);
+            return count;
+        }
+
+        virtual int fstat(struct stat *buf) override
+        {
+            if (m_file->fstat(buf) < 0)
+                return -1;
+            buf->st_size = m_size;
+            return 0;
+        }
+        virtual int fsync() override
+        {
+            return m_file->fsync();
+        }
+        virtual int fdatasync() override
+        {
+            return m_file->fdatasync();
+        }
+        virtual int close() override
+        {
+            if (m_ownership)
+            {
+                m_ownership = false;
+                delete m_file;
+            }
+            return 0;
+        }
+        virtual IFileSystem *filesystem() override
+        {
+            return m_file->filesystem();
+        }
+        UNIMPLEMENTED(int fchmod(mode_t mode) override);
+        UNIMPLEMENTED(int fchown(uid_t owner, gid_t group) override);
+        UNIMPLEMENTED(int ftruncate(off_t length) override);
+    };
+
+    IFile *zfile_open_append(IFile *file, bool create, const CompressOptions *opt,
+                             bool ownership)
+    {
+        if (file == nullptr)
+            LOG_ERROR_RETURN(EINVAL, nullptr, "invalid file (null)");
+        auto rst = new AppendFile(file, false);
+        if (rst->init(create, opt) < 0)
+        {
+            delete rst;
+            return nullptr;
+        }
+        rst->m_ownership = ownership;
+        return rst;
+    }
+
+    int is_zfile_append(IFile *file)
+    {
+        if (file == nullptr)
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid file (null)");
+        AlignedBuffer buf(ALIGNMENT);
+        if (!buf.ptr)
+            LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate the header");
+        auto ret = file->pread(buf.ptr, ALIGNMENT, 0);
+        if (ret < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to read the header");
+        return ret == ALIGNMENT && ((AppendHeader *)buf.ptr)->magic == AppendHeader::MAGIC();
+    }
+}
@@ -18,6 +18,9 @@
 #include "lz4/lz4.h"
 #include "../../alog.h"
 #include <memory>
+#include <algorithm>
+#include <cstring>
+#include <zstd.h>
 
 namespace ZFile
 {
@@ -27,6 +30,17 @@ namespace ZFile
     public:
         uint32_t max_dst_size = 0;
         uint32_t src_blk_size = 0;
+        // lz4 only references the last 64KB of a dictionary
+        const static int MAX_DICT_SIZE = 65536;
+        std::unique_ptr<char[]> m_dict;
+        int m_dict_size = 0;
+        LZ4_stream_t *m_dict_stream = nullptr;
+
+        ~Compressor_lz4()
+        {
+            if (m_dict_stream)
+                LZ4_freeStream(m_dict_stream);
+        }
 
         int init(const CompressArgs *args)
         {
@@ -40,6 +54,22 @@ namespace ZFile
             }
             src_blk_size = opt->block_size;
             max_dst_size = LZ4_compressBound(src_blk_size);
+            if (opt->use_dict) {
+                if (!args->dict_buf || opt->dict_size == 0) {
+                    LOG_ERROR_RETURN(EINVAL, -1, "use_dict is set without a dictionary.");
+                }
+                // the dictionary is hashed only once, each compress() starts
+                // from a copy of the prepared stream
+                m_dict_size = std::min((int)opt->dict_size, MAX_DICT_SIZE);
+                m_dict.reset(new char[m_dict_size]);
+                memcpy(m_dict.get(),
+                       args->dict_buf.get() + opt->dict_size - m_dict_size, m_dict_size);
+                m_dict_stream = LZ4_createStream();
+                if (m_dict_stream == nullptr) {
+                    LOG_ERROR_RETURN(ENOMEM, -1, "failed to create lz4 stream.");
+                }
+                LZ4_loadDict(m_dict_stream, m_dict.get(), m_dict_size);
+            }
             return 0;
         }
 
@@ -51,8 +81,16 @@ namespace ZFile
                                 max_dst_size - 1);
             }
 
-            auto ret = LZ4_compress_default((const char *)src, (char *)dst,
+            int ret;
+            if (m_dict_stream) {
+                static thread_local LZ4_stream_t stream;
+                memcpy(&stream, m_dict_stream, sizeof(stream));
+                ret = LZ4_compress_fast_continue(&stream, (const char *)src, (char *)dst,
+                                                 src_len, dst_len, 1);
+            } else {
+                ret = LZ4_compress_default((const char *)src, (char *)dst,
                                                     src_len, dst_len);
+            }
             if (ret < 0) {
                 LOG_ERROR_RETURN(EFAULT, -1, "LZ4 compress data failed. (retcode: `).", ret);
             }
@@ -72,8 +110,14 @@ namespace ZFile
                     "dst_len (`) should be greater than compressed block size `",
                     dst_len, src_blk_size );
             }
-            auto ret = LZ4_decompress_safe((const char*)src, (char *)dst,
+            int ret;
+            if (m_dict) {
+                ret = LZ4_decompress_safe_usingDict((const char*)src, (char *)dst,
+                                            src_len, dst_len, m_dict.get(), m_dict_size);
+            } else {
+                ret = LZ4_decompress_safe((const char*)src, (char *)dst,
                                             src_len, dst_len);
+            }
             if (ret < 0) {
                 LOG_ERROR_RETURN(EFAULT, -1,
                     "LZ4 decompress data failed. (retcode: `)", ret);
@@ -85,8 +129,221 @@ namespace ZFile
             LOG_DEBUG("decompressed ` bytes back into ` bytes.", src_len, ret);
             return ret;
         }
+
+        int compress_linked(const unsigned char *src, size_t src_len,
+                    unsigned char *dst, size_t dst_len, size_t prefix_len) override
+        {
+            if (dst_len < max_dst_size) {
+                LOG_ERROR_RETURN(ENOBUFS, -1, "dst_len should be greater than `",
+                                max_dst_size - 1);
+            }
+            // the stream goes on referencing the blocks compressed before
+            static thread_local LZ4_stream_t stream;
+            if (prefix_len == 0)
+                LZ4_resetStream(&stream);
+            auto ret = LZ4_compress_fast_continue(&stream, (const char *)src, (char *)dst,
+                                                  src_len, dst_len, 1);
+            if (ret <= 0) {
+                LOG_ERROR_RETURN(EFAULT, -1, "LZ4 compress linked block failed. (retcode: `).", ret);
+            }
+            return ret;
+        }
+
+        int decompress_linked(const unsigned char *src, size_t src_len,
+                        unsigned char *dst,  size_t dst_len, size_t prefix_len) override
+        {
+            if (dst_len < src_blk_size) {
+                LOG_ERROR_RETURN(0, -1,
+                    "dst_len (`) should be greater than compressed block size `",
+                    dst_len, src_blk_size );
+            }
+            int dict_size = std::min(prefix_len, (size_t)MAX_DICT_SIZE);
+            auto ret = LZ4_decompress_safe_usingDict((const char*)src, (char *)dst, src_len,
+                                                     dst_len, (const char *)dst - dict_size,
+                                                     dict_size);
+            if (ret <= 0) {
+                LOG_ERROR_RETURN(EFAULT, -1,
+                    "LZ4 decompress linked block failed. (retcode: `)", ret);
+            }
+            return ret;
+        }
+    };
+
+    class Compressor_zstd : public ICompressor
+    {
+    public:
+        uint32_t max_dst_size = 0;
+        uint32_t src_blk_size = 0;
+        int level = 0;
+        int window_log = 0;
+        // prepared once from the dictionary and shared by all the contexts
+        ZSTD_CDict *m_cdict = nullptr;
+        ZSTD_DDict *m_ddict = nullptr;
+
+        ~Compressor_zstd()
+        {
+            ZSTD_freeCDict(m_cdict);
+            ZSTD_freeDDict(m_ddict);
+        }
+
+        // contexts are expensive to create, so they are kept per thread
+        // and reused by all the zstd compressors running on it
+        struct CCtxDeleter { void operator()(ZSTD_CCtx *p) { ZSTD_freeCCtx(p); } };
+        struct DCtxDeleter { void operator()(ZSTD_DCtx *p) { ZSTD_freeDCtx(p); } };
+
+        static ZSTD_CCtx *cctx()
+        {
+            static thread_local std::unique_ptr<ZSTD_CCtx, CCtxDeleter> ctx(ZSTD_createCCtx());
+            return ctx.get();
+        }
+
+        static ZSTD_DCtx *dctx()
+        {
+            static thread_local std::unique_ptr<ZSTD_DCtx, DCtxDeleter> ctx(ZSTD_createDCtx());
+            return ctx.get();
+        }
+
+        int init(const CompressArgs *args)
+        {
+            auto opt = &args->opt;
+            if (opt == nullptr) {
+                LOG_ERROR_RETURN(EINVAL, -1, "CompressOptions* is nullptr.");
+            };
+            if (opt->type != CompressOptions::ZSTD) {
+                LOG_ERROR_RETURN(EINVAL, -1,
+                    "Compression type invalid. (expected: CompressionOptions::ZSTD)");
+            }
+            src_blk_size = opt->block_size;
+            max_dst_size = ZSTD_compressBound(src_blk_size);
+            // level 0 selects zstd's default level
+            level = std::min((int)opt->level, ZSTD_maxCLevel());
+            // a window covering the frame is all linked blocks can reference
+            for (window_log = 10; (1u << window_log) < opt->frame_size; window_log++)
+                ;
+            if (opt->use_dict) {
+                if (!args->dict_buf || opt->dict_size == 0) {
+                    LOG_ERROR_RETURN(EINVAL, -1, "use_dict is set without a dictionary.");
+                }
+                m_cdict = ZSTD_createCDict(args->dict_buf.get(), opt->dict_size, level);
+                m_ddict = ZSTD_createDDict(args->dict_buf.get(), opt->dict_size);
+                if (m_cdict == nullptr || m_ddict == nullptr) {
+                    LOG_ERROR_RETURN(EINVAL, -1, "failed to load zstd dictionary of ` bytes.",
+                                    opt->dict_size);
+                }
+            }
+            return 0;
+        }
+
+        int compress(const unsigned char *src, size_t src_len,
+                    unsigned char *dst, size_t dst_len) override
+        {
+            if (dst_len < max_dst_size) {
+                LOG_ERROR_RETURN(ENOBUFS, -1, "dst_len should be greater than `",
+                                max_dst_size - 1);
+            }
+            auto ctx = cctx();
+            if (ctx == nullptr) {
+                LOG_ERROR_RETURN(ENOMEM, -1, "failed to create zstd compression context.");
+            }
+            auto ret = m_cdict ?
+                ZSTD_compress_usingCDict(ctx, dst, dst_len, src, src_len, m_cdict) :
+                ZSTD_compressCCtx(ctx, dst, dst_len, src, src_len, level);
+            if (ZSTD_isError(ret)) {
+                LOG_ERROR_RETURN(EFAULT, -1, "ZSTD compress data failed. (`)",
+                                ZSTD_getErrorName(ret));
+            }
+            return ret;
+        }
+
+        int decompress(const unsigned char *src, size_t src_len,
+                        unsigned char *dst,  size_t dst_len) override
+        {
+            if (dst_len < src_blk_size) {
+                LOG_ERROR_RETURN(0, -1,
+                    "dst_len (`) should be greater than compressed block size `",
+                    dst_len, src_blk_size );
+            }
+            auto ctx = dctx();
+            if (ctx == nullptr) {
+                LOG_ERROR_RETURN(ENOMEM, -1, "failed to create zstd decompression context.");
+            }
+            auto ret = m_ddict ?
+                ZSTD_decompress_usingDDict(ctx, dst, dst_len, src, src_len, m_ddict) :
+                ZSTD_decompressDCtx(ctx, dst, dst_len, src, src_len);
+            if (ZSTD_isError(ret)) {
+                LOG_ERROR_RETURN(EFAULT, -1,
+                    "ZSTD decompress data failed. (`)", ZSTD_getErrorName(ret));
+            }
+            LOG_DEBUG("decompressed ` bytes back into ` bytes.", src_len, ret);
+            return ret;
+        }
+
+        // a frame is one zstd stream, flushed at the end of each block
+        int compress_linked(const unsigned char *src, size_t src_len,
+                    unsigned char *dst, size_t dst_len, size_t prefix_len) override
+        {
+            if (dst_len < max_dst_size) {
+                LOG_ERROR_RETURN(ENOBUFS, -1, "dst_len should be greater than `",
+                                max_dst_size - 1);
+            }
+            auto ctx = cctx();
+            if (ctx == nullptr) {
+                LOG_ERROR_RETURN(ENOMEM, -1, "failed to create zstd compression context.");
+            }
+            if (prefix_len == 0) {
+                ZSTD_CCtx_reset(ctx, ZSTD_reset_session_and_parameters);
+                ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, level);
+                ZSTD_CCtx_setParameter(ctx, ZSTD_c_windowLog, window_log);
+            }
+            ZSTD_inBuffer in{src, src_len, 0};
+            ZSTD_outBuffer out{dst, dst_len, 0};
+            size_t ret;
+            do {
+                ret = ZSTD_compressStream2(ctx, &out, &in, ZSTD_e_flush);
+                if (ZSTD_isError(ret)) {
+                    LOG_ERROR_RETURN(EFAULT, -1, "ZSTD compress linked block failed. (`)",
+                                    ZSTD_getErrorName(ret));
+                }
+                if (ret != 0 && out.pos == out.size) {
+                    LOG_ERROR_RETURN(ENOBUFS, -1, "ZSTD linked block exceeds ` bytes", dst_len);
+                }
+            } while (ret != 0);
+            return out.pos;
+        }
+
+        int decompress_linked(const unsigned char *src, size_t src_len,
+                        unsigned char *dst,  size_t dst_len, size_t prefix_len) override
+        {
+            if (dst_len < src_blk_size) {
+                LOG_ERROR_RETURN(0, -1,
+                    "dst_len (`) should be greater than compressed block size `",
+                    dst_len, src_blk_size );
+            }
+            auto ctx = dctx();
+            if (ctx == nullptr) {
+                LOG_ERROR_RETURN(ENOMEM, -1, "failed to create zstd decompression context.");
+            }
+            if (prefix_len == 0)
+                ZSTD_DCtx_reset(ctx, ZSTD_reset_session_only);
+            ZSTD_inBuffer in{src, src_len, 0};
+            ZSTD_outBuffer out{dst, dst_len, 0};
+            while (in.pos < in.size) {
+                auto ret = ZSTD_decompressStream(ctx, &out, &in);
+                if (ZSTD_isError(ret)) {
+                    LOG_ERROR_RETURN(EFAULT, -1,
+                        "ZSTD decompress linked block failed. (`)", ZSTD_getErrorName(ret));
+                }
+                if (in.pos < in.size && out.pos == out.size) {
+                    LOG_ERROR_RETURN(EFAULT, -1, "ZSTD linked block exceeds ` bytes", dst_len);
+                }
+            }
+            return out.pos;
+        }
     };
 
+    // defined in compressor_hw.cpp, returns `sw` if no accelerator is usable
+    ICompressor *create_hw_compressor(const CompressArgs *args, ICompressor *sw);
+
     ICompressor* create_compressor(const CompressArgs *args)
     {
         ICompressor *rst = nullptr;
@@ -101,6 +358,13 @@ namespace ZFile
             }
             break;
 
+        case CompressOptions::ZSTD:
+            rst = new Compressor_zstd;
+            if (rst != nullptr) {
+                init_flg = ((Compressor_zstd*)rst)->init(args);
+            }
+            break;
+
         default:
             LOG_ERROR_RETURN(EINVAL, nullptr, "invalid CompressionOptions.");
         }
@@ -108,6 +372,8 @@ namespace ZFile
             delete rst;
             return nullptr;
         }
+        if (args->hw_offload && !opt.use_dict)
+            rst = create_hw_compressor(args, rst);
         return rst;
     }
 
@@ -42,9 +42,16 @@ namespace ZFile{
         uint8_t type = LZ4;   // algorithm
         uint8_t level = 0;  // compress level
         uint8_t use_dict = 0;
-        uint32_t args = 0;  // reserve;
+        // bytes of the linked frames, 0 for independent blocks. Blocks of a
+        // frame are compressed with the blocks before them as history, and so
+        // are decompressed starting from the first block of the frame.
+        uint32_t frame_size = 0;
         uint32_t dict_size = 0;
         uint8_t verify = 0;
+        // store a block as is when compressing doesn't make it smaller, such
+        // a block is told by its stored length being its plain length.
+        // Recorded as a flag of the header, can't be used with linked frames.
+        uint8_t raw_blocks = 0;
 
         CompressOptions(uint8_t type = LZ4,
                         uint32_t block_size = DEFAULT_BLOCK_SIZE,
@@ -59,6 +66,13 @@ namespace ZFile{
         FileSystem::IFile *fdict = nullptr;
         std::unique_ptr<unsigned char[]> dict_buf = nullptr;
         CompressOptions opt;
+        // number of threads compressing blocks in zfile_compress(),
+        // the output is identical regardless of it
+        int workers = 1;
+        // offload the compression of independent blocks without a dictionary
+        // to a hardware accelerator if one is built in and present, falling
+        // back to software otherwise; the blocks are decompressed as usual
+        bool hw_offload = false;
 
         CompressArgs(const CompressOptions &opt, FileSystem::IFile *dict = nullptr,
                     unsigned char *dict_buf = nullptr)
@@ -87,6 +101,35 @@ namespace ZFile{
         */
         virtual int decompress(const unsigned char *src, size_t src_len,
                         unsigned char *dst, size_t dst_len) = 0;
+        /*
+            like compress() and decompress(), for a block of a linked frame
+            whose `prefix_len` bytes of plain data lie right before `src`
+            (compress) or `dst` (decompress). The blocks of a frame have to
+            be processed in order on one thread, from the one with
+            prefix_len == 0, without any other frame in between.
+        */
+        virtual int compress_linked(const unsigned char *src, size_t src_len,
+                        unsigned char *dst, size_t dst_len, size_t prefix_len) = 0;
+        virtual int decompress_linked(const unsigned char *src, size_t src_len,
+                        unsigned char *dst, size_t dst_len, size_t prefix_len) = 0;
+        /*
+            compress `n` independent blocks, src[i] of src_len[i] bytes into
+            dst[i] of dst_len bytes, with what compress() returns for each
+            in ret[i]. Return -1 if any failed, 0 otherwise. Accelerators
+            submit the batch at once, by default it's compressed block by
+            block.
+        */
+        virtual int compress_batch(const unsigned char *const *src, const size_t *src_len,
+                        unsigned char *const *dst, size_t dst_len, int *ret, size_t n)
+        {
+            int rst = 0;
+            for (size_t i = 0; i < n; i++) {
+                ret[i] = compress(src[i], src_len[i], dst[i], dst_len);
+                if (ret[i] <= 0)
+                    rst = -1;
+            }
+            return rst;
+        }
     };
 
     extern "C" ICompressor *create_compressor(const CompressArgs *args);
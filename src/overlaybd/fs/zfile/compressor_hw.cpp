@@ -0,0 +1,247 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "compressor.h"
+#include "../../alog.h"
+
+#ifdef ZFILE_QAT
+#define ZSTD_STATIC_LINKING_ONLY
+#include <string.h>
+#include <mutex>
+#include <zstd.h>
+#include <qatzip.h>
+#include <qatseqprod.h>
+#endif
+
+namespace ZFile
+{
+#ifndef ZFILE_QAT
+
+    ICompressor *create_hw_compressor(const CompressArgs *args, ICompressor *sw)
+    {
+        static bool warned = (LOG_WARN("no hardware accelerator built in, compress in software"),
+                              true);
+        (void)warned;
+        return sw;
+    }
+
+#else
+
+    // Intel QAT, through QATzip for lz4 and the sequence producer of
+    // QAT-ZSTD-Plugin for zstd. Both give the formats of the software
+    // compressors: QATzip emits lz4 frames, whose only block is what is
+    // stored, and zstd frames are built from the sequences matched by the
+    // device. Each compressor has its own session, so the workers of
+    // zfile_compress() keep the device busy together. A block the device
+    // fails, or leaves uncompressed, is compressed by `m_sw`, which also
+    // does the rest of the work.
+    class Compressor_qat : public ICompressor
+    {
+    public:
+        std::unique_ptr<ICompressor> m_sw;
+        uint8_t m_type;
+        int m_level;
+        // lz4
+        QzSession_T m_session{};
+        bool m_session_up = false;
+        std::unique_ptr<unsigned char[]> m_frame;
+        unsigned int m_frame_len = 0;
+        // zstd
+        ZSTD_CCtx *m_cctx = nullptr;
+        void *m_seq_state = nullptr;
+        bool m_device_up = false;
+
+        // the device is started once for all the zstd compressors
+        static std::mutex &device_mutex()
+        {
+            static std::mutex m;
+            return m;
+        }
+        static int &device_users()
+        {
+            static int n = 0;
+            return n;
+        }
+
+        Compressor_qat(ICompressor *sw, const CompressOptions &opt)
+            : m_sw(sw), m_type(opt.type), m_level(opt.level)
+        {
+        }
+
+        ~Compressor_qat()
+        {
+            if (m_session_up)
+            {
+                qzTeardownSession(&m_session);
+                qzClose(&m_session);
+            }
+            ZSTD_freeCCtx(m_cctx);
+            if (m_seq_state)
+                QZSTD_freeSeqProdState(m_seq_state);
+            if (m_device_up)
+            {
+                std::lock_guard<std::mutex> lock(device_mutex());
+                if (--device_users() == 0)
+                    QZSTD_stopQatDevice();
+            }
+        }
+
+        int init(size_t block_size)
+        {
+            if (m_type == CompressOptions::LZ4)
+            {
+                // no fallback inside QATzip, failed blocks come back to m_sw
+                if (qzInit(&m_session, 0) < 0)
+                {
+                    LOG_ERROR_RETURN(ENODEV, -1, "failed to init QAT session");
+                }
+                m_session_up = true;
+                QzSessionParamsLZ4_T params;
+                if (qzGetDefaultsLZ4(&params) != QZ_OK)
+                {
+                    LOG_ERROR_RETURN(ENODEV, -1, "failed to get QAT lz4 defaults");
+                }
+                if (qzSetupSessionLZ4(&m_session, &params) != QZ_OK)
+                {
+                    LOG_ERROR_RETURN(ENODEV, -1, "failed to setup QAT lz4 session");
+                }
+                m_frame_len = qzMaxCompressedLength(block_size, &m_session);
+                m_frame.reset(new unsigned char[m_frame_len]);
+                return 0;
+            }
+            // levels the device supports
+            if (m_level > 12)
+            {
+                LOG_ERROR_RETURN(ENOTSUP, -1, "zstd level ` isn't supported by QAT", m_level);
+            }
+            {
+                std::lock_guard<std::mutex> lock(device_mutex());
+                if (device_users() == 0 && QZSTD_startQatDevice() != QZSTD_OK)
+                {
+                    LOG_ERROR_RETURN(ENODEV, -1, "failed to start QAT device for zstd");
+                }
+                device_users()++;
+                m_device_up = true;
+            }
+            m_cctx = ZSTD_createCCtx();
+            m_seq_state = QZSTD_createSeqProdState();
+            if (m_cctx == nullptr || m_seq_state == nullptr)
+            {
+                LOG_ERROR_RETURN(ENOMEM, -1, "failed to create zstd context for QAT");
+            }
+            ZSTD_registerSequenceProducer(m_cctx, m_seq_state, qatSequenceProducer);
+            // the software matcher takes over a block the device fails
+            ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_enableSeqProducerFallback, 1);
+            ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_compressionLevel, m_level);
+            return 0;
+        }
+
+        // the only lz4 block of the frame made by QATzip, or -1
+        int compress_lz4(const unsigned char *src, size_t src_len,
+                         unsigned char *dst, size_t dst_len)
+        {
+            unsigned int in = src_len, out = m_frame_len;
+            if (qzCompress(&m_session, src, &in, m_frame.get(), &out, 1) != QZ_OK ||
+                in != src_len)
+                return -1;
+            // magic, FLG, BD, the optional content size and the header checksum
+            const unsigned int kMagic = 0x184D2204;
+            auto p = m_frame.get();
+            if (out < 7 || memcmp(p, &kMagic, 4) != 0)
+                return -1;
+            unsigned int pos = 4 + 2 + ((p[4] & 0x08) ? 8 : 0) + 1;
+            uint32_t block;
+            if (pos + 4 > out)
+                return -1;
+            memcpy(&block, p + pos, 4);
+            pos += 4;
+            // a block stored uncompressed, or more than one block
+            if ((block & 0x80000000) || block == 0 || pos + block > out || block > dst_len)
+                return -1;
+            unsigned int end = pos + block + ((p[4] & 0x10) ? 4 : 0);
+            uint32_t mark;
+            if (end + 4 > out || (memcpy(&mark, p + end, 4), mark != 0))
+                return -1;
+            memcpy(dst, p + pos, block);
+            return block;
+        }
+
+        int compress(const unsigned char *src, size_t src_len,
+                     unsigned char *dst, size_t dst_len) override
+        {
+            int ret;
+            compress_batch(&src, &src_len, &dst, dst_len, &ret, 1);
+            return ret;
+        }
+
+        int compress_batch(const unsigned char *const *src, const size_t *src_len,
+                           unsigned char *const *dst, size_t dst_len, int *ret,
+                           size_t n) override
+        {
+            int rst = 0;
+            for (size_t i = 0; i < n; i++)
+            {
+                if (m_cctx)
+                {
+                    auto r = ZSTD_compress2(m_cctx, dst[i], dst_len, src[i], src_len[i]);
+                    ret[i] = ZSTD_isError(r) ? -1 : (int)r;
+                }
+                else
+                {
+                    ret[i] = compress_lz4(src[i], src_len[i], dst[i], dst_len);
+                }
+                if (ret[i] <= 0)
+                    ret[i] = m_sw->compress(src[i], src_len[i], dst[i], dst_len);
+                if (ret[i] <= 0)
+                    rst = -1;
+            }
+            return rst;
+        }
+
+        int decompress(const unsigned char *src, size_t src_len,
+                       unsigned char *dst, size_t dst_len) override
+        {
+            return m_sw->decompress(src, src_len, dst, dst_len);
+        }
+
+        int compress_linked(const unsigned char *src, size_t src_len,
+                            unsigned char *dst, size_t dst_len, size_t prefix_len) override
+        {
+            return m_sw->compress_linked(src, src_len, dst, dst_len, prefix_len);
+        }
+
+        int decompress_linked(const unsigned char *src, size_t src_len,
+                              unsigned char *dst, size_t dst_len, size_t prefix_len) override
+        {
+            return m_sw->decompress_linked(src, src_len, dst, dst_len, prefix_len);
+        }
+    };
+
+    ICompressor *create_hw_compressor(const CompressArgs *args, ICompressor *sw)
+    {
+        auto hw = new Compressor_qat(sw, args->opt);
+        if (hw->init(args->opt.block_size) < 0)
+        {
+            LOG_WARN("QAT is unavailable, compress in software");
+            hw->m_sw.release();
+            delete hw;
+            return sw;
+        }
+        LOG_INFO("compress on QAT");
+        return hw;
+    }
+
+#endif
+}
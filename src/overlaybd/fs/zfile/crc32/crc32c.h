@@ -32,6 +32,7 @@ extern uint32_t crc32c_extend(const std::string &text, uint32_t crc);
 namespace testing {
 extern uint32_t crc32c_slow(const void *data, size_t nbytes, uint32_t crc);
 extern uint32_t crc32c_fast(const void *data, size_t nbytes, uint32_t crc);
+extern uint32_t crc32c_interleaved(const void *data, size_t nbytes, uint32_t crc);
 } // namespace testing
 
 } // namespace crc32
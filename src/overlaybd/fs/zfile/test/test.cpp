@@ -63,6 +63,32 @@ public:
         LOG_INFO("write done.");
     }
 
+    // compresses `fsrc` by `args` to verify.zfile, opened anew as `fdst`
+    void compress(IFile *fsrc, unique_ptr<IFile> &fdst, CompressArgs &args)
+    {
+        fdst.reset(lfs->open("verify.zfile", O_CREAT | O_TRUNC | O_RDWR, 0644));
+        ASSERT_TRUE(fdst);
+        ASSERT_EQ(zfile_compress(fsrc, fdst.get(), &args), 0);
+    }
+
+    // `write_times` random writes to verify.data, compressed by `args`, or
+    // by lz4 with crc32
+    void compress_random(unique_ptr<IFile> &fsrc, unique_ptr<IFile> &fdst, CompressArgs &args)
+    {
+        fsrc.reset(lfs->open("verify.data", O_CREAT | O_TRUNC | O_RDWR, 0644));
+        ASSERT_TRUE(fsrc);
+        randwrite(fsrc.get(), write_times);
+        compress(fsrc.get(), fdst, args);
+    }
+
+    void compress_random(unique_ptr<IFile> &fsrc, unique_ptr<IFile> &fdst)
+    {
+        CompressOptions opt;
+        opt.verify = 1;
+        CompressArgs args(opt);
+        compress_random(fsrc, fdst, args);
+    }
+
     void seqread(IFile *fsrc, IFile *fzfile)
     {
         LOG_INFO("start seqread.");
@@ -168,6 +194,501 @@ TEST_F(ZFileTest, verify_lz4)
     randread(fsrc.get(), flz4);
 }
 
+TEST_F(ZFileTest, verify_zstd)
+{
+    CompressOptions opt(CompressOptions::ZSTD);
+    opt.level = 3;
+    opt.verify = 1;
+    CompressArgs args(opt);
+    args.workers = 2;
+    // read by the software decompressor whether offloaded or fallen back
+    args.hw_offload = true;
+    unique_ptr<IFile> fsrc, fdst;
+    ASSERT_NO_FATAL_FAILURE(compress_random(fsrc, fdst, args));
+    IFile *fzstd = zfile_open_ro(fdst.get(), /*verify=*/true, false);
+    ASSERT_NE(fzstd, nullptr);
+    DEFER(delete fzstd);
+    seqread(fsrc.get(), fzstd);
+    randread(fsrc.get(), fzstd);
+}
+
+TEST_F(ZFileTest, dictionary)
+{
+    unique_ptr<IFile> fsrc(lfs->open("verify.data", O_CREAT | O_TRUNC | O_RDWR, 0644));
+    randwrite(fsrc.get(), write_times);
+    for (auto type : {CompressOptions::LZ4, CompressOptions::ZSTD})
+    {
+        CompressOptions opt(type);
+        opt.verify = 1;
+        CompressArgs args(opt);
+        ASSERT_EQ(zfile_train_dict(fsrc.get(), &args, 16 << 10), 0);
+        EXPECT_EQ(args.opt.use_dict, 1);
+        EXPECT_GT(args.opt.dict_size, 0U);
+        EXPECT_LE(args.opt.dict_size, 16U << 10);
+        unique_ptr<IFile> fdst;
+        ASSERT_NO_FATAL_FAILURE(compress(fsrc.get(), fdst, args));
+        IFile *fz = zfile_open_ro(fdst.get(), /*verify=*/true, false);
+        ASSERT_NE(fz, nullptr);
+        DEFER(delete fz);
+        seqread(fsrc.get(), fz);
+        randread(fsrc.get(), fz);
+    }
+}
+
+TEST_F(ZFileTest, linked_frames)
+{
+    auto fn_parallel = "verify.zframe.p";
+    unique_ptr<IFile> fsrc(lfs->open("verify.data", O_CREAT | O_TRUNC | O_RDWR, 0644));
+    // blocks are variations of a few ones, which only frames can make use of
+    int pool[8][1024];
+    for (auto &blk : pool)
+        for (auto &x : blk)
+            x = rand();
+    for (int i = 0; i < write_times; i++)
+    {
+        auto &blk = pool[rand() % 8];
+        blk[rand() % 1024] = rand();
+        fsrc->write(blk, sizeof(blk));
+    }
+    for (auto type : {CompressOptions::LZ4, CompressOptions::ZSTD})
+    {
+        CompressOptions opt(type);
+        opt.verify = 1;
+        CompressArgs args(opt);
+        unique_ptr<IFile> fdst;
+        ASSERT_NO_FATAL_FAILURE(compress(fsrc.get(), fdst, args));
+        struct stat st_blocks, st_frames, st_parallel;
+        fdst->fstat(&st_blocks);
+
+        args.opt.frame_size = 64 << 10;
+        ASSERT_NO_FATAL_FAILURE(compress(fsrc.get(), fdst, args));
+        unique_ptr<IFile> fparallel(lfs->open(fn_parallel, O_CREAT | O_TRUNC | O_RDWR, 0644));
+        args.workers = 4;
+        ASSERT_EQ(zfile_compress(fsrc.get(), fparallel.get(), &args), 0);
+        fdst->fstat(&st_frames);
+        fparallel->fstat(&st_parallel);
+        LOG_INFO("compressed size: ` in blocks, ` in frames", st_blocks.st_size, st_frames.st_size);
+        EXPECT_LT(st_frames.st_size, st_blocks.st_size / 2);
+        ASSERT_EQ(st_frames.st_size, st_parallel.st_size);
+
+        for (auto cache_size : {0, 256 << 10})
+        {
+            zfile_set_block_cache_size(cache_size);
+            DEFER(zfile_set_block_cache_size(0));
+            IFile *fz = zfile_open_ro(fparallel.get(), /*verify=*/true, false);
+            ASSERT_NE(fz, nullptr);
+            DEFER(delete fz);
+            seqread(fsrc.get(), fz);
+            randread(fsrc.get(), fz);
+        }
+    }
+}
+
+TEST_F(ZFileTest, raw_blocks)
+{
+    unique_ptr<IFile> fsrc(lfs->open("verify.data", O_CREAT | O_TRUNC | O_RDWR, 0644));
+    // random blocks which can't be compressed, between compressible ones,
+    // ending with a short block
+    int blk[1024];
+    for (int i = 0; i < write_times; i++)
+    {
+        for (auto &x : blk)
+            x = (i % 2) ? rand() : i;
+        fsrc->write(blk, sizeof(blk));
+    }
+    fsrc->write(blk, 1024);
+    struct stat st_src;
+    fsrc->fstat(&st_src);
+    for (auto type : {CompressOptions::LZ4, CompressOptions::ZSTD})
+    {
+        CompressOptions opt(type);
+        opt.verify = 1;
+        CompressArgs args(opt);
+        unique_ptr<IFile> fdst;
+        ASSERT_NO_FATAL_FAILURE(compress(fsrc.get(), fdst, args));
+        struct stat st_blocks, st_raw;
+        fdst->fstat(&st_blocks);
+
+        args.opt.raw_blocks = 1;
+        args.workers = 4;
+        ASSERT_NO_FATAL_FAILURE(compress(fsrc.get(), fdst, args));
+        fdst->fstat(&st_raw);
+        LOG_INFO("compressed size: `, ` with raw blocks", st_blocks.st_size, st_raw.st_size);
+        EXPECT_LT(st_raw.st_size, st_blocks.st_size);
+        EXPECT_LT(st_raw.st_size, st_src.st_size);
+
+        for (auto threads : {0, 4})
+        {
+            zfile_set_decompress_threads(threads);
+            zfile_set_block_cache_size(64 << 10);
+            DEFER({
+                zfile_set_decompress_threads(0);
+                zfile_set_block_cache_size(0);
+            });
+            IFile *fz = zfile_open_ro(fdst.get(), /*verify=*/true, false);
+            ASSERT_NE(fz, nullptr);
+            DEFER(delete fz);
+            // the whole file, short last block included
+            const size_t MAX_COUNT = 1 << 20;
+            auto data0 = unique_ptr<char[]>(new char[MAX_COUNT]);
+            auto data1 = unique_ptr<char[]>(new char[MAX_COUNT]);
+            for (off_t offset = 0; offset < st_src.st_size; offset += MAX_COUNT)
+            {
+                auto count = std::min((off_t)MAX_COUNT, st_src.st_size - offset);
+                ASSERT_EQ(fsrc->pread(data0.get(), count, offset), count);
+                ASSERT_EQ(fz->pread(data1.get(), count, offset), count);
+                ASSERT_EQ(memcmp(data0.get(), data1.get(), count), 0);
+            }
+            randread(fsrc.get(), fz);
+        }
+    }
+    CompressOptions opt;
+    opt.raw_blocks = 1;
+    opt.frame_size = 64 << 10;
+    CompressArgs args(opt);
+    unique_ptr<IFile> fdst(lfs->open("verify.zfile", O_CREAT | O_TRUNC | O_RDWR, 0644));
+    EXPECT_NE(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+}
+
+TEST_F(ZFileTest, verify_once)
+{
+    unique_ptr<IFile> fsrc(lfs->open("verify.data", O_CREAT | O_TRUNC | O_RDWR, 0644));
+    // random blocks, stored raw so that the crc32 of the first one is at a
+    // known offset
+    int blk[1024];
+    for (int i = 0; i < 64; i++)
+    {
+        for (auto &x : blk)
+            x = rand();
+        fsrc->write(blk, sizeof(blk));
+    }
+    CompressOptions opt;
+    opt.verify = 1;
+    opt.raw_blocks = 1;
+    CompressArgs args(opt);
+    unique_ptr<IFile> fdst;
+    ASSERT_NO_FATAL_FAILURE(compress(fsrc.get(), fdst, args));
+
+    zfile_set_verify_once(true);
+    DEFER(zfile_set_verify_once(false));
+    IFile *fz = zfile_open_ro(fdst.get(), /*verify=*/true, false);
+    ASSERT_NE(fz, nullptr);
+    DEFER(delete fz);
+    char data0[4096], data1[4096];
+    ASSERT_EQ(fsrc->pread(data0, sizeof(data0), 0), (ssize_t)sizeof(data0));
+    ASSERT_EQ(fz->pread(data1, sizeof(data1), 0), (ssize_t)sizeof(data1));
+    ASSERT_EQ(memcmp(data0, data1, sizeof(data0)), 0);
+
+    // a block verified once isn't verified again, a wrong crc32 goes unnoticed
+    uint32_t crc = 0;
+    ASSERT_EQ(fdst->pwrite(&crc, sizeof(crc), CompressionFile::HeaderTrailer::SPACE + 4096),
+              (ssize_t)sizeof(crc));
+    memset(data1, 0, sizeof(data1));
+    ASSERT_EQ(fz->pread(data1, sizeof(data1), 0), (ssize_t)sizeof(data1));
+    ASSERT_EQ(memcmp(data0, data1, sizeof(data0)), 0);
+    randread(fsrc.get(), fz);
+}
+
+TEST_F(ZFileTest, block_cache)
+{
+    unique_ptr<IFile> fsrc, fdst;
+    ASSERT_NO_FATAL_FAILURE(compress_random(fsrc, fdst));
+
+    // small enough to be evicting all the time
+    zfile_set_block_cache_size(64 << 10);
+    DEFER(zfile_set_block_cache_size(0));
+    IFile *fz = zfile_open_ro(fdst.get(), /*verify=*/true, false);
+    ASSERT_NE(fz, nullptr);
+    DEFER(delete fz);
+    struct stat st;
+    fsrc->fstat(&st);
+    char data0[8192], data1[8192];
+    for (int i = 0; i < 20000; i++)
+    {
+        // sub-block and block-crossing reads, hot blocks being read repeatedly
+        off_t offset = (rand() % 256) * 4096 + rand() % 4096;
+        if (i % 4 == 0)
+            offset = rand() % (st.st_size - sizeof(data0));
+        size_t count = rand() % sizeof(data0) + 1;
+        ASSERT_EQ(fsrc->pread(data0, count, offset), (ssize_t)count);
+        ASSERT_EQ(fz->pread(data1, count, offset), (ssize_t)count);
+        ASSERT_EQ(memcmp(data0, data1, count), 0);
+    }
+}
+
+class CountingFile : public ForwardFile
+{
+public:
+    int npreads = 0;
+    CountingFile(IFile *file) : ForwardFile(file) {}
+    virtual ssize_t pread(void *buf, size_t count, off_t offset) override
+    {
+        npreads++;
+        return m_file->pread(buf, count, offset);
+    }
+};
+
+TEST_F(ZFileTest, readahead)
+{
+    unique_ptr<IFile> fsrc, fdst;
+    ASSERT_NO_FATAL_FAILURE(compress_random(fsrc, fdst));
+
+    CountingFile counting(fdst.get());
+    zfile_set_readahead_size(1 << 20);
+    DEFER(zfile_set_readahead_size(0));
+    IFile *fz = zfile_open_ro(&counting, /*verify=*/true, false);
+    ASSERT_NE(fz, nullptr);
+    DEFER(delete fz);
+    struct stat st;
+    fsrc->fstat(&st);
+
+    // a sequential scan, with a random read in between now and then
+    char data0[16384], data1[16384];
+    int nreads = 0;
+    counting.npreads = 0;
+    for (off_t offset = 0; offset < st.st_size; offset += sizeof(data0), nreads++)
+    {
+        ASSERT_EQ(fsrc->pread(data0, sizeof(data0), offset), (ssize_t)sizeof(data0));
+        ASSERT_EQ(fz->pread(data1, sizeof(data1), offset), (ssize_t)sizeof(data1));
+        ASSERT_EQ(memcmp(data0, data1, sizeof(data0)), 0);
+        if (nreads % 100 == 99)
+        {
+            off_t roffset = rand() % (st.st_size - 4096);
+            ASSERT_EQ(fsrc->pread(data0, 4096, roffset), 4096);
+            ASSERT_EQ(fz->pread(data1, 4096, roffset), 4096);
+            ASSERT_EQ(memcmp(data0, data1, 4096), 0);
+            // resume the scan where it was
+            fz->pread(data1, 1, offset + sizeof(data0) - 1);
+        }
+    }
+    LOG_INFO("` reads of the zfile, ` reads of the backing file", nreads, counting.npreads);
+    EXPECT_LT(counting.npreads, nreads / 4);
+}
+
+TEST_F(ZFileTest, lazy_jump_table)
+{
+    unique_ptr<IFile> fsrc, fdst;
+    ASSERT_NO_FATAL_FAILURE(compress_random(fsrc, fdst));
+
+    CountingFile counting(fdst.get());
+    zfile_set_lazy_jump_table(true);
+    DEFER(zfile_set_lazy_jump_table(false));
+    IFile *fz = zfile_open_ro(&counting, /*verify=*/true, false);
+    ASSERT_NE(fz, nullptr);
+    DEFER(delete fz);
+    // only the header and the trailer are read at open
+    EXPECT_EQ(counting.npreads, 2);
+    EXPECT_EQ(((CompressionFile *)fz)->m_jump_table.size(), 0UL);
+
+    struct stat st;
+    fsrc->fstat(&st);
+    char data0[16384], data1[16384];
+    for (int i = 0; i < 1000; i++)
+    {
+        off_t offset = rand() % (st.st_size - sizeof(data0));
+        ASSERT_EQ(fsrc->pread(data0, sizeof(data0), offset), (ssize_t)sizeof(data0));
+        ASSERT_EQ(fz->pread(data1, sizeof(data1), offset), (ssize_t)sizeof(data1));
+        ASSERT_EQ(memcmp(data0, data1, sizeof(data0)), 0);
+    }
+}
+
+// a cached file whose reads but those of the header come out zeroed while
+// `stale`, till it's evicted
+class StaleFile : public ForwardFile
+{
+public:
+    bool stale = false;
+    int nevicts = 0;
+    StaleFile(IFile *file) : ForwardFile(file) {}
+    virtual ssize_t pread(void *buf, size_t count, off_t offset) override
+    {
+        auto ret = m_file->pread(buf, count, offset);
+        if (stale && offset > 0 && ret > 0)
+            memset(buf, 0, ret);
+        return ret;
+    }
+    virtual int fallocate(int mode, off_t offset, off_t len) override
+    {
+        stale = false;
+        nevicts++;
+        return 0;
+    }
+};
+
+TEST_F(ZFileTest, lazy_jump_table_evict)
+{
+    unique_ptr<IFile> fsrc, fdst;
+    ASSERT_NO_FATAL_FAILURE(compress_random(fsrc, fdst));
+
+    // a bad index loaded lazily is evicted and loaded again, as at open
+    StaleFile file(fdst.get());
+    zfile_set_lazy_jump_table(true);
+    DEFER(zfile_set_lazy_jump_table(false));
+    IFile *fz = zfile_open_ro(&file, /*verify=*/true, false);
+    ASSERT_NE(fz, nullptr);
+    DEFER(delete fz);
+    file.stale = true;
+    char data0[4096], data1[4096];
+    ASSERT_EQ(fsrc->pread(data0, sizeof(data0), 0), (ssize_t)sizeof(data0));
+    ASSERT_EQ(fz->pread(data1, sizeof(data1), 0), (ssize_t)sizeof(data1));
+    ASSERT_EQ(memcmp(data0, data1, sizeof(data0)), 0);
+    EXPECT_EQ(file.nevicts, 1);
+
+    // or fails the read, if it can't be evicted
+    IFile *fz1 = zfile_open_ro(&file, /*verify=*/false, false);
+    ASSERT_NE(fz1, nullptr);
+    DEFER(delete fz1);
+    file.stale = true;
+    EXPECT_LT(fz1->pread(data1, sizeof(data1), 0), 0);
+    EXPECT_EQ(file.nevicts, 1);
+}
+
+// records the prefetches, i.e. the reads without buffer, it takes
+class HintedFile : public ForwardFile
+{
+public:
+    std::vector<std::pair<off_t, size_t>> hints;
+    HintedFile(IFile *file) : ForwardFile(file) {}
+    virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override
+    {
+        if (iovcnt == 1 && iov->iov_base == nullptr)
+        {
+            hints.emplace_back(offset, iov->iov_len);
+            return iov->iov_len;
+        }
+        return m_file->preadv(iov, iovcnt, offset);
+    }
+};
+
+TEST_F(ZFileTest, refill_hint)
+{
+    unique_ptr<IFile> fsrc, fdst;
+    ASSERT_NO_FATAL_FAILURE(compress_random(fsrc, fdst));
+
+    HintedFile hinted(fdst.get());
+    const int lookahead = 4;
+    IFile *fz = zfile_open_ro(&hinted, /*verify=*/true, false, -1, lookahead);
+    ASSERT_NE(fz, nullptr);
+    DEFER(delete fz);
+    auto &jump_table = ((CompressionFile *)fz)->m_jump_table;
+    auto block_size = ((CompressionFile *)fz)->m_ht.opt.block_size;
+    struct stat st;
+    fsrc->fstat(&st);
+
+    // a random read hints its whole blocks, and the lookahead following
+    char data0[16384], data1[16384];
+    for (int i = 0; i < 1000; i++)
+    {
+        off_t offset = rand() % (st.st_size - sizeof(data0));
+        size_t count = rand() % sizeof(data0) + 1;
+        auto nhints = hinted.hints.size();
+        ASSERT_EQ(fsrc->pread(data0, count, offset), (ssize_t)count);
+        ASSERT_EQ(fz->pread(data1, count, offset), (ssize_t)count);
+        ASSERT_EQ(memcmp(data0, data1, count), 0);
+        if (hinted.hints.size() == nhints)
+            continue;
+        size_t begin = offset / block_size;
+        size_t end = std::min((offset + count - 1) / block_size + 1 + lookahead,
+                              jump_table.size() - 1);
+        EXPECT_EQ(hinted.hints.back().first, jump_table[begin]);
+        EXPECT_EQ(hinted.hints.back().second, (size_t)(jump_table[end] - jump_table[begin]));
+    }
+
+    // a sequential scan hints once per lookahead
+    hinted.hints.clear();
+    for (off_t offset = 0; offset + 4096 <= st.st_size; offset += 4096)
+    {
+        ASSERT_EQ(fz->pread(data1, 4096, offset), 4096);
+    }
+    auto nblocks = jump_table.size() - 1;
+    LOG_INFO("` blocks scanned with ` hints", nblocks, hinted.hints.size());
+    EXPECT_LE(hinted.hints.size(), nblocks / lookahead + 1);
+
+    // a read without buffer is passed on as one of its compressed blocks
+    hinted.hints.clear();
+    ASSERT_EQ(fz->pread(nullptr, 3 * block_size, block_size / 2), (ssize_t)(3 * block_size));
+    ASSERT_EQ(hinted.hints.size(), 1UL);
+    EXPECT_EQ(hinted.hints[0].first, jump_table[0]);
+    EXPECT_EQ(hinted.hints[0].second, (size_t)(jump_table[4] - jump_table[0]));
+    // or done at once without hints
+    IFile *fz1 = zfile_open_ro(&hinted, /*verify=*/true, false);
+    ASSERT_NE(fz1, nullptr);
+    DEFER(delete fz1);
+    ASSERT_EQ(fz1->pread(nullptr, 3 * block_size, block_size / 2), (ssize_t)(3 * block_size));
+    EXPECT_EQ(hinted.hints.size(), 1UL);
+}
+
+TEST_F(ZFileTest, parallel_decompress)
+{
+    unique_ptr<IFile> fsrc, fdst;
+    ASSERT_NO_FATAL_FAILURE(compress_random(fsrc, fdst));
+
+    zfile_set_decompress_threads(4);
+    zfile_set_block_cache_size(64 << 10);
+    DEFER({
+        zfile_set_decompress_threads(0);
+        zfile_set_block_cache_size(0);
+    });
+    IFile *fz = zfile_open_ro(fdst.get(), /*verify=*/true, false);
+    ASSERT_NE(fz, nullptr);
+    DEFER(delete fz);
+    struct stat st;
+    fsrc->fstat(&st);
+    const size_t MAX_COUNT = 1 << 20;
+    auto data0 = unique_ptr<char[]>(new char[MAX_COUNT]);
+    auto data1 = unique_ptr<char[]>(new char[MAX_COUNT]);
+    for (int i = 0; i < 1000; i++)
+    {
+        // aligned and unaligned reads of up to 1MB
+        size_t count = rand() % MAX_COUNT + 1;
+        off_t offset = rand() % (st.st_size - count);
+        if (i % 2 == 0)
+        {
+            count = count / 4096 * 4096 + 4096;
+            offset = offset / 4096 * 4096;
+        }
+        ASSERT_EQ(fsrc->pread(data0.get(), count, offset), (ssize_t)count);
+        ASSERT_EQ(fz->pread(data1.get(), count, offset), (ssize_t)count);
+        ASSERT_EQ(memcmp(data0.get(), data1.get(), count), 0);
+    }
+}
+
+TEST_F(ZFileTest, preadv)
+{
+    unique_ptr<IFile> fsrc, fdst;
+    ASSERT_NO_FATAL_FAILURE(compress_random(fsrc, fdst));
+    IFile *fz = zfile_open_ro(fdst.get(), /*verify=*/true, false);
+    ASSERT_NE(fz, nullptr);
+    DEFER(delete fz);
+    struct stat st;
+    fsrc->fstat(&st);
+
+    const size_t MAX_COUNT = 256 << 10;
+    auto data0 = unique_ptr<char[]>(new char[MAX_COUNT]);
+    auto data1 = unique_ptr<char[]>(new char[MAX_COUNT]);
+    for (int i = 0; i < 1000; i++)
+    {
+        // iovecs of random lengths, some of them empty, some splitting blocks
+        struct iovec iov[16];
+        int iovcnt = rand() % 16 + 1;
+        size_t count = 0;
+        for (int j = 0; j < iovcnt; j++)
+        {
+            size_t len = (rand() % 3 == 0) ? (rand() % 4 + 1) * 4096 : rand() % 10000;
+            len = std::min(len, MAX_COUNT - count);
+            iov[j] = {data1.get() + count, len};
+            count += len;
+        }
+        off_t offset = rand() % (st.st_size - count);
+        if (i % 2 == 0)
+            offset = offset / 4096 * 4096;
+        ASSERT_EQ(fsrc->pread(data0.get(), count, offset), (ssize_t)count);
+        memset(data1.get(), 0, count);
+        ASSERT_EQ(fz->preadv(iov, iovcnt, offset), (ssize_t)count);
+        ASSERT_EQ(memcmp(data0.get(), data1.get(), count), 0);
+    }
+}
+
 TEST_F(ZFileTest, verify_compression)
 {
     // log_output_level = 1;
@@ -216,6 +737,86 @@ TEST_F(ZFileTest, verify_compression)
     }
 }
 
+TEST_F(ZFileTest, parallel_compress)
+{
+    auto fn_parallel = "verify.zlz4.p";
+    CompressOptions opt;
+    opt.verify = 1;
+    CompressArgs args(opt);
+    unique_ptr<IFile> fsrc, fserial;
+    ASSERT_NO_FATAL_FAILURE(compress_random(fsrc, fserial, args));
+    unique_ptr<IFile> fparallel(lfs->open(fn_parallel, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    args.workers = 4;
+    EXPECT_EQ(zfile_compress(fsrc.get(), fparallel.get(), &args), 0);
+
+    // the output, jump table included, doesn't depend on the number of workers
+    struct stat st0, st1;
+    fserial->fstat(&st0);
+    fparallel->fstat(&st1);
+    ASSERT_EQ(st0.st_size, st1.st_size);
+    char data0[16384], data1[16384];
+    for (off_t i = 0; i < st0.st_size; i += sizeof(data0))
+    {
+        auto n = fserial->pread(data0, sizeof(data0), i);
+        EXPECT_EQ(fparallel->pread(data1, sizeof(data1), i), n);
+        ASSERT_EQ(memcmp(data0, data1, n), 0);
+    }
+
+    IFile *fz = zfile_open_ro(fparallel.get(), /*verify=*/true, false);
+    ASSERT_NE(fz, nullptr);
+    DEFER(delete fz);
+    seqread(fsrc.get(), fz);
+}
+
+TEST_F(ZFileTest, parallel_extract)
+{
+    auto fn_dec = "verify.data.0";
+    unique_ptr<IFile> fsrc(lfs->open("verify.data", O_CREAT | O_TRUNC | O_RDWR, 0644));
+    randwrite(fsrc.get(), write_times);
+    // a tail of a partial block and page
+    char tail[1000];
+    memset(tail, 'x', sizeof(tail));
+    fsrc->write(tail, sizeof(tail));
+    struct stat st;
+    fsrc->fstat(&st);
+
+    for (auto frame_size : {0, 64 << 10})
+    {
+        CompressOptions opt(frame_size ? CompressOptions::ZSTD : CompressOptions::LZ4);
+        opt.verify = 1;
+        opt.frame_size = frame_size;
+        CompressArgs args(opt);
+        unique_ptr<IFile> fdst;
+        ASSERT_NO_FATAL_FAILURE(compress(fsrc.get(), fdst, args));
+        unique_ptr<IFile> fdec(lfs->open(fn_dec, O_CREAT | O_TRUNC | O_RDWR, 0644));
+        // the jump table is loaded first, if it's loaded lazily
+        zfile_set_lazy_jump_table(true);
+        DEFER(zfile_set_lazy_jump_table(false));
+        ASSERT_EQ(zfile_decompress_parallel(fdst.get(), fdec.get(), 4), st.st_size);
+
+        struct stat st_dec;
+        fdec->fstat(&st_dec);
+        ASSERT_EQ(st_dec.st_size, st.st_size);
+        char data0[16384], data1[16384];
+        for (off_t i = 0; i < st.st_size; i += sizeof(data0))
+        {
+            auto n = fsrc->pread(data0, sizeof(data0), i);
+            ASSERT_EQ(fdec->pread(data1, sizeof(data1), i), n);
+            ASSERT_EQ(memcmp(data0, data1, n), 0);
+        }
+
+        // a corrupted block fails the extraction
+        char c;
+        off_t pos = CompressionFile::HeaderTrailer::SPACE + 100;
+        fdst->pread(&c, 1, pos);
+        c ^= 0xff;
+        fdst->pwrite(&c, 1, pos);
+        fdec.reset(lfs->open(fn_dec, O_CREAT | O_TRUNC | O_RDWR, 0644));
+        EXPECT_LT(zfile_decompress_parallel(fdst.get(), fdec.get(), 4), 0);
+        EXPECT_EQ(errno, ECHECKSUM);
+    }
+}
+
 TEST_F(ZFileTest, checksum)
 {
     // log_output_level = 0;
@@ -256,6 +857,92 @@ TEST_F(ZFileTest, checksum)
     }
 }
 
+TEST_F(ZFileTest, append)
+{
+    auto fn = "append.zlz4";
+    DEFER(lfs->unlink(fn));
+    auto file = lfs->open(fn, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    ASSERT_NE(nullptr, file);
+    unique_ptr<IFile> fz(zfile_open_append(file, true, nullptr, true));
+    ASSERT_NE(nullptr, fz);
+    EXPECT_EQ(1, is_zfile_append(file));
+
+    const size_t SIZE = 1024 * 1024, CHUNK = 96 * 1024;
+    vector<char> plain(SIZE);
+    for (size_t i = 0; i < SIZE; i++)
+        plain[i] = "overlaybd"[i % 9] + i / 4096 % 7;
+    // written out of order, in chunks across units
+    for (size_t off = SIZE / 2; off < SIZE; off += CHUNK)
+    {
+        auto len = std::min(CHUNK, SIZE - off);
+        ASSERT_EQ((ssize_t)len, fz->pwrite(&plain[off], len, off));
+    }
+    for (size_t off = 0; off < SIZE / 2; off += CHUNK)
+    {
+        auto len = std::min(CHUNK, SIZE / 2 - off);
+        ASSERT_EQ((ssize_t)len, fz->pwrite(&plain[off], len, off));
+    }
+    // a range written again in the middle of units
+    memset(&plain[100 * 1024], 0xcc, 64 * 1024);
+    ASSERT_EQ(64 * 1024, fz->pwrite(&plain[100 * 1024], 64 * 1024, 100 * 1024));
+
+    auto verify = [&](IFile *f) {
+        struct stat st;
+        EXPECT_EQ(0, f->fstat(&st));
+        EXPECT_EQ((off_t)SIZE, st.st_size);
+        vector<char> buf(SIZE);
+        EXPECT_EQ((ssize_t)SIZE, f->pread(buf.data(), SIZE, 0));
+        EXPECT_EQ(0, memcmp(plain.data(), buf.data(), SIZE));
+        for (int i = 0; i < 1000; i++)
+        {
+            size_t off = rand() % SIZE, len = rand() % 16384 + 1;
+            len = std::min(len, SIZE - off);
+            EXPECT_EQ((ssize_t)len, f->pread(buf.data(), len, off));
+            EXPECT_EQ(0, memcmp(&plain[off], buf.data(), len));
+        }
+    };
+    verify(fz.get());
+    fz.reset();
+
+    // the units are loaded, skipping a torn one at the end
+    file = lfs->open(fn, O_RDWR);
+    ASSERT_NE(nullptr, file);
+    struct stat st;
+    EXPECT_EQ(0, file->fstat(&st));
+    EXPECT_LT(st.st_size, (off_t)SIZE / 4);
+    char torn[1024];
+    memset(torn, 0x5a, sizeof(torn));
+    EXPECT_EQ((ssize_t)sizeof(torn), file->pwrite(torn, sizeof(torn), st.st_size));
+    fz.reset(zfile_open_append(file, false, nullptr, true));
+    ASSERT_NE(nullptr, fz);
+    verify(fz.get());
+    memset(&plain[SIZE - 4096], 0xdd, 4096);
+    ASSERT_EQ(4096, fz->pwrite(&plain[SIZE - 4096], 4096, SIZE - 4096));
+    fz.reset();
+    fz.reset(zfile_open_append(lfs->open(fn, O_RDWR), false, nullptr, true));
+    ASSERT_NE(nullptr, fz);
+    verify(fz.get());
+}
+
+TEST(CRC32C, interleaved)
+{
+    std::vector<uint8_t> buf(65536 + 8);
+    for (auto &c : buf)
+        c = rand();
+    size_t lens[] = {0, 1, 7, 8, 9, 255, 767, 768, 769, 4096, 4100,
+                     6143, 6144, 6145, 12288 + 771, 65536};
+    for (auto len : lens) {
+        for (size_t off = 0; off < 8; off++) {
+            uint32_t init = rand();
+            auto p = buf.data() + off;
+            auto expected = crc32::testing::crc32c_slow(p, len, init);
+            EXPECT_EQ(crc32::testing::crc32c_fast(p, len, init), expected);
+            EXPECT_EQ(crc32::testing::crc32c_interleaved(p, len, init), expected);
+            EXPECT_EQ(crc32::crc32c_extend(p, len, init), expected);
+        }
+    }
+}
+
 
 
 
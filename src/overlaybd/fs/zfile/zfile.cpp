@@ -23,11 +23,28 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <time.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <zdict.h>
 #include "../virtual-file.h"
 #include "../../utility.h"
 #include "../../uuid.h"
 #include "crc32/crc32c.h"
 #include "../forwardfs.h"
+#include "../../iovector.h"
+#include "../../memory.h"
+#include "../../metrics.h"
+#include "../../trace.h"
+#include "../cache/policy/lru.h"
+#include "../../photon/thread.h"
+#include "../../photon/thread11.h"
+#include "../../photon/syncio/fd-events.h"
 
 using namespace FileSystem;
 
@@ -41,7 +58,408 @@ uint64_t zfile_blk_cnt = 0;
 namespace ZFile
 {
 
+    static Metrics::Histogram *decompress_latency()
+    {
+        static auto h = Metrics::histogram("overlaybd_zfile_decompress_seconds",
+                                           "Time of decompressing a block");
+        return h;
+    }
+
+    static Metrics::Counter *checksum_failures()
+    {
+        static auto c = Metrics::counter("overlaybd_zfile_checksum_failures_total",
+                                         "Blocks failing the crc32c verification");
+        return c;
+    }
+
+    // photon::now is not updated while a block is decompressed, so the
+    // time is taken by the monotonic clock
+    class DecompressTimer
+    {
+    public:
+        DecompressTimer() : m_start(clock_us()) {}
+        ~DecompressTimer()
+        {
+            decompress_latency()->observe(clock_us() - m_start);
+        }
+
+    protected:
+        uint64_t m_start;
+        static uint64_t clock_us()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+        }
+    };
+
+    // memory budget of the block cache of each zfile opened, see zfile_set_block_cache_size()
+    static size_t block_cache_size = 0;
+
+    void zfile_set_block_cache_size(size_t bytes)
+    {
+        block_cache_size = bytes;
+    }
+
+    // max readahead window of each zfile opened, see zfile_set_readahead_size()
+    static size_t readahead_size = 0;
+
+    void zfile_set_readahead_size(size_t bytes)
+    {
+        readahead_size = bytes;
+    }
+
+    // whether the jump table of each zfile opened is loaded on its first
+    // read rather than at open, see zfile_set_lazy_jump_table()
+    static bool lazy_jump_table = false;
+
+    void zfile_set_lazy_jump_table(bool lazy)
+    {
+        lazy_jump_table = lazy;
+    }
+
+    // whether the crc32 of each block of a zfile opened is verified only on
+    // its first read, see zfile_set_verify_once()
+    static bool verify_once = false;
+
+    void zfile_set_verify_once(bool once)
+    {
+        verify_once = once;
+    }
+
+    // A bit per block, set once its crc32 has been verified. Bits are set
+    // by the DecompressPool threads as well, hence atomic.
+    class VerifiedBlocks
+    {
+    public:
+        explicit VerifiedBlocks(size_t nblocks)
+            : m_bits(new std::atomic<uint64_t>[(nblocks + 63) / 64]())
+        {
+        }
+        bool test(size_t idx) const
+        {
+            return m_bits[idx / 64].load(std::memory_order_relaxed) & (1ULL << (idx % 64));
+        }
+        void set(size_t idx)
+        {
+            m_bits[idx / 64].fetch_or(1ULL << (idx % 64), std::memory_order_relaxed);
+        }
+
+    private:
+        std::unique_ptr<std::atomic<uint64_t>[]> m_bits;
+    };
+
+    // A cache of decompressed blocks, keyed by block index, so that sub-block
+    // reads of a hot block cost a memcpy rather than a decompression. Blocks
+    // are spread over shards by index, each with its own lock and LRU. Over
+    // the shedding mark of the node, a block put frees the least recently
+    // used one instead of being cached, so that the cache shrinks.
+    class BlockCache
+    {
+    public:
+        const static size_t NSHARD = 8;
+
+        BlockCache(size_t budget, uint32_t block_size) : m_block_size(block_size)
+        {
+            m_shard_capacity = std::max(budget / block_size / NSHARD, (size_t)1);
+        }
+
+        // copy [offset, offset + count) of block `idx` into `buf` if it is cached
+        bool get(uint32_t idx, void *buf, size_t offset, size_t count)
+        {
+            auto &shard = m_shards[idx % NSHARD];
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            auto it = shard.blocks.find(idx);
+            if (it == shard.blocks.end())
+                return false;
+            shard.lru.access(it->second.lru_key);
+            memcpy(buf, it->second.data.get() + offset, count);
+            return true;
+        }
+
+        void put(uint32_t idx, const unsigned char *data)
+        {
+            auto &shard = m_shards[idx % NSHARD];
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            if (shard.blocks.find(idx) != shard.blocks.end())
+                return;
+            if (Memory::shedding())
+            {
+                if (!shard.blocks.empty())
+                {
+                    pop_lru(shard);
+                    m_account.sub(m_block_size);
+                }
+                return;
+            }
+            std::unique_ptr<unsigned char[]> buf;
+            if (shard.blocks.size() >= m_shard_capacity)
+            {
+                // recycle the buffer of the least recently used block
+                buf = pop_lru(shard);
+            }
+            else
+            {
+                buf.reset(new unsigned char[m_block_size]);
+                m_account.add(m_block_size);
+            }
+            memcpy(buf.get(), data, m_block_size);
+            auto key = shard.lru.push_front(idx);
+            shard.blocks.emplace(idx, Entry{key, std::move(buf)});
+        }
+
+    protected:
+        struct Entry
+        {
+            uint32_t lru_key;
+            std::unique_ptr<unsigned char[]> data;
+        };
+        struct Shard
+        {
+            std::mutex mtx;
+            FileSystem::LRU<uint32_t, uint32_t> lru;
+            std::unordered_map<uint32_t, Entry> blocks;
+        } m_shards[NSHARD];
+        uint32_t m_block_size;
+        size_t m_shard_capacity;
+        Memory::Account m_account{"zfile_block_cache"};
+
+        // remove the least recently used block, returning its buffer
+        std::unique_ptr<unsigned char[]> pop_lru(Shard &shard)
+        {
+            auto victim = shard.blocks.find(shard.lru.back());
+            auto buf = std::move(victim->second.data);
+            shard.blocks.erase(victim);
+            shard.lru.pop_back();
+            return buf;
+        }
+    };
+
+    // Detects sequential reads of a zfile, and fetches the compressed data
+    // that follows them from the backing file in background photon threads.
+    // Two buffers take turns, so one can be consumed while the other one is
+    // being filled. The window starts at MAX_READ_SIZE, and doubles on every
+    // fetch of a sequential stream, up to `max_window`.
+    class Readahead
+    {
+    public:
+        Readahead(IFile *file, size_t max_window, off_t data_end)
+            : m_file(file), m_max_window(std::max(max_window, MAX_READ_SIZE)),
+              m_data_end(data_end)
+        {
+        }
+
+        ~Readahead()
+        {
+            while (m_bufs[0].inflight || m_bufs[1].inflight)
+                m_cond.wait_no_lock();
+        }
+
+        // read compressed data, from a readahead buffer if one covers it
+        ssize_t pread(void *buf, size_t count, off_t offset)
+        {
+        again:
+            for (auto &b : m_bufs)
+            {
+                if (b.begin > offset || offset + (off_t)count > b.end)
+                    continue;
+                if (b.inflight)
+                {
+                    m_cond.wait_no_lock();
+                    goto again;
+                }
+                if (!b.valid)
+                    break;
+                memcpy(buf, b.data.get() + (offset - b.begin), count);
+                return count;
+            }
+            return m_file->pread(buf, count, offset);
+        }
+
+        // called for each read of raw data [offset, offset + count), which
+        // maps to compressed data ending at `cend`
+        void access(off_t offset, size_t count, off_t cend)
+        {
+            bool sequential = (offset == m_next);
+            m_next = offset + count;
+            if (!sequential)
+            {
+                m_window = MAX_READ_SIZE;
+                return;
+            }
+
+            // fetch ahead once less than half a window is left
+            off_t ahead = cend;
+            for (auto &b : m_bufs)
+            {
+                if (b.begin <= cend && b.end > ahead)
+                    ahead = b.end;
+            }
+            if (ahead >= m_data_end || ahead - cend > (off_t)m_window / 2)
+                return;
+
+            // recycle a buffer that is idle and behind the stream
+            Buffer *b = nullptr;
+            for (auto &x : m_bufs)
+            {
+                if (!x.inflight && (x.end <= cend || x.begin > ahead))
+                    b = &x;
+            }
+            if (b == nullptr)
+                return;
+            if (b->capacity < m_window)
+            {
+                b->data.reset(new unsigned char[m_window]);
+                b->capacity = m_window;
+            }
+            b->begin = ahead;
+            b->end = std::min(ahead + (off_t)m_window, m_data_end);
+            b->valid = false;
+            b->inflight = true;
+            LOG_DEBUG("readahead [`, `)", b->begin, b->end);
+            m_window = std::min(m_window * 2, m_max_window);
+            photon::thread_create11(&Readahead::fetch, this, b);
+        }
+
+    protected:
+        struct Buffer
+        {
+            std::unique_ptr<unsigned char[]> data;
+            size_t capacity = 0;
+            off_t begin = 0, end = 0;
+            bool valid = false;
+            bool inflight = false;
+        } m_bufs[2];
+        IFile *m_file;
+        size_t m_max_window;
+        size_t m_window = MAX_READ_SIZE;
+        off_t m_data_end;
+        off_t m_next = -1;
+        photon::condition_variable m_cond;
+
+        void fetch(Buffer *b)
+        {
+            auto count = b->end - b->begin;
+            auto ret = m_file->pread(b->data.get(), count, b->begin);
+            if (ret != count)
+                LOG_WARN("readahead [`, `) failed, ret: `, errno: `", b->begin, b->end, ret, errno);
+            b->valid = (ret == count);
+            b->inflight = false;
+            m_cond.notify_all();
+        }
+    };
+
+    // A pool of OS threads that decompress the blocks of large reads, so that
+    // they neither run serially nor keep the photon vcpu of the reader busy.
+    // The reader sleeps until the last of its tasks wakes it up with
+    // safe_thread_interrupt(), which is why the pool requires photon.
+    class DecompressPool
+    {
+    public:
+        // errno of the wakeup sent to the reader, as in aio-wrapper.cpp
+        const static int EOK = ENXIO;
+
+        DecompressPool(int nthreads)
+        {
+            for (int i = 0; i < nthreads; i++)
+                m_threads.emplace_back(&DecompressPool::worker, this);
+        }
+
+        ~DecompressPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                m_stop = true;
+            }
+            m_cv.notify_all();
+            for (auto &th : m_threads)
+                th.join();
+        }
+
+        size_t size() const
+        {
+            return m_threads.size();
+        }
+
+        // run `tasks` on the pool, and sleep until all of them are done;
+        // returns -1 with errno of a failed task, if any
+        int run(std::vector<std::function<int()>> &tasks)
+        {
+            Batch batch;
+            batch.remaining = tasks.size();
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                for (auto &t : tasks)
+                    m_queue.push_back({&t, &batch});
+            }
+            m_cv.notify_all();
+        again:
+            photon::thread_usleep(-1);
+            ERRNO e;
+            if (e.no != EOK)
+                goto again;
+            if (batch.eno != 0)
+            {
+                errno = batch.eno;
+                return -1;
+            }
+            return 0;
+        }
+
+    protected:
+        struct Batch
+        {
+            std::atomic<size_t> remaining{0};
+            std::atomic<int> eno{0};
+            photon::thread *th = photon::CURRENT;
+        };
+        struct Job
+        {
+            std::function<int()> *task;
+            Batch *batch;
+        };
+        std::mutex m_mtx;
+        std::condition_variable m_cv;
+        std::deque<Job> m_queue;
+        std::vector<std::thread> m_threads;
+        bool m_stop = false;
+
+        void worker()
+        {
+            while (true)
+            {
+                Job job;
+                {
+                    std::unique_lock<std::mutex> lock(m_mtx);
+                    m_cv.wait(lock, [&] { return m_stop || !m_queue.empty(); });
+                    if (m_stop)
+                        return;
+                    job = m_queue.front();
+                    m_queue.pop_front();
+                }
+                if ((*job.task)() < 0)
+                {
+                    int expected = 0;
+                    job.batch->eno.compare_exchange_strong(expected, errno ? errno : EIO);
+                }
+                auto th = job.batch->th;
+                if (job.batch->remaining.fetch_sub(1) == 1)
+                    photon::safe_thread_interrupt(th, EOK, 0);
+            }
+        }
+    };
+
+    static std::unique_ptr<DecompressPool> decompress_pool;
+
+    void zfile_set_decompress_threads(int nthreads)
+    {
+        decompress_pool.reset(nthreads > 0 ? new DecompressPool(nthreads) : nullptr);
+    }
+
     const static size_t BUF_SIZE = 512;
+    // independent blocks compressed in a batch
+    const static size_t BATCH_BLOCKS = 16;
+    const static size_t MAX_FRAME_SIZE = 1 << 20;
     const static uint32_t NOI_WELL_KNOWN_PRIME = 100007;
 
     template <typename T>
@@ -93,6 +511,7 @@ namespace ZFile
             static const uint32_t FLAG_SHIFT_HEADER = 0; // 1:header     0:trailer
             static const uint32_t FLAG_SHIFT_TYPE = 1;   // 1:data file, 0:index file
             static const uint32_t FLAG_SHIFT_SEALED = 2; // 1:YES,       0:NO
+            static const uint32_t FLAG_SHIFT_RAW_BLOCKS = 3; // 1:incompressible blocks stored raw
 
             uint32_t get_flag_bit(uint32_t shift) const { return flags & (1 << shift); }
             void set_flag_bit(uint32_t shift) { flags |= (1 << shift); }
@@ -109,7 +528,14 @@ namespace ZFile
             void set_sealed() { set_flag_bit(FLAG_SHIFT_SEALED); }
             void clr_sealed() { clr_flag_bit(FLAG_SHIFT_SEALED); }
 
-            void set_compress_option(const CompressOptions &opt) { this->opt = opt; }
+            void set_compress_option(const CompressOptions &opt)
+            {
+                this->opt = opt;
+                if (opt.raw_blocks)
+                    set_flag_bit(FLAG_SHIFT_RAW_BLOCKS);
+                else
+                    clr_flag_bit(FLAG_SHIFT_RAW_BLOCKS);
+            }
 
             // offset 32, 40, 48
             uint64_t index_offset; // in bytes
@@ -146,6 +572,12 @@ namespace ZFile
                 return deltas.size();
             }
 
+            size_t memory() const
+            {
+                return deltas.capacity() * sizeof(deltas[0]) +
+                       partial_offset.capacity() * sizeof(partial_offset[0]);
+            }
+
             int build(const uint32_t *ibuf, size_t n, off_t offset_begin)
             {
                 int part_size = DEFAULT_PART_SIZE;
@@ -179,11 +611,26 @@ namespace ZFile
             }
 
         } m_jump_table;
+        bool m_jump_table_loaded = false;
+        // the source is evicted and read again on a bad index, if opened to verify
+        bool m_evict_bad_index = false;
+        Memory::Account m_jump_table_account{"zfile_jump_table"};
+        photon::mutex m_jump_table_mutex;
 
         HeaderTrailer m_ht;
         IFile *m_file = nullptr;
         std::unique_ptr<ICompressor> m_compressor;
+        std::unique_ptr<BlockCache> m_cache;
+        std::unique_ptr<Readahead> m_readahead;
+        // blocks verified already, if verified once, see zfile_set_verify_once()
+        std::unique_ptr<VerifiedBlocks> m_verified;
+        // blocks following a read also hinted to m_file, see zfile_open_ro(),
+        // or -1 for no hints; later reads within the range hinted last skip
+        int m_refill_lookahead = -1;
+        off_t m_hinted_begin = 0, m_hinted_end = 0;
         bool m_ownership = false;
+        // reads of at least this # of blocks decompress on the DecompressPool
+        const static size_t MIN_PARALLEL_BLOCKS = 8;
         bool valid = false;
 
         CompressionFile(IFile *file, bool ownership) : m_file(file),
@@ -191,6 +638,8 @@ namespace ZFile
 
         ~CompressionFile()
         {
+            // in-flight readaheads are still using m_file
+            m_readahead.reset();
             if (m_ownership)
             {
                 delete m_file;
@@ -259,7 +708,7 @@ namespace ZFile
                 auto begin_offset = m_zfile->m_jump_table[begin];
                 LOG_DEBUG("block idx: [`, `), start_offset: `, read_size: `",
                           begin, end, begin_offset, read_size);
-                auto readn = m_zfile->m_file->pread(m_buf, read_size, begin_offset);
+                auto readn = m_zfile->read_compressed(m_buf, read_size, begin_offset);
                 if (readn != (ssize_t)read_size)
                 {
                     LOG_ERRNO_RETURN(0, -1, "read compressed blocks failed. (offset: `, len: `)",
@@ -428,78 +877,475 @@ namespace ZFile
             unsigned char m_buf[MAX_READ_SIZE]; //{};
         };
 
-        virtual ssize_t pread(void *buf, size_t count, off_t offset) override
+        // prefetch, by a read without buffer, the whole compressed blocks
+        // of a read, plus the lookahead, so that a cache below refills them
+        // at once, rather than missing again on the tail of a block
+        void hint_refill(off_t offset, size_t count)
         {
-            if (!valid)
+            auto block_size = m_ht.opt.block_size;
+            size_t begin = offset / block_size;
+            size_t end = (offset + count - 1) / block_size + 1;
+            off_t cbegin = m_jump_table[begin];
+            if (cbegin >= m_hinted_begin && m_jump_table[end] <= m_hinted_end)
+                return;
+            end = std::min(end + m_refill_lookahead, m_jump_table.size() - 1);
+            off_t cend = m_jump_table[end];
+            m_hinted_begin = cbegin;
+            m_hinted_end = cend;
+            struct iovec iov{nullptr, (size_t)(cend - cbegin)};
+            if (m_file->preadv(&iov, 1, cbegin) < 0)
+                LOG_DEBUG("refill hint [`, `) failed, errno: `", cbegin, cend, errno);
+        }
+
+        // a read without buffer is a prefetch, passed on as one of the
+        // compressed blocks of the range if m_file takes prefetches, see
+        // zfile_open_ro(), or else done with nothing to prefetch
+        ssize_t prefetch(size_t count, off_t offset)
+        {
+            if (m_refill_lookahead < 0)
+                return count;
+            auto block_size = m_ht.opt.block_size;
+            off_t cbegin = m_jump_table[offset / block_size];
+            off_t cend = m_jump_table[(offset + count - 1) / block_size + 1];
+            struct iovec iov{nullptr, (size_t)(cend - cbegin)};
+            if (m_file->preadv(&iov, 1, cbegin) < 0)
+                LOG_ERRNO_RETURN(0, -1, "failed to prefetch [`, `) of compressed data", cbegin, cend);
+            return count;
+        }
+
+        ssize_t read_compressed(void *buf, size_t count, off_t offset) const
+        {
+            if (m_readahead)
+                return m_readahead->pread(buf, count, offset);
+            return m_file->pread(buf, count, offset);
+        }
+
+        // decompress block `idx` of `len` bytes (crc32 excluded) into `dst`,
+        // or copy it if it was stored raw, i.e. `len` is its plain length
+        // whether the crc32 of block `idx` is to be checked by this read
+        bool to_verify(size_t idx) const
+        {
+            return m_ht.opt.verify && !(m_verified && m_verified->test(idx));
+        }
+        void verified(size_t idx)
+        {
+            if (m_verified)
+                m_verified->set(idx);
+        }
+
+        int decompress_block(size_t idx, const unsigned char *src, size_t len,
+                             unsigned char *dst)
+        {
+            uint64_t block_size = m_ht.opt.block_size;
+            if (m_ht.opt.raw_blocks &&
+                len == std::min(block_size, m_ht.raw_data_size - idx * block_size))
             {
-                LOG_ERROR_RETURN(EBADF, -1, "object invalid.");
+                memcpy(dst, src, len);
+                return len;
             }
-            if (m_ht.opt.block_size > MAX_READ_SIZE)
+            DecompressTimer timer;
+            return m_compressor->decompress(src, len, dst, block_size);
+        }
+
+        // decompress the blocks of a read on the DecompressPool, each full block
+        // straight into its place in `buf`, the partial head and tail blocks
+        // through raw buffers (and the block cache)
+        ssize_t pread_parallel(void *buf, size_t count, off_t offset)
+        {
+            const static size_t MIN_BLOCKS_PER_TASK = 4;
+            size_t block_size = m_ht.opt.block_size;
+            size_t begin = offset / block_size, end = (offset + count - 1) / block_size + 1;
+            off_t cbegin = m_jump_table[begin];
+            size_t clen = m_jump_table[end] - cbegin;
+            auto cbuf = std::unique_ptr<unsigned char[]>(new unsigned char[clen]);
+            if (read_compressed(cbuf.get(), clen, cbegin) != (ssize_t)clen)
             {
-                LOG_ERROR_RETURN(ENOMEM, -1, "block_size: ` > MAX_READ_SIZE (`)",
-                                 m_ht.opt.block_size, MAX_READ_SIZE);
+                LOG_ERRNO_RETURN(0, -1, "read compressed blocks failed. (offset: `, len: `)",
+                                 cbegin, clen);
             }
-            if (count == 0)
-                return 0;
-            assert(offset + count <= m_ht.raw_data_size);
-            ssize_t readn = 0; // final will equal to count
-            auto start_addr = buf;
-            unsigned char raw[MAX_READ_SIZE];
-            for (auto &block : BlockReader(this, offset, count))
-            {
+
+            auto decode = [&](size_t idx, unsigned char *dst) -> int {
+                auto src = cbuf.get() + (m_jump_table[idx] - cbegin);
+                size_t len = m_jump_table[idx + 1] - m_jump_table[idx];
                 if (m_ht.opt.verify)
+                    len -= sizeof(uint32_t);
+                if (to_verify(idx))
                 {
-                    int retry = 2;
-                again:
-                    auto c = crc32c((void *)block.buffer(), block.compressed_size);
-                    if (c != block.crc32_code())
+                    if (crc32c(src, len) != *(uint32_t *)(src + len))
                     {
-                        if (retry--) {
-                            int reload_res = block.reload();
-                            LOG_ERROR("checksum failed {offset: `, length: `} (expected ` but got `), reload result: `",
-                                            block.m_reader->m_buf_offset, block.compressed_size, block.crc32_code(), c, reload_res);
-                            if (reload_res < 0) {
-                                LOG_ERROR_RETURN(ECHECKSUM, -1, "checksum verification and reload failed");
+                        checksum_failures()->inc();
+                        errno = ECHECKSUM;
+                        return -1;
+                    }
+                    verified(idx);
+                }
+                return decompress_block(idx, src, len, dst);
+            };
+
+            // copy range of block `idx`, relative to `offset`
+            auto range = [&](size_t idx, size_t &cp_begin, size_t &cp_end) {
+                cp_begin = std::max((off_t)(idx * block_size), offset) - offset;
+                cp_end = std::min((off_t)((idx + 1) * block_size), (off_t)(offset + count)) - offset;
+            };
+
+            auto raw = std::unique_ptr<unsigned char[]>(new unsigned char[block_size * 2]);
+            unsigned char *partial[2] = {nullptr, nullptr};
+            size_t nfull_begin = begin, nfull_end = end;
+            for (int i = 0; i < 2; i++)
+            {
+                size_t idx = (i == 0) ? begin : end - 1, cp_begin, cp_end;
+                if (i == 1 && idx == begin)
+                    break;
+                range(idx, cp_begin, cp_end);
+                if (cp_end - cp_begin == block_size)
+                    continue;
+                (i == 0 ? nfull_begin : nfull_end) = (i == 0) ? idx + 1 : idx;
+                if (m_cache && m_cache->get(idx, (char *)buf + cp_begin,
+                                            (offset + cp_begin) % block_size, cp_end - cp_begin))
+                    continue;
+                partial[i] = raw.get() + i * block_size;
+            }
+
+            std::vector<std::function<int()>> tasks;
+            size_t nfull = nfull_end > nfull_begin ? nfull_end - nfull_begin : 0;
+            size_t step = std::max(MIN_BLOCKS_PER_TASK,
+                                   (nfull + decompress_pool->size() - 1) / decompress_pool->size());
+            for (size_t b = nfull_begin; b < nfull_end; b += step)
+            {
+                size_t e = std::min(b + step, nfull_end);
+                tasks.emplace_back([&, b, e]() -> int {
+                    for (size_t idx = b; idx < e; idx++)
+                    {
+                        auto dst = (unsigned char *)buf + (idx * block_size - offset);
+                        if (decode(idx, dst) != (int)block_size)
+                            return -1;
+                    }
+                    return 0;
+                });
+            }
+            int dret[2] = {0, 0};
+            for (int i = 0; i < 2; i++)
+            {
+                if (partial[i] == nullptr)
+                    continue;
+                size_t idx = (i == 0) ? begin : end - 1;
+                tasks.emplace_back([&, i, idx]() -> int {
+                    dret[i] = decode(idx, partial[i]);
+                    return dret[i];
+                });
+            }
+            if (decompress_pool->run(tasks) < 0)
+                return -1;
+
+            for (int i = 0; i < 2; i++)
+            {
+                if (partial[i] == nullptr)
+                    continue;
+                size_t idx = (i == 0) ? begin : end - 1, cp_begin, cp_end;
+                range(idx, cp_begin, cp_end);
+                memcpy((char *)buf + cp_begin, partial[i] + (offset + cp_begin) % block_size,
+                       cp_end - cp_begin);
+                if (m_cache && dret[i] == (int)block_size)
+                    m_cache->put(idx, partial[i]);
+            }
+            return count;
+        }
+
+        // A block of a linked frame can only be decompressed after the ones
+        // before it in the frame, so each frame a read touches is decoded from
+        // its first block up to the last one the read needs. All the blocks
+        // decoded on the way are put into the cache for the reads to follow.
+        ssize_t pread_linked(void *buf, size_t count, off_t offset)
+        {
+            size_t block_size = m_ht.opt.block_size;
+            size_t frame_blocks = m_ht.opt.frame_size / block_size;
+            auto frame = std::unique_ptr<unsigned char[]>(new unsigned char[m_ht.opt.frame_size]);
+            std::unique_ptr<unsigned char[]> cbuf;
+            size_t cbuf_size = 0;
+            off_t end = offset + count;
+            for (off_t pos = offset; pos < end;)
+            {
+                size_t begin = pos / block_size / frame_blocks * frame_blocks;
+                size_t last = std::min((size_t)(end - 1) / block_size, begin + frame_blocks - 1);
+                off_t cbegin = m_jump_table[begin];
+                size_t clen = m_jump_table[last + 1] - cbegin;
+                if (clen > cbuf_size)
+                {
+                    cbuf.reset(new unsigned char[clen]);
+                    cbuf_size = clen;
+                }
+                int retry = 2;
+                ssize_t ret = read_compressed(cbuf.get(), clen, cbegin);
+            again:
+                if (ret != (ssize_t)clen)
+                {
+                    LOG_ERRNO_RETURN(0, -1, "read compressed blocks failed. (offset: `, len: `)",
+                                     cbegin, clen);
+                }
+                for (size_t idx = begin; idx <= last; idx++)
+                {
+                    auto src = cbuf.get() + (m_jump_table[idx] - cbegin);
+                    size_t len = m_jump_table[idx + 1] - m_jump_table[idx];
+                    if (m_ht.opt.verify)
+                        len -= sizeof(uint32_t);
+                    if (to_verify(idx))
+                    {
+                        if (crc32c(src, len) != *(uint32_t *)(src + len))
+                        {
+                            checksum_failures()->inc();
+                            if (retry--)
+                            {
+                                LOG_ERROR("checksum failed {offset: `, length: `}, reload",
+                                          m_jump_table[idx], len);
+                                ret = m_file->pread(cbuf.get(), clen, cbegin);
+                                goto again;
                             }
-                            goto again;
-                        } else {
-                            LOG_ERROR_RETURN(ECHECKSUM, -1, "checksum verification failed after retries {offset: `, length: `}",
-                                block.m_reader->m_buf_offset, block.compressed_size);
+                            LOG_ERROR_RETURN(ECHECKSUM, -1,
+                                             "checksum verification failed after retries {offset: `, length: `}",
+                                             m_jump_table[idx], len);
                         }
+                        verified(idx);
                     }
+                    auto dst = frame.get() + (idx - begin) * block_size;
+                    int dret;
+                    {
+                        DecompressTimer timer;
+                        dret = m_compressor->decompress_linked(src, len, dst, block_size,
+                                                               (idx - begin) * block_size);
+                    }
+                    if (dret < 0)
+                        return -1;
+                    if (m_cache && dret == (int)block_size)
+                        m_cache->put(idx, dst);
                 }
-                if (block.cp_len == m_ht.opt.block_size)
+                off_t copy_end = std::min(end, (off_t)((last + 1) * block_size));
+                memcpy((char *)buf + (pos - offset), frame.get() + (pos - begin * block_size),
+                       copy_end - pos);
+                pos = copy_end;
+            }
+            return count;
+        }
+
+        // verify and decompress blocks [begin, end), whose compressed data,
+        // from the offset of `begin`, is in `cbuf`, into `dst` one after
+        // another; linked frames must start at `begin`. Used by the workers of
+        // zfile_decompress_parallel(), it returns the bytes decompressed.
+        ssize_t decode_blocks(size_t begin, size_t end, const unsigned char *cbuf,
+                              unsigned char *dst)
+        {
+            size_t block_size = m_ht.opt.block_size;
+            size_t frame_blocks = m_ht.opt.frame_size / block_size;
+            off_t cbegin = m_jump_table[begin];
+            ssize_t total = 0;
+            for (size_t idx = begin; idx < end; idx++)
+            {
+                auto src = cbuf + (m_jump_table[idx] - cbegin);
+                size_t len = m_jump_table[idx + 1] - m_jump_table[idx];
+                if (m_ht.opt.verify)
                 {
-                    auto dret = m_compressor->decompress(block.buffer(),
-                                                         block.compressed_size,
-                                                         (unsigned char *)buf,
-                                                         m_ht.opt.block_size);
-                    if (dret == -1)
-                        return -1;
+                    len -= sizeof(uint32_t);
+                    if (crc32c((void *)src, len) != *(uint32_t *)(src + len))
+                    {
+                        checksum_failures()->inc();
+                        LOG_ERROR_RETURN(ECHECKSUM, -1, "checksum verification failed {offset: `, length: `}",
+                                         m_jump_table[idx], len);
+                    }
+                }
+                int ret;
+                if (frame_blocks)
+                {
+                    size_t prefix = (idx - begin) % frame_blocks * block_size;
+                    DecompressTimer timer;
+                    ret = m_compressor->decompress_linked(src, len, dst + total, block_size, prefix);
                 }
                 else
                 {
-                    auto dret = m_compressor->decompress(block.buffer(),
-                                                         block.compressed_size,
-                                                         raw, m_ht.opt.block_size);
-                    if (dret == -1)
-                        return -1;
-                    memcpy(buf, raw + block.cp_begin, block.cp_len);
+                    ret = decompress_block(idx, src, len, dst + total);
                 }
-                readn += block.cp_len;
-                LOG_DEBUG("append buf, {offset: `, length: `, crc: `}",
-                          (off_t)buf - (off_t)start_addr, block.cp_len, block.crc32_code());
-                buf = (unsigned char *)buf + block.cp_len;
+                if (ret <= 0)
+                    LOG_ERROR_RETURN(0, -1, "failed to decompress block `", idx);
+                total += ret;
             }
-            LOG_DEBUG("done. (readn: `)", readn);
-            return readn;
+            return total;
         }
-    };
 
-    // static std::unique_ptr<uint64_t[]>
-    bool load_jump_table(IFile *file, CompressionFile::HeaderTrailer *pheader_trailer,
-                         CompressionFile::JumpTable &jump_table, bool trailer = true)
-    {
+        // Each run of blocks that lies within one iovec segment is read
+        // straight into it by pread(). Only a block split by a segment
+        // boundary is decompressed into a bounce buffer and scattered.
+        virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override
+        {
+            if (!valid)
+            {
+                LOG_ERROR_RETURN(EBADF, -1, "object invalid.");
+            }
+            if (iovcnt == 1)
+                return pread(iov[0].iov_base, iov[0].iov_len, offset);
+            iovector_view va((iovec *)iov, iovcnt);
+            off_t end = offset + va.sum();
+            off_t block_size = m_ht.opt.block_size;
+            std::unique_ptr<unsigned char[]> bounce;
+            off_t pos = offset;
+            int seg = 0;
+            size_t seg_off = 0;
+            while (pos < end)
+            {
+                if (seg_off == iov[seg].iov_len)
+                {
+                    seg++;
+                    seg_off = 0;
+                    continue;
+                }
+                off_t seg_end = pos + (iov[seg].iov_len - seg_off);
+                off_t run_end = seg_end;
+                if (seg_end < end && seg_end % block_size != 0)
+                    run_end = seg_end / block_size * block_size;
+                if (run_end > pos)
+                {
+                    auto ret = pread((char *)iov[seg].iov_base + seg_off, run_end - pos, pos);
+                    if (ret != run_end - pos)
+                        return -1;
+                    seg_off += ret;
+                    pos = run_end;
+                    continue;
+                }
+
+                // the block at `pos` is split by the end of the segment
+                off_t block_end = std::min(pos / block_size * block_size + block_size, end);
+                size_t len = block_end - pos;
+                if (!bounce)
+                    bounce.reset(new unsigned char[block_size]);
+                if (pread(bounce.get(), len, pos) != (ssize_t)len)
+                    return -1;
+                for (size_t copied = 0; copied < len;)
+                {
+                    if (seg_off == iov[seg].iov_len)
+                    {
+                        seg++;
+                        seg_off = 0;
+                        continue;
+                    }
+                    auto n = std::min(len - copied, iov[seg].iov_len - seg_off);
+                    memcpy((char *)iov[seg].iov_base + seg_off, bounce.get() + copied, n);
+                    copied += n;
+                    seg_off += n;
+                }
+                pos = block_end;
+            }
+            return end - offset;
+        }
+
+        int load_jump_table_lazily();
+
+        virtual ssize_t pread(void *buf, size_t count, off_t offset) override
+        {
+            SCOPE_TRACE("zfile");
+            if (!valid)
+            {
+                LOG_ERROR_RETURN(EBADF, -1, "object invalid.");
+            }
+            if (m_ht.opt.block_size > MAX_READ_SIZE)
+            {
+                LOG_ERROR_RETURN(ENOMEM, -1, "block_size: ` > MAX_READ_SIZE (`)",
+                                 m_ht.opt.block_size, MAX_READ_SIZE);
+            }
+            if (count == 0)
+                return 0;
+            assert(offset + count <= m_ht.raw_data_size);
+            if (!m_jump_table_loaded && load_jump_table_lazily() < 0)
+                return -1;
+            if (buf == nullptr)
+                return prefetch(count, offset);
+            auto block_size = m_ht.opt.block_size;
+            if (m_readahead)
+            {
+                auto end_idx = (offset + count - 1) / block_size + 1;
+                m_readahead->access(offset, count, m_jump_table[end_idx]);
+            }
+            if (m_cache && (size_t)offset / block_size == (offset + count - 1) / block_size &&
+                m_cache->get((size_t)offset / block_size, buf, offset % block_size, count))
+            {
+                return count;
+            }
+            if (m_refill_lookahead >= 0)
+                hint_refill(offset, count);
+            if (m_ht.opt.frame_size)
+                return pread_linked(buf, count, offset);
+            if (decompress_pool &&
+                (offset + count - 1) / block_size - offset / block_size + 1 >= MIN_PARALLEL_BLOCKS)
+            {
+                auto ret = pread_parallel(buf, count, offset);
+                // checksum errors are retried by the serial path below
+                if (ret >= 0 || errno != ECHECKSUM)
+                    return ret;
+                LOG_WARN("checksum failed in parallel read {offset: `, count: `}", offset, count);
+            }
+            ssize_t readn = 0; // final will equal to count
+            auto start_addr = buf;
+            unsigned char raw[MAX_READ_SIZE];
+            for (auto &block : BlockReader(this, offset, count))
+            {
+                if (to_verify(block.m_reader->m_idx))
+                {
+                    int retry = 2;
+                again:
+                    auto c = crc32c((void *)block.buffer(), block.compressed_size);
+                    if (c != block.crc32_code())
+                    {
+                        checksum_failures()->inc();
+                        if (retry--) {
+                            int reload_res = block.reload();
+                            LOG_ERROR("checksum failed {offset: `, length: `} (expected ` but got `), reload result: `",
+                                            block.m_reader->m_buf_offset, block.compressed_size, block.crc32_code(), c, reload_res);
+                            if (reload_res < 0) {
+                                LOG_ERROR_RETURN(ECHECKSUM, -1, "checksum verification and reload failed");
+                            }
+                            goto again;
+                        } else {
+                            LOG_ERROR_RETURN(ECHECKSUM, -1, "checksum verification failed after retries {offset: `, length: `}",
+                                block.m_reader->m_buf_offset, block.compressed_size);
+                        }
+                    }
+                    verified(block.m_reader->m_idx);
+                }
+                if (block.cp_len == m_ht.opt.block_size)
+                {
+                    auto dret = decompress_block(block.m_reader->m_idx, block.buffer(),
+                                                 block.compressed_size, (unsigned char *)buf);
+                    if (dret == -1)
+                        return -1;
+                }
+                else
+                {
+                    auto idx = block.m_reader->m_idx;
+                    if (!m_cache || !m_cache->get(idx, buf, block.cp_begin, block.cp_len))
+                    {
+                        auto dret = decompress_block(idx, block.buffer(),
+                                                     block.compressed_size, raw);
+                        if (dret == -1)
+                            return -1;
+                        memcpy(buf, raw + block.cp_begin, block.cp_len);
+                        // the last block of a file may be short, don't cache it
+                        if (m_cache && dret == (int)m_ht.opt.block_size)
+                            m_cache->put(idx, raw);
+                    }
+                }
+                readn += block.cp_len;
+                LOG_DEBUG("append buf, {offset: `, length: `, crc: `}",
+                          (off_t)buf - (off_t)start_addr, block.cp_len, block.crc32_code());
+                buf = (unsigned char *)buf + block.cp_len;
+            }
+            LOG_DEBUG("done. (readn: `)", readn);
+            return readn;
+        }
+    };
+
+    // static std::unique_ptr<uint64_t[]>
+    // the header and trailer are always verified, while the index is only read
+    // into `jump_table` if `load_index`
+    bool load_jump_table(IFile *file, CompressionFile::HeaderTrailer *pheader_trailer,
+                         CompressionFile::JumpTable &jump_table, bool trailer = true,
+                         bool load_index = true)
+    {
         char buf[CompressionFile::HeaderTrailer::SPACE];
         auto ret = file->pread(buf, CompressionFile::HeaderTrailer::SPACE, 0);
         if (ret < (ssize_t)CompressionFile::HeaderTrailer::SPACE)
@@ -546,48 +1392,115 @@ namespace ZFile
             if (index_bytes > trailer_offset - pht->index_offset)
                 LOG_ERROR_RETURN(0, false, "invalid index bytes or size. ");
         }
+        if (pheader_trailer)
+            *pheader_trailer = *pht;
+        if (!load_index)
+            return true;
         auto ibuf = std::unique_ptr<uint32_t[]>(new uint32_t[pht->index_size]);
         LOG_DEBUG("index_offset: `", pht->index_offset);
         ret = file->pread((void *)(ibuf.get()), index_bytes, pht->index_offset);
+        if (ret < (ssize_t)index_bytes)
+            LOG_ERRNO_RETURN(0, false, "failed to read index.");
         jump_table.build(ibuf.get(), pht->index_size,
                          CompressionFile::HeaderTrailer::SPACE + pht->opt.dict_size);
-        if (pheader_trailer)
-            *pheader_trailer = *pht;
         return true;
     }
 
-    IFile *zfile_open_ro(IFile *file, bool verify, bool ownership)
+    // load_jump_table() of a data file, which evicts the source and reads it
+    // again on failure if `evict`, i.e. the source can be evicted
+    static bool load_jump_table_or_evict(IFile *file, CompressionFile::HeaderTrailer *pheader_trailer,
+                                         CompressionFile::JumpTable &jump_table, bool load_index,
+                                         bool evict)
     {
-        if (!file)
-        {
-            LOG_ERRNO_RETURN(EINVAL, nullptr, "invalid file ptr. (NULL)");
-        }
-        CompressionFile::HeaderTrailer ht;
-        CompressionFile::JumpTable jump_table;
         int retry = 2;
     again:
-        if (!load_jump_table(file, &ht, jump_table, true))
+        if (!load_jump_table(file, pheader_trailer, jump_table, true, load_index))
         {
-            if (verify && retry--) {
+            if (evict && retry--) {
                 // verify means the source can be evicted. evict and retry
                 auto res = file->fallocate(0, 0, -1);
                 LOG_ERROR("failed load_jump_table, fallocate result: `", res);
                 if (res < 0) {
-                    LOG_ERRNO_RETURN(EIO, nullptr, "failed to read index for file: `, fallocate failed, no retry", file);
+                    LOG_ERRNO_RETURN(EIO, false, "failed to read index for file: `, fallocate failed, no retry", file);
                 }
                 goto again;
             }
-            LOG_ERRNO_RETURN(EIO, nullptr, "failed to read index for file: `", file);
+            LOG_ERRNO_RETURN(EIO, false, "failed to read index for file: `", file);
+        }
+        return true;
+    }
+
+    int CompressionFile::load_jump_table_lazily()
+    {
+        // concurrent first reads wait for the one loading the index
+        photon::scoped_lock lock(m_jump_table_mutex);
+        if (m_jump_table_loaded)
+            return 0;
+        if (!load_jump_table_or_evict(m_file, nullptr, m_jump_table, true, m_evict_bad_index))
+            LOG_ERROR_RETURN(0, -1, "failed to load jump table of file: `", m_file);
+        m_jump_table_account.set(m_jump_table.memory());
+        m_jump_table_loaded = true;
+        return 0;
+    }
+
+    IFile *zfile_open_ro(IFile *file, bool verify, bool ownership, int64_t cache_size,
+                         int refill_lookahead)
+    {
+        if (!file)
+        {
+            LOG_ERRNO_RETURN(EINVAL, nullptr, "invalid file ptr. (NULL)");
+        }
+        CompressionFile::HeaderTrailer ht;
+        CompressionFile::JumpTable jump_table;
+        if (!load_jump_table_or_evict(file, &ht, jump_table, !lazy_jump_table, verify))
+            return nullptr;
+        // files written before raw blocks may have garbage in its place
+        ht.opt.raw_blocks = ht.get_flag_bit(CompressionFile::HeaderTrailer::FLAG_SHIFT_RAW_BLOCKS) != 0;
+        if (ht.opt.raw_blocks && ht.opt.frame_size)
+        {
+            LOG_ERROR_RETURN(EINVAL, nullptr, "raw blocks in linked frames of file: `", file);
+        }
+        if (ht.opt.frame_size && (ht.opt.frame_size % ht.opt.block_size ||
+                                  ht.opt.frame_size > MAX_FRAME_SIZE))
+        {
+            LOG_ERROR_RETURN(EINVAL, nullptr, "invalid frame size ` of file: `",
+                             ht.opt.frame_size, file);
+        }
+        CompressArgs args(ht.opt);
+        if (ht.opt.use_dict)
+        {
+            // the dictionary is loaded once here, the compressor keeps it prepared
+            auto dict_size = ht.opt.dict_size;
+            args.dict_buf.reset(new unsigned char[dict_size]);
+            auto ret = file->pread(args.dict_buf.get(), dict_size,
+                                   CompressionFile::HeaderTrailer::SPACE);
+            if (ret != (ssize_t)dict_size)
+            {
+                LOG_ERRNO_RETURN(EIO, nullptr, "failed to read dictionary of file: `", file);
+            }
         }
         auto zfile = new CompressionFile(file, ownership);
         zfile->m_ht = ht;
         zfile->m_jump_table = std::move(jump_table);
-        CompressArgs args(ht.opt);
+        zfile->m_jump_table_account.set(zfile->m_jump_table.memory());
+        zfile->m_jump_table_loaded = !lazy_jump_table;
+        zfile->m_evict_bad_index = verify;
         ht.opt.verify = ht.opt.verify && verify;
         LOG_DEBUG("compress type: `, bs: `, verify_checksum: `",
                  ht.opt.type, ht.opt.block_size, ht.opt.verify);
 
         zfile->m_compressor.reset(create_compressor(&args));
+        if (cache_size < 0)
+            cache_size = block_cache_size;
+        if (cache_size > 0)
+            zfile->m_cache.reset(new BlockCache(cache_size, ht.opt.block_size));
+        if (readahead_size > 0)
+            zfile->m_readahead.reset(new Readahead(
+                file, readahead_size, ht.index_offset));
+        if (verify_once && zfile->m_ht.opt.verify)
+            zfile->m_verified.reset(new VerifiedBlocks(
+                (ht.raw_data_size + ht.opt.block_size - 1) / ht.opt.block_size));
+        zfile->m_refill_lookahead = refill_lookahead;
         zfile->m_ownership = ownership;
         zfile->valid = true;
         return zfile;
@@ -613,6 +1526,329 @@ namespace ZFile
         return (int)file->write(pht, CompressionFile::HeaderTrailer::SPACE);
     }
 
+    // complete a block compressed into `dst` by `ret` bytes, appending its
+    // crc32 if `crc32_verify`, returns the length of the block; with
+    // `raw_blocks`, a block that doesn't shrink is copied as is instead
+    static int finish_block(int ret, bool crc32_verify, const unsigned char *src,
+                            size_t src_len, unsigned char *dst, bool raw_blocks)
+    {
+        if (ret <= 0)
+            return -1;
+        if (raw_blocks && ret >= (int)src_len)
+        {
+            memcpy(dst, src, src_len);
+            ret = src_len;
+        }
+        if (crc32_verify)
+        {
+            auto crc32_code = crc32c(dst, ret);
+            *((uint32_t *)&dst[ret]) = crc32_code;
+            LOG_DEBUG("append ` bytes crc32_code: {count: `, crc32: `}",
+                      sizeof(uint32_t), ret, crc32_code);
+            ret += sizeof(uint32_t);
+        }
+        return ret;
+    }
+
+    // compress a unit, i.e. a batch of independent blocks or a linked frame
+    // of blocks, into `dst`, appending their lengths to `block_len`; returns
+    // the total compressed length
+    static ssize_t compress_unit(ICompressor *compressor, const CompressOptions &opt,
+                                 const unsigned char *src, size_t src_len,
+                                 unsigned char *dst, std::vector<uint32_t> &block_len)
+    {
+        size_t block_size = opt.block_size;
+        size_t dst_len = block_size + BUF_SIZE;
+        ssize_t total = 0;
+        if (opt.frame_size)
+        {
+            for (size_t i = 0; i < src_len; i += block_size)
+            {
+                auto step = std::min(block_size, src_len - i);
+                auto ret = compressor->compress_linked(src + i, step, dst + total, dst_len, i);
+                ret = finish_block(ret, opt.verify, src + i, step, dst + total, false);
+                if (ret <= 0)
+                    return -1;
+                block_len.push_back(ret);
+                total += ret;
+            }
+            return total;
+        }
+        // the blocks are compressed at once into their own spaces in `dst`,
+        // and then moved together
+        size_t n = (src_len + block_size - 1) / block_size;
+        if (n == 0 || n > BATCH_BLOCKS)
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid # of blocks ` in a batch", n);
+        const unsigned char *srcs[BATCH_BLOCKS] = {};
+        unsigned char *dsts[BATCH_BLOCKS] = {};
+        size_t lens[BATCH_BLOCKS] = {};
+        int rets[BATCH_BLOCKS];
+        for (size_t i = 0; i < n; i++)
+        {
+            srcs[i] = src + i * block_size;
+            dsts[i] = dst + i * dst_len;
+            lens[i] = std::min(block_size, src_len - i * block_size);
+        }
+        compressor->compress_batch(srcs, lens, dsts, dst_len, rets, n);
+        for (size_t i = 0; i < n; i++)
+        {
+            auto ret = finish_block(rets[i], opt.verify, srcs[i], lens[i], dsts[i],
+                                    opt.raw_blocks);
+            if (ret <= 0)
+                return -1;
+            memmove(dst + total, dsts[i], ret);
+            block_len.push_back(ret);
+            total += ret;
+        }
+        return total;
+    }
+
+    // size of the units that are compressed independently of each other
+    static size_t unit_size(const CompressOptions &opt)
+    {
+        return opt.frame_size ? opt.frame_size : opt.block_size * BATCH_BLOCKS;
+    }
+
+    // Units are read and written in order by the calling thread, while
+    // `workers` OS threads compress them in between. Each worker owns its
+    // compressor. Up to SLOTS_PER_WORKER units per worker are in flight,
+    // kept in a ring of slots indexed by unit number.
+    static int compress_blocks_parallel(IFile *file, IFile *as, const CompressArgs *args,
+                                        ssize_t raw_data_size, uint64_t &moffset,
+                                        std::vector<uint32_t> &block_len)
+    {
+        const static int SLOTS_PER_WORKER = 4;
+        struct Slot
+        {
+            std::unique_ptr<unsigned char[]> raw, compressed;
+            size_t raw_len = 0;
+            ssize_t compressed_len = 0;
+            std::vector<uint32_t> block_len;
+            bool done = false;
+        };
+
+        auto &opt = args->opt;
+        size_t block_size = opt.block_size;
+        size_t unit = unit_size(opt);
+        size_t buf_size = unit / block_size * (block_size + BUF_SIZE);
+        size_t nunits = (raw_data_size + unit - 1) / unit;
+        int workers = args->workers;
+        size_t nslots = workers * SLOTS_PER_WORKER;
+        std::vector<Slot> slots(nslots);
+        for (auto &slot : slots)
+        {
+            slot.raw.reset(new unsigned char[unit]);
+            slot.compressed.reset(new unsigned char[buf_size]);
+        }
+
+        std::mutex mtx;
+        std::condition_variable cv_read, cv_done;
+        size_t next_read = 0, next_compress = 0, next_write = 0;
+        bool stop = false;
+        int eno = 0;
+
+        auto worker = [&]() {
+            std::unique_ptr<ICompressor> compressor(create_compressor(args));
+            std::unique_lock<std::mutex> lock(mtx);
+            if (!compressor)
+            {
+                eno = errno ? errno : EINVAL;
+                cv_done.notify_one();
+                return;
+            }
+            while (true)
+            {
+                cv_read.wait(lock, [&] { return stop || next_compress < next_read; });
+                if (stop)
+                    return;
+                auto &slot = slots[next_compress++ % nslots];
+                lock.unlock();
+                slot.block_len.clear();
+                auto ret = compress_unit(compressor.get(), opt, slot.raw.get(), slot.raw_len,
+                                         slot.compressed.get(), slot.block_len);
+                auto err = errno;
+                lock.lock();
+                if (ret <= 0 && eno == 0)
+                    eno = err ? err : EFAULT;
+                slot.compressed_len = ret;
+                slot.done = true;
+                cv_done.notify_one();
+            }
+        };
+
+        LOG_INFO("compress with ` workers", workers);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < workers; i++)
+            threads.emplace_back(worker);
+        DEFER({
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stop = true;
+            }
+            cv_read.notify_all();
+            for (auto &th : threads)
+                th.join();
+        });
+
+        block_len.reserve((raw_data_size + block_size - 1) / block_size);
+        while (next_write < nunits)
+        {
+            // keep the ring full of raw units
+            while (next_read < nunits && next_read - next_write < nslots)
+            {
+                auto &slot = slots[next_read % nslots];
+                off_t offset = next_read * unit;
+                auto step = std::min((ssize_t)unit, (ssize_t)(raw_data_size - offset));
+                auto ret = file->pread(slot.raw.get(), step, offset);
+                if (ret < step)
+                {
+                    LOG_ERRNO_RETURN(0, -1, "failed to read from source file. (readn: `)", ret);
+                }
+                std::lock_guard<std::mutex> lock(mtx);
+                slot.raw_len = step;
+                slot.done = false;
+                next_read++;
+                cv_read.notify_one();
+            }
+
+            auto &slot = slots[next_write % nslots];
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv_done.wait(lock, [&] { return eno != 0 || slot.done; });
+                if (eno != 0)
+                {
+                    LOG_ERROR_RETURN(eno, -1, "failed to compress unit `", next_write);
+                }
+            }
+            size_t compressed_len = slot.compressed_len;
+            LOG_DEBUG("compress buffer {offset: `, count: `} into ` bytes.",
+                      next_write * unit, slot.raw_len, compressed_len);
+            auto ret = as->write(slot.compressed.get(), compressed_len);
+            if (ret < (ssize_t)compressed_len)
+            {
+                LOG_ERRNO_RETURN(0, -1, "failed to write compressed data.");
+            }
+            block_len.insert(block_len.end(), slot.block_len.begin(), slot.block_len.end());
+            moffset += compressed_len;
+            next_write++;
+        }
+        return 0;
+    }
+
+    int zfile_train_dict(IFile *file, CompressArgs *args, size_t dict_size)
+    {
+        // zstd suggests a training set of about 100 times the dictionary size
+        const static size_t SAMPLE_RATIO = 100;
+        if (file == nullptr || args == nullptr || dict_size == 0)
+        {
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid arguments (file: `, args: `, dict_size: `)",
+                             file, args, dict_size);
+        }
+        size_t block_size = args->opt.block_size;
+        auto raw_data_size = file->lseek(0, SEEK_END);
+        if (raw_data_size < 0)
+        {
+            LOG_ERRNO_RETURN(0, -1, "failed to get source file size");
+        }
+        size_t nblocks = raw_data_size / block_size;
+        size_t nsamples = std::min(nblocks, dict_size * SAMPLE_RATIO / block_size + 1);
+        if (nsamples == 0)
+        {
+            LOG_ERROR_RETURN(EINVAL, -1, "source file is too small to train a dictionary");
+        }
+
+        // pick evenly spaced whole blocks
+        auto samples = std::unique_ptr<unsigned char[]>(
+            new unsigned char[nsamples * block_size]);
+        std::vector<size_t> sample_sizes(nsamples, block_size);
+        for (size_t i = 0; i < nsamples; i++)
+        {
+            off_t offset = (i * nblocks / nsamples) * block_size;
+            auto ret = file->pread(samples.get() + i * block_size, block_size, offset);
+            if (ret != (ssize_t)block_size)
+            {
+                LOG_ERRNO_RETURN(0, -1, "failed to read sample block at `", offset);
+            }
+        }
+
+        auto dict = std::unique_ptr<unsigned char[]>(new unsigned char[dict_size]);
+        auto ret = ZDICT_trainFromBuffer(dict.get(), dict_size, samples.get(),
+                                         sample_sizes.data(), nsamples);
+        if (ZDICT_isError(ret))
+        {
+            LOG_ERROR_RETURN(EINVAL, -1, "failed to train dictionary from ` blocks: `",
+                             nsamples, ZDICT_getErrorName(ret));
+        }
+        LOG_INFO("trained a ` bytes dictionary from ` blocks", ret, nsamples);
+        args->dict_buf = std::move(dict);
+        args->opt.dict_size = ret;
+        args->opt.use_dict = 1;
+        return 0;
+    }
+
+    static int check_options(const CompressOptions &opt)
+    {
+        LOG_INFO("create compress file. [ block size: `, type: `, enable_checksum: `, frame size: `]",
+                 opt.block_size, opt.type, opt.verify, opt.frame_size);
+        if (opt.frame_size && (opt.frame_size % opt.block_size || opt.frame_size > MAX_FRAME_SIZE))
+        {
+            LOG_ERROR_RETURN(EINVAL, -1, "frame size ` is not a multiple of block size ` up to `",
+                             opt.frame_size, opt.block_size, MAX_FRAME_SIZE);
+        }
+        if (opt.frame_size && opt.use_dict)
+        {
+            LOG_ERROR_RETURN(EINVAL, -1, "linked frames can't be compressed with a dictionary");
+        }
+        if (opt.frame_size && opt.raw_blocks)
+        {
+            LOG_ERROR_RETURN(EINVAL, -1, "blocks of linked frames can't be stored raw");
+        }
+        return 0;
+    }
+
+    static int write_header_dict(IFile *as, const CompressArgs *args,
+                                 CompressionFile::HeaderTrailer *pht)
+    {
+        LOG_INFO("write header.");
+        auto ret = write_header_trailer(as, true, false, true, pht);
+        if (ret < 0)
+        {
+            LOG_ERRNO_RETURN(0, -1, "failed to write header");
+        }
+        auto &opt = args->opt;
+        if (opt.use_dict)
+        {
+            LOG_INFO("write dictionary. (size: `)", opt.dict_size);
+            if (as->write(args->dict_buf.get(), opt.dict_size) != (ssize_t)opt.dict_size)
+            {
+                LOG_ERRNO_RETURN(0, -1, "failed to write dictionary");
+            }
+        }
+        return 0;
+    }
+
+    static int write_index_trailer(IFile *as, uint64_t moffset, uint64_t raw_data_size,
+                                   std::vector<uint32_t> &block_len,
+                                   CompressionFile::HeaderTrailer *pht)
+    {
+        uint64_t index_offset = moffset;
+        uint64_t index_size = block_len.size();
+        ssize_t index_bytes = index_size * sizeof(uint32_t);
+        LOG_INFO("write index (offset: `, count: ` size: `)", index_offset, index_size, index_bytes);
+        if (as->write(&block_len[0], index_bytes) != index_bytes)
+        {
+            LOG_ERRNO_RETURN(0, -1, "failed to write index.");
+        }
+        pht->index_offset = index_offset;
+        pht->index_size = index_size;
+        pht->raw_data_size = raw_data_size;
+        LOG_INFO("write trailer.");
+        auto ret = write_header_trailer(as, false, true, true, pht);
+        if (ret < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to write trailer");
+        return 0;
+    }
+
     int zfile_compress(IFile *file, IFile *as, const CompressArgs *args)
     {
         if (args == nullptr)
@@ -624,82 +1860,195 @@ namespace ZFile
             LOG_ERROR_RETURN(EINVAL, -1, "file ptr is NULL (file: `, as: `)", file, as);
         }
         CompressOptions opt = args->opt;
-        LOG_INFO("create compress file. [ block size: `, type: `, enable_checksum: `]",
-                 opt.block_size, opt.type, opt.verify);
+        if (check_options(opt) < 0)
+            return -1;
         auto compressor = create_compressor(args);
         DEFER(delete compressor);
         if (compressor == nullptr)
             return -1;
-        char buf[CompressionFile::HeaderTrailer::SPACE];
+        char buf[CompressionFile::HeaderTrailer::SPACE]{};
         auto pht = new (buf) CompressionFile::HeaderTrailer;
         pht->set_compress_option(opt);
-
-        LOG_INFO("write header.");
-        auto ret = write_header_trailer(as, true, false, true, pht);
+        auto ret = write_header_dict(as, args, pht);
         if (ret < 0)
-        {
-            LOG_ERRNO_RETURN(0, -1, "failed to write header");
-        }
+            return -1;
 
         auto raw_data_size = file->lseek(0, SEEK_END);
         LOG_INFO("source data size: `", raw_data_size);
         auto block_size = opt.block_size;
-        auto buf_size = block_size + BUF_SIZE;
-        auto raw_data = std::unique_ptr<unsigned char[]>(
-            new unsigned char[buf_size]);
-        auto compressed_data = std::unique_ptr<unsigned char[]>(
-            new unsigned char[buf_size]);
-        bool crc32_verify = opt.verify;
         std::vector<uint32_t> block_len{};
         uint64_t moffset = CompressionFile::HeaderTrailer::SPACE + opt.dict_size;
         LOG_INFO("compress start....");
-        for (ssize_t i = 0; i < raw_data_size; i += block_size)
+        if (args->workers > 1)
         {
-            auto step = std::min((ssize_t)block_size, (ssize_t)(raw_data_size - i));
-            auto ret = file->pread(raw_data.get(), step, i);
-            if (ret < step)
+            if (compress_blocks_parallel(file, as, args, raw_data_size, moffset, block_len) < 0)
+                return -1;
+        }
+        else
+        {
+            size_t unit = unit_size(opt);
+            auto buf_size = unit / block_size * (block_size + BUF_SIZE);
+            auto raw_data = std::unique_ptr<unsigned char[]>(
+                new unsigned char[unit]);
+            auto compressed_data = std::unique_ptr<unsigned char[]>(
+                new unsigned char[buf_size]);
+            for (ssize_t i = 0; i < raw_data_size; i += unit)
             {
-                LOG_ERRNO_RETURN(0, -1, "failed to read from source file. (readn: `)", ret);
+                auto step = std::min((ssize_t)unit, (ssize_t)(raw_data_size - i));
+                auto ret = file->pread(raw_data.get(), step, i);
+                if (ret < step)
+                {
+                    LOG_ERRNO_RETURN(0, -1, "failed to read from source file. (readn: `)", ret);
+                }
+                ret = compress_unit(compressor, opt, raw_data.get(), step,
+                                    compressed_data.get(), block_len);
+                if (ret <= 0)
+                    return -1;
+                LOG_DEBUG("compress buffer {offset: `, count: `} into ` bytes.", i, step, ret);
+                size_t compressed_len = ret;
+                ret = as->write(compressed_data.get(), compressed_len);
+                if (ret < (ssize_t)compressed_len)
+                {
+                    LOG_ERRNO_RETURN(0, -1, "failed to write compressed data.");
+                }
+                moffset += compressed_len;
             }
-            size_t compressed_len = 0;
-            ret = compressor->compress(raw_data.get(), step,
-                                       compressed_data.get(), buf_size);
+        }
+        return write_index_trailer(as, moffset, raw_data_size, block_len, pht);
+    }
+
+    // the data written is compressed unit by unit as it fills up, and the
+    // zfile is completed with the last unit, the index and the trailer by
+    // close()
+    class CompressionWriter : public VirtualReadOnlyFile
+    {
+    public:
+        IFile *m_file;
+        const CompressArgs *m_args;
+        std::unique_ptr<ICompressor> m_compressor;
+        size_t m_unit;
+        std::unique_ptr<unsigned char[]> m_raw, m_compressed;
+        size_t m_raw_len = 0;
+        uint64_t m_raw_data_size = 0, m_moffset = 0;
+        std::vector<uint32_t> m_block_len;
+        char m_buf[CompressionFile::HeaderTrailer::SPACE]{};
+        bool m_closed = false;
+
+        CompressionWriter(IFile *file, const CompressArgs *args) : m_file(file), m_args(args)
+        {
+        }
+        ~CompressionWriter()
+        {
+            close();
+        }
+
+        int init()
+        {
+            auto &opt = m_args->opt;
+            if (check_options(opt) < 0)
+                return -1;
+            m_compressor.reset(create_compressor(m_args));
+            if (!m_compressor)
+                return -1;
+            m_unit = unit_size(opt);
+            m_raw.reset(new unsigned char[m_unit]);
+            m_compressed.reset(new unsigned char[m_unit / opt.block_size *
+                                                 (opt.block_size + BUF_SIZE)]);
+            auto pht = new (m_buf) CompressionFile::HeaderTrailer;
+            pht->set_compress_option(opt);
+            m_moffset = CompressionFile::HeaderTrailer::SPACE + opt.dict_size;
+            return write_header_dict(m_file, m_args, pht);
+        }
+
+        int flush_unit()
+        {
+            auto ret = compress_unit(m_compressor.get(), m_args->opt, m_raw.get(), m_raw_len,
+                                     m_compressed.get(), m_block_len);
             if (ret <= 0)
                 return -1;
-            LOG_DEBUG("compress buffer {offset: `, count: `} into ` bytes.", i, step, ret);
-            compressed_len = ret;
-            if (crc32_verify)
+            if (m_file->write(m_compressed.get(), ret) < ret)
             {
-                auto crc32_code = crc32c(compressed_data.get(), compressed_len);
-                *((uint32_t *)&compressed_data[compressed_len]) = crc32_code;
-                LOG_DEBUG("append ` bytes crc32_code: {offset: `, count: `, crc32: `}",
-                          sizeof(uint32_t), moffset, compressed_len, crc32_code);
-                compressed_len += sizeof(uint32_t);
+                LOG_ERRNO_RETURN(0, -1, "failed to write compressed data.");
             }
-            ret = as->write(compressed_data.get(), compressed_len);
-            if (ret < (ssize_t)compressed_len)
+            m_moffset += ret;
+            m_raw_len = 0;
+            return 0;
+        }
+
+        virtual ssize_t write(const void *buf, size_t count) override
+        {
+            if (m_closed)
+                LOG_ERROR_RETURN(EBADF, -1, "write after close");
+            auto p = (const unsigned char *)buf;
+            for (size_t left = count; left > 0;)
             {
-                LOG_ERRNO_RETURN(0, -1, "failed to write compressed data.");
+                auto step = std::min(left, m_unit - m_raw_len);
+                memcpy(m_raw.get() + m_raw_len, p, step);
+                m_raw_len += step;
+                m_raw_data_size += step;
+                p += step;
+                left -= step;
+                if (m_raw_len == m_unit && flush_unit() < 0)
+                    return -1;
             }
-            block_len.push_back(compressed_len);
-            moffset += compressed_len;
+            return count;
         }
-        uint64_t index_offset = moffset;
-        uint64_t index_size = block_len.size();
-        ssize_t index_bytes = index_size * sizeof(uint32_t);
-        LOG_INFO("write index (offset: `, count: ` size: `)", index_offset, index_size, index_bytes);
-        if (as->write(&block_len[0], index_bytes) != index_bytes)
+
+        virtual ssize_t pwrite(const void *buf, size_t count, off_t offset) override
         {
-            LOG_ERRNO_RETURN(0, -1, "failed to write index.");
+            if ((uint64_t)offset != m_raw_data_size)
+                LOG_ERROR_RETURN(ESPIPE, -1, "only written sequentially");
+            return write(buf, count);
         }
-        pht->index_offset = index_offset;
-        pht->index_size = index_size;
-        pht->raw_data_size = raw_data_size;
-        LOG_INFO("write trailer.");
-        ret = write_header_trailer(as, false, true, true, pht);
-        if (ret < 0)
-            LOG_ERRNO_RETURN(0, -1, "failed to write trailer");
-        return 0;
+
+        virtual off_t lseek(off_t offset, int whence) override
+        {
+            if (offset != 0 || whence == SEEK_SET)
+                LOG_ERROR_RETURN(ESPIPE, -1, "only written sequentially");
+            return m_raw_data_size;
+        }
+
+        virtual int close() override
+        {
+            if (m_closed)
+                return 0;
+            m_closed = true;
+            if (m_raw_len > 0 && flush_unit() < 0)
+                return -1;
+            return write_index_trailer(m_file, m_moffset, m_raw_data_size, m_block_len,
+                                       (CompressionFile::HeaderTrailer *)m_buf);
+        }
+
+        virtual int fstat(struct stat *buf) override
+        {
+            memset(buf, 0, sizeof(*buf));
+            buf->st_size = m_raw_data_size;
+            return 0;
+        }
+
+        virtual IFileSystem *filesystem() override
+        {
+            return nullptr;
+        }
+        UNIMPLEMENTED(ssize_t pread(void *buf, size_t count, off_t offset) override);
+        UNIMPLEMENTED(ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override);
+    };
+
+    IFile *zfile_writer(IFile *as, const CompressArgs *args)
+    {
+        if (as == nullptr || args == nullptr)
+        {
+            LOG_ERROR_RETURN(EINVAL, nullptr, "invalid arguments (as: `, args: `)", as,
+                             (void *)args);
+        }
+        auto writer = new CompressionWriter(as, args);
+        if (writer->init() < 0)
+        {
+            writer->m_closed = true;
+            delete writer;
+            return nullptr;
+        }
+        return writer;
     }
 
     int zfile_decompress(IFile *src, IFile *dst)
@@ -733,6 +2082,169 @@ namespace ZFile
         return 0;
     }
 
+    // Ranges of the jump table are read and written in order by the calling
+    // thread, while `workers` OS threads verify and decompress them in
+    // between, like compress_blocks_parallel(). The decompressors keep their
+    // contexts per thread, so the workers share the one of the zfile.
+    ssize_t zfile_decompress_parallel(IFile *src, IFile *dst, int workers)
+    {
+        const static int SLOTS_PER_WORKER = 4;
+        const static size_t MIN_UNIT = 1 << 20;
+        struct Slot
+        {
+            std::unique_ptr<unsigned char, decltype(&free)> raw{nullptr, &free};
+            std::unique_ptr<unsigned char[]> compressed;
+            size_t compressed_cap = 0;
+            size_t begin = 0, end = 0;
+            ssize_t raw_len = 0;
+            bool done = false;
+        };
+
+        if (src == nullptr || dst == nullptr || workers < 1)
+        {
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid arguments (src: `, dst: `, workers: `)",
+                             src, dst, workers);
+        }
+        auto file = (CompressionFile *)zfile_open_ro(src, /*verify = */ true);
+        DEFER(delete file);
+        if (file == nullptr)
+        {
+            LOG_ERROR_RETURN(0, -1, "failed to read file.");
+        }
+        if (!file->m_jump_table_loaded && file->load_jump_table_lazily() < 0)
+        {
+            LOG_ERROR_RETURN(0, -1, "failed to load jump table.");
+        }
+        auto &jump_table = file->m_jump_table;
+        uint64_t raw_data_size = file->m_ht.raw_data_size;
+        size_t block_size = file->m_ht.opt.block_size;
+        size_t nblocks = (raw_data_size + block_size - 1) / block_size;
+        if (nblocks + 1 > jump_table.size())
+        {
+            LOG_ERROR_RETURN(EINVAL, -1, "jump table of ` entries is short of ` blocks",
+                             jump_table.size(), nblocks);
+        }
+        // whole frames, of whole pages for O_DIRECT output, of MIN_UNIT at least
+        size_t granule = file->m_ht.opt.frame_size ? file->m_ht.opt.frame_size : block_size;
+        size_t unit = granule;
+        while (unit % ALIGNMENT_4K)
+            unit += granule;
+        unit *= (MIN_UNIT + unit - 1) / unit;
+        size_t unit_blocks = unit / block_size;
+        size_t nunits = (nblocks + unit_blocks - 1) / unit_blocks;
+
+        size_t nslots = workers * SLOTS_PER_WORKER;
+        std::vector<Slot> slots(nslots);
+        for (auto &slot : slots)
+        {
+            void *p = nullptr;
+            if (posix_memalign(&p, ALIGNMENT_4K, unit) != 0)
+            {
+                LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate ` bytes", unit);
+            }
+            slot.raw.reset((unsigned char *)p);
+        }
+
+        std::mutex mtx;
+        std::condition_variable cv_read, cv_done;
+        size_t next_read = 0, next_decompress = 0, next_write = 0;
+        bool stop = false;
+        int eno = 0;
+
+        auto worker = [&]() {
+            std::unique_lock<std::mutex> lock(mtx);
+            while (true)
+            {
+                cv_read.wait(lock, [&] { return stop || next_decompress < next_read; });
+                if (stop)
+                    return;
+                auto &slot = slots[next_decompress++ % nslots];
+                lock.unlock();
+                auto ret = file->decode_blocks(slot.begin, slot.end, slot.compressed.get(),
+                                               slot.raw.get());
+                auto err = errno;
+                lock.lock();
+                if (ret < 0 && eno == 0)
+                    eno = err ? err : EFAULT;
+                slot.raw_len = ret;
+                slot.done = true;
+                cv_done.notify_one();
+            }
+        };
+
+        LOG_INFO("decompress with ` workers in units of ` KB", workers, unit >> 10);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < workers; i++)
+            threads.emplace_back(worker);
+        DEFER({
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stop = true;
+            }
+            cv_read.notify_all();
+            for (auto &th : threads)
+                th.join();
+        });
+
+        while (next_write < nunits)
+        {
+            // keep the ring full of compressed units
+            while (next_read < nunits && next_read - next_write < nslots)
+            {
+                auto &slot = slots[next_read % nslots];
+                slot.begin = next_read * unit_blocks;
+                slot.end = std::min(slot.begin + unit_blocks, nblocks);
+                off_t cbegin = jump_table[slot.begin];
+                size_t clen = jump_table[slot.end] - cbegin;
+                if (clen > slot.compressed_cap)
+                {
+                    slot.compressed.reset(new unsigned char[clen]);
+                    slot.compressed_cap = clen;
+                }
+                auto ret = file->m_file->pread(slot.compressed.get(), clen, cbegin);
+                if (ret < (ssize_t)clen)
+                {
+                    LOG_ERRNO_RETURN(0, -1, "failed to read compressed blocks. (offset: `, len: `)",
+                                     cbegin, clen);
+                }
+                std::lock_guard<std::mutex> lock(mtx);
+                slot.done = false;
+                next_read++;
+                cv_read.notify_one();
+            }
+
+            auto &slot = slots[next_write % nslots];
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv_done.wait(lock, [&] { return eno != 0 || slot.done; });
+                if (eno != 0)
+                {
+                    LOG_ERROR_RETURN(eno, -1, "failed to decompress unit `", next_write);
+                }
+            }
+            size_t expect = std::min((uint64_t)unit, raw_data_size - next_write * unit);
+            if ((size_t)slot.raw_len != expect)
+            {
+                LOG_ERROR_RETURN(EIO, -1, "unit ` decompressed into ` bytes, expected `",
+                                 next_write, slot.raw_len, expect);
+            }
+            // the tail is padded to a whole page, and truncated at last
+            size_t len = (expect + ALIGNMENT_4K - 1) / ALIGNMENT_4K * ALIGNMENT_4K;
+            memset(slot.raw.get() + expect, 0, len - expect);
+            auto ret = dst->pwrite(slot.raw.get(), len, next_write * unit);
+            if (ret < (ssize_t)len)
+            {
+                LOG_ERRNO_RETURN(0, -1, "failed to write file into dst");
+            }
+            next_write++;
+        }
+        if (dst->ftruncate(raw_data_size) < 0)
+        {
+            LOG_ERRNO_RETURN(0, -1, "failed to truncate dst to `", raw_data_size);
+        }
+        return raw_data_size;
+    }
+
     int is_zfile(FileSystem::IFile *file)
     {
         char buf[CompressionFile::HeaderTrailer::SPACE];
@@ -20,15 +20,85 @@ namespace ZFile
 {
     const static size_t MAX_READ_SIZE     = 65536; // 64K
 
+    // `block_cache_size` is the memory budget, in bytes, of the block cache
+    // of the file, or -1 for the one set by zfile_set_block_cache_size().
+    // With `refill_lookahead` >= 0, a read missing the block cache first
+    // prefetches, by a read without buffer, the whole compressed blocks it
+    // covers plus `refill_lookahead` blocks following from `file`, which
+    // must take such reads, as a cached file does; -1 disables the hints.
+    // A read without buffer of the zfile is passed on likewise, or, with
+    // hints disabled, returns at once.
     extern "C" FileSystem::IFile* zfile_open_ro(FileSystem::IFile* file, bool verify = false,
-                                            bool ownership = false);
+                                            bool ownership = false,
+                                            int64_t block_cache_size = -1,
+                                            int refill_lookahead = -1);
+
+    // set the memory budget, in bytes, of the decompressed block cache of
+    // each zfile opened afterwards; 0 (the default) disables the cache.
+    extern "C" void zfile_set_block_cache_size(size_t bytes);
+
+    // set the max readahead window, in bytes, for sequential reads of each
+    // zfile opened afterwards; 0 (the default) disables readahead, which
+    // otherwise requires the files to be read from photon threads.
+    extern "C" void zfile_set_readahead_size(size_t bytes);
+
+    // start `nthreads` OS threads that decompress the blocks of large reads
+    // in parallel; 0 (the default) stops them. Like readahead it requires
+    // the files to be read from photon threads, and must be set before any
+    // zfile is read.
+    extern "C" void zfile_set_decompress_threads(int nthreads);
+
+    // load the jump table of each zfile opened afterwards on its first read,
+    // so that opening one only verifies its header and trailer; false (the
+    // default) loads it at open. Lazy loading requires photon threads.
+    extern "C" void zfile_set_lazy_jump_table(bool lazy);
+
+    // verify the crc32 of each block of a zfile opened afterwards only on its
+    // first read since the open, rather than on every read; false (the
+    // default) verifies every read, so data changed underneath is caught.
+    extern "C" void zfile_set_verify_once(bool once);
 
     extern "C" int zfile_compress(  FileSystem::IFile* src_file,
                     FileSystem::IFile* dst_file,
                     const CompressArgs *opt = nullptr);
 
+    // train a dictionary of at most `dict_size` bytes from blocks sampled
+    // from `src_file`, and attach it to `args`; zfile_compress() stores it
+    // after the header and both compressors make use of it.
+    extern "C" int zfile_train_dict(FileSystem::IFile *src_file, CompressArgs *args,
+                                    size_t dict_size);
+
+    // return a file whose data, written sequentially, e.g. by an LSMT
+    // commit, is compressed as a zfile into `as`, as zfile_compress() would
+    // of the same data. The zfile is complete once the file is closed, or
+    // destructed. `args` must outlive the file, and its workers are ignored.
+    extern "C" FileSystem::IFile *zfile_writer(FileSystem::IFile *as, const CompressArgs *args);
+
     extern "C" int zfile_decompress(FileSystem::IFile *src_file, FileSystem::IFile *dst_file);
 
+    // decompress `src_file` into `dst_file` as zfile_decompress() does, by
+    // `workers` OS threads decoding ranges of the jump table, and verifying
+    // the crc32 of their blocks, in parallel. `dst_file` is written in whole
+    // pages from aligned buffers, so that it may be opened with O_DIRECT, and
+    // truncated to the raw size at last. Returns the raw size, or -1.
+    extern "C" ssize_t zfile_decompress_parallel(FileSystem::IFile *src_file,
+                                                 FileSystem::IFile *dst_file, int workers);
+
+    // return a file whose data, written at any offset, as the data file of a
+    // writable LSMT file is, is compressed into `file` in units of up to 64KB,
+    // appended as they're written, and read at random, decompressing the
+    // units it covers; a range written again supersedes the units of it. With
+    // `create`, `file` is made such a file anew, compressed by `opt->type`
+    // (LZ4 by default), otherwise its units are loaded by their headers,
+    // skipping any torn by a crash.
+    extern "C" FileSystem::IFile *zfile_open_append(FileSystem::IFile *file, bool create,
+                                                    const CompressOptions *opt = nullptr,
+                                                    bool ownership = false);
+
+    // return 1 if `file` was made by zfile_open_append() with `create`,
+    // 0 if not, or -1 for an error.
+    extern "C" int is_zfile_append(FileSystem::IFile *file);
+
     // return 1 if file object is a zfile.
     // return 0 if file object is a normal file.
     // otherwise return -1.
@@ -17,7 +17,8 @@
 #include "photon/timer.h"
 
 struct ScalePoolController;
-static ScalePoolController *g_scale_pool_controller;
+// pools are scaled by a timer on their own vcpu
+static __thread ScalePoolController *g_scale_pool_controller;
 struct ScalePoolController {
     photon::Timer timer;
     intrusive_list<IdentityPoolBase> entries;
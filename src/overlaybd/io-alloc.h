@@ -21,6 +21,10 @@
 #include <malloc.h>
 #endif
 #include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <vector>
 #include "callback.h"
 #include "identity-pool.h"
 
@@ -199,6 +203,123 @@ protected:
     }
 };
 
+// Carves 2MB hugepages of an arena into buffers of 2^n bytes in
+// [4KB, MAX_ALLOCATION_SIZE], each hugepage serving a single size. Freed
+// buffers are kept in a free list of their size, without locking, so an
+// allocator must be used by a single vcpu. The arena is backed by hugetlbfs
+// pages if enough are reserved, or by transparent hugepages otherwise.
+// Beyond the arena, or beyond the max size, buffers are posix_memalign()ed.
+template <size_t MAX_ALLOCATION_SIZE = 1024 * 1024>
+class HugePageAllocator {
+    static_assert((MAX_ALLOCATION_SIZE & (MAX_ALLOCATION_SIZE - 1)) == 0, "must be 2^n");
+    static_assert(MAX_ALLOCATION_SIZE >= 4096, "...");
+    const static size_t HUGE_PAGE = 2 * 1024 * 1024;
+    static_assert(MAX_ALLOCATION_SIZE <= HUGE_PAGE, "...");
+    const static size_t N_SLOTS = __builtin_ffsl(MAX_ALLOCATION_SIZE / 4096);
+
+public:
+    ~HugePageAllocator() {
+        if (m_map)
+            munmap(m_map, m_map_size);
+    }
+
+    // maps an arena of `size` bytes, rounded up to hugepages
+    int init(size_t size) {
+        assert(m_map == nullptr);
+        size = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+        if (size == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+            m_map = m_base = (char *)ptr;
+            m_map_size = size;
+            m_hugetlb = true;
+        } else {
+            // over-map to align the arena to hugepages, for THP to back it
+            ptr = mmap(nullptr, size + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (ptr == MAP_FAILED)
+                return -1;
+            m_map = (char *)ptr;
+            m_map_size = size + HUGE_PAGE;
+            m_base = (char *)(((uint64_t)ptr + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+            madvise(m_base, size, MADV_HUGEPAGE);
+        }
+        m_pages = size / HUGE_PAGE;
+        m_page_slot.resize(m_pages);
+        return 0;
+    }
+
+    IOAlloc get_io_alloc() {
+        return IOAlloc{{this, &HugePageAllocator::allocator},
+                       {this, &HugePageAllocator::deallocator}};
+    }
+
+    bool hugetlb() {
+        return m_hugetlb;
+    }
+
+protected:
+    char *m_map = nullptr, *m_base = nullptr;
+    size_t m_map_size = 0, m_pages = 0, m_used_pages = 0;
+    bool m_hugetlb = false;
+    std::vector<uint8_t> m_page_slot; // size slot of each carved hugepage
+    std::vector<void *> m_free[N_SLOTS];
+
+    static int get_slot(size_t size) {
+        int i = 0;
+        while (((size_t)4096 << i) < size)
+            i++;
+        return i;
+    }
+
+    // carves a hugepage into the free list of `slot`
+    bool carve(int slot) {
+        if (m_used_pages == m_pages)
+            return false;
+        auto page = m_base + m_used_pages * HUGE_PAGE;
+        m_page_slot[m_used_pages++] = slot;
+        size_t size = (size_t)4096 << slot;
+        for (size_t i = HUGE_PAGE / size; i > 0; i--)
+            m_free[slot].push_back(page + (i - 1) * size);
+        return true;
+    }
+
+    int allocator(IOAlloc::RangeSize size, void **ptr) {
+        assert(size.min > 0 && size.max >= size.min);
+        if ((size_t)size.min <= MAX_ALLOCATION_SIZE) {
+            if ((size_t)size.max > MAX_ALLOCATION_SIZE)
+                size.max = MAX_ALLOCATION_SIZE;
+            auto slot = get_slot(size.max);
+            auto &list = m_free[slot];
+            if (!list.empty() || carve(slot)) {
+                *ptr = list.back();
+                list.pop_back();
+                return size.max;
+            }
+        }
+        int err = ::posix_memalign(ptr, 4096, (size_t)size.max);
+        if (err) {
+            errno = err;
+            return -1;
+        }
+        return size.max;
+    }
+
+    int deallocator(void *ptr) {
+        if (ptr < m_base || ptr >= m_base + m_pages * HUGE_PAGE) {
+            ::free(ptr);
+            return 0;
+        }
+        auto slot = m_page_slot[((char *)ptr - m_base) / HUGE_PAGE];
+        m_free[slot].push_back(ptr);
+        return 0;
+    }
+};
+
 inline void ___example_of_pooled_allocator___() {
     PooledAllocator<1024 * 1024> x;
 }
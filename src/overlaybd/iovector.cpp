@@ -80,13 +80,13 @@ ssize_t iovector_view::slice(size_t count, off_t offset, iovector_view * /*OUT*/
             }
             if (count < ptr[cnt].iov_len)
                 ptr[cnt].iov_len = count;
-            pos += p.iov_len;
             ret += ptr[cnt].iov_len;
             count -= ptr[cnt].iov_len;
             cnt++;
             if (cnt == iov->iovcnt)
                 break;
         }
+        pos += p.iov_len;
     }
     iov->iovcnt = cnt;
     return ret;
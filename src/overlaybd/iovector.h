@@ -760,6 +760,23 @@ public:
         return view().slice(count, offset, iov);
     }
 
+    // generate the partial data in `iov`, which uses its own iovec array
+    // rather than allocating one, so a stack-allocated IOVector makes it
+    // free of heap allocation; `iov` is cleared first, and must have
+    // room for as many iovecs as this iovector has
+    ssize_t slice(size_t count, off_t offset, iovector * /*OUT*/ iov) const {
+        if (iov == nullptr || iov->capacity - iov->iov_begin < iovcnt())
+            return -1;
+        iov->clear();
+        if (count == 0)
+            return 0;
+        iov->resize(iovcnt());
+        auto vi = iov->view();
+        auto ret = view().slice(count, offset, &vi);
+        iov->resize(vi.iovcnt);
+        return ret;
+    }
+
     IOAlloc *get_allocator() {
         return allocator();
     }
@@ -870,10 +887,11 @@ public:
     explicit IOVectorEntity(uint16_t preserve = DEF_PRESERVE) : iovector(CAPACITY, preserve) {
     }
 
+    // the preserved room shrinks for as many as CAPACITY iovecs to fit in
     explicit IOVectorEntity(const struct iovec *iov, int iovcnt, uint16_t preserve = DEF_PRESERVE)
-        : iovector(CAPACITY, preserve) {
+        : iovector(CAPACITY, iovcnt + preserve > CAPACITY ? CAPACITY - iovcnt : preserve) {
         assert(iovcnt >= 0);
-        assert(iovcnt + preserve < CAPACITY);
+        assert(iovcnt <= CAPACITY);
         memcpy(begin(), iov, iovcnt * sizeof(*iov));
         iov_end += iovcnt;
     }
@@ -0,0 +1,102 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "memory.h"
+#include <map>
+#include <mutex>
+
+namespace Memory {
+
+static const char *NAME = "overlaybd_memory_bytes";
+static const char *HELP = "Memory held by the subsystems of overlaybd, of devices or of the node";
+
+static std::atomic<int64_t> node_total{0};
+// the threshold of shedding, INT64_MAX for no budget
+static std::atomic<int64_t> shed_mark{INT64_MAX};
+
+namespace {
+struct Node {
+    Metrics::Gauge *total = Metrics::gauge("overlaybd_memory_node_bytes",
+                                           "Memory accounted by overlaybd on the node");
+    Metrics::Gauge *budget = Metrics::gauge("overlaybd_memory_budget_bytes",
+                                            "Memory budget of overlaybd on the node, 0 for none");
+    Metrics::Counter *sheds =
+        Metrics::counter("overlaybd_memory_shedding_total",
+                         "Times a subsystem shed memory, or took none, over the mark");
+};
+
+Node &node() {
+    static Node n;
+    return n;
+}
+
+// the gauges of devices are removed with their last account
+std::mutex device_mutex;
+std::map<Metrics::Labels, int> device_accounts;
+} // namespace
+
+Account::Account(const char *subsystem, const std::string &device) {
+    if (device.empty()) {
+        m_gauge = Metrics::gauge(NAME, HELP, {{"subsystem", subsystem}});
+        return;
+    }
+    m_device_labels = {{"subsystem", subsystem}, {"device", device}};
+    std::lock_guard<std::mutex> lock(device_mutex);
+    device_accounts[m_device_labels]++;
+    m_gauge = Metrics::gauge(NAME, HELP, m_device_labels);
+}
+
+Account::~Account() {
+    sub(bytes());
+    if (m_device_labels.empty())
+        return;
+    std::lock_guard<std::mutex> lock(device_mutex);
+    auto it = device_accounts.find(m_device_labels);
+    if (--it->second == 0) {
+        device_accounts.erase(it);
+        Metrics::remove(m_device_labels);
+    }
+}
+
+void Account::add(int64_t bytes) {
+    if (bytes == 0)
+        return;
+    m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    m_gauge->inc(bytes);
+    node_total.fetch_add(bytes, std::memory_order_relaxed);
+    node().total->inc(bytes);
+}
+
+void set_budget(uint64_t bytes) {
+    node().budget->set(bytes);
+    shed_mark.store(bytes ? bytes / 100 * SHED_PERCENT : INT64_MAX, std::memory_order_relaxed);
+}
+
+uint64_t budget() {
+    return node().budget->value();
+}
+
+int64_t total() {
+    return node_total.load(std::memory_order_relaxed);
+}
+
+bool shedding() {
+    if (total() < shed_mark.load(std::memory_order_relaxed))
+        return false;
+    node().sheds->inc();
+    return true;
+}
+
+} // namespace Memory
@@ -0,0 +1,69 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <atomic>
+#include <string>
+#include "metrics.h"
+
+// Memory held by the subsystems of overlaybd, e.g. indexes and caches, is
+// accounted by subsystem, and by device for that held for a single device,
+// as the gauge `overlaybd_memory_bytes`. The sum over the node is checked
+// against a budget: once it's above SHED_PERCENT of it, the subsystems
+// holding memory that may be dropped, e.g. caches, shed some whenever they
+// would take more, so that the budget is rarely hit. Accounting is a relaxed
+// atomic add, so accounts may be updated on any vcpu.
+namespace Memory {
+
+const uint32_t SHED_PERCENT = 90;
+
+class Account {
+public:
+    // `device` is empty for memory of the node, or shared by devices
+    explicit Account(const char *subsystem, const std::string &device = "");
+    // what's left accounted is released
+    ~Account();
+    Account(const Account &) = delete;
+    Account &operator=(const Account &) = delete;
+
+    void add(int64_t bytes);
+    void sub(int64_t bytes) {
+        add(-bytes);
+    }
+    // accounts `bytes` in all, for memory whose size is known but not its changes
+    void set(int64_t bytes) {
+        add(bytes - m_bytes.load(std::memory_order_relaxed));
+    }
+    int64_t bytes() const {
+        return m_bytes.load(std::memory_order_relaxed);
+    }
+
+protected:
+    Metrics::Gauge *m_gauge;
+    Metrics::Labels m_device_labels;
+    std::atomic<int64_t> m_bytes{0};
+};
+
+// the budget of the node in bytes, 0 for none
+void set_budget(uint64_t bytes);
+uint64_t budget();
+
+// the bytes accounted by all the accounts of the node
+int64_t total();
+
+// whether the node is over SHED_PERCENT of its budget
+bool shedding();
+
+} // namespace Memory
@@ -0,0 +1,201 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "metrics.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace Metrics {
+
+const size_t Histogram::NBUCKETS;
+const uint64_t Histogram::BOUNDS[NBUCKETS] = {
+    50,     100,    250,     500,     1000,    2500,    5000,    10000,    25000,
+    50000,  100000, 250000,  500000,  1000000, 2500000, 5000000, 10000000, 20000000,
+};
+
+static void append_seconds(std::string &out, uint64_t us) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%" PRIu64 ".%06" PRIu64, us / 1000000, us % 1000000);
+    // trims the trailing zeros, "0.000050" as "0.00005", "1.000000" as "1"
+    std::string s = buf;
+    while (s.back() == '0')
+        s.pop_back();
+    if (s.back() == '.')
+        s.pop_back();
+    out += s;
+}
+
+static void append_series(std::string &out, const std::string &name, const char *suffix,
+                          const std::string &labels, const std::string &extra) {
+    out += name;
+    out += suffix;
+    if (!labels.empty() || !extra.empty()) {
+        out += '{';
+        out += labels;
+        if (!labels.empty() && !extra.empty())
+            out += ',';
+        out += extra;
+        out += '}';
+    }
+    out += ' ';
+}
+
+void Counter::render(std::string &out, const std::string &name,
+                     const std::string &labels) const {
+    append_series(out, name, "", labels, "");
+    out += std::to_string(value());
+    out += '\n';
+}
+
+void Gauge::render(std::string &out, const std::string &name,
+                   const std::string &labels) const {
+    append_series(out, name, "", labels, "");
+    out += std::to_string(value());
+    out += '\n';
+}
+
+void Histogram::observe(uint64_t us) {
+    auto i = std::lower_bound(BOUNDS, BOUNDS + NBUCKETS, us) - BOUNDS;
+    m_buckets[i].fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(us, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::bucket(size_t i) const {
+    uint64_t n = 0;
+    for (size_t k = 0; k <= std::min(i, NBUCKETS); k++)
+        n += m_buckets[k].load(std::memory_order_relaxed);
+    return n;
+}
+
+void Histogram::render(std::string &out, const std::string &name,
+                       const std::string &labels) const {
+    uint64_t n = 0;
+    for (size_t i = 0; i <= NBUCKETS; i++) {
+        n += m_buckets[i].load(std::memory_order_relaxed);
+        std::string le = "le=\"";
+        if (i < NBUCKETS)
+            append_seconds(le, BOUNDS[i]);
+        else
+            le += "+Inf";
+        le += '"';
+        append_series(out, name, "_bucket", labels, le);
+        out += std::to_string(n);
+        out += '\n';
+    }
+    append_series(out, name, "_sum", labels, "");
+    append_seconds(out, sum());
+    out += '\n';
+    // the buckets may be ahead of the count while being observed, so the
+    // count is taken as the sum of them, to be consistent with +Inf
+    append_series(out, name, "_count", labels, "");
+    out += std::to_string(n);
+    out += '\n';
+}
+
+enum class Type { COUNTER, GAUGE, HISTOGRAM };
+
+struct Family {
+    Type type;
+    std::string help;
+    // by the rendered labels
+    std::map<std::string, std::unique_ptr<Metric>> series;
+};
+
+static std::mutex registry_mutex;
+
+// never destructed, as metrics may be updated by threads still running at exit
+static std::map<std::string, Family> &registry() {
+    static auto families = new std::map<std::string, Family>;
+    return *families;
+}
+
+static std::string render_labels(const Labels &labels) {
+    std::string s;
+    for (auto &l : labels) {
+        if (!s.empty())
+            s += ',';
+        s += l.first;
+        s += "=\"";
+        for (char c : l.second) {
+            if (c == '\\' || c == '"')
+                s += '\\';
+            if (c == '\n') {
+                s += "\\n";
+                continue;
+            }
+            s += c;
+        }
+        s += '"';
+    }
+    return s;
+}
+
+template <typename T>
+static T *get_or_create(Type type, const char *name, const char *help, const Labels &labels) {
+    auto key = render_labels(labels);
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    auto it = registry().find(name);
+    if (it == registry().end())
+        it = registry().emplace(name, Family{type, help, {}}).first;
+    else if (it->second.type != type)
+        return nullptr;
+    auto &m = it->second.series[key];
+    if (!m)
+        m.reset(new T);
+    return static_cast<T *>(m.get());
+}
+
+Counter *counter(const char *name, const char *help, const Labels &labels) {
+    return get_or_create<Counter>(Type::COUNTER, name, help, labels);
+}
+
+Gauge *gauge(const char *name, const char *help, const Labels &labels) {
+    return get_or_create<Gauge>(Type::GAUGE, name, help, labels);
+}
+
+Histogram *histogram(const char *name, const char *help, const Labels &labels) {
+    return get_or_create<Histogram>(Type::HISTOGRAM, name, help, labels);
+}
+
+int remove(const Labels &labels) {
+    auto key = render_labels(labels);
+    int n = 0;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto &f : registry())
+        n += f.second.series.erase(key);
+    return n;
+}
+
+std::string render() {
+    static const char *types[] = {"counter", "gauge", "histogram"};
+    std::string out;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto &f : registry()) {
+        if (f.second.series.empty())
+            continue;
+        out += "# HELP " + f.first + " " + f.second.help + "\n";
+        out += "# TYPE " + f.first + " " + types[(int)f.second.type] + "\n";
+        for (auto &s : f.second.series)
+            s.second->render(out, f.first, s.first);
+    }
+    return out;
+}
+
+} // namespace Metrics
@@ -0,0 +1,111 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Metrics are kept in a process-wide registry and rendered in the text
+// format of Prometheus. Updating one is a relaxed atomic add, so that it
+// may be done from any vcpu; looking one up takes a lock, so call sites
+// keep the pointers, which stay valid until removed.
+namespace Metrics {
+
+using Labels = std::vector<std::pair<std::string, std::string>>;
+
+class Metric {
+public:
+    virtual ~Metric() = default;
+    virtual void render(std::string &out, const std::string &name,
+                        const std::string &labels) const = 0;
+};
+
+class Counter : public Metric {
+public:
+    void inc(uint64_t n = 1) {
+        m_value.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t value() const {
+        return m_value.load(std::memory_order_relaxed);
+    }
+    void render(std::string &out, const std::string &name,
+                const std::string &labels) const override;
+
+protected:
+    std::atomic<uint64_t> m_value{0};
+};
+
+class Gauge : public Metric {
+public:
+    void set(int64_t v) {
+        m_value.store(v, std::memory_order_relaxed);
+    }
+    void inc(int64_t n = 1) {
+        m_value.fetch_add(n, std::memory_order_relaxed);
+    }
+    void dec(int64_t n = 1) {
+        m_value.fetch_sub(n, std::memory_order_relaxed);
+    }
+    int64_t value() const {
+        return m_value.load(std::memory_order_relaxed);
+    }
+    void render(std::string &out, const std::string &name,
+                const std::string &labels) const override;
+
+protected:
+    std::atomic<int64_t> m_value{0};
+};
+
+// latencies observed in us, and exported in seconds, with fixed buckets
+// from 50us to 20s
+class Histogram : public Metric {
+public:
+    static const size_t NBUCKETS = 18;
+    static const uint64_t BOUNDS[NBUCKETS];
+
+    void observe(uint64_t us);
+    uint64_t count() const {
+        return m_count.load(std::memory_order_relaxed);
+    }
+    uint64_t sum() const {
+        return m_sum.load(std::memory_order_relaxed);
+    }
+    // # of observations no more than BOUNDS[i], or all for i == NBUCKETS
+    uint64_t bucket(size_t i) const;
+    void render(std::string &out, const std::string &name,
+                const std::string &labels) const override;
+
+protected:
+    std::atomic<uint64_t> m_buckets[NBUCKETS + 1] = {};
+    std::atomic<uint64_t> m_count{0};
+    std::atomic<uint64_t> m_sum{0};
+};
+
+// get or create the metric `name` with `labels`, nullptr if `name` has been
+// registered as another type
+Counter *counter(const char *name, const char *help, const Labels &labels = {});
+Gauge *gauge(const char *name, const char *help, const Labels &labels = {});
+Histogram *histogram(const char *name, const char *help, const Labels &labels = {});
+
+// remove the metrics of all names with exactly `labels`, e.g. those of a
+// device being closed, returns the # of them removed
+int remove(const Labels &labels);
+
+// all the metrics in the text exposition format
+std::string render();
+
+} // namespace Metrics
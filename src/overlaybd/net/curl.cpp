@@ -26,9 +26,11 @@
 
 namespace Net {
 static constexpr int poll_size = 16;
-static photon::Timer *g_timer;
-static CURLM *g_libcurl_multi;
-static photon::FD_Poller *g_poller;
+// libcurl multi handle and its event loop are owned by each vcpu
+static __thread photon::Timer *g_timer;
+static __thread CURLM *g_libcurl_multi;
+static __thread photon::FD_Poller *g_poller;
+static __thread bool g_http2;
 static CURLcode global_initialized;
 struct async_libcurl_operation {
     photon::condition_variable cv;
@@ -68,6 +70,14 @@ int curl_perform(CURL *curl, uint64_t timeout) {
     if (ret != CURLE_OK)
         LOG_ERROR_RETURN(ENXIO, ret, "failed to set libcurl private: ", curl_easy_strerror(ret));
     DEFER(curl_easy_setopt(curl, CURLOPT_PRIVATE, nullptr));
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    if (g_http2) {
+        // wait for a connection to the host that can be multiplexed,
+        // rather than opening a new one for each concurrent request
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    }
+#endif
     // this will cause set timeout
     CURLMcode mret = curl_multi_add_handle(g_libcurl_multi, curl);
     if (mret != CURLM_OK)
@@ -158,12 +168,29 @@ protected:
     }
 };
 
-static cURLLoop g_loop;
+static __thread cURLLoop *g_loop;
 
 // CAUTION: this feature is incomplete in curl
 int libcurl_set_pipelining(long val) {
     return curl_multi_setopt(g_libcurl_multi, CURLMOPT_PIPELINING, val);
 }
+int libcurl_set_http2(bool on) {
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    if (on && !(curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2))
+        LOG_ERROR_RETURN(ENOTSUP, -1, "libcurl is built without HTTP/2 support");
+    auto ret = curl_multi_setopt(g_libcurl_multi, CURLMOPT_PIPELINING,
+                                 on ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+    if (ret != CURLM_OK)
+        LOG_ERROR_RETURN(EIO, -1, "failed to set HTTP/2 multiplexing: ", curl_multi_strerror(ret));
+    g_http2 = on;
+    return 0;
+#else
+    if (on)
+        LOG_ERROR_RETURN(ENOTSUP, -1, "HTTP/2 multiplexing requires libcurl 7.47.0 or later");
+    return 0;
+#endif
+}
+
 // this feature seems not able to use in 7.29.0
 int libcurl_set_maxconnects(long val) {
     // return curl_multi_setopt(g_libcurl_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
@@ -179,7 +206,8 @@ __attribute__((destructor)) void global_fini() {
 }
 int libcurl_init(long flags, long pipelining, long maxconn) {
     g_poller = photon::new_fd_poller(nullptr);
-    g_loop.start();
+    g_loop = new cURLLoop;
+    g_loop->start();
     g_timer = new photon::Timer(-1UL, {nullptr, &on_timer});
     if (!g_timer)
         LOG_ERROR_RETURN(EFAULT, -1, "failed to create photon timer");
@@ -203,13 +231,16 @@ int libcurl_init(long flags, long pipelining, long maxconn) {
     return 0;
 }
 void libcurl_fini() {
-    g_loop.stop();
+    g_loop->stop();
+    delete g_loop;
+    g_loop = nullptr;
     CURLMcode ret = curl_multi_cleanup(g_libcurl_multi);
     if (ret != CURLM_OK)
         LOG_ERROR("libcurl-multi cleanup error: ", curl_multi_strerror(ret));
 
     if (g_timer) {
         delete g_timer;
+        g_timer = nullptr;
     }
 }
 
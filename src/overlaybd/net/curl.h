@@ -35,6 +35,11 @@ int libcurl_set_pipelining(long val);
 
 int libcurl_set_maxconnects(long val);
 
+// multiplex concurrent requests to the same host over a shared HTTP/2
+// connection of the current vcpu, negotiated over TLS and falling back
+// to HTTP/1.1 when the server doesn't support it
+int libcurl_set_http2(bool on);
+
 int curl_perform(CURL *curl, uint64_t timeout);
 
 void libcurl_fini();
@@ -421,6 +426,14 @@ public:
         ret = (CURLcode)Net::curl_perform(m_curl, timeout);
         return get_response_code();
     }
+    // uploads `size` bytes read from `rstream`, e.g. a chunk of a blob
+    template <typename R, typename W = DummyReaderWriter>
+    long PATCH(const char *url, R *rstream, size_t size,
+               W *wstream = (DummyReaderWriter *)nullptr, uint64_t timeout = -1) {
+        setopt(CURLOPT_INFILESIZE_LARGE, (long)size);
+        setopt(CURLOPT_CUSTOMREQUEST, "PATCH");
+        return PUT(url, rstream, wstream, timeout);
+    }
     long DELETE(const char *url, uint64_t timeout = -1) {
         setopt(CURLOPT_URL, url);
         setopt(CURLOPT_CUSTOMREQUEST, "DELETE");
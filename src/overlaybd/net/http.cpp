@@ -0,0 +1,537 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "http.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../alog.h"
+#include "../photon/syncio/fd-events.h"
+#include "../photon/thread.h"
+#include "../timeout.h"
+#include "../utility.h"
+
+namespace Net {
+
+// of the headers, chunk sizes and discarded bodies of a connection
+static const size_t kBufferSize = 16 * 1024;
+// a discarded body larger than this closes the connection, rather than
+// being read through
+static const size_t kMaxDrain = 64 * 1024;
+// idle connections are closed after this, before the servers do
+static const uint64_t kMaxIdleTime = 30L * 1000 * 1000;
+// resolved addresses of a host are kept for this long
+static const uint64_t kAddressLife = 60L * 1000 * 1000;
+static const int kMaxIov = 64;
+
+static int max_idle = 8;
+
+void http_set_max_idle(int n) {
+    max_idle = n;
+}
+
+namespace {
+
+struct URLParts {
+    bool tls = false;
+    std::string authority; // "host[:port]", as the Host header
+    std::string host, port;
+    std::string target;    // path and query
+    std::string key() const {
+        return (tls ? "https://" : "http://") + host + ":" + port;
+    }
+};
+
+bool parse_url(const char *url, URLParts &u) {
+    estring_view s(url);
+    if (s.starts_with("https://")) {
+        u.tls = true;
+        s = s.substr(8);
+    } else if (s.starts_with("http://")) {
+        s = s.substr(7);
+    } else {
+        return false;
+    }
+    auto slash = s.find('/');
+    auto authority = s.substr(0, slash);
+    if (authority.empty() || authority.find('@') != estring_view::npos)
+        return false;
+    u.authority = authority;
+    u.target = slash == estring_view::npos ? "/" : std::string(s.substr(slash));
+    auto colon = authority.rfind(':');
+    if (authority[0] == '[') { // IPv6 literal
+        auto bracket = authority.find(']');
+        if (bracket == estring_view::npos)
+            return false;
+        u.host = authority.substr(1, bracket - 1);
+        colon = bracket + 1 < authority.size() ? bracket + 1 : estring_view::npos;
+    } else {
+        u.host = authority.substr(0, colon);
+    }
+    if (colon != estring_view::npos)
+        u.port = authority.substr(colon + 1);
+    if (u.port.empty())
+        u.port = u.tls ? "443" : "80";
+    return true;
+}
+
+struct Connection {
+    int fd = -1;
+    SSL *ssl = nullptr;
+    uint64_t idle_since = 0;
+    size_t begin = 0, end = 0; // of the bytes read ahead in buf
+    char buf[kBufferSize];
+
+    ~Connection() {
+        if (ssl)
+            SSL_free(ssl);
+        if (fd >= 0) {
+            photon::fd_events_forget(fd);
+            ::close(fd);
+        }
+    }
+
+    // waits for the want of the last SSL call, or returns -1
+    int ssl_wait(int ret, Timeout &tmo) {
+        switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return photon::wait_for_fd_readable(fd, tmo.timeout());
+        case SSL_ERROR_WANT_WRITE:
+            return photon::wait_for_fd_writable(fd, tmo.timeout());
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0)
+                errno = ECONNRESET;
+            return -1;
+        default:
+            char msg[256];
+            ERR_error_string_n(ERR_get_error(), msg, sizeof(msg));
+            LOG_ERROR_RETURN(EPROTO, -1, "TLS error: `", msg);
+        }
+    }
+
+    int handshake(const URLParts &u, SSL_CTX *ctx, Timeout &tmo) {
+        ssl = SSL_new(ctx);
+        if (!ssl)
+            LOG_ERROR_RETURN(ENOMEM, -1, "failed to create TLS session");
+        SSL_set_fd(ssl, fd);
+        SSL_set_tlsext_host_name(ssl, u.host.c_str());
+        X509_VERIFY_PARAM_set1_host(SSL_get0_param(ssl), u.host.c_str(), 0);
+        int ret;
+        while ((ret = SSL_connect(ssl)) != 1) {
+            if (ssl_wait(ret, tmo) < 0)
+                LOG_ERRNO_RETURN(0, -1, "failed TLS handshake with `", u.authority);
+        }
+        return 0;
+    }
+
+    ssize_t send(const char *data, size_t size, Timeout &tmo) {
+        while (size) {
+            ssize_t ret;
+            if (ssl) {
+                ret = SSL_write(ssl, data, size);
+                if (ret <= 0) {
+                    if (ssl_wait(ret, tmo) < 0)
+                        return -1;
+                    continue;
+                }
+            } else {
+                ret = ::send(fd, data, size, MSG_NOSIGNAL);
+                if (ret < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno != EAGAIN ||
+                        photon::wait_for_fd_writable(fd, tmo.timeout()) < 0)
+                        return -1;
+                    continue;
+                }
+            }
+            data += ret;
+            size -= ret;
+        }
+        return 0;
+    }
+
+    // some bytes into the iovecs, 0 at the end of the stream
+    ssize_t readv(const struct iovec *iov, int iovcnt, Timeout &tmo) {
+        while (true) {
+            if (ssl) {
+                auto ret = SSL_read(ssl, iov[0].iov_base, std::min(iov[0].iov_len, (size_t)INT_MAX));
+                if (ret > 0)
+                    return ret;
+                auto err = SSL_get_error(ssl, ret);
+                if (err == SSL_ERROR_ZERO_RETURN || (err == SSL_ERROR_SYSCALL && errno == 0))
+                    return 0;
+                if (ssl_wait(ret, tmo) < 0)
+                    return -1;
+            } else {
+                auto ret = ::readv(fd, iov, iovcnt);
+                if (ret >= 0)
+                    return ret;
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN || photon::wait_for_fd_readable(fd, tmo.timeout()) < 0)
+                    return -1;
+            }
+        }
+    }
+
+    // a line ending with CRLF, without it
+    int read_line(estring_view &line, Timeout &tmo) {
+        while (true) {
+            auto p = (char *)memmem(buf + begin, end - begin, "\r\n", 2);
+            if (p) {
+                line = estring_view(buf + begin, p - buf - begin);
+                begin = p + 2 - buf;
+                return 0;
+            }
+            if (begin > 0) {
+                memmove(buf, buf + begin, end - begin);
+                end -= begin;
+                begin = 0;
+            }
+            if (end == kBufferSize)
+                LOG_ERROR_RETURN(EPROTO, -1, "too long a line in the response");
+            struct iovec iov{buf + end, kBufferSize - end};
+            auto ret = readv(&iov, 1, tmo);
+            if (ret <= 0) {
+                if (ret == 0)
+                    errno = ECONNRESET;
+                return -1;
+            }
+            end += ret;
+        }
+    }
+
+    // `n` bytes of the body into `w`, those beyond its room dropped, or
+    // discarded if it's nullptr; up to the end of the stream if `to_end`
+    int read_body(IOVWriter *w, size_t n, bool to_end, Timeout &tmo) {
+        auto take = std::min(n, end - begin);
+        if (take && w)
+            w->write(buf + begin, take);
+        begin += take;
+        n -= take;
+        while (n) {
+            struct iovec iov[kMaxIov];
+            int cnt = 0;
+            if (w) {
+                auto src = w->iovec();
+                size_t left = n;
+                for (int i = 0; i < w->iovcnt() && cnt < kMaxIov && left; i++) {
+                    if (src[i].iov_len == 0)
+                        continue;
+                    iov[cnt] = {src[i].iov_base, std::min(src[i].iov_len, left)};
+                    left -= iov[cnt++].iov_len;
+                }
+            }
+            bool direct = cnt > 0;
+            if (!direct) // the read ahead are all taken
+                iov[cnt++] = {buf, std::min(n, kBufferSize)};
+            auto ret = readv(iov, cnt, tmo);
+            if (ret <= 0) {
+                if (ret == 0 && to_end)
+                    return 0;
+                if (ret == 0)
+                    errno = ECONNRESET;
+                return -1;
+            }
+            if (direct)
+                w->extract_front(ret);
+            else if (w)
+                w->drop += ret;
+            n -= ret;
+        }
+        return 0;
+    }
+};
+
+struct Address {
+    sockaddr_storage addr;
+    socklen_t len;
+};
+
+// the connections and resolved addresses of a vcpu, as are the fds
+// registered to its event engine
+struct VcpuState {
+    std::unordered_map<std::string, std::vector<Connection *>> idle;
+    std::unordered_map<std::string, std::pair<std::vector<Address>, uint64_t>> addresses;
+    SSL_CTX *ctx = nullptr;
+    std::string cafile;
+
+    ~VcpuState() {
+        for (auto &it : idle)
+            for (auto c : it.second)
+                delete c;
+        if (ctx)
+            SSL_CTX_free(ctx);
+    }
+
+    SSL_CTX *ssl_ctx(const char *ca) {
+        if (ctx && cafile == ca)
+            return ctx;
+        static std::once_flag once;
+        std::call_once(once, [] { SSL_library_init(); });
+        auto c = SSL_CTX_new(SSLv23_client_method());
+        if (!c)
+            LOG_ERROR_RETURN(ENOMEM, nullptr, "failed to create TLS context");
+        SSL_CTX_set_options(c, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION);
+        SSL_CTX_set_mode(c, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        SSL_CTX_set_verify(c, SSL_VERIFY_PEER, nullptr);
+        auto ret = *ca ? SSL_CTX_load_verify_locations(c, ca, nullptr)
+                       : SSL_CTX_set_default_verify_paths(c);
+        if (ret != 1) {
+            SSL_CTX_free(c);
+            LOG_ERROR_RETURN(EINVAL, nullptr, "failed to load CA certificates `", ca);
+        }
+        static const unsigned char alpn[] = "\x08http/1.1";
+        SSL_CTX_set_alpn_protos(c, alpn, sizeof(alpn) - 1);
+        if (ctx)
+            SSL_CTX_free(ctx);
+        ctx = c;
+        cafile = ca;
+        return ctx;
+    }
+
+    int resolve(const URLParts &u, std::vector<Address> &addrs) {
+        auto key = u.key();
+        auto it = addresses.find(key);
+        if (it != addresses.end() && it->second.second > photon::now) {
+            addrs = it->second.first;
+            return 0;
+        }
+        struct addrinfo hints = {}, *res;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        auto host = u.host.c_str();
+        int ret = getaddrinfo(host, u.port.c_str(), &hints, &res);
+        if (ret != 0)
+            LOG_ERROR_RETURN(EHOSTUNREACH, -1, "failed to resolve `: `", host, gai_strerror(ret));
+        DEFER(freeaddrinfo(res));
+        addrs.clear();
+        for (auto p = res; p; p = p->ai_next) {
+            Address a;
+            memcpy(&a.addr, p->ai_addr, p->ai_addrlen);
+            a.len = p->ai_addrlen;
+            addrs.push_back(a);
+        }
+        addresses[key] = {addrs, photon::now + kAddressLife};
+        return 0;
+    }
+
+    Connection *connect(const URLParts &u, const char *cafile, Timeout &tmo) {
+        std::vector<Address> addrs;
+        if (resolve(u, addrs) < 0)
+            return nullptr;
+        for (auto &a : addrs) {
+            std::unique_ptr<Connection> c(new Connection);
+            c->fd = ::socket(a.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (c->fd < 0)
+                LOG_ERRNO_RETURN(0, nullptr, "failed to create socket");
+            int one = 1;
+            setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (::connect(c->fd, (sockaddr *)&a.addr, a.len) < 0) {
+                if (errno != EINPROGRESS)
+                    continue;
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (photon::wait_for_fd_writable(c->fd, tmo.timeout()) < 0) {
+                    if (errno == EINTR)
+                        return nullptr;
+                    continue;
+                }
+                if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+                    continue;
+            }
+            if (u.tls) {
+                auto ctx = ssl_ctx(cafile);
+                if (!ctx || c->handshake(u, ctx, tmo) < 0)
+                    return nullptr;
+            }
+            return c.release();
+        }
+        addresses.erase(u.key());
+        LOG_ERROR_RETURN(ECONNREFUSED, nullptr, "failed to connect to `", u.authority);
+    }
+
+    // an idle connection still open, or a new one
+    Connection *get(const URLParts &u, const char *cafile, Timeout &tmo, bool &reused) {
+        auto &pool = idle[u.key()];
+        while (!pool.empty()) {
+            auto c = pool.back();
+            pool.pop_back();
+            char ch;
+            if (photon::now - c->idle_since < kMaxIdleTime &&
+                ::recv(c->fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN) {
+                reused = true;
+                return c;
+            }
+            delete c; // closed by the server, or too old
+        }
+        reused = false;
+        return connect(u, cafile, tmo);
+    }
+
+    void put(const URLParts &u, Connection *c) {
+        auto &pool = idle[u.key()];
+        if ((int)pool.size() >= max_idle) {
+            delete c;
+            return;
+        }
+        c->idle_since = photon::now;
+        pool.push_back(c);
+    }
+};
+
+static __thread VcpuState *g_state;
+
+VcpuState *state() {
+    if (!g_state)
+        g_state = new VcpuState;
+    return g_state;
+}
+
+// a request and its response over `c`; returns the status code, or 0;
+// `keep` tells whether `c` may be reused, and `responded` whether any
+// byte of the response has arrived
+long get_once(Connection *c, const URLParts &u, off_t offset, size_t count, HeaderMap *headers,
+              BodyTarget target, Timeout &tmo, bool &keep, bool &responded) {
+    keep = responded = false;
+    char range[64];
+    if (offset >= 0)
+        snprintf(range, sizeof(range), "%lu-%lu", (uint64_t)offset, (uint64_t)offset + count - 1);
+    else
+        strcpy(range, "0-0");
+    auto req = "GET " + u.target + " HTTP/1.1\r\nHost: " + u.authority +
+               "\r\nRange: bytes=" + range + "\r\nAccept: */*\r\n\r\n";
+    if (c->send(req.data(), req.size(), tmo) < 0)
+        LOG_ERRNO_RETURN(0, 0, "failed to send request to `", u.authority);
+
+    estring_view line;
+    long code;
+    bool http11;
+    HeaderMap h;
+    do { // skipping interim responses
+        if (c->read_line(line, tmo) < 0)
+            return 0;
+        responded = true;
+        if (!line.starts_with("HTTP/1.") || line.size() < 12)
+            LOG_ERROR_RETURN(EPROTO, 0, "bad status line from `", u.authority);
+        http11 = line[7] != '0';
+        code = atol(line.data() + 9);
+        while (true) {
+            if (c->read_line(line, tmo) < 0)
+                return 0;
+            if (line.empty())
+                break;
+            h.write(line.data(), line.size());
+            if (headers)
+                headers->write(line.data(), line.size());
+        }
+    } while (code / 100 == 1);
+
+    auto te = h.find("transfer-encoding");
+    bool chunked = te != h.end() && te->second.find("chunked") != std::string::npos;
+    int64_t length = -1;
+    if (!chunked)
+        h.try_get("content-length", length);
+    auto conn = h.find("connection");
+    keep = http11 && (chunked || length >= 0) &&
+           !(conn != h.end() && strcasecmp(conn->second.c_str(), "close") == 0);
+    if (code == 204 || code == 304)
+        return code;
+
+    IOVWriter *w = nullptr;
+    if (code / 100 == 2 && target)
+        w = target();
+    if (!chunked) {
+        if (!w && (length < 0 || (size_t)length > kMaxDrain)) {
+            keep = false;
+            return code;
+        }
+        if (c->read_body(w, length < 0 ? SIZE_MAX : length, length < 0, tmo) < 0)
+            LOG_ERRNO_RETURN(0, 0, "failed to read response from `", u.authority);
+        return code;
+    }
+    size_t drained = 0;
+    while (true) {
+        if (c->read_line(line, tmo) < 0)
+            LOG_ERRNO_RETURN(0, 0, "failed to read response from `", u.authority);
+        size_t size = strtoull(std::string(line).c_str(), nullptr, 16);
+        if (size == 0)
+            break;
+        if (!w && (drained += size) > kMaxDrain) {
+            keep = false;
+            return code;
+        }
+        if (c->read_body(w, size, false, tmo) < 0 || c->read_line(line, tmo) < 0)
+            LOG_ERRNO_RETURN(0, 0, "failed to read response from `", u.authority);
+    }
+    do { // trailers
+        if (c->read_line(line, tmo) < 0)
+            return 0;
+    } while (!line.empty());
+    return code;
+}
+
+} // namespace
+
+long http_get(const char *url, off_t offset, size_t count, HeaderMap *headers,
+              BodyTarget target, uint64_t timeout, const char *cafile) {
+    URLParts u;
+    if (!parse_url(url, u))
+        LOG_ERROR_RETURN(EINVAL, 0, "unsupported url `", url);
+    Timeout tmo(timeout);
+    auto s = state();
+    for (int attempt = 0;; attempt++) {
+        bool reused, keep, responded;
+        auto c = s->get(u, cafile ? cafile : "", tmo, reused);
+        if (!c)
+            return 0;
+        auto code = get_once(c, u, offset, count, headers, target, tmo, keep, responded);
+        ERRNO eno;
+        if (code > 0 && keep)
+            s->put(u, c);
+        else
+            delete c;
+        errno = eno.no;
+        if (code > 0)
+            return code;
+        // a kept-alive connection closed by the server as the request went
+        // out is retried on a new one
+        if (!reused || responded || errno == EINTR || attempt)
+            return 0;
+    }
+}
+
+void http_fini() {
+    delete g_state;
+    g_state = nullptr;
+}
+
+} // namespace Net
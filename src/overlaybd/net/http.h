@@ -0,0 +1,47 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <sys/types.h>
+#include "curl.h"
+#include "../callback.h"
+
+// A photon-native HTTP/1.1 client for the hot path of ranged GETs of blobs,
+// whose urls are already resolved, e.g. redirected and signed. Connections,
+// plain or TLS, are kept alive in a pool of each host of the vcpu, and the
+// body is read by readv() straight into the iovecs of the destination.
+// Redirects and authentication are left to cURL: a status code other than
+// 2xx is returned as is, with the body discarded.
+namespace Net {
+
+// the writer the body of a 2xx response is read into, asked for once the
+// headers arrive; nullptr for the body to be discarded
+using BodyTarget = Delegate<IOVWriter *>;
+
+// GET the bytes [offset, offset + count) of `url`, "http://" or "https://",
+// or only its first byte for a negative offset; the headers of the response
+// go to `headers` if given. `cafile` verifies the peer of https, the
+// default paths of OpenSSL if empty. Returns the status code, or 0 for a
+// failed connection or transfer with errno set, EINTR if interrupted.
+long http_get(const char *url, off_t offset, size_t count, HeaderMap *headers,
+              BodyTarget target, uint64_t timeout, const char *cafile = "");
+
+// the idle connections kept of each host on a vcpu, 8 by default
+void http_set_max_idle(int max_idle);
+
+// close the idle connections of the current vcpu
+void http_fini();
+
+} // namespace Net
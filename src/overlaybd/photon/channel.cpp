@@ -0,0 +1,56 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "channel.h"
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "syncio/fd-events.h"
+#include "../alog.h"
+
+namespace photon {
+MPSCChannel::~MPSCChannel() {
+    if (m_fd >= 0) {
+        fd_events_forget(m_fd);
+        close(m_fd);
+    }
+}
+
+void MPSCChannel::notify() {
+    uint64_t one = 1;
+    if (write(m_fd, &one, sizeof(one)) != sizeof(one))
+        LOG_ERRNO_RETURN(0, , "failed to signal the eventfd of channel");
+}
+
+mpsc_node *MPSCChannel::recv(uint64_t timeout) {
+    while (true) {
+        if (auto list = try_recv())
+            return list;
+        if (wait_for_fd_readable(m_fd, timeout) < 0)
+            return try_recv();
+        // only a stale signal gets nothing, left by a burst already drained
+        uint64_t count;
+        (void)read(m_fd, &count, sizeof(count));
+    }
+}
+
+MPSCChannel *new_mpsc_channel() {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to create eventfd for channel");
+    auto ch = new MPSCChannel;
+    ch->m_fd = fd;
+    return ch;
+}
+} // namespace photon
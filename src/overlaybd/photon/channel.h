@@ -0,0 +1,75 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <inttypes.h>
+#include <atomic>
+
+namespace photon {
+// to be embedded in the items sent through an MPSCChannel
+struct mpsc_node {
+    mpsc_node *mpsc_next = nullptr;
+};
+
+// a lock-free multi-producer / single-consumer channel, handing items from any
+// OS threads to a photon thread; only the producer sending to an empty channel
+// signals its eventfd, so a burst of items is drained with a single wakeup
+class MPSCChannel {
+public:
+    ~MPSCChannel();
+
+    // from any thread, never blocks
+    void send(mpsc_node *node) {
+        auto head = m_head.load(std::memory_order_relaxed);
+        do {
+            node->mpsc_next = head;
+        } while (!m_head.compare_exchange_weak(head, node, std::memory_order_release,
+                                               std::memory_order_relaxed));
+        if (!head)
+            notify();
+    }
+
+    // takes all the items sent, as a list in FIFO order linked by `mpsc_next`,
+    // or nullptr if none; never blocks
+    mpsc_node *try_recv() {
+        auto node = m_head.exchange(nullptr, std::memory_order_acquire);
+        mpsc_node *list = nullptr;
+        while (node) {
+            auto next = node->mpsc_next;
+            node->mpsc_next = list;
+            list = node;
+            node = next;
+        }
+        return list;
+    }
+
+    // the same as try_recv(), but waits up to `timeout` in current photon thread
+    // if none, which requires fd events of the vcpu; returns nullptr with errno
+    // set, if timed out or interrupted
+    mpsc_node *recv(uint64_t timeout = -1);
+
+    int fd() const {
+        return m_fd;
+    }
+
+protected:
+    std::atomic<mpsc_node *> m_head{nullptr};
+    int m_fd = -1; // eventfd
+    void notify();
+    friend MPSCChannel *new_mpsc_channel();
+};
+
+MPSCChannel *new_mpsc_channel();
+} // namespace photon
@@ -0,0 +1,130 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "offload.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "channel.h"
+#include "../alog.h"
+
+namespace photon {
+// completion of the offloaded tasks of a vcpu
+struct OffloadCompletion {
+    MPSCChannel *channel = nullptr;
+    thread *reaper = nullptr; // exits when no more in flight
+    uint32_t inflight = 0;
+    ~OffloadCompletion() {
+        delete channel;
+    }
+};
+static thread_local OffloadCompletion offload_completion;
+
+struct OffloadTask : public mpsc_node {
+    thread_entry func;
+    void *arg;
+    void *retval = nullptr;
+    OffloadCompletion *completion;
+    semaphore done{0};
+};
+
+static void *reap(void *arg) {
+    auto c = (OffloadCompletion *)arg;
+    while (c->inflight > 0) {
+        auto node = c->channel->recv();
+        while (node) {
+            auto next = node->mpsc_next;
+            c->inflight--;
+            static_cast<OffloadTask *>(node)->done.signal(1);
+            node = next;
+        }
+    }
+    c->reaper = nullptr;
+    return nullptr;
+}
+
+class OffloadPoolImpl : public OffloadPool {
+public:
+    ~OffloadPoolImpl() {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_stopping = true;
+        }
+        m_cond.notify_all();
+        for (auto &th : m_threads)
+            th.join();
+    }
+
+    void start(uint32_t nthreads) {
+        for (uint32_t i = 0; i < nthreads; i++)
+            m_threads.emplace_back(&OffloadPoolImpl::work, this);
+    }
+
+    void *await(thread_entry func, void *arg) override {
+        auto c = &offload_completion;
+        if (!get_vcpu()->event_engine || (!c->channel && !(c->channel = new_mpsc_channel())))
+            return func(arg);
+        OffloadTask task;
+        task.func = func;
+        task.arg = arg;
+        task.completion = c;
+        c->inflight++;
+        if (!c->reaper)
+            c->reaper = thread_create(&reap, c);
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_queue.push_back(&task);
+        }
+        m_cond.notify_one();
+        // not to be interrupted, as the task is on this stack
+        while (task.done.wait(1) < 0)
+            ;
+        return task.retval;
+    }
+
+protected:
+    std::vector<std::thread> m_threads;
+    std::mutex m_mtx;
+    std::condition_variable m_cond;
+    std::deque<OffloadTask *> m_queue;
+    bool m_stopping = false;
+
+    void work() {
+        while (true) {
+            OffloadTask *task;
+            {
+                std::unique_lock<std::mutex> lock(m_mtx);
+                m_cond.wait(lock, [&] { return m_stopping || !m_queue.empty(); });
+                if (m_queue.empty())
+                    return;
+                task = m_queue.front();
+                m_queue.pop_front();
+            }
+            task->retval = task->func(task->arg);
+            task->completion->channel->send(task);
+        }
+    }
+};
+
+OffloadPool *new_offload_pool(uint32_t nthreads) {
+    if (nthreads == 0)
+        LOG_ERROR_RETURN(EINVAL, nullptr, "invalid # of offload threads `", nthreads);
+    auto pool = new OffloadPoolImpl;
+    pool->start(nthreads);
+    return pool;
+}
+} // namespace photon
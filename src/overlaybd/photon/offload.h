@@ -0,0 +1,49 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include "thread.h"
+
+namespace photon {
+// a pool of native OS threads, running CPU-heavy work (decompression,
+// digests, etc.) out of the photon vcpus; results are handed back through
+// an MPSCChannel of each vcpu, drained in batches by a photon thread there
+class OffloadPool {
+public:
+    virtual ~OffloadPool() {
+    }
+
+    // runs `func(arg)` in a worker thread, blocking only current photon
+    // thread until done, and returns what it returns; the vcpu requires
+    // fd events, and runs `func` in place without them
+    virtual void *await(thread_entry func, void *arg) = 0;
+
+    // runs `f()` in a worker thread, which may return results by the captures
+    template <typename F>
+    void run(F &&f) {
+        await(&stub<F>, &f);
+    }
+
+protected:
+    template <typename F>
+    static void *stub(void *f) {
+        (*(F *)f)();
+        return nullptr;
+    }
+};
+
+// `nthreads` native threads, waiting for work when idle
+OffloadPool *new_offload_pool(uint32_t nthreads);
+} // namespace photon
@@ -36,10 +36,11 @@
 namespace photon {
 const int EOK = ENXIO;
 const uint64_t IODEPTH = 2048;
-static int evfd, running;
-static io_context_t aio_ctx;
-static thread *polling_thread = nullptr;
-static condition_variable cond;
+// the libaio context is owned by each vcpu
+static __thread int evfd, running;
+static __thread io_context_t aio_ctx;
+static __thread thread *polling_thread = nullptr;
+static thread_local condition_variable cond;
 
 template <typename F>
 ssize_t have_n_try(const F &f, const char *name, ssize_t error_level = 0) {
@@ -71,11 +72,8 @@ struct libaiocb : public iocb {
         struct io_event cancel_ret;
         HAVE_N_TRY(io_cancel, (aio_ctx, this, &cancel_ret));
     }
-    ssize_t submit_and_wait(uint64_t timedout = -1) {
-        io_set_eventfd(this, evfd);
-        this->data = CURRENT;
+    int submit() {
         auto piocb = (iocb *)this;
-
         while (true) {
             int ret = io_submit(aio_ctx, 1, &piocb);
             if (ret == 1)
@@ -98,6 +96,13 @@ struct libaiocb : public iocb {
                 return -1;
             }
         }
+        return 0;
+    }
+    ssize_t submit_and_wait(uint64_t timedout = -1) {
+        io_set_eventfd(this, evfd);
+        this->data = CURRENT;
+        if (submit() < 0)
+            return -1;
 
         int ret = thread_usleep(timedout);
         if (ret == 0) // timedout
@@ -130,6 +135,25 @@ struct libaiocb : public iocb {
     }
 };
 
+// an I/O not waited for, deleted once `done` is fired by the reaper
+struct libaiocb_async : public libaiocb {
+    Callback<ssize_t, int> done;
+
+    template <typename F, typename... ARGS>
+    static int submit(Callback<ssize_t, int> done, F io_prep, ARGS... args) {
+        auto piocb = new libaiocb_async;
+        io_prep(piocb, args...);
+        io_set_eventfd(piocb, evfd);
+        piocb->data = nullptr;
+        piocb->done = done;
+        if (piocb->libaiocb::submit() < 0) {
+            delete piocb;
+            return -1;
+        }
+        return 0;
+    }
+};
+
 static int my_io_getevents(long min_nr, long nr, struct io_event *events) {
     int ret = ::io_getevents(aio_ctx, min_nr, nr, events, NULL);
     if (ret < 0)
@@ -148,6 +172,13 @@ static void resume_libaio_requesters() {
                      VALUE(events[i].obj), VALUE(piocb->aio_lio_opcode), VALUE(piocb->aio_fildes),
                      VALUE(piocb->u.c.offset), VALUE(piocb->u.c.nbytes), VALUE(piocb->u.c.buf),
                      VALUE(piocb->u.c.resfd));
+        if (!events[i].data) {
+            auto piocb_async = static_cast<libaiocb_async *>(piocb);
+            auto ret = (ssize_t)events[i].res;
+            piocb_async->done(ret < 0 ? -1 : ret, ret < 0 ? (int)-ret : 0);
+            delete piocb_async;
+            continue;
+        }
         thread_interrupt((thread *)events[i].data, EOK);
     }
 }
@@ -261,6 +292,15 @@ ssize_t libaio_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset
     return libaiocb().asyncio(&io_prep_pwritev, fd, iov, iovcnt, offset);
 }
 
+int libaio_preadv_async(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                        Callback<ssize_t, int> done) {
+    return libaiocb_async::submit(done, &io_prep_preadv, fd, iov, iovcnt, offset);
+}
+int libaio_pwritev_async(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                         Callback<ssize_t, int> done) {
+    return libaiocb_async::submit(done, &io_prep_pwritev, fd, iov, iovcnt, offset);
+}
+
 ssize_t posixaio_pread(int fd, void *buf, size_t count, off_t offset) {
     static int n;
     Counter c(n);
@@ -339,6 +379,7 @@ int libaio_wrapper_fini() {
         thread_usleep(1000 * 10);
 
     io_destroy(aio_ctx);
+    fd_events_forget(evfd);
     close(evfd);
     evfd = 0;
     return 0;
@@ -16,6 +16,7 @@
 #pragma once
 #include <sys/types.h>
 #include <sys/uio.h>
+#include "../../callback.h"
 
 // aio wrapper depends on fd-events ( fd_events_epoll_init() )
 namespace photon {
@@ -31,7 +32,17 @@ ssize_t libaio_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset
 static int libaio_fsync(int fd) {
     return 0;
 }
+}
+
+// submit the I/O without waiting for it; `done` is fired with its result, and
+// the errno on failure, by the thread reaping the completions of current vcpu,
+// so it must not block; -1 is returned if it fails to be submitted
+int libaio_preadv_async(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                        Callback<ssize_t, int> done);
+int libaio_pwritev_async(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                         Callback<ssize_t, int> done);
 
+extern "C" {
 ssize_t posixaio_pread(int fd, void *buf, size_t count, off_t offset);
 ssize_t posixaio_pwrite(int fd, const void *buf, size_t count, off_t offset);
 int posixaio_fsync(int fd);
@@ -51,6 +62,14 @@ struct libaio {
     static ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
         return libaio_pwritev(fd, iov, iovcnt, offset);
     }
+    static int async_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                            Callback<ssize_t, int> done) {
+        return libaio_preadv_async(fd, iov, iovcnt, offset, done);
+    }
+    static int async_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                             Callback<ssize_t, int> done) {
+        return libaio_pwritev_async(fd, iov, iovcnt, offset, done);
+    }
     static int fsync(int fd) {
         return libaio_fsync(fd);
     }
@@ -17,6 +17,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <vector>
+#include <algorithm>
 #include <mutex>
 #include <thread>
 #include <chrono>
@@ -26,6 +27,8 @@
 #include <atomic>
 #include <bitset>
 #include <sched.h>
+#include <stdlib.h>
+#include <new>
 #include "../queue.h"
 #include "../thread.h"
 #include "../../utility.h"
@@ -86,14 +89,6 @@ public:
         }
         return 0;
     }
-    void cancel(int fd) {
-    again:
-        int ret = ctl(fd, EPOLL_CTL_DEL, 0, nullptr, ENOENT, EBADF);
-        if (ret < 0 && ret != -ENOENT && ret != -EBADF) {
-            thread_usleep(1000);
-            goto again;
-        }
-    }
     int do_wait_for_events(uint64_t timeout) {
         int ret = photon::thread_usleep(timeout);
         auto eno = &errno;
@@ -108,26 +103,6 @@ public:
         }
         return 0;
     }
-    int wait_for_events(int fd, uint32_t events, uint64_t timeout) {
-        int ret = ctl(fd, EPOLL_CTL_ADD, events, CURRENT);
-        if (ret < 0)
-            return -1;
-
-        DEFER(cancel(fd));
-        ret = do_wait_for_events(timeout);
-        if (ret < 0)
-            LOG_DEBUG(VALUE(fd), VALUE(events));
-        return ret;
-    }
-    int fd_interest(int fd, uint32_t events, void *data) {
-        if (events == 0)
-            return ctl(fd, EPOLL_CTL_DEL, events, data, ENOENT, EBADF);
-
-        int ret = ctl(fd, EPOLL_CTL_ADD, events, data, EEXIST);
-        if (ret == -EEXIST)
-            ret = ctl(fd, EPOLL_CTL_MOD, events, data);
-        return ret;
-    }
     int wait(epoll_event *events, int maxevents, int timeout_ms) {
     again:
         int ret = epoll_wait(epfd, events, maxevents, timeout_ms);
@@ -144,16 +119,73 @@ public:
     }
 };
 
-template <int MAX_EVENTS>
-struct EPWaiter {
-    epoll_event events[MAX_EVENTS];
-    int n;
-    EPWaiter(EPoll *epoll, int timeout_ms) {
-        n = epoll->wait(events, MAX_EVENTS, timeout_ms);
+// max # of events harvested by a single epoll_wait()
+static const int MAX_EVENTS = 128;
+
+// the poller of FD_Poller, whose interests are set by users. Interest
+// changes are coalesced per fd, and applied together right before the
+// next harvest, so an fd changed many times in between costs 1 epoll_ctl().
+// While the poller is sleeping in wait_for_fds(), changes, e.g. by the users
+// of other threads, are applied at once, or they would not be seen.
+class PollerEPoll : public EPoll {
+public:
+    struct Interest {
+        void *data;
+        uint32_t events;
+        bool registered;
+        bool queued;
+    };
+    std::vector<Interest> interests;
+    std::vector<int> changed;
+    bool sleeping = false;
+
+    int fd_interest(int fd, uint32_t events, void *data) {
+        if (fd < 0)
+            LOG_ERROR_RETURN(EBADF, -1, "invalid fd ", fd);
+        if ((size_t)fd >= interests.size())
+            interests.resize((fd + 1) * 2);
+        auto &x = interests[fd];
+        x.events = events;
+        x.data = data;
+        if (!x.queued) {
+            x.queued = true;
+            changed.push_back(fd);
+        }
+        if (sleeping)
+            apply_interests();
+        return 0;
     }
-    void *operator[](int i) {
-        assert(0 <= i && i < MAX_EVENTS);
-        return events[i].data.ptr;
+    void apply_interests() {
+        for (auto fd : changed) {
+            auto &x = interests[fd];
+            x.queued = false;
+            if (x.events == 0) {
+                if (x.registered)
+                    ctl(fd, EPOLL_CTL_DEL, 0, nullptr, ENOENT, EBADF);
+                x.registered = false;
+                continue;
+            }
+            // the fd may have been closed (and reused) since registered
+            int ret;
+            if (x.registered) {
+                ret = ctl(fd, EPOLL_CTL_MOD, x.events, x.data, ENOENT);
+                if (ret == -ENOENT)
+                    ret = ctl(fd, EPOLL_CTL_ADD, x.events, x.data);
+            } else {
+                ret = ctl(fd, EPOLL_CTL_ADD, x.events, x.data, EEXIST);
+                if (ret == -EEXIST)
+                    ret = ctl(fd, EPOLL_CTL_MOD, x.events, x.data);
+            }
+            x.registered = (ret == 0);
+        }
+        changed.clear();
+    }
+    int harvest(void **data, int count) {
+        epoll_event events[MAX_EVENTS];
+        int n = wait(events, std::min(count, MAX_EVENTS), 0);
+        for (int i = 0; i < n; ++i)
+            data[i] = events[i].data.ptr;
+        return n;
     }
 };
 
@@ -184,72 +216,135 @@ public:
         if_close_fd(evfd);
         return 0;
     }
+
+    // an fd is registered on its first wait, edge-triggered for both read
+    // and write, and stays registered until forget(), so waits on it cost
+    // no epoll_ctl(). Edges arriving with no waiter are remembered in
+    // `ready`, and consumed by the next wait, which returns immediately.
+    static const uint32_t ET_EVENTS =
+        evmap.UNDERLAY_EVENT_READ | evmap.UNDERLAY_EVENT_WRITE | EPOLLET;
+    enum : uint8_t { UNREGISTERED = 0, PENDING, REGISTERED };
     struct InFlightEvent {
         thread *reader;
         thread *writer;
+        uint8_t state;
+        uint8_t ready; // bitwised EVENT_READ, EVENT_WRITE
     };
     std::vector<InFlightEvent> inflight_events;
-    // target == 0 for read, 1 for write
-    int wait_for_event(uint64_t fd, int event, uint64_t timeout) {
-        if (fd >= inflight_events.size())
-            inflight_events.resize(fd * 2);
-        auto target = event;
-        auto actor = &inflight_events[fd].reader;
-        if (actor[target])
+    // fds waiting for registration, applied once per idle sleep
+    std::vector<int> pending;
+    epoll_event events[MAX_EVENTS];
+
+    // `mask` is bitwised EVENT_READ, EVENT_WRITE
+    int wait_for_event(int fd, uint32_t mask, uint64_t timeout) {
+        if (fd < 0)
+            LOG_ERROR_RETURN(EBADF, -1, "invalid fd ", fd);
+        if ((size_t)fd >= inflight_events.size())
+            inflight_events.resize((fd + 1) * 2);
+        auto e = &inflight_events[fd];
+        if (((mask & EVENT_READ) && e->reader) || ((mask & EVENT_WRITE) && e->writer))
             LOG_ERROR_RETURN(EALREADY, -1, "already waiting for fd ", fd);
-        actor[target] = CURRENT;
-        DEFER({ actor[target] = nullptr; });
-        static const uint32_t events[] = {evmap.UNDERLAY_EVENT_READ, evmap.UNDERLAY_EVENT_WRITE};
-
-        int ret;
-        auto other = target ^ 1;
-        if (actor[other]) {
-            ret = ctl(fd, EPOLL_CTL_MOD, events[target] | events[other], (void *)fd);
-        } else {
-            ret = ctl(fd, EPOLL_CTL_ADD, events[target], (void *)fd);
+        if (e->ready & mask) {
+            e->ready &= ~mask;
+            return 0;
         }
-        if (ret < 0)
-            return -1;
+        if (e->state == UNREGISTERED) {
+            e->state = PENDING;
+            pending.push_back(fd);
+        }
+        if (mask & EVENT_READ)
+            e->reader = CURRENT;
+        if (mask & EVENT_WRITE)
+            e->writer = CURRENT;
 
-        ret = do_wait_for_events(timeout);
+        int ret = do_wait_for_events(timeout);
         // inflight_events might be resized in other threads
         // may need to get new pointer
-        actor = &inflight_events[fd].reader;
+        e = &inflight_events[fd];
+        if (mask & EVENT_READ)
+            e->reader = nullptr;
+        if (mask & EVENT_WRITE)
+            e->writer = nullptr;
         if (ret < 0)
             LOG_DEBUG("do_wait_for_events() failed ", VALUE(fd), ERRNO());
-
-        if (actor[other]) {
-            ret = ctl(fd, EPOLL_CTL_MOD, events[other], (void *)fd);
-            if (ret < 0) {
-                cancel(fd);
-                return -1;
-            }
-        } else {
-            cancel(fd);
-        }
         return ret;
     }
     int wait_for_fd_readable(int fd, uint64_t timeout) {
-        return wait_for_event((uint32_t)fd, 0, timeout);
+        return wait_for_event(fd, EVENT_READ, timeout);
     }
     int wait_for_fd_writable(int fd, uint64_t timeout) {
-        return wait_for_event((uint32_t)fd, 1, timeout);
+        return wait_for_event(fd, EVENT_WRITE, timeout);
     }
-    int wait_and_issue_events(int timeout_ms) {
-        EPWaiter<16> result(this, timeout_ms);
+    void interrupt_waiters(InFlightEvent &e, int error_number) {
+        if (e.reader)
+            thread_interrupt(e.reader, error_number);
+        if (e.writer && e.writer != e.reader)
+            thread_interrupt(e.writer, error_number);
+    }
+    int forget(int fd) {
+        if (fd < 0 || (size_t)fd >= inflight_events.size())
+            return 0;
+        auto &e = inflight_events[fd];
+        if (e.state == REGISTERED)
+            ctl(fd, EPOLL_CTL_DEL, 0, nullptr, ENOENT, EBADF);
+        e.state = UNREGISTERED; // also drops it from `pending`
+        e.ready = 0;
+        interrupt_waiters(e, EBADF);
+        return 0;
+    }
+    void apply_pending() {
+        for (auto fd : pending) {
+            auto &e = inflight_events[fd];
+            if (e.state != PENDING)
+                continue;
+            auto data = (void *)(int64_t)fd;
+            int ret = ctl(fd, EPOLL_CTL_ADD, ET_EVENTS, data, EEXIST);
+            if (ret == -EEXIST)
+                ret = ctl(fd, EPOLL_CTL_MOD, ET_EVENTS, data);
+            if (ret < 0) {
+                e.state = UNREGISTERED;
+                interrupt_waiters(e, -ret);
+            } else {
+                e.state = REGISTERED;
+            }
+        }
+        pending.clear();
+    }
+    void issue_event(int64_t fd, uint32_t ev) {
         constexpr auto READBIT = evmap.UNDERLAY_EVENT_READ;
         constexpr auto WRITEBIT = evmap.UNDERLAY_EVENT_WRITE;
         constexpr auto ERRBIT = EPOLLERR | EPOLLHUP;
-        for (int i = 0; i < result.n; ++i) {
-            auto fd = (int64_t)result[i];
-            if (fd >= 0) {
-                assert((size_t)fd < inflight_events.size());
-                if ((result.events[i].events & (READBIT | ERRBIT)) && inflight_events[fd].reader)
-                    thread_interrupt(inflight_events[fd].reader, EOK);
-                if ((result.events[i].events & (WRITEBIT | ERRBIT)) && inflight_events[fd].writer)
-                    thread_interrupt(inflight_events[fd].writer, EOK);
-            } else
-                do_safe_thread_interrupt();
+        if ((size_t)fd >= inflight_events.size())
+            return;
+        auto &e = inflight_events[fd];
+        if (ev & (READBIT | ERRBIT)) {
+            if (e.reader)
+                thread_interrupt(e.reader, EOK);
+            else
+                e.ready |= EVENT_READ;
+        }
+        if (ev & (WRITEBIT | ERRBIT)) {
+            if (e.writer)
+                thread_interrupt(e.writer, EOK);
+            else
+                e.ready |= EVENT_WRITE;
+        }
+    }
+    int wait_and_issue_events(int timeout_ms) {
+        apply_pending();
+        // keep harvesting without blocking while the batch comes back full
+        for (int round = 0; round < 4; ++round) {
+            int n = wait(events, MAX_EVENTS, timeout_ms);
+            for (int i = 0; i < n; ++i) {
+                auto fd = (int64_t)events[i].data.ptr;
+                if (fd >= 0)
+                    issue_event(fd, events[i].events);
+                else
+                    do_safe_thread_interrupt();
+            }
+            if (n < MAX_EVENTS)
+                break;
+            timeout_ms = 0;
         }
         return 0;
     }
@@ -304,48 +399,83 @@ public:
     }
 };
 
-static MasterEPoll master_epoll;
+// each vcpu has its own master epoll, installed by fd_events_epoll_init()
+static __thread MasterEPoll *master_epoll = nullptr;
 
 int wait_for_fd_readable(int fd, uint64_t timeout) {
-    return master_epoll.wait_for_fd_readable(fd, timeout);
+    return master_epoll->wait_for_fd_readable(fd, timeout);
 }
 
 int wait_for_fd_writable(int fd, uint64_t timeout) {
-    return master_epoll.wait_for_fd_writable(fd, timeout);
+    return master_epoll->wait_for_fd_writable(fd, timeout);
 }
 
 int wait_for_fd(FD_Events fd_events, uint64_t timeout) {
-    return master_epoll.wait_for_events(fd_events.fd, evmap.translate_bitwisely(fd_events.events),
-                                        timeout);
+    auto mask = fd_events.events & (EVENT_READ | EVENT_WRITE);
+    if (mask == 0)
+        LOG_ERROR_RETURN(EINVAL, -1, "no event to wait for fd ", fd_events.fd);
+    return master_epoll->wait_for_event(fd_events.fd, mask, timeout);
+}
+
+int fd_events_forget(int fd) {
+    return master_epoll ? master_epoll->forget(fd) : 0;
 }
 
 static int wait_and_issue_events(uint64_t timeout) {
     uint64_t timeout_ms = timeout / 1000;
     if (timeout_ms > INT32_MAX)
         timeout_ms = -1;
-    return master_epoll.wait_and_issue_events((int32_t)timeout_ms);
+    return master_epoll->wait_and_issue_events((int32_t)timeout_ms);
 }
 
 int fd_events_epoll_init() {
     LOG_INFO("init event engine: epoll");
+    if (master_epoll)
+        LOG_ERROR_RETURN(EALREADY, -1, "EPoll already inited");
+
+    // MasterEPoll is cache-line aligned, which is beyond what `new` guarantees
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, alignof(MasterEPoll), sizeof(MasterEPoll)) != 0)
+        LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate MasterEPoll");
+    auto ep = new (ptr) MasterEPoll;
+    int ret = ep->init();
+    if (ret < 0) {
+        ep->~MasterEPoll();
+        free(ep);
+        return ret;
+    }
+    master_epoll = ep;
+    get_vcpu()->event_engine = ep;
     set_idle_sleeper(&wait_and_issue_events);
-    return master_epoll.init();
+    return 0;
 }
 
 int fd_events_epoll_fini() {
     LOG_INFO("finit event engine: epoll");
+    if (!master_epoll)
+        return 0;
     set_idle_sleeper(nullptr);
-    return master_epoll.fini();
+    get_vcpu()->event_engine = nullptr;
+    master_epoll->fini();
+    master_epoll->~MasterEPoll();
+    free(master_epoll);
+    master_epoll = nullptr;
+    return 0;
 }
 
+// may be invoked from any OS thread, so the target
+// master epoll is located by the vcpu of `th`
 void safe_thread_interrupt(thread *th, int error_number, int mode) {
-    return master_epoll.safe_thread_interrupt(th, error_number, mode);
+    auto ep = (MasterEPoll *)get_vcpu(th)->event_engine;
+    if (!ep)
+        LOG_ERROR_RETURN(ENOSYS, , "event engine of the vcpu is not inited");
+    return ep->safe_thread_interrupt(th, error_number, mode);
 }
 
 FD_Poller *new_fd_poller(void *) {
-    auto poller = new EPoll;
+    auto poller = new PollerEPoll;
     if (!poller)
-        LOG_ERRNO_RETURN(0, nullptr, "failed to create EPoll()");
+        LOG_ERRNO_RETURN(0, nullptr, "failed to create PollerEPoll()");
 
     int ret = poller->init();
     if (ret < 0) {
@@ -357,23 +487,33 @@ FD_Poller *new_fd_poller(void *) {
 }
 
 int delete_fd_poller(FD_Poller *poller_) {
-    auto poller = (EPoll *)poller_;
+    auto poller = (PollerEPoll *)poller_;
+    fd_events_forget(poller->epfd);
     delete poller;
     return 0;
 }
 
 // removing the fd is to show no interest (0) on the fd
 int fd_interest(FD_Poller *poller_, FD_Events fd_events, void *data) {
-    auto poller = (EPoll *)poller_;
+    auto poller = (PollerEPoll *)poller_;
     return poller->fd_interest(fd_events.fd, evmap.translate_bitwisely(fd_events.events), data);
 }
 
 int wait_for_fds(FD_Poller *poller_, void **data, int count, uint64_t timeout) {
     if (!poller_ || !data || count <= 0)
-        LOG_ERROR_RETURN(-1, EINVAL, "invalid argument(s)");
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid argument(s)");
+
+    auto poller = (PollerEPoll *)poller_;
+    poller->apply_interests();
+    // the epoll fd is waited edge-triggered, so it is only waited
+    // after finding nothing ready, lest leftover events get stuck
+    int n = poller->harvest(data, count);
+    if (n != 0)
+        return n;
 
-    auto poller = (EPoll *)poller_;
+    poller->sleeping = true;
     int ret = wait_for_fd_readable(poller->epfd, timeout);
+    poller->sleeping = false;
     if (ret < 0) {
         ERRNO eno;
         if (eno.no == ETIMEDOUT || eno.no == EINTR)
@@ -382,14 +522,8 @@ int wait_for_fds(FD_Poller *poller_, void **data, int count, uint64_t timeout) {
             return -1;
         LOG_ERRNO_RETURN(0, -1, "failed to wait for epoll fd ", poller->epfd);
     }
-
-    EPWaiter<16> result(poller, 0);
-    assert(result.n != 0);
-    if (result.n > count)
-        result.n = count;
-    for (int i = 0; i < result.n; ++i)
-        data[i] = result[i];
-    return result.n;
+    // may be 0 when woken up by an edge already harvested
+    return poller->harvest(data, count);
 }
 
 } // namespace photon
@@ -56,6 +56,9 @@ struct FD_Events {
 
 // blocks current photon thread, and wait
 // for the fd to become readable / writable
+// the fd stays registered to the vcpu's event engine (edge-triggered)
+// after the wait, so the wakeup may be spurious: retry the I/O and
+// wait again if it would block
 extern "C" int wait_for_fd_readable(int fd, uint64_t timeout = -1);
 extern "C" int wait_for_fd_writable(int fd, uint64_t timeout = -1);
 extern "C" int wait_for_fd(FD_Events fd_events, uint64_t timeout = -1);
@@ -63,6 +66,11 @@ inline int wait_for_fd(int fd, uint32_t events, uint64_t timeout = -1) {
     return wait_for_fd({fd, events}, timeout);
 }
 
+// drops the registration of an fd waited by wait_for_fd*(), on the
+// current vcpu; must be invoked before closing such an fd, or a new
+// fd reusing the number may never be woken up
+extern "C" int fd_events_forget(int fd);
+
 class FD_Poller;
 extern "C" FD_Poller *new_fd_poller(void *args);
 extern "C" int delete_fd_poller(FD_Poller *poller);
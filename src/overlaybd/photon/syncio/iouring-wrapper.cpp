@@ -0,0 +1,616 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "iouring-wrapper.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <algorithm>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include "../thread.h"
+#include "fd-events.h"
+#include "../../utility.h"
+#include "../../alog.h"
+
+namespace photon {
+const int IOURING_EOK = ENXIO;
+const unsigned IOURING_DEPTH = 1024;
+const int IOURING_MAX_FILES = 1024;
+// writes of iouring_write_async() queued before they're submitted at once
+const unsigned IOURING_ASYNC_BATCH = 64;
+// tags the user_data of the multishot polls, whose states are aligned
+const uint64_t IOURING_POLL_TAG = 1;
+
+// a multishot poll of a fd for readability, kept armed across waits
+struct IouringPoll {
+    int fd;
+    thread *waiter = nullptr;
+    bool armed = false, ready = false, cancelled = false;
+    int eno = 0;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+static int sys_io_uring_enter(int fd, unsigned to_submit) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, nullptr, 0);
+}
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+struct IouringRing {
+    int fd = -1, evfd = -1;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr = nullptr, *cq_ptr = nullptr, *sqes_ptr = nullptr;
+    size_t sq_len = 0, cq_len = 0, sqes_len = 0;
+    unsigned cq_entries = 0, inflight = 0;
+    std::vector<struct iovec> buffers;
+    bool files_registered = false;
+    // the registered files, unregistered by the vcpus closing them
+    std::mutex files_mtx;
+    std::unordered_map<int, int> files; // fd -> slot
+    std::vector<int> free_slots;
+    // the polls of iouring_wait_for_fd_readable(), and whether the kernel
+    // supports multishot polls (5.13+)
+    std::unordered_map<int, IouringPoll *> polls;
+    bool multishot = true;
+    // entries queued in the SQ ring by iouring_write_async(), not submitted yet
+    unsigned unsubmitted = 0;
+
+    ~IouringRing() {
+        if (sqes_ptr)
+            munmap(sqes_ptr, sqes_len);
+        if (cq_ptr && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_len);
+        if (sq_ptr)
+            munmap(sq_ptr, sq_len);
+        if (evfd >= 0) {
+            fd_events_forget(evfd);
+            close(evfd);
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+
+    static void *map(size_t len, int fd, off_t offset) {
+        auto ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        return ptr == MAP_FAILED ? nullptr : ptr;
+    }
+
+    int setup() {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        fd = sys_io_uring_setup(IOURING_DEPTH, &p);
+        if (fd < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to create io_uring by io_uring_setup()");
+
+        sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_len = cq_len = std::max(sq_len, cq_len);
+        sq_ptr = map(sq_len, fd, IORING_OFF_SQ_RING);
+        cq_ptr = single_mmap ? sq_ptr : map(cq_len, fd, IORING_OFF_CQ_RING);
+        sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes_ptr = map(sqes_len, fd, IORING_OFF_SQES);
+        if (!sq_ptr || !cq_ptr || !sqes_ptr)
+            LOG_ERRNO_RETURN(0, -1, "failed to mmap io_uring");
+
+        auto sq = (char *)sq_ptr, cq = (char *)cq_ptr;
+        sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+        sq_array = (unsigned *)(sq + p.sq_off.array);
+        cq_head = (unsigned *)(cq + p.cq_off.head);
+        cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+        sqes = (struct io_uring_sqe *)sqes_ptr;
+        cq_entries = p.cq_entries;
+
+        evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (evfd < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to create eventfd");
+        if (sys_io_uring_register(fd, IORING_REGISTER_EVENTFD, &evfd, 1) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to register eventfd to io_uring");
+
+        // a sparse file table, updated as files are registered
+        std::vector<int> table(IOURING_MAX_FILES, -1);
+        if (sys_io_uring_register(fd, IORING_REGISTER_FILES, table.data(), table.size()) == 0) {
+            files_registered = true;
+            for (int i = IOURING_MAX_FILES - 1; i >= 0; i--)
+                free_slots.push_back(i);
+        } else {
+            LOG_WARN("registered files of io_uring not supported, ", ERRNO());
+        }
+        return 0;
+    }
+
+    int update_file(int slot, int fd) {
+        struct io_uring_files_update upd;
+        memset(&upd, 0, sizeof(upd));
+        upd.offset = slot;
+        upd.fds = (uint64_t)&fd;
+        return sys_io_uring_register(this->fd, IORING_REGISTER_FILES_UPDATE, &upd, 1) < 0 ? -1 : 0;
+    }
+
+    int slot_of(int fd) {
+        if (!files_registered)
+            return -1;
+        std::lock_guard<std::mutex> lock(files_mtx);
+        auto it = files.find(fd);
+        return it == files.end() ? -1 : it->second;
+    }
+
+    int buffer_of(const void *buf, size_t count) {
+        for (size_t i = 0; i < buffers.size(); i++) {
+            auto base = (const char *)buffers[i].iov_base;
+            if (buf >= base && (const char *)buf + count <= base + buffers[i].iov_len)
+                return i;
+        }
+        return -1;
+    }
+};
+
+// the ring is owned by each vcpu
+static __thread IouringRing *uring = nullptr;
+static __thread int uring_running;
+static __thread thread *uring_polling_thread = nullptr;
+static __thread int uring_submitting;
+static __thread thread *uring_submitting_thread = nullptr;
+static thread_local condition_variable uring_cond;
+// rings of all vcpus, for unregistering files
+static std::mutex rings_mtx;
+static std::set<IouringRing *> rings;
+
+// put `sqe` at the tail of the SQ ring, returning its index
+static unsigned queue_sqe(const struct io_uring_sqe &sqe) {
+    // the sq tail is written by current vcpu only
+    unsigned tail = *uring->sq_tail;
+    unsigned idx = tail & *uring->sq_mask;
+    uring->sqes[idx] = sqe;
+    uring->sq_array[idx] = idx;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return idx;
+}
+
+// submit the `n` entries just queued, along with those left unsubmitted
+static int submit_queued(unsigned n = 1) {
+    while (true) {
+        int ret = sys_io_uring_enter(uring->fd, uring->unsubmitted + n);
+        if (ret > 0) {
+            uring->unsubmitted = 0;
+            return 0;
+        }
+        auto e = ret < 0 ? errno : EAGAIN;
+        if (e == EINTR)
+            continue;
+        if (e == EAGAIN || e == EBUSY) {
+            thread_usleep(1000);
+            continue;
+        }
+        errno = e;
+        return -1;
+    }
+}
+
+struct uringreq {
+    thread *th = CURRENT;
+    ssize_t ioret = 0;
+    bool done = false;
+
+    ssize_t submit_and_wait(struct io_uring_sqe &sqe) {
+        // keep the completions within the CQ ring
+        while (uring->inflight >= uring->cq_entries)
+            uring_cond.wait_no_lock();
+        sqe.user_data = (uint64_t)this;
+        auto idx = queue_sqe(sqe);
+        uring->inflight++;
+
+        if (submit_queued() < 0) {
+            // left in the SQ ring, the entry may still be submitted later, as a no-op
+            uring->sqes[idx].opcode = IORING_OP_NOP;
+            uring->sqes[idx].flags = 0;
+            uring->sqes[idx].user_data = 0;
+            LOG_ERRNO_RETURN(0, -1, "failed to io_uring_enter()");
+        }
+
+        // the buffers are in use until completed, even if interrupted by others
+        while (!done)
+            thread_usleep(-1);
+        if (ioret < 0)
+            LOG_ERROR_RETURN(-ioret, -1, "io_uring result error");
+        return ioret;
+    }
+};
+
+static void prep_rw(struct io_uring_sqe &sqe, uint8_t op, int fd, const void *addr, unsigned len,
+                    off_t offset) {
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = op;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t)addr;
+    sqe.len = len;
+    sqe.off = offset;
+    auto slot = uring->slot_of(fd);
+    if (slot >= 0) {
+        sqe.fd = slot;
+        sqe.flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+static void on_poll_event(IouringPoll *p, const struct io_uring_cqe &cqe) {
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if (!more)
+        p->armed = false;
+    if (p->cancelled) {
+        if (!more)
+            delete p;
+        return;
+    }
+    if (cqe.res >= 0) {
+        p->ready = true;
+    } else if (cqe.res != -ECANCELED) {
+        // an old kernel rejects the multishot flag
+        if (cqe.res == -EINVAL)
+            uring->multishot = false;
+        p->eno = -cqe.res;
+    }
+    if (p->waiter)
+        thread_interrupt(p->waiter, IOURING_EOK);
+}
+
+static void resume_iouring_requesters() {
+    unsigned head = *uring->cq_head;
+    unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        auto &cqe = uring->cqes[head & *uring->cq_mask];
+        // polls take no room of `inflight`, their CQEs are consumed at once
+        if (cqe.user_data & IOURING_POLL_TAG) {
+            on_poll_event((IouringPoll *)(cqe.user_data & ~IOURING_POLL_TAG), cqe);
+            continue;
+        }
+        auto req = (uringreq *)cqe.user_data;
+        uring->inflight--;
+        if (req == nullptr)
+            continue;
+        req->ioret = cqe.res;
+        req->done = true;
+        thread_interrupt(req->th, IOURING_EOK);
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void *iouring_polling(void *) {
+    uring_running = 1;
+    DEFER(uring_running = 0);
+    while (uring_running == 1) {
+        uring_running = 2;
+        wait_for_fd_readable(uring->evfd);
+        if (uring_running == -1)
+            break;
+        uring_running = 1;
+        uint64_t nevents = 0;
+        ::read(uring->evfd, &nevents, sizeof(nevents));
+        resume_iouring_requesters();
+        uring_cond.notify_all();
+    }
+    return nullptr;
+}
+
+// submits the writes of iouring_write_async() once the threads ready to run
+// have queued theirs, so that those of a round go by one io_uring_enter()
+static void *iouring_submitting(void *) {
+    uring_submitting = 1;
+    DEFER(uring_submitting = 0);
+    while (uring_submitting == 1) {
+        if (uring->unsubmitted == 0) {
+            thread_usleep(-1);
+            continue;
+        }
+        thread_yield();
+        if (uring->unsubmitted > 0 && submit_queued(0) < 0) {
+            LOG_ERROR("failed to submit ` queued writes to io_uring, `", uring->unsubmitted, ERRNO());
+            thread_usleep(1000);
+        }
+    }
+    return nullptr;
+}
+
+int iouring_wait_for_fd_readable(int fd, uint64_t timeout) {
+    if (!uring || !uring->multishot)
+        return wait_for_fd_readable(fd, timeout);
+    auto &p = uring->polls[fd];
+    if (!p)
+        p = new IouringPoll{fd};
+    if (p->waiter)
+        LOG_ERROR_RETURN(EBUSY, -1, "fd ` is waited by another thread", fd);
+    if (!p->ready && !p->armed) {
+        struct io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_POLL_ADD;
+        sqe.fd = fd;
+        sqe.poll32_events = POLLIN;
+        sqe.len = IORING_POLL_ADD_MULTI;
+        sqe.user_data = (uint64_t)p | IOURING_POLL_TAG;
+        auto idx = queue_sqe(sqe);
+        if (submit_queued() < 0) {
+            uring->sqes[idx].opcode = IORING_OP_NOP;
+            uring->sqes[idx].user_data = 0;
+            uring->inflight++;
+            LOG_ERRNO_RETURN(0, -1, "failed to arm the poll of fd `", fd);
+        }
+        p->armed = true;
+    }
+    if (!p->ready && p->eno == 0) {
+        p->waiter = CURRENT;
+        auto ret = thread_usleep(timeout);
+        auto e = errno;
+        p->waiter = nullptr;
+        if (ret < 0 && e != IOURING_EOK) {
+            errno = e;
+            return -1;
+        }
+    }
+    if (p->eno) {
+        auto e = p->eno;
+        p->eno = 0;
+        if (!uring->multishot) {
+            LOG_WARN("multishot poll of io_uring not supported, wait by epoll");
+            return wait_for_fd_readable(fd, timeout);
+        }
+        LOG_ERROR_RETURN(e, -1, "failed to poll fd ` by io_uring", fd);
+    }
+    if (!p->ready) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    p->ready = false;
+    return 0;
+}
+
+int iouring_cancel_poll(int fd) {
+    // waited by epoll without a ring, or multishot polls
+    fd_events_forget(fd);
+    if (!uring)
+        return 0;
+    auto it = uring->polls.find(fd);
+    if (it == uring->polls.end())
+        return 0;
+    auto p = it->second;
+    uring->polls.erase(it);
+    if (!p->armed) {
+        delete p;
+        // the writes queued to the fd go before it's closed
+        return uring->unsubmitted > 0 ? submit_queued(0) : 0;
+    }
+    // freed by its last CQE
+    p->cancelled = true;
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_POLL_REMOVE;
+    sqe.fd = -1;
+    sqe.addr = (uint64_t)p | IOURING_POLL_TAG;
+    queue_sqe(sqe);
+    uring->inflight++;
+    if (submit_queued() < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to cancel the poll of fd `", fd);
+    return 0;
+}
+
+int iouring_write_async(int fd, const void *buf, size_t count) {
+    // quietly, for the caller to write by itself
+    if (!uring || !uring_submitting_thread) {
+        errno = ENOSYS;
+        return -1;
+    }
+    while (uring->inflight >= uring->cq_entries)
+        uring_cond.wait_no_lock();
+    struct io_uring_sqe sqe;
+    // at the file position, as write() does
+    prep_rw(sqe, IORING_OP_WRITE, fd, buf, count, -1);
+    sqe.user_data = 0;
+    queue_sqe(sqe);
+    uring->inflight++;
+    if (++uring->unsubmitted >= IOURING_ASYNC_BATCH) {
+        if (submit_queued(0) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to submit queued writes to io_uring");
+    } else if (uring->unsubmitted == 1) {
+        thread_interrupt(uring_submitting_thread);
+    }
+    return 0;
+}
+
+ssize_t iouring_pread(int fd, void *buf, size_t count, off_t offset) {
+    if (!uring)
+        return ::pread(fd, buf, count, offset);
+    struct io_uring_sqe sqe;
+    struct iovec iov = {buf, count};
+    auto index = uring->buffer_of(buf, count);
+    if (index >= 0) {
+        prep_rw(sqe, IORING_OP_READ_FIXED, fd, buf, count, offset);
+        sqe.buf_index = index;
+    } else {
+        prep_rw(sqe, IORING_OP_READV, fd, &iov, 1, offset);
+    }
+    return uringreq().submit_and_wait(sqe);
+}
+
+ssize_t iouring_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    if (!uring)
+        return ::preadv(fd, iov, iovcnt, offset);
+    if (iovcnt == 1)
+        return iouring_pread(fd, iov->iov_base, iov->iov_len, offset);
+    struct io_uring_sqe sqe;
+    prep_rw(sqe, IORING_OP_READV, fd, iov, iovcnt, offset);
+    return uringreq().submit_and_wait(sqe);
+}
+
+ssize_t iouring_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    if (!uring)
+        return ::pwrite(fd, buf, count, offset);
+    struct io_uring_sqe sqe;
+    struct iovec iov = {(void *)buf, count};
+    auto index = uring->buffer_of(buf, count);
+    if (index >= 0) {
+        prep_rw(sqe, IORING_OP_WRITE_FIXED, fd, buf, count, offset);
+        sqe.buf_index = index;
+    } else {
+        prep_rw(sqe, IORING_OP_WRITEV, fd, &iov, 1, offset);
+    }
+    return uringreq().submit_and_wait(sqe);
+}
+
+ssize_t iouring_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    if (!uring)
+        return ::pwritev(fd, iov, iovcnt, offset);
+    if (iovcnt == 1)
+        return iouring_pwrite(fd, iov->iov_base, iov->iov_len, offset);
+    struct io_uring_sqe sqe;
+    prep_rw(sqe, IORING_OP_WRITEV, fd, iov, iovcnt, offset);
+    return uringreq().submit_and_wait(sqe);
+}
+
+int iouring_fsync(int fd) {
+    if (!uring)
+        return ::fsync(fd);
+    struct io_uring_sqe sqe;
+    prep_rw(sqe, IORING_OP_FSYNC, fd, nullptr, 0, 0);
+    return (int)uringreq().submit_and_wait(sqe);
+}
+
+int iouring_fdatasync(int fd) {
+    if (!uring)
+        return ::fdatasync(fd);
+    struct io_uring_sqe sqe;
+    prep_rw(sqe, IORING_OP_FSYNC, fd, nullptr, 0, 0);
+    sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+    return (int)uringreq().submit_and_wait(sqe);
+}
+
+int iouring_register_buffers(const struct iovec *iov, int iovcnt) {
+    if (!uring)
+        LOG_ERROR_RETURN(ENOSYS, -1, "io_uring not inited");
+    iouring_unregister_buffers();
+    if (sys_io_uring_register(uring->fd, IORING_REGISTER_BUFFERS, iov, iovcnt) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to register ` buffers to io_uring", iovcnt);
+    uring->buffers.assign(iov, iov + iovcnt);
+    return 0;
+}
+
+int iouring_unregister_buffers() {
+    if (!uring)
+        LOG_ERROR_RETURN(ENOSYS, -1, "io_uring not inited");
+    if (uring->buffers.empty())
+        return 0;
+    uring->buffers.clear();
+    if (sys_io_uring_register(uring->fd, IORING_UNREGISTER_BUFFERS, nullptr, 0) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to unregister buffers of io_uring");
+    return 0;
+}
+
+int iouring_register_file(int fd) {
+    if (!uring || !uring->files_registered)
+        LOG_ERROR_RETURN(ENOTSUP, -1, "registered files of io_uring not available");
+    std::lock_guard<std::mutex> lock(uring->files_mtx);
+    auto it = uring->files.find(fd);
+    if (it != uring->files.end())
+        return it->second;
+    if (uring->free_slots.empty())
+        LOG_ERROR_RETURN(ENOSPC, -1, "no free slot to register fd ` to io_uring", fd);
+    int slot = uring->free_slots.back();
+    if (uring->update_file(slot, fd) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to register fd ` to io_uring", fd);
+    uring->free_slots.pop_back();
+    uring->files[fd] = slot;
+    return slot;
+}
+
+int iouring_unregister_file(int fd) {
+    std::lock_guard<std::mutex> lock(rings_mtx);
+    for (auto r : rings) {
+        std::lock_guard<std::mutex> files_lock(r->files_mtx);
+        auto it = r->files.find(fd);
+        if (it == r->files.end())
+            continue;
+        if (r->update_file(it->second, -1) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to unregister fd ` from io_uring", fd);
+        r->free_slots.push_back(it->second);
+        r->files.erase(it);
+    }
+    return 0;
+}
+
+int iouring_wrapper_init() {
+    if (uring)
+        LOG_ERROR_RETURN(EALREADY, -1, "already inited");
+    auto r = new IouringRing;
+    if (r->setup() < 0) {
+        delete r;
+        return -1;
+    }
+    {
+        std::lock_guard<std::mutex> lock(rings_mtx);
+        rings.insert(r);
+    }
+    uring = r;
+    uring_polling_thread = thread_create(&iouring_polling, nullptr);
+    uring_submitting_thread = thread_create(&iouring_submitting, nullptr);
+    return 0;
+}
+
+int iouring_wrapper_fini() {
+    if (!uring_running || !uring_polling_thread || !uring)
+        LOG_ERROR_RETURN(ENOSYS, -1, "not inited");
+
+    if (uring_running == 2) // if waiting for fd readable
+        thread_interrupt(uring_polling_thread, ECANCELED);
+
+    uring_running = -1;
+    while (uring_running != 0)
+        thread_usleep(1000 * 10);
+
+    if (uring_submitting) {
+        uring_submitting = -1;
+        thread_interrupt(uring_submitting_thread, ECANCELED);
+        while (uring_submitting != 0)
+            thread_usleep(1000 * 10);
+    }
+    uring_submitting_thread = nullptr;
+    // the polls left are freed with the ring, which cancels them
+    for (auto &it : uring->polls)
+        delete it.second;
+
+    {
+        std::lock_guard<std::mutex> lock(rings_mtx);
+        rings.erase(uring);
+    }
+    delete uring;
+    uring = nullptr;
+    uring_polling_thread = nullptr;
+    return 0;
+}
+} // namespace photon
@@ -0,0 +1,86 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// io_uring wrapper depends on fd-events ( fd_events_epoll_init() ), each vcpu
+// owning a ring, whose completions are signaled through a registered eventfd
+namespace photon {
+extern "C" {
+int iouring_wrapper_init();
+int iouring_wrapper_fini();
+
+// both buffered and O_DIRECT files are supported; without a ring
+// on current vcpu, they fall back to the blocking syscalls
+ssize_t iouring_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t iouring_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t iouring_pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t iouring_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+int iouring_fsync(int fd);
+int iouring_fdatasync(int fd);
+
+// registers the buffers to the ring of current vcpu, replacing the ones
+// registered before, so that I/O entirely within one of them is done with
+// the buffer fixed, saving the mapping of its pages for each I/O
+int iouring_register_buffers(const struct iovec *iov, int iovcnt);
+int iouring_unregister_buffers();
+
+// registers `fd` to the ring of current vcpu, saving the lookup of the file
+// for each I/O on it there; the fd must be unregistered before closed,
+// which removes it from the rings of all vcpus
+int iouring_register_file(int fd);
+int iouring_unregister_file(int fd);
+
+// waits for `fd` to be readable, as wait_for_fd_readable() does, by a
+// multishot poll of the ring of current vcpu, armed by the first wait and
+// kept armed across waits, so a wakeup takes no syscall of its own; by epoll
+// without a ring, or multishot polls (5.13+). One thread waits for a fd at a
+// time, and iouring_cancel_poll() must be called before the fd is closed,
+// which also does fd_events_forget() for it.
+int iouring_wait_for_fd_readable(int fd, uint64_t timeout = -1);
+int iouring_cancel_poll(int fd);
+
+// queues a write of `buf` to `fd` at its file position, without waiting for
+// it; the writes queued by the threads of current vcpu in a round are
+// submitted together, or with the next I/O of the ring. `buf` must stay
+// valid till the write is done, e.g. be static. Fails with ENOSYS without a
+// ring on current vcpu.
+int iouring_write_async(int fd, const void *buf, size_t count);
+}
+
+struct iouring {
+    static ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+        return iouring_pread(fd, buf, count, offset);
+    }
+    static ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+        return iouring_preadv(fd, iov, iovcnt, offset);
+    }
+    static ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+        return iouring_pwrite(fd, buf, count, offset);
+    }
+    static ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+        return iouring_pwritev(fd, iov, iovcnt, offset);
+    }
+    static int fsync(int fd) {
+        return iouring_fsync(fd);
+    }
+    static int fdatasync(int fd) {
+        return iouring_fdatasync(fd);
+    }
+};
+} // namespace photon
@@ -227,6 +227,7 @@ namespace photon
             LOG_ERROR_RETURN(EALREADY, -1, "already finited");
 
         eloop->stop();
+        fd_events_forget(sgfd);
         close(sgfd);
         delete eloop;
         // __unregister_atfork((void*)&fork_hook_child);
@@ -15,6 +15,7 @@
 */
 #include "../thread.cpp"
 #include "../syncio/aio-wrapper.cpp"
+#include "../syncio/iouring-wrapper.cpp"
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
@@ -23,6 +24,8 @@
 #include "../syncio/fd-events.h"
 #include "../../utility.h"
 #include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
 using namespace photon;
 
 
@@ -211,6 +214,200 @@ int test_aio(const char* fn, bool is_posix)
     return 0;
 }
 
+TEST(IOUring, rand_rw)
+{
+    if (iouring_wrapper_init() < 0)
+        GTEST_SKIP() << "io_uring not available";
+    DEFER(iouring_wrapper_fini());
+
+    // buffered, without O_DIRECT
+    const char* fn = "test_uring.bin";
+    int fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    DEFER({ close(fd); unlink(fn); });
+    ASSERT_EQ(0, ftruncate(fd, alignment * 1024));
+
+    rand_args_t args;
+    args.fd = fd;
+    args.start = 0;
+    args.length = alignment * 1024;
+    args.n = 1000 * 10;
+    do_test_aio<iouring>(args);
+
+    // registered file and fixed buffers
+    EXPECT_GE(iouring_register_file(fd), 0);
+    void* buf = nullptr;
+    ASSERT_EQ(0, posix_memalign(&buf, alignment, alignment * 2));
+    DEFER(free(buf));
+    struct iovec fixed = {buf, alignment * 2};
+    EXPECT_EQ(0, iouring_register_buffers(&fixed, 1));
+    memset(buf, 'x', alignment);
+    EXPECT_EQ((ssize_t)alignment, iouring_pwrite(fd, buf, alignment, alignment));
+    memset(buf, 0, alignment * 2);
+    EXPECT_EQ((ssize_t)alignment, iouring_pread(fd, (char*)buf + alignment, alignment, alignment));
+    EXPECT_EQ('x', ((char*)buf)[alignment * 2 - 1]);
+    EXPECT_EQ(0, iouring_fdatasync(fd));
+
+    // vectored, with buffers not registered
+    char a[100], b[200];
+    struct iovec iov[2] = {{a, sizeof(a)}, {b, sizeof(b)}};
+    EXPECT_EQ(300, iouring_preadv(fd, iov, 2, alignment - 100));
+    EXPECT_EQ(0, a[99]);
+    EXPECT_EQ('x', b[199]);
+    EXPECT_EQ(0, iouring_unregister_buffers());
+    EXPECT_EQ(0, iouring_unregister_file(fd));
+    EXPECT_EQ(-1, iouring_pread(-1, a, sizeof(a), 0));
+}
+
+static void* write_after_1ms(void* arg)
+{
+    photon::thread_usleep(1000);
+    char c = 'x';
+    (void)::write((int)(uint64_t)arg, &c, 1);
+    return nullptr;
+}
+
+TEST(IOUring, poll_and_write_async)
+{
+    if (iouring_wrapper_init() < 0)
+        GTEST_SKIP() << "io_uring not available";
+    DEFER(iouring_wrapper_fini());
+
+    int fds[2];
+    ASSERT_EQ(0, pipe2(fds, O_NONBLOCK));
+    DEFER({ close(fds[0]); close(fds[1]); });
+    EXPECT_EQ(-1, iouring_wait_for_fd_readable(fds[0], 10 * 1000));
+    EXPECT_EQ(ETIMEDOUT, errno);
+
+    // the poll stays armed across waits
+    char buf[16];
+    for (int i = 0; i < 3; ++i) {
+        thread_create(&write_after_1ms, (void*)(uint64_t)fds[1]);
+        EXPECT_EQ(0, iouring_wait_for_fd_readable(fds[0], 1000 * 1000));
+        EXPECT_EQ(1, ::read(fds[0], buf, sizeof(buf)));
+    }
+
+    // writes queued in a round are submitted together
+    static const char data[] = "0123456789";
+    for (int i = 0; i < 10; ++i)
+        EXPECT_EQ(0, iouring_write_async(fds[1], data + i, 1));
+    EXPECT_EQ(0, iouring_wait_for_fd_readable(fds[0], 1000 * 1000));
+    thread_usleep(1000);
+    EXPECT_EQ(10, ::read(fds[0], buf, sizeof(buf)));
+    EXPECT_EQ(0, memcmp(buf, data, 10));
+    EXPECT_EQ(0, iouring_cancel_poll(fds[0]));
+}
+
+TEST(EPoll, edge_triggered)
+{
+    int fds[2];
+    ASSERT_EQ(0, pipe2(fds, O_NONBLOCK));
+    EXPECT_EQ(-1, wait_for_fd_readable(fds[0], 10 * 1000));
+    EXPECT_EQ(ETIMEDOUT, errno);
+
+    // the fd stays registered across waits
+    char buf[16];
+    for (int i = 0; i < 3; ++i) {
+        thread_create(&write_after_1ms, (void*)(uint64_t)fds[1]);
+        EXPECT_EQ(0, wait_for_fd_readable(fds[0], 1000 * 1000));
+        EXPECT_EQ(1, ::read(fds[0], buf, sizeof(buf)));
+    }
+
+    // an edge arriving with no waiter is consumed by the next wait
+    EXPECT_EQ(1, ::write(fds[1], "x", 1));
+    thread_usleep(1000);
+    EXPECT_EQ(0, wait_for_fd_readable(fds[0], 0));
+    EXPECT_EQ(1, ::read(fds[0], buf, sizeof(buf)));
+    EXPECT_EQ(-1, wait_for_fd_readable(fds[0], 10 * 1000));
+    EXPECT_EQ(ETIMEDOUT, errno);
+
+    // a forgotten fd number is registered again when reused
+    fd_events_forget(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+    ASSERT_EQ(0, pipe2(fds, O_NONBLOCK));
+    thread_create(&write_after_1ms, (void*)(uint64_t)fds[1]);
+    EXPECT_EQ(0, wait_for_fd_readable(fds[0], 1000 * 1000));
+    fd_events_forget(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static int g_interest_fd;
+static void* interest_after_1ms(void* arg)
+{
+    photon::thread_usleep(1000);
+    ((FD_Poller*)arg)->fd_interest({g_interest_fd, EVENT_READ}, (void*)1);
+    return nullptr;
+}
+
+TEST(EPoll, fd_poller)
+{
+    const int N = 40;
+    int fds[N][2];
+    auto poller = new_fd_poller(nullptr);
+    ASSERT_NE(nullptr, poller);
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, pipe2(fds[i], O_NONBLOCK));
+        // changes before the next wait are coalesced
+        poller->fd_interest({fds[i][0], EVENT_READ}, (void*)(uint64_t)(i + 1));
+        poller->fd_no_interest(fds[i][0]);
+        poller->fd_interest({fds[i][0], EVENT_READ}, (void*)(uint64_t)(i + 1));
+        EXPECT_EQ(1, ::write(fds[i][1], "x", 1));
+    }
+
+    void* data[64];
+    EXPECT_EQ(N, poller->wait_for_fds(data, 64, 1000 * 1000));
+    uint64_t sum = 0;
+    for (int i = 0; i < N; ++i)
+        sum += (uint64_t)data[i];
+    EXPECT_EQ((uint64_t)N * (N + 1) / 2, sum);
+
+    for (int i = 0; i < N; ++i)
+        poller->fd_no_interest(fds[i][0]);
+    EXPECT_EQ(-1, poller->wait_for_fds(data, 64, 10 * 1000));
+    EXPECT_EQ(ETIMEDOUT, errno);
+
+    // an interest set by another thread is seen by the wait already sleeping
+    thread_create(&interest_after_1ms, poller);
+    g_interest_fd = fds[0][0];
+    EXPECT_EQ(1, poller->wait_for_fds(data, 64, 1000 * 1000));
+    EXPECT_EQ((void*)1, data[0]);
+    poller->fd_no_interest(fds[0][0]);
+
+    delete_fd_poller(poller);
+    for (int i = 0; i < N; ++i) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+}
+
+TEST(MultiVcpu, safe_thread_interrupt)
+{
+    std::atomic<photon::thread*> sleeper{nullptr};
+    uint32_t vcpu_id = 0;
+    int wakeup_errno = 0;
+    std::thread vcpu([&]() {
+        photon::init();
+        photon::fd_events_init();
+        vcpu_id = photon::get_vcpu()->id;
+        sleeper = photon::CURRENT;
+        if (photon::thread_usleep(10 * 1000 * 1000) < 0)
+            wakeup_errno = errno;
+        photon::fd_events_fini();
+        photon::fini();
+    });
+    while (!sleeper)
+        ::usleep(1000);
+    EXPECT_NE(photon::CURRENT, sleeper.load());
+    // wake up the thread on the other vcpu, from the main vcpu
+    photon::safe_thread_interrupt(sleeper, EEXIST, 0);
+    vcpu.join();
+    EXPECT_EQ(EEXIST, wakeup_errno);
+    EXPECT_NE(0U, vcpu_id);
+    EXPECT_EQ(0U, photon::get_vcpu()->id);
+}
+
 int main(int argc, char** arg)
 {
     photon::init();
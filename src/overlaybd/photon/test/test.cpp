@@ -16,12 +16,19 @@
 #include "../thread.cpp"
 #include "../thread11.h"
 #include "../thread-pool.h"
+#include "../vcpu-pool.h"
+#include "../channel.h"
+#include "../offload.h"
+#include "../syncio/fd-events.h"
+#include "../../utility.h"
 #include <inttypes.h>
 #include <math.h>
 #include <string>
 #include <random>
 #include <queue>
 #include <algorithm>
+#include <atomic>
+#include <pthread.h>
 #include <sys/time.h>
 #include <gtest/gtest.h>
 #include <gflags/gflags.h>
@@ -810,6 +817,53 @@ TEST(ThreadPool, test)
     LOG_INFO("???????????????");
 }
 
+void *tp_sleep(void *arg)
+{
+    photon::thread_usleep((uint64_t)arg);
+    return nullptr;
+}
+
+TEST(ThreadPool, limits)
+{
+    auto pool = photon::new_thread_pool(64);
+    pool->set_limits(4, 2, 2);
+    ThreadPoolStats st;
+    pool->get_stats(&st);
+    EXPECT_EQ(4UL, st.idle);
+
+    EXPECT_EQ(0, pool->submit(&tp_sleep, (void*)(20*1000UL)));
+    EXPECT_EQ(0, pool->submit(&tp_sleep, (void*)(20*1000UL)));
+    EXPECT_EQ(0, pool->submit(&tp_sleep, (void*)(20*1000UL)));
+    EXPECT_EQ(0, pool->submit(&tp_sleep, (void*)(20*1000UL)));
+    pool->get_stats(&st);
+    EXPECT_EQ(2UL, st.busy);
+    EXPECT_EQ(2UL, st.queue_length);
+    EXPECT_EQ(2UL, st.queued);
+
+    // full queue: rejected at once, or accepted after waiting for room
+    EXPECT_EQ(-1, pool->submit(&tp_sleep, nullptr, 0));
+    EXPECT_EQ(EBUSY, errno);
+    EXPECT_EQ(0, pool->submit(&tp_sleep, (void*)(20*1000UL)));
+
+    photon::thread_usleep(200*1000);
+    pool->get_stats(&st);
+    EXPECT_EQ(0UL, st.busy);
+    EXPECT_EQ(0UL, st.queue_length);
+    EXPECT_EQ(5UL, st.tasks);
+    EXPECT_EQ(1UL, st.rejected);
+    EXPECT_GT(st.queue_wait_us, 0UL);
+    EXPECT_GE(st.exec_us, 5*15*1000UL);
+
+    // idle threads are reaped by autoscale, down to the minimum
+    EXPECT_EQ(4UL, st.idle);
+    pool->set_limits(2, 2, 2);
+    pool->enable_autoscale();
+    photon::thread_usleep(3500*1000);
+    pool->get_stats(&st);
+    EXPECT_EQ(2UL, st.idle);
+    photon::delete_thread_pool(pool);
+}
+
 uint64_t rw_count;
 bool writing = false;
 photon::rwlock rwl;
@@ -871,6 +925,341 @@ TEST(RWLock, interrupt) {
     EXPECT_EQ(EALREADY, errno);
 }
 
+static void* rwlock_writer(void* arg) {
+    auto rwl = (photon::rwlock*)arg;
+    rwl->lock(photon::WLOCK);
+    rwl->unlock();
+    return nullptr;
+}
+
+TEST(RWLock, fast_path) {
+    photon::set_thread_stats(true);
+    DEFER(photon::set_thread_stats(false));
+    photon::thread_stats s0, s1;
+    photon::thread_get_group_stats(nullptr, &s0);
+    photon::rwlock rwl;
+    photon::mutex m;
+    photon::semaphore sem(1);
+    for (int i = 0; i < 1000; i++) {
+        EXPECT_EQ(0, rwl.lock(photon::RLOCK));
+        EXPECT_EQ(0, rwl.lock(photon::RLOCK));
+        rwl.unlock();
+        rwl.unlock();
+        EXPECT_EQ(0, rwl.lock(photon::WLOCK));
+        rwl.unlock();
+        EXPECT_EQ(0, m.lock());
+        m.unlock();
+        EXPECT_EQ(0, sem.wait(1));
+        sem.signal(1);
+    }
+    // uncontended, nothing is switched to
+    photon::thread_get_group_stats(nullptr, &s1);
+    EXPECT_EQ(s0.switches, s1.switches);
+
+    // a waiting writer holds off new readers, which queue behind it
+    EXPECT_EQ(0, rwl.lock(photon::RLOCK));
+    auto jh = photon::thread_enable_join(photon::thread_create(&rwlock_writer, &rwl));
+    photon::thread_yield();
+    EXPECT_EQ(-1, rwl.lock(photon::RLOCK, 1000));
+    EXPECT_EQ(ETIMEDOUT, errno);
+    rwl.unlock();
+    photon::thread_join(jh);
+    EXPECT_EQ(0, rwl.lock(photon::WLOCK, 0));
+    rwl.unlock();
+}
+
+struct vcpu_task_args {
+    std::atomic<int> done{0};
+    std::atomic<photon::thread*> sleeper{nullptr};
+    std::atomic<int> sleeper_errno{0};
+};
+
+void* vcpu_sleep_task(void* arg) {
+    auto args = (vcpu_task_args*)arg;
+    photon::thread_usleep(10 * 1000);
+    args->done++;
+    return nullptr;
+}
+
+void* vcpu_sleeper_task(void* arg) {
+    auto args = (vcpu_task_args*)arg;
+    args->sleeper = photon::CURRENT;
+    if (photon::thread_usleep(10UL * 1000 * 1000) < 0)
+        args->sleeper_errno = errno;
+    args->done++;
+    return nullptr;
+}
+
+TEST(VcpuPool, steal) {
+    vcpu_task_args args;
+    auto pool = photon::new_vcpu_pool(4, 2);
+    ASSERT_NE(nullptr, pool);
+    EXPECT_EQ(4U, pool->size());
+    // all queued to vcpu 0, which runs 2 at a time
+    for (int i = 0; i < 40; i++)
+        EXPECT_EQ(0, pool->submit(&vcpu_sleep_task, &args, 0));
+    delete pool;
+    EXPECT_EQ(40, args.done.load());
+}
+
+TEST(VcpuPool, steal_count) {
+    vcpu_task_args args;
+    auto pool = photon::new_vcpu_pool(4, 1);
+    ASSERT_NE(nullptr, pool);
+    for (int i = 0; i < 40; i++)
+        pool->submit(&vcpu_sleep_task, &args, 0);
+    while (args.done < 40)
+        photon::thread_usleep(1000);
+    uint64_t stolen = 0;
+    for (uint32_t i = 0; i < pool->size(); i++)
+        stolen += pool->stolen(i);
+    EXPECT_EQ(0U, pool->stolen(0));
+    EXPECT_GT(stolen, 0U);
+    delete pool;
+}
+
+TEST(VcpuPool, cross_vcpu_interrupt) {
+    photon::fd_events_init();
+    DEFER(photon::fd_events_fini());
+    vcpu_task_args args;
+    auto pool = photon::new_vcpu_pool(2);
+    ASSERT_NE(nullptr, pool);
+    pool->submit(&vcpu_sleeper_task, &args, 1);
+    while (!args.sleeper)
+        photon::thread_usleep(1000);
+    EXPECT_EQ(pool->get_vcpu(1), photon::get_vcpu(args.sleeper));
+    EXPECT_NE(photon::get_vcpu(), photon::get_vcpu(args.sleeper));
+    // until it sleeps
+    while (photon::thread_stat(args.sleeper) != photon::WAITING)
+        photon::thread_usleep(1000);
+    photon::thread_interrupt(args.sleeper, EEXIST);
+    delete pool;
+    EXPECT_EQ(1, args.done.load());
+    EXPECT_EQ(EEXIST, args.sleeper_errno.load());
+}
+
+void* stack_touch(void* arg) {
+    char buf[32 * 1024];
+    memset(buf, (int)(uint64_t)arg, sizeof(buf));
+    photon::thread_usleep(1000);
+    return (void*)(uint64_t)buf[sizeof(buf) - 1];
+}
+
+TEST(Stack, pool) {
+    const uint64_t size = 64 * 1024;
+    // emptied, as other tests have filled it
+    photon::set_stack_pool_size(0);
+    EXPECT_EQ(0U, photon::get_stack_pool_count());
+    photon::set_stack_pool_size(photon::DEFAULT_STACK_POOL_SIZE);
+    std::vector<photon::join_handle*> jhs;
+    for (uint64_t i = 0; i < 16; i++) {
+        auto th = photon::thread_create(&stack_touch, (void*)i, size);
+        ASSERT_NE(nullptr, th);
+        jhs.push_back(photon::thread_enable_join(th));
+    }
+    for (auto jh : jhs)
+        photon::thread_join(jh);
+    EXPECT_EQ(16U, photon::get_stack_pool_count());
+    // reused by threads of the same size, not by the others
+    auto th = photon::thread_create(&stack_touch, (void*)1, size);
+    EXPECT_EQ(15U, photon::get_stack_pool_count());
+    photon::thread_join(photon::thread_enable_join(th));
+    th = photon::thread_create(&stack_touch, (void*)1, size * 2);
+    EXPECT_EQ(16U, photon::get_stack_pool_count());
+    photon::thread_join(photon::thread_enable_join(th));
+    EXPECT_EQ(17U, photon::get_stack_pool_count());
+
+    photon::set_stack_pool_size(4);
+    EXPECT_EQ(4U, photon::get_stack_pool_count());
+    photon::set_stack_pool_size(photon::DEFAULT_STACK_POOL_SIZE);
+}
+
+struct wheel_sleep_args {
+    uint64_t duration;
+    int ret;
+    uint64_t elapsed;
+};
+
+void* wheel_sleep(void* arg) {
+    auto args = (wheel_sleep_args*)arg;
+    auto t0 = photon::now;
+    args->ret = photon::thread_usleep(args->duration);
+    args->elapsed = photon::now - t0;
+    return nullptr;
+}
+
+TEST(TimingWheel, sleep) {
+    const int N = 200;
+    std::vector<wheel_sleep_args> args(N);
+    std::vector<photon::thread*> ths;
+    std::vector<photon::join_handle*> jhs;
+    for (int i = 0; i < N; i++) {
+        // a few in the heap, and one beyond the range of the wheel
+        args[i].duration = (i % 10 == 0) ? 10 * 1000 : (100 + rand() % 300) * 1000;
+        if (i == 1)
+            args[i].duration = 10UL * 3600 * 1000 * 1000;
+        auto th = photon::thread_create(&wheel_sleep, &args[i]);
+        ths.push_back(th);
+        jhs.push_back(photon::thread_enable_join(th));
+    }
+    photon::thread_usleep(50 * 1000);
+    for (int i = 1; i < N; i += 4)
+        photon::thread_interrupt(ths[i], ECANCELED);
+    for (auto jh : jhs)
+        photon::thread_join(jh);
+    for (int i = 0; i < N; i++) {
+        if (i % 4 == 1) {
+            EXPECT_EQ(-1, args[i].ret);
+            EXPECT_LT(args[i].elapsed, args[i].duration);
+        } else {
+            EXPECT_EQ(0, args[i].ret);
+            EXPECT_GE(args[i].elapsed, args[i].duration);
+            EXPECT_LT(args[i].elapsed, args[i].duration + 20 * 1000);
+        }
+    }
+}
+
+static photon::mutex stats_mutex;
+static void* stats_worker(void* arg) {
+    photon::thread_set_group(photon::CURRENT, (const char*)arg);
+    // 10ms sleeping, 5ms running, and waiting for the lock held by main
+    photon::thread_usleep(10 * 1000);
+    auto t0 = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - t0 < std::chrono::milliseconds(5))
+        ;
+    photon::scoped_lock lock(stats_mutex);
+    return nullptr;
+}
+
+TEST(ThreadStats, group) {
+    photon::set_thread_stats(true);
+    DEFER(photon::set_thread_stats(false));
+    photon::thread_stats total0;
+    EXPECT_EQ(0, photon::thread_get_group_stats(nullptr, &total0));
+    std::vector<photon::join_handle*> jhs;
+    {
+        photon::scoped_lock lock(stats_mutex);
+        for (int i = 0; i < 2; i++) {
+            auto th = photon::thread_create(&stats_worker, (void*)"workers");
+            jhs.push_back(photon::thread_enable_join(th));
+        }
+        photon::thread_usleep(30 * 1000);
+    }
+    for (auto jh : jhs)
+        photon::thread_join(jh);
+
+    photon::thread_stats g, total;
+    EXPECT_EQ(0, photon::thread_get_group_stats("workers", &g));
+    EXPECT_EQ(0, photon::thread_get_group_stats(nullptr, &total));
+    EXPECT_GE(g.run_ns, 10UL * 1000 * 1000);
+    // the 2nd worker was due, but starved, while the 1st one was spinning
+    EXPECT_GE(g.runnable_ns, 4UL * 1000 * 1000);
+    EXPECT_GE(g.blocked_ns, 15UL * 1000 * 1000);
+    EXPECT_GE(g.lock_wait_ns, 15UL * 1000 * 1000);
+    EXPECT_GE(g.switches, 4UL);
+    EXPECT_GE(total.run_ns - total0.run_ns, g.run_ns);
+    EXPECT_EQ(-1, photon::thread_get_group_stats("nonexistent", &g));
+    EXPECT_EQ(ENOENT, errno);
+    photon::thread_stats_dump();
+}
+
+struct channel_item : public photon::mpsc_node {
+    int producer;
+    int seq;
+};
+
+TEST(MPSCChannel, burst) {
+    photon::fd_events_init();
+    DEFER(photon::fd_events_fini());
+    const int P = 4, N = 10000;
+    auto ch = photon::new_mpsc_channel();
+    ASSERT_NE(nullptr, ch);
+    DEFER(delete ch);
+    std::vector<channel_item> items(P * N);
+    for (int p = 0; p < P; p++) {
+        for (int i = 0; i < N; i++) {
+            items[p * N + i].producer = p;
+            items[p * N + i].seq = i;
+        }
+    }
+    struct producer_args {
+        photon::MPSCChannel* ch;
+        channel_item* items;
+    };
+    std::vector<producer_args> args;
+    for (int p = 0; p < P; p++)
+        args.push_back({ch, &items[p * N]});
+    std::vector<pthread_t> producers(P);
+    for (int p = 0; p < P; p++) {
+        pthread_create(&producers[p], nullptr, [](void* arg) -> void* {
+            auto a = (producer_args*)arg;
+            for (int i = 0; i < N; i++)
+                a->ch->send(&a->items[i]);
+            return nullptr;
+        }, &args[p]);
+    }
+    int received = 0, batches = 0;
+    std::vector<int> next(P, 0);
+    while (received < P * N) {
+        auto node = ch->recv(1000 * 1000);
+        ASSERT_NE(nullptr, node);
+        batches++;
+        for (; node; node = node->mpsc_next) {
+            auto x = (channel_item*)node;
+            EXPECT_EQ(next[x->producer], x->seq); // FIFO of each producer
+            next[x->producer] = x->seq + 1;
+            received++;
+        }
+    }
+    for (auto th : producers)
+        pthread_join(th, nullptr);
+    EXPECT_LT(batches, P * N);
+    EXPECT_EQ(nullptr, ch->recv(1000));
+}
+
+struct offload_args {
+    photon::OffloadPool* pool;
+    uint64_t n;
+    uint64_t sum;
+    pthread_t tid;
+};
+
+void* offload_sum(void* arg) {
+    auto a = (offload_args*)arg;
+    a->pool->run([&] {
+        uint64_t sum = 0;
+        for (uint64_t k = 0; k <= a->n; k++)
+            sum += k;
+        a->sum = sum;
+        a->tid = pthread_self();
+    });
+    return nullptr;
+}
+
+TEST(OffloadPool, await) {
+    photon::fd_events_init();
+    DEFER(photon::fd_events_fini());
+    auto pool = photon::new_offload_pool(4);
+    ASSERT_NE(nullptr, pool);
+    DEFER(delete pool);
+    const int N = 32;
+    std::vector<offload_args> args(N);
+    std::vector<photon::join_handle*> jhs;
+    for (int i = 0; i < N; i++) {
+        args[i] = {pool, 100000UL + i, 0, 0};
+        auto th = photon::thread_create(&offload_sum, &args[i]);
+        jhs.push_back(photon::thread_enable_join(th));
+    }
+    for (auto jh : jhs)
+        photon::thread_join(jh);
+    for (auto& a : args) {
+        EXPECT_EQ(a.n * (a.n + 1) / 2, a.sum);
+        EXPECT_FALSE(pthread_equal(pthread_self(), a.tid));
+    }
+    auto ret = pool->await([](void* arg) -> void* { return (char*)arg + 1; }, (void*)1);
+    EXPECT_EQ((void*)2, ret);
+}
+
 int main(int argc, char** arg)
 {
     photon::init();
@@ -14,17 +14,81 @@
    limitations under the License.
 */
 #include "thread-pool.h"
+#include <time.h>
+#include <algorithm>
 #include "../alog.h"
 
 namespace photon {
+static uint64_t clock_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL * 1000 + ts.tv_nsec / 1000;
+}
+
 TPControl *ThreadPoolBase::thread_create_ex(thread_entry start, void *arg, bool joinable) {
     auto pCtrl = B::get();
+    m_busy++;
     pCtrl->joinable = joinable;
     pCtrl->start = start;
     pCtrl->arg = arg;
     pCtrl->cvar.notify_one();
     return pCtrl;
 }
+int ThreadPoolBase::submit(thread_entry start, void *arg, uint64_t timeout) {
+    auto expire = sat_add(now, timeout);
+    while (true) {
+        if (m_max_threads == 0 || (m_busy < m_max_threads && m_queue.empty())) {
+            thread_create_ex(start, arg);
+            return 0;
+        }
+        if (m_max_queue == 0 || m_queue.size() < m_max_queue)
+            break;
+        if (now >= expire) {
+            m_stats.rejected++;
+            LOG_ERROR_RETURN(EBUSY, -1, "the queue of thread pool is full");
+        }
+        if (m_room.wait_no_lock(expire - now) < 0 && errno != ETIMEDOUT) {
+            m_stats.rejected++;
+            return -1;
+        }
+    }
+    m_queue.push_back({start, arg, clock_us()});
+    m_stats.queued++;
+    return 0;
+}
+void ThreadPoolBase::run(TPControl *pCtrl) {
+    auto t0 = clock_us();
+    pCtrl->start(pCtrl->arg);
+    auto t1 = clock_us();
+    m_stats.exec_us += t1 - t0;
+    m_stats.tasks++;
+    // the thread goes on with the queued tasks, saving a hand-off,
+    // unless it is to be joined, or the pool has shrunk meanwhile
+    while (!pCtrl->joinable && !m_queue.empty() &&
+           (m_max_threads == 0 || m_busy <= m_max_threads)) {
+        auto task = m_queue.front();
+        m_queue.pop_front();
+        m_room.notify_one();
+        m_stats.queue_wait_us += t1 - task.ts_queued;
+        for (int k = 0; k < MAX_THREAD_LOCALS; k++)
+            thread_set_local(k, nullptr);
+        task.start(task.arg);
+        t0 = t1;
+        t1 = clock_us();
+        m_stats.exec_us += t1 - t0;
+        m_stats.tasks++;
+    }
+}
+// starts queued tasks on other threads, while the limit allows
+void ThreadPoolBase::dispatch() {
+    while (!m_queue.empty() && (m_max_threads == 0 || m_busy < m_max_threads)) {
+        auto task = m_queue.front();
+        m_queue.pop_front();
+        m_room.notify_one();
+        m_stats.queue_wait_us += clock_us() - task.ts_queued;
+        thread_create_ex(task.start, task.arg);
+    }
+}
 void *ThreadPoolBase::stub(void *arg) {
     TPControl ctrl;
     auto th = *(thread **)arg;
@@ -36,11 +100,15 @@ void *ThreadPoolBase::stub(void *arg) {
 
         if (ctrl.start == &stub)
             break;
-        thread_set_local(nullptr);
-        ctrl.start(ctrl.arg);
+        for (int k = 0; k < MAX_THREAD_LOCALS; k++)
+            thread_set_local(k, nullptr);
+        auto pool = ctrl.pool;
+        pool->run(&ctrl);
         ctrl.cvar.notify_all();
         ctrl.start = nullptr;
-        ctrl.pool->put(&ctrl);
+        pool->put(&ctrl);
+        pool->m_busy--;
+        pool->dispatch();
     }
     if (ctrl.joinable) // wait for being joined
         ctrl.cvar.wait_no_lock();
@@ -59,6 +127,32 @@ void ThreadPoolBase::join(TPControl *pCtrl) {
     while (pCtrl->start && pCtrl->start != &stub)
         pCtrl->cvar.wait_no_lock();
 }
+void ThreadPoolBase::set_limits(uint32_t min_threads, uint32_t max_threads, uint32_t max_queue) {
+    m_min_threads = std::min(min_threads, m_capacity);
+    m_max_threads = max_threads;
+    m_max_queue = max_queue;
+    while (m_size < m_min_threads) {
+        TPControl *pCtrl = nullptr;
+        m_ctor(&pCtrl);
+        B::put(pCtrl);
+    }
+    dispatch();
+    m_room.notify_all();
+}
+void ThreadPoolBase::get_stats(ThreadPoolStats *stats) {
+    *stats = m_stats;
+    stats->busy = m_busy;
+    stats->idle = m_size;
+    stats->queue_length = m_queue.size();
+}
+// reaps idle threads like IdentityPool0, but keeps `m_min_threads` of them
+uint64_t ThreadPoolBase::do_scale() {
+    auto n = (min_size_in_interval + 1) / 2;
+    while (m_size > m_min_threads && n-- > 0)
+        m_dtor(m_items[--m_size]);
+    min_size_in_interval = m_size;
+    return 0;
+}
 int ThreadPoolBase::ctor(ThreadPoolBase *pool, TPControl **out) {
     auto pCtrl = (TPControl *)CURRENT;
     auto stack_size = (uint64_t)pool->m_reserved;
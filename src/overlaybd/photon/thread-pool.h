@@ -14,6 +14,7 @@
    limitations under the License.
 */
 #pragma once
+#include <deque>
 #include "thread.h"
 #include "../identity-pool.h"
 
@@ -29,7 +30,41 @@ struct TPControl {
     bool joinable = false;
 };
 
-class ThreadPoolBase : protected IdentityPool0<TPControl> {
+struct ThreadPoolStats {
+    uint64_t tasks = 0;         // # of tasks run
+    uint64_t queued = 0;        // # of tasks that waited in the queue
+    uint64_t rejected = 0;      // # of tasks rejected by submit(), for the queue is full
+    uint64_t queue_wait_us = 0; // total time tasks spent in the queue
+    uint64_t exec_us = 0;       // total time of running the tasks
+    uint32_t busy = 0;          // # of threads running tasks currently
+    uint32_t idle = 0;          // # of threads waiting for tasks currently
+    uint32_t queue_length = 0;  // # of tasks waiting in the queue currently
+};
+
+// the task queue and limits, laid out before the IdentityPool0, which
+// must end the pool for its trailing items; being polymorphic makes it
+// the primary base, or the compiler would place it after IdentityPool0
+class TPState {
+public:
+    virtual ~TPState() {
+    }
+
+protected:
+    struct Task {
+        thread_entry start;
+        void *arg;
+        uint64_t ts_queued;
+    };
+    std::deque<Task> m_queue;
+    condition_variable m_room;
+    uint32_t m_min_threads = 0;
+    uint32_t m_max_threads = 0; // 0 for unlimited
+    uint32_t m_max_queue = 0;   // 0 for unlimited
+    uint32_t m_busy = 0;
+    ThreadPoolStats m_stats;
+};
+
+class ThreadPoolBase : protected TPState, protected IdentityPool0<TPControl> {
 public:
     using IdentityPool0<TPControl>::enable_autoscale;
     using IdentityPool0<TPControl>::disable_autoscale;
@@ -38,20 +73,33 @@ public:
     }
 
     // returns a TPControl* that can be used for join; need not be deleted;
+    // it always starts a thread, regardless of the limits of submit()
     TPControl *thread_create_ex(thread_entry start, void *arg, bool joinable = false);
 
     void join(TPControl *pCtrl);
 
+    // runs start(arg) in the pool, on a new or idle thread if less than
+    // `max_threads` are busy, or after queueing otherwise; when the queue
+    // is full, it waits for room up to `timeout`, and is rejected by
+    // returning -1 with errno == EBUSY if still full
+    int submit(thread_entry start, void *arg, uint64_t timeout = -1);
+
+    // keeps at least `min_threads` (up to the capacity) idle threads from
+    // being reaped by autoscale, and limits submit() as above; 0 for no limit
+    void set_limits(uint32_t min_threads, uint32_t max_threads, uint32_t max_queue);
+
+    void get_stats(ThreadPoolStats *stats);
+
     static ThreadPoolBase *new_thread_pool(uint32_t capacity,
                                            uint64_t stack_size = DEFAULT_STACK_SIZE) {
-        auto p = B::new_identity_pool(capacity);
-        auto pool = (ThreadPoolBase *)p;
-        pool->init(stack_size);
-        return pool;
+        auto ptr = malloc(sizeof(ThreadPoolBase) + capacity * sizeof(m_items[0]));
+        return new (ptr) ThreadPoolBase(capacity, stack_size);
     }
 
+    // tasks still in the queue are dropped
     static void delete_thread_pool(ThreadPoolBase *p) {
-        B::delete_identity_pool((B *)p);
+        p->~ThreadPoolBase();
+        free(p);
     }
 
 protected:
@@ -59,6 +107,9 @@ protected:
     static void *stub(void *arg);
     static int ctor(ThreadPoolBase *, TPControl **);
     static int dtor(ThreadPoolBase *, TPControl *);
+    void run(TPControl *pCtrl);
+    void dispatch();
+    uint64_t do_scale() override;
     void init(uint64_t stack_size) {
         m_ctor.bind(this, &ctor);
         m_dtor.bind(this, &dtor);
@@ -23,11 +23,18 @@
 #include <vector>
 #include <new>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <unordered_map>
+#include <string>
+#include <time.h>
 #include "list.h"
+#include "syncio/fd-events.h"
 #include "../alog.h"
+#include "../memory.h"
 
 namespace photon {
 static std::condition_variable idle_sleep;
@@ -39,7 +46,7 @@ static int default_idle_sleeper(uint64_t usec) {
     idle_sleep.wait_for(lock, us);
     return 0;
 }
-IdleSleeper idle_sleeper = &default_idle_sleeper;
+static __thread IdleSleeper idle_sleeper = &default_idle_sleeper;
 void set_idle_sleeper(IdleSleeper sleeper) {
     idle_sleeper = sleeper ? sleeper : &default_idle_sleeper;
 }
@@ -78,10 +85,11 @@ public:
 
 struct thread;
 typedef intrusive_list<thread> thread_list;
+static inline void account(thread *th);
 struct thread : public intrusive_list_node<thread> {
     states state = states::READY;
     int error_number = 0;
-    int idx; /* index in the sleep queue array */
+    int idx; /* index in the sleep queue array, or -2 - slot in the timing wheel */
     int flags = 0;
     int reserved;
     bool joinable = false;
@@ -90,19 +98,27 @@ struct thread : public intrusive_list_node<thread> {
                                 // than 10ms, otherwise -1 will be returned and errno == EPERM
 
     thread_list *waitq = nullptr; /* the q if WAITING in a queue */
+    vcpu_base *vcpu = nullptr;    /* the vcpu the thread is running on */
 
     thread_entry start;
     void *arg;
+    void *locals[MAX_THREAD_LOCALS - 1] = {}; /* by keys from 1 */
     void *retval;
     void *go() {
         auto _arg = arg;
         arg = nullptr; // arg will be used as thread-local variable
         return retval = start(_arg);
     }
-    char *buf;
+    char *buf = nullptr;
+    uint64_t buf_size = 0; /* size of the stack, excluding the guard page */
 
     Stack stack;
     uint64_t ts_wakeup = 0;  /* Wakeup time when thread is sleeping */
+    thread *tw_prev = nullptr, *tw_next = nullptr; /* links of the timing wheel slot */
+    uint64_t ts_account = 0;         /* when the time in current state is accounted from */
+    thread_stats stats;              /* accumulated when accounting is enabled */
+    thread_stats *group = nullptr;   /* stats of the group the thread is in, if any */
+    const char *group_name = nullptr;
     condition_variable cond; /* used for join, or timer REUSE */
 
     int set_error_number() {
@@ -115,6 +131,7 @@ struct thread : public intrusive_list_node<thread> {
     }
 
     void dequeue_ready() {
+        account(this);
         if (waitq) {
             waitq->erase(this);
             waitq = nullptr;
@@ -129,9 +146,7 @@ struct thread : public intrusive_list_node<thread> {
         return this->ts_wakeup < rhs.ts_wakeup;
     }
 
-    void dispose() {
-        delete[] buf;
-    }
+    void dispose();
 };
 
 class SleepQueue {
@@ -229,8 +244,332 @@ public:
     }
 };
 
-thread *CURRENT = new thread;
-static SleepQueue sleepq;
+// stacks are mmap()ed with a guard page at the low end, and recycled by
+// the pool of each vcpu, so that creating a thread takes no syscall when a
+// stack of the size is cached; pages of a returned stack are MADV_FREEed,
+// reclaimed by the kernel only under memory pressure, and committed lazily
+// when the stack is (re)used
+// a hierarchical timing wheel of 4 levels with 64 slots each, ticking every
+// 1024us; a sleeper is put into the slot of the level that its remaining
+// ticks fit in, and moved down a level each time the lower level rotates
+// to it, so insertion and cancellation are O(1); sleepers are woken up at
+// the tick after their wakeup time, i.e. up to 1 tick late
+class TimingWheel {
+public:
+    static const uint64_t TICK_SHIFT = 10;
+    static const uint64_t SLOT_BITS = 6;
+    static const uint64_t SLOTS = 1 << SLOT_BITS;
+    static const uint64_t LEVELS = 4;
+    static const uint64_t MAX_TICKS = 1ULL << (SLOT_BITS * LEVELS);
+
+    bool empty() const {
+        return m_count == 0;
+    }
+
+    void push(thread *th) {
+        if (m_count == 0)
+            m_tick = now >> TICK_SHIFT;
+        auto tick = (th->ts_wakeup >> TICK_SHIFT) + 1;
+        insert(th, tick);
+        m_count++;
+    }
+
+    void pop(thread *th) {
+        unlink(th);
+        m_count--;
+    }
+
+    // wakes up the sleepers due by `ts`, returning # of them
+    template <typename F>
+    int advance(uint64_t ts, F wakeup) {
+        int count = 0;
+        uint64_t to = ts >> TICK_SHIFT;
+        while (m_tick < to) {
+            if (m_count == 0) {
+                m_tick = to;
+                break;
+            }
+            // the next non-empty slot of level 0 in this rotation, or the
+            // start of the next rotation, where the upper levels cascade
+            uint64_t next = (m_tick | (SLOTS - 1)) + 1;
+            auto bits = m_bitmap[0] & (~0ULL << (m_tick & (SLOTS - 1)) << 1);
+            if (bits)
+                next = (m_tick & ~(SLOTS - 1)) + __builtin_ctzll(bits);
+            if (next > to) {
+                m_tick = to;
+                break;
+            }
+            m_tick = next;
+            if ((m_tick & (SLOTS - 1)) == 0)
+                cascade(1);
+            auto slot = m_tick & (SLOTS - 1);
+            while (auto th = m_slots[slot]) {
+                pop(th);
+                wakeup(th);
+                count++;
+            }
+        }
+        return count;
+    }
+
+    // a lower bound of the earliest wakeup time of the sleepers
+    uint64_t next_wakeup() const {
+        uint64_t ret = -1UL;
+        for (uint64_t level = 0; level < LEVELS; level++) {
+            auto bits = m_bitmap[level];
+            if (!bits)
+                continue;
+            auto base = m_tick >> (SLOT_BITS * level);
+            auto s = (base + 1) & (SLOTS - 1);
+            auto rotated = s ? (bits >> s) | (bits << (SLOTS - s)) : bits;
+            auto tick = (base + 1 + __builtin_ctzll(rotated)) << (SLOT_BITS * level);
+            ret = std::min(ret, tick);
+        }
+        return ret == -1UL ? ret : ret << TICK_SHIFT;
+    }
+
+protected:
+    thread *m_slots[LEVELS * SLOTS] = {};
+    uint64_t m_bitmap[LEVELS] = {};
+    uint64_t m_tick = 0;
+    uint32_t m_count = 0;
+
+    void insert(thread *th, uint64_t tick) {
+        if (tick < m_tick)
+            tick = m_tick;
+        auto delta = tick - m_tick;
+        if (delta >= MAX_TICKS) // to be re-inserted when cascaded down
+            tick = m_tick + (delta = MAX_TICKS - 1);
+        uint64_t level = 0;
+        while (delta >= (1ULL << (SLOT_BITS * (level + 1))))
+            level++;
+        auto s = (tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+        auto slot = level * SLOTS + s;
+        th->idx = -2 - (int)slot;
+        th->tw_prev = nullptr;
+        th->tw_next = m_slots[slot];
+        if (th->tw_next)
+            th->tw_next->tw_prev = th;
+        m_slots[slot] = th;
+        m_bitmap[level] |= 1ULL << s;
+    }
+
+    void unlink(thread *th) {
+        auto slot = -2 - th->idx;
+        if (th->tw_prev)
+            th->tw_prev->tw_next = th->tw_next;
+        else
+            m_slots[slot] = th->tw_next;
+        if (th->tw_next)
+            th->tw_next->tw_prev = th->tw_prev;
+        if (!m_slots[slot])
+            m_bitmap[slot / SLOTS] &= ~(1ULL << (slot % SLOTS));
+        th->tw_prev = th->tw_next = nullptr;
+        th->idx = -1;
+    }
+
+    // re-inserts the sleepers of the current slot of `level` into the lower ones
+    void cascade(uint64_t level) {
+        if (level >= LEVELS)
+            return;
+        auto s = (m_tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+        if (s == 0)
+            cascade(level + 1);
+        auto slot = level * SLOTS + s;
+        while (auto th = m_slots[slot]) {
+            unlink(th);
+            insert(th, (th->ts_wakeup >> TICK_SHIFT) + 1);
+        }
+    }
+};
+
+class StackPool {
+public:
+    static const uint64_t GUARD = 4096;
+    uint32_t capacity = DEFAULT_STACK_POOL_SIZE;
+
+    // threads may still come and go in later destructors, no longer pooled
+    ~StackPool() {
+        capacity = 0;
+        shrink();
+    }
+
+    char *get(uint64_t size) {
+        auto it = m_count ? m_free.find(size) : m_free.end();
+        if (it != m_free.end() && !it->second.empty()) {
+            auto p = it->second.back();
+            it->second.pop_back();
+            m_count--;
+            return p;
+        }
+        auto p = (char *)mmap(nullptr, size + GUARD, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            return nullptr;
+        mprotect(p, GUARD, PROT_NONE);
+        return p;
+    }
+
+    void put(char *p, uint64_t size) {
+        if (m_count >= capacity) {
+            munmap(p, size + GUARD);
+            return;
+        }
+#ifdef MADV_FREE
+        if (madvise(p + GUARD, size, MADV_FREE) < 0)
+#endif
+            madvise(p + GUARD, size, MADV_DONTNEED);
+        m_free[size].push_back(p);
+        m_count++;
+    }
+
+    void shrink() {
+        while (m_count > capacity) {
+            for (auto &x : m_free) {
+                if (!x.second.empty()) {
+                    munmap(x.second.back(), x.first + GUARD);
+                    x.second.pop_back();
+                    m_count--;
+                    break;
+                }
+            }
+        }
+    }
+
+    uint32_t count() const {
+        return m_count;
+    }
+
+protected:
+    std::unordered_map<uint64_t, std::vector<char *>> m_free; // by stack size
+    uint32_t m_count = 0;
+};
+
+__thread thread *CURRENT;
+static thread_local StackPool stack_pool;
+static thread_local SleepQueue sleepq;
+static thread_local TimingWheel sleepwheel;
+static thread_local uint64_t sleepwheel_threshold = DEFAULT_TIMER_WHEEL_THRESHOLD;
+static thread_local vcpu_base vcpu;
+static std::atomic<uint32_t> vcpu_count{0};
+
+// the main thread may use photon even before init(), as it always did
+static struct __main_thread_init {
+    __main_thread_init() {
+        CURRENT = new thread;
+        CURRENT->vcpu = &vcpu;
+    }
+} __main_thread_init_;
+
+// stacks of the threads alive, accounted by each vcpu in steps of a few MB,
+// so that creating a thread doesn't touch a shared counter
+static const int64_t STACK_ACCOUNT_STEP = 4 * 1024 * 1024;
+static thread_local int64_t stack_bytes_unaccounted = 0;
+
+static void account_stack(int64_t bytes) {
+    // never destructed, as threads may be disposed at exit
+    static auto account = new Memory::Account("photon_stacks");
+    stack_bytes_unaccounted += bytes;
+    if (stack_bytes_unaccounted >= STACK_ACCOUNT_STEP ||
+        stack_bytes_unaccounted <= -STACK_ACCOUNT_STEP) {
+        account->add(stack_bytes_unaccounted);
+        stack_bytes_unaccounted = 0;
+    }
+}
+
+// the stack holds `this`, so it must not be running on it
+void thread::dispose() {
+    if (buf) {
+        account_stack(-(int64_t)buf_size);
+        stack_pool.put(buf, buf_size);
+    }
+}
+
+void set_stack_pool_size(uint32_t count) {
+    stack_pool.capacity = count;
+    stack_pool.shrink();
+}
+
+uint32_t get_stack_pool_count() {
+    return stack_pool.count();
+}
+
+void set_timer_wheel_threshold(uint64_t useconds) {
+    sleepwheel_threshold = useconds;
+}
+
+// sleepers expecting to wake up soon are kept in the heap, the other ones in the wheel
+static void sleepq_push(thread *th) {
+    if (sleepwheel_threshold && th->ts_wakeup >= sat_add(now, sleepwheel_threshold))
+        sleepwheel.push(th);
+    else
+        sleepq.push(th);
+}
+
+static void sleepq_pop(thread *th) {
+    if (th->idx < -1)
+        sleepwheel.pop(th);
+    else
+        sleepq.pop(th);
+}
+
+// scheduler accounting, see set_thread_stats(); the time since a thread
+// changed its state last is accounted right before it changes again
+static thread_local bool stats_enabled = false;
+static thread_local uint64_t stats_since = -1UL;
+static thread_local thread_stats stats_total;
+static thread_local std::unordered_map<std::string, thread_stats> stats_groups;
+static thread_local join_handle *stats_dumper = nullptr;
+
+static uint64_t stats_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL * 1000 * 1000 + ts.tv_nsec;
+}
+
+static void add_stats(thread *th, uint64_t thread_stats::*field, uint64_t delta) {
+    th->stats.*field += delta;
+    stats_total.*field += delta;
+    if (th->group)
+        th->group->*field += delta;
+}
+
+static void do_account(thread *th, uint64_t t) {
+    // not accounted since enabled, so it starts from now
+    if (th->ts_account < stats_since) {
+        th->ts_account = t;
+        return;
+    }
+    auto delta = t - th->ts_account;
+    th->ts_account = t;
+    if (th->state == states::RUNNING)
+        return add_stats(th, &thread_stats::run_ns, delta);
+    if (th->state == states::READY)
+        return add_stats(th, &thread_stats::runnable_ns, delta);
+    // sleepers are resumed only when the run queue drains, so the
+    // time past their wakeup is counted as runnable
+    if (th->ts_wakeup < now) {
+        auto overdue = std::min(delta, (now - th->ts_wakeup) * 1000);
+        add_stats(th, &thread_stats::runnable_ns, overdue);
+        delta -= overdue;
+    }
+    add_stats(th, th->waitq ? &thread_stats::lock_wait_ns : &thread_stats::blocked_ns, delta);
+}
+
+static inline void account(thread *th) {
+    if (__builtin_expect(stats_enabled, 0))
+        do_account(th, stats_clock());
+}
+
+static void account_switch(thread *from, thread *to) {
+    auto t = stats_clock();
+    do_account(from, t);
+    do_account(to, t);
+    to->stats.switches++;
+    stats_total.switches++;
+    if (to->group)
+        to->group->switches++;
+}
 
 static void thread_die(thread *th) {
     th->dispose();
@@ -254,7 +593,7 @@ static void enqueue_wait(thread_list *q, thread *th, uint64_t expire) {
 static void thread_stub() {
     CURRENT->go();
     CURRENT->cond.notify_all();
-    while (CURRENT->single() && !sleepq.empty()) {
+    while (CURRENT->single() && !(sleepq.empty() && sleepwheel.empty())) {
         if (resume_sleepers() == 0)
             do_idle_sleep(-1);
     }
@@ -262,7 +601,10 @@ static void thread_stub() {
     auto th = CURRENT;
     CURRENT = CURRENT->remove_from_list();
     if (!th->joinable) {
+        if (__builtin_expect(stats_enabled, 0))
+            account_switch(th, CURRENT);
         th->state = states::DONE;
+        CURRENT->state = states::RUNNING;
         photon_die_and_jmp_to_context(th, CURRENT->stack.pointer_ref(), &thread_die);
     } else {
         switch_context(th, states::DONE, CURRENT);
@@ -270,22 +612,31 @@ static void thread_stub() {
 }
 
 thread *thread_create(void *(*start)(void *), void *arg, uint64_t stack_size) {
-    stack_size += (rand() % 32) * (1024 + 8);
-    auto ptr = new char[stack_size];
-    auto p = ptr + stack_size - sizeof(thread);
+    stack_size = (stack_size + StackPool::GUARD - 1) & ~(StackPool::GUARD - 1);
+    auto ptr = stack_pool.get(stack_size);
+    if (!ptr)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to allocate a stack of size `", stack_size);
+    // stacks of the same size are pooled, so their tops are randomized
+    // in place, rather than by the size, avoiding cache aliasing
+    uint64_t color = (rand() % 32) * (1024 + 8) % (stack_size / 4);
+    auto p = ptr + StackPool::GUARD + stack_size - sizeof(thread) - color;
     (uint64_t &)p &= ~63;
     auto th = new (p) thread;
     th->buf = ptr;
+    th->buf_size = stack_size;
+    account_stack(stack_size);
     th->idx = -1;
     th->start = start;
     th->arg = arg;
+    th->vcpu = CURRENT->vcpu;
     th->stack.init(p, &thread_stub);
     th->state = states::READY;
+    account(th);
     CURRENT->insert_tail(th);
     return th;
 }
 
-uint64_t now;
+__thread uint64_t now;
 static inline uint64_t update_now() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
@@ -306,6 +657,8 @@ static inline void prefetch_context(thread *from, thread *to) {
 }
 extern void photon_switch_context(void **, void **) asm("_photon_switch_context");
 static inline void switch_context(thread *from, states new_state, thread *to) {
+    if (__builtin_expect(stats_enabled, 0))
+        account_switch(from, to);
     from->state = new_state;
     to->state = states::RUNNING;
     photon_switch_context(from->stack.pointer_ref(), to->stack.pointer_ref());
@@ -323,13 +676,17 @@ static int resume_sleepers() {
         th->dequeue_ready();
         count++;
     }
-    return count;
+    return count + sleepwheel.advance(now, [](thread *th) { th->dequeue_ready(); });
 }
 
 states thread_stat(thread *th) {
     return th->state;
 }
 
+vcpu_base *get_vcpu(thread *th) {
+    return th->vcpu;
+}
+
 void thread_yield() {
     if (CURRENT->single()) {
         auto ret = resume_sleepers(); // photon::now will be update during resume
@@ -365,9 +722,11 @@ void thread_yield_to(thread *th) {
 }
 
 static int do_idle_sleep(uint64_t usec) {
+    auto ts = sleepwheel.next_wakeup();
     if (!sleepq.empty())
-        if (sleepq.front()->ts_wakeup > now)
-            usec = std::min(usec, sleepq.front()->ts_wakeup - now);
+        ts = std::min(ts, sleepq.front()->ts_wakeup);
+    if (ts > now)
+        usec = std::min(usec, ts - now);
     auto ret = idle_sleeper(usec);
     update_now();
     return ret;
@@ -379,8 +738,10 @@ static int thread_usleep(uint64_t useconds, thread_list *waitq) {
         thread_yield();
         return 0;
     }
+    account(CURRENT);
     CURRENT->state = states::WAITING;
     auto expire = sat_add(now, useconds);
+    CURRENT->ts_wakeup = expire;
     while (CURRENT->single()) // if no active threads available
     {
         if (resume_sleepers() > 0) // will update_now() in it
@@ -388,11 +749,15 @@ static int thread_usleep(uint64_t useconds, thread_list *waitq) {
             break;
         }
         if (now >= expire) {
+            account(CURRENT);
+            CURRENT->state = states::RUNNING;
             return 0;
         }
         do_idle_sleep(useconds);
         if (CURRENT->state == states::READY) // CURRENT has been woken up during idle sleep
         {
+            account(CURRENT);
+            CURRENT->state = states::RUNNING;
             CURRENT->set_error_number();
             return -1;
         }
@@ -403,7 +768,7 @@ static int thread_usleep(uint64_t useconds, thread_list *waitq) {
     prefetch_context(t0, CURRENT);
     assert(CURRENT != nullptr);
     enqueue_wait(waitq, t0, expire);
-    sleepq.push(t0);
+    sleepq_push(t0);
     switch_context(t0, states::WAITING, CURRENT);
     return t0->set_error_number();
 }
@@ -418,7 +783,8 @@ int thread_usleep(uint64_t useconds) {
     return thread_usleep(useconds, nullptr);
 }
 
-void thread_interrupt(thread *th, int error_number) {
+// interrupts a thread of current vcpu
+static void do_thread_interrupt(thread *th, int error_number) {
     if (th->state == states::READY) { // th is already in runing queue
         return;
     }
@@ -428,15 +794,23 @@ void thread_interrupt(thread *th, int error_number) {
 
     if (th ==
         CURRENT) { // idle_sleep may run in CURRENT's context, which may be single() and WAITING
+        account(th);
         th->state = states::READY;
         th->error_number = error_number;
         return;
     }
-    sleepq.pop(th);
+    sleepq_pop(th);
     th->dequeue_ready();
     th->error_number = error_number;
 }
 
+void thread_interrupt(thread *th, int error_number) {
+    // a thread of another vcpu is interrupted by its own vcpu
+    if (th && th->vcpu != CURRENT->vcpu)
+        return safe_thread_interrupt(th, error_number, 0);
+    do_thread_interrupt(th, error_number);
+}
+
 join_handle *thread_enable_join(thread *th, bool flag) {
     th->joinable = flag;
     return (join_handle *)th;
@@ -464,12 +838,96 @@ int thread_shutdown(thread *th, bool flag) {
     return 0;
 }
 
+static void *stats_dump_loop(void *interval) {
+    while (thread_usleep((uint64_t)interval) == 0)
+        thread_stats_dump();
+    return nullptr;
+}
+
+void set_thread_stats(bool enable, uint64_t dump_interval) {
+    if (stats_dumper) {
+        thread_interrupt((thread *)stats_dumper, ECANCELED);
+        thread_join(stats_dumper);
+        stats_dumper = nullptr;
+    }
+    if (enable && !stats_enabled)
+        stats_since = stats_clock();
+    stats_enabled = enable;
+    if (!enable)
+        return;
+    account(CURRENT);
+    if (dump_interval) {
+        auto th = thread_create(&stats_dump_loop, (void *)dump_interval, 64 * 1024);
+        if (th)
+            stats_dumper = thread_enable_join(th);
+    }
+}
+
+int thread_get_stats(thread *th, thread_stats *stats) {
+    if (!th || !stats || th->vcpu != CURRENT->vcpu)
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid argument(s)");
+    account(th);
+    *stats = th->stats;
+    return 0;
+}
+
+int thread_set_group(thread *th, const char *name) {
+    if (!th || th->vcpu != CURRENT->vcpu)
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid thread");
+    if (th->group_name == name || (name && th->group_name && strcmp(name, th->group_name) == 0))
+        return 0;
+    account(th); // the time so far goes to the previous group
+    if (name) {
+        auto it = stats_groups.emplace(name, thread_stats()).first;
+        th->group = &it->second;
+        th->group_name = it->first.c_str();
+    } else {
+        th->group = nullptr;
+        th->group_name = nullptr;
+    }
+    return 0;
+}
+
+int thread_get_group_stats(const char *name, thread_stats *stats) {
+    if (!stats)
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid argument(s)");
+    account(CURRENT);
+    if (!name) {
+        *stats = stats_total;
+        return 0;
+    }
+    auto it = stats_groups.find(name);
+    if (it == stats_groups.end())
+        LOG_ERROR_RETURN(ENOENT, -1, "no thread group `", name);
+    *stats = it->second;
+    return 0;
+}
+
+static void log_thread_stats(const char *name, const thread_stats &x) {
+    LOG_INFO("thread stats of vcpu `, `: run `us, runnable `us, lock wait `us, blocked `us, ` switches",
+             vcpu.id, name, x.run_ns / 1000, x.runnable_ns / 1000, x.lock_wait_ns / 1000,
+             x.blocked_ns / 1000, x.switches);
+}
+
+void thread_stats_dump() {
+    account(CURRENT);
+    log_thread_stats("all threads", stats_total);
+    for (auto &x : stats_groups)
+        log_thread_stats(x.first.c_str(), x.second);
+}
+
 void *thread_get_local() {
     return CURRENT->arg;
 }
 void thread_set_local(void *local) {
     CURRENT->arg = local;
 }
+void *thread_get_local(int key) {
+    return key == 0 ? CURRENT->arg : CURRENT->locals[key - 1];
+}
+void thread_set_local(int key, void *local) {
+    (key == 0 ? CURRENT->arg : CURRENT->locals[key - 1]) = local;
+}
 
 void Timer::stub() {
     auto timeout = _default_timeout;
@@ -514,10 +972,10 @@ void waitq::resume(thread *th) {
     assert(th->waitq == (thread_list *)&q);
     if (!th || !q || th->waitq != (thread_list *)&q)
         return;
-    // will update q during thread_interrupt()
-    thread_interrupt(th, ECANCELED);
+    // will update q during thread_interrupt(); a waitq is used within its vcpu
+    do_thread_interrupt(th, ECANCELED);
 }
-int mutex::lock(uint64_t timeout) {
+int mutex::lock_contended(uint64_t timeout) {
     if (owner == CURRENT)
         LOG_ERROR_RETURN(EINVAL, -1, "recursive locking is not supported");
 
@@ -535,13 +993,6 @@ int mutex::lock(uint64_t timeout) {
     owner = CURRENT;
     return 0;
 }
-void mutex::unlock() {
-    if (owner != CURRENT)
-        return;
-
-    owner = nullptr;
-    resume_one();
-}
 int condition_variable::wait_no_lock(uint64_t timeout) {
     return waitq::wait(timeout);
 }
@@ -563,9 +1014,7 @@ void condition_variable::notify_all() {
     while (q)
         resume_one();
 }
-int semaphore::wait(uint64_t count, uint64_t timeout) {
-    if (count == 0)
-        return 0;
+int semaphore::wait_contended(uint64_t count, uint64_t timeout) {
     while (m_count < count) {
         CURRENT->retval = (void *)count;
         int ret = waitq::wait(timeout);
@@ -579,17 +1028,15 @@ int semaphore::wait(uint64_t count, uint64_t timeout) {
     m_count -= count;
     return 0;
 }
-int semaphore::signal(uint64_t count) {
-    m_count += count;
+void semaphore::resume_waiters() {
     while (q) {
         auto q_front_count = (uint64_t)q->retval;
         if (m_count < q_front_count)
             break;
         resume_one();
     }
-    return 0;
 }
-int rwlock::lock(int mode, uint64_t timeout) {
+int rwlock::lock_contended(int mode, uint64_t timeout) {
     if (mode != RLOCK && mode != WLOCK)
         LOG_ERROR_RETURN(EINVAL, -1, "mode unknow");
     // backup retval
@@ -617,23 +1064,20 @@ int rwlock::lock(int mode, uint64_t timeout) {
     state += op;
     return 0;
 }
-int rwlock::unlock() {
-    assert(state != 0);
-    if (state > 0)
-        state--;
+void rwlock::resume_waiters() {
+    if (((uint64_t)q->retval) & WLOCK)
+        resume_one();
     else
-        state++;
-    if (state == 0 && q) {
-        if (((uint64_t)q->retval) & WLOCK)
+        while (q && (((uint64_t)q->retval) & RLOCK))
             resume_one();
-        else
-            while (q && (((uint64_t)q->retval) & RLOCK))
-                resume_one();
-    }
-    return 0;
 }
 
 int init() {
+    if (!CURRENT) {
+        CURRENT = new thread;
+        CURRENT->vcpu = &vcpu;
+        vcpu.id = ++vcpu_count;
+    }
     CURRENT->idx = -1;
     CURRENT->state = states::RUNNING;
     update_now();
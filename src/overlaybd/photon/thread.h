@@ -19,13 +19,26 @@
 #include <errno.h>
 
 namespace photon {
+// init() / fini() the photon environment of the calling OS thread;
+// each OS thread that has been init()ed runs as an independent vcpu,
+// with its own run queue, sleep queue and event engine
 int init();
 int fini();
 
 struct timer;
 struct thread;
-extern thread *CURRENT;
-extern uint64_t now;
+extern __thread thread *CURRENT;
+extern __thread uint64_t now;
+
+// per-vcpu data, accessible to the attached event engines
+struct vcpu_base {
+    void *event_engine = nullptr; // installed by the fd events engine, if any
+    uint32_t id = 0;              // 0 for the main (static-init) thread
+};
+
+// the vcpu that `th` belongs to; threads never leave their vcpu,
+// see vcpu-pool.h for running tasks across vcpus
+vcpu_base *get_vcpu(thread *th = CURRENT);
 
 enum states {
     READY = 0,   // ready to run
@@ -36,8 +49,24 @@ enum states {
 
 typedef void *(*thread_entry)(void *);
 const uint64_t DEFAULT_STACK_SIZE = 8 * 1024 * 1024;
+// the stack, of any size, is rounded up to pages and guarded by an
+// inaccessible page below it; returns nullptr if failed to allocate it
 thread *thread_create(thread_entry start, void *arg, uint64_t stack_size = DEFAULT_STACK_SIZE);
 
+// stacks of dead threads are cached by the pool of their vcpu, up to
+// `count` of them, to be reused by threads created with the same size;
+// their pages are given back lazily, with MADV_FREE
+const uint32_t DEFAULT_STACK_POOL_SIZE = 128;
+void set_stack_pool_size(uint32_t count);
+uint32_t get_stack_pool_count(); // # of stacks cached by current vcpu
+
+// sleeps, or waits with timeout, lasting `useconds` or longer are timed by
+// a hierarchical timing wheel of current vcpu, with O(1) insertion and
+// cancellation, but at the resolution of 1ms; shorter ones are timed by a
+// heap, precisely; 0 times all of them by the heap
+const uint64_t DEFAULT_TIMER_WHEEL_THRESHOLD = 100 * 1000;
+void set_timer_wheel_threshold(uint64_t useconds);
+
 // Threads are join-able *only* through their join_handle.
 // Once join is enabled, the thread will remain existing until being joined.
 // Failing to do so will cause resource leak.
@@ -65,6 +94,9 @@ inline void thread_suspend() {
 }
 
 states thread_stat(thread *th = CURRENT);
+// `th` may belong to another vcpu, which is then asked to interrupt it,
+// if its fd events engine is inited; the interrupt takes effect
+// asynchronously, when `th` is sleeping or waiting by then
 void thread_interrupt(thread *th, int error_number = EINTR);
 inline void thread_resume(thread *th) {
     thread_interrupt(th, 0);
@@ -77,11 +109,37 @@ inline void thread_resume(thread *th) {
 // with EPERM)
 int thread_shutdown(thread *th, bool flag = true);
 
+// scheduler accounting of current vcpu, off by default; when enabled, each
+// thread accumulates the time it spends in each state, in nanoseconds
+struct thread_stats {
+    uint64_t run_ns = 0;       // RUNNING on the vcpu
+    uint64_t runnable_ns = 0;  // READY, but waiting for the vcpu to run it
+    uint64_t lock_wait_ns = 0; // WAITING in a waitq: mutex, cv, semaphore, rwlock
+    uint64_t blocked_ns = 0;   // WAITING otherwise: fd events, sleep, etc.
+    uint64_t switches = 0;     // # of times switched to
+};
+// if `dump_interval` (in us) is not 0, stats of the groups of current vcpu
+// are also logged periodically, by a thread created for that
+void set_thread_stats(bool enable, uint64_t dump_interval = 0);
+int thread_get_stats(thread *th, thread_stats *stats);
+// threads of current vcpu may be grouped by `name` (nullptr to ungroup), and
+// a group accumulates the stats of its threads, including the dead ones
+int thread_set_group(thread *th, const char *name);
+// stats of a group of current vcpu, or of all its threads if `name` is nullptr
+int thread_get_group_stats(const char *name, thread_stats *stats);
+void thread_stats_dump();
+
 // the getter and setter of thread-local variable
 // getting and setting local in a timer context will cause undefined behavior!
 void *thread_get_local();
 void thread_set_local(void *local);
 
+// more thread-local variables, by keys from 1 to MAX_THREAD_LOCALS - 1, key
+// 0 being the one above; all of them are nullptr in a new thread
+const int MAX_THREAD_LOCALS = 4;
+void *thread_get_local(int key);
+void thread_set_local(int key, void *local);
+
 class waitq {
 public:
     int wait(uint64_t timeout = -1);
@@ -104,12 +162,27 @@ protected:
     thread *q = nullptr; // the first thread in queue, if any
 };
 
+// the locks below are used within a vcpu, like waitq, so their uncontended
+// acquiring and releasing are inlined plain stores, and only contention
+// goes out of line into the waitq
 class mutex : protected waitq {
 public:
-    void unlock();
-    int lock(uint64_t timeout = -1);    // threads are guaranteed to get the lock
-    int try_lock(uint64_t timeout = -1) // in FIFO order, when there's contention
-    {
+    void unlock() {
+        if (owner != CURRENT)
+            return;
+        owner = nullptr;
+        resume_one();
+    }
+    // threads are guaranteed to get the lock
+    // in FIFO order, when there's contention
+    int lock(uint64_t timeout = -1) {
+        if (!owner) {
+            owner = CURRENT;
+            return 0;
+        }
+        return lock_contended(timeout);
+    }
+    int try_lock(uint64_t timeout = -1) {
         return owner ? -1 : lock();
     }
     ~mutex() {
@@ -118,6 +191,7 @@ public:
 
 protected:
     thread *owner = nullptr;
+    int lock_contended(uint64_t timeout);
 };
 
 class scoped_lock {
@@ -187,11 +261,24 @@ class semaphore : protected waitq // NOT TESTED YET
 public:
     explicit semaphore(uint64_t count) : m_count(count) {
     }
-    int wait(uint64_t count, uint64_t timeout = -1);
-    int signal(uint64_t count);
+    int wait(uint64_t count, uint64_t timeout = -1) {
+        if (m_count >= count) {
+            m_count -= count;
+            return 0;
+        }
+        return wait_contended(count, timeout);
+    }
+    int signal(uint64_t count) {
+        m_count += count;
+        if (q)
+            resume_waiters();
+        return 0;
+    }
 
 protected:
     uint64_t m_count;
+    int wait_contended(uint64_t count, uint64_t timeout);
+    void resume_waiters();
 };
 
 // to be different to timer flags
@@ -201,11 +288,32 @@ constexpr int RLOCK = 0x1000;
 constexpr int WLOCK = 0x2000;
 class rwlock : protected waitq {
 public:
-    int lock(int mode, uint64_t timeout = -1);
-    int unlock();
+    // `state` > 0 for the # of readers, or -1 for the writer
+    int lock(int mode, uint64_t timeout = -1) {
+        if (!q) {
+            if (mode == RLOCK && state >= 0) {
+                state++;
+                return 0;
+            }
+            if (mode == WLOCK && state == 0) {
+                state = -1;
+                return 0;
+            }
+        }
+        return lock_contended(mode, timeout);
+    }
+    int unlock() {
+        assert(state != 0);
+        state += (state > 0) ? -1 : 1;
+        if (state == 0 && q)
+            resume_waiters();
+        return 0;
+    }
 
 protected:
     int64_t state = 0;
+    int lock_contended(int mode, uint64_t timeout);
+    void resume_waiters();
 };
 
 class scoped_rwlock {
@@ -0,0 +1,209 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "vcpu-pool.h"
+#include <atomic>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "syncio/fd-events.h"
+#include "../alog.h"
+
+namespace photon {
+
+class VcpuPoolImpl : public VcpuPool {
+public:
+    VcpuPoolImpl(uint32_t max_running) : m_max_running(max_running) {
+    }
+
+    ~VcpuPoolImpl() {
+        m_stopping = true;
+        for (auto w : m_workers)
+            wakeup(w);
+        for (auto w : m_workers) {
+            if (w->th.joinable())
+                w->th.join();
+            delete w;
+        }
+    }
+
+    int start(uint32_t nvcpu) {
+        for (uint32_t i = 0; i < nvcpu; i++)
+            m_workers.push_back(new Worker(i));
+        for (auto w : m_workers) {
+            auto ready = w->ready.get_future();
+            w->th = std::thread(&VcpuPoolImpl::run, this, w);
+            if (ready.get() < 0)
+                LOG_ERROR_RETURN(0, -1, "failed to start vcpu ` of the pool", w->index);
+        }
+        return 0;
+    }
+
+    int submit(thread_entry start, void *arg, int index) override {
+        if (m_stopping)
+            LOG_ERROR_RETURN(ESHUTDOWN, -1, "vcpu pool is stopping");
+        uint32_t i = index < 0 ? m_next++ : (uint32_t)index;
+        auto w = m_workers[i % m_workers.size()];
+        {
+            std::lock_guard<std::mutex> lock(w->mtx);
+            w->queue.push_back({start, arg});
+            w->queued++;
+        }
+        wakeup(w);
+        // to be stolen by an idle vcpu, if `w` is busy
+        if (w->running >= m_max_running) {
+            for (auto x : m_workers) {
+                if (x->idle) {
+                    wakeup(x);
+                    break;
+                }
+            }
+        }
+        return 0;
+    }
+
+    uint32_t size() override {
+        return m_workers.size();
+    }
+
+    vcpu_base *get_vcpu(uint32_t index) override {
+        return m_workers[index]->vcpu;
+    }
+
+    uint64_t stolen(uint32_t index) override {
+        return m_workers[index]->stolen;
+    }
+
+protected:
+    static const uint64_t IDLE_US = 10 * 1000; // max time an idle vcpu waits to steal again
+
+    struct Task {
+        thread_entry start;
+        void *arg;
+    };
+
+    struct Worker {
+        uint32_t index;
+        std::thread th;
+        std::promise<int> ready;
+        vcpu_base *vcpu = nullptr;
+        thread *dispatcher = nullptr;
+        std::mutex mtx;
+        std::deque<Task> queue;
+        std::atomic<uint32_t> queued{0}, running{0};
+        std::atomic<uint64_t> stolen{0};
+        std::atomic<bool> idle{false};
+        explicit Worker(uint32_t index) : index(index) {
+        }
+    };
+
+    struct TaskContext {
+        VcpuPoolImpl *pool;
+        Worker *worker;
+        Task task;
+    };
+
+    std::vector<Worker *> m_workers;
+    uint32_t m_max_running;
+    std::atomic<bool> m_stopping{false};
+    std::atomic<uint32_t> m_next{0};
+
+    // wakes up the dispatcher of `w`, if it is idle
+    void wakeup(Worker *w) {
+        if (w->idle && w->dispatcher)
+            safe_thread_interrupt(w->dispatcher, EAGAIN, 0);
+    }
+
+    static bool pop(Worker *w, Task &task) {
+        std::lock_guard<std::mutex> lock(w->mtx);
+        if (w->queue.empty())
+            return false;
+        task = w->queue.front();
+        w->queue.pop_front();
+        w->queued--;
+        return true;
+    }
+
+    // a task of its own, or the oldest one of the vcpu with the most queued
+    bool take(Worker *w, Task &task) {
+        if (pop(w, task))
+            return true;
+        Worker *victim = nullptr;
+        for (auto x : m_workers) {
+            if (x != w && x->queued > 0 && (!victim || x->queued > victim->queued))
+                victim = x;
+        }
+        if (victim && pop(victim, task)) {
+            w->stolen++;
+            return true;
+        }
+        return false;
+    }
+
+    static void *run_task(void *arg) {
+        auto ctx = (TaskContext *)arg;
+        auto w = ctx->worker;
+        ctx->task.start(ctx->task.arg);
+        delete ctx;
+        w->running--;
+        if (thread_stat(w->dispatcher) == states::WAITING)
+            thread_interrupt(w->dispatcher, EAGAIN);
+        return nullptr;
+    }
+
+    void run(Worker *w) {
+        photon::init();
+        DEFER(photon::fini());
+        if (fd_events_init() < 0) {
+            w->ready.set_value(-1);
+            return;
+        }
+        DEFER(fd_events_fini());
+        w->vcpu = photon::get_vcpu();
+        w->dispatcher = CURRENT;
+        w->ready.set_value(0);
+
+        while (true) {
+            Task task;
+            if (w->running < m_max_running && take(w, task)) {
+                w->running++;
+                thread_create(&VcpuPoolImpl::run_task, new TaskContext{this, w, task});
+                continue;
+            }
+            if (m_stopping && w->running == 0)
+                break;
+            w->idle = true;
+            // queued after the taking, without seeing it idle
+            if (w->queued == 0 || w->running >= m_max_running)
+                thread_usleep(IDLE_US);
+            w->idle = false;
+        }
+    }
+};
+
+VcpuPool *new_vcpu_pool(uint32_t nvcpu, uint32_t max_running) {
+    if (nvcpu == 0 || max_running == 0)
+        LOG_ERROR_RETURN(EINVAL, nullptr, "invalid # of vcpus ` or running tasks `", nvcpu,
+                         max_running);
+    auto pool = new VcpuPoolImpl(max_running);
+    if (pool->start(nvcpu) < 0) {
+        delete pool;
+        return nullptr;
+    }
+    return pool;
+}
+} // namespace photon
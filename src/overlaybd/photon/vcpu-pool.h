@@ -0,0 +1,44 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <inttypes.h>
+#include "thread.h"
+
+namespace photon {
+// A pool of vcpus, each an OS thread of its own with photon and the fd events
+// engine inited. Tasks are queued to the vcpus, and run there as photon
+// threads, at most `max_running` at a time on each vcpu. A vcpu with a free
+// seat and nothing queued to it steals the oldest task of the vcpu with the
+// most queued. A task never moves once started, as threads never leave
+// their vcpu, so it is free to use the photon primitives.
+class VcpuPool {
+public:
+    // stops the vcpus, after the tasks queued and running are all done
+    virtual ~VcpuPool() {
+    }
+
+    // queues `start(arg)` to vcpu `index` % size(), or to the vcpus in turn
+    // with -1; callable from any OS thread
+    virtual int submit(thread_entry start, void *arg, int index = -1) = 0;
+
+    virtual uint32_t size() = 0;
+    virtual vcpu_base *get_vcpu(uint32_t index) = 0;
+    // # of tasks run by vcpu `index` that were queued to others
+    virtual uint64_t stolen(uint32_t index) = 0;
+};
+
+VcpuPool *new_vcpu_pool(uint32_t nvcpu, uint32_t max_running = 64);
+} // namespace photon
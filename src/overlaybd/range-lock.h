@@ -15,6 +15,7 @@
 */
 #pragma once
 #include <inttypes.h>
+#include <memory>
 #include <set>
 #include "photon/thread.h"
 
@@ -123,8 +124,67 @@ protected:
             cond.notify_all();
         }
     };
-    std::set<Range> m_index;
-    typedef std::set<Range>::iterator iterator;
+    // keeps up to MAX_FREE nodes freed by the thread for reuse, so that
+    // locking and unlocking in the steady state allocates no memory
+    template <typename T>
+    struct RecyclingAllocator {
+        typedef T value_type;
+        RecyclingAllocator() = default;
+        template <typename U>
+        RecyclingAllocator(const RecyclingAllocator<U> &) {
+        }
+        T *allocate(size_t n) {
+            auto &fl = free_list();
+            if (n == 1 && fl.head) {
+                auto p = fl.head;
+                fl.head = p->next;
+                fl.count--;
+                return (T *)p;
+            }
+            return std::allocator<T>().allocate(n);
+        }
+        void deallocate(T *p, size_t n) {
+            auto &fl = free_list();
+            if (n == 1 && fl.count < MAX_FREE) {
+                auto node = (FreeNode *)p;
+                node->next = fl.head;
+                fl.head = node;
+                fl.count++;
+                return;
+            }
+            std::allocator<T>().deallocate(p, n);
+        }
+        bool operator==(const RecyclingAllocator &) const {
+            return true;
+        }
+        bool operator!=(const RecyclingAllocator &) const {
+            return false;
+        }
+
+    private:
+        enum { MAX_FREE = 64 };
+        struct FreeNode {
+            FreeNode *next;
+        };
+        static_assert(sizeof(T) >= sizeof(FreeNode), "node too small to link");
+        struct FreeList {
+            FreeNode *head = nullptr;
+            int count = 0;
+            ~FreeList() {
+                while (head) {
+                    auto p = head;
+                    head = p->next;
+                    std::allocator<T>().deallocate((T *)p, 1);
+                }
+            }
+        };
+        static FreeList &free_list() {
+            static thread_local FreeList fl;
+            return fl;
+        }
+    };
+    std::set<Range, std::less<Range>, RecyclingAllocator<Range>> m_index;
+    typedef decltype(m_index)::iterator iterator;
     uint64_t next_offset(iterator it) {
         return (++it == m_index.end()) ? (uint64_t)-1 : it->offset;
     }
@@ -0,0 +1,306 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Microbenchmarks of the hot paths of index lookup, decompression and cache
+// queries. The data is synthetic and generated from fixed seeds, so that the
+// results of different commits are comparable, e.g. with
+//     base_bench --benchmark_format=json > a.json
+// and tools/compare.py of google benchmark.
+
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "../alog.h"
+#include "../fs/aligned-file.h"
+#include "../fs/cache/cache.h"
+#include "../fs/localfs.h"
+#include "../fs/lsmt/index.h"
+#include "../fs/zfile/compressor.h"
+#include "../fs/zfile/crc32/crc32c.h"
+#include "../fs/zfile/zfile.cpp"
+#include "../io-alloc.h"
+#include "../photon/syncio/fd-events.h"
+#include "../photon/thread.h"
+
+using namespace FileSystem;
+using namespace LSMT;
+
+static const uint64_t SEED = 20210531;
+
+// sorted mappings of `n` segments of 4K to 64K, with holes in between, as
+// written by layers of a filesystem
+static std::vector<SegmentMapping> make_mappings(size_t n, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<SegmentMapping> mappings;
+    mappings.reserve(n);
+    uint64_t offset = 0, moffset = 0;
+    for (size_t i = 0; i < n; i++) {
+        offset += rng() % 4 == 0 ? 8 * (rng() % 16) : 0;
+        uint32_t length = 8 * (1 + rng() % 16);
+        mappings.emplace_back(offset, length, moffset);
+        offset += length;
+        moffset += length;
+    }
+    return mappings;
+}
+
+// looks up random blocks of range(1) bytes in an index of range(0) segments
+static void BM_IndexLookup(benchmark::State &state) {
+    auto mappings = make_mappings(state.range(0), SEED);
+    auto end = mappings.back().end();
+    std::unique_ptr<IMemoryIndex> index(
+        create_memory_index(mappings.data(), mappings.size(), 0, UINT64_MAX, false));
+    uint32_t length = state.range(1) / 512;
+    std::mt19937_64 rng(SEED);
+    SegmentMapping pm[64];
+    for (auto _ : state) {
+        Segment s{rng() % (end - length), length};
+        benchmark::DoNotOptimize(index->lookup(s, pm, 64));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IndexLookup)->ArgsProduct({{1 << 20, 4 << 20}, {4096, 65536}});
+
+// looks up random blocks of 4K in the combo index of a writable layer of
+// range(0) segments, written at random, over lower layers of 4M segments,
+// with the indexes merged into one tree if range(1)
+static void BM_ComboLookup(benchmark::State &state) {
+    auto lower = make_mappings(4 << 20, SEED);
+    auto end = lower.back().end();
+    std::unique_ptr<IMemoryIndex> index(
+        create_memory_index(lower.data(), lower.size(), 0, UINT64_MAX, false));
+    std::unique_ptr<IMemoryIndex0> index0(create_memory_index0());
+    set_combo_index_merged(state.range(1));
+    std::unique_ptr<IComboIndex> combo(create_combo_index(index0.get(), index.get(), 1, false));
+    set_combo_index_merged(false);
+    std::mt19937_64 rng(SEED);
+    for (int64_t i = 0; i < state.range(0); i++)
+        combo->insert(SegmentMapping(rng() % (end - 128), 8 * (1 + rng() % 16), i * 128));
+    SegmentMapping pm[64];
+    for (auto _ : state) {
+        Segment s{rng() % (end - 8), 8};
+        benchmark::DoNotOptimize(combo->lookup(s, pm, 64));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ComboLookup)->ArgsProduct({{1 << 16, 1 << 20}, {0, 1}});
+
+// merges range(0) layers of 1M segments each, as when an image is opened
+static void BM_MergeIndexes(benchmark::State &state) {
+    int n = state.range(0);
+    std::vector<std::vector<SegmentMapping>> layers;
+    std::vector<std::unique_ptr<IMemoryIndex>> indexes;
+    std::vector<const IMemoryIndex *> pindexes;
+    for (int i = 0; i < n; i++) {
+        layers.push_back(make_mappings(1 << 20, SEED + i));
+        auto &m = layers.back();
+        indexes.emplace_back(create_memory_index(m.data(), m.size(), 0, UINT64_MAX, false));
+        pindexes.push_back(indexes.back().get());
+    }
+    for (auto _ : state) {
+        std::unique_ptr<IMemoryIndex> merged(merge_memory_indexes(pindexes.data(), n));
+        benchmark::DoNotOptimize(merged->size());
+    }
+    state.SetItemsProcessed(state.iterations() * n * (1 << 20));
+}
+BENCHMARK(BM_MergeIndexes)->Arg(2)->Arg(8)->Unit(benchmark::kMillisecond);
+
+// looks up the offsets of random blocks in the jump table of a zfile of
+// range(0) blocks, compressed to 1K ~ 4K each
+static void BM_JumpTable(benchmark::State &state) {
+    size_t n = state.range(0);
+    std::mt19937 rng(SEED);
+    std::vector<uint32_t> sizes(n);
+    for (auto &s : sizes)
+        s = 1024 + rng() % 3072;
+    ZFile::CompressionFile::JumpTable table;
+    table.build(sizes.data(), n, 512);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(table[rng() % n]);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_JumpTable)->Arg(1 << 20)->Arg(4 << 20);
+
+// data of words from a small vocabulary, about as compressible as binaries
+static std::vector<unsigned char> make_data(size_t size) {
+    static const char *words[] = {"overlay", "block",  "\x7f" "ELF", "\0\0\0\0", "layer",
+                                  "index",   "\xff\xfe", "cache",   "lib",     "/usr/"};
+    std::mt19937 rng(SEED);
+    std::vector<unsigned char> data;
+    while (data.size() < size) {
+        if (rng() % 4 == 0) {
+            data.push_back(rng());
+            continue;
+        }
+        auto w = words[rng() % 10];
+        data.insert(data.end(), w, w + std::max<size_t>(strlen(w), 1));
+    }
+    data.resize(size);
+    return data;
+}
+
+static void BM_Crc32c(benchmark::State &state) {
+    auto data = make_data(state.range(0));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(crc32::crc32c(data.data(), data.size()));
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Crc32c)->Arg(4096)->Arg(65536);
+
+static std::unique_ptr<ZFile::ICompressor> make_lz4(size_t block_size) {
+    ZFile::CompressOptions opt(ZFile::CompressOptions::LZ4, block_size);
+    ZFile::CompressArgs args(opt);
+    return std::unique_ptr<ZFile::ICompressor>(ZFile::create_compressor(&args));
+}
+
+static void BM_Lz4Compress(benchmark::State &state) {
+    auto data = make_data(state.range(0));
+    auto lz4 = make_lz4(data.size());
+    std::vector<unsigned char> out(data.size() * 2);
+    int n = 0;
+    for (auto _ : state) {
+        n = lz4->compress(data.data(), data.size(), out.data(), out.size());
+        benchmark::DoNotOptimize(n);
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+    state.counters["ratio"] = (double)data.size() / n;
+}
+BENCHMARK(BM_Lz4Compress)->Arg(4096)->Arg(65536);
+
+static void BM_Lz4Decompress(benchmark::State &state) {
+    auto data = make_data(state.range(0));
+    auto lz4 = make_lz4(data.size());
+    std::vector<unsigned char> compressed(data.size() * 2), out(data.size());
+    int n = lz4->compress(data.data(), data.size(), compressed.data(), compressed.size());
+    if (n <= 0) {
+        state.SkipWithError("compression failed");
+        return;
+    }
+    for (auto _ : state)
+        benchmark::DoNotOptimize(lz4->decompress(compressed.data(), n, out.data(), out.size()));
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Lz4Decompress)->Arg(4096)->Arg(65536);
+
+// queries random ranges of range(0) bytes in a cache file of 64MB, whose
+// pages are cached one in every two, as fragmented as it gets
+static void BM_QueryRefillRange(benchmark::State &state) {
+    const std::string root = "/tmp/obdcache/bench/";
+    const size_t kPageSize = 4096, kPageCount = 16384;
+    system(("rm -rf " + root + " && mkdir -p " + root).c_str());
+    DEFER(system(("rm -rf " + root).c_str()));
+    {
+        int fd = ::open((root + "file").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            state.SkipWithError("failed to create the cache file");
+            return;
+        }
+        std::vector<char> page(kPageSize, 'a');
+        for (size_t i = 0; i < kPageCount; i += 2)
+            ::pwrite(fd, page.data(), kPageSize, i * kPageSize);
+        ::ftruncate(fd, kPageCount * kPageSize);
+        ::close(fd);
+    }
+    auto mediaFs = new_localfs_adaptor(root.c_str(), ioengine_psync);
+    AlignedAlloc allocator(4096);
+    std::unique_ptr<ICachedFileSystem> fs(new_full_file_cached_fs(
+        nullptr, mediaFs, kPageSize, 512, 1000 * 1000, 128ul * 1024 * 1024, &allocator));
+    std::unique_ptr<ICachedFile> file(
+        static_cast<ICachedFile *>(fs->open("/file", 0, 0644)));
+    auto store = file->get_store();
+    size_t size = state.range(0);
+    std::mt19937_64 rng(SEED);
+    for (auto _ : state) {
+        off_t offset = rng() % (kPageCount - size / kPageSize + 1) * kPageSize;
+        benchmark::DoNotOptimize(store->queryRefillRange(offset, size));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_QueryRefillRange)->Arg(4096)->Arg(65536);
+
+// the heap allocations made by the benchmarked code, counted by wrapping
+// the allocation functions of glibc
+static uint64_t heap_allocs = 0;
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
+extern "C" void *malloc(size_t size) {
+    heap_allocs++;
+    return __libc_malloc(size);
+}
+extern "C" int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    heap_allocs++;
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+// reads random ranges of range(0) bytes in range(1) iovecs, all cached, and
+// counts the heap allocations per read, which are expected to be none
+static void BM_CachedRead(benchmark::State &state) {
+    const std::string root = "/tmp/obdcache/bench/";
+    const size_t kPageSize = 4096, kPageCount = 4096;
+    system(("rm -rf " + root + " && mkdir -p " + root + "src " + root + "cache").c_str());
+    DEFER(system(("rm -rf " + root).c_str()));
+    std::vector<char> data(kPageSize * kPageCount, 'a');
+    {
+        int fd = ::open((root + "src/file").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ::pwrite(fd, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+            state.SkipWithError("failed to create the source file");
+            return;
+        }
+        ::close(fd);
+    }
+    auto srcFs = new_localfs_adaptor((root + "src").c_str(), ioengine_psync);
+    auto mediaFs = new_localfs_adaptor((root + "cache").c_str(), ioengine_psync);
+    AlignedAlloc allocator(4096);
+    std::unique_ptr<ICachedFileSystem> fs(new_full_file_cached_fs(
+        srcFs, mediaFs, kPageSize * 64, 512, 1000 * 1000, 128ul * 1024 * 1024, &allocator));
+    std::unique_ptr<IFile> file(fs->open("/file", 0, 0644));
+    if (!file || file->pread(data.data(), data.size(), 0) != (ssize_t)data.size()) {
+        state.SkipWithError("failed to fill the cache");
+        return;
+    }
+    size_t size = state.range(0), n = state.range(1);
+    std::vector<iovec> iov(n);
+    for (size_t i = 0; i < n; i++)
+        iov[i] = {&data[i * size / n], size / n};
+    std::mt19937_64 rng(SEED);
+    auto allocs = heap_allocs;
+    for (auto _ : state) {
+        off_t offset = rng() % (kPageCount - size / kPageSize + 1) * kPageSize;
+        benchmark::DoNotOptimize(file->preadv(iov.data(), n, offset));
+    }
+    state.counters["allocs"] = benchmark::Counter(heap_allocs - allocs,
+                                                  benchmark::Counter::kAvgIterations);
+    state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_CachedRead)->Args({4096, 1})->Args({65536, 16})->Args({131072, 32})->Args({262144, 64});
+
+int main(int argc, char **argv) {
+    log_output_level = ALOG_FATAL;
+    photon::init();
+    DEFER(photon::fini());
+    photon::fd_events_init();
+    DEFER(photon::fd_events_fini());
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
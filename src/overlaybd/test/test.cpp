@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <vector>
 #include <memory>
+#include <thread>
 #include <string>
 #include <gtest/gtest.h>
 #include <gtest/gtest-spi.h>
@@ -35,10 +36,13 @@
 #include "../ring.cpp"
 #include "../alog-stdstring.h"
 #include "../alog-functionptr.h"
+#include "../alog-audit.h"
 #include "../utility.h"
 #include "../string-keyed.h"
 #include "../range-lock.h"
 #include "../expirecontainer.h"
+#include "../metrics.h"
+#include "../trace.h"
 #include "../photon/timer.h"
 
 
@@ -122,6 +126,71 @@ TEST(ALog, log_to_file) {
     ::close(fd);
 }
 
+TEST(ALog, async_output) {
+    int fd = ::open("/tmp/logfile_async", O_RDWR | O_TRUNC | O_CREAT, 0666);
+    ASSERT_GE(fd, 0);
+    auto file = new_log_output_file(fd);
+    auto async = new_async_log_output(file, 0, true);
+    ALogLogger logger(0, async);
+    auto log_lines = [&] {
+        for (int i = 0; i < 1000; i++)
+            logger << LOG_INFO("async log line `", i);
+    };
+    std::thread th(log_lines);
+    log_lines();
+    th.join();
+    auto dropped = log_output_dropped(async);
+    EXPECT_EQ(0UL, log_output_dropped(file));
+    delete async; // flushed before deleted, along with `file`
+
+    uint64_t lines = 0, dropped_reported = 0;
+    char buf[256];
+    auto fp = fopen("/tmp/logfile_async", "r");
+    ASSERT_NE(nullptr, fp);
+    while (fgets(buf, sizeof(buf), fp)) {
+        if (strstr(buf, " log lines dropped"))
+            dropped_reported += strtoul(buf, nullptr, 10);
+        else
+            lines++;
+    }
+    fclose(fp);
+    EXPECT_EQ(2000UL, lines + dropped);
+    EXPECT_EQ(dropped, dropped_reported);
+}
+
+TEST(ALog, audit_ring) {
+    ASSERT_EQ(0, audit_ring_open("/tmp/audit_ring", 4));
+    std::string path = "/a/very/long/path/name/of/the/blob/sha256:0123456789";
+    for (int i = 0; i < 6; i++) {
+        SCOPE_AUDIT("download", AU_FILEOP(path, i * 4096, 4096));
+    }
+    {
+        SCOPE_AUDIT("connect", AU_SOCKETOP("127.0.0.1")); // in text
+    }
+    auto ring = audit_ring;
+    EXPECT_EQ(6UL, ring->next);
+    EXPECT_EQ(1U, ring->nops);
+    EXPECT_STREQ("download", ring->ops[0]);
+    auto records = (AuditRecord *)((char *)ring + AUDIT_RING_HEADER_SIZE);
+    for (uint64_t i = 2; i < 6; i++) {
+        auto &r = records[i % 4];
+        EXPECT_EQ(i + 1, r.seq);
+        EXPECT_EQ(i * 4096, r.offset);
+        EXPECT_EQ(4096, r.size);
+        EXPECT_EQ(0U, r.op);
+        EXPECT_EQ(std::hash<std::string_view>()(path), r.path_hash);
+        EXPECT_EQ(0, strncmp(path.c_str() + path.size() - sizeof(r.path), r.path,
+                             sizeof(r.path)));
+    }
+    audit_ring_close();
+    EXPECT_FALSE(audit_ring_enabled());
+    // reopened with the records kept
+    ASSERT_EQ(0, audit_ring_open("/tmp/audit_ring", 4));
+    EXPECT_EQ(6UL, audit_ring->next);
+    audit_ring_close();
+    unlink("/tmp/audit_ring");
+}
+
 TEST(ALog, float_point)
 {
     log_output = &log_output_test;
@@ -1061,6 +1130,54 @@ TEST(iovector, slice)
     EXPECT_EQ(o.iov[2].iov_base, view.iov[2].iov_base);
     EXPECT_EQ(512, view.iov[2].iov_len);
     }
+    {
+    iovector_view view;
+    auto ret = iov.slice(300, 200, &view);
+    EXPECT_EQ(300, ret);
+    EXPECT_EQ(2, view.iovcnt);
+    EXPECT_EQ((char*)o.iov[1].iov_base + 72, view.iov[0].iov_base);
+    EXPECT_EQ(184, view.iov[0].iov_len);
+    EXPECT_EQ(o.iov[2].iov_base, view.iov[1].iov_base);
+    EXPECT_EQ(116, view.iov[1].iov_len);
+    }
+}
+
+TEST(iovector, slice_iovector)
+{
+    IOVector iov;
+    iov.push_back(128);
+    iov.push_back(256);
+    iov.push_back(512);
+    auto o = iov.view();
+    IOVector part;
+    auto ret = iov.slice(300, 200, &part);
+    EXPECT_EQ(300, ret);
+    EXPECT_EQ(2, part.iovcnt());
+    EXPECT_EQ((char*)o.iov[1].iov_base + 72, part.iovec()[0].iov_base);
+    EXPECT_EQ(184, part.iovec()[0].iov_len);
+    EXPECT_EQ(o.iov[2].iov_base, part.iovec()[1].iov_base);
+    EXPECT_EQ(116, part.iovec()[1].iov_len);
+    // sliced again, over the previous result
+    ret = iov.slice(28, 100, &part);
+    EXPECT_EQ(28, ret);
+    EXPECT_EQ(1, part.iovcnt());
+    EXPECT_EQ((char*)o.iov[0].iov_base + 100, part.iovec()[0].iov_base);
+    EXPECT_EQ(0, iov.slice(0, 100, &part));
+    EXPECT_EQ(0, part.iovcnt());
+
+    // as many iovecs as the capacity, with no room preserved
+    char buf[IOVector::capacity];
+    struct iovec v[IOVector::capacity];
+    for (int i = 0; i < IOVector::capacity; i++)
+        v[i] = {buf + i, 1};
+    IOVector full(v, IOVector::capacity);
+    EXPECT_EQ(IOVector::capacity, full.iovcnt());
+    EXPECT_EQ(0, full.front_free_iovcnt());
+    EXPECT_EQ(-1, full.slice(2, 1, &part));
+    IOVectorEntity<IOVector::capacity, 0> all;
+    EXPECT_EQ(IOVector::capacity - 1, full.slice(IOVector::capacity, 1, &all));
+    EXPECT_EQ(IOVector::capacity - 1, all.iovcnt());
+    EXPECT_EQ(buf + 1, all.front().iov_base);
 }
 
 TEST(iovector, memcpy)
@@ -1580,6 +1697,102 @@ TEST(PooledAllocator, allocFailed) {
     EXPECT_EQ(nullptr, p2);
 }
 
+TEST(HugePageAllocator, basic) {
+    HugePageAllocator<> pool;
+    ASSERT_EQ(0, pool.init(4 * 1024 * 1024));
+    auto alloc = pool.get_io_alloc();
+    auto p1 = alloc.alloc(64 * 1024);
+    auto p2 = alloc.alloc(64 * 1024);
+    ASSERT_NE(nullptr, p1);
+    EXPECT_EQ(0UL, (uint64_t)p1 % 4096);
+    EXPECT_EQ(64 * 1024L, labs((char*)p2 - (char*)p1));
+    memset(p1, 1, 64 * 1024);
+    alloc.dealloc(p1);
+    EXPECT_EQ(p1, alloc.alloc(60 * 1024));
+    // a size of its own takes another hugepage
+    auto p3 = alloc.alloc(1024 * 1024);
+    EXPECT_GE(labs((char*)p3 - (char*)p1), 1024 * 1024L);
+    // the arena is exhausted, or the size too large, so malloc()ed
+    auto p4 = alloc.alloc(8 * 1024);
+    auto p5 = alloc.alloc(1024 * 1024 + 1);
+    ASSERT_NE(nullptr, p4);
+    ASSERT_NE(nullptr, p5);
+    EXPECT_EQ(0UL, (uint64_t)p5 % 4096);
+    for (auto p : {p1, p2, p3, p4, p5})
+        alloc.dealloc(p);
+}
+
+TEST(Metrics, render) {
+    auto c = Metrics::counter("test_ops_total", "ops", {{"dev", "a\"b"}});
+    EXPECT_EQ(c, Metrics::counter("test_ops_total", "ops", {{"dev", "a\"b"}}));
+    EXPECT_EQ(nullptr, Metrics::gauge("test_ops_total", "ops"));
+    c->inc(3);
+    Metrics::gauge("test_queued", "queued")->set(-2);
+    auto h = Metrics::histogram("test_latency_seconds", "latency");
+    h->observe(50);
+    h->observe(70);
+    h->observe(30000000);
+    EXPECT_EQ(3UL, h->count());
+    EXPECT_EQ(1UL, h->bucket(0));
+    EXPECT_EQ(2UL, h->bucket(1));
+    EXPECT_EQ(2UL, h->bucket(Metrics::Histogram::NBUCKETS - 1));
+    EXPECT_EQ(3UL, h->bucket(Metrics::Histogram::NBUCKETS));
+
+    auto text = Metrics::render();
+    for (auto line : {"# TYPE test_ops_total counter\n",
+                      "test_ops_total{dev=\"a\\\"b\"} 3\n",
+                      "test_queued -2\n",
+                      "test_latency_seconds_bucket{le=\"0.00005\"} 1\n",
+                      "test_latency_seconds_bucket{le=\"0.0001\"} 2\n",
+                      "test_latency_seconds_bucket{le=\"20\"} 2\n",
+                      "test_latency_seconds_bucket{le=\"+Inf\"} 3\n",
+                      "test_latency_seconds_sum 30.00012\n",
+                      "test_latency_seconds_count 3\n"})
+        EXPECT_NE(std::string::npos, text.find(line)) << line;
+
+    EXPECT_EQ(1, Metrics::remove({{"dev", "a\"b"}}));
+    EXPECT_EQ(std::string::npos, Metrics::render().find("test_ops_total"));
+}
+
+static void *check_no_trace(void *) {
+    EXPECT_EQ(nullptr, Trace::current());
+    return nullptr;
+}
+
+TEST(Trace, breakdown) {
+    {
+        // disabled
+        Trace::Request req("read", 0, 4096);
+        EXPECT_FALSE(req.active());
+        EXPECT_EQ(nullptr, Trace::current());
+    }
+    Trace::set_threshold(1000);
+    DEFER(Trace::set_threshold(0));
+    Trace::Request req("read", 4096, 8192);
+    ASSERT_TRUE(req.active());
+    EXPECT_EQ(&req, Trace::current());
+    {
+        SCOPE_TRACE("outer");
+        for (int i = 0; i < 2; i++) {
+            SCOPE_TRACE("inner");
+            photon::thread_usleep(5 * 1000);
+        }
+    }
+    auto s = req.breakdown();
+    uint64_t total, self, inner_total, inner_self;
+    int calls, inner_calls;
+    ASSERT_EQ(6, sscanf(s.c_str(), "outer:%lu/%lu(%d) inner:%lu/%lu(%d)", &total, &self, &calls,
+                        &inner_total, &inner_self, &inner_calls)) << s;
+    EXPECT_EQ(1, calls);
+    EXPECT_EQ(2, inner_calls);
+    EXPECT_GE(inner_total, 10 * 1000UL);
+    EXPECT_EQ(inner_total, inner_self);
+    EXPECT_EQ(total, self + inner_total);
+    // not inherited by other threads
+    auto th = photon::thread_create(&check_no_trace, nullptr);
+    photon::thread_yield_to(th);
+}
+
 TEST(ALog, throttled_log) {
     //update time
     photon::thread_yield();
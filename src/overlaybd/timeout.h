@@ -17,7 +17,7 @@
 #include <inttypes.h>
 
 namespace photon {
-extern uint64_t now;
+extern __thread uint64_t now;
 }
 
 class Timeout {
@@ -0,0 +1,125 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "trace.h"
+#include <string.h>
+#include <time.h>
+#include "alog-stdstring.h"
+#include "alog.h"
+#include "photon/thread.h"
+
+namespace Trace {
+
+static uint64_t threshold = 0;
+static Sink sink = nullptr;
+
+void set_threshold(uint64_t us) {
+    threshold = us;
+}
+
+uint64_t get_threshold() {
+    return threshold;
+}
+
+void set_sink(Sink s) {
+    sink = s;
+}
+
+// photon::now is not updated while a layer computes, e.g. decompresses, so
+// the monotonic clock is used
+static uint64_t clock_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+Request *current() {
+    return (Request *)photon::thread_get_local(LOCAL_KEY);
+}
+
+Request::Request(const char *op, off_t offset, size_t count)
+    : m_op(op), m_offset(offset), m_count(count) {
+    if (threshold == 0)
+        return;
+    m_start = clock_us();
+    m_prev = photon::thread_get_local(LOCAL_KEY);
+    photon::thread_set_local(LOCAL_KEY, this);
+}
+
+Request::~Request() {
+    if (!active())
+        return;
+    photon::thread_set_local(LOCAL_KEY, m_prev);
+    auto elapsed = clock_us() - m_start;
+    if (sink)
+        sink(*this, elapsed);
+    if (elapsed >= threshold)
+        LOG_WARN("slow ` of ` bytes at ` took `us: `", m_op, m_count, m_offset, elapsed,
+                 breakdown());
+}
+
+void Request::enter(const char *name) {
+    if (m_depth == MAX_DEPTH) {
+        m_dropped++;
+        return;
+    }
+    // names are string literals, compared by address first
+    int layer = -1;
+    for (int i = 0; i < m_nlayers; i++) {
+        if (m_layers[i].name == name || strcmp(m_layers[i].name, name) == 0) {
+            layer = i;
+            break;
+        }
+    }
+    if (layer < 0 && m_nlayers < MAX_LAYERS) {
+        layer = m_nlayers++;
+        m_layers[layer] = {name, 0, 0, 0};
+    }
+    m_stack[m_depth++] = {layer, clock_us(), 0};
+}
+
+void Request::exit() {
+    if (m_dropped > 0) {
+        m_dropped--;
+        return;
+    }
+    if (m_depth == 0)
+        return;
+    auto &f = m_stack[--m_depth];
+    auto elapsed = clock_us() - f.begin;
+    if (f.layer >= 0) {
+        auto &l = m_layers[f.layer];
+        l.total += elapsed;
+        l.self += elapsed > f.children ? elapsed - f.children : 0;
+        l.calls++;
+    }
+    if (m_depth > 0)
+        m_stack[m_depth - 1].children += elapsed;
+}
+
+std::string Request::breakdown() const {
+    std::string s;
+    for (int i = 0; i < m_nlayers; i++) {
+        auto &l = m_layers[i];
+        if (!s.empty())
+            s += ' ';
+        s += l.name;
+        s += ':' + std::to_string(l.total) + '/' + std::to_string(l.self) + '(' +
+             std::to_string(l.calls) + ')';
+    }
+    return s;
+}
+
+} // namespace Trace
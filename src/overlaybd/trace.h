@@ -0,0 +1,114 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+
+#include "utility.h"
+
+// A request, e.g. a read of the guest, may be traced through the layers of
+// files it passes, each of which opens a scope with SCOPE_TRACE(name). The
+// time spent in each layer, itself and in total, is accounted to the request
+// found in a photon thread-local variable, and the breakdown of a request
+// slower than the threshold is logged. Without a request being traced, a
+// scope costs a load and a branch.
+namespace Trace {
+
+// the key of the photon thread-local variable of the request being traced
+const int LOCAL_KEY = 1;
+
+// requests taking at least `us` are logged, 0 (the default) disables tracing
+void set_threshold(uint64_t us);
+uint64_t get_threshold();
+
+class Request;
+// called with each request traced as it completes, in its photon thread,
+// whether logged or not, e.g. to aggregate the breakdowns by a benchmark
+using Sink = void (*)(const Request &req, uint64_t elapsed);
+void set_sink(Sink sink);
+
+class Request {
+public:
+    static const int MAX_LAYERS = 16;
+    static const int MAX_DEPTH = 32;
+
+    struct Layer {
+        const char *name;
+        uint64_t total, self;
+        uint32_t calls;
+    };
+
+    // traces the calling photon thread till destructed, if enabled
+    Request(const char *op, off_t offset, size_t count);
+    ~Request();
+
+    void enter(const char *name);
+    void exit();
+    // the breakdown so far, as "name:total/self(calls) ..." in us
+    std::string breakdown() const;
+    bool active() const {
+        return m_start != 0;
+    }
+    const char *op() const {
+        return m_op;
+    }
+    // the layers entered, in the order of their first entries
+    int nlayers() const {
+        return m_nlayers;
+    }
+    const Layer &layer(int i) const {
+        return m_layers[i];
+    }
+
+protected:
+    struct Frame {
+        int layer;
+        uint64_t begin, children;
+    };
+    const char *m_op;
+    off_t m_offset;
+    size_t m_count;
+    uint64_t m_start = 0;
+    Layer m_layers[MAX_LAYERS];
+    int m_nlayers = 0;
+    Frame m_stack[MAX_DEPTH];
+    int m_depth = 0;
+    // frames beyond MAX_DEPTH, or of layers beyond MAX_LAYERS, not accounted
+    int m_dropped = 0;
+    void *m_prev;
+};
+
+Request *current();
+
+class Scope {
+public:
+    Scope(const char *name) : m_req(current()) {
+        if (m_req)
+            m_req->enter(name);
+    }
+    ~Scope() {
+        if (m_req)
+            m_req->exit();
+    }
+
+protected:
+    Request *m_req;
+};
+
+} // namespace Trace
+
+#define SCOPE_TRACE(name) Trace::Scope _CONCAT(__trace__, __LINE__)(name)
@@ -16,27 +16,51 @@
  * See the file COPYING included with this distribution for more details.
  */
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <map>
-#include <queue>
+#include <list>
 #include <unistd.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 
 #include "prefetch.h"
+#include "overlaybd/fs/cache/cache.h"
 #include "overlaybd/fs/forwardfs.h"
 #include "overlaybd/fs/localfs.h"
+#include "overlaybd/fs/registryfs/registryfs.h"
 #include "overlaybd/fs/zfile/crc32/crc32c.h"
 #include "overlaybd/alog.h"
 #include "overlaybd/alog-stdstring.h"
+#include "overlaybd/memory.h"
+#include "overlaybd/metrics.h"
+#include "overlaybd/trace.h"
 #include "overlaybd/photon/thread11.h"
 
 using namespace std;
 
 namespace FileSystem {
 
+namespace {
+struct ReplayMetrics {
+    Metrics::Counter *queued = Metrics::counter("overlaybd_prefetch_replay_ranges_total",
+                                                "Ranges of the traces to replay");
+    Metrics::Counter *done = Metrics::counter("overlaybd_prefetch_replayed_ranges_total",
+                                              "Ranges of the traces replayed");
+    Metrics::Counter *bytes = Metrics::counter("overlaybd_prefetch_replayed_bytes_total",
+                                               "Bytes of the traces replayed");
+    Metrics::Counter *failed = Metrics::counter("overlaybd_prefetch_replay_failures_total",
+                                                "Ranges of the traces failed to replay");
+};
+
+ReplayMetrics &metrics() {
+    static ReplayMetrics m;
+    return m;
+}
+} // namespace
+
 class PrefetcherImpl;
 
 class PrefetchFile : public ForwardFile_Ownership {
@@ -52,7 +76,8 @@ private:
 
 class PrefetcherImpl : public Prefetcher {
 public:
-    explicit PrefetcherImpl(const string& trace_file_path) {
+    PrefetcherImpl(const string& trace_file_path, uint64_t lead_window_us, uint32_t min_run_percent)
+        : m_lead_window_us(lead_window_us), m_min_run_percent(min_run_percent) {
         // Detect mode
         size_t file_size = 0;
         m_mode = detect_mode(trace_file_path, &file_size);
@@ -62,7 +87,8 @@ public:
 
         // Open trace file
         if (m_mode != Mode::Disabled) {
-            int flags = m_mode == Mode::Record ? O_WRONLY : O_RDONLY;
+            // a recording interrupted before is started over
+            int flags = m_mode == Mode::Record ? O_WRONLY | O_TRUNC : O_RDONLY;
             m_trace_file = FileSystem::open_localfile_adaptor(trace_file_path.c_str(), flags, 0666, 2);
         }
 
@@ -70,13 +96,17 @@ public:
         if (m_mode == Mode::Record) {
             int lock_fd = open(m_lock_file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_EXCL, 0666);
             close(lock_fd);
+            m_recorded.resize(RECORD_DEDUP_SLOTS);
             auto th = photon::thread_create11(&PrefetcherImpl::detect_lock, this);
             m_detect_thread = photon::thread_enable_join(th);
         }
 
-        // Reload if going to replay
+        // Reload if going to replay, while the layers are being opened, till replay()
         if (m_mode == Mode::Replay) {
-            reload(file_size);
+            m_trace_file_path = trace_file_path;
+            auto th = photon::thread_create11(&PrefetcherImpl::reload, this, m_trace_file_path,
+                                              file_size);
+            m_reload_thread = photon::thread_enable_join(th);
         }
     }
 
@@ -90,6 +120,7 @@ public:
             dump();
 
         } else if (m_mode == Mode::Replay) {
+            wait_for_reload();
             m_replay_stopped = true;
             for (auto th : m_replay_threads) {
                 photon::thread_shutdown((photon::thread*) th);
@@ -107,51 +138,92 @@ public:
         return new PrefetchFile(src_file, layer_index, this);
     }
 
+    // records are encoded into a buffer, which is written to the trace file in
+    // the background once it's RECORD_BUFFER_SIZE, so that the memory taken is
+    // bounded however long it records, and no read of the guest waits for it
     void record(TraceOp op, uint32_t layer_index, size_t count, off_t offset) override {
-        if (m_record_stopped) {
+        if (m_record_stopped || recorded(op, layer_index, count, offset)) {
             return;
         }
-        TraceFormat trace = {op, layer_index, count, offset};
-        m_record_array.push_back(trace);
+        // the trace file can't keep up, which is unlikely of a local file
+        if (m_record_buf.size() >= 2 * RECORD_BUFFER_SIZE) {
+            m_record_dropped++;
+            return;
+        }
+        TraceFormat trace = {op, layer_index, count, offset, photon::now - m_start_time};
+        encode_record(trace, &m_record_buf, &m_record_last_offset, &m_record_last_time);
+        m_record_count++;
+        if (m_record_buf.size() >= RECORD_BUFFER_SIZE && !m_flushing) {
+            m_flushing = true;
+            photon::thread_create11(&PrefetcherImpl::flush_records, this);
+        }
     }
 
     void replay() override {
         if (m_mode != Mode::Replay) {
             return;
         }
+        wait_for_reload();
         if (m_replay_queue.empty() || m_src_files.empty()) {
             return;
         }
         LOG_INFO("Prefetch: Replay ` records from ` layers", m_replay_queue.size(), m_src_files.size());
+        metrics().queued->inc(m_replay_queue.size());
+        m_start_time = photon::now;
         for (int i = 0; i < REPLAY_CONCURRENCY; ++i) {
-            auto th = photon::thread_create11(&PrefetcherImpl::replay_worker_thread, this);
+            auto th = photon::thread_create11(&PrefetcherImpl::replay_worker_thread, this, i,
+                                              registryfs_get_io_owner());
             auto join_handle = photon::thread_enable_join(th);
             m_replay_threads.push_back(join_handle);
         }
     }
 
-    int replay_worker_thread() {
-        static char buf[MAX_IO_SIZE];       // multi threads reuse one buffer
+    int replay_worker_thread(int index, RegistryIOOwner *owner) {
+        registryfs_set_io_owner(owner);
+        // the traced ranges are known to be hot
+        cached_fs_set_admission(ADMIT_ALWAYS);
+        DEFER(cached_fs_set_admission(ADMIT_BY_FILTER));
         while (!m_replay_queue.empty() && !m_replay_stopped) {
+            // workers beyond the allowed number pause, while reads of the guest are slow,
+            // and all but one while the node is short of memory
+            if (index >= m_replay_workers || (index > 0 && Memory::shedding())) {
+                m_replay_cv.wait_no_lock(THROTTLE_INTERVAL_US);
+                continue;
+            }
+            // let the ready reads of the guest go first
+            photon::thread_yield();
+            if (m_replay_queue.empty() || m_replay_stopped) {
+                break;
+            }
+            // a phase of the trace is issued `m_lead_window_us` before it was read
+            auto elapsed = photon::now - m_start_time;
+            auto due = m_replay_queue.front().timestamp;
+            if (m_lead_window_us > 0 && due > elapsed + m_lead_window_us) {
+                m_replay_cv.wait_no_lock(due - elapsed - m_lead_window_us);
+                continue;
+            }
             auto trace = m_replay_queue.front();
-            m_replay_queue.pop();
+            unindex(m_replay_queue.begin());
+            m_replay_queue.pop_front();
             auto iter = m_src_files.find(trace.layer_index);
             if (iter == m_src_files.end()) {
+                metrics().failed->inc();
                 continue;
             }
             auto src_file = iter->second;
             if (trace.op == PrefetcherImpl::TraceOp::READ) {
-                ssize_t n_read = src_file->pread(buf, trace.count, trace.offset);
-                if (n_read != (ssize_t) trace.count) {
-                    LOG_ERROR("Prefetch: replay pread failed: `, `, respect: `, got: `", ERRNO(), trace, trace.count, n_read);
+                // a read without buffer only fills the cache, see ICachedFile::prefetch()
+                struct iovec iov = {nullptr, trace.count};
+                Trace::Request req("replay", trace.offset, trace.count);
+                ssize_t n_read = src_file->preadv(&iov, 1, trace.offset);
+                if (n_read < (ssize_t) trace.count) {
+                    LOG_ERROR("Prefetch: replay prefetch failed: `, `, respect: `, got: `", ERRNO(), trace, trace.count, n_read);
+                    metrics().failed->inc();
                     continue;
                 }
+                metrics().bytes->inc(n_read);
             }
-        }
-        photon::thread_sleep(3);
-        if (!m_buffer_released) {
-            m_buffer_released = true;
-            madvise(buf, MAX_IO_SIZE, MADV_DONTNEED);
+            metrics().done->inc();
         }
         return 0;
     }
@@ -160,12 +232,58 @@ public:
         m_src_files[layer_index] = src_file;
     }
 
+    // a read of the guest moves the queued ranges it overlaps to the front
+    void on_read_begin(uint32_t layer_index, size_t count, off_t offset) {
+        if (m_replay_index.empty()) {
+            return;
+        }
+        // no range is longer than MAX_IO_SIZE
+        auto it = m_replay_index.lower_bound({layer_index, offset - MAX_IO_SIZE + 1});
+        vector<list<TraceFormat>::iterator> hits;
+        for (; it != m_replay_index.end() && it->first.first == layer_index &&
+               it->first.second < offset + (off_t) count; ++it) {
+            if (it->first.second + (off_t) it->second->count > offset) {
+                hits.push_back(it->second);
+            }
+        }
+        // and they are wanted right now
+        for (auto i = hits.rbegin(); i != hits.rend(); ++i) {
+            (*i)->timestamp = 0;
+            m_replay_queue.splice(m_replay_queue.begin(), m_replay_queue, *i);
+        }
+        if (!hits.empty()) {
+            m_replay_cv.notify_all();
+        }
+    }
+
+    // replay backs off multiplicatively once a read of the guest is slower
+    // than FG_LATENCY_TARGET_US, and resumes one worker for each faster one
+    void on_read_end(uint64_t latency_us) {
+        if (m_replay_queue.empty()) {
+            return;
+        }
+        if (latency_us > FG_LATENCY_TARGET_US) {
+            m_replay_workers = std::max(m_replay_workers / 2, 1);
+        } else if (m_replay_workers < REPLAY_CONCURRENCY) {
+            m_replay_workers++;
+            m_replay_cv.notify_all();
+        }
+    }
+
 private:
     struct TraceFormat {
         TraceOp op;
         uint32_t layer_index;
         size_t count;
         off_t offset;
+        uint64_t timestamp;     // in us since the start of recording, 0 in version 1
+    };
+
+    struct TraceFormatV1 {
+        TraceOp op;
+        uint32_t layer_index;
+        size_t count;
+        off_t offset;
     };
 
     struct TraceHeader {
@@ -175,21 +293,50 @@ private:
     };
 
     static const int MAX_IO_SIZE = 1024 * 1024;
+    static const int MERGE_GAP = 256 * 1024;   // the size of a cache refill unit
     static const int REPLAY_CONCURRENCY = 16;
+    static const size_t RECORD_BUFFER_SIZE = 64 * 1024;
+    static const size_t RECORD_DEDUP_SLOTS = 128 * 1024;
+    static const size_t RECORD_DEDUP_WAYS = 4;
+    static const uint64_t FG_LATENCY_TARGET_US = 50 * 1000;
+    static const uint64_t THROTTLE_INTERVAL_US = 100 * 1000;
     static const uint32_t TRACE_MAGIC = 3270449184; // CRC32 of `Container Image Trace Format`
-
-    vector<TraceFormat> m_record_array;
-    queue<TraceFormat> m_replay_queue;
+    static const uint32_t TRACE_MAGIC_V2 = 4233965968; // CRC32 of `Container Image Trace Format v2`
+    static const uint32_t TRACE_MAGIC_V3 = 2337931526; // CRC32 of `Container Image Trace Format v3`
+
+    // encoded records not written yet, and those being written
+    string m_record_buf;
+    string m_flush_buf;
+    bool m_flushing = false;
+    photon::condition_variable m_flush_cv;
+    off_t m_record_last_offset = 0;
+    uint64_t m_record_last_time = 0;
+    size_t m_record_count = 0;
+    size_t m_record_dropped = 0;
+    // the size and the checksum of the records written
+    size_t m_data_size = 0;
+    uint32_t m_checksum = 0;
+    bool m_record_failed = false;
+    // hashes of the ranges recorded lately, by which repeats are skipped
+    vector<uint64_t> m_recorded;
+    list<TraceFormat> m_replay_queue;
+    multimap<pair<uint32_t, off_t>, list<TraceFormat>::iterator> m_replay_index;
+    uint64_t m_lead_window_us = 0;
+    uint32_t m_min_run_percent = 0;
+    uint64_t m_start_time = photon::now;
+    int m_replay_workers = REPLAY_CONCURRENCY;
+    photon::condition_variable m_replay_cv;
     map<uint32_t, IFile*> m_src_files;
     vector<photon::join_handle*> m_replay_threads;
     photon::join_handle* m_detect_thread = nullptr;
+    photon::join_handle* m_reload_thread = nullptr;
+    string m_trace_file_path;
     bool m_detect_thread_interruptible = false;
     string m_lock_file_path;
     string m_ok_file_path;
     IFile* m_trace_file = nullptr;
     bool m_replay_stopped = false;
     bool m_record_stopped = false;
-    bool m_buffer_released = false;
 
     int dump() {
         if (m_trace_file == nullptr) {
@@ -208,31 +355,26 @@ private:
         };
         DEFER(close_trace_file());
 
-        TraceHeader hdr = {};
-        hdr.magic = TRACE_MAGIC;
-        hdr.checksum = 0;       // calculate and re-write checksum later
-        hdr.data_size = sizeof(TraceFormat) * m_record_array.size();
-
-        ssize_t n_written = m_trace_file->write(&hdr, sizeof(TraceHeader));
-        if (n_written != sizeof(TraceHeader)) {
-            m_trace_file->ftruncate(0);
-            LOG_ERRNO_RETURN(0, -1, "Prefetch: dump write header failed");
+        // the records left, then the header, the records being in place already
+        while (m_flushing) {
+            m_flush_cv.wait_no_lock();
         }
-
-        for (auto& each : m_record_array) {
-            hdr.checksum = crc32::crc32c_extend(&each, sizeof(TraceFormat), hdr.checksum);
-            n_written = m_trace_file->write(&each, sizeof(TraceFormat));
-            if (n_written != sizeof(TraceFormat)) {
-                m_trace_file->ftruncate(0);
-                LOG_ERRNO_RETURN(0, -1, "Prefetch: dump write content failed");
-            }
+        write_records(m_record_buf);
+        m_record_buf.clear();
+        if (m_record_failed) {
+            m_trace_file->ftruncate(0);
+            LOG_ERROR_RETURN(0, -1, "Prefetch: dump failed");
         }
-
-        n_written = m_trace_file->pwrite(&hdr, sizeof(TraceHeader), 0);
-        if (n_written != sizeof(TraceHeader)) {
+        TraceHeader hdr = {};
+        hdr.magic = TRACE_MAGIC_V3;
+        hdr.data_size = m_data_size;
+        hdr.checksum = m_checksum;
+        if (m_trace_file->pwrite(&hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr)) {
             m_trace_file->ftruncate(0);
-            LOG_ERRNO_RETURN(0, -1, "Prefetch: dump write header(checksum) failed");
+            LOG_ERRNO_RETURN(0, -1, "Prefetch: dump write failed");
         }
+        LOG_INFO("Prefetch: dump ` records, ` bytes, ` dropped", m_record_count, m_data_size,
+                 m_record_dropped);
 
         unlink(m_lock_file_path.c_str());
 
@@ -244,43 +386,350 @@ private:
         return 0;
     }
 
-    int reload(size_t trace_file_size) {
-        // Reload header
-        TraceHeader hdr = {};
-        ssize_t n_read = m_trace_file->read(&hdr, sizeof(TraceHeader));
-        if (n_read != sizeof(TraceHeader)) {
-            LOG_ERRNO_RETURN(0, -1, "Prefetch: reload header failed");
+    int flush_records() {
+        while (m_record_buf.size() >= RECORD_BUFFER_SIZE && !m_record_failed) {
+            m_flush_buf.swap(m_record_buf);
+            write_records(m_flush_buf);
+            m_flush_buf.clear();
+        }
+        m_flushing = false;
+        m_flush_cv.notify_all();
+        return 0;
+    }
+
+    void write_records(const string& buf) {
+        if (buf.empty() || m_record_failed) {
+            return;
+        }
+        auto n = m_trace_file->pwrite(buf.data(), buf.size(), sizeof(TraceHeader) + m_data_size);
+        if (n != (ssize_t) buf.size()) {
+            m_record_failed = true;
+            m_record_stopped = true;
+            LOG_ERRNO_RETURN(0, , "Prefetch: write records failed, stop recording");
+        }
+        m_checksum = crc32::crc32c_extend(buf.data(), buf.size(), m_checksum);
+        m_data_size += buf.size();
+    }
+
+    // whether the same range has been recorded lately, remembered by its hash in
+    // a set of RECORD_DEDUP_WAYS slots of m_recorded, the oldest one replaced by
+    // a new range, so as to take no more memory however long it records
+    bool recorded(TraceOp op, uint32_t layer_index, size_t count, off_t offset) {
+        uint64_t h = (uint64_t) offset * 0x9E3779B97F4A7C15ULL ^ (uint64_t) count << 20 ^
+                     (uint64_t) layer_index << 52 ^ (uint64_t) op;
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+        h = h ^ (h >> 31);
+        auto set = &m_recorded[(h >> 32) % (RECORD_DEDUP_SLOTS / RECORD_DEDUP_WAYS) *
+                               RECORD_DEDUP_WAYS];
+        h |= 1;     // 0 for an empty slot
+        if (std::find(set, set + RECORD_DEDUP_WAYS, h) != set + RECORD_DEDUP_WAYS) {
+            return true;
+        }
+        memmove(set + 1, set, (RECORD_DEDUP_WAYS - 1) * sizeof(*set));
+        set[0] = h;
+        return false;
+    }
+
+    void wait_for_reload() {
+        if (m_reload_thread != nullptr) {
+            photon::thread_join(m_reload_thread);
+            m_reload_thread = nullptr;
+        }
+    }
+
+    int reload(const string& trace_file_path, size_t trace_file_size) {
+        auto start = photon::now;
+        vector<vector<TraceFormat>> runs(1);
+        if (load_trace(m_trace_file, trace_file_size, &runs[0]) != 0) {
+            return -1;
+        }
+        // traces recorded by other runs of the image are put beside as `trace.1`, `trace.2`...
+        for (int n = 1;; ++n) {
+            auto path = trace_file_path + "." + std::to_string(n);
+            struct stat st = {};
+            if (stat(path.c_str(), &st) != 0) {
+                break;
+            }
+            auto file = FileSystem::open_localfile_adaptor(path.c_str(), O_RDONLY, 0666, 2);
+            if (file == nullptr) {
+                LOG_ERRNO_RETURN(0, -1, "Prefetch: open trace file ` failed", path);
+            }
+            DEFER(delete file);
+            vector<TraceFormat> records;
+            if (load_trace(file, st.st_size, &records) != 0) {
+                LOG_WARN("Prefetch: ignore trace file `", path);
+                continue;
+            }
+            runs.push_back(std::move(records));
+        }
+
+        // Save in memory
+        size_t n_records = 0;
+        for (auto& run : runs) {
+            n_records += run.size();
+        }
+        auto ranges = runs.size() == 1 ? merge_records(runs[0], m_lead_window_us)
+                                       : rank_records(runs, m_lead_window_us, m_min_run_percent);
+        for (auto& each : ranges) {
+            m_replay_queue.push_back(each);
+            m_replay_index.emplace(make_pair(each.layer_index, each.offset),
+                                   std::prev(m_replay_queue.end()));
+        }
+        m_reload_time = photon::now - start;
+        LOG_INFO("Prefetch: Reload ` records of ` runs, merged into ` ranges, in ` us", n_records,
+                 runs.size(), m_replay_queue.size(), m_reload_time);
+        return 0;
+    }
+
+    // Reload the whole file at once
+    static int load_trace(IFile* file, size_t trace_file_size, vector<TraceFormat>* records) {
+        if (trace_file_size < sizeof(TraceHeader)) {
+            LOG_ERROR_RETURN(0, -1, "Prefetch: trace file size mismatch");
+        }
+        string buf(trace_file_size, '\0');
+        ssize_t n_read = file->pread(&buf[0], trace_file_size, 0);
+        if (n_read != (ssize_t) trace_file_size) {
+            LOG_ERRNO_RETURN(0, -1, "Prefetch: reload trace file failed");
         }
-        if (TRACE_MAGIC != hdr.magic) {
+        TraceHeader hdr = {};
+        memcpy(&hdr, buf.data(), sizeof(TraceHeader));
+        if (TRACE_MAGIC != hdr.magic && TRACE_MAGIC_V2 != hdr.magic && TRACE_MAGIC_V3 != hdr.magic) {
             LOG_ERROR_RETURN(0, -1, "Prefetch: trace magic mismatch");
         }
         if (trace_file_size != hdr.data_size + sizeof(TraceHeader)) {
             LOG_ERROR_RETURN(0, -1, "Prefetch: trace file size mismatch");
         }
+        auto data = buf.data() + sizeof(TraceHeader);
+        if (crc32::crc32c(data, hdr.data_size) != hdr.checksum) {
+            LOG_ERROR_RETURN(0, -1, "Prefetch: reload checksum error");
+        }
 
         // Reload content
-        uint32_t checksum = 0;
-        TraceFormat fmt = {};
-        for (int i = 0; i < hdr.data_size / sizeof(TraceFormat); ++i) {
-            n_read = m_trace_file->read(&fmt, sizeof(TraceFormat));
-            if (n_read != sizeof(TraceFormat)) {
-                LOG_ERRNO_RETURN(0, -1, "Prefetch: reload content failed");
+        if (hdr.magic == TRACE_MAGIC_V3) {
+            if (decode_records(data, hdr.data_size, records) != 0) {
+                LOG_ERROR_RETURN(0, -1, "Prefetch: reload content failed");
+            }
+        } else {
+            // records of version 1 have no timestamp
+            size_t record_size = hdr.magic == TRACE_MAGIC ? sizeof(TraceFormatV1) : sizeof(TraceFormat);
+            records->resize(hdr.data_size / record_size);
+            for (size_t i = 0; i < records->size(); ++i) {
+                (*records)[i].timestamp = 0;
+                memcpy(&(*records)[i], data + i * record_size, record_size);
             }
-            checksum = crc32::crc32c_extend(&fmt, sizeof(TraceFormat), checksum);
-            // Save in memory
-            m_replay_queue.push(fmt);
         }
+        return 0;
+    }
 
-        if (checksum != hdr.checksum) {
-            queue<TraceFormat> tmp;
-            m_replay_queue.swap(tmp);
-            LOG_ERROR_RETURN(0, -1, "Prefetch: reload checksum error");
+    // Version 3 of the trace format encodes each record as the op byte, then
+    // varints of the layer index, the zigzag delta of the offset to that of the
+    // previous record, the count, and the delta of the timestamp.
+    static void put_varint(string* buf, uint64_t v) {
+        while (v >= 0x80) {
+            buf->push_back((char) (v | 0x80));
+            v >>= 7;
         }
+        buf->push_back((char) v);
+    }
+
+    static bool get_varint(const char** p, const char* end, uint64_t* v) {
+        *v = 0;
+        for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+            uint8_t b = *(*p)++;
+            *v |= (uint64_t) (b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
 
-        LOG_INFO("Prefetch: Reload ` records", m_replay_queue.size());
+    static void encode_record(const TraceFormat& r, string* buf, off_t* last_offset,
+                              uint64_t* last_time) {
+        int64_t delta = r.offset - *last_offset;
+        buf->push_back((char) r.op);
+        put_varint(buf, r.layer_index);
+        put_varint(buf, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+        put_varint(buf, r.count);
+        put_varint(buf, r.timestamp - std::min(*last_time, r.timestamp));
+        *last_offset = r.offset;
+        *last_time = std::max(*last_time, r.timestamp);
+    }
+
+    static int decode_records(const char* data, size_t size, vector<TraceFormat>* records) {
+        auto p = data, end = data + size;
+        off_t last_offset = 0;
+        uint64_t last_time = 0;
+        while (p < end) {
+            TraceFormat r = {};
+            uint64_t layer, zigzag, count, time;
+            r.op = (TraceOp) *p++;
+            if (!get_varint(&p, end, &layer) || !get_varint(&p, end, &zigzag) ||
+                !get_varint(&p, end, &count) || !get_varint(&p, end, &time)) {
+                return -1;
+            }
+            r.layer_index = layer;
+            r.offset = last_offset + (int64_t) ((zigzag >> 1) ^ -(zigzag & 1));
+            r.count = count;
+            r.timestamp = last_time + time;
+            last_offset = r.offset;
+            last_time = r.timestamp;
+            records->push_back(r);
+        }
         return 0;
     }
 
+    // Deduplicate the reads, and merge them into ranges of at most MAX_IO_SIZE,
+    // bridging holes up to MERGE_GAP, since such a gap costs less than another
+    // registry request. Layers are replayed in the order they were first read,
+    // and ranges of each layer by offset. With a `window`, this is done for each
+    // phase of `window` us in the trace, phases replayed in time order.
+    static vector<TraceFormat> merge_records(const vector<TraceFormat>& records,
+                                             uint64_t window) {
+        auto phase = [&](const TraceFormat& r) {
+            return window > 0 ? r.timestamp / window : 0;
+        };
+        map<uint32_t, size_t> first_read;
+        vector<TraceFormat> reads;
+        for (size_t i = 0; i < records.size(); ++i) {
+            auto& r = records[i];
+            if (r.op != TraceOp::READ || r.count == 0) {
+                continue;
+            }
+            first_read.emplace(r.layer_index, i);
+            reads.push_back(r);
+        }
+        std::sort(reads.begin(), reads.end(), [&](const TraceFormat& a, const TraceFormat& b) {
+            if (phase(a) != phase(b)) {
+                return phase(a) < phase(b);
+            }
+            if (a.layer_index != b.layer_index) {
+                return first_read[a.layer_index] < first_read[b.layer_index];
+            }
+            return a.offset < b.offset;
+        });
+
+        vector<TraceFormat> ranges;
+        auto flush = [&](TraceFormat range) {
+            while (range.count > 0) {
+                auto count = std::min(range.count, (size_t)MAX_IO_SIZE);
+                ranges.push_back({TraceOp::READ, range.layer_index, count, range.offset,
+                                  phase(range) * window});
+                range.offset += count;
+                range.count -= count;
+            }
+        };
+        TraceFormat cur = {};
+        bool has_cur = false;
+        for (auto& r : reads) {
+            off_t cur_end = cur.offset + cur.count;
+            if (has_cur && phase(r) == phase(cur) && r.layer_index == cur.layer_index &&
+                r.offset <= cur_end + MERGE_GAP) {
+                cur.count = std::max(cur_end, (off_t)(r.offset + r.count)) - cur.offset;
+                continue;
+            }
+            if (has_cur) {
+                flush(cur);
+            }
+            cur = r;
+            has_cur = true;
+        }
+        if (has_cur) {
+            flush(cur);
+        }
+        return ranges;
+    }
+
+    void unindex(list<TraceFormat>::iterator pos) {
+        auto range = m_replay_index.equal_range({pos->layer_index, pos->offset});
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == pos) {
+                m_replay_index.erase(it);
+                return;
+            }
+        }
+    }
+
+    // The weighted union of the traces of several runs. Reads are counted in
+    // blocks of MERGE_GAP, once per run, and blocks read in less than
+    // `min_run_percent` of the runs are dropped. The others are replayed by
+    // the number of runs reading them, the commonest first, then in the order
+    // of merge_records(), and contiguous ones of the same rank are merged.
+    // With a `window`, phases go first, so that replay still runs ahead of time.
+    static vector<TraceFormat> rank_records(const vector<vector<TraceFormat>>& runs,
+                                            uint64_t window, uint32_t min_run_percent) {
+        struct Block {
+            uint32_t layer_index;
+            uint64_t index;         // offset / MERGE_GAP
+            uint32_t runs;
+            uint32_t last_run;
+            uint64_t timestamp;     // the earliest read
+        };
+        map<uint32_t, size_t> first_read;
+        map<pair<uint32_t, uint64_t>, Block> blocks;
+        size_t seq = 0;
+        for (uint32_t run = 1; run <= runs.size(); ++run) {
+            for (auto& r : runs[run - 1]) {
+                seq++;
+                if (r.op != TraceOp::READ || r.count == 0) {
+                    continue;
+                }
+                first_read.emplace(r.layer_index, seq);
+                for (uint64_t i = r.offset / MERGE_GAP; i <= (r.offset + r.count - 1) / MERGE_GAP; ++i) {
+                    auto it = blocks.emplace(make_pair(r.layer_index, i),
+                                             Block{r.layer_index, i, 0, 0, r.timestamp}).first;
+                    auto& b = it->second;
+                    if (b.last_run != run) {
+                        b.runs++;
+                        b.last_run = run;
+                    }
+                    b.timestamp = std::min(b.timestamp, r.timestamp);
+                }
+            }
+        }
+
+        auto phase = [&](const Block& b) {
+            return window > 0 ? b.timestamp / window : 0;
+        };
+        vector<Block> ranked;
+        for (auto& each : blocks) {
+            if (each.second.runs * 100 >= min_run_percent * runs.size()) {
+                ranked.push_back(each.second);
+            }
+        }
+        std::sort(ranked.begin(), ranked.end(), [&](const Block& a, const Block& b) {
+            if (phase(a) != phase(b)) {
+                return phase(a) < phase(b);
+            }
+            if (a.runs != b.runs) {
+                return a.runs > b.runs;
+            }
+            if (a.layer_index != b.layer_index) {
+                return first_read[a.layer_index] < first_read[b.layer_index];
+            }
+            return a.index < b.index;
+        });
+
+        vector<TraceFormat> ranges;
+        for (size_t i = 0; i < ranked.size(); ++i) {
+            auto& b = ranked[i];
+            if (i > 0 && !ranges.empty()) {
+                auto& prev = ranked[i - 1];
+                auto& last = ranges.back();
+                if (phase(prev) == phase(b) && prev.runs == b.runs &&
+                    prev.layer_index == b.layer_index && prev.index + 1 == b.index &&
+                    last.count + MERGE_GAP <= (size_t) MAX_IO_SIZE) {
+                    last.count += MERGE_GAP;
+                    continue;
+                }
+            }
+            ranges.push_back({TraceOp::READ, b.layer_index, (size_t) MERGE_GAP,
+                              (off_t) (b.index * MERGE_GAP), phase(b) * window});
+        }
+        return ranges;
+    }
+
     int detect_lock() {
         while (!m_record_stopped) {
             m_detect_thread_interruptible = true;
@@ -299,11 +748,12 @@ private:
     }
 
     friend LogBuffer& operator<<(LogBuffer& log, const PrefetcherImpl::TraceFormat& f);
+    friend int load_traced_reads(const string& trace_file_path, vector<TracedRead>* reads);
 };
 
 LogBuffer& operator<<(LogBuffer& log, const PrefetcherImpl::TraceFormat& f) {
     return log << "Op " << char(f.op) << ", Count " << f.count << ", Offset " << f.offset << ", Layer_index "
-               << f.layer_index;
+               << f.layer_index << ", Timestamp " << f.timestamp;
 }
 
 PrefetchFile::PrefetchFile(IFile* src_file, uint32_t layer_index, Prefetcher* prefetcher) :
@@ -316,6 +766,14 @@ PrefetchFile::PrefetchFile(IFile* src_file, uint32_t layer_index, Prefetcher* pr
 }
 
 ssize_t PrefetchFile::pread(void* buf, size_t count, off_t offset) {
+    SCOPE_TRACE("prefetch");
+    if (m_prefetcher->get_mode() == PrefetcherImpl::Mode::Replay) {
+        m_prefetcher->on_read_begin(m_layer_index, count, offset);
+        auto start = photon::now;
+        ssize_t n_read = m_file->pread(buf, count, offset);
+        m_prefetcher->on_read_end(photon::now - start);
+        return n_read;
+    }
     ssize_t n_read = m_file->pread(buf, count, offset);
     if (n_read == (ssize_t) count && m_prefetcher->get_mode() == PrefetcherImpl::Mode::Record) {
         m_prefetcher->record(PrefetcherImpl::TraceOp::READ, m_layer_index, count, offset);
@@ -323,8 +781,31 @@ ssize_t PrefetchFile::pread(void* buf, size_t count, off_t offset) {
     return n_read;
 }
 
-Prefetcher* new_prefetcher(const string& trace_file_path) {
-    return new PrefetcherImpl(trace_file_path);
+int load_traced_reads(const string& trace_file_path, vector<TracedRead>* reads) {
+    size_t file_size = 0;
+    if (Prefetcher::detect_mode(trace_file_path, &file_size) != Prefetcher::Mode::Replay) {
+        LOG_ERROR_RETURN(ENOENT, -1, "Prefetch: no trace in `", trace_file_path);
+    }
+    unique_ptr<IFile> file(
+        FileSystem::open_localfile_adaptor(trace_file_path.c_str(), O_RDONLY, 0666, 2));
+    if (!file) {
+        LOG_ERRNO_RETURN(0, -1, "Prefetch: open trace file ` failed", trace_file_path);
+    }
+    vector<PrefetcherImpl::TraceFormat> records;
+    if (PrefetcherImpl::load_trace(file.get(), file_size, &records) != 0) {
+        return -1;
+    }
+    for (auto& r : records) {
+        if (r.op == Prefetcher::TraceOp::READ && r.count > 0) {
+            reads->push_back({r.layer_index, r.count, r.offset});
+        }
+    }
+    return 0;
+}
+
+Prefetcher* new_prefetcher(const string& trace_file_path, uint64_t lead_window_us,
+                           uint32_t min_run_percent) {
+    return new PrefetcherImpl(trace_file_path, lead_window_us, min_run_percent);
 }
 
 Prefetcher::Mode Prefetcher::detect_mode(const string& trace_file_path, size_t* file_size) {
@@ -335,7 +816,8 @@ Prefetcher::Mode Prefetcher::detect_mode(const string& trace_file_path, size_t*
     }
     if (ret != 0) {
         return Mode::Disabled;
-    } else if (buf.st_size == 0) {
+    } else if (buf.st_size == 0 || access((trace_file_path + ".lock").c_str(), F_OK) == 0) {
+        // records are written as they're recorded, and the header once it's done
         return Mode::Record;
     } else {
         return Mode::Replay;
@@ -20,6 +20,7 @@
 
 #include <cctype>
 #include <string>
+#include <vector>
 #include "overlaybd/fs/filesystem.h"
 
 namespace FileSystem {
@@ -31,14 +32,31 @@ namespace FileSystem {
  *
  * 2. When starting recording, a lock file will be created. Delete it to stop recording.
  *
- * 3. After recording stopped, data will be dumped into trace file. A OK file will be created
- *    to indicate dump finished.
+ * 3. Records are written to the trace file while recording, through a buffer of fixed size,
+ *    skipping repeats of a range read lately. After recording stopped, the header is written,
+ *    and a OK file will be created to indicate dump finished.
  *
  * 4. In conclusion, the work modes are as follows:
  *      trace file non-existent                         => Disabled
- *      trace file exist but empty                      => Start Recording
+ *      trace file exist but empty, or lock file exist  => Start Recording
  *      lock file deleted or prefetcher destructed      => Stop Recording
  *      trace file exist and not empty                  => Replay
+ *
+ * 5. Replay yields to the reads of the container. Ranges it is reading are moved to the
+ *    front of the replay queue, and fewer replay workers run while its reads are slow.
+ *
+ * 6. Records are timestamped. With a lead window, replay issues each phase of the trace
+ *    that long before it was read during recording, instead of all at once.
+ *
+ * 7. Records are stored compactly, as varints of the deltas to the previous ones, and the
+ *    trace file is reloaded in bulk.
+ *
+ * 8. Traces recorded by other runs of the image may be put beside the trace file, named
+ *    `<trace file>.1`, `<trace file>.2` and so on. They are replayed as a union, the ranges
+ *    read by most runs first, skipping those read by less than a percentage of the runs.
+ *
+ * 9. `overlaybd-accel` turns a trace into an acceleration layer holding the data read, in
+ *    the order it was read, which is fetched sequentially instead of replaying the trace.
  */
 class Prefetcher : public Object {
 public:
@@ -66,10 +84,28 @@ public:
         return m_mode;
     }
 
+    // time taken to reload the trace for replay, in us, known once replay() is called,
+    // as the trace is reloaded in the background
+    uint64_t get_reload_time() const {
+        return m_reload_time;
+    }
+
 protected:
     Mode m_mode;
+    uint64_t m_reload_time = 0;
 };
 
-Prefetcher* new_prefetcher(const std::string& trace_file_path);
+// a read of a trace, of `count` bytes at `offset` of the lower layer `layer_index`
+struct TracedRead {
+    uint32_t layer_index;
+    size_t count;
+    off_t offset;
+};
+
+// load the reads of a trace file of any version, in the order they were recorded
+int load_traced_reads(const std::string& trace_file_path, std::vector<TracedRead>* reads);
+
+Prefetcher* new_prefetcher(const std::string& trace_file_path, uint64_t lead_window_us = 0,
+                           uint32_t min_run_percent = 0);
 
 }
\ No newline at end of file
@@ -0,0 +1,157 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "promote_file.h"
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include "overlaybd/alog.h"
+#include "overlaybd/iovector.h"
+#include "overlaybd/metrics.h"
+#include "overlaybd/fs/forwardfs.h"
+#include "overlaybd/fs/lsmt/index.h"
+
+using namespace FileSystem;
+using namespace LSMT;
+
+namespace Promote {
+
+namespace {
+struct PromoteMetrics {
+    Metrics::Counter *hits = Metrics::counter("overlaybd_promoted_reads_total",
+                                              "Reads served by the promotion layers");
+    Metrics::Counter *bytes = Metrics::counter("overlaybd_promoted_bytes_total",
+                                               "Bytes written to the promotion layers");
+};
+
+PromoteMetrics &metrics() {
+    static PromoteMetrics m;
+    return m;
+}
+} // namespace
+
+// the sector of the mappings of LSMT
+static const uint64_t ALIGNMENT = 512;
+// a read resolved to more mappings than this is passed through
+static const size_t MAX_MAPPINGS = 32;
+
+class PromoteFile : public ForwardFile_Ownership {
+public:
+    PromoteFile(IFileRO *image, uint32_t nlowers, IFileRW *promoted, uint32_t min_reads,
+                uint64_t max_bytes, bool ownership)
+        : ForwardFile_Ownership(image, ownership), m_image(image), m_nlowers(nlowers),
+          m_promoted(promoted), m_min_reads(min_reads), m_max_bytes(max_bytes) {
+        auto st = promoted->data_stat();
+        m_promoted_bytes = st.total_data_size == (uint64_t)-1 ? 0 : st.total_data_size;
+    }
+
+    ssize_t pread(void *buf, size_t count, off_t offset) override {
+        struct iovec iov { buf, count };
+        return preadv(&iov, 1, offset);
+    }
+
+    ssize_t preadv_mutable(struct iovec *iov, int iovcnt, off_t offset) override {
+        return preadv(iov, iovcnt, offset);
+    }
+
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        // a prefetch delivers no data to promote
+        if (iovcnt == 1 && iov->iov_base == nullptr)
+            return m_file->preadv(iov, iovcnt, offset);
+        iovector_view view((struct iovec *)iov, iovcnt);
+        size_t count = view.sum();
+        if (count == 0 || offset % ALIGNMENT || count % ALIGNMENT ||
+            !in_lowers(offset, count))
+            return m_file->preadv(iov, iovcnt, offset);
+        if (covered(m_promoted->index(), offset, count, UINT16_MAX)) {
+            auto ret = m_promoted->preadv(iov, iovcnt, offset);
+            if (ret == (ssize_t)count) {
+                metrics().hits->inc();
+                return ret;
+            }
+            LOG_WARN("failed to read the promotion layer at `, `:`", offset, errno,
+                     strerror(errno));
+        }
+        auto ret = m_file->preadv(iov, iovcnt, offset);
+        if (ret == (ssize_t)count && hot(offset, count))
+            promote(iov, iovcnt, offset, count);
+        return ret;
+    }
+
+private:
+    IFileRO *m_image;
+    uint32_t m_nlowers;
+    std::unique_ptr<IFileRW> m_promoted;
+    uint32_t m_min_reads;
+    uint64_t m_max_bytes;
+    uint64_t m_promoted_bytes = 0;
+    // the # of reads of each region of the lowers, till it's hot
+    std::unordered_map<uint64_t, uint32_t> m_reads;
+
+    // whether [offset, offset + count) is covered by the data of `index`, in
+    // layers below `max_tag`, i.e. without a hole or a zeroed mapping
+    static bool covered(const IMemoryIndex *index, off_t offset, size_t count, uint32_t max_tag) {
+        SegmentMapping pm[MAX_MAPPINGS];
+        Segment s{(uint64_t)offset / ALIGNMENT, (uint32_t)(count / ALIGNMENT)};
+        auto n = index->lookup(s, pm, MAX_MAPPINGS);
+        uint64_t end = s.offset;
+        for (size_t i = 0; i < n; i++) {
+            if (pm[i].offset != end || pm[i].zeroed || pm[i].tag >= max_tag)
+                return false;
+            end = pm[i].end();
+        }
+        return end == s.end();
+    }
+
+    // the index of the image is looked up each time, as it's updated by the
+    // writes to the upper, and by its compaction
+    bool in_lowers(off_t offset, size_t count) const {
+        return count / ALIGNMENT <= Segment::MAX_LENGTH &&
+               covered(m_image->index(), offset, count, m_nlowers);
+    }
+
+    bool hot(off_t offset, size_t count) {
+        if (m_promoted_bytes >= m_max_bytes)
+            return false;
+        bool ret = false;
+        for (uint64_t r = offset / REGION_SIZE; r <= (offset + count - 1) / REGION_SIZE; r++) {
+            auto &n = m_reads[r];
+            if (n < m_min_reads)
+                n++;
+            ret = ret || n >= m_min_reads;
+        }
+        return ret;
+    }
+
+    void promote(const struct iovec *iov, int iovcnt, off_t offset, size_t count) {
+        if (m_promoted->pwritev(iov, iovcnt, offset) != (ssize_t)count) {
+            LOG_WARN("failed to promote [`, +`), `:`", offset, count, errno, strerror(errno));
+            return;
+        }
+        m_promoted_bytes += count;
+        metrics().bytes->inc(count);
+        if (m_promoted_bytes >= m_max_bytes)
+            LOG_INFO("promotion layer is full, with ` bytes of data", m_promoted_bytes);
+    }
+};
+
+IFile *new_promote_file(IFileRO *image, uint32_t nlowers, IFileRW *promoted, uint32_t min_reads,
+                        uint64_t max_bytes, bool ownership) {
+    return new PromoteFile(image, nlowers, promoted, std::max(min_reads, 1U), max_bytes,
+                           ownership);
+}
+
+} // namespace Promote
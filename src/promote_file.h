@@ -0,0 +1,39 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include "overlaybd/fs/filesystem.h"
+#include "overlaybd/fs/lsmt/file.h"
+
+// The promotion layer of an image is a local writable LSMT file of the size
+// of the image, holding data of its lowers read often, so that it's read
+// locally from then on, whatever the cache of the remote layers evicts. It
+// lies between the upper and the lowers: a read is served by it only if the
+// whole range resolves to the lowers, and the guest never writes to it.
+namespace Promote {
+
+// reads are counted by regions of this size
+static const uint64_t REGION_SIZE = 64 * 1024;
+
+// reads of `image`, stacked of the upper, if any, over `nlowers` lowers, are
+// served by `promoted` where it holds them all; otherwise, once a region
+// they are in has been read `min_reads` times, they are written to it, till
+// it holds `max_bytes` of data; `promoted` is owned by the returned file,
+// which owns `image` as well if `ownership`
+FileSystem::IFile *new_promote_file(LSMT::IFileRO *image, uint32_t nlowers,
+                                    LSMT::IFileRW *promoted, uint32_t min_reads,
+                                    uint64_t max_bytes, bool ownership = true);
+
+} // namespace Promote
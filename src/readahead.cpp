@@ -0,0 +1,206 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "readahead.h"
+#include <algorithm>
+#include <deque>
+#include "overlaybd/alog.h"
+#include "overlaybd/photon/thread.h"
+
+namespace Readahead {
+
+// prefetches queued and not taken yet, beyond which a stream isn't prefetched
+static const size_t MAX_QUEUED = 256;
+// blocks prefetched ahead of a strided stream
+static const uint64_t MAX_STRIDED_BLOCKS = 64;
+
+class StreamDetectorImpl : public StreamDetector {
+public:
+    StreamDetectorImpl(uint64_t size, uint64_t max_window)
+        : m_size(size), m_max_window(std::max(max_window, MIN_WINDOW)) {
+    }
+
+    ~StreamDetectorImpl() {
+        LOG_INFO("readahead: ` streams detected, ` bytes prefetched, ` prefetches dropped",
+                 m_detected, m_prefetched, m_dropped);
+    }
+
+    virtual void on_read(off_t offset, size_t count) override {
+        if (m_stopped || count == 0)
+            return;
+        m_clock++;
+        int i = find(offset, count);
+        if (i < 0) {
+            restart(evict(), offset, count);
+            return;
+        }
+        auto &s = m_streams[i];
+        s.used = m_clock;
+        // a read within the last one, e.g. of the same block again, is neither
+        // a hit nor a break
+        if (s.stride == 0 && offset < s.last + (off_t)s.len)
+            return;
+        s.hits++;
+        s.last = offset;
+        s.len = count;
+        if (s.hits < STREAM_MIN_HITS)
+            return;
+        if (s.hits == STREAM_MIN_HITS)
+            m_detected++;
+        prefetch(i, offset + count);
+    }
+
+    virtual bool pop(off_t *offset, size_t *count) override {
+        while (!m_stopped) {
+            while (!m_queue.empty()) {
+                auto p = m_queue.front();
+                m_queue.pop_front();
+                // the stream broke off since
+                if (m_streams[p.stream].gen != p.gen) {
+                    m_dropped++;
+                    continue;
+                }
+                *offset = p.offset;
+                *count = p.count;
+                m_prefetched += p.count;
+                return true;
+            }
+            m_cond.wait_no_lock();
+        }
+        return false;
+    }
+
+    virtual void stop() override {
+        m_stopped = true;
+        m_cond.notify_all();
+    }
+
+private:
+    struct Stream {
+        off_t last = -1;  // the last read of the stream
+        size_t len = 0;
+        off_t stride = 0; // between the reads of a strided stream, 0 if sequential
+        uint32_t hits = 0;
+        uint64_t window = 0;
+        off_t ra_end = 0; // the end of the ranges queued to prefetch
+        uint64_t gen = 0; // of the stream in the slot, for its queued prefetches
+        uint64_t used = 0;
+    };
+    struct Pending {
+        off_t offset;
+        size_t count;
+        int stream;
+        uint64_t gen;
+    };
+
+    Stream m_streams[MAX_STREAMS];
+    std::deque<Pending> m_queue;
+    photon::condition_variable m_cond;
+    uint64_t m_size, m_max_window, m_clock = 0;
+    bool m_stopped = false;
+    uint64_t m_detected = 0, m_prefetched = 0, m_dropped = 0;
+
+    // the stream a read at `offset` goes on with: the next read of a
+    // sequential one, which may skip ahead within the ranges prefetched,
+    // or of a strided one; or a stream of one read so far, nearest before
+    // it, which becomes strided
+    int find(off_t offset, size_t count) {
+        int fresh = -1;
+        for (int i = 0; i < MAX_STREAMS; i++) {
+            auto &s = m_streams[i];
+            if (s.last < 0)
+                continue;
+            off_t end = s.last + s.len;
+            if (s.stride == 0 && offset >= s.last &&
+                (offset <= end || (s.hits >= STREAM_MIN_HITS && offset < s.ra_end)))
+                return i;
+            if (s.stride > 0 && offset == s.last + s.stride && count == s.len)
+                return i;
+            if (s.hits == 0 && offset > end && offset - s.last <= (off_t)MAX_STRIDE &&
+                (fresh < 0 || s.last > m_streams[fresh].last))
+                fresh = i;
+        }
+        if (fresh >= 0 && m_streams[fresh].len == count)
+            m_streams[fresh].stride = offset - m_streams[fresh].last;
+        else
+            fresh = -1;
+        return fresh;
+    }
+
+    // the slot of the stream read least recently, which is taken as broken
+    // off, its prefetches not taken yet dropped
+    int evict() {
+        int victim = 0;
+        for (int i = 0; i < MAX_STREAMS; i++) {
+            if (m_streams[i].last < 0)
+                return i;
+            if (m_streams[i].used < m_streams[victim].used)
+                victim = i;
+        }
+        return victim;
+    }
+
+    void restart(int i, off_t offset, size_t count) {
+        auto &s = m_streams[i];
+        auto gen = s.gen + 1;
+        s = Stream();
+        s.gen = gen;
+        s.last = offset;
+        s.len = count;
+        s.used = m_clock;
+    }
+
+    void queue(int i, off_t offset, size_t count) {
+        m_queue.push_back({offset, count, i, m_streams[i].gen});
+    }
+
+    // queue the ranges stream `i`, read up to `end`, is about to read, once
+    // less than half of its window is left ahead of it, ramping it up
+    void prefetch(int i, off_t end) {
+        auto &s = m_streams[i];
+        uint64_t ahead = 0;
+        if (s.ra_end > end)
+            ahead = s.stride ? (s.ra_end - end) / s.stride * s.len : s.ra_end - end;
+        if (s.window && ahead >= s.window / 2)
+            return;
+        s.window = s.window ? std::min(s.window * 2, m_max_window)
+                            : std::min(std::max(MIN_WINDOW, (uint64_t)s.len * 2), m_max_window);
+        if (s.stride == 0) {
+            off_t from = std::max(s.ra_end, end);
+            off_t to = std::min(end + (off_t)s.window, (off_t)m_size);
+            for (; from < to && m_queue.size() < MAX_QUEUED; from += MAX_IO_SIZE)
+                queue(i, from, std::min((off_t)MAX_IO_SIZE, to - from));
+            s.ra_end = std::max(s.ra_end, std::min(from, to));
+        } else {
+            auto n = std::min(std::max(s.window / s.len, (uint64_t)1), MAX_STRIDED_BLOCKS);
+            for (uint64_t k = 1; k <= n && m_queue.size() < MAX_QUEUED; k++) {
+                off_t p = s.last + (off_t)k * s.stride;
+                if (p >= (off_t)m_size)
+                    break;
+                if (p + (off_t)s.len <= s.ra_end)
+                    continue;
+                queue(i, p, std::min((off_t)s.len, (off_t)m_size - p));
+                s.ra_end = p + s.len;
+            }
+        }
+        m_cond.notify_all();
+    }
+};
+
+StreamDetector *new_stream_detector(uint64_t size, uint64_t max_window) {
+    return new StreamDetectorImpl(size, max_window);
+}
+
+} // namespace Readahead
@@ -0,0 +1,55 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+
+// Readahead of the streams of guest reads of a device: up to MAX_STREAMS
+// sequential or strided streams, read by different threads of the guest at
+// once, are told apart at the LBA level. Once a stream has been read in its
+// pattern STREAM_MIN_HITS times in a row, the ranges it's about to read are
+// queued to be prefetched, in a window doubling on each read, up to the max;
+// the prefetches of a stream not yet done are dropped once it breaks off.
+namespace Readahead {
+
+static const int MAX_STREAMS = 8;
+static const uint32_t STREAM_MIN_HITS = 2;
+// the initial window, and the largest piece a prefetch is queued in
+static const uint64_t MIN_WINDOW = 128 * 1024;
+static const uint64_t MAX_IO_SIZE = 1024 * 1024;
+// reads farther apart than this are not taken as strides of a stream
+static const uint64_t MAX_STRIDE = 4 * 1024 * 1024;
+
+class StreamDetector {
+public:
+    virtual ~StreamDetector() {
+    }
+
+    // a read of the guest, of `count` bytes at `offset`
+    virtual void on_read(off_t offset, size_t count) = 0;
+
+    // take a range to prefetch, waiting for one; false once stopped
+    virtual bool pop(off_t *offset, size_t *count) = 0;
+
+    // wake up the threads waiting in pop() to quit
+    virtual void stop() = 0;
+};
+
+// detect the streams of reads of a device of `size` bytes, prefetching up to
+// `max_window` bytes ahead of each
+StreamDetector *new_stream_detector(uint64_t size, uint64_t max_window);
+
+} // namespace Readahead
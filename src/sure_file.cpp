@@ -15,23 +15,106 @@
 */
 #include <limits.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include "overlaybd/alog-stdstring.h"
 #include "overlaybd/alog.h"
+#include "overlaybd/iovector.h"
 #include "overlaybd/fs/localfs.h"
 #include "overlaybd/photon/thread.h"
+#include "overlaybd/trace.h"
 #include "image_file.h"
 #include "sure_file.h"
 
 namespace FileSystem {
+static const uint32_t BREAKER_FAILURES = 8;
+static const uint64_t BREAKER_MIN_BACKOFF = 10 * 1000, BREAKER_MAX_BACKOFF = 1000 * 1000;
+
+// shared by the files reading from a backend, which may be in different vcpus;
+// after BREAKER_FAILURES consecutive failed reads, the breaker opens, and instead of
+// all retrying, the reads wait for one of them at a time to probe the backend,
+// with the interval between probes backed off from 10ms to 1s; once a read
+// succeeds, the breaker closes and the waiting reads resume together
+class CircuitBreaker {
+public:
+    explicit CircuitBreaker(const std::string &backend) : m_backend(backend) {
+    }
+
+    // return true if the caller may go on reading, as the probe if `probe`,
+    // or false if it should wait and try again
+    bool enter(bool &probe) {
+        probe = false;
+        if (!m_open.load(std::memory_order_acquire))
+            return true;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_open.load(std::memory_order_relaxed))
+            return true;
+        if (m_probing || photon::now < m_next_probe)
+            return false;
+        m_probing = probe = true;
+        return true;
+    }
+
+    void leave(bool probe, bool ok) {
+        if (ok && !probe && m_failures.load(std::memory_order_relaxed) == 0 &&
+            !m_open.load(std::memory_order_relaxed))
+            return;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (probe)
+            m_probing = false;
+        if (ok) {
+            m_failures = 0;
+            if (m_open.load(std::memory_order_relaxed)) {
+                m_open.store(false, std::memory_order_release);
+                LOG_INFO("backend ` recovered, circuit breaker closed", m_backend);
+            }
+        } else if (probe) {
+            m_backoff = std::min(m_backoff * 2, BREAKER_MAX_BACKOFF);
+            m_next_probe = photon::now + m_backoff;
+        } else if (++m_failures >= BREAKER_FAILURES && !m_open.load(std::memory_order_relaxed)) {
+            m_backoff = BREAKER_MIN_BACKOFF;
+            m_next_probe = photon::now + m_backoff;
+            m_open.store(true, std::memory_order_release);
+            LOG_ERROR("backend ` failed ` times in a row, circuit breaker opened", m_backend,
+                      BREAKER_FAILURES);
+        }
+    }
+
+    // the breaker of `backend`, created on first use, and never released
+    static CircuitBreaker *get(const std::string &backend) {
+        static std::mutex mutex;
+        static std::unordered_map<std::string, CircuitBreaker *> breakers;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &b = breakers[backend];
+        if (!b)
+            b = new CircuitBreaker(backend);
+        return b;
+    }
+
+private:
+    std::string m_backend;
+    std::mutex m_mutex;
+    std::atomic<bool> m_open{false};
+    std::atomic<uint32_t> m_failures{0};
+    bool m_probing = false;
+    uint64_t m_next_probe = 0;
+    uint64_t m_backoff = BREAKER_MIN_BACKOFF;
+};
+
 class SureFile : public ForwardFile_Ownership {
 public:
     SureFile() = delete;
-    SureFile(IFile *src_file, ImageFile *image_file, bool ownership)
-        : ForwardFile_Ownership(src_file, ownership), m_ifile(image_file) {
+    SureFile(IFile *src_file, ImageFile *image_file, bool ownership, CircuitBreaker *breaker)
+        : ForwardFile_Ownership(src_file, ownership), m_ifile(image_file), m_breaker(breaker) {
     }
 
 private:
     ImageFile *m_ifile = nullptr;
+    CircuitBreaker *m_breaker = nullptr;
 
     void io_sleep(uint64_t &try_cnt) {
         if (try_cnt < 10)
@@ -77,13 +160,75 @@ public:
         return done_cnt;
     }
 
+    virtual ssize_t writev(const struct iovec *iov, int iovcnt) override {
+        // copied, as the written ones are extracted on partial writes
+        std::vector<struct iovec> v(iov, iov + iovcnt);
+        iovector_view view(v.data(), iovcnt);
+        size_t count = view.sum();
+        size_t done_cnt = 0;
+        while (m_ifile && m_ifile->m_status >= 0 && done_cnt < count) {
+            ssize_t ret = m_file->writev(view.iov, view.iovcnt);
+            if (ret > 0) {
+                done_cnt += ret;
+                view.extract_front(ret);
+            }
+            if (done_cnt == count)
+                return count;
+
+            if (ret == -1 && errno == EINTR) {
+                LOG_INFO("writev(...), errno:EINTR, need continue try.");
+                continue;
+            } else if (ret <= 0) {
+                LOG_ERROR("writev(...), done_cnt(`) count(`), ret:`, errno:`, need io hang",
+                          done_cnt, count, ret, errno);
+                io_hand();
+            }
+        }
+        return done_cnt;
+    }
+
+    virtual ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override {
+        std::vector<struct iovec> v(iov, iov + iovcnt);
+        iovector_view view(v.data(), iovcnt);
+        size_t count = view.sum();
+        size_t done_cnt = 0;
+        while (m_ifile && m_ifile->m_status >= 0 && done_cnt < count) {
+            ssize_t ret = m_file->pwritev(view.iov, view.iovcnt, offset + done_cnt);
+            if (ret > 0) {
+                done_cnt += ret;
+                view.extract_front(ret);
+            }
+            if (done_cnt == count)
+                return count;
+
+            if (ret == -1 && errno == EINTR) {
+                LOG_INFO("pwritev(...), errno:EINTR, need continue try.");
+                continue;
+            } else if (ret <= 0) {
+                LOG_ERROR("pwritev(...), done_cnt(`) count(`), ret:`, errno:`, need io hang",
+                          done_cnt, count, ret, errno);
+                io_hand();
+            }
+        }
+        return done_cnt;
+    }
+
     virtual ssize_t pread(void *buf, size_t count, off_t offset) override {
+        SCOPE_TRACE("sure");
         uint64_t try_cnt = 0;
         size_t got_cnt = 0;
         auto time_st = photon::now;
         while (m_ifile && m_ifile->m_status >= 0 && photon::now - time_st < 31 * 1000 * 1000) {
             // exit on image in exit status, or timeout
+            bool probe = false;
+            if (m_breaker && !m_breaker->enter(probe)) {
+                // the backend is down, wait for the probe
+                photon::thread_usleep(1000);
+                continue;
+            }
             ssize_t ret = m_file->pread((char *)buf + got_cnt, count - got_cnt, offset + got_cnt);
+            if (m_breaker)
+                m_breaker->leave(probe, ret >= 0);
             if (ret > 0)
                 got_cnt += ret;
             if (got_cnt == count)
@@ -115,12 +260,13 @@ public:
 } // namespace FileSystem
 
 FileSystem::IFile *new_sure_file(FileSystem::IFile *src_file, ImageFile *image_file,
-                                 bool ownership) {
+                                 bool ownership, const char *backend) {
     if (!src_file) {
         LOG_ERROR("failed to new_sure_file(null)");
         return nullptr;
     }
-    return new FileSystem::SureFile(src_file, image_file, ownership);
+    auto breaker = backend ? FileSystem::CircuitBreaker::get(backend) : nullptr;
+    return new FileSystem::SureFile(src_file, image_file, ownership, breaker);
 }
 
 FileSystem::IFile *new_sure_file_by_path(const char *file_path, int open_flags,
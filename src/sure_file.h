@@ -18,7 +18,11 @@
 
 struct ImageFile;
 
+// reads of the files with the same `backend`, if not nullptr, share a circuit
+// breaker, so that they wait for one probe at a time while it is down,
+// instead of all retrying
 extern "C" FileSystem::IFile *new_sure_file(FileSystem::IFile *src_file, ImageFile *image_file,
-                                            bool ownership = true);
+                                            bool ownership = true,
+                                            const char *backend = nullptr);
 extern "C" FileSystem::IFile *new_sure_file_by_path(const char *file_path, int open_flags,
                                                     ImageFile *image_file, bool ownership = true);
\ No newline at end of file
@@ -14,12 +14,17 @@
    limitations under the License.
 */
 #include <fcntl.h>
+#include <map>
 #include <mutex>
 #include "overlaybd/alog-audit.h"
 #include "overlaybd/alog-stdstring.h"
 #include "overlaybd/alog.h"
+#include "overlaybd/fs/forwardfs.h"
 #include "overlaybd/fs/localfs.h"
+#include "overlaybd/iovector.h"
 #include "overlaybd/photon/thread.h"
+#include "overlaybd/trace.h"
+#include "overlaybd/fs/gzip_file.h"
 #include "overlaybd/fs/tar_file.h"
 #include "switch_file.h"
 #include "overlaybd/fs/zfile/zfile.h"
@@ -34,6 +39,80 @@ namespace FileSystem {
     DEFER({ --io_count; });                                                                        \
     return m_file->func;
 
+// The source blob, with reads of the ranges downloaded so far served from the
+// partial local file, so that a large layer gets faster as it is downloaded.
+// A read not entirely downloaded goes to the source as a whole.
+class PartialFile : public ForwardFile_Ownership {
+public:
+    PartialFile(IFile *source) : ForwardFile_Ownership(source, true) {
+    }
+    ~PartialFile() {
+        delete m_local;
+    }
+
+    int set_local(const char *filepath) {
+        delete m_local;
+        m_local = nullptr;
+        m_ranges.clear();
+        if (filepath == nullptr)
+            return 0;
+        m_local = open_localfile_adaptor(filepath, O_RDONLY, 0644, 0);
+        if (m_local == nullptr)
+            LOG_ERRNO_RETURN(0, -1, "failed to open downloading file `", filepath);
+        m_filepath = filepath;
+        return 0;
+    }
+
+    void add_range(off_t offset, size_t count) {
+        off_t begin = offset, end = offset + count;
+        auto it = m_ranges.upper_bound(begin);
+        if (it != m_ranges.begin()) {
+            auto prev = std::prev(it);
+            if (prev->second >= begin) {
+                begin = prev->first;
+                end = std::max(end, prev->second);
+                m_ranges.erase(prev);
+            }
+        }
+        while (it != m_ranges.end() && it->first <= end) {
+            end = std::max(end, it->second);
+            it = m_ranges.erase(it);
+        }
+        m_ranges[begin] = end;
+    }
+
+    virtual ssize_t pread(void *buf, size_t count, off_t offset) override {
+        if (!downloaded(offset, count))
+            return m_file->pread(buf, count, offset);
+        SCOPE_AUDIT_THRESHOLD(10UL * 1000, "file:pread", AU_FILEOP(m_filepath, offset, count));
+        return m_local->pread(buf, count, offset);
+    }
+    virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        auto count = iovector_view((struct iovec *)iov, iovcnt).sum();
+        if (!downloaded(offset, count))
+            return m_file->preadv(iov, iovcnt, offset);
+        // a prefetch of local data
+        if (iovcnt == 1 && iov->iov_base == nullptr)
+            return count;
+        SCOPE_AUDIT_THRESHOLD(10UL * 1000, "file:preadv", AU_FILEOP(m_filepath, offset, count));
+        return m_local->preadv(iov, iovcnt, offset);
+    }
+
+private:
+    IFile *m_local = nullptr;
+    string m_filepath;
+    map<off_t, off_t> m_ranges; // begin -> end, disjoint and not adjacent
+
+    bool downloaded(off_t offset, size_t count) {
+        if (m_local == nullptr || m_ranges.empty())
+            return false;
+        auto it = m_ranges.upper_bound(offset);
+        if (it == m_ranges.begin())
+            return false;
+        return std::prev(it)->second >= offset + (off_t)count;
+    }
+};
+
 class SwitchFile : public ISwitchFile {
 public:
     int state; /* 0. normal state; 1. ready to switch; 2. in processing */
@@ -42,9 +121,14 @@ public:
     IFile *m_file = nullptr;
     IFile *m_old = nullptr;
     string m_filepath;
+    PartialFile *m_partial = nullptr; // in the files stacked in m_file
+    string m_gz_index;                // the checkpoints of a gzip'd blob
+    int64_t m_block_cache_size;
 
-    SwitchFile(IFile *source, bool local=false, const char* filepath=nullptr)
-        : m_file(source), local_path(local) {
+    SwitchFile(IFile *source, bool local=false, const char* filepath=nullptr,
+               PartialFile *partial=nullptr, int64_t block_cache_size=-1)
+        : m_file(source), local_path(local), m_partial(partial),
+          m_block_cache_size(block_cache_size) {
         state = 0;
         io_count = 0;
         if (filepath != nullptr)
@@ -65,6 +149,17 @@ public:
         state = 1;
     }
 
+    int set_partial_file(const char *filepath) override {
+        if (m_partial == nullptr)
+            LOG_ERROR_RETURN(ENOTSUP, -1, "not a remote file");
+        return m_partial->set_local(filepath);
+    }
+
+    void add_downloaded(off_t offset, size_t count) override {
+        if (m_partial)
+            m_partial->add_range(offset, count);
+    }
+
     int do_switch() {
         int flags = O_RDONLY;
         // TODO support libaio
@@ -74,10 +169,20 @@ public:
                              errno, strerror(errno));
         }
 
+        // if gzip file, the checkpoints taken on the remote blob apply
+        if (FileSystem::is_gzip_file(file) == 1) {
+            auto gz = FileSystem::new_gzip_file(
+                file, m_gz_index.empty() ? nullptr : m_gz_index.c_str(), true);
+            if (!gz) {
+                delete file;
+                LOG_ERROR_RETURN(0, -1, "new_gzip_file failed, path: `", m_filepath);
+            }
+            file = gz;
+        }
         // if tar file, open tar file
         file = FileSystem::new_tar_file_adaptor(file);
         //open zfile
-        auto zf = ZFile::zfile_open_ro(file, false, true);
+        auto zf = ZFile::zfile_open_ro(file, false, true, m_block_cache_size);
         if (!zf) {
             delete file;
             LOG_ERROR_RETURN(0, -1, "zfile_open_ro failed, path: `: error: `(`)", m_filepath, errno,
@@ -86,6 +191,10 @@ public:
         file = zf;
 
         LOG_INFO("switch to localfile '`' success.", m_filepath);
+        if (m_partial) {
+            m_partial->set_local(nullptr);
+            m_partial = nullptr;
+        }
         m_old = m_file;
         m_file = file;
         local_path = true;
@@ -130,6 +239,7 @@ public:
         FORWARD(writev(iov, iovcnt));
     }
     virtual ssize_t pread(void *buf, size_t count, off_t offset) override {
+        SCOPE_TRACE("switch");
         if (local_path) {
             SCOPE_AUDIT_THRESHOLD(10UL * 1000, "file:pread", AU_FILEOP(m_filepath, offset, count));
             FORWARD(pread(buf, count, offset));
@@ -141,7 +251,15 @@ public:
         FORWARD(pwrite(buf, count, offset));
     }
     virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
-        FORWARD(preadv(iov, iovcnt, offset));
+        SCOPE_TRACE("switch");
+        check_switch();
+        ++io_count;
+        DEFER({ --io_count; });
+        // a read without buffer is a prefetch, needless once switched to the local file
+        if (local_path && iovcnt == 1 && iov->iov_base == nullptr) {
+            return iov->iov_len;
+        }
+        return m_file->preadv(iov, iovcnt, offset);
     }
     virtual ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override {
         FORWARD(pwritev(iov, iovcnt, offset));
@@ -155,6 +273,9 @@ public:
     virtual IFileSystem *filesystem() override {
         FORWARD(filesystem());
     }
+    virtual Object *get_underlay_object(int i = 0) override {
+        FORWARD(get_underlay_object(i));
+    }
     virtual int fsync() override {
         FORWARD(fsync());
     }
@@ -178,17 +299,41 @@ public:
     }
 };
 
-ISwitchFile *new_switch_file(IFile *source, bool local, const char* file_path) {
+ISwitchFile *new_switch_file(IFile *source, bool local, const char* file_path,
+                             const char *tar_index, int64_t block_cache_size,
+                             int refill_lookahead) {
+    // a remote blob is read from the local file progressively while downloading
+    PartialFile *partial = local ? nullptr : new PartialFile(source);
+    if (partial)
+        source = partial;
+    // if gzip file, e.g. a tar.gz layer, it's decompressed from the nearest
+    // checkpoint for each read, with the checkpoints saved aside `tar_index`;
+    // the tar headers within are then cheap to read, so they're not saved
+    string gz_index;
+    if (FileSystem::is_gzip_file(source) == 1) {
+        if (tar_index)
+            gz_index = string(tar_index) + ".gzi";
+        auto gz = FileSystem::new_gzip_file(source, tar_index ? gz_index.c_str() : nullptr, true);
+        if (!gz) {
+            LOG_ERROR_RETURN(0, nullptr, "new_gzip_file failed, path: `", file_path);
+        }
+        source = gz;
+        tar_index = nullptr;
+    }
     // if tar file, open tar file
-    IFile *file = FileSystem::new_tar_file_adaptor(source);
+    IFile *file = tar_index ? FileSystem::new_tar_file_adaptor_indexed(source, tar_index)
+                            : FileSystem::new_tar_file_adaptor(source);
     // open zfile
     bool verify = !local;
-    auto zf = ZFile::zfile_open_ro(file, verify, true);
+    auto zf = ZFile::zfile_open_ro(file, verify, true, block_cache_size,
+                                   local ? -1 : refill_lookahead);
     if (!zf) {
         LOG_ERROR_RETURN(0, nullptr, "zfile_open_ro failed, path: `: error: `(`)", file_path, errno,
                                     strerror(errno));
     }
     file = zf;
-    return new SwitchFile(file, local, file_path);
+    auto ret = new SwitchFile(file, local, file_path, partial, block_cache_size);
+    ret->m_gz_index = gz_index;
+    return ret;
 };
 } // namespace FileSystem
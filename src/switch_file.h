@@ -24,8 +24,21 @@ namespace FileSystem {
 class ISwitchFile : public IFile {
 public:
     virtual void set_switch_file(const char *filepath) = 0;
+    // while the layer is downloaded into `filepath`, reads of the ranges added
+    // as downloaded are served from it; nullptr drops the file and the ranges
+    virtual int set_partial_file(const char *filepath) = 0;
+    virtual void add_downloaded(off_t offset, size_t count) = 0;
 };
 
-extern "C" ISwitchFile *new_switch_file(IFile *source, bool local=false, const char* filepath=nullptr);
+// the member of a tar-wrapped `source` is saved in, and loaded from, the local
+// file `tar_index`, if not nullptr, so that its headers are read only once; a
+// gzip'd `source`, e.g. a tar.gz layer, is read lazily by the checkpoints saved
+// in `tar_index`.gzi, taken by decompressing it once at the first open;
+// `block_cache_size` is passed to zfile_open_ro() for the zfile, before and
+// after switching, and `refill_lookahead` only before, for a remote `source`
+extern "C" ISwitchFile *new_switch_file(IFile *source, bool local=false, const char* filepath=nullptr,
+                                        const char *tar_index=nullptr,
+                                        int64_t block_cache_size=-1,
+                                        int refill_lookahead=-1);
 
 } // namespace FileSystem
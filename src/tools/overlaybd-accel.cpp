@@ -0,0 +1,382 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "../bk_download.h"
+#include "../config.h"
+#include "../image_service.h"
+#include "../prefetch.h"
+#include "../overlaybd/alog.h"
+#include "../overlaybd/fs/localfs.h"
+#include "../overlaybd/fs/lsmt/file.h"
+#include "../overlaybd/fs/lsmt/index.h"
+#include "../overlaybd/fs/registryfs/registryfs.h"
+#include "../overlaybd/fs/zfile/zfile.h"
+#include "../overlaybd/net/curl.h"
+#include "../overlaybd/photon/syncio/fd-events.h"
+#include "../overlaybd/photon/thread.h"
+#include "../overlaybd/utility.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace LSMT;
+using namespace FileSystem;
+
+static void usage() {
+    static const char msg[] =
+        "overlaybd-accel [-v] <image config> <trace file> <output layer> [output config]\n"
+        "Builds an acceleration layer of an image from a trace recorded by `recordTracePath`.\n"
+        "The layer holds the data of the image read by the trace, each block once, in the\n"
+        "order it was first read, so that it is fetched by a few large sequential reads\n"
+        "instead of replaying the trace. The output config, if given, is the image config\n"
+        "with the layer on top of its lowers, as the acceleration layer.\n"
+        "options:\n"
+        "   -v print log detail.\n"
+        "example:\n"
+        "   ./overlaybd-accel ./config.v1.json ./trace ./accel.lsmt ./config.accel.json\n";
+
+    puts(msg);
+    exit(0);
+}
+
+// the sector of the mappings of LSMT
+static const uint64_t ALIGNMENT = 512;
+// reads of the image copied to the layer at a time
+static const size_t COPY_SIZE = 1024 * 1024;
+
+ImageConfigNS::ImageConfig conf;
+string conf_path, trace_path, out_path, out_conf_path, cred_path;
+unique_ptr<IFileSystem> lfs, registryfs;
+
+static void parse_args(int argc, char **argv) {
+    int ch;
+    bool log = false;
+    while ((ch = getopt(argc, argv, "v")) != -1) {
+        switch (ch) {
+            case 'v':
+                log = true;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (!log)
+        log_output = log_output_null;
+    if (argc - optind < 3 || argc - optind > 4)
+        usage();
+    conf_path = argv[optind++];
+    trace_path = argv[optind++];
+    out_path = argv[optind++];
+    if (optind < argc)
+        out_conf_path = argv[optind];
+}
+
+static std::pair<std::string, std::string> load_registry_auth(void *, const char *remote_path) {
+    std::string username, password;
+    if (load_cred_from_file(cred_path, std::string(remote_path), username, password) != 0)
+        fprintf(stderr, "registry credential of '%s' not found.\n", remote_path);
+    return std::make_pair(username, password);
+}
+
+static IFileSystem *new_registryfs() {
+    if (Net::cURL::init() < 0) {
+        fprintf(stderr, "Net cURL init failed.\n");
+        return nullptr;
+    }
+    auto cafile = "/etc/ssl/certs/ca-bundle.crt";
+    if (access(cafile, 0) != 0) {
+        cafile = "/etc/ssl/certs/ca-certificates.crt";
+        if (access(cafile, 0) != 0) {
+            fprintf(stderr, "no certificates found.\n");
+            return nullptr;
+        }
+    }
+    ImageConfigNS::GlobalConfig obd_conf;
+    if (!obd_conf.ParseJSON("/etc/overlaybd/overlaybd.json")) {
+        fprintf(stderr, "invalid overlaybd config file.\n");
+        return nullptr;
+    }
+    cred_path = obd_conf.credentialFilePath();
+    return new_registryfs_with_credential_callback({nullptr, &load_registry_auth}, cafile,
+                                                   30UL * 1000000);
+}
+
+// a lower layer is opened as the image would: a local file, a downloaded
+// blob, or the blob in the registry; any of which may be compressed as zfile
+static IFile *open_layer(ImageConfigNS::LayerConfig &layer) {
+    string path;
+    IFile *file = nullptr;
+    if (layer.file() != "") {
+        path = layer.file();
+        file = lfs->open(path.c_str(), O_RDONLY);
+    } else if (BKDL::check_downloaded(layer.dir())) {
+        path = layer.dir() + "/" + BKDL::COMMIT_FILE_NAME;
+        file = lfs->open(path.c_str(), O_RDONLY);
+    } else {
+        path = conf.repoBlobUrl();
+        if (path.empty()) {
+            fprintf(stderr, "empty repoBlobUrl for remote layer %s\n", layer.digest().c_str());
+            return nullptr;
+        }
+        if (path.back() != '/')
+            path += "/";
+        path += layer.digest();
+        if (!registryfs)
+            registryfs.reset(new_registryfs());
+        if (registryfs)
+            file = registryfs->open(path.c_str(), O_RDONLY);
+    }
+    if (!file) {
+        fprintf(stderr, "failed to open layer '%s', %d: %s\n", path.c_str(), errno,
+                strerror(errno));
+        return nullptr;
+    }
+    if (ZFile::is_zfile(file) == 1) {
+        auto zfile = ZFile::zfile_open_ro(file, false, true);
+        if (!zfile)
+            fprintf(stderr, "failed to open zfile '%s'\n", path.c_str());
+        return zfile;
+    }
+    return file;
+}
+
+// The trace records the reads of each layer at the offsets of its data, as
+// the prefetcher wraps the files of the layers; they are mapped back to the
+// ranges of the image by the mappings of the layer in the merged index.
+class TraceMapper {
+public:
+    TraceMapper(const IMemoryIndex *index, size_t nlayers) : m_layers(nlayers) {
+        for (auto &m : ptr_array(index->buffer(), index->size())) {
+            if (!m.zeroed && m.tag < nlayers)
+                m_layers[m.tag].push_back(m);
+        }
+        for (auto &layer : m_layers)
+            sort(layer.begin(), layer.end(), [](const SegmentMapping &a, const SegmentMapping &b) {
+                return a.moffset < b.moffset;
+            });
+    }
+
+    // the ranges of the image, in 512B sectors, read by `r`
+    void map(const TracedRead &r, vector<Segment> &out) const {
+        if (r.layer_index >= m_layers.size())
+            return;
+        auto &layer = m_layers[r.layer_index];
+        uint64_t begin = r.offset / ALIGNMENT;
+        uint64_t end = (r.offset + r.count + ALIGNMENT - 1) / ALIGNMENT;
+        // mappings may share their data, so those starting a whole mapping
+        // ahead are checked as well
+        uint64_t from = begin > Segment::MAX_LENGTH ? begin - Segment::MAX_LENGTH : 0;
+        auto it = lower_bound(layer.begin(), layer.end(), from,
+                              [](const SegmentMapping &m, uint64_t x) { return m.moffset < x; });
+        for (; it != layer.end() && it->moffset < end; ++it) {
+            uint64_t mbegin = max((uint64_t)it->moffset, begin);
+            uint64_t mend = min(it->mend(), end);
+            if (mbegin < mend)
+                out.push_back({it->offset + (mbegin - it->moffset), (uint32_t)(mend - mbegin)});
+        }
+    }
+
+private:
+    vector<vector<SegmentMapping>> m_layers;
+};
+
+// copy [offset, offset + length) of the image, in sectors, to the layer
+static int copy_range(IFileRO *image, IFileRW *out, uint64_t offset, uint64_t length) {
+    ALIGNED_MEM4K(buf, COPY_SIZE);
+    while (length > 0) {
+        auto step = min(length * ALIGNMENT, COPY_SIZE);
+        if (image->pread(buf, step, offset * ALIGNMENT) != (ssize_t)step) {
+            fprintf(stderr, "failed to read the image at %lu, %d: %s\n", offset * ALIGNMENT, errno,
+                    strerror(errno));
+            return -1;
+        }
+        if (out->pwrite(buf, step, offset * ALIGNMENT) != (ssize_t)step) {
+            fprintf(stderr, "failed to write the layer, %d: %s\n", errno, strerror(errno));
+            return -1;
+        }
+        offset += step / ALIGNMENT;
+        length -= step / ALIGNMENT;
+    }
+    return 0;
+}
+
+// copy the parts of `s` not in the layer yet, appended to its data in order
+static int copy_unwritten(IFileRO *image, IFileRW *out, Segment s, uint64_t &copied) {
+    const size_t N = 16;
+    SegmentMapping pm[N];
+    while (s.length > 0) {
+        auto n = out->index()->lookup(s, pm, N);
+        uint64_t offset = s.offset;
+        for (size_t i = 0; i < n; i++) {
+            if (pm[i].offset > offset) {
+                if (copy_range(image, out, offset, pm[i].offset - offset) < 0)
+                    return -1;
+                copied += pm[i].offset - offset;
+            }
+            offset = pm[i].end();
+        }
+        if (n < N) {
+            if (offset < s.end()) {
+                if (copy_range(image, out, offset, s.end() - offset) < 0)
+                    return -1;
+                copied += s.end() - offset;
+            }
+            break;
+        }
+        s.forward_offset_to(offset);
+    }
+    return 0;
+}
+
+// the image config with the layer on top of `lowers`, as its acceleration
+// layer holding data
+static int save_config(bool has_accel) {
+    auto &alloc = conf.GetAllocator();
+    auto &lowers = conf["lowers"];
+    if (has_accel)
+        lowers.PopBack();
+    rapidjson::Value accel(rapidjson::kObjectType);
+    accel.AddMember("file", rapidjson::Value(out_path.c_str(), alloc), alloc);
+    lowers.PushBack(accel, alloc);
+    for (auto name : {"accelerationLayer", "accelerationData"}) {
+        if (conf.HasMember(name))
+            conf[name].SetBool(true);
+        else
+            conf.AddMember(rapidjson::StringRef(name), true, alloc);
+    }
+    auto s = conf.DumpString();
+    auto file = fopen(out_conf_path.c_str(), "w");
+    if (!file) {
+        fprintf(stderr, "failed to create '%s', %d: %s\n", out_conf_path.c_str(), errno,
+                strerror(errno));
+        return -1;
+    }
+    auto n = fwrite(s.data(), 1, s.size(), file);
+    if (fclose(file) != 0 || n != s.size()) {
+        fprintf(stderr, "failed to write '%s'\n", out_conf_path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    photon::init();
+    DEFER(photon::fini());
+    photon::fd_events_init();
+    DEFER(photon::fd_events_fini());
+    if (!conf.ParseJSON(conf_path) || !conf.HasMember("lowers")) {
+        fprintf(stderr, "invalid image config '%s'\n", conf_path.c_str());
+        return -1;
+    }
+    auto lowers = conf.lowers();
+    // the trace was recorded without the acceleration layer, which is replaced
+    bool has_accel = conf.accelerationLayer() && !lowers.empty();
+    if (has_accel)
+        lowers.pop_back();
+    if (lowers.empty()) {
+        fprintf(stderr, "no lower layers to accelerate\n");
+        return -1;
+    }
+    vector<TracedRead> reads;
+    if (load_traced_reads(trace_path, &reads) < 0) {
+        fprintf(stderr, "failed to load trace '%s', %d: %s\n", trace_path.c_str(), errno,
+                strerror(errno));
+        return -1;
+    }
+
+    lfs.reset(new_localfs_adaptor(nullptr, ioengine_psync));
+    vector<IFile *> layers;
+    for (auto &layer : lowers) {
+        auto file = open_layer(layer);
+        if (!file) {
+            for (auto x : layers)
+                delete x;
+            return -1;
+        }
+        layers.push_back(file);
+    }
+    unique_ptr<IFileRO> image(open_files_ro(layers.data(), layers.size(), true));
+    if (!image) {
+        fprintf(stderr, "failed to open the image, %d: %s\n", errno, strerror(errno));
+        for (auto x : layers)
+            delete x;
+        return -1;
+    }
+    struct stat st;
+    if (image->fstat(&st) < 0) {
+        fprintf(stderr, "failed to stat the image, %d: %s\n", errno, strerror(errno));
+        return -1;
+    }
+
+    // the data is appended in the order written, and sealed with its index
+    // at the end; the index is kept aside meanwhile
+    auto index_path = out_path + ".index";
+    auto fdata = lfs->open(out_path.c_str(), O_RDWR | O_EXCL | O_CREAT,
+                           S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    auto findex = lfs->open(index_path.c_str(), O_RDWR | O_EXCL | O_CREAT, S_IRUSR | S_IWUSR);
+    if (!fdata || !findex) {
+        fprintf(stderr, "failed to create '%s' or '%s', %d: %s\n", out_path.c_str(),
+                index_path.c_str(), errno, strerror(errno));
+        delete fdata;
+        delete findex;
+        lfs->unlink(index_path.c_str());
+        return -1;
+    }
+    DEFER(lfs->unlink(index_path.c_str()));
+    LayerInfo args(fdata, findex);
+    args.virtual_size = st.st_size;
+    image->get_uuid(args.parent_uuid, layers.size() - 1);
+    unique_ptr<IFileRW> out(create_file_rw(args, true));
+    if (!out) {
+        fprintf(stderr, "failed to create the layer, %d: %s\n", errno, strerror(errno));
+        lfs->unlink(out_path.c_str());
+        return -1;
+    }
+
+    TraceMapper mapper(image->index(), layers.size());
+    vector<Segment> ranges;
+    uint64_t copied = 0;
+    for (auto &r : reads) {
+        ranges.clear();
+        mapper.map(r, ranges);
+        for (auto &s : ranges) {
+            if (copy_unwritten(image.get(), out.get(), s, copied) < 0) {
+                lfs->unlink(out_path.c_str());
+                return -1;
+            }
+        }
+    }
+    if (out->close_seal() < 0) {
+        fprintf(stderr, "failed to seal the layer, %d: %s\n", errno, strerror(errno));
+        lfs->unlink(out_path.c_str());
+        return -1;
+    }
+    if (!out_conf_path.empty() && save_config(has_accel) < 0)
+        return -1;
+    printf("%zu reads of the trace, %lu bytes copied to the acceleration layer SUCCESSFULLY\n",
+           reads.size(), copied * ALIGNMENT);
+    return 0;
+}
@@ -0,0 +1,67 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "../overlaybd/alog-audit.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+int usage() {
+    static const char msg[] = "overlaybd-audit is a tool to decode a binary audit ring.\n"
+                              "Usage: overlaybd-audit [options] <audit_ring_file>\n"
+                              "   -n <n> print the last n records only.\n"
+                              "example:\n"
+                              "   ./overlaybd-audit /var/log/overlaybd-audit.ring\n"
+                              "   ./overlaybd-audit -n 100 /var/log/overlaybd-audit.ring\n";
+    puts(msg);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    uint64_t last = UINT64_MAX;
+    while ((ch = getopt(argc, argv, "n:")) != -1) {
+        switch (ch) {
+            case 'n':
+                last = strtoull(optarg, nullptr, 10);
+                break;
+            default:
+                usage();
+                exit(-1);
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        exit(-1);
+    }
+    AuditRingReader ring;
+    if (ring.open(argv[optind]) < 0)
+        return -1;
+    ring.for_each(last, [&](const AuditRecord &r) {
+        char ts[32];
+        time_t sec = r.ts / 1000000;
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(ts, sizeof(ts), "%Y/%m/%d %H:%M:%S", &tm);
+        printf("%s.%06" PRIu64 "|AUDIT|%s|pathname=...%.*s|path_hash=%016" PRIx64
+               "|offset=%" PRIu64 "|size=%d|latency=%u|\n",
+               ts, r.ts % 1000000, ring.op_name(r.op), (int)strnlen(r.path, sizeof(r.path)),
+               r.path, r.path_hash, r.offset, r.size, r.latency);
+    });
+    return 0;
+}
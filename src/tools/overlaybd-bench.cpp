@@ -0,0 +1,411 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../image_file.h"
+#include "../image_service.h"
+#include "../overlaybd/alog.h"
+#include "../overlaybd/metrics.h"
+#include "../overlaybd/net/curl.h"
+#include "../overlaybd/photon/syncio/aio-wrapper.h"
+#include "../overlaybd/photon/syncio/fd-events.h"
+#include "../overlaybd/photon/thread.h"
+#include "../overlaybd/photon/thread11.h"
+#include "../overlaybd/trace.h"
+#include "../overlaybd/utility.h"
+
+int usage() {
+    static const char msg[] =
+        "overlaybd-bench is a tool to benchmark an image through the whole stack of overlaybd, "
+        "without TCMU.\n"
+        "Usage: overlaybd-bench [options] <image_config_json>\n"
+        "   -m <mode>   randread, randwrite, randrw, read or write, randread by default.\n"
+        "   -b <bytes>  block size, a multiple of 512, 4096 by default.\n"
+        "   -j <n>      # of vcpus, each opening the image on its own, 1 by default;\n"
+        "               more than 1 only for reads.\n"
+        "   -q <n>      queue depth of each vcpu, 1 by default.\n"
+        "   -t <sec>    run time, 10 by default.\n"
+        "   -s <bytes>  size of the range accessed from offset 0, the whole image by default.\n"
+        "   -w <pct>    percentage of writes of randrw, 50 by default.\n"
+        "   -r          replay the trace of the acceleration layer instead, for -t at most.\n"
+        "The registry is emulated with `registryEmulator` of the global config, if set.\n"
+        "example:\n"
+        "   ./overlaybd-bench -m randread -b 4096 -q 32 -t 30 /path/to/config.v1.json\n"
+        "   ./overlaybd-bench -r /path/to/config.v1.json\n";
+    puts(msg);
+    return 0;
+}
+
+static uint64_t clock_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// latencies in us, in log-linear buckets of 16 per power of 2, so that
+// percentiles are within about 6%
+struct LatencyHistogram {
+    static const int SUB = 16;
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(64 * SUB, 0);
+    uint64_t count = 0, sum = 0, max = 0;
+
+    static int index(uint64_t v) {
+        if (v < SUB)
+            return v;
+        int e = 63 - __builtin_clzll(v);
+        return (e - 3) * SUB + ((v >> (e - 4)) & (SUB - 1));
+    }
+    static uint64_t value(int i) {
+        if (i < SUB)
+            return i;
+        int e = i / SUB + 3;
+        return (1ULL << e) | ((uint64_t)(i % SUB) << (e - 4));
+    }
+    void add(uint64_t v) {
+        buckets[index(v)]++;
+        count++;
+        sum += v;
+        max = std::max(max, v);
+    }
+    void merge(const LatencyHistogram &x) {
+        for (size_t i = 0; i < buckets.size(); i++)
+            buckets[i] += x.buckets[i];
+        count += x.count;
+        sum += x.sum;
+        max = std::max(max, x.max);
+    }
+    uint64_t percentile(double p) const {
+        uint64_t n = 0, target = (uint64_t)(count * p / 100);
+        for (size_t i = 0; i < buckets.size(); i++) {
+            n += buckets[i];
+            if (n > target)
+                return std::min(value(i), max);
+        }
+        return max;
+    }
+};
+
+struct LayerStats {
+    uint64_t requests = 0, calls = 0, self = 0;
+    LatencyHistogram total;
+};
+
+struct Stats {
+    uint64_t ops = 0, bytes = 0, errors = 0;
+    LatencyHistogram latency;
+    // by the names of layers, in the order of their first entries
+    std::vector<std::pair<std::string, LayerStats>> layers;
+
+    LayerStats &layer(const char *name) {
+        for (auto &l : layers)
+            if (l.first == name)
+                return l.second;
+        layers.emplace_back(name, LayerStats());
+        return layers.back().second;
+    }
+    void merge(const Stats &x) {
+        ops += x.ops;
+        bytes += x.bytes;
+        errors += x.errors;
+        latency.merge(x.latency);
+        for (auto &l : x.layers) {
+            auto &y = layer(l.first.c_str());
+            y.requests += l.second.requests;
+            y.calls += l.second.calls;
+            y.self += l.second.self;
+            y.total.merge(l.second.total);
+        }
+    }
+};
+
+// the stats of the vcpu, fed by the traced requests
+static thread_local Stats *vcpu_stats = nullptr;
+
+static void on_request(const Trace::Request &req, uint64_t elapsed) {
+    if (!vcpu_stats)
+        return;
+    for (int i = 0; i < req.nlayers(); i++) {
+        auto &l = req.layer(i);
+        auto &s = vcpu_stats->layer(l.name);
+        s.requests++;
+        s.calls += l.calls;
+        s.self += l.self;
+        s.total.add(l.total);
+    }
+}
+
+enum class Mode { RANDREAD, RANDWRITE, RANDRW, READ, WRITE };
+
+static Mode mode = Mode::RANDREAD;
+static const char *mode_name = "randread";
+static size_t block_size = 4096;
+static int jobs = 1, depth = 1;
+static uint64_t runtime = 10;
+static uint64_t range = 0;
+static int write_percent = 50;
+static bool replay = false;
+static const char *config_path = nullptr;
+
+class Job {
+public:
+    Stats stats;
+    int ret = 0;
+
+    explicit Job(int id) : m_id(id) {
+    }
+
+    void run() {
+        photon::init();
+        DEFER(photon::fini());
+        photon::fd_events_init();
+        DEFER(photon::fd_events_fini());
+        photon::libaio_wrapper_init();
+        DEFER(photon::libaio_wrapper_fini());
+        Net::libcurl_init();
+        DEFER(Net::libcurl_fini());
+        vcpu_stats = &stats;
+        DEFER(vcpu_stats = nullptr);
+
+        auto imgservice = create_image_service(jobs > 1 ? m_id : -1);
+        if (!imgservice) {
+            fprintf(stderr, "failed to create image service\n");
+            ret = -1;
+            return;
+        }
+        DEFER(delete imgservice);
+        m_file = imgservice->create_image_file(config_path);
+        if (!m_file) {
+            fprintf(stderr, "failed to open image %s\n", config_path);
+            ret = -1;
+            return;
+        }
+        DEFER({
+            m_file->close();
+            delete m_file;
+        });
+        m_size = range ? std::min(range, (uint64_t)m_file->size) : m_file->size;
+        m_size = m_size / block_size * block_size;
+        if (replay) {
+            ret = wait_for_replay();
+            return;
+        }
+        if (m_size < block_size) {
+            fprintf(stderr, "the range to access is less than a block\n");
+            ret = -1;
+            return;
+        }
+        if (mode != Mode::RANDREAD && mode != Mode::READ && m_file->read_only) {
+            fprintf(stderr, "the image is read only\n");
+            ret = -1;
+            return;
+        }
+        m_deadline = clock_us() + runtime * 1000000;
+        std::vector<photon::join_handle *> workers;
+        for (int i = 0; i < depth; i++) {
+            auto th = photon::thread_create11(&Job::worker, this);
+            workers.push_back(photon::thread_enable_join(th));
+        }
+        for (auto jh : workers)
+            photon::thread_join(jh);
+    }
+
+protected:
+    int m_id;
+    ImageFile *m_file = nullptr;
+    uint64_t m_size = 0;
+    uint64_t m_deadline = 0;
+    uint64_t m_cursor = 0;
+
+    void worker() {
+        void *buf = nullptr;
+        if (posix_memalign(&buf, 4096, block_size) != 0)
+            return;
+        DEFER(free(buf));
+        memset(buf, m_id + 1, block_size);
+        uint64_t nblocks = m_size / block_size;
+        unsigned int seed = clock_us() ^ (uint64_t)photon::CURRENT;
+        while (clock_us() < m_deadline) {
+            off_t offset;
+            if (mode == Mode::READ || mode == Mode::WRITE) {
+                offset = m_cursor;
+                m_cursor = (m_cursor + block_size) % (nblocks * block_size);
+            } else {
+                offset = (rand_r(&seed) % nblocks) * block_size;
+            }
+            bool write = mode == Mode::WRITE || mode == Mode::RANDWRITE ||
+                         (mode == Mode::RANDRW && (int)(rand_r(&seed) % 100) < write_percent);
+            struct iovec iov = {buf, block_size};
+            auto start = clock_us();
+            ssize_t n;
+            {
+                Trace::Request req(write ? "write" : "read", offset, block_size);
+                n = write ? m_file->pwritev(&iov, 1, offset) : m_file->preadv(&iov, 1, offset);
+            }
+            stats.latency.add(clock_us() - start);
+            stats.ops++;
+            if (n == (ssize_t)block_size)
+                stats.bytes += block_size;
+            else
+                stats.errors++;
+        }
+    }
+
+    // the replay is started by opening the image, and is done once all
+    // the ranges queued are replayed or failed
+    int wait_for_replay() {
+        auto queued = Metrics::counter("overlaybd_prefetch_replay_ranges_total", "");
+        auto done = Metrics::counter("overlaybd_prefetch_replayed_ranges_total", "");
+        auto failed = Metrics::counter("overlaybd_prefetch_replay_failures_total", "");
+        auto bytes = Metrics::counter("overlaybd_prefetch_replayed_bytes_total", "");
+        if (!queued || queued->value() == 0) {
+            fprintf(stderr, "no trace of the acceleration layer to replay\n");
+            return -1;
+        }
+        auto deadline = clock_us() + runtime * 1000000;
+        while (done->value() + failed->value() < queued->value() && clock_us() < deadline)
+            photon::thread_usleep(10 * 1000);
+        stats.ops = done->value();
+        stats.errors = failed->value();
+        stats.bytes = bytes->value();
+        if (stats.ops + stats.errors < queued->value())
+            printf("replay not finished in %lus: %lu of %lu ranges\n", runtime,
+                   stats.ops + stats.errors, queued->value());
+        return 0;
+    }
+};
+
+static void report(const Stats &s, uint64_t elapsed) {
+    double sec = elapsed / 1e6;
+    if (replay) {
+        printf("replay: %lu ranges, %.1f MB in %.2fs (%.1f MB/s), %lu failed\n", s.ops,
+               s.bytes / 1e6, sec, s.bytes / 1e6 / sec, s.errors);
+    } else {
+        printf("%s bs=%zu jobs=%d depth=%d runtime=%.2fs\n", mode_name, block_size, jobs, depth,
+               sec);
+        printf("ops: %lu (%.1f/s), bytes: %.1f MB (%.1f MB/s), errors: %lu\n", s.ops,
+               s.ops / sec, s.bytes / 1e6, s.bytes / 1e6 / sec, s.errors);
+        auto &l = s.latency;
+        printf("latency(us): avg %lu, p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %lu\n",
+               l.count ? l.sum / l.count : 0, l.percentile(50), l.percentile(90),
+               l.percentile(99), l.percentile(99.9), l.max);
+    }
+    if (s.layers.empty())
+        return;
+    // a layer is entered by a part of the requests, maybe more than once by
+    // each, its total time including the layers below, and self not
+    printf("%-10s %10s %10s %10s %10s %10s %10s\n", "layer", "requests", "calls/req",
+           "avg_self", "avg_total", "p50_total", "p99_total");
+    for (auto &x : s.layers) {
+        auto &y = x.second;
+        printf("%-10s %10lu %10.2f %10lu %10lu %10lu %10lu\n", x.first.c_str(), y.requests,
+               (double)y.calls / y.requests, y.self / y.requests, y.total.sum / y.requests,
+               y.total.percentile(50), y.total.percentile(99));
+    }
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    while ((ch = getopt(argc, argv, "m:b:j:q:t:s:w:r")) != -1) {
+        switch (ch) {
+            case 'm': {
+                static const std::map<std::string, Mode> modes = {
+                    {"randread", Mode::RANDREAD}, {"randwrite", Mode::RANDWRITE},
+                    {"randrw", Mode::RANDRW},     {"read", Mode::READ},
+                    {"write", Mode::WRITE},
+                };
+                auto it = modes.find(optarg);
+                if (it == modes.end()) {
+                    usage();
+                    exit(-1);
+                }
+                mode = it->second;
+                mode_name = it->first.c_str();
+                break;
+            }
+            case 'b':
+                block_size = strtoull(optarg, nullptr, 10);
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'q':
+                depth = atoi(optarg);
+                break;
+            case 't':
+                runtime = strtoull(optarg, nullptr, 10);
+                break;
+            case 's':
+                range = strtoull(optarg, nullptr, 10);
+                break;
+            case 'w':
+                write_percent = atoi(optarg);
+                break;
+            case 'r':
+                replay = true;
+                break;
+            default:
+                usage();
+                exit(-1);
+        }
+    }
+    if (optind >= argc || block_size == 0 || block_size % 512 || jobs < 1 || depth < 1 ||
+        write_percent < 0 || write_percent > 100) {
+        usage();
+        exit(-1);
+    }
+    if (jobs > 1 && (replay || (mode != Mode::RANDREAD && mode != Mode::READ))) {
+        fprintf(stderr, "-j > 1 is only for reads\n");
+        exit(-1);
+    }
+    config_path = argv[optind];
+    log_output_level = ALOG_WARN;
+    // every request is traced, and none is logged as slow
+    Trace::set_threshold(UINT64_MAX);
+    Trace::set_sink(&on_request);
+
+    std::vector<Job *> js;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < jobs; i++)
+        js.push_back(new Job(i));
+    auto start = clock_us();
+    for (auto j : js)
+        threads.emplace_back(&Job::run, j);
+    for (auto &t : threads)
+        t.join();
+    auto elapsed = clock_us() - start;
+
+    Stats total;
+    int ret = 0;
+    for (auto j : js) {
+        ret |= j->ret;
+        total.merge(j->stats);
+        delete j;
+    }
+    if (ret < 0)
+        return -1;
+    report(total, replay ? elapsed : std::min(elapsed, runtime * 1000000));
+    return 0;
+}
@@ -0,0 +1,675 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "../config.h"
+#include "../prefetch.h"
+#include "../overlaybd/alog-audit.h"
+#include "../overlaybd/alog.h"
+#include "../overlaybd/fs/cache/cache.h"
+#include "../overlaybd/fs/cache/full_file_cache/cache_pool.h"
+#include "../overlaybd/fs/fiemap.h"
+#include "../overlaybd/fs/virtual-file.h"
+#include "../overlaybd/iovector.h"
+#include "../overlaybd/photon/thread.h"
+#include "../overlaybd/utility.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace FileSystem;
+
+static void usage() {
+    static const char msg[] =
+        "overlaybd-cachesim [options] -t <image config>:<trace file> | -r <audit ring> ...\n"
+        "Replays the reads of prefetch traces, or the downloads of binary audit rings, of\n"
+        "many devices against simulated registry caches, one for each combination of the\n"
+        "options, and reports the hit rate, the bytes read from the registry and written\n"
+        "to the cache media. The caches run the code of overlaybd on media keeping no data.\n"
+        "Traces are replayed first, in the order given, then the records of all the rings,\n"
+        "in the order of their timestamps.\n"
+        "options:\n"
+        "   -t <image config>:<trace file> a trace recorded by `recordTracePath`, of the\n"
+        "      image of the config, whose layers are named by their digests.\n"
+        "   -r <audit ring> an audit ring of `auditRingPath`, whose downloads are replayed,\n"
+        "      i.e. the misses of the cache it was recorded with.\n"
+        "   -c <GB,...> capacities of the cache, 4 by default.\n"
+        "   -u <KB,...> refill units, 256 by default.\n"
+        "   -e <policy,...> eviction policies, `lru` or `2q`, with `+units` to evict the cold\n"
+        "      refill units of open files first, `lru` by default.\n"
+        "   -a <hits,...> misses of a refill unit to admit it, 0 by default for all.\n"
+        "   -v print log detail.\n"
+        "example:\n"
+        "   ./overlaybd-cachesim -c 4,8,16 -e lru,2q+units -r ./node1.ring -r ./node2.ring\n";
+
+    puts(msg);
+    exit(0);
+}
+
+static const uint64_t kBlockSize = 4096;
+// the simulated media is as large as no cache would fill it
+static const uint64_t kMediaBlocks = 1ULL << 40;
+// the period of eviction, shorter than that of the service, as the reads are
+// replayed faster than they were recorded
+static const uint64_t kEvictionPeriodInUs = 1000;
+
+struct Blob {
+    string name;
+    uint64_t size;
+};
+
+// a read of `count` bytes at `offset` of blobs[blob]
+struct SimRead {
+    uint64_t ts;
+    uint32_t blob;
+    uint32_t count;
+    uint64_t offset;
+};
+
+vector<Blob> blobs;
+unordered_map<string, uint32_t> blob_index;
+vector<SimRead> trace_reads, ring_reads;
+
+struct Stats {
+    uint64_t src_reads = 0;
+    uint64_t src_bytes = 0;
+    uint64_t media_written = 0;
+    uint64_t media_blocks = 0;
+};
+
+// a file system with the methods unused by the cache failing with ENOSYS
+class NullFileSystem : public IFileSystem {
+public:
+    UNIMPLEMENTED_POINTER(IFile *open(const char *pathname, int flags) override);
+    UNIMPLEMENTED_POINTER(IFile *open(const char *pathname, int flags, mode_t mode) override);
+    UNIMPLEMENTED_POINTER(IFile *creat(const char *pathname, mode_t mode) override);
+    UNIMPLEMENTED(int mkdir(const char *pathname, mode_t mode) override);
+    UNIMPLEMENTED(int rmdir(const char *pathname) override);
+    UNIMPLEMENTED(int symlink(const char *oldname, const char *newname) override);
+    UNIMPLEMENTED(ssize_t readlink(const char *path, char *buf, size_t bufsiz) override);
+    UNIMPLEMENTED(int link(const char *oldname, const char *newname) override);
+    UNIMPLEMENTED(int rename(const char *oldname, const char *newname) override);
+    UNIMPLEMENTED(int unlink(const char *filename) override);
+    UNIMPLEMENTED(int chmod(const char *pathname, mode_t mode) override);
+    UNIMPLEMENTED(int chown(const char *pathname, uid_t owner, gid_t group) override);
+    UNIMPLEMENTED(int lchown(const char *pathname, uid_t owner, gid_t group) override);
+    UNIMPLEMENTED(int statfs(const char *path, struct statfs *buf) override);
+    UNIMPLEMENTED(int statvfs(const char *path, struct statvfs *buf) override);
+    UNIMPLEMENTED(int stat(const char *path, struct stat *buf) override);
+    UNIMPLEMENTED(int lstat(const char *path, struct stat *buf) override);
+    UNIMPLEMENTED(int access(const char *pathname, int mode) override);
+    UNIMPLEMENTED(int truncate(const char *path, off_t length) override);
+    UNIMPLEMENTED(int syncfs() override);
+    UNIMPLEMENTED_POINTER(DIR *opendir(const char *name) override);
+};
+
+class NullFile : public VirtualFile {
+public:
+    UNIMPLEMENTED(ssize_t pwrite(const void *buf, size_t count, off_t offset) override);
+    UNIMPLEMENTED(ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override);
+    UNIMPLEMENTED(int ftruncate(off_t length) override);
+    int close() override {
+        return 0;
+    }
+    int fsync() override {
+        return 0;
+    }
+    int fdatasync() override {
+        return 0;
+    }
+    UNIMPLEMENTED(int fchmod(mode_t mode) override);
+    UNIMPLEMENTED(int fchown(uid_t owner, gid_t group) override);
+};
+
+// a blob of the registry, whose reads are counted without delivering data
+class SourceFile : public NullFile {
+public:
+    SourceFile(IFileSystem *fs, uint64_t size, Stats *stats)
+        : m_fs(fs), m_size(size), m_stats(stats) {
+    }
+    IFileSystem *filesystem() override {
+        return m_fs;
+    }
+    ssize_t pread(void *buf, size_t count, off_t offset) override {
+        struct iovec iov { buf, count };
+        return preadv(&iov, 1, offset);
+    }
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        iovector_view view((struct iovec *)iov, iovcnt);
+        if ((uint64_t)offset >= m_size)
+            return 0;
+        auto ret = min((uint64_t)view.sum(), m_size - offset);
+        m_stats->src_reads++;
+        m_stats->src_bytes += ret;
+        return ret;
+    }
+    int fstat(struct stat *buf) override {
+        memset(buf, 0, sizeof(*buf));
+        buf->st_mode = S_IFREG | 0644;
+        buf->st_size = m_size;
+        return 0;
+    }
+
+private:
+    IFileSystem *m_fs;
+    uint64_t m_size;
+    Stats *m_stats;
+};
+
+class SourceFs : public NullFileSystem {
+public:
+    explicit SourceFs(Stats *stats) : m_stats(stats) {
+    }
+    IFile *open(const char *pathname, int flags) override {
+        auto it = blob_index.find(pathname);
+        if (it == blob_index.end())
+            LOG_ERROR_RETURN(ENOENT, nullptr, "no blob `", pathname);
+        return new SourceFile(this, blobs[it->second].size, m_stats);
+    }
+    IFile *open(const char *pathname, int flags, mode_t mode) override {
+        return open(pathname, flags);
+    }
+
+private:
+    Stats *m_stats;
+};
+
+// a file of the media, keeping which of its blocks are allocated, but no data
+struct MediaNode {
+    uint64_t size = 0;
+    uint64_t used = 0; // # of blocks allocated
+    vector<bool> blocks;
+
+    void set(uint64_t begin, uint64_t end, Stats *stats) {
+        if (blocks.size() < end)
+            blocks.resize(end);
+        for (auto i = begin; i < end; i++) {
+            if (!blocks[i]) {
+                blocks[i] = true;
+                used++;
+                stats->media_blocks++;
+            }
+        }
+    }
+    void clear(uint64_t begin, uint64_t end, Stats *stats) {
+        end = min(end, (uint64_t)blocks.size());
+        for (auto i = begin; i < end; i++) {
+            if (blocks[i]) {
+                blocks[i] = false;
+                used--;
+                stats->media_blocks--;
+            }
+        }
+    }
+    void truncate(uint64_t length, Stats *stats) {
+        clear((length + kBlockSize - 1) / kBlockSize, UINT64_MAX, stats);
+        size = length;
+    }
+};
+
+class MediaFile : public NullFile {
+public:
+    MediaFile(IFileSystem *fs, shared_ptr<MediaNode> node, Stats *stats)
+        : m_fs(fs), m_node(node), m_stats(stats) {
+    }
+    IFileSystem *filesystem() override {
+        return m_fs;
+    }
+    ssize_t pread(void *buf, size_t count, off_t offset) override {
+        struct iovec iov { buf, count };
+        return preadv(&iov, 1, offset);
+    }
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        iovector_view view((struct iovec *)iov, iovcnt);
+        if ((uint64_t)offset >= m_node->size)
+            return 0;
+        return min((uint64_t)view.sum(), m_node->size - offset);
+    }
+    ssize_t pwrite(const void *buf, size_t count, off_t offset) override {
+        struct iovec iov { (void *)buf, count };
+        return pwritev(&iov, 1, offset);
+    }
+    ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override {
+        iovector_view view((struct iovec *)iov, iovcnt);
+        uint64_t count = view.sum();
+        if (count == 0)
+            return 0;
+        m_node->set(offset / kBlockSize, (offset + count + kBlockSize - 1) / kBlockSize, m_stats);
+        m_node->size = max(m_node->size, offset + count);
+        m_stats->media_written += count;
+        return count;
+    }
+    int ftruncate(off_t length) override {
+        m_node->truncate(length, m_stats);
+        return 0;
+    }
+    // only punching holes, as the cache does
+    int fallocate(int mode, off_t offset, off_t len) override {
+        m_node->clear((offset + kBlockSize - 1) / kBlockSize, (offset + len) / kBlockSize,
+                      m_stats);
+        return 0;
+    }
+    int fiemap(struct fiemap *map) override {
+        auto &blocks = m_node->blocks;
+        uint64_t i = map->fm_start / kBlockSize;
+        uint64_t length = min((uint64_t)map->fm_length, m_node->size);
+        uint64_t end = min((uint64_t)blocks.size(),
+                           (map->fm_start + length + kBlockSize - 1) / kBlockSize);
+        map->fm_mapped_extents = 0;
+        fiemap_extent *last = nullptr;
+        while (i < end && map->fm_mapped_extents < map->fm_extent_count) {
+            if (!blocks[i]) {
+                i++;
+                continue;
+            }
+            auto j = i;
+            while (j < end && blocks[j])
+                j++;
+            last = &map->fm_extents[map->fm_mapped_extents++];
+            memset(last, 0, sizeof(*last));
+            last->fe_logical = last->fe_physical = i * kBlockSize;
+            last->fe_length = (j - i) * kBlockSize;
+            i = j;
+        }
+        if (last && find(blocks.begin() + i, blocks.end(), true) == blocks.end())
+            last->fe_flags = FIEMAP_EXTENT_LAST;
+        return 0;
+    }
+    int fstat(struct stat *buf) override {
+        return stat_node(*m_node, buf);
+    }
+
+    static int stat_node(const MediaNode &node, struct stat *buf) {
+        memset(buf, 0, sizeof(*buf));
+        buf->st_mode = S_IFREG | 0644;
+        buf->st_size = node.size;
+        buf->st_blksize = kBlockSize;
+        buf->st_blocks = node.used * (kBlockSize / 512);
+        return 0;
+    }
+
+private:
+    IFileSystem *m_fs;
+    shared_ptr<MediaNode> m_node;
+    Stats *m_stats;
+};
+
+class EmptyDir : public DIR {
+public:
+    int closedir() override {
+        return 0;
+    }
+    struct dirent *get() override {
+        return nullptr;
+    }
+    int next() override {
+        return 0;
+    }
+    void rewinddir() override {
+    }
+    void seekdir(long loc) override {
+    }
+    long telldir() override {
+        return 0;
+    }
+};
+
+// the media of the cache, with the files created by it only, so its
+// traversal at startup finds nothing
+class MediaFs : public NullFileSystem {
+public:
+    explicit MediaFs(Stats *stats) : m_stats(stats) {
+    }
+    IFile *open(const char *pathname, int flags) override {
+        return open(pathname, flags, 0644);
+    }
+    IFile *open(const char *pathname, int flags, mode_t mode) override {
+        auto it = m_files.find(pathname);
+        if (it == m_files.end()) {
+            if (!(flags & O_CREAT)) {
+                errno = ENOENT;
+                return nullptr;
+            }
+            it = m_files.emplace(pathname, make_shared<MediaNode>()).first;
+        } else if (flags & O_TRUNC) {
+            it->second->truncate(0, m_stats);
+        }
+        return new MediaFile(this, it->second, m_stats);
+    }
+    int mkdir(const char *pathname, mode_t mode) override {
+        return 0;
+    }
+    int rename(const char *oldname, const char *newname) override {
+        auto it = m_files.find(oldname);
+        if (it == m_files.end()) {
+            errno = ENOENT;
+            return -1;
+        }
+        auto node = it->second;
+        m_files.erase(it);
+        unlink(newname);
+        m_files[newname] = node;
+        return 0;
+    }
+    int unlink(const char *filename) override {
+        auto it = m_files.find(filename);
+        if (it == m_files.end()) {
+            errno = ENOENT;
+            return -1;
+        }
+        // the blocks are freed once the file is closed as well
+        if (it->second.use_count() == 1)
+            it->second->truncate(0, m_stats);
+        m_files.erase(it);
+        return 0;
+    }
+    int statvfs(const char *path, struct statvfs *buf) override {
+        memset(buf, 0, sizeof(*buf));
+        buf->f_bsize = buf->f_frsize = kBlockSize;
+        buf->f_blocks = kMediaBlocks;
+        buf->f_bfree = buf->f_bavail = kMediaBlocks - m_stats->media_blocks;
+        return 0;
+    }
+    int stat(const char *path, struct stat *buf) override {
+        auto it = m_files.find(path);
+        if (it == m_files.end()) {
+            errno = ENOENT;
+            return -1;
+        }
+        return MediaFile::stat_node(*it->second, buf);
+    }
+    int lstat(const char *path, struct stat *buf) override {
+        return stat(path, buf);
+    }
+    int truncate(const char *path, off_t length) override {
+        auto it = m_files.find(path);
+        if (it == m_files.end()) {
+            errno = ENOENT;
+            return -1;
+        }
+        it->second->truncate(length, m_stats);
+        return 0;
+    }
+    DIR *opendir(const char *name) override {
+        return new EmptyDir;
+    }
+
+private:
+    Stats *m_stats;
+    map<string, shared_ptr<MediaNode>> m_files;
+};
+
+static uint32_t add_blob(const string &name, uint64_t size) {
+    auto it = blob_index.find(name);
+    if (it != blob_index.end()) {
+        auto &blob = blobs[it->second];
+        blob.size = max(blob.size, size);
+        return it->second;
+    }
+    blobs.push_back({name, size});
+    blob_index.emplace(name, blobs.size() - 1);
+    return blobs.size() - 1;
+}
+
+static void add_read(vector<SimRead> &reads, uint64_t ts, uint32_t blob, uint64_t offset,
+                     uint64_t count) {
+    if (count == 0)
+        return;
+    auto &b = blobs[blob];
+    b.size = max(b.size, offset + count);
+    reads.push_back({ts, blob, (uint32_t)count, offset});
+}
+
+// the layers of the trace are named by their digests, so that those of the
+// images sharing them are cached once; local layers are not cached
+static int load_trace(const string &arg) {
+    auto pos = arg.find(':');
+    if (pos == string::npos) {
+        fprintf(stderr, "invalid trace '%s', not <image config>:<trace file>\n", arg.c_str());
+        return -1;
+    }
+    auto conf_path = arg.substr(0, pos), trace_path = arg.substr(pos + 1);
+    ImageConfigNS::ImageConfig conf;
+    if (!conf.ParseJSON(conf_path) || !conf.HasMember("lowers")) {
+        fprintf(stderr, "invalid image config '%s'\n", conf_path.c_str());
+        return -1;
+    }
+    auto lowers = conf.lowers();
+    // traces are recorded without the acceleration layer
+    if (conf.accelerationLayer() && !lowers.empty())
+        lowers.pop_back();
+    vector<TracedRead> reads;
+    if (load_traced_reads(trace_path, &reads) < 0) {
+        fprintf(stderr, "failed to load trace '%s', %d: %s\n", trace_path.c_str(), errno,
+                strerror(errno));
+        return -1;
+    }
+    vector<int64_t> layers;
+    for (auto &layer : lowers) {
+        if (layer.file() != "" || layer.digest() == "")
+            layers.push_back(-1);
+        else
+            layers.push_back(add_blob("/" + layer.digest(), layer.size()));
+    }
+    for (auto &r : reads) {
+        if (r.layer_index < layers.size() && layers[r.layer_index] >= 0)
+            add_read(trace_reads, 0, layers[r.layer_index], r.offset, r.count);
+    }
+    return 0;
+}
+
+// the blobs of the rings are named by the hashes of their full paths, which
+// are the same on any node
+static int load_ring(const char *fn) {
+    AuditRingReader ring;
+    if (ring.open(fn) < 0)
+        return -1;
+    ring.for_each(UINT64_MAX, [&](const AuditRecord &r) {
+        if (strcmp(ring.op_name(r.op), "download") != 0 || r.size <= 0)
+            return;
+        char name[32];
+        snprintf(name, sizeof(name), "/%016" PRIx64, r.path_hash);
+        add_read(ring_reads, r.ts, add_blob(name, 0), r.offset, r.size);
+    });
+    return 0;
+}
+
+static vector<string> split_list(const char *arg) {
+    vector<string> ret;
+    string s(arg);
+    size_t pos = 0;
+    while (pos <= s.size()) {
+        auto end = s.find(',', pos);
+        if (end == string::npos)
+            end = s.size();
+        if (end > pos)
+            ret.push_back(s.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return ret;
+}
+
+static vector<uint64_t> parse_numbers(const char *arg) {
+    vector<uint64_t> ret;
+    for (auto &x : split_list(arg))
+        ret.push_back(strtoull(x.c_str(), nullptr, 10));
+    return ret;
+}
+
+struct SimConfig {
+    uint64_t capacity_gb;
+    uint64_t refill_kb;
+    string policy;
+    uint32_t admit_hits;
+};
+
+struct SimResult {
+    uint64_t reads = 0;
+    uint64_t hits = 0;
+    uint64_t src_bytes = 0;
+    uint64_t media_written = 0;
+};
+
+static int simulate(const SimConfig &sc, const vector<SimRead> &reads, SimResult *result) {
+    auto policy = sc.policy;
+    bool evict_units = false;
+    auto pos = policy.find("+units");
+    if (pos != string::npos) {
+        policy.erase(pos);
+        evict_units = true;
+    }
+    // updated till the cache is destroyed, saving its manifest
+    Stats stats;
+    unique_ptr<IFileSystem> src(new SourceFs(&stats));
+    // owned by the cached fs, with its pool
+    auto media = new MediaFs(&stats);
+    IOAlloc alloc;
+    unique_ptr<ICachedFileSystem> cached(new_full_file_cached_fs(
+        src.get(), media, sc.refill_kb << 10, sc.capacity_gb, kEvictionPeriodInUs, 0, &alloc, 0,
+        2, policy.c_str(), evict_units, false, false, 0, sc.admit_hits));
+    if (!cached) {
+        fprintf(stderr, "failed to create the cache, %d: %s\n", errno, strerror(errno));
+        return -1;
+    }
+    auto pool = dynamic_cast<Cache::FileCachePool *>(cached->get_pool());
+
+    // the blobs stay open, as the layers of running devices do
+    vector<unique_ptr<IFile>> files(blobs.size());
+    vector<char> buf;
+    for (auto &r : reads) {
+        auto &file = files[r.blob];
+        if (!file) {
+            file.reset(cached->open(blobs[r.blob].name.c_str(), O_RDONLY));
+            if (!file) {
+                fprintf(stderr, "failed to open %s, %d: %s\n", blobs[r.blob].name.c_str(),
+                        errno, strerror(errno));
+                return -1;
+            }
+        }
+        if (buf.size() < r.count)
+            buf.resize(r.count);
+        auto before = stats.src_bytes;
+        if (file->pread(buf.data(), r.count, r.offset) < 0) {
+            fprintf(stderr, "failed to read %s at %" PRIu64 ", %d: %s\n",
+                    blobs[r.blob].name.c_str(), r.offset, errno, strerror(errno));
+            return -1;
+        }
+        result->reads++;
+        if (stats.src_bytes == before)
+            result->hits++;
+        // eviction runs in the background, and is assumed to keep up with
+        // the reads, which would be refused by the full cache otherwise
+        photon::thread_yield();
+        while (pool && pool->isFull())
+            photon::thread_usleep(Cache::FileCachePool::kDeleteDelayInUs);
+    }
+    result->src_bytes = stats.src_bytes;
+    result->media_written = stats.media_written;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    bool log = false;
+    vector<uint64_t> capacities{4}, refill_units{256};
+    vector<string> policies{"lru"};
+    vector<uint64_t> admissions{0};
+    vector<string> traces, rings;
+    while ((ch = getopt(argc, argv, "t:r:c:u:e:a:v")) != -1) {
+        switch (ch) {
+            case 't':
+                traces.push_back(optarg);
+                break;
+            case 'r':
+                rings.push_back(optarg);
+                break;
+            case 'c':
+                capacities = parse_numbers(optarg);
+                break;
+            case 'u':
+                refill_units = parse_numbers(optarg);
+                break;
+            case 'e':
+                policies = split_list(optarg);
+                break;
+            case 'a':
+                admissions = parse_numbers(optarg);
+                break;
+            case 'v':
+                log = true;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (!log)
+        log_output = log_output_null;
+    if (traces.empty() && rings.empty())
+        usage();
+    photon::init();
+    DEFER(photon::fini());
+
+    for (auto &t : traces) {
+        if (load_trace(t) < 0)
+            return -1;
+    }
+    for (auto &r : rings) {
+        if (load_ring(r.c_str()) < 0)
+            return -1;
+    }
+    stable_sort(ring_reads.begin(), ring_reads.end(),
+                [](const SimRead &a, const SimRead &b) { return a.ts < b.ts; });
+    auto reads = move(trace_reads);
+    reads.insert(reads.end(), ring_reads.begin(), ring_reads.end());
+    if (reads.empty()) {
+        fprintf(stderr, "no reads to replay\n");
+        return -1;
+    }
+    uint64_t total = 0;
+    for (auto &b : blobs)
+        total += b.size;
+    printf("%zu reads of %zu blobs of %" PRIu64 " MB in total\n", reads.size(), blobs.size(),
+           total >> 20);
+
+    printf("%8s %9s %10s %6s %10s %8s %14s %14s\n", "cacheGB", "refillKB", "policy", "admit",
+           "reads", "hit%", "registryMB", "writtenMB");
+    for (auto c : capacities)
+        for (auto u : refill_units)
+            for (auto &p : policies)
+                for (auto a : admissions) {
+                    SimConfig sc{c, u, p, (uint32_t)a};
+                    SimResult result;
+                    if (simulate(sc, reads, &result) < 0)
+                        return -1;
+                    printf("%8" PRIu64 " %9" PRIu64 " %10s %6u %10" PRIu64 " %8.2f %14" PRIu64
+                           " %14" PRIu64 "\n",
+                           c, u, p.c_str(), sc.admit_hits, result.reads,
+                           100.0 * result.hits / result.reads, result.src_bytes >> 20,
+                           result.media_written >> 20);
+                }
+    return 0;
+}
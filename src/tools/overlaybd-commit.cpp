@@ -13,14 +13,21 @@
    See the License for the specific language governing permissions and
    limitations under the License.
 */
+#include "../image_service.h"
 #include "../overlaybd/alog.h"
 #include "../overlaybd/fs/localfs.h"
 #include "../overlaybd/fs/lsmt/file.h"
+#include "../overlaybd/fs/registryfs/registryfs.h"
+#include "../overlaybd/fs/zfile/zfile.h"
+#include "../overlaybd/net/curl.h"
+#include "../overlaybd/photon/syncio/fd-events.h"
+#include "../overlaybd/photon/thread.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <memory>
 #include <string>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -33,13 +40,32 @@ using namespace FileSystem;
 
 static void usage() {
     static const char msg[] =
-        "overlaybd-commit [-v|-m msg | -p parent_uuid]  <data file> <index file> [output file]\n"
+        "overlaybd-commit [-v|-m msg | -p parent_uuid | -j n | -z | -a algorithm | -H | -2 | -e]  <data file> "
+        "<index file> [output file]\n"
+        "overlaybd-commit [options above] -u <upload url> <data file> <index file>\n"
+        "overlaybd-commit [-v] -i <output file> <layer file>...\n"
         "options:\n"
         "   -v print log detail.\n"
         "   -m <msg>    add some custom message if needed.\n"
         "   -p <parent-uuid> parent uuid.\n"
+        "   -j <n> copy the data with n reads in flight, 1 by default.\n"
+        "   -z compress the output as zfile, instead of compressing it afterwards.\n"
+        "   -a <algorithm> compression algorithm of -z, lz4 (default) or zstd.\n"
+        "   -H compress on a hardware accelerator if built with one, or in software.\n"
+        "   -2 save the index in the v2 format, whose segments are up to 512MB long, so that\n"
+        "      large files are mapped by fewer segments; older versions can't open the output.\n"
+        "   -e save the index encoded in 1/4 of the size or less, implying -2.\n"
+        "   -u <upload url> upload the output as a blob to the blob uploads url of a repository,\n"
+        "                   as it is committed, and print its digest. The credential is read\n"
+        "                   from `credentialFilePath` of /etc/overlaybd/overlaybd.json.\n"
+        "   -i <output file> save the merged index of the layers, from the lowest to the top,\n"
+        "                    to be loaded as `mergedIndex` of the image config.\n"
         "example:\n"
-        "   ./overlaybd-commit -m commitMsg ./file.data ./file.index ./file.lsmt\n";
+        "   ./overlaybd-commit -m commitMsg ./file.data ./file.index ./file.lsmt\n"
+        "   ./overlaybd-commit -j 16 -z ./file.data ./file.index ./file.lsmtz\n"
+        "   ./overlaybd-commit -z -u https://registry.example.com/v2/foo/blobs/uploads/ "
+        "./file.data ./file.index\n"
+        "   ./overlaybd-commit -i ./merged.index ./layer0.lsmt ./layer1.lsmt\n";
 
     puts(msg);
     exit(0);
@@ -58,12 +84,33 @@ IFileRW *fin;
 IFile *fout;
 string commit_msg;
 string parent_uuid;
+string merged_index;
+string upload_url, cred_path;
+vector<IFile *> layers;
+int concurrency = 1;
+bool compress = false;
+bool hw_offload = false;
+ZFile::CompressOptions compress_opt;
+
+// the layers may be compressed as zfile
+static IFile *open_layer(IFileSystem *fs, const char *fn) {
+    auto file = open(fs, fn, O_RDONLY);
+    if (ZFile::is_zfile(file) == 1) {
+        auto zfile = ZFile::zfile_open_ro(file, false, true);
+        if (!zfile) {
+            fprintf(stderr, "failed to open zfile '%s'\n", fn);
+            exit(-1);
+        }
+        return zfile;
+    }
+    return file;
+}
 
 static void parse_args(int argc, char **argv) {
     int shift = 1;
     int ch;
     bool log = false;
-    while ((ch = getopt(argc, argv, "vm:p:")) != -1) {
+    while ((ch = getopt(argc, argv, "vm:p:i:j:za:Hu:2e")) != -1) {
         switch (ch) {
             case 'v':
                 log = true;
@@ -81,18 +128,75 @@ static void parse_args(int argc, char **argv) {
                 parent_uuid = string(optarg);
                 shift += 2;
                 break;
+            case 'i':
+                merged_index = optarg;
+                shift += 2;
+                break;
+            case 'j':
+                concurrency = atoi(optarg);
+                if (concurrency < 1)
+                    usage();
+                shift += 2;
+                break;
+            case 'z':
+                compress = true;
+                shift++;
+                break;
+            case 'a':
+                if (strcmp(optarg, "lz4") == 0) {
+                    compress_opt.type = ZFile::CompressOptions::LZ4;
+                } else if (strcmp(optarg, "zstd") == 0) {
+                    compress_opt.type = ZFile::CompressOptions::ZSTD;
+                } else {
+                    usage();
+                }
+                shift += 2;
+                break;
+            case 'H':
+                hw_offload = true;
+                shift++;
+                break;
+            case 'u':
+                upload_url = optarg;
+                shift += 2;
+                break;
+            case '2':
+                LSMT::set_index_v2(true);
+                shift++;
+                break;
+            case 'e':
+                LSMT::set_index_encoding(true);
+                shift++;
+                break;
             default:
                 usage();
                 exit(-1);
         }
     }
-    if (argc - shift < 1 || argc - shift > 3)
-        return usage();
-
     if (!log)
         log_output = log_output_null;
-    unique_ptr<IFileSystem> lfs(new_localfs_adaptor());
+    // the reads in flight are issued by photon threads, without blocking each other
+    unique_ptr<IFileSystem> lfs(
+        new_localfs_adaptor(nullptr, concurrency > 1 ? ioengine_posixaio : ioengine_psync));
+    if (!merged_index.empty()) {
+        if (argc - shift < 1)
+            return usage();
+        for (; shift < argc; shift++)
+            layers.push_back(open_layer(lfs.get(), argv[shift]));
+        fout = open(lfs.get(), merged_index.c_str(), O_RDWR | O_EXCL | O_CREAT,
+                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        return;
+    }
+    if (argc - shift < 1 || argc - shift > 3 || (!upload_url.empty() && argc - shift != 2))
+        return usage();
+
     auto fdata = open(lfs.get(), argv[shift], O_RDONLY);
+    if (ZFile::is_zfile_append(fdata) == 1)
+        fdata = ZFile::zfile_open_append(fdata, false, nullptr, true);
+    if (!fdata) {
+        fprintf(stderr, "failed to load compressed data of '%s'\n", argv[shift]);
+        exit(-1);
+    }
     shift++;
     auto findex = open(lfs.get(), argv[shift], O_RDONLY);
     shift++;
@@ -104,14 +208,93 @@ static void parse_args(int argc, char **argv) {
         exit(-1);
     }
 
-    fout = (argc - shift == 0) ? new_localfile_adaptor(1) : // stdout
-               open(lfs.get(), argv[argc - 1], O_RDWR | O_EXCL | O_CREAT,
-                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    // the upload is created after photon is initialized
+    if (upload_url.empty())
+        fout = (argc - shift == 0) ? new_localfile_adaptor(1) : // stdout
+                   open(lfs.get(), argv[argc - 1], O_RDWR | O_EXCL | O_CREAT,
+                        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+}
+
+static std::pair<std::string, std::string> load_registry_auth(void *, const char *remote_path) {
+    std::string username, password;
+    if (load_cred_from_file(cred_path, std::string(remote_path), username, password) != 0)
+        fprintf(stderr, "registry credential of '%s' not found.\n", remote_path);
+    return std::make_pair(username, password);
+}
+
+static IFileSystem *new_registryfs() {
+    if (Net::cURL::init() < 0) {
+        fprintf(stderr, "Net cURL init failed.\n");
+        return nullptr;
+    }
+    auto cafile = "/etc/ssl/certs/ca-bundle.crt";
+    if (access(cafile, 0) != 0) {
+        cafile = "/etc/ssl/certs/ca-certificates.crt";
+        if (access(cafile, 0) != 0) {
+            fprintf(stderr, "no certificates found.\n");
+            return nullptr;
+        }
+    }
+    ImageConfigNS::GlobalConfig obd_conf;
+    if (!obd_conf.ParseJSON("/etc/overlaybd/overlaybd.json")) {
+        fprintf(stderr, "invalid overlaybd config file.\n");
+        return nullptr;
+    }
+    cred_path = obd_conf.credentialFilePath();
+    return new_registryfs_with_credential_callback({nullptr, &load_registry_auth}, cafile,
+                                                   30UL * 1000000);
+}
+
+static int save_merged_index() {
+    unique_ptr<IFileRO> file(open_files_ro(layers.data(), layers.size(), true));
+    if (!file) {
+        fprintf(stderr, "failed to open the layers, possibly wrong file format!\n");
+        return -1;
+    }
+    auto ret = save_merged_index(file.get(), fout);
+    delete fout;
+    if (ret < 0) {
+        fprintf(stderr, "failed to save merged index, %d: %s\n", errno, strerror(errno));
+        return ret;
+    }
+    printf("merged index of %zu layers saved SUCCESSFULLY\n", layers.size());
+    return 0;
 }
 
 int main(int argc, char **argv) {
     parse_args(argc, argv);
-    CommitArgs args(fout);
+    // the indexes of the layers are loaded, and the data is copied, by photon threads
+    photon::init();
+    DEFER(photon::fini());
+    photon::fd_events_init();
+    DEFER(photon::fd_events_fini());
+    if (!merged_index.empty())
+        return save_merged_index();
+    // the output is uploaded in chunks as it is written, compressed on the fly
+    // with -z, so that it is not staged in a local file
+    unique_ptr<IFileSystem> registryfs;
+    if (!upload_url.empty()) {
+        registryfs.reset(new_registryfs());
+        if (registryfs)
+            fout = registryfs->creat(upload_url.c_str(), 0);
+        if (!fout) {
+            fprintf(stderr, "failed to start upload to '%s'\n", upload_url.c_str());
+            return -1;
+        }
+    }
+    compress_opt.verify = 1;
+    ZFile::CompressArgs compress_args(compress_opt);
+    compress_args.hw_offload = hw_offload;
+    IFile *zout = nullptr;
+    if (compress) {
+        zout = ZFile::zfile_writer(fout, &compress_args);
+        if (!zout) {
+            fprintf(stderr, "failed to create zfile writer, %d: %s\n", errno, strerror(errno));
+            return -1;
+        }
+    }
+    CommitArgs args(compress ? zout : fout);
+    args.concurrency = concurrency;
     if (parent_uuid.empty() == false) {
         memcpy(args.parent_uuid.data, parent_uuid.c_str(), parent_uuid.length());
     }
@@ -123,6 +306,23 @@ int main(int argc, char **argv) {
     if (ret < 0) {
         fprintf(stderr, "failed to perform commit(), %d: %s\n", errno, strerror(errno));
     }
+    if (zout) {
+        if (ret == 0 && zout->close() < 0) {
+            fprintf(stderr, "failed to complete zfile, %d: %s\n", errno, strerror(errno));
+            ret = -1;
+        }
+        delete zout;
+    }
+    if (ret == 0 && !upload_url.empty()) {
+        if (fout->close() < 0) {
+            fprintf(stderr, "failed to complete upload, %d: %s\n", errno, strerror(errno));
+            ret = -1;
+        } else {
+            printf("uploaded blob %s of %jd bytes\n",
+                   static_cast<RegistryUploadFile *>(fout)->digest().c_str(),
+                   (intmax_t)fout->lseek(0, SEEK_END));
+        }
+    }
     delete fout;
     delete fin;
     printf("lsmt_commit has committed files SUCCESSFULLY\n");
@@ -25,6 +25,7 @@
 #include <fcntl.h>
 #include "../overlaybd/fs/lsmt/file.h"
 #include "../overlaybd/fs/localfs.h"
+#include "../overlaybd/fs/zfile/zfile.h"
 #include "../overlaybd/alog.h"
 #include "../overlaybd/uuid.h"
 
@@ -34,10 +35,15 @@ using namespace FileSystem;
 static void usage() {
     static const char msg[] =
         "overlaybd-create [options] <data file> <index file> <virtual size in GB>\n"
+        "overlaybd-create -c <source data file> <source index file> <data file> <index file>\n"
         "options:\n"
         "   -u <parent_UUID>\n"
+        "   -c clone the writable layer of the source files, by reflinks if supported,\n"
+        "      which must not be written meanwhile\n"
+        "   -z compress the data written to the layer by LZ4, in units of up to 64KB\n"
         "example:\n"
-        "   ./overlaybd-create ./file.data ./file.index 100\n";
+        "   ./overlaybd-create ./file.data ./file.index 100\n"
+        "   ./overlaybd-create -c ./file.data ./file.index ./clone.data ./clone.index\n";
 
     puts(msg);
     exit(0);
@@ -55,31 +61,56 @@ IFile *open(IFileSystem *fs, const char *fn, int flags, mode_t mode = 0) {
 uint64_t vsize;
 int level = 255;
 unique_ptr<IFile> fdata, findex;
+unique_ptr<IFile> src_data, src_index;
 string parent_uuid;
+bool clone_rw = false;
+bool compress_data = false;
 static void parse_args(int argc, char **argv) {
     int shift = 1;
     int ch;
-    while ((ch = getopt(argc, argv, "u:")) != -1) {
+    while ((ch = getopt(argc, argv, "u:cz")) != -1) {
         switch (ch) {
             case 'u':
                 parent_uuid = optarg;
                 shift += 2;
                 break;
+            case 'c':
+                clone_rw = true;
+                shift += 1;
+                break;
+            case 'z':
+                compress_data = true;
+                shift += 1;
+                break;
             default:
                 usage();
                 exit(-1);
         }
     }
-    if (argc - shift < 2)
+    if (argc - shift < (clone_rw ? 4 : 2))
         return usage();
 
     const auto flag = O_RDWR | O_EXCL | O_CREAT;
     const auto mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
     unique_ptr<IFileSystem> lfs(new_localfs_adaptor());
+    if (clone_rw) {
+        src_data.reset(open(lfs.get(), argv[shift++], O_RDONLY));
+        src_index.reset(open(lfs.get(), argv[shift++], O_RDONLY));
+    }
     auto fdata = open(lfs.get(), argv[shift++], flag, mode);
+    if (compress_data && !clone_rw) {
+        fdata = ZFile::zfile_open_append(fdata, true, nullptr, true);
+        if (!fdata) {
+            fprintf(stderr, "failed to create compressed data file, %d: %s\n", errno,
+                    strerror(errno));
+            exit(-1);
+        }
+    }
     auto findex = open(lfs.get(), argv[shift++], flag, mode);
     ::findex.reset(findex);
     ::fdata.reset(fdata);
+    if (clone_rw)
+        return;
 
     int ret = sscanf(argv[shift++], "%lu", &vsize);
     if (ret != 1) {
@@ -94,6 +125,14 @@ static void parse_args(int argc, char **argv) {
 int main(int argc, char **argv) {
     log_output = log_output_null;
     parse_args(argc, argv);
+    if (clone_rw) {
+        if (LSMT::clone_file_rw(src_data.get(), src_index.get(), fdata.get(), findex.get()) < 0) {
+            fprintf(stderr, "failed to clone lsmt files, %d: %s\n", errno, strerror(errno));
+            exit(-1);
+        }
+        printf("lsmt_create has cloned files SUCCESSFULLY\n");
+        return 0;
+    }
     LSMT::LayerInfo args(fdata.get(), findex.get());
     args.parent_uuid.parse(parent_uuid.c_str(), parent_uuid.size());
     args.virtual_size = vsize;
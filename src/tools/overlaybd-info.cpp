@@ -17,7 +17,10 @@
 #include <stdio.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <algorithm>
 #include <memory>
+#include <string>
+#include <vector>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -33,6 +36,8 @@
 #include "../overlaybd/photon/thread.h"
 #include "../overlaybd/photon/syncio/fd-events.h"
 #include "../image_service.h"
+#include "../merkle_file.h"
+#include "../heatmap.h"
 
 using namespace std;
 using namespace LSMT;
@@ -157,13 +162,28 @@ struct HeaderTrailer {
 static void usage() {
     static const char msg[] =
         "overlaybd-info [options] <data file> [index file]\n"
+        "overlaybd-info -l [-v] <layer file>...\n"
+        "overlaybd-info -H <heatmap file>\n"
         "options:\n"
         "   -u only show UUID.\n"
         "   -r <registry_blob_url> read blob from registry.\n"
+        "   -s show the space of the layer: live and garbage data, data segments by length,\n"
+        "      and zeroed (discarded) segments.\n"
+        "   -l show the space of each of the sealed layers stacked, the lowest first, where\n"
+        "      the data hidden by upper layers is garbage too.\n"
+        "   -M <tree file> save the merkle tree of the layer file, as it is in the registry, and\n"
+        "      print its root, to be set as `merkleTree` and `merkleRoot` of the layer config.\n"
+        "   -H show the reads of each layer counted in the heatmap file saved by overlaybd-tcmu\n"
+        "      as `heatmapPath` of the image config, at startup and after, with the hottest\n"
+        "      1MB regions of the data of the layer.\n"
         "   -v show log detail.\n"
         "example:\n"
         "   ./overlaybd-info -u ./file.data ./file.index\n"
-        "   ./overlaybd-info -u -r https://docker.io/v2/overlaybd/imgxxx/blobs/sha256:xxxxx\n";
+        "   ./overlaybd-info -u -r https://docker.io/v2/overlaybd/imgxxx/blobs/sha256:xxxxx\n"
+        "   ./overlaybd-info -s ./file.data ./file.index\n"
+        "   ./overlaybd-info -l ./layer0.lsmt ./layer1.lsmt ./layer2.lsmt\n"
+        "   ./overlaybd-info -M ./layer0.merkle ./layer0.lsmtz\n"
+        "   ./overlaybd-info -H /var/lib/overlaybd/heatmap\n";
 
     puts(msg);
     exit(0);
@@ -179,26 +199,44 @@ IFile *open(IFileSystem *fs, const char *fn, int flags, mode_t mode = 0) {
 }
 
 IFile *findex, *fdata;
+vector<string> layer_paths;
 int action = 0;
 bool is_remote = false;
-string url, cred_path;
+bool show_space = false, stacked = false;
+string url, cred_path, merkle_tree, heatmap;
 IFileSystem *registryfs, *localfs;
 
 static void parse_args(int &argc, char **argv) {
     int shift = 1;
     int ch;
     bool log = false;
-    while ((ch = getopt(argc, argv, "vur:a:s:")) != -1) {
+    while ((ch = getopt(argc, argv, "vur:slM:H:")) != -1) {
         switch (ch) {
             case 'u':
                 action = 1;
                 shift += 1;
                 break;
+            case 's':
+                show_space = true;
+                shift += 1;
+                break;
+            case 'l':
+                stacked = true;
+                shift += 1;
+                break;
             case 'r':
                 is_remote = true;
                 url = optarg;
                 shift += 2;
                 break;
+            case 'M':
+                merkle_tree = optarg;
+                shift += 2;
+                break;
+            case 'H':
+                heatmap = optarg;
+                shift += 2;
+                break;
             case 'v':
                 log = true;
                 log_output_level = 0;
@@ -214,6 +252,17 @@ static void parse_args(int &argc, char **argv) {
         log_output = log_output_null;
     }
     argc -= shift;
+    if (!heatmap.empty()) {
+        if (argc != 0)
+            return usage();
+        return;
+    }
+    if (stacked) {
+        if (argc < 1 || is_remote)
+            return usage();
+        layer_paths.assign(argv + shift, argv + shift + argc);
+        return;
+    }
     if (!is_remote) {
         if (argc != 1 && argc != 2)
             return usage();
@@ -239,8 +288,148 @@ std::pair<std::string, std::string> reload_registry_auth(void *, const char *rem
     return std::make_pair("", "");
 }
 
+static string size_str(uint64_t size) {
+    char buf[32];
+    if (size >= (1UL << 20) && size % (1UL << 20) == 0)
+        snprintf(buf, sizeof(buf), "%luM", size >> 20);
+    else if (size >= 1024 && size % 1024 == 0)
+        snprintf(buf, sizeof(buf), "%luK", size >> 10);
+    else
+        snprintf(buf, sizeof(buf), "%luB", size);
+    return buf;
+}
+
+static void print_space(const IFileRO::SpaceStat &st) {
+    auto pct = [&](uint64_t x) { return st.data_size ? 100.0 * x / st.data_size : 0.0; };
+    printf("Data Size: %lu\n", st.data_size);
+    printf("Live Size: %lu (%.1f%%)\n", st.live_size, pct(st.live_size));
+    printf("Garbage Size: %lu (%.1f%%)\n", st.garbage_size, pct(st.garbage_size));
+    printf("Data Segments: %lu, in %lu fragments\n", st.segments, st.fragments);
+    for (int i = 0; i < IFileRO::SpaceStat::HISTOGRAM_SIZE; i++) {
+        if (st.histogram[i] == 0)
+            continue;
+        auto begin = size_str(512UL << i);
+        auto end = i + 1 < IFileRO::SpaceStat::HISTOGRAM_SIZE ? size_str(512UL << (i + 1)) : "";
+        printf("  [%s, %s): %lu\n", begin.c_str(), end.c_str(), st.histogram[i]);
+    }
+    printf("Zeroed Segments: %lu, of %lu bytes\n", st.zeroed_segments, st.zeroed_size);
+}
+
+// the space of each layer as seen through the whole stack, the lowest first
+static int print_stacked_space() {
+    auto lfs = new_localfs_adaptor();
+    vector<IFile *> files;
+    for (auto &path : layer_paths) {
+        IFile *file = open(lfs, path.c_str(), O_RDONLY);
+        if (ZFile::is_zfile(file) == 1) {
+            auto zfile = ZFile::zfile_open_ro(file, false, true);
+            if (!zfile) {
+                fprintf(stderr, "failed to open zfile '%s'\n", path.c_str());
+                exit(-1);
+            }
+            file = zfile;
+        }
+        files.push_back(file);
+    }
+    auto n = files.size();
+    unique_ptr<IFileRO> lower(open_files_ro(files.data(), n, true));
+    if (!lower) {
+        fprintf(stderr, "failed to open the layers as a stack\n");
+        exit(-1);
+    }
+    vector<IFileRO::SpaceStat> stats(n);
+    if (lower->space_stat(stats.data(), n) < 0) {
+        fprintf(stderr, "failed to get the space of the layers, %d: %s\n", errno, strerror(errno));
+        exit(-1);
+    }
+    uint64_t mapped = 0;
+    for (size_t i = 0; i < n; i++) {
+        // the top layer is the 0-th in the stack
+        auto &st = stats[n - 1 - i];
+        UUID uuid;
+        lower->get_uuid(uuid, n - 1 - i);
+        char uuid_str[UUID::String::LEN];
+        uuid.to_string(uuid_str, sizeof(uuid_str));
+        printf("Layer: %s\n", layer_paths[i].c_str());
+        printf("UUID: %s\n", uuid_str);
+        print_space(st);
+        mapped += st.live_size + st.zeroed_size;
+    }
+    auto vsize = (uint64_t)lower->lseek(0, SEEK_END);
+    printf("Virtual Size: %lu\n", vsize);
+    printf("Unmapped Size: %lu\n", vsize > mapped ? vsize - mapped : 0);
+    return 0;
+}
+
+// the hottest buckets of a layer in a phase, with the share of its reads
+static void print_hot_regions(const Heatmap::LayerHeat &l, int phase) {
+    static const size_t TOP = 8;
+    auto &buckets = l.buckets[phase];
+    vector<uint64_t> idx;
+    for (uint64_t i = 0; i < buckets.size(); i++)
+        if (buckets[i])
+            idx.push_back(i);
+    auto n = min(TOP, idx.size());
+    partial_sort(idx.begin(), idx.begin() + n, idx.end(),
+                 [&](uint64_t a, uint64_t b) { return buckets[a] > buckets[b]; });
+    uint64_t sum = 0;
+    for (auto i : idx)
+        sum += buckets[i];
+    for (size_t k = 0; k < n; k++) {
+        auto i = idx[k];
+        printf("    [%s, %s): %u (%.1f%%)\n", size_str(i * Heatmap::BUCKET_SIZE).c_str(),
+               size_str((i + 1) * Heatmap::BUCKET_SIZE).c_str(), buckets[i],
+               100.0 * buckets[i] / sum);
+    }
+    if (idx.size() > n)
+        printf("    ... %lu more regions read\n", idx.size() - n);
+}
+
+static int print_heatmap() {
+    vector<Heatmap::LayerHeat> layers;
+    uint64_t uptime, startup;
+    if (Heatmap::load_heatmap(heatmap, &layers, &uptime, &startup) < 0) {
+        fprintf(stderr, "failed to load heatmap '%s', %d: %s\n", heatmap.c_str(), errno,
+                strerror(errno));
+        return -1;
+    }
+    uint64_t total[Heatmap::PHASES] = {};
+    for (auto &l : layers)
+        for (int p = 0; p < Heatmap::PHASES; p++)
+            total[p] += l.bytes[p];
+    printf("Counted For: %lu s, the first %lu s as startup\n", uptime / 1000000,
+           startup / 1000000);
+    static const char *phases[] = {"Startup", "Steady"};
+    for (size_t i = 0; i < layers.size(); i++) {
+        auto &l = layers[i];
+        printf("Layer %lu: %s\n", i, l.name.c_str());
+        for (int p = 0; p < Heatmap::PHASES; p++) {
+            printf("  %s Reads: %lu, of %lu bytes (%.1f%%)\n", phases[p], l.reads[p], l.bytes[p],
+                   total[p] ? 100.0 * l.bytes[p] / total[p] : 0.0);
+            print_hot_regions(l, p);
+        }
+    }
+    return 0;
+}
+
+static int save_merkle_tree() {
+    unique_ptr<IFileSystem> lfs(new_localfs_adaptor());
+    unique_ptr<IFile> tree(open(lfs.get(), merkle_tree.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644));
+    auto root = Merkle::build_tree(fdata, tree.get());
+    if (root.empty() || tree->fdatasync() < 0) {
+        fprintf(stderr, "failed to save merkle tree, %d: %s\n", errno, strerror(errno));
+        return -1;
+    }
+    printf("%s\n", root.c_str());
+    return 0;
+}
+
 int main(int argc, char **argv) {
     parse_args(argc, argv);
+    if (!heatmap.empty())
+        return print_heatmap();
+    if (stacked)
+        return print_stacked_space();
     if (is_remote) {
         auto ret = photon::init();
         if (ret < 0) {
@@ -295,12 +484,16 @@ int main(int argc, char **argv) {
         fdata = f;
     }
 
+    if (!merkle_tree.empty())
+        return save_merkle_tree();
+
     LSMT::IFile *fp = nullptr;
     LSMT::IFile *file = nullptr;
+    IFileRO *lsmt = nullptr;
     HeaderTrailer *pht = nullptr;
     ALIGNED_MEM(buf, HeaderTrailer::SPACE, 4096);
     if (argc == 2) {
-        file = open_file_rw(fdata, findex, false);
+        file = lsmt = open_file_rw(fdata, findex, false);
         auto ret = fdata->pread(buf, HeaderTrailer::SPACE, 0);
         if (ret != HeaderTrailer::SPACE) {
             delete file;
@@ -322,7 +515,7 @@ int main(int argc, char **argv) {
         }
         auto ht = (HeaderTrailer *)buf;
         if (ht->is_sealed()) {
-            file = open_file_ro(fp);
+            file = lsmt = open_file_ro(fp);
             ret = fp->pread(buf, HeaderTrailer::SPACE, 0);
             if (ret != HeaderTrailer::SPACE) {
                 delete file;
@@ -374,6 +567,17 @@ int main(int argc, char **argv) {
         printf("Data Size: %ld\n", fdata->lseek(0, SEEK_END));
         printf("Index Size: %ld\n", findex->lseek(0, SEEK_END));
     }
+    if (show_space) {
+        IFileRO::SpaceStat st;
+        if (!lsmt) {
+            fprintf(stderr, "no index to show the space of the file with\n");
+        } else if (lsmt->space_stat(&st, 1) < 0) {
+            fprintf(stderr, "failed to get the space of the file, %d: %s\n", errno,
+                    strerror(errno));
+        } else {
+            print_space(st);
+        }
+    }
 
     delete file;
     return 0;
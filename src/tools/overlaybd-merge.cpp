@@ -0,0 +1,276 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "../bk_download.h"
+#include "../config.h"
+#include "../image_service.h"
+#include "../overlaybd/alog.h"
+#include "../overlaybd/fs/localfs.h"
+#include "../overlaybd/fs/lsmt/file.h"
+#include "../overlaybd/fs/registryfs/registryfs.h"
+#include "../overlaybd/fs/zfile/zfile.h"
+#include "../overlaybd/net/curl.h"
+#include "../overlaybd/photon/syncio/fd-events.h"
+#include "../overlaybd/photon/thread.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace LSMT;
+using namespace FileSystem;
+
+static void usage() {
+    static const char msg[] =
+        "overlaybd-merge [-v | -j n | -a algorithm | -n] <image config> <output layer> "
+        "[output config]\n"
+        "Merges the lower layers of an image, except its acceleration layer, into one layer\n"
+        "of their live data, compressed as zfile. The output config, if given, is the image\n"
+        "config with the merged layer as its lowers, followed by the acceleration layer.\n"
+        "options:\n"
+        "   -v print log detail.\n"
+        "   -j <n> copy the data with n reads in flight, 1 by default.\n"
+        "   -a <algorithm> compression algorithm, lz4 (default) or zstd.\n"
+        "   -n output the layer without compression.\n"
+        "example:\n"
+        "   ./overlaybd-merge -j 16 ./config.v1.json ./merged.lsmtz ./config.merged.json\n";
+
+    puts(msg);
+    exit(0);
+}
+
+ImageConfigNS::ImageConfig conf;
+string conf_path, out_path, out_conf_path, cred_path;
+int concurrency = 1;
+bool compress = true;
+ZFile::CompressOptions compress_opt;
+unique_ptr<IFileSystem> lfs, registryfs;
+
+static void parse_args(int argc, char **argv) {
+    int ch;
+    bool log = false;
+    while ((ch = getopt(argc, argv, "vj:a:n")) != -1) {
+        switch (ch) {
+            case 'v':
+                log = true;
+                break;
+            case 'j':
+                concurrency = atoi(optarg);
+                if (concurrency < 1)
+                    usage();
+                break;
+            case 'a':
+                if (strcmp(optarg, "lz4") == 0) {
+                    compress_opt.type = ZFile::CompressOptions::LZ4;
+                } else if (strcmp(optarg, "zstd") == 0) {
+                    compress_opt.type = ZFile::CompressOptions::ZSTD;
+                } else {
+                    usage();
+                }
+                break;
+            case 'n':
+                compress = false;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (!log)
+        log_output = log_output_null;
+    if (argc - optind < 2 || argc - optind > 3)
+        usage();
+    conf_path = argv[optind++];
+    out_path = argv[optind++];
+    if (optind < argc)
+        out_conf_path = argv[optind];
+}
+
+static std::pair<std::string, std::string> load_registry_auth(void *, const char *remote_path) {
+    std::string username, password;
+    if (load_cred_from_file(cred_path, std::string(remote_path), username, password) != 0)
+        fprintf(stderr, "registry credential of '%s' not found.\n", remote_path);
+    return std::make_pair(username, password);
+}
+
+static IFileSystem *new_registryfs() {
+    if (Net::cURL::init() < 0) {
+        fprintf(stderr, "Net cURL init failed.\n");
+        return nullptr;
+    }
+    auto cafile = "/etc/ssl/certs/ca-bundle.crt";
+    if (access(cafile, 0) != 0) {
+        cafile = "/etc/ssl/certs/ca-certificates.crt";
+        if (access(cafile, 0) != 0) {
+            fprintf(stderr, "no certificates found.\n");
+            return nullptr;
+        }
+    }
+    ImageConfigNS::GlobalConfig obd_conf;
+    if (!obd_conf.ParseJSON("/etc/overlaybd/overlaybd.json")) {
+        fprintf(stderr, "invalid overlaybd config file.\n");
+        return nullptr;
+    }
+    cred_path = obd_conf.credentialFilePath();
+    return new_registryfs_with_credential_callback({nullptr, &load_registry_auth}, cafile,
+                                                   30UL * 1000000);
+}
+
+// a lower layer is opened as the image would: a local file, a downloaded
+// blob, or the blob in the registry; any of which may be compressed as zfile
+static IFile *open_layer(ImageConfigNS::LayerConfig &layer) {
+    string path;
+    IFile *file = nullptr;
+    if (layer.file() != "") {
+        path = layer.file();
+        file = lfs->open(path.c_str(), O_RDONLY);
+    } else if (BKDL::check_downloaded(layer.dir())) {
+        path = layer.dir() + "/" + BKDL::COMMIT_FILE_NAME;
+        file = lfs->open(path.c_str(), O_RDONLY);
+    } else {
+        path = conf.repoBlobUrl();
+        if (path.empty()) {
+            fprintf(stderr, "empty repoBlobUrl for remote layer %s\n", layer.digest().c_str());
+            return nullptr;
+        }
+        if (path.back() != '/')
+            path += "/";
+        path += layer.digest();
+        if (!registryfs)
+            registryfs.reset(new_registryfs());
+        if (registryfs)
+            file = registryfs->open(path.c_str(), O_RDONLY);
+    }
+    if (!file) {
+        fprintf(stderr, "failed to open layer '%s', %d: %s\n", path.c_str(), errno,
+                strerror(errno));
+        return nullptr;
+    }
+    if (ZFile::is_zfile(file) == 1) {
+        auto zfile = ZFile::zfile_open_ro(file, false, true);
+        if (!zfile)
+            fprintf(stderr, "failed to open zfile '%s'\n", path.c_str());
+        return zfile;
+    }
+    return file;
+}
+
+// the image config with `lowers` replaced by the merged layer, followed by
+// the acceleration layer if any; the merged index of the old lowers is dropped
+static int save_config(bool has_accel) {
+    auto &alloc = conf.GetAllocator();
+    rapidjson::Value lowers(rapidjson::kArrayType);
+    rapidjson::Value merged(rapidjson::kObjectType);
+    merged.AddMember("file", rapidjson::Value(out_path.c_str(), alloc), alloc);
+    lowers.PushBack(merged, alloc);
+    if (has_accel) {
+        auto &old = conf["lowers"];
+        rapidjson::Value accel;
+        accel.CopyFrom(old[old.Size() - 1], alloc);
+        lowers.PushBack(accel, alloc);
+    }
+    conf["lowers"].Swap(lowers);
+    conf.RemoveMember("mergedIndex");
+    auto s = conf.DumpString();
+    auto file = fopen(out_conf_path.c_str(), "w");
+    if (!file) {
+        fprintf(stderr, "failed to create '%s', %d: %s\n", out_conf_path.c_str(), errno,
+                strerror(errno));
+        return -1;
+    }
+    auto n = fwrite(s.data(), 1, s.size(), file);
+    if (fclose(file) != 0 || n != s.size()) {
+        fprintf(stderr, "failed to write '%s'\n", out_conf_path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    photon::init();
+    DEFER(photon::fini());
+    photon::fd_events_init();
+    DEFER(photon::fd_events_fini());
+    if (!conf.ParseJSON(conf_path) || !conf.HasMember("lowers")) {
+        fprintf(stderr, "invalid image config '%s'\n", conf_path.c_str());
+        return -1;
+    }
+    auto lowers = conf.lowers();
+    // the acceleration layer holds a trace to replay, not data to merge
+    bool has_accel = conf.accelerationLayer() && !lowers.empty();
+    if (has_accel)
+        lowers.pop_back();
+    if (lowers.empty()) {
+        fprintf(stderr, "no lower layers to merge\n");
+        return -1;
+    }
+
+    // the reads in flight are issued by photon threads, without blocking each other
+    lfs.reset(new_localfs_adaptor(nullptr, concurrency > 1 ? ioengine_posixaio : ioengine_psync));
+    vector<IFile *> layers;
+    DEFER({
+        for (auto x : layers)
+            delete x;
+    });
+    for (auto &layer : lowers) {
+        auto file = open_layer(layer);
+        if (!file)
+            return -1;
+        layers.push_back(file);
+    }
+
+    unique_ptr<IFile> fout(lfs->open(out_path.c_str(), O_RDWR | O_EXCL | O_CREAT,
+                                     S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+    if (!fout) {
+        fprintf(stderr, "failed to create '%s', %d: %s\n", out_path.c_str(), errno,
+                strerror(errno));
+        return -1;
+    }
+    compress_opt.verify = 1;
+    ZFile::CompressArgs compress_args(compress_opt);
+    unique_ptr<IFile> zout;
+    if (compress) {
+        zout.reset(ZFile::zfile_writer(fout.get(), &compress_args));
+        if (!zout) {
+            fprintf(stderr, "failed to create zfile writer, %d: %s\n", errno, strerror(errno));
+            lfs->unlink(out_path.c_str());
+            return -1;
+        }
+    }
+    CommitArgs args(compress ? zout.get() : fout.get());
+    args.concurrency = concurrency;
+    auto ret = merge_files_ro(layers.data(), layers.size(), args);
+    if (ret == 0 && zout && zout->close() < 0) {
+        fprintf(stderr, "failed to complete zfile, %d: %s\n", errno, strerror(errno));
+        ret = -1;
+    }
+    if (ret < 0) {
+        fprintf(stderr, "failed to merge layers, %d: %s\n", errno, strerror(errno));
+        lfs->unlink(out_path.c_str());
+        return -1;
+    }
+    if (!out_conf_path.empty() && save_config(has_accel) < 0)
+        return -1;
+    printf("%zu layers merged SUCCESSFULLY\n", layers.size());
+    return 0;
+}
@@ -23,12 +23,14 @@
 #include "../overlaybd/uuid.h"
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <memory>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 using namespace std;
@@ -42,17 +44,38 @@ int usage() {
                               "   -f force compress. unlink exist <dst_file>.\n"
                               "   -x extract zfile.\n"
                               "   -t wrapper with tar.\n"
+                              "   -p <n> compress with n threads, 1 by default. With -x, decompress with n threads\n"
+                              "      into <dst_file> opened with O_DIRECT, verifying the checksums.\n"
+                              "   -a <algorithm> compression algorithm, lz4 (default) or zstd.\n"
+                              "   -l <level> compression level, 0 for the algorithm's default.\n"
+                              "   -D <n> train a dictionary of n KB from sampled blocks and store it in the zfile.\n"
+                              "   -F <n> compress blocks in linked frames of n KB for a better ratio,\n"
+                              "      a read decodes its frame from the beginning. 0 (default) for independent blocks.\n"
+                              "   -R store blocks that don't shrink by compression as is.\n"
+                              "   -H compress on a hardware accelerator if built with one, or in software.\n"
                               "example:\n"
                               "- create\n"
                               "   ./overlaybd-zfile ./layer0.lsmt ./layer0.lsmtz\n"
+                              "   ./overlaybd-zfile -p 8 ./layer0.lsmt ./layer0.lsmtz\n"
+                              "   ./overlaybd-zfile -a zstd -l 3 ./layer0.lsmt ./layer0.lsmtz\n"
+                              "   ./overlaybd-zfile -a zstd -D 64 ./layer0.lsmt ./layer0.lsmtz\n"
+                              "   ./overlaybd-zfile -a zstd -F 64 ./layer0.lsmt ./layer0.lsmtz\n"
+                              "   ./overlaybd-zfile -H -p 8 -a zstd ./layer0.lsmt ./layer0.lsmtz\n"
                               "- extract\n"
-                              "   ./overlaybd-zfile -x ./layer0.lsmtz ./layer0.lsmt\n";
+                              "   ./overlaybd-zfile -x ./layer0.lsmtz ./layer0.lsmt\n"
+                              "   ./overlaybd-zfile -x -p 8 ./layer0.lsmtz ./layer0.lsmt\n";
     puts(msg);
     return 0;
 }
 
 FileSystem::IFileSystem *lfs = nullptr;
 
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 int main(int argc, char **argv) {
     log_output_level = 1;
     int ch;
@@ -60,9 +83,12 @@ int main(int argc, char **argv) {
     int parse_idx = 1;
     bool rm_old = false;
     bool tar = false;
+    int workers = 1;
+    bool hw_offload = false;
+    size_t dict_kb = 0;
     CompressOptions opt;
     opt.verify = 1;
-    while ((ch = getopt(argc, argv, "tfxd:")) != -1) {
+    while ((ch = getopt(argc, argv, "tfxRHd:p:a:l:D:F:")) != -1) {
         switch (ch) {
             case 'd':
                 printf("set log output level: %d\n", log_output_level);
@@ -81,6 +107,45 @@ int main(int argc, char **argv) {
                 parse_idx++;
                 tar = true;
                 break;
+            case 'R':
+                parse_idx++;
+                opt.raw_blocks = 1;
+                break;
+            case 'H':
+                parse_idx++;
+                hw_offload = true;
+                break;
+            case 'p':
+                parse_idx += 2;
+                workers = atoi(optarg);
+                if (workers < 1) {
+                    usage();
+                    exit(-1);
+                }
+                break;
+            case 'a':
+                parse_idx += 2;
+                if (strcmp(optarg, "lz4") == 0) {
+                    opt.type = CompressOptions::LZ4;
+                } else if (strcmp(optarg, "zstd") == 0) {
+                    opt.type = CompressOptions::ZSTD;
+                } else {
+                    usage();
+                    exit(-1);
+                }
+                break;
+            case 'l':
+                parse_idx += 2;
+                opt.level = atoi(optarg);
+                break;
+            case 'D':
+                parse_idx += 2;
+                dict_kb = atoi(optarg);
+                break;
+            case 'F':
+                parse_idx += 2;
+                opt.frame_size = atoi(optarg) << 10;
+                break;
             default:
                 usage();
                 exit(-1);
@@ -98,6 +163,8 @@ int main(int argc, char **argv) {
 
     int ret = 0;
     CompressArgs args(opt);
+    args.workers = workers;
+    args.hw_offload = hw_offload;
     if (op == 0) {
         printf("compress file %s as %s\n", fn_src, fn_dst);
         IFile *infile = lfs->open(fn_src, O_RDONLY);
@@ -106,6 +173,11 @@ int main(int argc, char **argv) {
         }
         DEFER(delete infile);
 
+        if (dict_kb > 0 && zfile_train_dict(infile, &args, dict_kb << 10) != 0) {
+            LOG_ERROR_RETURN(0, -1, "train dictionary fail. (err: `, msg: `)", errno,
+                             strerror(errno));
+        }
+
         IFile *outfile = fs->open(fn_dst, O_RDWR | O_CREAT | O_EXCL, 0644);
         if (outfile == nullptr) {
             LOG_ERROR_RETURN(0, -1, "open dst file error.");
@@ -127,16 +199,38 @@ int main(int argc, char **argv) {
         }
         DEFER(delete infile);
 
-        IFile *outfile = lfs->open(fn_dst, O_WRONLY | O_CREAT | O_EXCL, S_IRWXU);
+        // the parallel mode writes around the page cache, if the fs allows
+        int flags = O_WRONLY | O_CREAT | O_EXCL;
+        IFile *outfile = nullptr;
+        if (workers > 1) {
+            outfile = lfs->open(fn_dst, flags | O_DIRECT, S_IRWXU);
+            if (outfile == nullptr && errno == EINVAL)
+                LOG_WARN("O_DIRECT is not supported for `, write through the page cache", fn_dst);
+        }
+        if (outfile == nullptr)
+            outfile = lfs->open(fn_dst, flags, S_IRWXU);
         if (outfile == nullptr) {
             LOG_ERROR_RETURN(0, -1, "open dst file error.");
         }
         DEFER(delete outfile);
 
-        ret = zfile_decompress(infile, outfile);
+        auto start = now_sec();
+        ssize_t raw_size = 0;
+        if (workers > 1) {
+            raw_size = zfile_decompress_parallel(infile, outfile, workers);
+            ret = raw_size < 0 ? -1 : 0;
+        } else {
+            ret = zfile_decompress(infile, outfile);
+            struct stat st;
+            if (ret == 0 && outfile->fstat(&st) == 0)
+                raw_size = st.st_size;
+        }
         if (ret != 0) {
             LOG_ERROR_RETURN(0, -1, "decompress fail. (err: `, msg: `)", errno, strerror(errno));
         }
+        auto elapsed = now_sec() - start;
+        printf("decompressed %zd bytes in %.3f s, %.1f MB/s\n", raw_size, elapsed,
+               elapsed > 0 ? raw_size / elapsed / (1 << 20) : 0.0);
         LOG_INFO("decompress file done.");
         return ret;
     }